@@ -0,0 +1,76 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLASYNCSTATE_H__
+#define __ATLASYNCSTATE_H__
+
+#pragma once
+
+// The handshake CIsapiExtension uses to keep the I/O completion of an
+// ATLSRV_INIT_USEASYNC_EX request from running beside the handler that
+// started the I/O.  It only relies on LONG, BOOL, ATLASSERT and the
+// Interlocked functions, which the including file must provide, so that
+// it can be exercised outside of a Windows build.
+//
+// The dispatching thread calls AtlAsyncHandlerStart before it runs the
+// handler and AtlAsyncHandlerDone after the handler returns.  The thread
+// that receives the completion calls AtlAsyncCompletionArrived; if that
+// returns TRUE the completion has been left for the dispatching thread,
+// which finds out from AtlAsyncHandlerDone and processes it itself.  The
+// completion must be stored where the dispatching thread can find it
+// before AtlAsyncCompletionArrived is called.
+
+// Values for AtlServerRequest::lAsyncState
+#define  ATLSRV_ASYNC_NONE       0 // the request does not use ATLSRV_INIT_USEASYNC_EX
+#define  ATLSRV_ASYNC_IDLE       1 // no thread is working on the request
+#define  ATLSRV_ASYNC_RUNNING    2 // DispatchStencilCall is running the handler
+#define  ATLSRV_ASYNC_PENDING    3 // a completion arrived while the handler was running
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+// Marks the handler as running. Returns the previous state, which is
+// ATLSRV_ASYNC_NONE the first time and ATLSRV_ASYNC_IDLE after that: a
+// continuation is only queued after the completion that caused it has been
+// processed, so no other thread can be using the request.
+inline LONG AtlAsyncHandlerStart(volatile LONG *plState) noexcept
+{
+	LONG lState = InterlockedExchange(plState, ATLSRV_ASYNC_RUNNING);
+	ATLASSERT(lState == ATLSRV_ASYNC_NONE || lState == ATLSRV_ASYNC_IDLE);
+	return lState;
+}
+
+// Returns TRUE if the handler is still running, in which case the
+// completion is left for it. Otherwise the caller processes the completion.
+inline BOOL AtlAsyncCompletionArrived(volatile LONG *plState) noexcept
+{
+	return InterlockedCompareExchange(plState,
+		ATLSRV_ASYNC_PENDING, ATLSRV_ASYNC_RUNNING) == ATLSRV_ASYNC_RUNNING;
+}
+
+// Hands the request back once the handler has returned. Returns TRUE if a
+// completion arrived while the handler was running, in which case the
+// caller must process it.
+inline BOOL AtlAsyncHandlerDone(volatile LONG *plState) noexcept
+{
+	LONG lState = InterlockedCompareExchange(plState,
+		ATLSRV_ASYNC_IDLE, ATLSRV_ASYNC_RUNNING);
+	ATLASSERT(lState == ATLSRV_ASYNC_RUNNING || lState == ATLSRV_ASYNC_PENDING);
+	if (lState != ATLSRV_ASYNC_PENDING)
+		return FALSE;
+
+	InterlockedExchange(plState, ATLSRV_ASYNC_IDLE);
+	return TRUE;
+}
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLASYNCSTATE_H__
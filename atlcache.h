@@ -23,6 +23,8 @@
 #include <atldbcli.h>
 #include <atlspriv.h>
 #include <atlutil.h>
+#include <atlcacheflush.h>
+#include <atlcachewheel.h>
 
 #pragma warning (push)
 #ifndef _ATL_NO_PRAGMA_WARNINGS
@@ -52,6 +54,8 @@ extern "C" __declspec(selectany) const IID IID_IMemoryCacheClient = {0xb721b49d,
 extern "C" __declspec(selectany) const IID IID_IMemoryCache = { 0x9c6cfb46, 0xfbde, 0x4f8b, { 0xb9, 0x44, 0x2a, 0xa0, 0x5d, 0x96, 0xeb, 0x5c } };
 extern "C" __declspec(selectany) const IID IID_IMemoryCacheControl = { 0x7634b28b, 0xd819, 0x409d, { 0xb9, 0x6e, 0xfc, 0x9f, 0x3a, 0xba, 0x32, 0x9f } };
 extern "C" __declspec(selectany) const IID IID_IMemoryCacheStats = { 0xd4b6df2d, 0x4bc0, 0x4734, { 0x8a, 0xce, 0xb7, 0x3a, 0xb, 0x97, 0x59, 0x56 } };
+extern "C" __declspec(selectany) const IID IID_IMemoryCacheControlEx = { 0xa3e32599, 0xd5b6, 0x4749, { 0x8b, 0x9c, 0xfe, 0xa2, 0x2b, 0xa0, 0xdb, 0x57 } };
+extern "C" __declspec(selectany) const IID IID_IMemoryCacheStatsEx = { 0x8120dbb8, 0xef84, 0x4be9, { 0x8a, 0xcd, 0xd9, 0x20, 0xb8, 0xa3, 0x86, 0xbc } };
 
 __interface ATL_NO_VTABLE __declspec(uuid("b721b49d-bb57-47bc-ac43-a8d4c07d183d")) 
 	IMemoryCacheClient : public IUnknown
@@ -103,6 +107,37 @@ __interface ATL_NO_VTABLE __declspec(uuid("d4b6df2d-4bc0-4734-8ace-b73a0b975956"
 
 };
 
+// The DWORD size methods of IMemoryCacheControl and IMemoryCacheStats
+// report sizes of 4 GB and above as 0xFFFFFFFF; these interfaces give the
+// full 64-bit values.  A low water size makes FlushEntries evict down to
+// that size in one pass once the maximum allowed size is exceeded.
+__interface ATL_NO_VTABLE __declspec(uuid("a3e32599-d5b6-4749-8b9c-fea22ba0db57")) 
+	IMemoryCacheControlEx : public IMemoryCacheControl
+{
+	// IMemoryCacheControlEx Methods
+	STDMETHOD(SetMaxAllowedSize64)(ULONGLONG nSize);
+	STDMETHOD(GetMaxAllowedSize64)(ULONGLONG *pnSize);
+	STDMETHOD(SetLowWaterSize)(ULONGLONG nSize);
+	STDMETHOD(GetLowWaterSize)(ULONGLONG *pnSize);
+};
+
+__interface ATL_NO_VTABLE __declspec(uuid("8120dbb8-ef84-4be9-8acd-d920b8a386bc")) 
+	IMemoryCacheStatsEx : public IMemoryCacheStats
+{
+	// IMemoryCacheStatsEx Methods
+	STDMETHOD(GetCurrentAllocSize64)(ULONGLONG *pnSize);
+	STDMETHOD(GetMaxAllocSize64)(ULONGLONG *pnSize);
+};
+
+// size limit of a cache that has no limit set
+#define ATL_CACHE_SIZE_UNLIMITED ((ULONGLONG)-1)
+
+// Converts a 64-bit cache size for the DWORD interface methods
+inline DWORD AtlCacheSizeToDWORD(ULONGLONG nSize)
+{
+	return (nSize >= 0xFFFFFFFF) ? 0xFFFFFFFF : (DWORD)nSize;
+}
+
 struct DLL_CACHE_ENTRY
 {
 	HINSTANCE hInstDll;
@@ -138,247 +173,6 @@ __interface ATL_NO_VTABLE __declspec(uuid("A12478AB-D261-42f9-B525-7589143C1C97"
 
 typedef CFixedStringT<CStringA, ATL_CACHE_KEY_LENGTH> CFixedStringKey;
 
-struct CFlusherCacheData
-{
-	CFlusherCacheData *pNext;
-	CFlusherCacheData *pPrev;
-	DWORD dwAccessed;
-
-	CFlusherCacheData()
-	{
-		pNext = NULL;
-		pPrev = NULL;
-		dwAccessed = 0;
-	}
-};
-
-// No flusher -- only expired entries will be removed from the cache
-// Also gives the skeleton for all of the flushers
-class CNoFlusher
-{
-public:
-	void Add(CFlusherCacheData * /*pItem*/) { }
-	void Remove(CFlusherCacheData * /*pItem*/) { }
-	void Access(CFlusherCacheData * /*pItem*/) { }
-	CFlusherCacheData * GetStart() const { return NULL; }
-	CFlusherCacheData * GetNext(CFlusherCacheData * /*pCur*/) const { return NULL; }
-   	void Release(CFlusherCacheData * /*pItem*/){  }
-};
-
-// Old flusher -- oldest items are flushed first
-class COldFlusher
-{
-public:
-	CFlusherCacheData * pHead;
-	CFlusherCacheData * pTail;
-
-	COldFlusher() : pHead(NULL), pTail(NULL)
-	{
-	}
-
-	// Add it to the tail of the list
-	void Add(CFlusherCacheData * pItem)
-	{
-		ATLENSURE(pItem);
-
-		pItem->pNext = NULL;
-		pItem->pPrev = pTail;
-		if (pHead)
-		{
-			pTail->pNext = pItem;
-			pTail = pItem;
-		}
-		else
-		{
-			pHead = pItem;
-			pTail = pItem;
-		}
-	}
-
-	void Remove(CFlusherCacheData * pItem)
-	{
-		ATLENSURE(pItem);
-
-		CFlusherCacheData * pPrev = pItem->pPrev;
-		CFlusherCacheData * pNext = pItem->pNext;
-
-		if (pPrev)
-			pPrev->pNext = pNext;
-		else
-			pHead = pNext;
-
-		if (pNext)
-			pNext->pPrev = pPrev;
-		else
-			pTail = pPrev;
-
-	}
-
-	void Access(CFlusherCacheData * /*pItem*/)
-	{
-	}
-
-	void Release(CFlusherCacheData * /*pItem*/)
-	{
-	}
-
-	CFlusherCacheData * GetStart() const
-	{
-		return pHead;
-	}
-
-	CFlusherCacheData * GetNext(CFlusherCacheData * pCur) const
-	{
-		if (pCur != NULL)
-			return pCur->pNext;
-		else
-			return NULL;
-	}
-};
-
-// Least recently used flusher -- the item that was accessed the longest time ago is flushed
-class CLRUFlusher : public COldFlusher
-{
-public:
-	// Move it to the tail of the list
-	void Access(CFlusherCacheData * pItem)
-	{
-		ATLASSERT(pItem);
-
-		Remove(pItem);
-		Add(pItem);
-	}
-};
-
-// Least often used flusher
-class CLOUFlusher : public COldFlusher
-{
-public:
-	// Adds to the tail of the list
-	void Add(CFlusherCacheData * pItem)
-	{
-		ATLENSURE(pItem);
-		pItem->dwAccessed = 1;
-		COldFlusher::Add(pItem);
-	}
-
-	void Access(CFlusherCacheData * pItem)
-	{
-		ATLENSURE(pItem);
-		pItem->dwAccessed++;
-
-		CFlusherCacheData * pMark = static_cast<CFlusherCacheData *>(pItem->pPrev);
-		if (!pMark)   // The item is already at the head
-			return;
-
-		if (pMark->dwAccessed >= pItem->dwAccessed) // The element before it has
-			return;                                 // been accessed more times
-
-		Remove(pItem);
-
-		while (pMark && (pMark->dwAccessed < pItem->dwAccessed))
-			pMark = static_cast<CFlusherCacheData *>(pMark->pPrev);
-
-		// pMark points to the first element that has been accessed more times,
-		// so add pItem after pMark
-		if (pMark)
-		{
-			CFlusherCacheData *pNext = static_cast<CFlusherCacheData *>(pMark->pNext);
-			pMark->pNext = pItem;
-			pItem->pPrev = pMark;
-
-			pItem->pNext = pNext;
-			pNext->pPrev = pItem;
-		}
-		else // Ran out of items -- put it on the head
-		{
-			pItem->pNext = pHead;
-			pItem->pPrev = NULL;
-			if (pHead)
-				pHead->pPrev = pItem;
-			else // the list was empty
-				pTail = pItem;
-			pHead = pItem;
-		}
-	}
-
-	// We start at the tail and move forward for this flusher
-	CFlusherCacheData * GetStart() const
-	{
-		return pTail;
-	}
-
-	CFlusherCacheData * GetNext(CFlusherCacheData * pCur) const
-	{
-		if (pCur != NULL)
-			return static_cast<CFlusherCacheData *>(pCur->pPrev);
-		else
-			return NULL;
-	}
-};
-
-template <class CFirst, class CSecond>
-class COrFlushers 
-{
-	CFirst m_First;
-	CSecond m_Second;
-	BOOL m_bWhich;
-public:
-	COrFlushers()
-	{
-		m_bWhich = FALSE;
-	}
-
-	BOOL Switch()
-	{
-		m_bWhich = !m_bWhich;
-		return m_bWhich;
-	}
-
-	void Add(CFlusherCacheData * pItem) 
-	{
-		ATLASSERT(pItem);
-		m_First.Add(pItem);
-		m_Second.Add(pItem);
-	}
-
-	void Remove(CFlusherCacheData * pItem) 
-	{
-		ATLASSERT(pItem);
-		m_First.Remove(pItem);
-		m_Second.Remove(pItem);
-	}
-
-	void Access(CFlusherCacheData * pItem) 
-	{
-		ATLASSERT(pItem);
-		m_First.Access(pItem);
-		m_Second.Access(pItem);
-	}
-	void Release(CFlusherCacheData * pItem)
-	{
-		ATLASSERT(pItem);
-		m_First.Release(pItem);
-		m_Second.Release(pItem);
-	}
-
-	CFlusherCacheData * GetStart() const 
-	{ 
-		if (m_bWhich)
-			return m_First.GetStart();
-		else
-			return m_Second.GetStart();
-	}
-
-	CFlusherCacheData * GetNext(CFlusherCacheData * pCur) const 
-	{ 
-		if (m_bWhich)
-			return m_First.GetNext(pCur);
-		else
-			return m_Second.GetNext(pCur);
-	}
-};
-
 struct CCullerCacheData
 {
 	CCullerCacheData()
@@ -386,11 +180,13 @@ struct CCullerCacheData
 		pNext = NULL;
 		pPrev = NULL;
 		nLifespan = 0;
+		nWheelSlot = 0xFFFFFFFF;
 	}
 	CCullerCacheData *pNext;
 	CCullerCacheData *pPrev;
 	ULONGLONG nLifespan;
 	CFileTime cftExpireTime;
+	DWORD nWheelSlot;
 };
 
 class CNoExpireCuller
@@ -592,6 +388,122 @@ public:
 	}
 };
 
+#ifndef ATL_CACHE_WHEEL_TICK
+#define ATL_CACHE_WHEEL_TICK CFileTime::Second
+#endif
+
+//
+// CWheelExpireCuller
+// A culler with the same expiration rules as CExpireCuller, built on a
+// hierarchical timing wheel (CAtlTimingWheel in atlcachewheel.h) instead
+// of a sorted list.  A level 0 slot of the wheel covers one tick of
+// t_nTick FILETIME units.  Commit, Access and Remove are O(1).  Start
+// moves the wheel to the current time and GetExpired then drains the
+// items that have come due.  Expiration is detected with a granularity of
+// one tick.
+template <ULONGLONG t_nTick=ATL_CACHE_WHEEL_TICK>
+class CWheelExpireCuller :
+	public CAtlTimingWheel<CWheelExpireCuller<t_nTick>, CCullerCacheData, t_nTick>
+{
+public:
+	typedef CAtlTimingWheel<CWheelExpireCuller<t_nTick>, CCullerCacheData, t_nTick> baseWheel;
+
+	CFileTime m_cftCurrent;
+
+	CWheelExpireCuller()
+	{
+		m_cftCurrent = CFileTime::GetCurrentTime();
+		baseWheel::SetCurrentTime(m_cftCurrent.GetTime());
+	}
+
+	void Add(CCullerCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		pItem->nWheelSlot = baseWheel::SLOT_NONE;
+	}
+
+	// Expiration data has been set -- put the item in its slot.
+	// a FILETIME of 0 indicates that the item should never expire
+	void Commit(CCullerCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		baseWheel::Insert(pItem);
+	}
+
+	void Access(CCullerCacheData * /*pItem*/)
+	{
+	}
+
+	void Release(CCullerCacheData * /*pItem*/)
+	{
+	}
+
+	void Remove(CCullerCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		baseWheel::Remove(pItem);
+	}
+
+	// About to start culling -- advance the wheel to the current time
+	void Start()
+	{
+		m_cftCurrent = CFileTime::GetCurrentTime();
+		baseWheel::Advance(m_cftCurrent.GetTime());
+	}
+
+	BOOL IsExpired(CCullerCacheData *pItem)
+	{
+		if ((pItem->cftExpireTime != 0) && 
+			m_cftCurrent > pItem->cftExpireTime)
+			return TRUE;
+
+		return FALSE;
+	}
+
+	// Get the next expired entry
+	CCullerCacheData * GetExpired()
+	{
+		return baseWheel::GetExpired();
+	}
+
+	static ULONGLONG GetExpireTime(const CCullerCacheData *pItem)
+	{
+		return pItem->cftExpireTime.GetTime();
+	}
+};
+
+// The timing wheel counterpart of CLifetimeCuller -- each access renews
+// the item's lifespan
+template <ULONGLONG t_nTick=ATL_CACHE_WHEEL_TICK>
+class CWheelLifetimeCuller : public CWheelExpireCuller<t_nTick>
+{
+public:
+	typedef CWheelExpireCuller<t_nTick> baseCuller;
+
+	void Add(CCullerCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		pItem->nLifespan = 0;
+		baseCuller::Add(pItem);
+	}
+
+	void Commit(CCullerCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		if (pItem->nLifespan == 0)
+			pItem->cftExpireTime = 0;
+		else
+			pItem->cftExpireTime = CFileTime(CFileTime::GetCurrentTime().GetTime() + pItem->nLifespan);
+		baseCuller::Commit(pItem);
+	}
+
+	void Access(CCullerCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		baseCuller::Remove(pItem);
+		Commit(pItem);
+	}
+};
 
 template <class CFirst, class CSecond>
 class COrCullers
@@ -665,6 +577,7 @@ public:
 // Template Parameters:
 //  T: The class that inherits from this class. This class must implement
 //     void OnDestroyEntry(NodeType *pEntry);
+//     RemoveAt is called through T, so T may replace it
 //  DataType: Specifies the type of the element to be stored in the memory
 //            cache such as CString or void*
 //  NodeInfo: Specifies any additional data that should be stored in each item
@@ -716,7 +629,8 @@ protected:
 	Culler m_culler;
 
 	//memory cache configuration parameters
-	DWORD m_dwMaxAllocationSize;
+	ULONGLONG m_nMaxAllocationSize;
+	ULONGLONG m_nLowWaterSize;
 	DWORD m_dwMaxEntries;
 
 	BOOL m_bInitialized;
@@ -724,7 +638,8 @@ public:
 
 	mapType m_hashTable;
 	CMemoryCacheBase() :
-	  m_dwMaxAllocationSize(0xFFFFFFFF),
+	  m_nMaxAllocationSize(ATL_CACHE_SIZE_UNLIMITED),
+	  m_nLowWaterSize(ATL_CACHE_SIZE_UNLIMITED),
 	  m_dwMaxEntries(0xFFFFFFFF),
 	  m_bInitialized(FALSE)
 	{
@@ -799,6 +714,7 @@ public:
 			}
 			pEntry->Data = data;
 			pEntry->dwSize = dwSize;
+			pEntry->nKeyHash = KeyTrait::Hash(Key);
 
 			CComCritSecLock<SyncClass> lock(m_syncObj, false);
 
@@ -812,7 +728,7 @@ public:
 
 			if (pos != NULL)
 			{
-				RemoveAt(pos, FALSE);
+				static_cast<T*>(this)->RemoveAt(pos, FALSE);
 				m_hashTable.GetValueAt(pos) = pEntry;
 			}
 			else
@@ -998,7 +914,7 @@ public:
 			ATLASSERT(pEntry->dwRef > 0);
 			pEntry->dwRef--;
 			if (pEntry->pos)
-				RemoveAt(pEntry->pos, TRUE);
+				static_cast<T*>(this)->RemoveAt(pEntry->pos, TRUE);
 			else if ((long)pEntry->dwRef == 0)
 				InternalRemoveEntry(pEntry);
 			lock.Unlock();
@@ -1026,7 +942,7 @@ public:
 			m_culler.Start();
 
 			while (NodeType *pNode = static_cast<NodeType *>(m_culler.GetExpired()))
-				RemoveAt(pNode->pos, TRUE);
+				static_cast<T*>(this)->RemoveAt(pNode->pos, TRUE);
 
 			lock.Unlock();
 		}
@@ -1053,16 +969,17 @@ public:
 			if (FAILED(hr))
 				return hr;
 
+			ULONGLONG nTargetSize = GetFlushTargetSize();
 			NodeType * pNode = static_cast<NodeType *>(m_flusher.GetStart());
 
 			while (pNode &&
 				   (((m_statObj.GetCurrentEntryCount() > m_dwMaxEntries)) ||
-					((m_statObj.GetCurrentAllocSize() > m_dwMaxAllocationSize))))
+					((m_statObj.GetCurrentAllocSize() > nTargetSize))))
 			{
 				NodeType *pNext = static_cast<NodeType *>(m_flusher.GetNext(pNode));
 
 				if (pNode->dwRef == 0)
-					RemoveAt(pNode->pos, TRUE);
+					static_cast<T*>(this)->RemoveAt(pNode->pos, TRUE);
 
 				pNode = pNext;
 			}
@@ -1076,40 +993,71 @@ public:
 		return S_OK;
 	}
 
+	// 0xFFFFFFFF removes the limit
 	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize(DWORD dwSize)
 	{
-		m_dwMaxAllocationSize = dwSize;
-		return S_OK;
+		return SetMaxAllowedSize64((dwSize == 0xFFFFFFFF) ? ATL_CACHE_SIZE_UNLIMITED : dwSize);
 	}
 
 	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize(DWORD *pdwSize)
 	{
 		if (!pdwSize)
 			return E_POINTER;
-		*pdwSize = m_dwMaxAllocationSize;
+		*pdwSize = AtlCacheSizeToDWORD(m_nMaxAllocationSize);
 		return S_OK;
 	}
 
-	HRESULT STDMETHODCALLTYPE SetMaxAllowedEntries(DWORD dwSize)
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize64(ULONGLONG nSize)
 	{
-		m_dwMaxEntries = dwSize;
+		m_nMaxAllocationSize = nSize;
 		return S_OK;
 	}
 
-	HRESULT STDMETHODCALLTYPE GetMaxAllowedEntries(DWORD *pdwSize)
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize64(ULONGLONG *pnSize)
 	{
-		if (!pdwSize)
+		if (!pnSize)
 			return E_POINTER;
-		*pdwSize = m_dwMaxEntries;
+		*pnSize = m_nMaxAllocationSize;
 		return S_OK;
 	}
 
+	// Once the allocation size exceeds the maximum allowed size,
+	// FlushEntries evicts down to the low water size.
+	// ATL_CACHE_SIZE_UNLIMITED (the default) evicts only down to the maximum.
+	HRESULT STDMETHODCALLTYPE SetLowWaterSize(ULONGLONG nSize)
+	{
+		m_nLowWaterSize = nSize;
+		return S_OK;
+	}
 
-	HRESULT ResetCache()
+	HRESULT STDMETHODCALLTYPE GetLowWaterSize(ULONGLONG *pnSize)
 	{
-		ATLASSUME(m_bInitialized);
-		HRESULT hr = E_UNEXPECTED;
-		if (SUCCEEDED(ClearStats()))
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = m_nLowWaterSize;
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedEntries(DWORD dwSize)
+	{
+		m_dwMaxEntries = dwSize;
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedEntries(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_dwMaxEntries;
+		return S_OK;
+	}
+
+
+	HRESULT ResetCache()
+	{
+		ATLASSUME(m_bInitialized);
+		HRESULT hr = E_UNEXPECTED;
+		if (SUCCEEDED(ClearStats()))
 			hr = RemoveAllEntries(); 
 		return hr;
 	}
@@ -1134,7 +1082,7 @@ public:
 		{
 			oldpos = pos;
 			m_hashTable.GetNext(pos);
-			RemoveAt(oldpos, TRUE);
+			static_cast<T*>(this)->RemoveAt(oldpos, TRUE);
 		}
 		m_hashTable.EnableAutoRehash();
 		m_syncObj.Unlock();
@@ -1146,19 +1094,29 @@ protected:
 
 	// Checks to see if the cache can accommodate any new entries within
 	// its allocation and entry count limits.  
-	bool CanAddEntry(DWORD dwSizeToAdd)
+	bool CanAddEntry(ULONGLONG nSizeToAdd)
 	{
-		return CheckAlloc(dwSizeToAdd) && CheckEntryCount(1);
+		return CheckAlloc(nSizeToAdd) && CheckEntryCount(1);
 	}
 
-	// Checks to see if the cache can accommodate dwSizeToAdd additional
+	// Checks to see if the cache can accommodate nSizeToAdd additional
 	// allocation within its allocation limit.
-	bool CheckAlloc(DWORD dwSizeToAdd)
+	bool CheckAlloc(ULONGLONG nSizeToAdd)
 	{
-		if (m_dwMaxAllocationSize == 0xFFFFFFFF)
+		if (m_nMaxAllocationSize == ATL_CACHE_SIZE_UNLIMITED)
 			return true; //max allocation size setting hasn't been set
-		DWORD dwNew = m_statObj.GetCurrentAllocSize() + dwSizeToAdd;
-		return dwNew < m_dwMaxAllocationSize;
+		ULONGLONG nNew = m_statObj.GetCurrentAllocSize() + nSizeToAdd;
+		return nNew < m_nMaxAllocationSize;
+	}
+
+	// The allocation size FlushEntries evicts down to: the low water size
+	// once the maximum allowed size has been exceeded, otherwise the maximum
+	ULONGLONG GetFlushTargetSize()
+	{
+		if (m_nLowWaterSize < m_nMaxAllocationSize &&
+			m_statObj.GetCurrentAllocSize() > m_nMaxAllocationSize)
+			return m_nLowWaterSize;
+		return m_nMaxAllocationSize;
 	}
 
 
@@ -1338,984 +1296,3039 @@ public:
    */
 }; // CMemoryCache
 
-// CStdStatData - contains the data that CStdStatClass keeps track of
-#define ATL_PERF_CACHE_OBJECT 100
+#ifndef ATL_CACHE_READ_BUCKETS
+#define ATL_CACHE_READ_BUCKETS 1024
+#endif
 
-struct CPerfStatObject : public CPerfObject
-{
-	DECLARE_PERF_CATEGORY(CPerfStatObject, ATL_PERF_CACHE_OBJECT, IDS_PERFMON_CACHE, IDS_PERFMON_CACHE_HELP, -1);
+#ifndef ATL_CACHE_EPOCH_SLOTS
+#define ATL_CACHE_EPOCH_SLOTS 64
+#endif
 
-	BEGIN_COUNTER_MAP(CPerfStatObject)
-		DEFINE_COUNTER(m_nHitCount, IDS_PERFMON_HITCOUNT, IDS_PERFMON_HITCOUNT_HELP, PERF_COUNTER_RAWCOUNT, -1)
-		DEFINE_COUNTER(m_nMissCount, IDS_PERFMON_MISSCOUNT, IDS_PERFMON_MISSCOUNT_HELP, PERF_COUNTER_RAWCOUNT, -1)
-		DEFINE_COUNTER(m_nCurrentAllocations, IDS_PERFMON_CURRENTALLOCATIONS, IDS_PERFMON_CURRENTALLOCATIONS_HELP, PERF_COUNTER_RAWCOUNT, -3)
-		DEFINE_COUNTER(m_nMaxAllocations, IDS_PERFMON_MAXALLOCATIONS, IDS_PERFMON_MAXALLOCATIONS_HELP, PERF_COUNTER_RAWCOUNT, -3)
-		DEFINE_COUNTER(m_nCurrentEntries, IDS_PERFMON_CURRENTENTRIES, IDS_PERFMON_CURRENTENTRIES_HELP, PERF_COUNTER_RAWCOUNT, -1)
-		DEFINE_COUNTER(m_nMaxEntries, IDS_PERFMON_MAXENTRIES, IDS_PERFMON_MAXENTRIES_HELP, PERF_COUNTER_RAWCOUNT, -1)
-	END_COUNTER_MAP()
+#ifndef ATL_CACHE_ACCESS_STRIPES
+#define ATL_CACHE_ACCESS_STRIPES 16
+#endif
 
-	long m_nHitCount;
-	long m_nMissCount;
-	long m_nCurrentAllocations;
-	long m_nMaxAllocations;
-	long m_nCurrentEntries;
-	long m_nMaxEntries;
-};
+#ifndef ATL_CACHE_ACCESS_BUFFER
+#define ATL_CACHE_ACCESS_BUFFER 32
+#endif
 
-// CCachePerfMon - the interface to CPerfMon, with associated definitions
-class CCachePerfMon : public CPerfMon
+// Node information for entries in a read-mostly cache -- a copy of the key
+// and the links used by lock-free readers and deferred reclamation
+template <class NodeInfo, class keyType>
+struct CCacheDataReadMostly : public NodeInfo
 {
-public:
-	BEGIN_PERF_MAP(_T("ATL Server:Cache"))
-		CHAIN_PERF_CATEGORY(CPerfStatObject)
-	END_PERF_MAP()
+	CCacheDataReadMostly()
+	{
+		nHash = 0;
+		pNextRead = NULL;
+		pNextRetired = NULL;
+		lRetireEpoch = 0;
+	}
+
+	keyType Key;
+	UINT nHash;
+	void * volatile pNextRead;
+	void *pNextRetired;
+	LONG lRetireEpoch;
 };
 
 //
-//CStdStatClass
-// Description
-// This class provides the implementation of a standard cache statistics accounting class
-class CStdStatClass
-{ 
+//CReadMostlyMemoryCacheBase
+// Description:
+//  A variant of CMemoryCacheBase for caches that are hit far more often
+//  than they are changed.  Besides the CAtlMap used by writers, entries are
+//  linked into a fixed size bucket array that LookupEntry, AddRefEntry and
+//  ReleaseEntry use without taking m_syncObj.  Reference counts are
+//  maintained with interlocked operations, and an entry whose count reaches
+//  zero after it has been removed is marked dead so readers can no longer
+//  reference it.
+//
+//  Dead entries are not deleted immediately.  Readers announce the epoch
+//  they entered in one of ATL_CACHE_EPOCH_SLOTS slots, and a retired entry
+//  is only deleted once every reader that could have seen it has left.
+//
+//  Hits are recorded in one of ATL_CACHE_ACCESS_STRIPES small buffers,
+//  picked by thread id, and passed on to the flusher and culler in one
+//  batch when CullEntries or FlushEntries runs.  A hit that finds its
+//  buffer full is dropped, so under load the flusher and culler see a
+//  sample of the accesses, and the LRU/LOU order and the lifetime culler's
+//  renewals are approximate between two culls.  Draining the buffers costs
+//  the same however many entries the cache holds.
+//
+// Template Parameters:
+//  Same as CMemoryCacheBase, plus
+//  t_nBuckets: the number of buckets used by lock-free readers.  Must be
+//              a power of two; the bucket array does not grow.
+template <class T,
+		 class DataType,
+		 class NodeInfo=CCacheDataBase,
+		 class keyType=CFixedStringKey,
+		 class KeyTrait=CStringElementTraits<CFixedStringKey >,
+		 class Flusher=COldFlusher,
+		 class Culler=CExpireCuller,
+		 class SyncClass=CComCriticalSection,
+		 class StatClass=CStdStatClass,
+		 DWORD t_nBuckets=ATL_CACHE_READ_BUCKETS >
+class CReadMostlyMemoryCacheBase :
+	public CMemoryCacheBase<T, DataType, CCacheDataReadMostly<NodeInfo, keyType>, keyType, KeyTrait, Flusher, Culler, SyncClass, StatClass>
+{
+	friend class CMemoryCacheBase<T, DataType, CCacheDataReadMostly<NodeInfo, keyType>, keyType, KeyTrait, Flusher, Culler, SyncClass, StatClass>;
+
 protected:
-	CPerfStatObject* m_pStats;
-	CPerfStatObject m_stats;
+	typedef CMemoryCacheBase<T, DataType, CCacheDataReadMostly<NodeInfo, keyType>, keyType, KeyTrait, Flusher, Culler, SyncClass, StatClass> baseClass;
+	typedef typename baseClass::NodeType NodeType;
 
-public:
+	// reference count of an entry that is being destroyed
+	static const LONG c_lDeadRef = (LONG)0x80000000;
 
-	CStdStatClass()
-	{
-		m_pStats = &m_stats;
-	}
+	void * volatile m_rgBuckets[t_nBuckets];
+	volatile LONG m_rgEpochSlots[ATL_CACHE_EPOCH_SLOTS];
+	volatile LONG m_lEpoch;
+	NodeType *m_pRetired;
 
-	// This function is not thread safe by design
-	HRESULT Initialize(CPerfStatObject* pStats = NULL)
+	struct CAccessStripe
 	{
-		if (pStats)
-			m_pStats = pStats;
-		else
-			m_pStats = &m_stats;
+		volatile LONG lCount;
+		void * volatile rgpNodes[ATL_CACHE_ACCESS_BUFFER];
+	};
+	CAccessStripe m_rgAccessStripes[ATL_CACHE_ACCESS_STRIPES];
 
-		ResetCounters();
-		return S_OK;
+public:
+	CReadMostlyMemoryCacheBase() :
+		m_lEpoch(1),
+		m_pRetired(NULL)
+	{
+		C_ASSERT(t_nBuckets > 0 && (t_nBuckets & (t_nBuckets-1)) == 0);
+		memset((void *)m_rgBuckets, 0, sizeof(m_rgBuckets));
+		memset((void *)m_rgEpochSlots, 0, sizeof(m_rgEpochSlots));
+		memset((void *)m_rgAccessStripes, 0, sizeof(m_rgAccessStripes));
 	}
 
-	// This function is not thread safe by design
 	HRESULT Uninitialize()
 	{
-		m_pStats = &m_stats;
-		return S_OK;
-	}
+		if (!m_bInitialized)
+			return S_OK;
 
-	void Hit()
-	{
-		InterlockedIncrement(&m_pStats->m_nHitCount);
-	}
+		HRESULT hr = baseClass::Uninitialize();
 
-	void Miss()
-	{ 
-		InterlockedIncrement(&m_pStats->m_nMissCount);
+		// no reader can be active while the cache is being torn down
+		ReclaimRetired(TRUE);
+		return hr;
 	}
 
-	void AddElement(DWORD dwBytes)
+	HRESULT AddEntry(
+					const keyType &Key,
+					const DataType &data,
+					DWORD dwSize,
+					HCACHEITEM *phEntry = NULL
+					)
 	{
-		DWORD nCurrentEntries = InterlockedIncrement(&m_pStats->m_nCurrentEntries);
-		AtlInterlockedUpdateMax(nCurrentEntries, &m_pStats->m_nMaxEntries);
-
-		DWORD nCurrentAllocations = dwBytes + AtlInterlockedExchangeAdd(&m_pStats->m_nCurrentAllocations, dwBytes);
-		AtlInterlockedUpdateMax(nCurrentAllocations, &m_pStats->m_nMaxAllocations);
-	}
+		_ATLTRY
+		{
+			ATLASSUME(m_bInitialized);
 
-	void ReleaseElement(DWORD dwBytes)
-	{
-		InterlockedDecrement(&m_pStats->m_nCurrentEntries);
-		AtlInterlockedExchangeAdd(&m_pStats->m_nCurrentAllocations, -((long)dwBytes));
-	}
+			CAutoPtr<NodeType> spEntry(new NodeType);
 
-	DWORD GetHitCount()
-	{
-		return m_pStats->m_nHitCount;
-	}
+			if (!spEntry)
+				return E_OUTOFMEMORY;
 
-	DWORD GetMissCount()
-	{
-		return m_pStats->m_nMissCount;
-	}
+			NodeType *pEntry = spEntry;
 
-	DWORD GetCurrentAllocSize()
-	{
-		return m_pStats->m_nCurrentAllocations;
-	}
+			if (phEntry)
+			{
+				*phEntry = static_cast<HCACHEITEM>(pEntry);
+				pEntry->dwRef++;
+			}
+			pEntry->Data = data;
+			pEntry->dwSize = dwSize;
+			pEntry->Key = Key;
+			pEntry->nHash = KeyTrait::Hash(Key);
+			pEntry->nKeyHash = pEntry->nHash;
 
-	DWORD GetMaxAllocSize()
-	{
-		return m_pStats->m_nMaxAllocations;
-	}
+			CComCritSecLock<SyncClass> lock(m_syncObj, false);
 
-	DWORD GetCurrentEntryCount()
-	{
-		return m_pStats->m_nCurrentEntries;
-	}
+			HRESULT hr = lock.Lock();
+			if (FAILED(hr))
+			{
+				return hr;
+			}
 
-	DWORD GetMaxEntryCount()
-	{   
-		return m_pStats->m_nMaxEntries;
-	}
+			POSITION pos = (POSITION)m_hashTable.Lookup(Key);
 
-	void ResetCounters()
-	{
-		m_pStats->m_nHitCount = 0;
-		m_pStats->m_nMissCount = 0;
-		m_pStats->m_nCurrentAllocations = 0;
-		m_pStats->m_nMaxAllocations = 0;
-		m_pStats->m_nCurrentEntries = 0;
-		m_pStats->m_nMaxEntries = 0;
-	}
-}; // CStdStatClass
+			if (pos != NULL)
+			{
+				RemoveAt(pos, FALSE);
+				m_hashTable.GetValueAt(pos) = pEntry;
+			}
+			else
+			{
+				pos = m_hashTable.SetAt(Key, pEntry);
+			}
+			spEntry.Detach();
 
-//
-// CNoStatClass
-// This is a noop stat class
-class CNoStatClass
-{ 
-public:
-	HRESULT Initialize(){ return S_OK; }
-	HRESULT Uninitialize(){ return S_OK; }
-	void Hit(){ }
-	void Miss(){ }
-	void AddElement(DWORD){ }
-	void ReleaseElement(DWORD){ }
-	DWORD GetHitCount(){ return 0; }
-	DWORD GetMissCount(){ return 0; }
-	DWORD GetCurrentAllocSize(){ return 0; }
-	DWORD GetMaxAllocSize(){ return 0; }
-	DWORD GetCurrentEntryCount(){ return 0; }
-	DWORD GetMaxEntryCount(){ return 0; }
-	void ResetCounters(){ }
-}; // CNoStatClass
+			pEntry->pos = pos;
+			m_statObj.AddElement(dwSize);
+			m_flusher.Add(pEntry);
+			m_culler.Add(pEntry);
+			LinkNode(pEntry);
 
-//
-//CPerfStatClass
-// Description
-// This class provides the implementation of a cache statistics gathering class
-// with PerfMon support
-class CPerfStatClass : public CStdStatClass
-{
-	CPerfStatObject * m_pPerfObject;
-	CCachePerfMon m_PerfMon;
+			ReclaimRetired(FALSE);
 
-public:
+			lock.Unlock();
 
-	HRESULT Initialize(__in_z_opt LPWSTR szName=NULL)
-	{
-		HRESULT hr;
-		WCHAR szPath[MAX_PATH];
+			if (!phEntry)
+				return CommitEntry(static_cast<HCACHEITEM>(pEntry));
 
-		if (!szName)
+			return S_OK;
+		}
+		_ATLCATCHALL()
 		{
-			// default name is the name of the module
-			// we don't care about possible truncation if longer than max_path
-			// we just need an identifier
-			HINSTANCE hInst = _AtlBaseModule.GetModuleInstance();
-			if (::GetModuleFileNameW(hInst, szPath, MAX_PATH) == 0)
-			{
-				return E_FAIL;
-			}
-			szPath[MAX_PATH-1] = 0;
-			szName = szPath;
+			return E_FAIL;
 		}
+	}
 
-		m_pPerfObject = NULL;
-		ATLTRACE(atlTraceCache, 2, _T("Initializing m_PerfMon\n"));
-		hr = m_PerfMon.Initialize();
-		if (SUCCEEDED(hr))
-		{
-			CPerfLock lock(&m_PerfMon);
-			if (FAILED(hr = lock.GetStatus()))
-			{
-				return hr;
-			}
+	// Looks up an entry without taking the cache lock unless every
+	// epoch slot is in use
+	HRESULT LookupEntry(const keyType &Key, HCACHEITEM * phEntry)
+	{
+		ATLASSUME(m_bInitialized);
 
-			hr = m_PerfMon.CreateInstance(ATL_PERF_CACHE_OBJECT, 0, szName, reinterpret_cast<CPerfObject**>(&m_pPerfObject));
-			if (FAILED(hr))
-			{
-				return hr;
-			}
+		UINT nHash = KeyTrait::Hash(Key);
+		NodeType *pEntry = NULL;
 
-			CStdStatClass::Initialize(m_pPerfObject);
+		int nSlot = EnterEpoch();
+		if (nSlot >= 0)
+		{
+			pEntry = FindAndAddRef(Key, nHash);
+			LeaveEpoch(nSlot);
 		}
 		else
-			ATLASSUME(m_pPerfObject == NULL);
-
-		return hr;
-	}
-
-	HRESULT Uninitialize()
-	{
-		CStdStatClass::Uninitialize();
-
-		if (m_pPerfObject != NULL) // Initialized m_pPerfObject successfully above
 		{
-			HRESULT hr = m_PerfMon.ReleaseInstance(m_pPerfObject);
-			if (hr != S_OK)
+			HRESULT hr = m_syncObj.Lock();
+			if (FAILED(hr))
 				return hr;
+			pEntry = FindAndAddRef(Key, nHash);
+			m_syncObj.Unlock();
+		}
 
-			m_PerfMon.UnInitialize();
+		if (pEntry == NULL)
+		{
+			if (phEntry)
+				*phEntry = NULL;
+			m_statObj.Miss();
+			return E_FAIL;
 		}
 
+		RecordAccess(pEntry);
+		m_statObj.Hit();
+
+		if (phEntry)
+			*phEntry = static_cast<HCACHEITEM>(pEntry);
+		else
+			ReleaseEntry(static_cast<HCACHEITEM>(pEntry));
+
 		return S_OK;
 	}
-}; // CPerfStatClass
 
-#ifndef ATL_BLOB_CACHE_TIMEOUT
-#ifdef _DEBUG
-#define ATL_BLOB_CACHE_TIMEOUT 1000
-#else
-#define ATL_BLOB_CACHE_TIMEOUT 5000
-#endif // _DEBUG
-#endif // ATL_BLOB_CACHE_TIMEOUT
+	DWORD ReleaseEntry(const HCACHEITEM hEntry)
+	{
+		ATLASSUME(m_bInitialized);
+		if (!hEntry || hEntry == INVALID_HANDLE_VALUE)
+			return (DWORD)-1;
 
-//
-//CBlobCache
-// Description:
-// Implements a cache that stores pointers to void. Uses the generic CMemoryCacheBase class
-// as the implementation.
-template <class MonitorClass,
-		class StatClass=CStdStatClass,
-		class SyncObj=CComCriticalSection,
-		class FlushClass=COldFlusher,
-		class CullClass=CExpireCuller >
-class CBlobCache : public CMemoryCache<void*, StatClass, FlushClass, CFixedStringKey, 
-	CStringElementTraits<CFixedStringKey >, SyncObj, CullClass>,
-	public IMemoryCache,
-	public IMemoryCacheControl,
-	public IMemoryCacheStats,
-	public IWorkerThreadClient
-{
-	typedef CMemoryCache<void*, StatClass, FlushClass, CFixedStringKey, 
-		CStringElementTraits<CFixedStringKey>, SyncObj, CullClass> cacheBase;
+		NodeType * pEntry = static_cast<NodeType *>(hEntry);
+		ATLASSERT(*RefOf(pEntry) > 0);
 
-	MonitorClass m_Monitor;
+		// The entry may be destroyed as soon as the count drops, so stay
+		// in an epoch (or hold the lock) until we are done looking at it
+		int nSlot = EnterEpoch();
+		if (nSlot < 0)
+		{
+			HRESULT hr = m_syncObj.Lock();
+			if (FAILED(hr))
+				return (DWORD)-1;
+		}
 
-protected:
-	HANDLE m_hTimer;
+		LONG lRef = InterlockedDecrement(RefOf(pEntry));
+		if (lRef == 0 && pEntry->pos == NULL)
+		{
+			// removed while referenced -- the last release destroys it
+			if (nSlot >= 0 && SUCCEEDED(m_syncObj.Lock()))
+			{
+				KillNode(pEntry);
+				m_syncObj.Unlock();
+			}
+			else if (nSlot < 0)
+				KillNode(pEntry);
+		}
 
-public:
-	CBlobCache() : m_hTimer(NULL)
-	{
-	}
+		if (nSlot >= 0)
+			LeaveEpoch(nSlot);
+		else
+			m_syncObj.Unlock();
 
-	HRESULT Initialize(IServiceProvider *pProv)
-	{
-		HRESULT hr = cacheBase::Initialize(pProv);
-		if (FAILED(hr))
-			return hr;
-		hr = m_Monitor.Initialize();
-		if (FAILED(hr))
-			return hr;
-		return m_Monitor.AddTimer(ATL_BLOB_CACHE_TIMEOUT, 
-			static_cast<IWorkerThreadClient*>(this), (DWORD_PTR) this, &m_hTimer);
+		return (DWORD)lRef;
 	}
 
-	template <class ThreadTraits>
-	HRESULT Initialize(IServiceProvider *pProv, CWorkerThread<ThreadTraits> *pWorkerThread)
+	DWORD AddRefEntry(const HCACHEITEM hEntry)
 	{
-		ATLASSERT(pWorkerThread);
+		ATLASSUME(m_bInitialized);
+		if (!hEntry || hEntry == INVALID_HANDLE_VALUE)
+			return (DWORD)-1;
 
-		HRESULT hr = cacheBase::Initialize(pProv);
-		if (FAILED(hr))
-			return hr;
+		NodeType * pEntry = static_cast<NodeType *>(hEntry);
+		ATLASSERT(*RefOf(pEntry) > 0);
 
-		hr = m_Monitor.Initialize(pWorkerThread);
-		if (FAILED(hr))
-			return hr;
+		RecordAccess(pEntry);
 
-		return m_Monitor.AddTimer(ATL_BLOB_CACHE_TIMEOUT, 
-			static_cast<IWorkerThreadClient*>(this), (DWORD_PTR) this, &m_hTimer);
+		return (DWORD)InterlockedIncrement(RefOf(pEntry));
 	}
 
-	HRESULT Execute(DWORD_PTR dwParam, HANDLE /*hObject*/)
+	HRESULT RemoveEntryByKey(const keyType &Key)
 	{
-		CBlobCache* pCache = (CBlobCache*)dwParam;
+		ATLASSUME(m_bInitialized);
+		HCACHEITEM hEntry;
+		HRESULT hr = LookupEntry(Key, &hEntry);
+		if (hr == S_OK)
+			hr = RemoveEntry(hEntry);
 
-		if (pCache)
-			pCache->Flush();
-		return S_OK;
+		return hr;
 	}
 
-	HRESULT CloseHandle(HANDLE hObject)
+	// Removes the entry and releases the caller's reference on it
+	HRESULT RemoveEntry(const HCACHEITEM hEntry)
 	{
-		ATLASSUME(m_hTimer == hObject);
-		m_hTimer = NULL;
-		::CloseHandle(hObject);
+		ATLASSUME(m_bInitialized);
+		if (!hEntry || hEntry == INVALID_HANDLE_VALUE)
+			return E_INVALIDARG;
+
+		_ATLTRY
+		{
+			CComCritSecLock<SyncClass> lock(m_syncObj, false);
+
+			HRESULT hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+
+			NodeType * pEntry = static_cast<NodeType *>(hEntry);
+			m_flusher.Release(pEntry);
+			m_culler.Release(pEntry);
+			ATLASSERT(*RefOf(pEntry) > 0);
+			if (pEntry->pos)
+				RemoveAt(pEntry->pos, TRUE);
+			if (InterlockedDecrement(RefOf(pEntry)) == 0)
+				KillNode(pEntry);
+			lock.Unlock();
+		}
+		_ATLCATCHALL()
+		{
+			return E_OUTOFMEMORY;
+		}
+
 		return S_OK;
 	}
 
-	virtual ~CBlobCache()
+	// CullEntries hands the accesses recorded since the last call to the
+	// flusher and culler, removes all expired items and deletes retired
+	// entries that no reader can see any more
+	HRESULT CullEntries()
 	{
-		if (m_hTimer)
+		ATLASSUME(m_bInitialized);
+
+		_ATLTRY
 		{
-			ATLENSURE(SUCCEEDED(m_Monitor.RemoveHandle(m_hTimer)));
+			CComCritSecLock<SyncClass> lock(m_syncObj, false);
+			HRESULT hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+
+			ApplyAccesses();
+
+			m_culler.Start();
+
+			while (NodeType *pNode = static_cast<NodeType *>(m_culler.GetExpired()))
+				RemoveAt(pNode->pos, TRUE);
+
+			ReclaimRetired(FALSE);
+
+			lock.Unlock();
 		}
+		_ATLCATCHALL()
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		return S_OK;
 	}
 
-	HRESULT Uninitialize()
+	HRESULT FlushEntries()
 	{
-		HRESULT hrMonitor=S_OK;
-		if (m_hTimer)
+		ATLASSUME(m_bInitialized);
+		HRESULT hr = CullEntries();
+		if (FAILED(hr))
+			return hr;
+
+		_ATLTRY
 		{
-			hrMonitor=m_Monitor.RemoveHandle(m_hTimer);
-			m_hTimer = NULL;
+			CComCritSecLock<SyncClass> lock(m_syncObj, false);
+			hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+
+			ULONGLONG nTargetSize = GetFlushTargetSize();
+			NodeType * pNode = static_cast<NodeType *>(m_flusher.GetStart());
+
+			while (pNode &&
+				   (((m_statObj.GetCurrentEntryCount() > m_dwMaxEntries)) ||
+					((m_statObj.GetCurrentAllocSize() > nTargetSize))))
+			{
+				NodeType *pNext = static_cast<NodeType *>(m_flusher.GetNext(pNode));
+
+				// a reader may take a reference after this check; RemoveAt
+				// then detaches the entry instead of destroying it
+				if (*RefOf(pNode) == 0)
+					RemoveAt(pNode->pos, TRUE);
+
+				pNode = pNext;
+			}
+			lock.Unlock();
 		}
-		HRESULT hrShut=m_Monitor.Shutdown();
-		HRESULT hrCache=cacheBase::Uninitialize();
-		if(FAILED(hrMonitor))
+		_ATLCATCHALL()
 		{
-			return hrMonitor;
+			return E_OUTOFMEMORY;
 		}
-		if(FAILED(hrShut))
+
+		return S_OK;
+	}
+
+protected:
+	static volatile LONG * RefOf(NodeType *pEntry)
+	{
+		return reinterpret_cast<volatile LONG *>(&pEntry->dwRef);
+	}
+
+	// Takes a reference on a live entry.  Fails if the entry is being
+	// destroyed.
+	static bool TryAddRef(NodeType *pEntry)
+	{
+		volatile LONG *plRef = RefOf(pEntry);
+		for (;;)
 		{
-			return hrShut;
+			LONG lRef = *plRef;
+			if (lRef < 0)
+				return false;
+			if (InterlockedCompareExchange(plRef, lRef+1, lRef) == lRef)
+				return true;
 		}
-		return hrCache;
 	}
-	// IUnknown methods
-	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv)
+
+	// Must be called inside an epoch or with the lock held
+	NodeType * FindAndAddRef(const keyType &Key, UINT nHash)
 	{
-		HRESULT hr = E_NOINTERFACE;
-		if (!ppv)
-			hr = E_POINTER;
-		else
+		NodeType *pNode = static_cast<NodeType *>(m_rgBuckets[nHash & (t_nBuckets-1)]);
+		while (pNode)
 		{
-			if (InlineIsEqualGUID(riid, __uuidof(IUnknown)) ||
-				InlineIsEqualGUID(riid, __uuidof(IMemoryCache)))
-			{
-				*ppv = (IUnknown *) (IMemoryCache *) this;
-				AddRef();
-				hr = S_OK;
-			}
-			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheStats)))
-			{
-				*ppv = (IUnknown *) (IMemoryCacheStats*)this;
-				AddRef();
-				hr = S_OK;
-			}
-			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheControl)))
+			if (pNode->nHash == nHash && 
+				KeyTrait::CompareElements(pNode->Key, Key) &&
+				TryAddRef(pNode))
 			{
-				*ppv = (IUnknown *) (IMemoryCacheControl*)this;
-				AddRef();
-				hr = S_OK;
+				if (pNode->pos != NULL)
+					return pNode;
+
+				// removed after we found it
+				ReleaseEntry(static_cast<HCACHEITEM>(pNode));
 			}
+			pNode = static_cast<NodeType *>(pNode->pNextRead);
+		}
+		return NULL;
+	}
 
+	int EnterEpoch()
+	{
+		// thread ids are multiples of four
+		DWORD nStart = GetCurrentThreadId() >> 2;
+		for (DWORD i=0; i<ATL_CACHE_EPOCH_SLOTS; i++)
+		{
+			DWORD nSlot = (nStart + i) % ATL_CACHE_EPOCH_SLOTS;
+			if (m_rgEpochSlots[nSlot] == 0 &&
+				InterlockedCompareExchange(&m_rgEpochSlots[nSlot], m_lEpoch, 0) == 0)
+				return (int)nSlot;
 		}
-		return hr;
+		return -1;
 	}
 
-	ULONG STDMETHODCALLTYPE AddRef()
+	void LeaveEpoch(int nSlot)
 	{
-		return 1;
+		InterlockedExchange(&m_rgEpochSlots[nSlot], 0);
 	}
 
-	ULONG STDMETHODCALLTYPE Release()
+	// Queues a hit for ApplyAccesses.  The caller holds a reference on the
+	// entry, so it cannot be destroyed before the pointer is stored.
+	void RecordAccess(NodeType *pEntry)
 	{
-		return 1;
+		CAccessStripe &stripe = m_rgAccessStripes[(GetCurrentThreadId() >> 2) % ATL_CACHE_ACCESS_STRIPES];
+		if (stripe.lCount >= ATL_CACHE_ACCESS_BUFFER)
+			return;
+
+		LONG lSlot = InterlockedIncrement(&stripe.lCount) - 1;
+		if (lSlot < ATL_CACHE_ACCESS_BUFFER)
+			InterlockedExchangePointer(&stripe.rgpNodes[lSlot], pEntry);
 	}
 
-	// IMemoryCache Methods
-	HRESULT STDMETHODCALLTYPE Add(LPCSTR szKey, void *pvData, DWORD dwSize, 
-		FILETIME *pftExpireTime, 
-		HINSTANCE hInstClient,
-		HCACHEITEM *phEntry,
-		IMemoryCacheClient *pClient)
+	// The following functions are called with the lock held
+
+	void LinkNode(NodeType *pEntry)
 	{
-		HRESULT hr = E_FAIL;
-		//if it's a multithreaded cache monitor we'll let the monitor take care of
-		//cleaning up the cache so we don't overflow our configuration settings.
-		//if it's not a threaded cache monitor, we need to make sure we don't
-		//overflow the configuration settings by adding a new element
-		if (m_Monitor.GetThreadHandle()==NULL)
+		void * volatile *ppBucket = &m_rgBuckets[pEntry->nHash & (t_nBuckets-1)];
+		pEntry->pNextRead = *ppBucket;
+		InterlockedExchangePointer(ppBucket, pEntry);
+	}
+
+	// Readers positioned on the entry can still follow its pNextRead
+	void UnlinkNode(NodeType *pEntry)
+	{
+		void * volatile *ppLink = &m_rgBuckets[pEntry->nHash & (t_nBuckets-1)];
+		while (*ppLink)
 		{
-			if (!cacheBase::CanAddEntry(dwSize))
+			NodeType *pNode = static_cast<NodeType *>(*ppLink);
+			if (pNode == pEntry)
 			{
-				//flush the entries and check again to see if we can add
-				cacheBase::FlushEntries();
-				if (!cacheBase::CanAddEntry(dwSize))
-					return E_OUTOFMEMORY;
+				InterlockedExchangePointer(ppLink, pEntry->pNextRead);
+				return;
 			}
-		}
-		_ATLTRY
-		{
-			hr = cacheBase::AddEntry(szKey, pvData, dwSize,
-				pftExpireTime, hInstClient, pClient, phEntry);
-			return hr;
-		}
-		_ATLCATCHALL()
-		{
-			return E_FAIL;
+			ppLink = &pNode->pNextRead;
 		}
 	}
 
-	HRESULT STDMETHODCALLTYPE LookupEntry(LPCSTR szKey, HCACHEITEM * phEntry)
+	HRESULT RemoveAt(POSITION pos, BOOL bDelete)
 	{
-		return cacheBase::LookupEntry(szKey, phEntry);
+		ATLASSERT(pos != NULL);
+		NodeType * pEntry = m_hashTable.GetValueAt(pos);
+		m_flusher.Remove(pEntry);
+		m_culler.Remove(pEntry);
+		UnlinkNode(pEntry);
+		if (bDelete)
+			m_hashTable.RemoveAtPos(pos);
+
+		// clear pos before trying to destroy the entry, so that a release
+		// racing with us either sees it or loses the race to KillNode
+		pEntry->pos = NULL;
+		KillNode(pEntry);
+
+		return S_OK;
 	}
 
-	HRESULT STDMETHODCALLTYPE GetData(const HCACHEITEM hKey, void **ppvData, DWORD *pdwSize) const
+	// Destroys an unreferenced entry that is no longer in the cache and
+	// queues its memory for reclamation
+	void KillNode(NodeType *pEntry)
 	{
-		return cacheBase::GetEntryData(hKey, ppvData, pdwSize);
+		ATLENSURE(pEntry != NULL);
+
+		if (InterlockedCompareExchange(RefOf(pEntry), c_lDeadRef, 0) != 0)
+			return;
+
+		T* pT = static_cast<T*>(this);
+		pT->OnDestroyEntry(pEntry);
+
+		m_statObj.ReleaseElement(pEntry->dwSize);
+
+		pEntry->lRetireEpoch = m_lEpoch;
+		if (InterlockedIncrement(&m_lEpoch) == 0)
+			InterlockedIncrement(&m_lEpoch);
+
+		pEntry->pNextRetired = m_pRetired;
+		m_pRetired = pEntry;
 	}
 
-	HRESULT STDMETHODCALLTYPE ReleaseEntry(const HCACHEITEM hKey)
+	void ReclaimRetired(BOOL bAll)
 	{
-		return cacheBase::ReleaseEntry(hKey);
+		LONG lOldest = m_lEpoch;
+		if (!bAll)
+		{
+			for (DWORD i=0; i<ATL_CACHE_EPOCH_SLOTS; i++)
+			{
+				LONG lSlot = m_rgEpochSlots[i];
+				if (lSlot != 0 && (LONG)(lSlot - lOldest) < 0)
+					lOldest = lSlot;
+			}
+		}
+
+		// Hits recorded after this drain come from threads holding a
+		// reference, so their entries are not on the retired list yet
+		if (m_pRetired != NULL)
+			ApplyAccesses();
+
+		NodeType *pPrev = NULL;
+		NodeType *pNode = m_pRetired;
+		while (pNode)
+		{
+			NodeType *pNext = static_cast<NodeType *>(pNode->pNextRetired);
+			if (bAll || (LONG)(lOldest - pNode->lRetireEpoch) > 0)
+			{
+				if (pPrev)
+					pPrev->pNextRetired = pNext;
+				else
+					m_pRetired = pNext;
+				delete pNode;
+			}
+			else
+				pPrev = pNode;
+			pNode = pNext;
+		}
 	}
 
-	HRESULT STDMETHODCALLTYPE RemoveEntry(const HCACHEITEM hKey)
+	// Passes the queued hits to the flusher and culler.  Every slot is
+	// cleared, including ones filled after their buffer's count was read,
+	// so no pointer survives a drain that precedes reclamation.
+	void ApplyAccesses()
 	{
-		return cacheBase::RemoveEntry(hKey);
+		for (DWORD i=0; i<ATL_CACHE_ACCESS_STRIPES; i++)
+		{
+			CAccessStripe &stripe = m_rgAccessStripes[i];
+			for (DWORD j=0; j<ATL_CACHE_ACCESS_BUFFER; j++)
+			{
+				NodeType *pNode = static_cast<NodeType *>(InterlockedExchangePointer(&stripe.rgpNodes[j], NULL));
+
+				// entries removed since the hit are off the flusher's lists
+				if (pNode != NULL && pNode->pos != NULL)
+				{
+					m_flusher.Access(pNode);
+					m_culler.Access(pNode);
+				}
+			}
+			InterlockedExchange(&stripe.lCount, 0);
+		}
 	}
+}; // CReadMostlyMemoryCacheBase
 
-	HRESULT STDMETHODCALLTYPE RemoveEntryByKey(LPCSTR szKey)
+//
+//CReadMostlyMemoryCache
+// Description:
+//  The read-mostly counterpart of CMemoryCache.
+template <typename DataType, 
+		class StatClass=CStdStatClass,
+		class FlushClass=COldFlusher,
+		class keyType=CFixedStringKey,  class KeyTrait=CStringElementTraits<CFixedStringKey >,
+		class SyncClass=CComCriticalSection,
+		class CullClass=CExpireCuller,
+		DWORD t_nBuckets=ATL_CACHE_READ_BUCKETS >
+class CReadMostlyMemoryCache:
+	public CReadMostlyMemoryCacheBase<CReadMostlyMemoryCache<DataType, StatClass, FlushClass, keyType, KeyTrait, SyncClass, CullClass, t_nBuckets>, DataType, CCacheDataEx, 
+		keyType, KeyTrait, FlushClass, CullClass, SyncClass, StatClass, t_nBuckets>
+{
+protected:
+	CComPtr<IServiceProvider> m_spServiceProv;
+	CComPtr<IDllCache> m_spDllCache;
+	typedef CReadMostlyMemoryCacheBase<CReadMostlyMemoryCache<DataType, StatClass, FlushClass, keyType, KeyTrait, SyncClass, CullClass, t_nBuckets>, DataType, CCacheDataEx, 
+		keyType, KeyTrait, FlushClass, CullClass, SyncClass, StatClass, t_nBuckets> baseClass;
+public:
+	virtual ~CReadMostlyMemoryCache()
 	{
-		return cacheBase::RemoveEntryByKey(szKey);
 	}
 
-	HRESULT STDMETHODCALLTYPE Flush()
+	HRESULT Initialize(IServiceProvider * pProvider)
 	{
-		return cacheBase::FlushEntries();
+		baseClass::Initialize();
+		m_spServiceProv = pProvider;
+		if (pProvider)
+			return m_spServiceProv->QueryService(__uuidof(IDllCache), __uuidof(IDllCache), (void**)&m_spDllCache);
+		else
+			return S_OK;
 	}
 
-
-	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize(DWORD dwSize)
+	HRESULT AddEntry(
+					const keyType &Key,
+					const DataType &data,
+					DWORD dwSize,
+					FILETIME * pftExpireTime = NULL,
+					HINSTANCE hInstance = NULL,
+					IMemoryCacheClient * pClient = NULL,
+					HCACHEITEM *phEntry = NULL
+					)
 	{
-		return cacheBase::SetMaxAllowedSize(dwSize);
+		_ATLTRY
+		{
+			HRESULT hr;
+			NodeType * pEntry = NULL;
+			hr = baseClass::AddEntry(Key, data, dwSize, (HCACHEITEM *)&pEntry);
+			if (hr != S_OK)
+				return hr;
+
+			pEntry->hInstance = hInstance;
+			pEntry->pClient = pClient;
+			if (pftExpireTime)
+				pEntry->cftExpireTime = *pftExpireTime;
+
+			if (hInstance && m_spDllCache)
+				m_spDllCache->AddRefModule(hInstance);
+
+			baseClass::CommitEntry(static_cast<HCACHEITEM>(pEntry));
+
+			if (phEntry)
+				*phEntry = static_cast<HCACHEITEM>(pEntry);
+			else
+				baseClass::ReleaseEntry(static_cast<HCACHEITEM>(pEntry));
+
+			return S_OK;
+		}
+		_ATLCATCHALL()
+		{
+			return E_FAIL;
+		}
 	}
 
-	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize(DWORD *pdwSize)
+	virtual void OnDestroyEntry(const void * pEntry_)
 	{
-		return cacheBase::GetMaxAllowedSize(pdwSize);
+		const NodeType* pEntry = (const NodeType*)pEntry_;
+		ATLASSERT(pEntry);
+		if (!pEntry)
+			return;
+
+		if (pEntry->pClient)
+			pEntry->pClient->Free((void *)&pEntry->Data);
+		if (pEntry->hInstance && m_spDllCache)
+			m_spDllCache->ReleaseModule(pEntry->hInstance);
 	}
+}; // CReadMostlyMemoryCache
 
-	HRESULT STDMETHODCALLTYPE SetMaxAllowedEntries(DWORD dwSize)
+#ifndef ATL_CACHE_SHARD_COUNT
+#define ATL_CACHE_SHARD_COUNT 16
+#endif
+
+// Node information for entries in a sharded cache -- records which
+// segment owns the entry so that handle based operations can be
+// routed without looking the key up again
+template <class NodeInfo>
+struct CCacheDataShard : public NodeInfo
+{
+	CCacheDataShard()
 	{
-		return cacheBase::SetMaxAllowedEntries(dwSize);
+		nShard = 0;
 	}
 
-	HRESULT STDMETHODCALLTYPE GetMaxAllowedEntries(DWORD *pdwSize)
+	DWORD nShard;
+};
+
+//
+//CShardStatClass
+// Description:
+//  The statistics class of a single CMemoryCacheShard.  The segment keeps
+//  its own entry count and allocation size, which its share of the cache
+//  limits are checked against, and reports every event to the one
+//  StatClass instance owned by the sharded cache.  The local counters are
+//  only updated with the segment's lock held.
+template <class StatClass>
+class CShardStatClass
+{
+	StatClass *m_pOwnerStats;
+	DWORD m_nCurrentEntries;
+	ULONGLONG m_nCurrentAllocations;
+
+public:
+	CShardStatClass() :
+		m_pOwnerStats(NULL),
+		m_nCurrentEntries(0),
+		m_nCurrentAllocations(0)
 	{
-		return cacheBase::GetMaxAllowedEntries(pdwSize);
 	}
 
-	HRESULT STDMETHODCALLTYPE ResetCache()
+	void SetOwnerStats(StatClass *pOwnerStats)
 	{
-		return cacheBase::ResetCache();
+		m_pOwnerStats = pOwnerStats;
 	}
 
-	// IMemoryCacheStats methods
-	HRESULT STDMETHODCALLTYPE ClearStats()
+	// the owner initializes its StatClass once for all of the segments
+	HRESULT Initialize()
 	{
-		m_statObj.ResetCounters();
+		ATLASSUME(m_pOwnerStats != NULL);
+		m_nCurrentEntries = 0;
+		m_nCurrentAllocations = 0;
 		return S_OK;
 	}
 
-	HRESULT STDMETHODCALLTYPE GetHitCount(DWORD *pdwSize)
+	HRESULT Uninitialize()
 	{
-		if (!pdwSize)
-			return E_POINTER;
-		*pdwSize = m_statObj.GetHitCount();
 		return S_OK;
 	}
 
-	HRESULT STDMETHODCALLTYPE GetMissCount(DWORD *pdwSize)
+	void Hit()
 	{
-		if (!pdwSize)
-			return E_POINTER;
-		*pdwSize = m_statObj.GetMissCount();
-		return S_OK;
+		m_pOwnerStats->Hit();
 	}
 
-	HRESULT STDMETHODCALLTYPE GetMaxAllocSize(DWORD *pdwSize)
+	void Miss()
 	{
-		if (!pdwSize)
-			return E_POINTER;
-		*pdwSize = m_statObj.GetMaxAllocSize();
-		return S_OK;
+		m_pOwnerStats->Miss();
 	}
 
-	HRESULT STDMETHODCALLTYPE GetCurrentAllocSize(DWORD *pdwSize)
+	void AddElement(ULONGLONG nBytes)
 	{
-		if (!pdwSize)
-			return E_POINTER;
-		*pdwSize = m_statObj.GetCurrentAllocSize();
-		return S_OK;
+		m_nCurrentEntries++;
+		m_nCurrentAllocations += nBytes;
+		m_pOwnerStats->AddElement(nBytes);
 	}
 
-	HRESULT STDMETHODCALLTYPE GetMaxEntryCount(DWORD *pdwSize)
+	void ReleaseElement(ULONGLONG nBytes)
 	{
-		if (!pdwSize)
-			return E_POINTER;
-		*pdwSize = m_statObj.GetMaxEntryCount();
-		return S_OK;
+		m_nCurrentEntries--;
+		m_nCurrentAllocations -= nBytes;
+		m_pOwnerStats->ReleaseElement(nBytes);
 	}
 
-	HRESULT STDMETHODCALLTYPE GetCurrentEntryCount(DWORD *pdwSize)
+	DWORD GetHitCount()
 	{
-		if (!pdwSize)
-			return E_POINTER;
-		*pdwSize = m_statObj.GetCurrentEntryCount();
-		return S_OK;
+		return m_pOwnerStats->GetHitCount();
 	}
 
-}; // CBlobCache
+	DWORD GetMissCount()
+	{
+		return m_pOwnerStats->GetMissCount();
+	}
 
+	ULONGLONG GetCurrentAllocSize()
+	{
+		return m_nCurrentAllocations;
+	}
 
-//
-// CDllCache
-// This class manages a cache to handle calls to LoadLibrary
-// and FreeLibrary.  
-// It keeps dlls loaded even after the last call to free library
-// a worker thread then calls FreeLibrary on unused dlls
-//
-#ifndef ATL_DLL_CACHE_TIMEOUT
-	#ifdef _DEBUG
-		#define ATL_DLL_CACHE_TIMEOUT   1000        // 1 sec default for debug builds
-	#else
-		#define ATL_DLL_CACHE_TIMEOUT   10*60000    // 10 minute default for retail builds
-	#endif
-#endif
+	ULONGLONG GetMaxAllocSize()
+	{
+		return m_pOwnerStats->GetMaxAllocSize();
+	}
 
-class CNoDllCachePeer
-{
-public:
-	struct DllInfo
+	DWORD GetCurrentEntryCount()
 	{
-	};
+		return m_nCurrentEntries;
+	}
 
-	BOOL Add(HINSTANCE /*hInst*/, DllInfo * /*pInfo*/)
+	DWORD GetMaxEntryCount()
 	{
-		return TRUE;
+		return m_pOwnerStats->GetMaxEntryCount();
 	}
 
-	void Remove(HINSTANCE /*hInst*/, DllInfo * /*pInfo*/)
+	// the owner's counters are reset by the sharded cache; the segment
+	// totals stay exact because its limits depend on them
+	void ResetCounters()
 	{
 	}
-};
+}; // CShardStatClass
 
-// CDllCache
-// Implements IDllCache, an interface that is used to load and unload Dlls.
-// To use it, construct an instance of a CDllCache and call Initialize.
-// The Initialize call has to match with the type of monitor class you 
-// templatize on. The monitor thread will call IWorkerThreadClient::Execute
-// after its timeout expires. Make sure to Uninitialize the object before
-// it is destroyed by calling Uninitialize
 //
-template <class MonitorClass, class Peer=CNoDllCachePeer>
-class CDllCache : public IDllCache, 
-	public IWorkerThreadClient
+//CMemoryCacheShard
+// Description:
+//  A single independently locked segment of a CShardedMemoryCacheBase.
+//  Each segment has its own hash table, flusher, culler and
+//  synchronization object, and reports its statistics to the owning
+//  cache through CShardStatClass.  Entry destruction is forwarded to
+//  the owning cache.
+template <class TOwner,
+		 class DataType,
+		 class NodeInfo,
+		 class keyType,
+		 class KeyTrait,
+		 class Flusher,
+		 class Culler,
+		 class SyncClass,
+		 class StatClass >
+class CMemoryCacheShard :
+	public CMemoryCacheBase<CMemoryCacheShard<TOwner, DataType, NodeInfo, keyType, KeyTrait, Flusher, Culler, SyncClass, StatClass>, 
+		DataType, CCacheDataShard<NodeInfo>, keyType, KeyTrait, Flusher, Culler, SyncClass, CShardStatClass<StatClass> >
 {
-protected:
-	CComCriticalSection m_critSec;
-	CSimpleArray<DLL_CACHE_ENTRY> m_Dlls;
-	CSimpleArray<typename Peer::DllInfo> m_DllInfos;
-	MonitorClass m_Monitor;
-	HANDLE m_hTimer;
+public:
+	typedef CMemoryCacheBase<CMemoryCacheShard<TOwner, DataType, NodeInfo, keyType, KeyTrait, Flusher, Culler, SyncClass, StatClass>, 
+		DataType, CCacheDataShard<NodeInfo>, keyType, KeyTrait, Flusher, Culler, SyncClass, CShardStatClass<StatClass> > baseClass;
+	typedef typename baseClass::NodeType NodeType;
 
-	void RemoveDllEntry(DLL_CACHE_ENTRY& entry)
+	TOwner *m_pOwner;
+	DWORD m_nShard;
+
+	CMemoryCacheShard() :
+		m_pOwner(NULL),
+		m_nShard(0)
 	{
-		::FreeLibrary(entry.hInstDll);
-		entry.hInstDll = NULL;
-		m_Dlls.RemoveAt(m_Dlls.GetSize()-1);
 	}
 
-public:
-	Peer m_Peer;
-
-	CDllCache() :
-		m_hTimer(NULL)
-	{
-
-	}
-
-	HRESULT Initialize(DWORD dwTimeout=ATL_DLL_CACHE_TIMEOUT)
+	// Adds an entry and stamps it with the index of this segment before
+	// any other thread can obtain a handle to it
+	HRESULT AddEntry(const keyType &Key, const DataType &data, DWORD dwSize, HCACHEITEM *phEntry = NULL)
 	{
-		HRESULT hr = m_critSec.Init();
-		if (FAILED(hr))
-			return hr;
-		hr = m_Monitor.Initialize();
+		CComCritSecLock<SyncClass> lock(m_syncObj, false);
+		HRESULT hr = lock.Lock();
 		if (FAILED(hr))
 			return hr;
-		return m_Monitor.AddTimer(dwTimeout, this, 0, &m_hTimer);
-	}
 
-	template <class ThreadTraits>
-	HRESULT Initialize(CWorkerThread<ThreadTraits> *pWorkerThread,
-			DWORD dwTimeout=ATL_DLL_CACHE_TIMEOUT)
-	{
-		HRESULT hr = m_critSec.Init();
-		if (FAILED(hr))
-			return hr;
-		hr = m_Monitor.Initialize(pWorkerThread);
-		if (FAILED(hr))
+		NodeType *pEntry = NULL;
+		hr = baseClass::AddEntry(Key, data, dwSize, (HCACHEITEM *)&pEntry);
+		if (hr != S_OK)
 			return hr;
-		return m_Monitor.AddTimer(dwTimeout, this, 0, &m_hTimer);
-	}
 
-	HRESULT Uninitialize()
-	{
-		HRESULT hr = S_OK;
-		HRESULT hrLatest = S_OK;
-		if (m_hTimer)
-		{
-			hrLatest=m_Monitor.RemoveHandle(m_hTimer);
-			if(FAILED(hrLatest) && SUCCEEDED(hr))
-			{
-				hr=hrLatest;
-			}
-			m_hTimer = NULL;
-		}
-		m_Monitor.Shutdown();
+		pEntry->nShard = m_nShard;
 
-		// free all the libraries we've cached
-		int nLen = m_Dlls.GetSize();
-		for (int i=0; i<nLen; i++)
+		if (phEntry)
+			*phEntry = static_cast<HCACHEITEM>(pEntry);
+		else
 		{
-			DLL_CACHE_ENTRY& entry = m_Dlls[i];
-			ATLASSERT(entry.dwRefs == 0);
-			BOOL bRet = ::FreeLibrary(entry.hInstDll);
-
-			if (!bRet)
-			{
-				hrLatest = AtlHresultFromLastError();
-				if(FAILED(hrLatest) && SUCCEEDED(hr))
-				{
-					hr=hrLatest;
-				}
-				ATLTRACE(atlTraceCache, 0, _T("Free library failed on shutdown of dll cache : hr = 0x%08x)"), hr);
-			}
+			hr = baseClass::CommitEntry(static_cast<HCACHEITEM>(pEntry));
+			baseClass::ReleaseEntry(static_cast<HCACHEITEM>(pEntry));
 		}
-		m_Dlls.RemoveAll();
-		m_critSec.Term();
 		return hr;
-
 	}
 
-	// IUnknown methods
-	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv)
+	SyncClass& GetSyncObj()
 	{
-		if (!ppv)
-			return E_POINTER;
-		if (InlineIsEqualGUID(riid, __uuidof(IUnknown)) ||
-			InlineIsEqualGUID(riid, __uuidof(IDllCache)))
-		{
-			*ppv = (IUnknown *) this;
-			AddRef();
-			return S_OK;
-		}
-		return E_NOINTERFACE;
+		return m_syncObj;
 	}
 
-	ULONG STDMETHODCALLTYPE AddRef()
+	CShardStatClass<StatClass>& GetStatObj()
 	{
-		return 1;
+		return m_statObj;
 	}
 
-	ULONG STDMETHODCALLTYPE Release()
+	bool CanAddEntry(ULONGLONG nSizeToAdd)
 	{
-		return 1;
+		return baseClass::CanAddEntry(nSizeToAdd);
 	}
 
-	// IDllCache methods
-	HINSTANCE Load(LPCSTR szDllName, void *pPeerInfo)
+	void OnDestroyEntry(const void *pEntry)
 	{
-		HRESULT hr = m_critSec.Lock();
-		if (FAILED(hr))
-			return NULL;
-
-		int nLen = m_Dlls.GetSize();
-		for (int i=0; i<nLen; i++)
-		{
-			DLL_CACHE_ENTRY& entry = m_Dlls[i];
-			if (!_stricmp(entry.szDllName, szDllName))
-			{
-				entry.dwRefs++;
-				m_critSec.Unlock();
-				if (pPeerInfo)
-				{
-					Peer::DllInfo *pl = (Peer::DllInfo*)pPeerInfo;
-					*pl = m_DllInfos[i];
-				}
-				return entry.hInstDll;
-			}
-		}
-		DLL_CACHE_ENTRY entry;
-		entry.hInstDll = ::LoadLibraryA(szDllName);
-		if (!entry.hInstDll)
-		{
-			m_critSec.Unlock();
-			return NULL;
-		}
-		if (!SafeStringCopy(entry.szDllName, szDllName))
-		{
-			::FreeLibrary(entry.hInstDll);
-			m_critSec.Unlock();
-			return NULL;
-		}
-		entry.dwRefs = 1;
-		entry.bAlive = TRUE;
-		m_Dlls.Add(entry);
+		ATLASSUME(m_pOwner != NULL);
+		m_pOwner->OnDestroyEntry(pEntry);
+	}
+}; // CMemoryCacheShard
 
-		Peer::DllInfo *pdllInfo = (Peer::DllInfo*)pPeerInfo;
+//
+//CShardedMemoryCacheBase
+// Description:
+//  A drop-in alternative to CMemoryCacheBase for caches that are looked up
+//  concurrently from many threads.  Keys are hashed to one of t_nShards
+//  segments (see CMemoryCacheShard), each protected by its own SyncClass
+//  instance, so lookups and releases on different segments do not contend.
+//  Handles returned by this class remember their segment, so ReleaseEntry,
+//  AddRefEntry and RemoveEntry only lock the segment owning the entry.
+//
+//  The configured maximum allocation size and entry count are divided evenly
+//  between the segments.  Statistics are kept in a single StatClass instance
+//  that all of the segments report to, so a CPerfStatClass registers one
+//  performance instance for the whole cache.
+//
+// Template Parameters:
+//  Same as CMemoryCacheBase, plus
+//  t_nShards: the number of independently locked segments
+template <class T,
+		 class DataType,
+		 class NodeInfo=CCacheDataBase,
+		 class keyType=CFixedStringKey,
+		 class KeyTrait=CStringElementTraits<CFixedStringKey >,
+		 class Flusher=COldFlusher,
+		 class Culler=CExpireCuller,
+		 class SyncClass=CComCriticalSection,
+		 class StatClass=CStdStatClass,
+		 DWORD t_nShards=ATL_CACHE_SHARD_COUNT >
+class CShardedMemoryCacheBase
+{
+protected:
+	typedef CMemoryCacheShard<T, DataType, NodeInfo, keyType, KeyTrait, Flusher, Culler, SyncClass, StatClass> shardType;
+	typedef typename shardType::NodeType NodeType;
 
-		// m_Peer could throw an exception from user code. We
-		// pass that exception from here to a higher context (we
-		// won't deal with user exception here).
-		if (!m_Peer.Add(entry.hInstDll, pdllInfo))
-		{
-			RemoveDllEntry(entry);
-		}
+	shardType m_shards[t_nShards];
+	StatClass m_statObj;
 
+	//memory cache configuration parameters
+	ULONGLONG m_nMaxAllocationSize;
+	ULONGLONG m_nLowWaterSize;
+	DWORD m_dwMaxEntries;
 
-		if ((entry.hInstDll != NULL) && (!m_DllInfos.Add(*pdllInfo)))
-		{
-			RemoveDllEntry(entry);
-		}
+	BOOL m_bInitialized;
 
-		m_critSec.Unlock();
-		return entry.hInstDll;
+public:
+	CShardedMemoryCacheBase() :
+	  m_nMaxAllocationSize(ATL_CACHE_SIZE_UNLIMITED),
+	  m_nLowWaterSize(ATL_CACHE_SIZE_UNLIMITED),
+	  m_dwMaxEntries(0xFFFFFFFF),
+	  m_bInitialized(FALSE)
+	{
+		C_ASSERT(t_nShards > 0);
 	}
 
-	BOOL Free(HINSTANCE hInstDll)
+	HRESULT Initialize()
 	{
-		HRESULT hr = m_critSec.Lock();
+		if (m_bInitialized)
+			return HRESULT_FROM_WIN32(ERROR_ALREADY_INITIALIZED);
+
+		HRESULT hr = m_statObj.Initialize();
 		if (FAILED(hr))
-			return FALSE;
+			return hr;
 
-		int nLen = m_Dlls.GetSize();
-		for (int i=0; i<nLen; i++)
+		T* pT = static_cast<T*>(this);
+		for (DWORD i=0; i<t_nShards; i++)
 		{
-			DLL_CACHE_ENTRY &entry = m_Dlls[i];
-			if (entry.hInstDll == hInstDll)
+			m_shards[i].m_pOwner = pT;
+			m_shards[i].m_nShard = i;
+			m_shards[i].GetStatObj().SetOwnerStats(&m_statObj);
+			hr = m_shards[i].Initialize();
+			if (FAILED(hr))
 			{
-				ATLASSERT(entry.dwRefs > 0);
-				entry.bAlive = TRUE;
-				entry.dwRefs--;
-				m_critSec.Unlock();
-				return TRUE;
+				while (i--)
+					m_shards[i].Uninitialize();
+				m_statObj.Uninitialize();
+				return hr;
 			}
 		}
 
-		m_critSec.Unlock();
-		// the dll wasn't found
-		// in the cache, so just
-		// pass along to ::FreeLibrary
-		return ::FreeLibrary(hInstDll);
+		m_bInitialized = TRUE;
+		return hr;
 	}
 
-	BOOL AddRefModule(HINSTANCE hInstDll)
+	HRESULT Uninitialize()
 	{
-		HRESULT hr = m_critSec.Lock();
-		if (FAILED(hr))
-			return FALSE;
+		if (!m_bInitialized)
+			return S_OK;
 
-		int nLen = m_Dlls.GetSize();
-		for (int i=0; i<nLen; i++)
+		HRESULT hr = S_OK;
+		for (DWORD i=0; i<t_nShards; i++)
 		{
-			DLL_CACHE_ENTRY &entry = m_Dlls[i];
-			if (entry.hInstDll == hInstDll)
-			{
-				ATLASSERT(entry.dwRefs > 0);
-				entry.dwRefs++;
-				m_critSec.Unlock();
-				return TRUE;
-			}
+			HRESULT hrShard = m_shards[i].Uninitialize();
+			if (FAILED(hrShard) && SUCCEEDED(hr))
+				hr = hrShard;
 		}
+		m_statObj.Uninitialize();
 
-		m_critSec.Unlock();
-		return FALSE;
+		m_bInitialized = FALSE;
+		return hr;
 	}
 
-	BOOL ReleaseModule(HINSTANCE hInstDll)
+	HRESULT AddEntry(
+					const keyType &Key,
+					const DataType &data,
+					DWORD dwSize,
+					HCACHEITEM *phEntry = NULL
+					)
 	{
-		HRESULT hr = m_critSec.Lock();
-		if (FAILED(hr))
-			return FALSE;
+		ATLASSUME(m_bInitialized);
+		return GetShard(Key).AddEntry(Key, data, dwSize, phEntry);
+	}
 
-		int nLen = m_Dlls.GetSize();
-		for (int i=0; i<nLen; i++)
-		{
-			DLL_CACHE_ENTRY &entry = m_Dlls[i];
-			if (entry.hInstDll == hInstDll)
-			{
-				ATLASSERT(entry.dwRefs > 0);
-				entry.bAlive = TRUE;
-				entry.dwRefs--;
-				m_critSec.Unlock();
-				return TRUE;
-			}
-		}
-		m_critSec.Unlock();
-		return FALSE;
+	HRESULT CommitEntry(const HCACHEITEM hEntry)
+	{
+		ATLASSUME(m_bInitialized);
+		if (!hEntry || hEntry == INVALID_HANDLE_VALUE)
+			return E_INVALIDARG;
+
+		return GetShard(hEntry).CommitEntry(hEntry);
 	}
 
-	HRESULT GetEntries(DWORD dwCount, DLL_CACHE_ENTRY *pEntries, DWORD *pdwCopied)
+	HRESULT LookupEntry(const keyType &Key, HCACHEITEM * phEntry)
+	{
+		ATLASSUME(m_bInitialized);
+		return GetShard(Key).LookupEntry(Key, phEntry);
+	}
+
+	HRESULT GetEntryData(const HCACHEITEM hEntry, DataType *pData, DWORD *pdwSize) const
+	{
+		ATLASSUME(m_bInitialized);
+		ATLASSERT(pData != NULL || pdwSize != NULL);  // At least one should not be NULL
+
+		if (!hEntry || hEntry == INVALID_HANDLE_VALUE)
+			return E_INVALIDARG;
+
+		const NodeType * pEntry = static_cast<const NodeType *>(hEntry);
+		if (pData)
+			*pData = pEntry->Data;
+		if (pdwSize)
+			*pdwSize = pEntry->dwSize;
+
+		return S_OK;
+	}
+
+	DWORD ReleaseEntry(const HCACHEITEM hEntry)
+	{
+		ATLASSUME(m_bInitialized);
+		if (!hEntry || hEntry == INVALID_HANDLE_VALUE)
+			return (DWORD)-1;
+
+		return GetShard(hEntry).ReleaseEntry(hEntry);
+	}
+
+	DWORD AddRefEntry(const HCACHEITEM hEntry)
+	{
+		ATLASSUME(m_bInitialized);
+		if (!hEntry || hEntry == INVALID_HANDLE_VALUE)
+			return (DWORD)-1;
+
+		return GetShard(hEntry).AddRefEntry(hEntry);
+	}
+
+	HRESULT RemoveEntryByKey(const keyType &Key)
+	{
+		ATLASSUME(m_bInitialized);
+		return GetShard(Key).RemoveEntryByKey(Key);
+	}
+
+	HRESULT RemoveEntry(const HCACHEITEM hEntry)
+	{
+		ATLASSUME(m_bInitialized);
+		if (!hEntry || hEntry == INVALID_HANDLE_VALUE)
+			return E_INVALIDARG;
+
+		return GetShard(hEntry).RemoveEntry(hEntry);
+	}
+
+	// CullEntries removes all expired items, one segment at a time
+	HRESULT CullEntries()
+	{
+		ATLASSUME(m_bInitialized);
+		HRESULT hr = S_OK;
+		for (DWORD i=0; i<t_nShards; i++)
+		{
+			HRESULT hrShard = m_shards[i].CullEntries();
+			if (FAILED(hrShard) && SUCCEEDED(hr))
+				hr = hrShard;
+		}
+		return hr;
+	}
+
+	// FlushEntries reduces each segment to meet its share of the
+	// configuration requirements
+	HRESULT FlushEntries()
+	{
+		ATLASSUME(m_bInitialized);
+		HRESULT hr = S_OK;
+		for (DWORD i=0; i<t_nShards; i++)
+		{
+			HRESULT hrShard = m_shards[i].FlushEntries();
+			if (FAILED(hrShard) && SUCCEEDED(hr))
+				hr = hrShard;
+		}
+		return hr;
+	}
+
+	// 0xFFFFFFFF removes the limit
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize(DWORD dwSize)
+	{
+		return SetMaxAllowedSize64((dwSize == 0xFFFFFFFF) ? ATL_CACHE_SIZE_UNLIMITED : dwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = AtlCacheSizeToDWORD(m_nMaxAllocationSize);
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize64(ULONGLONG nSize)
+	{
+		m_nMaxAllocationSize = nSize;
+		ULONGLONG nShardSize = GetShardSizeLimit(nSize);
+		for (DWORD i=0; i<t_nShards; i++)
+			m_shards[i].SetMaxAllowedSize64(nShardSize);
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = m_nMaxAllocationSize;
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE SetLowWaterSize(ULONGLONG nSize)
+	{
+		m_nLowWaterSize = nSize;
+		ULONGLONG nShardSize = GetShardSizeLimit(nSize);
+		for (DWORD i=0; i<t_nShards; i++)
+			m_shards[i].SetLowWaterSize(nShardSize);
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetLowWaterSize(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = m_nLowWaterSize;
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedEntries(DWORD dwSize)
+	{
+		m_dwMaxEntries = dwSize;
+		DWORD dwShardEntries = GetShardLimit(dwSize);
+		for (DWORD i=0; i<t_nShards; i++)
+			m_shards[i].SetMaxAllowedEntries(dwShardEntries);
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedEntries(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_dwMaxEntries;
+		return S_OK;
+	}
+
+	HRESULT ResetCache()
+	{
+		ATLASSUME(m_bInitialized);
+		HRESULT hr = E_UNEXPECTED;
+		if (SUCCEEDED(ClearStats()))
+			hr = RemoveAllEntries();
+		return hr;
+	}
+
+	HRESULT ClearStats()
+	{
+		m_statObj.ResetCounters();
+		return S_OK;
+	}
+
+	HRESULT RemoveAllEntries()
+	{
+		ATLASSUME(m_bInitialized);
+		HRESULT hr = S_OK;
+		for (DWORD i=0; i<t_nShards; i++)
+		{
+			HRESULT hrShard = m_shards[i].RemoveAllEntries();
+			if (FAILED(hrShard) && SUCCEEDED(hr))
+				hr = hrShard;
+		}
+		return hr;
+	}
+
+	// Statistics for all of the segments
+	DWORD GetHitCount()
+	{
+		return m_statObj.GetHitCount();
+	}
+
+	DWORD GetMissCount()
+	{
+		return m_statObj.GetMissCount();
+	}
+
+	ULONGLONG GetCurrentAllocSize()
+	{
+		return m_statObj.GetCurrentAllocSize();
+	}
+
+	ULONGLONG GetMaxAllocSize()
+	{
+		return m_statObj.GetMaxAllocSize();
+	}
+
+	DWORD GetCurrentEntryCount()
+	{
+		return m_statObj.GetCurrentEntryCount();
+	}
+
+	DWORD GetMaxEntryCount()
+	{
+		return m_statObj.GetMaxEntryCount();
+	}
+
+protected:
+
+	// Checks to see if the segment that will hold Key can accommodate
+	// a new entry within its limits
+	bool CanAddEntry(const keyType &Key, ULONGLONG nSizeToAdd)
+	{
+		return GetShard(Key).CanAddEntry(nSizeToAdd);
+	}
+
+	// Maps a key to its segment.  The key hash is mixed before it is reduced
+	// so that the segment index is independent of the hash table bucket
+	// the segment's CAtlMap picks for the same key.
+	shardType& GetShard(const keyType &Key)
+	{
+		ULONG nHash = KeyTrait::Hash(Key);
+		nHash ^= (nHash >> 16);
+		nHash *= 0x45d9f3b;
+		nHash ^= (nHash >> 16);
+		return m_shards[nHash % t_nShards];
+	}
+
+	// Maps a handle to the segment that owns it
+	shardType& GetShard(const HCACHEITEM hEntry)
+	{
+		const NodeType *pEntry = static_cast<const NodeType *>(hEntry);
+		ATLENSURE(pEntry->nShard < t_nShards);
+		return m_shards[pEntry->nShard];
+	}
+
+	static DWORD GetShardLimit(DWORD dwLimit)
+	{
+		if (dwLimit == 0xFFFFFFFF)
+			return dwLimit;
+		DWORD dwShardLimit = dwLimit / t_nShards;
+		return dwShardLimit ? dwShardLimit : 1;
+	}
+
+	static ULONGLONG GetShardSizeLimit(ULONGLONG nLimit)
+	{
+		if (nLimit == ATL_CACHE_SIZE_UNLIMITED)
+			return nLimit;
+		ULONGLONG nShardLimit = nLimit / t_nShards;
+		return nShardLimit ? nShardLimit : 1;
+	}
+}; // CShardedMemoryCacheBase
+
+//
+//CShardedMemoryCache
+// Description:
+//  The sharded counterpart of CMemoryCache: stores the module instance and
+//  IMemoryCacheClient of each entry and releases them when the entry is
+//  destroyed.
+template <typename DataType, 
+		class StatClass=CStdStatClass,
+		class FlushClass=COldFlusher,
+		class keyType=CFixedStringKey,  class KeyTrait=CStringElementTraits<CFixedStringKey >,
+		class SyncClass=CComCriticalSection,
+		class CullClass=CExpireCuller,
+		DWORD t_nShards=ATL_CACHE_SHARD_COUNT >
+class CShardedMemoryCache:
+	public CShardedMemoryCacheBase<CShardedMemoryCache<DataType, StatClass, FlushClass, keyType, KeyTrait, SyncClass, CullClass, t_nShards>, DataType, CCacheDataEx, 
+		keyType, KeyTrait, FlushClass, CullClass, SyncClass, StatClass, t_nShards>
+{
+protected:
+	CComPtr<IServiceProvider> m_spServiceProv;
+	CComPtr<IDllCache> m_spDllCache;
+	typedef CShardedMemoryCacheBase<CShardedMemoryCache<DataType, StatClass, FlushClass, keyType, KeyTrait, SyncClass, CullClass, t_nShards>, DataType, CCacheDataEx, 
+		keyType, KeyTrait, FlushClass, CullClass, SyncClass, StatClass, t_nShards> baseClass;
+public:
+	virtual ~CShardedMemoryCache()
+	{
+	}
+
+	HRESULT Initialize(IServiceProvider * pProvider)
+	{
+		baseClass::Initialize();
+		m_spServiceProv = pProvider;
+		if (pProvider)
+			return m_spServiceProv->QueryService(__uuidof(IDllCache), __uuidof(IDllCache), (void**)&m_spDllCache);
+		else
+			return S_OK;
+	}
+
+	HRESULT AddEntry(
+					const keyType &Key,
+					const DataType &data,
+					DWORD dwSize,
+					FILETIME * pftExpireTime = NULL,
+					HINSTANCE hInstance = NULL,
+					IMemoryCacheClient * pClient = NULL,
+					HCACHEITEM *phEntry = NULL
+					)
+	{
+		_ATLTRY
+		{
+			HRESULT hr;
+			NodeType * pEntry = NULL;
+			hr = baseClass::AddEntry(Key, data, dwSize, (HCACHEITEM *)&pEntry);
+			if (hr != S_OK)
+				return hr;
+
+			pEntry->hInstance = hInstance;
+			pEntry->pClient = pClient;
+			if (pftExpireTime)
+				pEntry->cftExpireTime = *pftExpireTime;
+
+			if (hInstance && m_spDllCache)
+				m_spDllCache->AddRefModule(hInstance);
+
+			baseClass::CommitEntry(static_cast<HCACHEITEM>(pEntry));
+
+			if (phEntry)
+				*phEntry = static_cast<HCACHEITEM>(pEntry);
+			else
+				baseClass::ReleaseEntry(static_cast<HCACHEITEM>(pEntry));
+
+			return S_OK;
+		}
+		_ATLCATCHALL()
+		{
+			return E_FAIL;
+		}
+	}
+
+	virtual void OnDestroyEntry(const void * pEntry_)
+	{
+		const NodeType* pEntry = (const NodeType*)pEntry_;
+		ATLASSERT(pEntry);
+		if (!pEntry)
+			return;
+
+		if (pEntry->pClient)
+			pEntry->pClient->Free((void *)&pEntry->Data);
+		if (pEntry->hInstance && m_spDllCache)
+			m_spDllCache->ReleaseModule(pEntry->hInstance);
+	}
+}; // CShardedMemoryCache
+
+// CStdStatData - contains the data that CStdStatClass keeps track of
+#define ATL_PERF_CACHE_OBJECT 100
+
+struct CPerfStatObject : public CPerfObject
+{
+	DECLARE_PERF_CATEGORY(CPerfStatObject, ATL_PERF_CACHE_OBJECT, IDS_PERFMON_CACHE, IDS_PERFMON_CACHE_HELP, -1);
+
+	BEGIN_COUNTER_MAP(CPerfStatObject)
+		DEFINE_COUNTER(m_nHitCount, IDS_PERFMON_HITCOUNT, IDS_PERFMON_HITCOUNT_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_nMissCount, IDS_PERFMON_MISSCOUNT, IDS_PERFMON_MISSCOUNT_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_nCurrentAllocations, IDS_PERFMON_CURRENTALLOCATIONS, IDS_PERFMON_CURRENTALLOCATIONS_HELP, PERF_COUNTER_LARGE_RAWCOUNT, -3)
+		DEFINE_COUNTER(m_nMaxAllocations, IDS_PERFMON_MAXALLOCATIONS, IDS_PERFMON_MAXALLOCATIONS_HELP, PERF_COUNTER_LARGE_RAWCOUNT, -3)
+		DEFINE_COUNTER(m_nCurrentEntries, IDS_PERFMON_CURRENTENTRIES, IDS_PERFMON_CURRENTENTRIES_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_nMaxEntries, IDS_PERFMON_MAXENTRIES, IDS_PERFMON_MAXENTRIES_HELP, PERF_COUNTER_RAWCOUNT, -1)
+	END_COUNTER_MAP()
+
+	long m_nHitCount;
+	long m_nMissCount;
+	long m_nCurrentEntries;
+	long m_nMaxEntries;
+	LONGLONG m_nCurrentAllocations;
+	LONGLONG m_nMaxAllocations;
+};
+
+// CCachePerfMon - the interface to CPerfMon, with associated definitions
+class CCachePerfMon : public CPerfMon
+{
+public:
+	BEGIN_PERF_MAP(_T("ATL Server:Cache"))
+		CHAIN_PERF_CATEGORY(CPerfStatObject)
+	END_PERF_MAP()
+};
+
+//
+//CStdStatClass
+// Description
+// This class provides the implementation of a standard cache statistics accounting class
+class CStdStatClass
+{ 
+protected:
+	CPerfStatObject* m_pStats;
+	CPerfStatObject m_stats;
+
+public:
+
+	CStdStatClass()
+	{
+		m_pStats = &m_stats;
+	}
+
+	// This function is not thread safe by design
+	HRESULT Initialize(CPerfStatObject* pStats = NULL)
+	{
+		if (pStats)
+			m_pStats = pStats;
+		else
+			m_pStats = &m_stats;
+
+		ResetCounters();
+		return S_OK;
+	}
+
+	// This function is not thread safe by design
+	HRESULT Uninitialize()
+	{
+		m_pStats = &m_stats;
+		return S_OK;
+	}
+
+	void Hit()
+	{
+		InterlockedIncrement(&m_pStats->m_nHitCount);
+	}
+
+	void Miss()
+	{ 
+		InterlockedIncrement(&m_pStats->m_nMissCount);
+	}
+
+	void AddElement(ULONGLONG nBytes)
+	{
+		DWORD nCurrentEntries = InterlockedIncrement(&m_pStats->m_nCurrentEntries);
+		AtlInterlockedUpdateMax(nCurrentEntries, &m_pStats->m_nMaxEntries);
+
+		LONGLONG nCurrentAllocations = (LONGLONG)nBytes + AtlInterlockedExchangeAdd64(&m_pStats->m_nCurrentAllocations, (LONGLONG)nBytes);
+		AtlInterlockedUpdateMax64(nCurrentAllocations, &m_pStats->m_nMaxAllocations);
+	}
+
+	void ReleaseElement(ULONGLONG nBytes)
+	{
+		InterlockedDecrement(&m_pStats->m_nCurrentEntries);
+		AtlInterlockedExchangeAdd64(&m_pStats->m_nCurrentAllocations, -((LONGLONG)nBytes));
+	}
+
+	DWORD GetHitCount()
+	{
+		return m_pStats->m_nHitCount;
+	}
+
+	DWORD GetMissCount()
+	{
+		return m_pStats->m_nMissCount;
+	}
+
+	ULONGLONG GetCurrentAllocSize()
+	{
+		return (ULONGLONG)m_pStats->m_nCurrentAllocations;
+	}
+
+	ULONGLONG GetMaxAllocSize()
+	{
+		return (ULONGLONG)m_pStats->m_nMaxAllocations;
+	}
+
+	DWORD GetCurrentEntryCount()
+	{
+		return m_pStats->m_nCurrentEntries;
+	}
+
+	DWORD GetMaxEntryCount()
+	{   
+		return m_pStats->m_nMaxEntries;
+	}
+
+	void ResetCounters()
+	{
+		m_pStats->m_nHitCount = 0;
+		m_pStats->m_nMissCount = 0;
+		m_pStats->m_nCurrentAllocations = 0;
+		m_pStats->m_nMaxAllocations = 0;
+		m_pStats->m_nCurrentEntries = 0;
+		m_pStats->m_nMaxEntries = 0;
+	}
+}; // CStdStatClass
+
+//
+// CNoStatClass
+// This is a noop stat class
+class CNoStatClass
+{ 
+public:
+	HRESULT Initialize(){ return S_OK; }
+	HRESULT Uninitialize(){ return S_OK; }
+	void Hit(){ }
+	void Miss(){ }
+	void AddElement(ULONGLONG){ }
+	void ReleaseElement(ULONGLONG){ }
+	DWORD GetHitCount(){ return 0; }
+	DWORD GetMissCount(){ return 0; }
+	ULONGLONG GetCurrentAllocSize(){ return 0; }
+	ULONGLONG GetMaxAllocSize(){ return 0; }
+	DWORD GetCurrentEntryCount(){ return 0; }
+	DWORD GetMaxEntryCount(){ return 0; }
+	void ResetCounters(){ }
+}; // CNoStatClass
+
+//
+//CPerfStatClass
+// Description
+// This class provides the implementation of a cache statistics gathering class
+// with PerfMon support
+class CPerfStatClass : public CStdStatClass
+{
+	CPerfStatObject * m_pPerfObject;
+	CCachePerfMon m_PerfMon;
+
+public:
+
+	HRESULT Initialize(__in_z_opt LPWSTR szName=NULL)
+	{
+		HRESULT hr;
+		WCHAR szPath[MAX_PATH];
+
+		if (!szName)
+		{
+			// default name is the name of the module
+			// we don't care about possible truncation if longer than max_path
+			// we just need an identifier
+			HINSTANCE hInst = _AtlBaseModule.GetModuleInstance();
+			if (::GetModuleFileNameW(hInst, szPath, MAX_PATH) == 0)
+			{
+				return E_FAIL;
+			}
+			szPath[MAX_PATH-1] = 0;
+			szName = szPath;
+		}
+
+		m_pPerfObject = NULL;
+		ATLTRACE(atlTraceCache, 2, _T("Initializing m_PerfMon\n"));
+		hr = m_PerfMon.Initialize();
+		if (SUCCEEDED(hr))
+		{
+			CPerfLock lock(&m_PerfMon);
+			if (FAILED(hr = lock.GetStatus()))
+			{
+				return hr;
+			}
+
+			hr = m_PerfMon.CreateInstance(ATL_PERF_CACHE_OBJECT, 0, szName, reinterpret_cast<CPerfObject**>(&m_pPerfObject));
+			if (FAILED(hr))
+			{
+				return hr;
+			}
+
+			CStdStatClass::Initialize(m_pPerfObject);
+		}
+		else
+			ATLASSUME(m_pPerfObject == NULL);
+
+		return hr;
+	}
+
+	HRESULT Uninitialize()
+	{
+		CStdStatClass::Uninitialize();
+
+		if (m_pPerfObject != NULL) // Initialized m_pPerfObject successfully above
+		{
+			HRESULT hr = m_PerfMon.ReleaseInstance(m_pPerfObject);
+			if (hr != S_OK)
+				return hr;
+
+			m_PerfMon.UnInitialize();
+		}
+
+		return S_OK;
+	}
+}; // CPerfStatClass
+
+#ifndef ATL_BLOB_CACHE_TIMEOUT
+#ifdef _DEBUG
+#define ATL_BLOB_CACHE_TIMEOUT 1000
+#else
+#define ATL_BLOB_CACHE_TIMEOUT 5000
+#endif // _DEBUG
+#endif // ATL_BLOB_CACHE_TIMEOUT
+
+//
+//CBlobCache
+// Description:
+// Implements a cache that stores pointers to void. Uses the generic CMemoryCacheBase class
+// as the implementation.
+template <class MonitorClass,
+		class StatClass=CStdStatClass,
+		class SyncObj=CComCriticalSection,
+		class FlushClass=COldFlusher,
+		class CullClass=CExpireCuller >
+class CBlobCache : public CMemoryCache<void*, StatClass, FlushClass, CFixedStringKey, 
+	CStringElementTraits<CFixedStringKey >, SyncObj, CullClass>,
+	public IMemoryCache,
+	public IMemoryCacheControlEx,
+	public IMemoryCacheStatsEx,
+	public IWorkerThreadClient
+{
+	typedef CMemoryCache<void*, StatClass, FlushClass, CFixedStringKey, 
+		CStringElementTraits<CFixedStringKey>, SyncObj, CullClass> cacheBase;
+
+	MonitorClass m_Monitor;
+
+protected:
+	HANDLE m_hTimer;
+
+public:
+	CBlobCache() : m_hTimer(NULL)
+	{
+	}
+
+	HRESULT Initialize(IServiceProvider *pProv)
+	{
+		HRESULT hr = cacheBase::Initialize(pProv);
+		if (FAILED(hr))
+			return hr;
+		hr = m_Monitor.Initialize();
+		if (FAILED(hr))
+			return hr;
+		return m_Monitor.AddTimer(ATL_BLOB_CACHE_TIMEOUT, 
+			static_cast<IWorkerThreadClient*>(this), (DWORD_PTR) this, &m_hTimer);
+	}
+
+	template <class ThreadTraits>
+	HRESULT Initialize(IServiceProvider *pProv, CWorkerThread<ThreadTraits> *pWorkerThread)
+	{
+		ATLASSERT(pWorkerThread);
+
+		HRESULT hr = cacheBase::Initialize(pProv);
+		if (FAILED(hr))
+			return hr;
+
+		hr = m_Monitor.Initialize(pWorkerThread);
+		if (FAILED(hr))
+			return hr;
+
+		return m_Monitor.AddTimer(ATL_BLOB_CACHE_TIMEOUT, 
+			static_cast<IWorkerThreadClient*>(this), (DWORD_PTR) this, &m_hTimer);
+	}
+
+	HRESULT Execute(DWORD_PTR dwParam, HANDLE /*hObject*/)
+	{
+		CBlobCache* pCache = (CBlobCache*)dwParam;
+
+		if (pCache)
+			pCache->Flush();
+		return S_OK;
+	}
+
+	HRESULT CloseHandle(HANDLE hObject)
+	{
+		ATLASSUME(m_hTimer == hObject);
+		m_hTimer = NULL;
+		::CloseHandle(hObject);
+		return S_OK;
+	}
+
+	virtual ~CBlobCache()
+	{
+		if (m_hTimer)
+		{
+			ATLENSURE(SUCCEEDED(m_Monitor.RemoveHandle(m_hTimer)));
+		}
+	}
+
+	HRESULT Uninitialize()
+	{
+		HRESULT hrMonitor=S_OK;
+		if (m_hTimer)
+		{
+			hrMonitor=m_Monitor.RemoveHandle(m_hTimer);
+			m_hTimer = NULL;
+		}
+		HRESULT hrShut=m_Monitor.Shutdown();
+		HRESULT hrCache=cacheBase::Uninitialize();
+		if(FAILED(hrMonitor))
+		{
+			return hrMonitor;
+		}
+		if(FAILED(hrShut))
+		{
+			return hrShut;
+		}
+		return hrCache;
+	}
+	// IUnknown methods
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv)
+	{
+		HRESULT hr = E_NOINTERFACE;
+		if (!ppv)
+			hr = E_POINTER;
+		else
+		{
+			if (InlineIsEqualGUID(riid, __uuidof(IUnknown)) ||
+				InlineIsEqualGUID(riid, __uuidof(IMemoryCache)))
+			{
+				*ppv = (IUnknown *) (IMemoryCache *) this;
+				AddRef();
+				hr = S_OK;
+			}
+			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheStats)) ||
+				InlineIsEqualGUID(riid, __uuidof(IMemoryCacheStatsEx)))
+			{
+				*ppv = (IUnknown *) (IMemoryCacheStatsEx*)this;
+				AddRef();
+				hr = S_OK;
+			}
+			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheControl)) ||
+				InlineIsEqualGUID(riid, __uuidof(IMemoryCacheControlEx)))
+			{
+				*ppv = (IUnknown *) (IMemoryCacheControlEx*)this;
+				AddRef();
+				hr = S_OK;
+			}
+
+		}
+		return hr;
+	}
+
+	ULONG STDMETHODCALLTYPE AddRef()
+	{
+		return 1;
+	}
+
+	ULONG STDMETHODCALLTYPE Release()
+	{
+		return 1;
+	}
+
+	// IMemoryCache Methods
+	HRESULT STDMETHODCALLTYPE Add(LPCSTR szKey, void *pvData, DWORD dwSize, 
+		FILETIME *pftExpireTime, 
+		HINSTANCE hInstClient,
+		HCACHEITEM *phEntry,
+		IMemoryCacheClient *pClient)
+	{
+		HRESULT hr = E_FAIL;
+		//if it's a multithreaded cache monitor we'll let the monitor take care of
+		//cleaning up the cache so we don't overflow our configuration settings.
+		//if it's not a threaded cache monitor, we need to make sure we don't
+		//overflow the configuration settings by adding a new element
+		if (m_Monitor.GetThreadHandle()==NULL)
+		{
+			if (!cacheBase::CanAddEntry(dwSize))
+			{
+				//flush the entries and check again to see if we can add
+				cacheBase::FlushEntries();
+				if (!cacheBase::CanAddEntry(dwSize))
+					return E_OUTOFMEMORY;
+			}
+		}
+		_ATLTRY
+		{
+			hr = cacheBase::AddEntry(szKey, pvData, dwSize,
+				pftExpireTime, hInstClient, pClient, phEntry);
+			return hr;
+		}
+		_ATLCATCHALL()
+		{
+			return E_FAIL;
+		}
+	}
+
+	HRESULT STDMETHODCALLTYPE LookupEntry(LPCSTR szKey, HCACHEITEM * phEntry)
+	{
+		return cacheBase::LookupEntry(szKey, phEntry);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetData(const HCACHEITEM hKey, void **ppvData, DWORD *pdwSize) const
+	{
+		return cacheBase::GetEntryData(hKey, ppvData, pdwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE ReleaseEntry(const HCACHEITEM hKey)
+	{
+		return cacheBase::ReleaseEntry(hKey);
+	}
+
+	HRESULT STDMETHODCALLTYPE RemoveEntry(const HCACHEITEM hKey)
+	{
+		return cacheBase::RemoveEntry(hKey);
+	}
+
+	HRESULT STDMETHODCALLTYPE RemoveEntryByKey(LPCSTR szKey)
+	{
+		return cacheBase::RemoveEntryByKey(szKey);
+	}
+
+	HRESULT STDMETHODCALLTYPE Flush()
+	{
+		return cacheBase::FlushEntries();
+	}
+
+
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize(DWORD dwSize)
+	{
+		return cacheBase::SetMaxAllowedSize(dwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize(DWORD *pdwSize)
+	{
+		return cacheBase::GetMaxAllowedSize(pdwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize64(ULONGLONG nSize)
+	{
+		return cacheBase::SetMaxAllowedSize64(nSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize64(ULONGLONG *pnSize)
+	{
+		return cacheBase::GetMaxAllowedSize64(pnSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE SetLowWaterSize(ULONGLONG nSize)
+	{
+		return cacheBase::SetLowWaterSize(nSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetLowWaterSize(ULONGLONG *pnSize)
+	{
+		return cacheBase::GetLowWaterSize(pnSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedEntries(DWORD dwSize)
+	{
+		return cacheBase::SetMaxAllowedEntries(dwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedEntries(DWORD *pdwSize)
+	{
+		return cacheBase::GetMaxAllowedEntries(pdwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE ResetCache()
+	{
+		return cacheBase::ResetCache();
+	}
+
+	// IMemoryCacheStats methods
+	HRESULT STDMETHODCALLTYPE ClearStats()
+	{
+		m_statObj.ResetCounters();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetHitCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_statObj.GetHitCount();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMissCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_statObj.GetMissCount();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllocSize(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = AtlCacheSizeToDWORD(m_statObj.GetMaxAllocSize());
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetCurrentAllocSize(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = AtlCacheSizeToDWORD(m_statObj.GetCurrentAllocSize());
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllocSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = m_statObj.GetMaxAllocSize();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetCurrentAllocSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = m_statObj.GetCurrentAllocSize();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxEntryCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_statObj.GetMaxEntryCount();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetCurrentEntryCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_statObj.GetCurrentEntryCount();
+		return S_OK;
+	}
+
+}; // CBlobCache
+
+//
+//CShardedBlobCache
+// Description:
+// A CBlobCache alternative for heavily multithreaded servers. Implements the
+// same interfaces, but uses CShardedMemoryCache so that lookups and releases
+// of entries that hash to different segments do not contend for one lock.
+template <class MonitorClass,
+		class StatClass=CStdStatClass,
+		class SyncObj=CComCriticalSection,
+		class FlushClass=COldFlusher,
+		class CullClass=CExpireCuller,
+		DWORD t_nShards=ATL_CACHE_SHARD_COUNT >
+class CShardedBlobCache : public CShardedMemoryCache<void*, StatClass, FlushClass, CFixedStringKey, 
+	CStringElementTraits<CFixedStringKey >, SyncObj, CullClass, t_nShards>,
+	public IMemoryCache,
+	public IMemoryCacheControlEx,
+	public IMemoryCacheStatsEx,
+	public IWorkerThreadClient
+{
+	typedef CShardedMemoryCache<void*, StatClass, FlushClass, CFixedStringKey, 
+		CStringElementTraits<CFixedStringKey>, SyncObj, CullClass, t_nShards> cacheBase;
+
+	MonitorClass m_Monitor;
+
+protected:
+	HANDLE m_hTimer;
+
+public:
+	CShardedBlobCache() : m_hTimer(NULL)
+	{
+	}
+
+	HRESULT Initialize(IServiceProvider *pProv)
+	{
+		HRESULT hr = cacheBase::Initialize(pProv);
+		if (FAILED(hr))
+			return hr;
+		hr = m_Monitor.Initialize();
+		if (FAILED(hr))
+			return hr;
+		return m_Monitor.AddTimer(ATL_BLOB_CACHE_TIMEOUT, 
+			static_cast<IWorkerThreadClient*>(this), (DWORD_PTR) this, &m_hTimer);
+	}
+
+	template <class ThreadTraits>
+	HRESULT Initialize(IServiceProvider *pProv, CWorkerThread<ThreadTraits> *pWorkerThread)
+	{
+		ATLASSERT(pWorkerThread);
+
+		HRESULT hr = cacheBase::Initialize(pProv);
+		if (FAILED(hr))
+			return hr;
+
+		hr = m_Monitor.Initialize(pWorkerThread);
+		if (FAILED(hr))
+			return hr;
+
+		return m_Monitor.AddTimer(ATL_BLOB_CACHE_TIMEOUT, 
+			static_cast<IWorkerThreadClient*>(this), (DWORD_PTR) this, &m_hTimer);
+	}
+
+	HRESULT Execute(DWORD_PTR dwParam, HANDLE /*hObject*/)
+	{
+		CShardedBlobCache* pCache = (CShardedBlobCache*)dwParam;
+
+		if (pCache)
+			pCache->Flush();
+		return S_OK;
+	}
+
+	HRESULT CloseHandle(HANDLE hObject)
+	{
+		ATLASSUME(m_hTimer == hObject);
+		m_hTimer = NULL;
+		::CloseHandle(hObject);
+		return S_OK;
+	}
+
+	virtual ~CShardedBlobCache()
+	{
+		if (m_hTimer)
+		{
+			ATLENSURE(SUCCEEDED(m_Monitor.RemoveHandle(m_hTimer)));
+		}
+	}
+
+	HRESULT Uninitialize()
+	{
+		HRESULT hrMonitor=S_OK;
+		if (m_hTimer)
+		{
+			hrMonitor=m_Monitor.RemoveHandle(m_hTimer);
+			m_hTimer = NULL;
+		}
+		HRESULT hrShut=m_Monitor.Shutdown();
+		HRESULT hrCache=cacheBase::Uninitialize();
+		if(FAILED(hrMonitor))
+		{
+			return hrMonitor;
+		}
+		if(FAILED(hrShut))
+		{
+			return hrShut;
+		}
+		return hrCache;
+	}
+	// IUnknown methods
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv)
+	{
+		HRESULT hr = E_NOINTERFACE;
+		if (!ppv)
+			hr = E_POINTER;
+		else
+		{
+			if (InlineIsEqualGUID(riid, __uuidof(IUnknown)) ||
+				InlineIsEqualGUID(riid, __uuidof(IMemoryCache)))
+			{
+				*ppv = (IUnknown *) (IMemoryCache *) this;
+				AddRef();
+				hr = S_OK;
+			}
+			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheStats)) ||
+				InlineIsEqualGUID(riid, __uuidof(IMemoryCacheStatsEx)))
+			{
+				*ppv = (IUnknown *) (IMemoryCacheStatsEx*)this;
+				AddRef();
+				hr = S_OK;
+			}
+			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheControl)) ||
+				InlineIsEqualGUID(riid, __uuidof(IMemoryCacheControlEx)))
+			{
+				*ppv = (IUnknown *) (IMemoryCacheControlEx*)this;
+				AddRef();
+				hr = S_OK;
+			}
+
+		}
+		return hr;
+	}
+
+	ULONG STDMETHODCALLTYPE AddRef()
+	{
+		return 1;
+	}
+
+	ULONG STDMETHODCALLTYPE Release()
+	{
+		return 1;
+	}
+
+	// IMemoryCache Methods
+	HRESULT STDMETHODCALLTYPE Add(LPCSTR szKey, void *pvData, DWORD dwSize, 
+		FILETIME *pftExpireTime, 
+		HINSTANCE hInstClient,
+		HCACHEITEM *phEntry,
+		IMemoryCacheClient *pClient)
+	{
+		HRESULT hr = E_FAIL;
+		// without a monitor thread, make sure the segment the key maps to
+		// stays within its share of the configuration settings
+		if (m_Monitor.GetThreadHandle()==NULL)
+		{
+			if (!cacheBase::CanAddEntry(szKey, dwSize))
+			{
+				//flush the entries and check again to see if we can add
+				cacheBase::FlushEntries();
+				if (!cacheBase::CanAddEntry(szKey, dwSize))
+					return E_OUTOFMEMORY;
+			}
+		}
+		_ATLTRY
+		{
+			hr = cacheBase::AddEntry(szKey, pvData, dwSize,
+				pftExpireTime, hInstClient, pClient, phEntry);
+			return hr;
+		}
+		_ATLCATCHALL()
+		{
+			return E_FAIL;
+		}
+	}
+
+	HRESULT STDMETHODCALLTYPE LookupEntry(LPCSTR szKey, HCACHEITEM * phEntry)
+	{
+		return cacheBase::LookupEntry(szKey, phEntry);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetData(const HCACHEITEM hKey, void **ppvData, DWORD *pdwSize) const
+	{
+		return cacheBase::GetEntryData(hKey, ppvData, pdwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE ReleaseEntry(const HCACHEITEM hKey)
+	{
+		return cacheBase::ReleaseEntry(hKey);
+	}
+
+	HRESULT STDMETHODCALLTYPE RemoveEntry(const HCACHEITEM hKey)
+	{
+		return cacheBase::RemoveEntry(hKey);
+	}
+
+	HRESULT STDMETHODCALLTYPE RemoveEntryByKey(LPCSTR szKey)
+	{
+		return cacheBase::RemoveEntryByKey(szKey);
+	}
+
+	HRESULT STDMETHODCALLTYPE Flush()
+	{
+		return cacheBase::FlushEntries();
+	}
+
+
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize(DWORD dwSize)
+	{
+		return cacheBase::SetMaxAllowedSize(dwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize(DWORD *pdwSize)
+	{
+		return cacheBase::GetMaxAllowedSize(pdwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize64(ULONGLONG nSize)
+	{
+		return cacheBase::SetMaxAllowedSize64(nSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize64(ULONGLONG *pnSize)
+	{
+		return cacheBase::GetMaxAllowedSize64(pnSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE SetLowWaterSize(ULONGLONG nSize)
+	{
+		return cacheBase::SetLowWaterSize(nSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetLowWaterSize(ULONGLONG *pnSize)
+	{
+		return cacheBase::GetLowWaterSize(pnSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedEntries(DWORD dwSize)
+	{
+		return cacheBase::SetMaxAllowedEntries(dwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedEntries(DWORD *pdwSize)
+	{
+		return cacheBase::GetMaxAllowedEntries(pdwSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE ResetCache()
+	{
+		return cacheBase::ResetCache();
+	}
+
+	// IMemoryCacheStats methods
+	HRESULT STDMETHODCALLTYPE ClearStats()
+	{
+		return cacheBase::ClearStats();
+	}
+
+	HRESULT STDMETHODCALLTYPE GetHitCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = cacheBase::GetHitCount();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMissCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = cacheBase::GetMissCount();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllocSize(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = AtlCacheSizeToDWORD(cacheBase::GetMaxAllocSize());
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetCurrentAllocSize(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = AtlCacheSizeToDWORD(cacheBase::GetCurrentAllocSize());
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllocSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = cacheBase::GetMaxAllocSize();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetCurrentAllocSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = cacheBase::GetCurrentAllocSize();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxEntryCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = cacheBase::GetMaxEntryCount();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetCurrentEntryCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = cacheBase::GetCurrentEntryCount();
+		return S_OK;
+	}
+
+}; // CShardedBlobCache
+
+
+//
+// CDllCache
+// This class manages a cache to handle calls to LoadLibrary
+// and FreeLibrary.  
+// It keeps dlls loaded even after the last call to free library
+// a worker thread then calls FreeLibrary on unused dlls
+//
+#ifndef ATL_DLL_CACHE_TIMEOUT
+	#ifdef _DEBUG
+		#define ATL_DLL_CACHE_TIMEOUT   1000        // 1 sec default for debug builds
+	#else
+		#define ATL_DLL_CACHE_TIMEOUT   10*60000    // 10 minute default for retail builds
+	#endif
+#endif
+
+class CNoDllCachePeer
+{
+public:
+	struct DllInfo
+	{
+	};
+
+	BOOL Add(HINSTANCE /*hInst*/, DllInfo * /*pInfo*/)
+	{
+		return TRUE;
+	}
+
+	void Remove(HINSTANCE /*hInst*/, DllInfo * /*pInfo*/)
+	{
+	}
+};
+
+// CDllCache
+// Implements IDllCache, an interface that is used to load and unload Dlls.
+// To use it, construct an instance of a CDllCache and call Initialize.
+// The Initialize call has to match with the type of monitor class you 
+// templatize on. The monitor thread will call IWorkerThreadClient::Execute
+// after its timeout expires. Make sure to Uninitialize the object before
+// it is destroyed by calling Uninitialize
+//
+template <class MonitorClass, class Peer=CNoDllCachePeer>
+class CDllCache : public IDllCache, 
+	public IWorkerThreadClient
+{
+protected:
+	CComCriticalSection m_critSec;
+	CSimpleArray<DLL_CACHE_ENTRY> m_Dlls;
+	CSimpleArray<typename Peer::DllInfo> m_DllInfos;
+	MonitorClass m_Monitor;
+	HANDLE m_hTimer;
+
+	void RemoveDllEntry(DLL_CACHE_ENTRY& entry)
+	{
+		::FreeLibrary(entry.hInstDll);
+		entry.hInstDll = NULL;
+		m_Dlls.RemoveAt(m_Dlls.GetSize()-1);
+	}
+
+public:
+	Peer m_Peer;
+
+	CDllCache() :
+		m_hTimer(NULL)
+	{
+
+	}
+
+	HRESULT Initialize(DWORD dwTimeout=ATL_DLL_CACHE_TIMEOUT)
+	{
+		HRESULT hr = m_critSec.Init();
+		if (FAILED(hr))
+			return hr;
+		hr = m_Monitor.Initialize();
+		if (FAILED(hr))
+			return hr;
+		return m_Monitor.AddTimer(dwTimeout, this, 0, &m_hTimer);
+	}
+
+	template <class ThreadTraits>
+	HRESULT Initialize(CWorkerThread<ThreadTraits> *pWorkerThread,
+			DWORD dwTimeout=ATL_DLL_CACHE_TIMEOUT)
+	{
+		HRESULT hr = m_critSec.Init();
+		if (FAILED(hr))
+			return hr;
+		hr = m_Monitor.Initialize(pWorkerThread);
+		if (FAILED(hr))
+			return hr;
+		return m_Monitor.AddTimer(dwTimeout, this, 0, &m_hTimer);
+	}
+
+	HRESULT Uninitialize()
+	{
+		HRESULT hr = S_OK;
+		HRESULT hrLatest = S_OK;
+		if (m_hTimer)
+		{
+			hrLatest=m_Monitor.RemoveHandle(m_hTimer);
+			if(FAILED(hrLatest) && SUCCEEDED(hr))
+			{
+				hr=hrLatest;
+			}
+			m_hTimer = NULL;
+		}
+		m_Monitor.Shutdown();
+
+		// free all the libraries we've cached
+		int nLen = m_Dlls.GetSize();
+		for (int i=0; i<nLen; i++)
+		{
+			DLL_CACHE_ENTRY& entry = m_Dlls[i];
+			ATLASSERT(entry.dwRefs == 0);
+			BOOL bRet = ::FreeLibrary(entry.hInstDll);
+
+			if (!bRet)
+			{
+				hrLatest = AtlHresultFromLastError();
+				if(FAILED(hrLatest) && SUCCEEDED(hr))
+				{
+					hr=hrLatest;
+				}
+				ATLTRACE(atlTraceCache, 0, _T("Free library failed on shutdown of dll cache : hr = 0x%08x)"), hr);
+			}
+		}
+		m_Dlls.RemoveAll();
+		m_critSec.Term();
+		return hr;
+
+	}
+
+	// IUnknown methods
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv)
+	{
+		if (!ppv)
+			return E_POINTER;
+		if (InlineIsEqualGUID(riid, __uuidof(IUnknown)) ||
+			InlineIsEqualGUID(riid, __uuidof(IDllCache)))
+		{
+			*ppv = (IUnknown *) this;
+			AddRef();
+			return S_OK;
+		}
+		return E_NOINTERFACE;
+	}
+
+	ULONG STDMETHODCALLTYPE AddRef()
+	{
+		return 1;
+	}
+
+	ULONG STDMETHODCALLTYPE Release()
+	{
+		return 1;
+	}
+
+	// IDllCache methods
+	HINSTANCE Load(LPCSTR szDllName, void *pPeerInfo)
+	{
+		HRESULT hr = m_critSec.Lock();
+		if (FAILED(hr))
+			return NULL;
+
+		int nLen = m_Dlls.GetSize();
+		for (int i=0; i<nLen; i++)
+		{
+			DLL_CACHE_ENTRY& entry = m_Dlls[i];
+			if (!_stricmp(entry.szDllName, szDllName))
+			{
+				entry.dwRefs++;
+				m_critSec.Unlock();
+				if (pPeerInfo)
+				{
+					Peer::DllInfo *pl = (Peer::DllInfo*)pPeerInfo;
+					*pl = m_DllInfos[i];
+				}
+				return entry.hInstDll;
+			}
+		}
+		DLL_CACHE_ENTRY entry;
+		entry.hInstDll = ::LoadLibraryA(szDllName);
+		if (!entry.hInstDll)
+		{
+			m_critSec.Unlock();
+			return NULL;
+		}
+		if (!SafeStringCopy(entry.szDllName, szDllName))
+		{
+			::FreeLibrary(entry.hInstDll);
+			m_critSec.Unlock();
+			return NULL;
+		}
+		entry.dwRefs = 1;
+		entry.bAlive = TRUE;
+		m_Dlls.Add(entry);
+
+		Peer::DllInfo *pdllInfo = (Peer::DllInfo*)pPeerInfo;
+
+		// m_Peer could throw an exception from user code. We
+		// pass that exception from here to a higher context (we
+		// won't deal with user exception here).
+		if (!m_Peer.Add(entry.hInstDll, pdllInfo))
+		{
+			RemoveDllEntry(entry);
+		}
+
+
+		if ((entry.hInstDll != NULL) && (!m_DllInfos.Add(*pdllInfo)))
+		{
+			RemoveDllEntry(entry);
+		}
+
+		m_critSec.Unlock();
+		return entry.hInstDll;
+	}
+
+	BOOL Free(HINSTANCE hInstDll)
+	{
+		HRESULT hr = m_critSec.Lock();
+		if (FAILED(hr))
+			return FALSE;
+
+		int nLen = m_Dlls.GetSize();
+		for (int i=0; i<nLen; i++)
+		{
+			DLL_CACHE_ENTRY &entry = m_Dlls[i];
+			if (entry.hInstDll == hInstDll)
+			{
+				ATLASSERT(entry.dwRefs > 0);
+				entry.bAlive = TRUE;
+				entry.dwRefs--;
+				m_critSec.Unlock();
+				return TRUE;
+			}
+		}
+
+		m_critSec.Unlock();
+		// the dll wasn't found
+		// in the cache, so just
+		// pass along to ::FreeLibrary
+		return ::FreeLibrary(hInstDll);
+	}
+
+	BOOL AddRefModule(HINSTANCE hInstDll)
+	{
+		HRESULT hr = m_critSec.Lock();
+		if (FAILED(hr))
+			return FALSE;
+
+		int nLen = m_Dlls.GetSize();
+		for (int i=0; i<nLen; i++)
+		{
+			DLL_CACHE_ENTRY &entry = m_Dlls[i];
+			if (entry.hInstDll == hInstDll)
+			{
+				ATLASSERT(entry.dwRefs > 0);
+				entry.dwRefs++;
+				m_critSec.Unlock();
+				return TRUE;
+			}
+		}
+
+		m_critSec.Unlock();
+		return FALSE;
+	}
+
+	BOOL ReleaseModule(HINSTANCE hInstDll)
+	{
+		HRESULT hr = m_critSec.Lock();
+		if (FAILED(hr))
+			return FALSE;
+
+		int nLen = m_Dlls.GetSize();
+		for (int i=0; i<nLen; i++)
+		{
+			DLL_CACHE_ENTRY &entry = m_Dlls[i];
+			if (entry.hInstDll == hInstDll)
+			{
+				ATLASSERT(entry.dwRefs > 0);
+				entry.bAlive = TRUE;
+				entry.dwRefs--;
+				m_critSec.Unlock();
+				return TRUE;
+			}
+		}
+		m_critSec.Unlock();
+		return FALSE;
+	}
+
+	HRESULT GetEntries(DWORD dwCount, DLL_CACHE_ENTRY *pEntries, DWORD *pdwCopied)
+	{
+		if (!pdwCopied)
+			return E_POINTER;
+
+		HRESULT hr = m_critSec.Lock();
+		if (FAILED(hr))
+			return hr;
+
+		if (dwCount==0 || pEntries==NULL)
+		{
+			// just return the required size
+			*pdwCopied = m_Dlls.GetSize();
+			m_critSec.Unlock();
+			return S_OK;
+		}
+
+		if (dwCount > (DWORD) m_Dlls.GetSize())
+			dwCount = m_Dlls.GetSize();
+		Checked::memcpy_s(pEntries, dwCount*sizeof(DLL_CACHE_ENTRY), m_Dlls.GetData(), dwCount*sizeof(DLL_CACHE_ENTRY));
+		*pdwCopied = dwCount;
+		m_critSec.Unlock();
+		return S_OK;
+	}
+
+	HRESULT Flush()
+	{
+		HRESULT hr = m_critSec.Lock();
+		if (FAILED(hr))
+			return hr;
+
+		int nLen = m_Dlls.GetSize();
+		for (int i=0; i<nLen; i++)
+		{
+			DLL_CACHE_ENTRY &entry = m_Dlls[i];
+			if (entry.dwRefs == 0 && !entry.bAlive)
+			{
+				_ATLTRY
+				{
+					m_Peer.Remove(entry.hInstDll, &m_DllInfos[i]);
+				}
+				_ATLCATCHALL()
+				{
+					ATLTRACE(atlTraceCache, 2, _T("Exception thrown from user code in CDllCache::Flush\n"));
+				}
+
+				::FreeLibrary(entry.hInstDll);
+				m_Dlls.RemoveAt(i);
+				m_DllInfos.RemoveAt(i);
+				i--;
+				nLen--;
+			}
+			entry.bAlive = FALSE;
+		}
+
+		m_critSec.Unlock();
+		return S_OK;
+	}
+
+	HRESULT Execute(DWORD_PTR /*dwParam*/, HANDLE /*hObject*/)
+	{
+		Flush();
+		return S_OK;
+	}
+
+	HRESULT CloseHandle(HANDLE hObject)
+	{
+		ATLASSUME(m_hTimer == hObject);
+		m_hTimer = NULL;
+		::CloseHandle(hObject);
+		return S_OK;
+	}
+}; // CDllCache
+
+
+//
+//IStencilCache
+//IStencilCache is used by a stencil processor to cache pointers to CStencil
+//derived objects.
+
+
+// {8702269B-707D-49cc-AEF8-5FFCB3D6891B}
+extern "C" __declspec(selectany) const IID IID_IStencilCache = { 0x8702269b, 0x707d, 0x49cc, { 0xae, 0xf8, 0x5f, 0xfc, 0xb3, 0xd6, 0x89, 0x1b } };
+
+__interface ATL_NO_VTABLE __declspec(uuid("8702269B-707D-49cc-AEF8-5FFCB3D6891B")) 
+	IStencilCache : public IUnknown
+{
+	// IStencilCache methods
+	STDMETHOD(CacheStencil)(LPCSTR szName, //a name for this cache entry
+								void *pStencil, //a pointer to a CStencil derived object
+								DWORD dwSize, //sizeof pStencil
+								HCACHEITEM *pHandle, //out pointer to a handle to the this cache entry
+								HINSTANCE hInst, //HINSTANCE of the module putting this entry
+												 //in the cache.
+								IMemoryCacheClient *pClient //Interface used to free this instance
+								);
+	STDMETHOD(LookupStencil)(LPCSTR szName, HCACHEITEM * phStencil);
+	STDMETHOD(GetStencil)(const HCACHEITEM hStencil, void ** ppStencil) const;
+	STDMETHOD(AddRefStencil)(const HCACHEITEM hStencil);
+	STDMETHOD(ReleaseStencil)(const HCACHEITEM hStencil);
+};
+
+// {55DEF119-D7A7-4eb7-A876-33365E1C5E1A}
+extern "C" __declspec(selectany) const IID IID_IStencilCacheControl = { 0x55def119, 0xd7a7, 0x4eb7, { 0xa8, 0x76, 0x33, 0x36, 0x5e, 0x1c, 0x5e, 0x1a } };
+__interface ATL_NO_VTABLE __declspec(uuid("55DEF119-D7A7-4eb7-A876-33365E1C5E1A"))
+IStencilCacheControl : public IUnknown
+{
+	//IStencilCacheControl
+	STDMETHOD(RemoveStencil)(const HCACHEITEM hStencil); // Removes the stencil if there are no references,
+														 // otherwise detaches it
+	STDMETHOD(RemoveStencilByName)(LPCSTR szStencil); //removes a stencil if there are no
+													//references to it
+	STDMETHOD(RemoveAllStencils)(); //removes all stencils that don't have references on them
+	STDMETHOD(SetDefaultLifespan)(unsigned __int64 dwdwLifespan); //sets the lifespan for all stencils
+															 //in the cache (in 100 nanosecond units (10,000,000=1 second)).
+	STDMETHOD(GetDefaultLifespan)(unsigned __int64 *pdwdwLifespan);
+};
+
+#ifndef ATL_STENCIL_CACHE_TIMEOUT
+#ifdef _DEBUG
+	#define ATL_STENCIL_CACHE_TIMEOUT 1000
+#else
+	#define ATL_STENCIL_CACHE_TIMEOUT 5000
+#endif // _DEBUG
+#endif // ATL_STENCIL_CACHE_TIMEOUT
+
+#ifndef ATL_STENCIL_LIFESPAN
+#ifdef _DEBUG                    
+	#define ATL_STENCIL_LIFESPAN CFileTime::Second
+#else
+	#define ATL_STENCIL_LIFESPAN CFileTime::Hour
+#endif
+#endif
+
+// timeout before we check if the file
+// has changed in m.s.
+#ifndef ATL_STENCIL_CHECK_TIMEOUT
+	#define ATL_STENCIL_CHECK_TIMEOUT 1000
+#endif
+
+template <class MonitorClass,
+		class StatClass=CStdStatClass,
+		class SyncClass=CComCriticalSection,
+		class FlushClass=COldFlusher,
+		class CullClass=CLifetimeCuller >
+class CStencilCache :
+	public CMemoryCacheBase<CStencilCache<MonitorClass, StatClass, SyncClass, FlushClass, CullClass>, void *, CCacheDataEx, 
+		CFixedStringKey,  CStringElementTraitsI<CFixedStringKey >, 
+		FlushClass, CullClass, SyncClass, StatClass>,
+	public IStencilCache,
+	public IStencilCacheControl,
+	public IWorkerThreadClient,
+	public IMemoryCacheStatsEx,
+	public CComObjectRootEx<CComGlobalsThreadModel>
+{
+protected:
+	typedef CMemoryCacheBase<CStencilCache<MonitorClass, StatClass, SyncClass, FlushClass, CullClass>, void *, CCacheDataEx, 
+		CFixedStringKey,  CStringElementTraitsI<CFixedStringKey >, 
+		FlushClass, CullClass, SyncClass, StatClass> cacheBase;
+	unsigned __int64 m_dwdwStencilLifespan;
+
+	MonitorClass m_Monitor;
+	HANDLE m_hTimer;
+	CComPtr<IDllCache> m_spDllCache;
+
+public:
+
+	CStencilCache() :
+		m_dwdwStencilLifespan(ATL_STENCIL_LIFESPAN),
+		m_hTimer(NULL)
+	{
+
+	}
+
+	~CStencilCache()
+	{
+		if (m_hTimer)
+		{
+			ATLENSURE(SUCCEEDED(m_Monitor.RemoveHandle(m_hTimer)));
+		}
+	}
+
+	HRESULT Execute(DWORD_PTR dwParam, HANDLE /*hObject*/)
+	{
+		CStencilCache* pCache = (CStencilCache*)dwParam;
+		if (pCache)
+			pCache->FlushEntries();
+		return S_OK;
+	}
+
+	HRESULT CloseHandle(HANDLE hObject)
+	{
+		ATLASSUME(m_hTimer == hObject);
+		m_hTimer = NULL;
+		::CloseHandle(hObject);
+		return S_OK;
+	}
+
+	HRESULT Initialize(IServiceProvider *pProv, DWORD dwStencilCacheTimeout=ATL_STENCIL_CACHE_TIMEOUT, 
+		__int64 dwdwStencilLifespan=ATL_STENCIL_LIFESPAN)
+	{
+		m_dwdwStencilLifespan = dwdwStencilLifespan;
+		HRESULT hr = cacheBase::Initialize();
+		if (FAILED(hr))
+			return hr;
+		hr = E_FAIL;
+		if (pProv)
+			hr = pProv->QueryService(__uuidof(IDllCache), __uuidof(IDllCache), (void**)&m_spDllCache);
+		if (FAILED(hr))
+			return hr;
+		hr = m_Monitor.Initialize();
+		if (FAILED(hr))
+			return hr;
+		return m_Monitor.AddTimer(dwStencilCacheTimeout, this, (DWORD_PTR) this, &m_hTimer);
+	}
+
+	template <class ThreadTraits>
+	HRESULT Initialize(IServiceProvider *pProv, CWorkerThread<ThreadTraits> *pWorkerThread, 
+		DWORD dwStencilCacheTimeout=ATL_STENCIL_CACHE_TIMEOUT, __int64 dwdwStencilLifespan=ATL_STENCIL_LIFESPAN)
+	{
+		m_dwdwStencilLifespan = dwdwStencilLifespan;
+		HRESULT hr = cacheBase::Initialize();
+		if (FAILED(hr))
+			return hr;
+		hr = E_FAIL;
+		if (pProv)
+			hr = pProv->QueryService(__uuidof(IDllCache), __uuidof(IDllCache), (void**)&m_spDllCache);
+		if (FAILED(hr))
+			return hr;
+		hr = m_Monitor.Initialize(pWorkerThread);
+		if (FAILED(hr))
+			return hr;
+		return m_Monitor.AddTimer(dwStencilCacheTimeout, this, (DWORD_PTR) this, &m_hTimer);
+	}
+
+
+	BEGIN_COM_MAP(CStencilCache)
+		COM_INTERFACE_ENTRY(IMemoryCacheStats)
+		COM_INTERFACE_ENTRY(IMemoryCacheStatsEx)
+		COM_INTERFACE_ENTRY(IStencilCache)
+		COM_INTERFACE_ENTRY(IStencilCacheControl)
+	END_COM_MAP()
+//IStencilCache methods
+	STDMETHOD(CacheStencil)(LPCSTR szName, void *pStencil, DWORD dwSize, HCACHEITEM *phEntry,
+				HINSTANCE hInstance, IMemoryCacheClient *pClient)
+	{
+		NodeType * pEntry = NULL;
+		HRESULT hr = m_syncObj.Lock();
+		if (FAILED(hr))
+			return hr;
+
+		_ATLTRY
+		{
+			hr = cacheBase::AddEntry(szName, pStencil, dwSize,  (HCACHEITEM *)&pEntry);
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_FAIL;
+		}
+		if (hr != S_OK)
+		{
+			m_syncObj.Unlock();
+			return hr;
+		}
+
+		pEntry->hInstance = hInstance;
+		pEntry->pClient = pClient;
+		pEntry->nLifespan = m_dwdwStencilLifespan;
+		if (hInstance && m_spDllCache)
+			m_spDllCache->AddRefModule(hInstance);
+
+		cacheBase::CommitEntry(static_cast<HCACHEITEM>(pEntry));
+
+		if (phEntry)
+			*phEntry = static_cast<HCACHEITEM>(pEntry);
+		else
+			cacheBase::ReleaseEntry(static_cast<HCACHEITEM>(pEntry));
+
+		m_syncObj.Unlock();
+		return hr;
+	}
+
+	STDMETHOD(LookupStencil)(LPCSTR szName, HCACHEITEM * phStencil)
+	{
+		return cacheBase::LookupEntry(szName, phStencil);
+	}
+
+	STDMETHOD(GetStencil)(const HCACHEITEM hStencil, void ** pStencil) const
+	{
+		return cacheBase::GetEntryData(hStencil, pStencil, NULL);
+	}
+
+	STDMETHOD(AddRefStencil)(const HCACHEITEM hStencil)
+	{
+		return cacheBase::AddRefEntry(hStencil);
+	}
+
+	STDMETHOD(ReleaseStencil)(const HCACHEITEM hStencil)
+	{
+		return cacheBase::ReleaseEntry(hStencil);
+	}
+
+	//IStencilCacheControl
+
+	STDMETHOD(RemoveStencil)(const HCACHEITEM hStencil)
+	{
+		return cacheBase::RemoveEntry(hStencil);
+	}
+
+	STDMETHOD(RemoveStencilByName)(LPCSTR szStencil)
+	{
+		return cacheBase::RemoveEntryByKey(szStencil);
+	}
+
+	STDMETHOD(RemoveAllStencils)()
+	{
+		return cacheBase::RemoveAllEntries();
+	}
+
+	STDMETHOD(SetDefaultLifespan)(unsigned __int64 dwdwLifespan)
+	{
+		m_dwdwStencilLifespan = dwdwLifespan;
+		return S_OK;
+	}
+
+	STDMETHOD(GetDefaultLifespan)(unsigned __int64 *pdwdwLifepsan)
+	{
+		HRESULT hr = E_POINTER;
+		if (pdwdwLifepsan)
+		{
+			*pdwdwLifepsan = m_dwdwStencilLifespan;
+			hr = S_OK;
+		}
+		return hr;
+	}
+
+   virtual void OnDestroyEntry(const void * pEntry_)
+   {
+      const NodeType* pEntry = (const NodeType*)pEntry_;
+      ATLASSERT(pEntry);
+      if (!pEntry)
+         return;
+
+      if (pEntry->pClient)
+         pEntry->pClient->Free((void *)&pEntry->Data);
+      if (pEntry->hInstance && m_spDllCache)
+         m_spDllCache->ReleaseModule(pEntry->hInstance);
+   }
+
+
+ /*
+	virtual void OnDestroyEntry(const NodeType * pEntry)
 	{
-		if (!pdwCopied)
-			return E_POINTER;
+		ATLASSERT(pEntry);
+		if (!pEntry)
+			return;
 
-		HRESULT hr = m_critSec.Lock();
-		if (FAILED(hr))
-			return hr;
+		if (pEntry->pClient)
+			pEntry->pClient->Free((void *)&pEntry->Data);
+		if (pEntry->hInstance && m_spDllCache)
+			m_spDllCache->ReleaseModule(pEntry->hInstance);
+	}
+*/
 
-		if (dwCount==0 || pEntries==NULL)
+	HRESULT Uninitialize()
+	{
+		HRESULT hrMonitor=S_OK;
+		if (m_hTimer)
 		{
-			// just return the required size
-			*pdwCopied = m_Dlls.GetSize();
-			m_critSec.Unlock();
-			return S_OK;
+			hrMonitor=m_Monitor.RemoveHandle(m_hTimer);
+			m_hTimer = NULL;
+		}
+		m_Monitor.Shutdown();
+		HRESULT hrCache=cacheBase::Uninitialize();
+		if(FAILED(hrMonitor))
+		{
+			return hrMonitor;
 		}
+		return hrCache;
+	}
+	// IMemoryCacheStats methods
+	HRESULT STDMETHODCALLTYPE ClearStats()
+	{
+		m_statObj.ResetCounters();
+		return S_OK;
+	}
 
-		if (dwCount > (DWORD) m_Dlls.GetSize())
-			dwCount = m_Dlls.GetSize();
-		Checked::memcpy_s(pEntries, dwCount*sizeof(DLL_CACHE_ENTRY), m_Dlls.GetData(), dwCount*sizeof(DLL_CACHE_ENTRY));
-		*pdwCopied = dwCount;
-		m_critSec.Unlock();
+	HRESULT STDMETHODCALLTYPE GetHitCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_statObj.GetHitCount();
 		return S_OK;
 	}
 
-	HRESULT Flush()
+	HRESULT STDMETHODCALLTYPE GetMissCount(DWORD *pdwSize)
 	{
-		HRESULT hr = m_critSec.Lock();
-		if (FAILED(hr))
-			return hr;
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_statObj.GetMissCount();
+		return S_OK;
+	}
 
-		int nLen = m_Dlls.GetSize();
-		for (int i=0; i<nLen; i++)
-		{
-			DLL_CACHE_ENTRY &entry = m_Dlls[i];
-			if (entry.dwRefs == 0 && !entry.bAlive)
-			{
-				_ATLTRY
-				{
-					m_Peer.Remove(entry.hInstDll, &m_DllInfos[i]);
-				}
-				_ATLCATCHALL()
-				{
-					ATLTRACE(atlTraceCache, 2, _T("Exception thrown from user code in CDllCache::Flush\n"));
-				}
+	HRESULT STDMETHODCALLTYPE GetMaxAllocSize(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = AtlCacheSizeToDWORD(m_statObj.GetMaxAllocSize());
+		return S_OK;
+	}
 
-				::FreeLibrary(entry.hInstDll);
-				m_Dlls.RemoveAt(i);
-				m_DllInfos.RemoveAt(i);
-				i--;
-				nLen--;
-			}
-			entry.bAlive = FALSE;
-		}
+	HRESULT STDMETHODCALLTYPE GetCurrentAllocSize(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = AtlCacheSizeToDWORD(m_statObj.GetCurrentAllocSize());
+		return S_OK;
+	}
 
-		m_critSec.Unlock();
+	HRESULT STDMETHODCALLTYPE GetMaxAllocSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = m_statObj.GetMaxAllocSize();
 		return S_OK;
 	}
 
-	HRESULT Execute(DWORD_PTR /*dwParam*/, HANDLE /*hObject*/)
+	HRESULT STDMETHODCALLTYPE GetCurrentAllocSize64(ULONGLONG *pnSize)
 	{
-		Flush();
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = m_statObj.GetCurrentAllocSize();
 		return S_OK;
 	}
 
-	HRESULT CloseHandle(HANDLE hObject)
+	HRESULT STDMETHODCALLTYPE GetMaxEntryCount(DWORD *pdwSize)
 	{
-		ATLASSUME(m_hTimer == hObject);
-		m_hTimer = NULL;
-		::CloseHandle(hObject);
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_statObj.GetMaxEntryCount();
 		return S_OK;
 	}
-}; // CDllCache
 
+	HRESULT STDMETHODCALLTYPE GetCurrentEntryCount(DWORD *pdwSize)
+	{
+		if (!pdwSize)
+			return E_POINTER;
+		*pdwSize = m_statObj.GetCurrentEntryCount();
+		return S_OK;
+	}
+}; // CStencilCache
 
 //
-//IStencilCache
-//IStencilCache is used by a stencil processor to cache pointers to CStencil
-//derived objects.
-
-
-// {8702269B-707D-49cc-AEF8-5FFCB3D6891B}
-extern "C" __declspec(selectany) const IID IID_IStencilCache = { 0x8702269b, 0x707d, 0x49cc, { 0xae, 0xf8, 0x5f, 0xfc, 0xb3, 0xd6, 0x89, 0x1b } };
-
-__interface ATL_NO_VTABLE __declspec(uuid("8702269B-707D-49cc-AEF8-5FFCB3D6891B")) 
-	IStencilCache : public IUnknown
-{
-	// IStencilCache methods
-	STDMETHOD(CacheStencil)(LPCSTR szName, //a name for this cache entry
-								void *pStencil, //a pointer to a CStencil derived object
-								DWORD dwSize, //sizeof pStencil
-								HCACHEITEM *pHandle, //out pointer to a handle to the this cache entry
-								HINSTANCE hInst, //HINSTANCE of the module putting this entry
-												 //in the cache.
-								IMemoryCacheClient *pClient //Interface used to free this instance
-								);
-	STDMETHOD(LookupStencil)(LPCSTR szName, HCACHEITEM * phStencil);
-	STDMETHOD(GetStencil)(const HCACHEITEM hStencil, void ** ppStencil) const;
-	STDMETHOD(AddRefStencil)(const HCACHEITEM hStencil);
-	STDMETHOD(ReleaseStencil)(const HCACHEITEM hStencil);
-};
-
-// {55DEF119-D7A7-4eb7-A876-33365E1C5E1A}
-extern "C" __declspec(selectany) const IID IID_IStencilCacheControl = { 0x55def119, 0xd7a7, 0x4eb7, { 0xa8, 0x76, 0x33, 0x36, 0x5e, 0x1c, 0x5e, 0x1a } };
-__interface ATL_NO_VTABLE __declspec(uuid("55DEF119-D7A7-4eb7-A876-33365E1C5E1A"))
-IStencilCacheControl : public IUnknown
-{
-	//IStencilCacheControl
-	STDMETHOD(RemoveStencil)(const HCACHEITEM hStencil); // Removes the stencil if there are no references,
-														 // otherwise detaches it
-	STDMETHOD(RemoveStencilByName)(LPCSTR szStencil); //removes a stencil if there are no
-													//references to it
-	STDMETHOD(RemoveAllStencils)(); //removes all stencils that don't have references on them
-	STDMETHOD(SetDefaultLifespan)(unsigned __int64 dwdwLifespan); //sets the lifespan for all stencils
-															 //in the cache (in 100 nanosecond units (10,000,000=1 second)).
-	STDMETHOD(GetDefaultLifespan)(unsigned __int64 *pdwdwLifespan);
-};
-
-#ifndef ATL_STENCIL_CACHE_TIMEOUT
-#ifdef _DEBUG
-	#define ATL_STENCIL_CACHE_TIMEOUT 1000
-#else
-	#define ATL_STENCIL_CACHE_TIMEOUT 5000
-#endif // _DEBUG
-#endif // ATL_STENCIL_CACHE_TIMEOUT
-
-#ifndef ATL_STENCIL_LIFESPAN
-#ifdef _DEBUG                    
-	#define ATL_STENCIL_LIFESPAN CFileTime::Second
-#else
-	#define ATL_STENCIL_LIFESPAN CFileTime::Hour
-#endif
-#endif
-
-// timeout before we check if the file
-// has changed in m.s.
-#ifndef ATL_STENCIL_CHECK_TIMEOUT
-	#define ATL_STENCIL_CHECK_TIMEOUT 1000
-#endif
-
+//CShardedStencilCache
+// Description:
+//  A CStencilCache alternative for heavily multithreaded servers.  Implements
+//  the same interfaces, but keeps the stencils in a CShardedMemoryCacheBase
+//  so that lookups and releases of stencils that hash to different segments
+//  do not contend for one lock.
 template <class MonitorClass,
 		class StatClass=CStdStatClass,
 		class SyncClass=CComCriticalSection,
 		class FlushClass=COldFlusher,
-		class CullClass=CLifetimeCuller >
-class CStencilCache :
-	public CMemoryCacheBase<CStencilCache<MonitorClass, StatClass, SyncClass, FlushClass, CullClass>, void *, CCacheDataEx, 
+		class CullClass=CLifetimeCuller,
+		DWORD t_nShards=ATL_CACHE_SHARD_COUNT >
+class CShardedStencilCache :
+	public CShardedMemoryCacheBase<CShardedStencilCache<MonitorClass, StatClass, SyncClass, FlushClass, CullClass, t_nShards>, void *, CCacheDataEx, 
 		CFixedStringKey,  CStringElementTraitsI<CFixedStringKey >, 
-		FlushClass, CullClass, SyncClass, StatClass>,
+		FlushClass, CullClass, SyncClass, StatClass, t_nShards>,
 	public IStencilCache,
 	public IStencilCacheControl,
 	public IWorkerThreadClient,
-	public IMemoryCacheStats,
+	public IMemoryCacheStatsEx,
 	public CComObjectRootEx<CComGlobalsThreadModel>
 {
 protected:
-	typedef CMemoryCacheBase<CStencilCache<MonitorClass, StatClass, SyncClass, FlushClass, CullClass>, void *, CCacheDataEx, 
+	typedef CShardedMemoryCacheBase<CShardedStencilCache<MonitorClass, StatClass, SyncClass, FlushClass, CullClass, t_nShards>, void *, CCacheDataEx, 
 		CFixedStringKey,  CStringElementTraitsI<CFixedStringKey >, 
-		FlushClass, CullClass, SyncClass, StatClass> cacheBase;
+		FlushClass, CullClass, SyncClass, StatClass, t_nShards> cacheBase;
 	unsigned __int64 m_dwdwStencilLifespan;
 
 	MonitorClass m_Monitor;
@@ -2324,14 +4337,13 @@ protected:
 
 public:
 
-	CStencilCache() :
+	CShardedStencilCache() :
 		m_dwdwStencilLifespan(ATL_STENCIL_LIFESPAN),
 		m_hTimer(NULL)
 	{
-
 	}
 
-	~CStencilCache()
+	~CShardedStencilCache()
 	{
 		if (m_hTimer)
 		{
@@ -2341,7 +4353,7 @@ public:
 
 	HRESULT Execute(DWORD_PTR dwParam, HANDLE /*hObject*/)
 	{
-		CStencilCache* pCache = (CStencilCache*)dwParam;
+		CShardedStencilCache* pCache = (CShardedStencilCache*)dwParam;
 		if (pCache)
 			pCache->FlushEntries();
 		return S_OK;
@@ -2392,9 +4404,9 @@ public:
 		return m_Monitor.AddTimer(dwStencilCacheTimeout, this, (DWORD_PTR) this, &m_hTimer);
 	}
 
-
-	BEGIN_COM_MAP(CStencilCache)
+	BEGIN_COM_MAP(CShardedStencilCache)
 		COM_INTERFACE_ENTRY(IMemoryCacheStats)
+		COM_INTERFACE_ENTRY(IMemoryCacheStatsEx)
 		COM_INTERFACE_ENTRY(IStencilCache)
 		COM_INTERFACE_ENTRY(IStencilCacheControl)
 	END_COM_MAP()
@@ -2402,14 +4414,17 @@ public:
 	STDMETHOD(CacheStencil)(LPCSTR szName, void *pStencil, DWORD dwSize, HCACHEITEM *phEntry,
 				HINSTANCE hInstance, IMemoryCacheClient *pClient)
 	{
+		// hold the segment's lock until the entry is filled in and committed,
+		// so no other thread can find it half initialized
+		typename cacheBase::shardType &shard = cacheBase::GetShard(CFixedStringKey(szName));
 		NodeType * pEntry = NULL;
-		HRESULT hr = m_syncObj.Lock();
+		HRESULT hr = shard.GetSyncObj().Lock();
 		if (FAILED(hr))
 			return hr;
 
 		_ATLTRY
 		{
-			hr = cacheBase::AddEntry(szName, pStencil, dwSize,  (HCACHEITEM *)&pEntry);
+			hr = shard.AddEntry(szName, pStencil, dwSize, (HCACHEITEM *)&pEntry);
 		}
 		_ATLCATCHALL()
 		{
@@ -2417,7 +4432,7 @@ public:
 		}
 		if (hr != S_OK)
 		{
-			m_syncObj.Unlock();
+			shard.GetSyncObj().Unlock();
 			return hr;
 		}
 
@@ -2427,14 +4442,14 @@ public:
 		if (hInstance && m_spDllCache)
 			m_spDllCache->AddRefModule(hInstance);
 
-		cacheBase::CommitEntry(static_cast<HCACHEITEM>(pEntry));
+		shard.CommitEntry(static_cast<HCACHEITEM>(pEntry));
 
 		if (phEntry)
 			*phEntry = static_cast<HCACHEITEM>(pEntry);
 		else
-			cacheBase::ReleaseEntry(static_cast<HCACHEITEM>(pEntry));
+			shard.ReleaseEntry(static_cast<HCACHEITEM>(pEntry));
 
-		m_syncObj.Unlock();
+		shard.GetSyncObj().Unlock();
 		return hr;
 	}
 
@@ -2492,23 +4507,9 @@ public:
 		return hr;
 	}
 
-   virtual void OnDestroyEntry(const void * pEntry_)
-   {
-      const NodeType* pEntry = (const NodeType*)pEntry_;
-      ATLASSERT(pEntry);
-      if (!pEntry)
-         return;
-
-      if (pEntry->pClient)
-         pEntry->pClient->Free((void *)&pEntry->Data);
-      if (pEntry->hInstance && m_spDllCache)
-         m_spDllCache->ReleaseModule(pEntry->hInstance);
-   }
-
-
- /*
-	virtual void OnDestroyEntry(const NodeType * pEntry)
+	virtual void OnDestroyEntry(const void * pEntry_)
 	{
+		const NodeType* pEntry = (const NodeType*)pEntry_;
 		ATLASSERT(pEntry);
 		if (!pEntry)
 			return;
@@ -2518,7 +4519,6 @@ public:
 		if (pEntry->hInstance && m_spDllCache)
 			m_spDllCache->ReleaseModule(pEntry->hInstance);
 	}
-*/
 
 	HRESULT Uninitialize()
 	{
@@ -2536,18 +4536,18 @@ public:
 		}
 		return hrCache;
 	}
+
 	// IMemoryCacheStats methods
 	HRESULT STDMETHODCALLTYPE ClearStats()
 	{
-		m_statObj.ResetCounters();
-		return S_OK;
+		return cacheBase::ClearStats();
 	}
 
 	HRESULT STDMETHODCALLTYPE GetHitCount(DWORD *pdwSize)
 	{
 		if (!pdwSize)
 			return E_POINTER;
-		*pdwSize = m_statObj.GetHitCount();
+		*pdwSize = cacheBase::GetHitCount();
 		return S_OK;
 	}
 
@@ -2555,7 +4555,7 @@ public:
 	{
 		if (!pdwSize)
 			return E_POINTER;
-		*pdwSize = m_statObj.GetMissCount();
+		*pdwSize = cacheBase::GetMissCount();
 		return S_OK;
 	}
 
@@ -2563,7 +4563,7 @@ public:
 	{
 		if (!pdwSize)
 			return E_POINTER;
-		*pdwSize = m_statObj.GetMaxAllocSize();
+		*pdwSize = AtlCacheSizeToDWORD(cacheBase::GetMaxAllocSize());
 		return S_OK;
 	}
 
@@ -2571,7 +4571,23 @@ public:
 	{
 		if (!pdwSize)
 			return E_POINTER;
-		*pdwSize = m_statObj.GetCurrentAllocSize();
+		*pdwSize = AtlCacheSizeToDWORD(cacheBase::GetCurrentAllocSize());
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllocSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = cacheBase::GetMaxAllocSize();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetCurrentAllocSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = cacheBase::GetCurrentAllocSize();
 		return S_OK;
 	}
 
@@ -2579,7 +4595,7 @@ public:
 	{
 		if (!pdwSize)
 			return E_POINTER;
-		*pdwSize = m_statObj.GetMaxEntryCount();
+		*pdwSize = cacheBase::GetMaxEntryCount();
 		return S_OK;
 	}
 
@@ -2587,10 +4603,10 @@ public:
 	{
 		if (!pdwSize)
 			return E_POINTER;
-		*pdwSize = m_statObj.GetCurrentEntryCount();
+		*pdwSize = cacheBase::GetCurrentEntryCount();
 		return S_OK;
 	}
-}; // CStencilCache
+}; // CShardedStencilCache
 
 // {105A8866-4059-45fe-86AE-FA0EABBFBBB4}
 extern "C" __declspec(selectany) const IID IID_IFileCache = { 0x105a8866, 0x4059, 0x45fe, { 0x86, 0xae, 0xfa, 0xe, 0xab, 0xbf, 0xbb, 0xb4 } };
@@ -2658,8 +4674,8 @@ class CFileCache:
 			FlushClass, CullClass, SyncClass, StatClass>, 
 	public IWorkerThreadClient,
 	public IFileCache,
-	public IMemoryCacheControl,
-	public IMemoryCacheStats
+	public IMemoryCacheControlEx,
+	public IMemoryCacheStatsEx
 {
 	typedef CMemoryCacheBase<CFileCache<MonitorClass, StatClass, FileCachePeer, FlushClass, SyncClass, CullClass>, LPSTR, CCacheDataPeer<FileCachePeer>, 
 			CFixedStringKey,  CStringElementTraits<CFixedStringKey >, 
@@ -2764,15 +4780,17 @@ public:
 				AddRef();
 				hr = S_OK;
 			}
-			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheStats)))
+			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheStats)) ||
+				InlineIsEqualGUID(riid, __uuidof(IMemoryCacheStatsEx)))
 			{
-				*ppv = (IMemoryCacheStats*)this;
+				*ppv = (IMemoryCacheStatsEx*)this;
 				AddRef();
 				hr = S_OK;
 			}
-			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheControl)))
+			if (InlineIsEqualGUID(riid, __uuidof(IMemoryCacheControl)) ||
+				InlineIsEqualGUID(riid, __uuidof(IMemoryCacheControlEx)))
 			{
-				*ppv = (IMemoryCacheControl*)this;
+				*ppv = (IMemoryCacheControlEx*)this;
 				AddRef();
 				hr = S_OK;
 			}
@@ -2973,6 +4991,26 @@ public:
 		return cacheBase::GetMaxAllowedSize(pdwSize);
 	}
 
+	HRESULT STDMETHODCALLTYPE SetMaxAllowedSize64(ULONGLONG nSize)
+	{
+		return cacheBase::SetMaxAllowedSize64(nSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllowedSize64(ULONGLONG *pnSize)
+	{
+		return cacheBase::GetMaxAllowedSize64(pnSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE SetLowWaterSize(ULONGLONG nSize)
+	{
+		return cacheBase::SetLowWaterSize(nSize);
+	}
+
+	HRESULT STDMETHODCALLTYPE GetLowWaterSize(ULONGLONG *pnSize)
+	{
+		return cacheBase::GetLowWaterSize(pnSize);
+	}
+
 	HRESULT STDMETHODCALLTYPE SetMaxAllowedEntries(DWORD dwSize)
 	{
 		return cacheBase::SetMaxAllowedEntries(dwSize);
@@ -3016,7 +5054,7 @@ public:
 	{
 		if (!pdwSize)
 			return E_POINTER;
-		*pdwSize = m_statObj.GetMaxAllocSize();
+		*pdwSize = AtlCacheSizeToDWORD(m_statObj.GetMaxAllocSize());
 		return S_OK;
 	}
 
@@ -3024,7 +5062,23 @@ public:
 	{
 		if (!pdwSize)
 			return E_POINTER;
-		*pdwSize = m_statObj.GetCurrentAllocSize();
+		*pdwSize = AtlCacheSizeToDWORD(m_statObj.GetCurrentAllocSize());
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetMaxAllocSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = m_statObj.GetMaxAllocSize();
+		return S_OK;
+	}
+
+	HRESULT STDMETHODCALLTYPE GetCurrentAllocSize64(ULONGLONG *pnSize)
+	{
+		if (!pnSize)
+			return E_POINTER;
+		*pnSize = m_statObj.GetCurrentAllocSize();
 		return S_OK;
 	}
 
@@ -0,0 +1,626 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLCACHEFLUSH_H__
+#define __ATLCACHEFLUSH_H__
+
+#pragma once
+
+// The flusher policies used by the memory caches in atlcache.h.  They only
+// rely on the basic ATL types and macros (DWORD, ATLASSERT, ATLENSURE,
+// C_ASSERT), which the including file must provide, so that they can be
+// exercised outside of a Windows build.
+
+#include <string.h>
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+struct CFlusherCacheData
+{
+	CFlusherCacheData *pNext;
+	CFlusherCacheData *pPrev;
+	DWORD dwAccessed;
+	DWORD nKeyHash;
+
+	CFlusherCacheData()
+	{
+		pNext = NULL;
+		pPrev = NULL;
+		dwAccessed = 0;
+		nKeyHash = 0;
+	}
+};
+
+// No flusher -- only expired entries will be removed from the cache
+// Also gives the skeleton for all of the flushers
+class CNoFlusher
+{
+public:
+	void Add(CFlusherCacheData * /*pItem*/) { }
+	void Remove(CFlusherCacheData * /*pItem*/) { }
+	void Access(CFlusherCacheData * /*pItem*/) { }
+	CFlusherCacheData * GetStart() const { return NULL; }
+	CFlusherCacheData * GetNext(CFlusherCacheData * /*pCur*/) const { return NULL; }
+   	void Release(CFlusherCacheData * /*pItem*/){  }
+};
+
+// Old flusher -- oldest items are flushed first
+class COldFlusher
+{
+public:
+	CFlusherCacheData * pHead;
+	CFlusherCacheData * pTail;
+
+	COldFlusher() : pHead(NULL), pTail(NULL)
+	{
+	}
+
+	// Add it to the tail of the list
+	void Add(CFlusherCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+
+		pItem->pNext = NULL;
+		pItem->pPrev = pTail;
+		if (pHead)
+		{
+			pTail->pNext = pItem;
+			pTail = pItem;
+		}
+		else
+		{
+			pHead = pItem;
+			pTail = pItem;
+		}
+	}
+
+	void Remove(CFlusherCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+
+		CFlusherCacheData * pPrev = pItem->pPrev;
+		CFlusherCacheData * pNext = pItem->pNext;
+
+		if (pPrev)
+			pPrev->pNext = pNext;
+		else
+			pHead = pNext;
+
+		if (pNext)
+			pNext->pPrev = pPrev;
+		else
+			pTail = pPrev;
+
+	}
+
+	void Access(CFlusherCacheData * /*pItem*/)
+	{
+	}
+
+	void Release(CFlusherCacheData * /*pItem*/)
+	{
+	}
+
+	CFlusherCacheData * GetStart() const
+	{
+		return pHead;
+	}
+
+	CFlusherCacheData * GetNext(CFlusherCacheData * pCur) const
+	{
+		if (pCur != NULL)
+			return pCur->pNext;
+		else
+			return NULL;
+	}
+};
+
+// Least recently used flusher -- the item that was accessed the longest time ago is flushed
+class CLRUFlusher : public COldFlusher
+{
+public:
+	// Move it to the tail of the list
+	void Access(CFlusherCacheData * pItem)
+	{
+		ATLASSERT(pItem);
+
+		Remove(pItem);
+		Add(pItem);
+	}
+};
+
+// Least often used flusher
+class CLOUFlusher : public COldFlusher
+{
+public:
+	// Adds to the tail of the list
+	void Add(CFlusherCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		pItem->dwAccessed = 1;
+		COldFlusher::Add(pItem);
+	}
+
+	void Access(CFlusherCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		pItem->dwAccessed++;
+
+		CFlusherCacheData * pMark = static_cast<CFlusherCacheData *>(pItem->pPrev);
+		if (!pMark)   // The item is already at the head
+			return;
+
+		if (pMark->dwAccessed >= pItem->dwAccessed) // The element before it has
+			return;                                 // been accessed more times
+
+		Remove(pItem);
+
+		while (pMark && (pMark->dwAccessed < pItem->dwAccessed))
+			pMark = static_cast<CFlusherCacheData *>(pMark->pPrev);
+
+		// pMark points to the first element that has been accessed more times,
+		// so add pItem after pMark
+		if (pMark)
+		{
+			CFlusherCacheData *pNext = static_cast<CFlusherCacheData *>(pMark->pNext);
+			pMark->pNext = pItem;
+			pItem->pPrev = pMark;
+
+			pItem->pNext = pNext;
+			pNext->pPrev = pItem;
+		}
+		else // Ran out of items -- put it on the head
+		{
+			pItem->pNext = pHead;
+			pItem->pPrev = NULL;
+			if (pHead)
+				pHead->pPrev = pItem;
+			else // the list was empty
+				pTail = pItem;
+			pHead = pItem;
+		}
+	}
+
+	// We start at the tail and move forward for this flusher
+	CFlusherCacheData * GetStart() const
+	{
+		return pTail;
+	}
+
+	CFlusherCacheData * GetNext(CFlusherCacheData * pCur) const
+	{
+		if (pCur != NULL)
+			return static_cast<CFlusherCacheData *>(pCur->pPrev);
+		else
+			return NULL;
+	}
+};
+
+template <class CFirst, class CSecond>
+class COrFlushers 
+{
+	CFirst m_First;
+	CSecond m_Second;
+	BOOL m_bWhich;
+public:
+	COrFlushers()
+	{
+		m_bWhich = FALSE;
+	}
+
+	BOOL Switch()
+	{
+		m_bWhich = !m_bWhich;
+		return m_bWhich;
+	}
+
+	void Add(CFlusherCacheData * pItem) 
+	{
+		ATLASSERT(pItem);
+		m_First.Add(pItem);
+		m_Second.Add(pItem);
+	}
+
+	void Remove(CFlusherCacheData * pItem) 
+	{
+		ATLASSERT(pItem);
+		m_First.Remove(pItem);
+		m_Second.Remove(pItem);
+	}
+
+	void Access(CFlusherCacheData * pItem) 
+	{
+		ATLASSERT(pItem);
+		m_First.Access(pItem);
+		m_Second.Access(pItem);
+	}
+	void Release(CFlusherCacheData * pItem)
+	{
+		ATLASSERT(pItem);
+		m_First.Release(pItem);
+		m_Second.Release(pItem);
+	}
+
+	CFlusherCacheData * GetStart() const 
+	{ 
+		if (m_bWhich)
+			return m_First.GetStart();
+		else
+			return m_Second.GetStart();
+	}
+
+	CFlusherCacheData * GetNext(CFlusherCacheData * pCur) const 
+	{ 
+		if (m_bWhich)
+			return m_First.GetNext(pCur);
+		else
+			return m_Second.GetNext(pCur);
+	}
+};
+
+// CLOCK (second chance) flusher -- the items form a ring swept by a hand.
+// Access only sets the item's reference bit; the sweep clears set bits and
+// offers the first item whose bit is clear, so hits never relink the ring.
+class CClockFlusher
+{
+public:
+	mutable CFlusherCacheData * pHand;
+	mutable DWORD m_nSweepLeft;
+	DWORD m_nCount;
+
+	CClockFlusher() : pHand(NULL), m_nSweepLeft(0), m_nCount(0)
+	{
+	}
+
+	// Insert just behind the hand, so a new item is swept last
+	void Add(CFlusherCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+
+		pItem->dwAccessed = 0;
+		if (pHand)
+		{
+			pItem->pNext = pHand;
+			pItem->pPrev = pHand->pPrev;
+			pHand->pPrev->pNext = pItem;
+			pHand->pPrev = pItem;
+		}
+		else
+		{
+			pItem->pNext = pItem;
+			pItem->pPrev = pItem;
+			pHand = pItem;
+		}
+		m_nCount++;
+	}
+
+	void Remove(CFlusherCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		ATLASSERT(m_nCount > 0);
+
+		if (pItem->pNext == pItem)
+		{
+			pHand = NULL;
+		}
+		else
+		{
+			pItem->pPrev->pNext = pItem->pNext;
+			pItem->pNext->pPrev = pItem->pPrev;
+			if (pHand == pItem)
+				pHand = pItem->pNext;
+		}
+		pItem->pNext = NULL;
+		pItem->pPrev = NULL;
+		m_nCount--;
+	}
+
+	void Access(CFlusherCacheData * pItem)
+	{
+		ATLASSERT(pItem);
+		pItem->dwAccessed = 1;
+	}
+
+	void Release(CFlusherCacheData * /*pItem*/)
+	{
+	}
+
+	// Starts a sweep.  Every item is visited at most twice: once to clear
+	// its reference bit and once to be offered.
+	CFlusherCacheData * GetStart() const
+	{
+		m_nSweepLeft = 2 * m_nCount;
+		return Sweep(pHand);
+	}
+
+	// The caller may remove pCur once this returns, so pCur is never
+	// offered again, even when the hand comes back around to it
+	CFlusherCacheData * GetNext(CFlusherCacheData * pCur) const
+	{
+		if (pCur == NULL)
+			return NULL;
+		return Sweep(pCur->pNext, pCur);
+	}
+
+protected:
+	CFlusherCacheData * Sweep(CFlusherCacheData * pItem, CFlusherCacheData * pSkip = NULL) const
+	{
+		while (pItem && m_nSweepLeft)
+		{
+			m_nSweepLeft--;
+			if (pItem != pSkip)
+			{
+				if (pItem->dwAccessed == 0)
+				{
+					pHand = pItem->pNext;
+					return pItem;
+				}
+				pItem->dwAccessed = 0;
+			}
+			pItem = pItem->pNext;
+		}
+		return NULL;
+	}
+};
+
+#ifndef ATL_CACHE_SKETCH_WIDTH
+#define ATL_CACHE_SKETCH_WIDTH 4096
+#endif
+
+//
+// CFrequencySketch
+// A count-min sketch of 4 bit counters (one byte each, four rows) that
+// estimates how often a key hash has been seen.  All counters are halved
+// after 10 * t_nWidth increments, so old popularity fades.
+template <DWORD t_nWidth=ATL_CACHE_SKETCH_WIDTH>
+class CFrequencySketch
+{
+public:
+	enum { MAX_ESTIMATE = 15 };
+
+private:
+	BYTE m_rgCounters[4][t_nWidth];
+	DWORD m_nAdditions;
+
+	static DWORD Index(DWORD nHash, int nRow)
+	{
+		static const DWORD rgSeeds[4] = { 0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F };
+		DWORD n = (nHash + nRow) * rgSeeds[nRow];
+		return (n ^ (n >> 16)) & (t_nWidth-1);
+	}
+
+public:
+	CFrequencySketch()
+	{
+		C_ASSERT(t_nWidth > 0 && (t_nWidth & (t_nWidth-1)) == 0);
+		Reset();
+	}
+
+	void Reset()
+	{
+		memset(m_rgCounters, 0, sizeof(m_rgCounters));
+		m_nAdditions = 0;
+	}
+
+	void Increment(DWORD nHash)
+	{
+		bool bAdded = false;
+		for (int i=0; i<4; i++)
+		{
+			BYTE &bCounter = m_rgCounters[i][Index(nHash, i)];
+			if (bCounter < MAX_ESTIMATE)
+			{
+				bCounter++;
+				bAdded = true;
+			}
+		}
+
+		if (bAdded && ++m_nAdditions >= 10 * t_nWidth)
+		{
+			for (int i=0; i<4; i++)
+				for (DWORD j=0; j<t_nWidth; j++)
+					m_rgCounters[i][j] >>= 1;
+			m_nAdditions /= 2;
+		}
+	}
+
+	DWORD Estimate(DWORD nHash) const
+	{
+		DWORD nMin = MAX_ESTIMATE;
+		for (int i=0; i<4; i++)
+		{
+			DWORD n = m_rgCounters[i][Index(nHash, i)];
+			if (n < nMin)
+				nMin = n;
+		}
+		return nMin;
+	}
+};
+
+#ifndef ATL_CACHE_TINYLFU_WINDOW
+#define ATL_CACHE_TINYLFU_WINDOW 16
+#endif
+
+// TinyLFU flusher -- a segmented LRU guarded by a frequency sketch.
+// New items enter the probation segment; an item that is hit while on
+// probation is promoted once to the protected segment, which holds at most
+// t_nProtectedPercent of the items.  Later hits only update the sketch.
+// Flushing offers probation items first, least frequently seen first,
+// so a burst of one-hit items cannot push out popular ones.  Because the
+// sketch is keyed on the key hash it also remembers items that have been
+// flushed and come back.
+//
+// Only the t_nWindow oldest probation items are ranked by frequency; the
+// rest of the probation segment follows in age order, then the protected
+// segment.  GetStart estimates the window items once, and the sketch has
+// only MAX_ESTIMATE+1 distinct estimates, so the window is offered with
+// at most one pass over those estimates per value, oldest first within
+// each.  Starting a flush costs O(t_nWindow) however large the cache is,
+// and allocates nothing.
+template <DWORD t_nProtectedPercent=80, DWORD t_nSketchWidth=ATL_CACHE_SKETCH_WIDTH, DWORD t_nWindow=ATL_CACHE_TINYLFU_WINDOW>
+class CTinyLFUFlusher
+{
+public:
+	enum { SEGMENT_PROBATION = 0, SEGMENT_PROTECTED = 1 };
+	typedef CFrequencySketch<t_nSketchWidth> sketchType;
+
+	COldFlusher m_probation;
+	COldFlusher m_protected;
+	DWORD m_nProbation;
+	DWORD m_nProtected;
+	sketchType m_sketch;
+
+	// flush state, set up by GetStart: the window items and their
+	// estimates, the window index of the item offered last, the first
+	// probation item past the window, and the estimate being offered --
+	// PHASE_REST once the rest of the probation segment is reached,
+	// PHASE_PROTECTED after that
+	enum { PHASE_REST = sketchType::MAX_ESTIMATE+1, PHASE_PROTECTED };
+	mutable CFlusherCacheData *m_rgWindow[t_nWindow];
+	mutable BYTE m_rgEstimates[t_nWindow];
+	mutable DWORD m_nWindow;
+	mutable DWORD m_nCursor;
+	mutable CFlusherCacheData *m_pWindowEnd;
+	mutable DWORD m_nEstimate;
+
+	CTinyLFUFlusher() : m_nProbation(0), m_nProtected(0),
+		m_nWindow(0), m_nCursor(0), m_pWindowEnd(NULL), m_nEstimate(0)
+	{
+		C_ASSERT(t_nProtectedPercent <= 100);
+		C_ASSERT(t_nWindow > 0);
+	}
+
+	void Add(CFlusherCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		m_sketch.Increment(pItem->nKeyHash);
+		pItem->dwAccessed = SEGMENT_PROBATION;
+		m_probation.Add(pItem);
+		m_nProbation++;
+	}
+
+	void Remove(CFlusherCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		if (pItem->dwAccessed == SEGMENT_PROTECTED)
+		{
+			m_protected.Remove(pItem);
+			m_nProtected--;
+		}
+		else
+		{
+			m_probation.Remove(pItem);
+			m_nProbation--;
+		}
+	}
+
+	void Access(CFlusherCacheData * pItem)
+	{
+		ATLENSURE(pItem);
+		m_sketch.Increment(pItem->nKeyHash);
+		if (pItem->dwAccessed == SEGMENT_PROTECTED)
+			return;
+
+		m_probation.Remove(pItem);
+		m_nProbation--;
+		pItem->dwAccessed = SEGMENT_PROTECTED;
+		m_protected.Add(pItem);
+		m_nProtected++;
+
+		// demote the oldest protected items once the segment is over its share
+		DWORD nTotal = m_nProbation + m_nProtected;
+		while (m_nProtected > 1 &&
+			   (ULONGLONG)m_nProtected * 100 > (ULONGLONG)nTotal * t_nProtectedPercent)
+		{
+			CFlusherCacheData *pDemote = m_protected.GetStart();
+			m_protected.Remove(pDemote);
+			m_nProtected--;
+			pDemote->dwAccessed = SEGMENT_PROBATION;
+			m_probation.Add(pDemote);
+			m_nProbation++;
+		}
+	}
+
+	void Release(CFlusherCacheData * /*pItem*/)
+	{
+	}
+
+	CFlusherCacheData * GetStart() const
+	{
+		CFlusherCacheData *pItem = m_probation.GetStart();
+		for (m_nWindow=0; pItem && m_nWindow<t_nWindow; m_nWindow++)
+		{
+			m_rgWindow[m_nWindow] = pItem;
+			m_rgEstimates[m_nWindow] = (BYTE)m_sketch.Estimate(pItem->nKeyHash);
+			pItem = m_probation.GetNext(pItem);
+		}
+		m_pWindowEnd = pItem;
+
+		m_nEstimate = 0;
+		return FindInWindow(0);
+	}
+
+	CFlusherCacheData * GetNext(CFlusherCacheData * pCur) const
+	{
+		if (pCur == NULL)
+			return NULL;
+
+		if (m_nEstimate == PHASE_PROTECTED)
+			return m_protected.GetNext(pCur);
+
+		if (m_nEstimate == PHASE_REST)
+		{
+			CFlusherCacheData *pNext = m_probation.GetNext(pCur);
+			if (pNext)
+				return pNext;
+			m_nEstimate = PHASE_PROTECTED;
+			return m_protected.GetStart();
+		}
+
+		ATLASSERT(m_rgWindow[m_nCursor] == pCur);
+		return FindInWindow(m_nCursor+1);
+	}
+
+protected:
+	// Returns the first window item from index i on with the current
+	// estimate, moving on to the next estimate from the start of the window
+	// when there is none, and after the last estimate to the items past the
+	// window.  Offered items may have been removed by now, but they are
+	// never looked at again.  Only offered items are removed during a
+	// flush, so m_pWindowEnd stays in the list.
+	CFlusherCacheData * FindInWindow(DWORD i) const
+	{
+		while (m_nEstimate <= sketchType::MAX_ESTIMATE)
+		{
+			for (; i<m_nWindow; i++)
+			{
+				if (m_rgEstimates[i] == m_nEstimate)
+				{
+					m_nCursor = i;
+					return m_rgWindow[i];
+				}
+			}
+			m_nEstimate++;
+			i = 0;
+		}
+
+		m_nEstimate = PHASE_REST;
+		if (m_pWindowEnd)
+			return m_pWindowEnd;
+		m_nEstimate = PHASE_PROTECTED;
+		return m_protected.GetStart();
+	}
+};
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLCACHEFLUSH_H__
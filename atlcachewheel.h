@@ -0,0 +1,234 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLCACHEWHEEL_H__
+#define __ATLCACHEWHEEL_H__
+
+#pragma once
+
+// The hierarchical timing wheel behind CWheelExpireCuller and
+// CWheelLifetimeCuller in atlcache.h. Times are plain ULONGLONG counts
+// (FILETIME units in atlcache.h) passed in by the caller, so the wheel
+// only relies on the basic ATL types and macros (DWORD, ULONGLONG,
+// C_ASSERT), which the including file must provide, and can be exercised
+// outside of a Windows build with any clock.
+
+#include <string.h>
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+#define ATL_CACHE_WHEEL_BITS 6
+#define ATL_CACHE_WHEEL_SIZE (1 << ATL_CACHE_WHEEL_BITS)
+#define ATL_CACHE_WHEEL_LEVELS 4
+
+//
+// CAtlTimingWheel
+// Items are kept in ATL_CACHE_WHEEL_LEVELS levels of 64 slots; a level 0
+// slot covers one tick of t_nTick time units, and each higher level covers
+// 64 slots of the level below. Items further out than the top level wait
+// in an overflow slot. Insert and Remove are O(1). Advance moves the wheel
+// to a new time, cascading higher level slots down as they come due and
+// moving the items of every elapsed level 0 slot to a due list, which
+// GetExpired returns the head of. An item is due once the tick that holds
+// its expiration time has elapsed.
+//
+// TItem must have pNext, pPrev and nWheelSlot members, which belong to the
+// wheel while the item is in it. T derives from CAtlTimingWheel and
+// provides
+//     static ULONGLONG GetExpireTime(const TItem *pItem);
+// where a time of 0 means that the item never expires.
+template <class T, class TItem, ULONGLONG t_nTick>
+class CAtlTimingWheel
+{
+public:
+	enum
+	{
+		SLOT_OVERFLOW = ATL_CACHE_WHEEL_LEVELS * ATL_CACHE_WHEEL_SIZE,
+		SLOT_DUE,
+		SLOT_COUNT,
+		SLOT_NONE = 0xFFFFFFFF
+	};
+
+	ULONGLONG m_nCurrentTick;     // the first tick that has not elapsed yet
+	TItem *m_rgSlots[SLOT_COUNT];
+
+	CAtlTimingWheel()
+	{
+		C_ASSERT(t_nTick > 0);
+		memset(m_rgSlots, 0, sizeof(m_rgSlots));
+		m_nCurrentTick = 0;
+	}
+
+	// Sets the time of an empty wheel
+	void SetCurrentTime(ULONGLONG nNow)
+	{
+		m_nCurrentTick = nNow / t_nTick;
+	}
+
+	// Puts the item in the slot for its expiration time
+	void Insert(TItem *pItem)
+	{
+		ULONGLONG nExpireTime = T::GetExpireTime(pItem);
+		if (nExpireTime == 0)
+		{
+			pItem->nWheelSlot = SLOT_NONE;
+			pItem->pNext = NULL;
+			pItem->pPrev = NULL;
+			return;
+		}
+
+		ULONGLONG nTick = nExpireTime / t_nTick;
+		if (nTick < m_nCurrentTick)
+		{
+			Link(pItem, SLOT_DUE);
+			return;
+		}
+
+		ULONGLONG nDelta = nTick - m_nCurrentTick;
+		for (int nLevel=0; nLevel<ATL_CACHE_WHEEL_LEVELS; nLevel++)
+		{
+			if (nDelta < ((ULONGLONG)1 << (ATL_CACHE_WHEEL_BITS * (nLevel+1))))
+			{
+				Link(pItem, SlotOf(nLevel, nTick));
+				return;
+			}
+		}
+
+		Link(pItem, SLOT_OVERFLOW);
+	}
+
+	void Remove(TItem *pItem)
+	{
+		if (pItem->nWheelSlot == SLOT_NONE)
+			return;
+
+		if (pItem->pPrev)
+			pItem->pPrev->pNext = pItem->pNext;
+		else
+			m_rgSlots[pItem->nWheelSlot] = pItem->pNext;
+
+		if (pItem->pNext)
+			pItem->pNext->pPrev = pItem->pPrev;
+
+		pItem->pNext = NULL;
+		pItem->pPrev = NULL;
+		pItem->nWheelSlot = SLOT_NONE;
+	}
+
+	// Moves the wheel forward to nNow
+	void Advance(ULONGLONG nNow)
+	{
+		ULONGLONG nNowTick = nNow / t_nTick;
+		if (nNowTick <= m_nCurrentTick)
+			return;
+
+		if (nNowTick - m_nCurrentTick > ATL_CACHE_WHEEL_SIZE * ATL_CACHE_WHEEL_SIZE)
+		{
+			// it has been a long time since the last cull -- it is cheaper
+			// to place every item again than to step through each tick
+			TItem *pAll = NULL;
+			for (DWORD i=0; i<SLOT_DUE; i++)
+			{
+				pAll = Append(pAll, m_rgSlots[i]);
+				m_rgSlots[i] = NULL;
+			}
+			m_nCurrentTick = nNowTick;
+			Reinsert(pAll);
+			return;
+		}
+
+		while (m_nCurrentTick < nNowTick)
+		{
+			ULONGLONG nTick = m_nCurrentTick;
+
+			if ((nTick & (((ULONGLONG)1 << (ATL_CACHE_WHEEL_BITS * ATL_CACHE_WHEEL_LEVELS)) - 1)) == 0)
+				Cascade(SLOT_OVERFLOW);
+
+			for (int nLevel=ATL_CACHE_WHEEL_LEVELS-1; nLevel>0; nLevel--)
+			{
+				if ((nTick & (((ULONGLONG)1 << (ATL_CACHE_WHEEL_BITS * nLevel)) - 1)) == 0)
+					Cascade(SlotOf(nLevel, nTick));
+			}
+
+			// every item in the level 0 slot expires during this tick
+			DWORD nSlot = SlotOf(0, nTick);
+			TItem *pItem = m_rgSlots[nSlot];
+			m_rgSlots[nSlot] = NULL;
+			while (pItem)
+			{
+				TItem *pNext = pItem->pNext;
+				Link(pItem, SLOT_DUE);
+				pItem = pNext;
+			}
+
+			m_nCurrentTick++;
+		}
+	}
+
+	// Get the next item that is due
+	TItem * GetExpired() const
+	{
+		return m_rgSlots[SLOT_DUE];
+	}
+
+protected:
+	static DWORD SlotOf(int nLevel, ULONGLONG nTick)
+	{
+		return nLevel * ATL_CACHE_WHEEL_SIZE +
+			(DWORD)((nTick >> (ATL_CACHE_WHEEL_BITS * nLevel)) & (ATL_CACHE_WHEEL_SIZE-1));
+	}
+
+	void Link(TItem *pItem, DWORD nSlot)
+	{
+		pItem->nWheelSlot = nSlot;
+		pItem->pPrev = NULL;
+		pItem->pNext = m_rgSlots[nSlot];
+		if (pItem->pNext)
+			pItem->pNext->pPrev = pItem;
+		m_rgSlots[nSlot] = pItem;
+	}
+
+	// Places the items of a slot again, relative to the current tick
+	void Cascade(DWORD nSlot)
+	{
+		TItem *pItem = m_rgSlots[nSlot];
+		m_rgSlots[nSlot] = NULL;
+		Reinsert(pItem);
+	}
+
+	void Reinsert(TItem *pItem)
+	{
+		while (pItem)
+		{
+			TItem *pNext = pItem->pNext;
+			Insert(pItem);
+			pItem = pNext;
+		}
+	}
+
+	static TItem * Append(TItem *pList, TItem *pOther)
+	{
+		if (!pOther)
+			return pList;
+		TItem *pLast = pOther;
+		while (pLast->pNext)
+			pLast = pLast->pNext;
+		pLast->pNext = pList;
+		if (pList)
+			pList->pPrev = pLast;
+		return pOther;
+	}
+}; // CAtlTimingWheel
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLCACHEWHEEL_H__
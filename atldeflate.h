@@ -0,0 +1,344 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLDEFLATE_H__
+#define __ATLDEFLATE_H__
+
+#pragma once
+
+// The gzip and deflate content codings used for compressed responses and
+// page cache variants in atlisapi.h.  They only rely on the basic ATL
+// types and macros (BYTE, DWORD, ATLASSERT, ATLTRY), which the including
+// file must provide, so that they can be exercised outside of a Windows
+// build.  Output goes to any byte array with the GetCount, SetCount and
+// GetData members of CAtlArray<BYTE>.
+
+#include <string.h>
+
+// Content codings for compressed responses. See AtlGetAcceptedEncoding.
+#define ATLS_ENCODING_IDENTITY	0
+#define ATLS_ENCODING_GZIP		1
+#define ATLS_ENCODING_DEFLATE	2
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+//
+// CAtlDeflateEncoder
+// A single pass DEFLATE (RFC 1951) encoder: greedy LZ77 matching over a
+// 32K window, coded with the fixed Huffman codes in one final block. It
+// gives up some ratio for speed and a fixed amount of state, and is used
+// to build the gzip and deflate content codings of responses.
+class CAtlDeflateEncoder
+{
+public:
+	enum
+	{
+		WINDOW_SIZE = 32768,
+		HASH_BITS = 15,
+		MAX_CHAIN = 32,
+		MIN_MATCH = 3,
+		MAX_MATCH = 258
+	};
+
+	CAtlDeflateEncoder() noexcept
+	{
+		m_pbOut = NULL;
+		m_nOut = 0;
+		m_ullBits = 0;
+		m_nBits = 0;
+		m_pnHead = NULL;
+		m_pnPrev = NULL;
+	}
+
+	~CAtlDeflateEncoder() noexcept
+	{
+		delete [] m_pnHead;
+		delete [] m_pnPrev;
+	}
+
+	// Appends the DEFLATE stream of the cbData bytes at pbData to arrOut.
+	template <class TArray>
+	BOOL Encode(const BYTE *pbData, DWORD cbData, TArray& arrOut) noexcept
+	{
+		// the match tables are kept for the next call
+		if (m_pnHead == NULL)
+			ATLTRY(m_pnHead = new int[1 << HASH_BITS]);
+		if (m_pnPrev == NULL)
+			ATLTRY(m_pnPrev = new int[WINDOW_SIZE]);
+		if (m_pnHead == NULL || m_pnPrev == NULL)
+			return FALSE;
+		memset(m_pnHead, 0xff, sizeof(int) << HASH_BITS);
+		int *pnHead = m_pnHead;
+		int *pnPrev = m_pnPrev;
+
+		// fixed Huffman codes take at most 9 bits per byte
+		size_t nStart = arrOut.GetCount();
+		size_t cbMax = nStart + cbData + cbData/8 + 16;
+		if (cbMax < nStart || !arrOut.SetCount(cbMax))
+			return FALSE;
+		m_pbOut = arrOut.GetData();
+		m_nOut = nStart;
+		m_ullBits = 0;
+		m_nBits = 0;
+
+		PutBits(1, 1);	// BFINAL
+		PutBits(1, 2);	// BTYPE: fixed Huffman codes
+
+		DWORD i = 0;
+		while (i < cbData)
+		{
+			DWORD nBestLen = 0;
+			DWORD nBestDist = 0;
+			if (cbData - i >= MIN_MATCH)
+			{
+				DWORD dwHash = Hash(pbData + i);
+				DWORD nMax = (cbData - i < (DWORD) MAX_MATCH) ? cbData - i : (DWORD) MAX_MATCH;
+				int nCand = pnHead[dwHash];
+				for (int nChain = MAX_CHAIN; nCand >= 0 && i - nCand <= WINDOW_SIZE && nChain > 0; nChain--)
+				{
+					const BYTE *pbCand = pbData + nCand;
+					const BYTE *pbCur = pbData + i;
+					if (pbCand[nBestLen] == pbCur[nBestLen])
+					{
+						DWORD nLen = 0;
+						while (nLen < nMax && pbCand[nLen] == pbCur[nLen])
+							nLen++;
+						if (nLen > nBestLen)
+						{
+							nBestLen = nLen;
+							nBestDist = i - nCand;
+							if (nLen == nMax)
+								break;
+						}
+					}
+					nCand = pnPrev[nCand & (WINDOW_SIZE-1)];
+				}
+				pnPrev[i & (WINDOW_SIZE-1)] = pnHead[dwHash];
+				pnHead[dwHash] = (int) i;
+			}
+
+			if (nBestLen >= MIN_MATCH)
+			{
+				PutMatch(nBestLen, nBestDist);
+				DWORD nEnd = i + nBestLen;
+				for (i++; i < nEnd; i++)
+				{
+					if (cbData - i >= MIN_MATCH)
+					{
+						DWORD dwHash = Hash(pbData + i);
+						pnPrev[i & (WINDOW_SIZE-1)] = pnHead[dwHash];
+						pnHead[dwHash] = (int) i;
+					}
+				}
+			}
+			else
+			{
+				PutLiteral(pbData[i]);
+				i++;
+			}
+		}
+
+		PutLiteral(256);	// end of block
+		if (m_nBits)
+			PutBits(0, 8 - m_nBits);
+
+		arrOut.SetCount(m_nOut);
+		return TRUE;
+	}
+
+private:
+	BYTE *m_pbOut;
+	size_t m_nOut;
+	ULONGLONG m_ullBits;
+	int m_nBits;
+	int *m_pnHead;
+	int *m_pnPrev;
+
+	// not copyable: owns the match tables
+	CAtlDeflateEncoder(const CAtlDeflateEncoder&);
+	CAtlDeflateEncoder& operator=(const CAtlDeflateEncoder&);
+
+	static DWORD Hash(const BYTE *pb) noexcept
+	{
+		return ((pb[0] << 10) ^ (pb[1] << 5) ^ pb[2]) & ((1 << HASH_BITS) - 1);
+	}
+
+	void PutBits(DWORD dwBits, int nBits) noexcept
+	{
+		m_ullBits |= (ULONGLONG) dwBits << m_nBits;
+		m_nBits += nBits;
+		while (m_nBits >= 8)
+		{
+			m_pbOut[m_nOut++] = (BYTE) m_ullBits;
+			m_ullBits >>= 8;
+			m_nBits -= 8;
+		}
+	}
+
+	// Huffman codes are packed starting with their most significant bit
+	void PutCode(DWORD dwCode, int nBits) noexcept
+	{
+		DWORD dwReversed = 0;
+		for (int i = 0; i < nBits; i++)
+		{
+			dwReversed = (dwReversed << 1) | (dwCode & 1);
+			dwCode >>= 1;
+		}
+		PutBits(dwReversed, nBits);
+	}
+
+	void PutLiteral(DWORD dwSymbol) noexcept
+	{
+		if (dwSymbol < 144)
+			PutCode(0x30 + dwSymbol, 8);
+		else if (dwSymbol < 256)
+			PutCode(0x190 + dwSymbol - 144, 9);
+		else if (dwSymbol < 280)
+			PutCode(dwSymbol - 256, 7);
+		else
+			PutCode(0xc0 + dwSymbol - 280, 8);
+	}
+
+	void PutMatch(DWORD nLen, DWORD nDist) noexcept
+	{
+		static const WORD s_rgLenBase[29] = {
+			3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const BYTE s_rgLenExtra[29] = {
+			0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const WORD s_rgDistBase[30] = {
+			1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		static const BYTE s_rgDistExtra[30] = {
+			0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+			7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+		int nCode = 28;
+		while (s_rgLenBase[nCode] > nLen)
+			nCode--;
+		PutLiteral(257 + nCode);
+		if (s_rgLenExtra[nCode])
+			PutBits(nLen - s_rgLenBase[nCode], s_rgLenExtra[nCode]);
+
+		nCode = 29;
+		while (s_rgDistBase[nCode] > nDist)
+			nCode--;
+		PutCode(nCode, 5);
+		if (s_rgDistExtra[nCode])
+			PutBits(nDist - s_rgDistBase[nCode], s_rgDistExtra[nCode]);
+	}
+}; // class CAtlDeflateEncoder
+
+inline DWORD AtlCrc32(DWORD dwCrc, const BYTE *pbData, size_t cbData) noexcept
+{
+	static const DWORD s_rgdwNibble[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+
+	dwCrc = ~dwCrc;
+	for (size_t i = 0; i < cbData; i++)
+	{
+		dwCrc ^= pbData[i];
+		dwCrc = (dwCrc >> 4) ^ s_rgdwNibble[dwCrc & 15];
+		dwCrc = (dwCrc >> 4) ^ s_rgdwNibble[dwCrc & 15];
+	}
+	return ~dwCrc;
+}
+
+inline DWORD AtlAdler32(const BYTE *pbData, size_t cbData) noexcept
+{
+	DWORD dwA = 1;
+	DWORD dwB = 0;
+	while (cbData)
+	{
+		// the largest run that can't overflow dwB before the modulo
+		size_t cbRun = (cbData < 5552) ? cbData : 5552;
+		cbData -= cbRun;
+		while (cbRun--)
+		{
+			dwA += *pbData++;
+			dwB += dwA;
+		}
+		dwA %= 65521;
+		dwB %= 65521;
+	}
+	return (dwB << 16) | dwA;
+}
+
+// Appends the header that precedes the DEFLATE stream in the gzip
+// (RFC 1952) or deflate (zlib, RFC 1950) content coding.
+template <class TArray>
+inline BOOL AtlBeginContentCoding(int nEncoding, TArray& arrOut) noexcept
+{
+	static const BYTE s_rgbGzip[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+	static const BYTE s_rgbZlib[2] = { 0x78, 0x01 };
+
+	ATLASSERT(nEncoding == ATLS_ENCODING_GZIP || nEncoding == ATLS_ENCODING_DEFLATE);
+	const BYTE *pbHeader = (nEncoding == ATLS_ENCODING_GZIP) ? s_rgbGzip : s_rgbZlib;
+	size_t cbHeader = (nEncoding == ATLS_ENCODING_GZIP) ? sizeof(s_rgbGzip) : sizeof(s_rgbZlib);
+
+	size_t nCount = arrOut.GetCount();
+	if (!arrOut.SetCount(nCount + cbHeader))
+		return FALSE;
+	memcpy(arrOut.GetData() + nCount, pbHeader, cbHeader);
+	return TRUE;
+}
+
+// Appends the trailer that follows the DEFLATE stream of the cbData bytes
+// at pbData in the gzip or deflate content coding.
+template <class TArray>
+inline BOOL AtlEndContentCoding(int nEncoding, const BYTE *pbData, DWORD cbData, TArray& arrOut) noexcept
+{
+	BYTE rgbTrailer[8];
+	size_t cbTrailer;
+	if (nEncoding == ATLS_ENCODING_GZIP)
+	{
+		DWORD dwCrc = AtlCrc32(0, pbData, cbData);
+		for (int i = 0; i < 4; i++)
+		{
+			rgbTrailer[i] = (BYTE) (dwCrc >> (8*i));
+			rgbTrailer[4+i] = (BYTE) (cbData >> (8*i));
+		}
+		cbTrailer = 8;
+	}
+	else
+	{
+		DWORD dwAdler = AtlAdler32(pbData, cbData);
+		for (int i = 0; i < 4; i++)
+			rgbTrailer[i] = (BYTE) (dwAdler >> (24 - 8*i));
+		cbTrailer = 4;
+	}
+
+	size_t nCount = arrOut.GetCount();
+	if (!arrOut.SetCount(nCount + cbTrailer))
+		return FALSE;
+	memcpy(arrOut.GetData() + nCount, rgbTrailer, cbTrailer);
+	return TRUE;
+}
+
+// Sets arrOut to the cbData bytes at pbData in the gzip or deflate content
+// coding. Returns FALSE if that fails or doesn't make the data smaller.
+template <class TArray>
+inline BOOL AtlCompressContent(int nEncoding, const BYTE *pbData, DWORD cbData, TArray& arrOut) noexcept
+{
+	arrOut.RemoveAll();
+	CAtlDeflateEncoder encoder;
+	return AtlBeginContentCoding(nEncoding, arrOut) &&
+		encoder.Encode(pbData, cbData, arrOut) &&
+		AtlEndContentCoding(nEncoding, pbData, cbData, arrOut) &&
+		arrOut.GetCount() < cbData;
+}
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLDEFLATE_H__
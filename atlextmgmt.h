@@ -52,6 +52,7 @@
 // _ATL_THREADPOOL_MANAGEMENT (The thread pool manager web service and web based UI)
 // _ATL_STENCILCACHE_MANAGEMENT (The stencil cache manager web service and web based UI)
 // _ATL_DLLCACHE_MANAGEMENT (The DLL cache manager service and web based UI)
+// _ATL_REQUESTSTATS_MANAGEMENT (A plain text dump of the request latency histograms and per handler statistics)
 
 // You can use the following constants to remove the web based UI if you don't
 // want to use it.
@@ -147,6 +148,10 @@
 	#define ID_DLLCACHEMGR_SRFHANDLER_NAME "DllMgrSrf"
 #endif
 
+#ifndef ID_REQUESTSTATS_HANDLER_NAME
+	#define ID_REQUESTSTATS_HANDLER_NAME "RequestStats"
+#endif
+
 #pragma pack(push,_ATL_PACKING)
 namespace ATL {
 
@@ -525,6 +530,19 @@ public:
 		if (!pdwSize)
 			return E_INVALIDARG;
 
+		// prefer the 64-bit size when the cache provides it
+		CComQIPtr<IMemoryCacheStatsEx> spStatsEx(m_spMemCacheStats);
+		if (spStatsEx)
+		{
+			ULONGLONG nValue;
+			HRESULT hr = spStatsEx->GetCurrentAllocSize64(&nValue);
+			if (hr == S_OK)
+			{
+				*pdwSize = (__int64)nValue;
+			}
+			return hr;
+		}
+
 		DWORD dwValue;
 
 		HRESULT hr = m_spMemCacheStats->GetCurrentAllocSize(&dwValue);
@@ -541,6 +559,19 @@ public:
 		if (!pdwSize)
 			return E_INVALIDARG;
 
+		// prefer the 64-bit size when the cache provides it
+		CComQIPtr<IMemoryCacheStatsEx> spStatsEx(m_spMemCacheStats);
+		if (spStatsEx)
+		{
+			ULONGLONG nValue;
+			HRESULT hr = spStatsEx->GetMaxAllocSize64(&nValue);
+			if (hr == S_OK)
+			{
+				*pdwSize = (__int64)nValue;
+			}
+			return hr;
+		}
+
 		DWORD dwValue;
 
 		HRESULT hr = m_spMemCacheStats->GetMaxAllocSize(&dwValue);
@@ -1272,6 +1303,44 @@ __if_exists(_Authority)
 #endif // _ATL_DLLCACHE_NOUI
 #endif // _ATL_DLLCACHE_MANAGEMENT
 
+#ifdef _ATL_REQUESTSTATS_MANAGEMENT
+///////////////////////////////////////////////////////////////////////
+// Request latency statistics
+
+// Writes the queue wait and service time histograms kept by the
+// extension's request stats class as text/plain, followed by the
+// breakdown by request type and handler. See CAtlLatencyHistogram::Render
+// and CRequestBreakdownStats::Render for the format.
+[request_handler(name=ID_REQUESTSTATS_HANDLER_NAME)]
+class CRequestStatsDump
+{
+public:
+	HTTP_CODE HandleRequest(AtlServerRequest *pRequestInfo, IServiceProvider * /*pProvider*/)
+	{
+		HTTP_CODE hcErr = HTTP_SUCCESS;
+
+		// Make sure caller is authorized on this system
+__if_exists(_Authority)
+{
+		hcErr = HTTP_FAIL;
+		ATLTRY(hcErr = _Authority.IsAuthorized(pRequestInfo, ATL_DEFAULT_AUTHGRP))
+		if (hcErr != HTTP_SUCCESS)
+			return hcErr;
+}
+		CComQIPtr<IRequestLatencyStats> spStats(pRequestInfo->pExtension);
+		if (!spStats)
+			return HTTP_ERROR(500, ISE_SUBERR_UNEXPECTED);
+
+		m_HttpResponse.SetContentType("text/plain");
+		m_HttpResponse.AppendHeader("Cache-Control", "no-cache");
+		if (FAILED(spStats->RenderLatencyStats(&m_HttpResponse)))
+			return HTTP_ERROR(500, ISE_SUBERR_UNEXPECTED);
+
+		return HTTP_SUCCESS;
+	}
+};
+#endif // _ATL_REQUESTSTATS_MANAGEMENT
+
 }; // ATL
 
 #pragma pack(pop)
@@ -0,0 +1,151 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLHTTPCOND_H__
+#define __ATLHTTPCOND_H__
+
+#pragma once
+
+// The validators behind the conditional GETs AtlIsNotModified in
+// atlisapi.h answers. They only rely on the basic ATL types and macros
+// (BYTE, WORD, ULONGLONG, LPCSTR, ATLASSERT) and on SYSTEMTIME, FILETIME
+// and SystemTimeToFileTime, which the including file must provide, so
+// that they can be exercised outside of a Windows build.
+
+#include <string.h>
+
+// Starting value for AtlHashValidator.
+#define ATLS_VALIDATOR_SEED 14695981039346656037ULL
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+// Adds cbData bytes to ullHash (64-bit FNV-1a). Used to build strong
+// entity tags from the content they describe.
+inline ULONGLONG AtlHashValidator(ULONGLONG ullHash, const void *pvData, size_t cbData) noexcept
+{
+	const BYTE *pbData = (const BYTE *) pvData;
+	for (size_t i = 0; i < cbData; i++)
+	{
+		ullHash ^= pbData[i];
+		ullHash *= 1099511628211ULL;
+	}
+	return ullHash;
+}
+
+inline BOOL _AtlParseHttpDateField(LPCSTR *pszDate, int nDigits, char chEnd, WORD *pwValue) noexcept
+{
+	LPCSTR szDate = *pszDate;
+	WORD wValue = 0;
+	for (int i = 0; i < nDigits; i++)
+	{
+		if (szDate[i] < '0' || szDate[i] > '9')
+			return FALSE;
+		wValue = (WORD) (wValue * 10 + (szDate[i] - '0'));
+	}
+	if (szDate[nDigits] != chEnd)
+		return FALSE;
+
+	*pszDate = szDate + nDigits + 1;
+	*pwValue = wValue;
+	return TRUE;
+}
+
+// Parses an HTTP date in the preferred format, "Sun, 06 Nov 1994 08:49:37 GMT",
+// which is what SystemTimeToHttpDate writes and what clients send back.
+// Returns FALSE for the obsolete formats.
+inline BOOL AtlParseHttpDate(LPCSTR szDate, FILETIME *pft) noexcept
+{
+	static const char s_szMonths[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+	ATLASSERT(szDate != NULL);
+	ATLASSERT(pft != NULL);
+
+	szDate = strchr(szDate, ',');
+	if (szDate == NULL || szDate[1] != ' ')
+		return FALSE;
+	szDate += 2;
+
+	SYSTEMTIME st;
+	memset(&st, 0x00, sizeof(st));
+	if (!_AtlParseHttpDateField(&szDate, 2, ' ', &st.wDay))
+		return FALSE;
+
+	for (WORD wMonth = 0; wMonth < 12; wMonth++)
+	{
+		if (!strncmp(szDate, s_szMonths + wMonth*3, 3))
+		{
+			st.wMonth = wMonth + 1;
+			break;
+		}
+	}
+	if (st.wMonth == 0 || szDate[3] != ' ')
+		return FALSE;
+	szDate += 4;
+
+	if (!_AtlParseHttpDateField(&szDate, 4, ' ', &st.wYear) ||
+		!_AtlParseHttpDateField(&szDate, 2, ':', &st.wHour) ||
+		!_AtlParseHttpDateField(&szDate, 2, ':', &st.wMinute) ||
+		!_AtlParseHttpDateField(&szDate, 2, ' ', &st.wSecond) ||
+		strcmp(szDate, "GMT"))
+	{
+		return FALSE;
+	}
+
+	return SystemTimeToFileTime(&st, pft);
+}
+
+// Returns TRUE if the entity tag list of an If-None-Match header matches
+// szETag, using the weak comparison RFC 7232 specifies for If-None-Match.
+inline BOOL AtlMatchETag(LPCSTR szETagList, LPCSTR szETag) noexcept
+{
+	ATLASSERT(szETagList != NULL);
+	ATLASSERT(szETag != NULL);
+
+	if (szETag[0] == 'W' && szETag[1] == '/')
+		szETag += 2;
+	size_t cchETag = strlen(szETag);
+
+	LPCSTR szCur = szETagList;
+	for (;;)
+	{
+		while (*szCur == ' ' || *szCur == '\t' || *szCur == ',')
+			szCur++;
+		if (*szCur == '\0')
+			return FALSE;
+		if (*szCur == '*')
+			return TRUE;
+		if (szCur[0] == 'W' && szCur[1] == '/')
+			szCur += 2;
+
+		LPCSTR szEnd = szCur;
+		if (*szEnd == '"')
+		{
+			szEnd = strchr(szEnd+1, '"');
+			if (szEnd == NULL)
+				return FALSE;
+			szEnd++;
+		}
+		else
+		{
+			while (*szEnd && *szEnd != ',')
+				szEnd++;
+		}
+
+		if ((size_t) (szEnd - szCur) == cchETag && !memcmp(szCur, szETag, cchETag))
+			return TRUE;
+		szCur = szEnd;
+	}
+}
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLHTTPCOND_H__
@@ -28,6 +28,14 @@
 #include <atlcache.h>
 #include <atlsrvres.h>
 #include <atlsiface.h>
+#include <atlasyncstate.h>
+#include <atlpoolqueue.h>
+#include <atldeflate.h>
+#include <atlxmltok.h>
+#include <atlurlparams.h>
+#include <atlmultipart.h>
+#include <atllatency.h>
+#include <atlhttpcond.h>
 #include <objbase.h>
 #include <atlsecurity.h>
 #include <errno.h>
@@ -68,7 +76,8 @@
 	#define SESSION_COOKIE_NAME "SESSIONID"
 #endif
 
-// override this if you want to use a different CLSID for SAX
+// override this if you want to use a different CLSID for SAX. It is only
+// used if ATLS_USE_MSXML_SAX is set; see AtlCreateSoapXmlReader.
 #ifndef ATLS_SAXXMLREADER_CLSID
 	#define ATLS_SAXXMLREADER_CLSID __uuidof(SAXXMLReader)
 #endif // ATLS_SAXXMLREADER_CLSID
@@ -122,11 +131,17 @@ extern __declspec(selectany) const TCHAR * const c_tAtlDLLExtension = _T(ATL_DEF
 #endif // ATL_DEFAULT_HANDLER_NAME
 
 
-// maximum timeout for async guard mutex
+// maximum timeout for async guard mutex. No longer used: async
+// continuations are synchronized through AtlServerRequest::lAsyncState
 #ifndef ATLS_ASYNC_MUTEX_TIMEOUT
 	#define ATLS_ASYNC_MUTEX_TIMEOUT 10000
 #endif
 
+// Largest number of buffers passed to the server in one gathered send.
+#ifndef ATLS_MAX_SEND_BUFFERS
+#define ATLS_MAX_SEND_BUFFERS 16
+#endif
+
 #if defined(_M_IA64) || defined (_M_AMD64)
 #define ATLS_FUNCID_INITIALIZEHANDLERS "InitializeAtlHandlers"
 #define ATLS_FUNCID_GETATLHANDLERBYNAME "GetAtlHandlerByName"
@@ -537,7 +552,8 @@ enum ATLSRV_REQUESTTYPE
 {
 	ATLSRV_REQUEST_UNKNOWN=-1,  // The request type isn't known yet
 	ATLSRV_REQUEST_STENCIL,     // The request is for a .srf file
-	ATLSRV_REQUEST_DLL          // The request is for a .dll file
+	ATLSRV_REQUEST_DLL,         // The request is for a .dll file
+	ATLSRV_REQUEST_CACHE        // The request was answered from the page cache
 };
 
 // Flags the InitRequest can return in dwStatus
@@ -548,6 +564,213 @@ enum ATLSRV_REQUESTTYPE
 typedef HTTP_CODE (IRequestHandler::*PFnHandleRequest)(AtlServerRequest *pRequestInfo, IServiceProvider *pProvider);
 typedef void (*PFnAsyncComplete)(AtlServerRequest *pRequestInfo, DWORD cbIO, DWORD dwError);
 
+// Minimum size of the arena space carved out of each AtlServerRequest block.
+// Small dynamic pages are expected to fit entirely in this space.
+#ifndef ATLS_REQUEST_ARENA_SIZE
+#define ATLS_REQUEST_ARENA_SIZE 2048
+#endif
+
+// Size of each additional chunk the request arena takes from the
+// request heap once the initial space is used up.
+#ifndef ATLS_REQUEST_ARENA_CHUNK
+#define ATLS_REQUEST_ARENA_CHUNK 8192
+#endif
+
+//
+// CAtlRequestArena
+// Description:
+// A bump allocator for memory that lives exactly as long as a request.
+// Allocate moves a cursor through the space handed to the constructor
+// and, when that runs out, through chunks taken from the request heap.
+// Free and Reallocate only work in place for the most recent block;
+// everything else is returned in one shot by FreeAll, which
+// CIsapiExtension::FreeRequest calls after the handler and server
+// context have been released. GetStringManager returns a string manager
+// over the arena so CStringA buffers can be built from it as well.
+//
+// A request is only processed by one thread at a time, so the arena
+// does no locking. Anything allocated from it, including CStringA
+// copies that share an arena buffer, must not outlive the request, so
+// the arena is only used for internal scratch such as the private
+// header collection of CHttpResponse. Collections that handlers can
+// reach, like CHttpRequestParams, keep using the default string manager.
+class CAtlRequestArena : public IAtlMemMgr
+{
+protected:
+	struct CChunk
+	{
+		CChunk *pNext;
+	};
+
+	// every block is preceded by its size, padded to keep blocks aligned
+	static const size_t c_nAlign = MEMORY_ALLOCATION_ALIGNMENT;
+	static const size_t c_nHeader = (sizeof(size_t) + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(MEMORY_ALLOCATION_ALIGNMENT - 1);
+	static const size_t c_nChunkHeader = (sizeof(CChunk) + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(MEMORY_ALLOCATION_ALIGNMENT - 1);
+
+	HANDLE m_hHeap;
+	BYTE *m_pInitial;
+	size_t m_nInitial;
+	BYTE *m_pCur;
+	BYTE *m_pEnd;
+	void *m_pLast;
+	CChunk *m_pChunks;
+	CAtlStringMgr m_strMgr;
+
+	static size_t AlignUp(__in size_t n) noexcept
+	{
+		return (n + c_nAlign - 1) & ~(c_nAlign - 1);
+	}
+
+	void *Carve(__in BYTE *pBlock, __in size_t nBytes) noexcept
+	{
+		*reinterpret_cast<size_t *>(pBlock) = nBytes;
+		return pBlock + c_nHeader;
+	}
+
+	BYTE *AllocChunk(__in size_t nBytes) noexcept
+	{
+		if (m_hHeap == NULL || nBytes > ((size_t)-1) - c_nChunkHeader)
+			return NULL;
+
+		CChunk *pChunk = static_cast<CChunk *>(HeapAlloc(m_hHeap, 0, c_nChunkHeader + nBytes));
+		if (pChunk == NULL)
+			return NULL;
+
+		pChunk->pNext = m_pChunks;
+		m_pChunks = pChunk;
+		return reinterpret_cast<BYTE *>(pChunk) + c_nChunkHeader;
+	}
+
+public:
+	CAtlRequestArena(__in HANDLE hHeap, __in_bcount_opt(nInitial) void *pInitial, __in size_t nInitial) noexcept :
+		m_hHeap(hHeap),
+		m_pInitial(static_cast<BYTE *>(pInitial)),
+		m_nInitial(pInitial ? nInitial & ~(c_nAlign - 1) : 0),
+		m_pLast(NULL),
+		m_pChunks(NULL)
+	{
+		ATLASSERT(((UINT_PTR)pInitial & (c_nAlign - 1)) == 0);
+		m_pCur = m_pInitial;
+		m_pEnd = m_pInitial + m_nInitial;
+		m_strMgr.SetMemoryManager(this);
+	}
+
+	~CAtlRequestArena() noexcept
+	{
+		FreeAll();
+	}
+
+	// returns a string manager whose CStringA buffers come from this arena
+	IAtlStringMgr *GetStringManager() noexcept
+	{
+		return &m_strMgr;
+	}
+
+	// releases every chunk taken from the request heap and rewinds the
+	// cursor to the start of the initial space
+	void FreeAll() noexcept
+	{
+		while (m_pChunks != NULL)
+		{
+			CChunk *pNext = m_pChunks->pNext;
+			HeapFree(m_hHeap, 0, m_pChunks);
+			m_pChunks = pNext;
+		}
+		m_pCur = m_pInitial;
+		m_pEnd = m_pInitial + m_nInitial;
+		m_pLast = NULL;
+	}
+
+	// IAtlMemMgr
+	virtual void *Allocate(__in size_t nBytes) noexcept
+	{
+		if (nBytes > ((size_t)-1) - c_nHeader - c_nAlign)
+			return NULL;
+
+		size_t nNeed = c_nHeader + AlignUp(nBytes);
+		if (nNeed > (size_t)(m_pEnd - m_pCur))
+		{
+			// large blocks get a chunk of their own so the space left
+			// in the current chunk is not thrown away
+			if (nNeed > ATLS_REQUEST_ARENA_CHUNK/2)
+			{
+				BYTE *pBlock = AllocChunk(nNeed);
+				return pBlock ? Carve(pBlock, nBytes) : NULL;
+			}
+
+			BYTE *pBlock = AllocChunk(ATLS_REQUEST_ARENA_CHUNK);
+			if (pBlock == NULL)
+				return NULL;
+			m_pCur = pBlock;
+			m_pEnd = pBlock + ATLS_REQUEST_ARENA_CHUNK;
+		}
+
+		m_pLast = Carve(m_pCur, nBytes);
+		m_pCur += nNeed;
+		return m_pLast;
+	}
+
+	virtual void Free(__in_opt void *p) noexcept
+	{
+		// only the most recent block can be given back early
+		if (p != NULL && p == m_pLast)
+		{
+			m_pCur = static_cast<BYTE *>(p) - c_nHeader;
+			m_pLast = NULL;
+		}
+	}
+
+	virtual void *Reallocate(__in_opt void *p, __in size_t nBytes) noexcept
+	{
+		if (p == NULL)
+			return Allocate(nBytes);
+
+		if (nBytes > ((size_t)-1) - c_nHeader - c_nAlign)
+			return NULL;
+
+		if (p == m_pLast && AlignUp(nBytes) <= (size_t)(m_pEnd - static_cast<BYTE *>(p)))
+		{
+			// the last block can grow or shrink where it is
+			m_pCur = Carve(static_cast<BYTE *>(p) - c_nHeader, nBytes) + AlignUp(nBytes);
+			return p;
+		}
+
+		size_t nOld = GetSize(p);
+		void *pNew = Allocate(nBytes);
+		if (pNew != NULL)
+			Checked::memcpy_s(pNew, nBytes, p, __min(nOld, nBytes));
+		return pNew;
+	}
+
+	virtual size_t GetSize(__in void *p) noexcept
+	{
+		ATLENSURE_RETURN_VAL(p != NULL, 0);
+		return *reinterpret_cast<size_t *>(static_cast<BYTE *>(p) - c_nHeader);
+	}
+
+private:
+	CAtlRequestArena(__in const CAtlRequestArena&);
+	CAtlRequestArena& operator=(__in const CAtlRequestArena&);
+}; // class CAtlRequestArena
+
+#pragma push_macro("new")
+#undef new
+// Constructs a CAtlRequestArena in the memory at pv, which must be
+// suitably aligned and at least sizeof(CAtlRequestArena) bytes.
+inline CAtlRequestArena *_AtlConstructRequestArena(
+	__out_bcount(sizeof(CAtlRequestArena)) void *pv,
+	__in HANDLE hHeap,
+	__in_bcount_opt(nInitial) void *pInitial,
+	__in size_t nInitial) noexcept
+{
+	ATLASSERT(pv != NULL);
+	return new(pv) CAtlRequestArena(hHeap, pInitial, nInitial);
+}
+#pragma pop_macro("new")
+
+struct CPageCacheFill;
+class CServerContext;
+
 struct AtlServerRequest
 {
 	DWORD cbSize;							// For future compatibility
@@ -566,10 +789,9 @@ struct AtlServerRequest
 	HCACHEITEM hEntry;
 	IFileCache* pFileCache;
 
-	HANDLE m_hMutex;						// necessary to syncronize calls to HandleRequest
-											// if HandleRequest could potientially make an
-											// async call before returning. only used
-											// if indicated with ATLSRV_INIT_USEASYNC_EX
+	HANDLE m_hMutex;						// no longer created; ATLSRV_INIT_USEASYNC_EX requests are
+											// synchronized through lAsyncState. Closed by
+											// _ReleaseAtlServerRequest if a caller sets it
 
 	DWORD dwStartTicks;						// Tick count when the request was received
 	EXTENSION_CONTROL_BLOCK *pECB;
@@ -578,8 +800,84 @@ struct AtlServerRequest
 	LPCSTR pszBuffer;						// buffer to be flushed asyncronously
 	DWORD dwBufferLen;						// length of data in pszBuffer
 	void* pUserData;						// value that can be used to pass user data between parent and child handlers
+	CAtlRequestArena *pArena;				// per-request allocator, freed in one shot by FreeRequest.
+											// NULL if the request was not created by CIsapiExtension::CreateRequest
+	DWORD dwWorkerAffinity;					// 1-based index of the pool worker that last ran the request, 0 if none.
+											// Set by CWorkStealingThreadPool so continuations return to the same worker
+	DWORD dwQueueInfo;						// Depth of the queue the request was last taken from, combined with
+											// ATLSRV_QUEUE_STOLEN if another worker stole it. Set by CWorkStealingThreadPool
+	volatile LONG lAsyncState;				// necessary to syncronize calls to HandleRequest if HandleRequest
+											// could potentially make an async call before returning.
+											// ATLSRV_ASYNC_NONE unless indicated with ATLSRV_INIT_USEASYNC_EX
+	DWORD cbAsyncIO;						// the last I/O completion for the request. Also holds the
+	DWORD dwAsyncError;						// completion left for DispatchStencilCall when lAsyncState
+											// is ATLSRV_ASYNC_PENDING
+	IMemoryCache* pMemoryCache;				// Set instead of pFileCache when hEntry is a page
+											// served from the in-memory page cache
+	CPageCacheFill* pPageFill;				// Set while the request renders a page that other requests
+											// for the same URL wait for. See CIsapiExtension::BeginPageFill
+	BOOL bNoPageFill;						// The request renders its page itself rather than wait for
+											// another request to cache it
+	ULONGLONG ullStartTime;					// AtlGetMicroseconds() when the request was received
+	ULONGLONG ullQueuedTime;				// AtlGetMicroseconds() when the request was last queued,
+											// 0 while it runs
+	DWORD dwQueueWait;						// Microseconds the request last waited for a worker
+	DWORD dwTotalQueueWait;					// Microseconds the request has waited for workers in all
+	CHAR szHandlerName[ATL_MAX_HANDLER_NAME_LEN+1];	// Name of the handler the request was dispatched to,
+											// empty until the handler is loaded
+	CServerContext *pClientContext;			// The context that writes to the client, which pServerContext
+											// may wrap. Not AddRef'd; counts the bytes sent for the request
 };
 
+// Returns a monotonic clock reading in microseconds, used to time requests.
+inline ULONGLONG AtlGetMicroseconds() noexcept
+{
+	LARGE_INTEGER liFrequency;
+	LARGE_INTEGER liCounter;
+	if (!QueryPerformanceFrequency(&liFrequency) || !QueryPerformanceCounter(&liCounter) ||
+		liFrequency.QuadPart <= 0)
+	{
+		return (ULONGLONG) GetTickCount() * 1000;
+	}
+
+	// split the conversion so the multiplication can't overflow
+	ULONGLONG ullFrequency = (ULONGLONG) liFrequency.QuadPart;
+	ULONGLONG ullCounter = (ULONGLONG) liCounter.QuadPart;
+	return (ullCounter / ullFrequency) * 1000000 + (ullCounter % ullFrequency) * 1000000 / ullFrequency;
+}
+
+// Records that the request is being queued for a worker thread.
+inline void AtlOnRequestQueued(__inout AtlServerRequest *pRequest) noexcept
+{
+	ATLASSERT(pRequest);
+	if (pRequest->cbSize >= sizeof(AtlServerRequest))
+		pRequest->ullQueuedTime = AtlGetMicroseconds();
+}
+
+// Records that a worker thread has taken the request from its queue,
+// setting dwQueueWait to the time it waited.
+inline void AtlOnRequestDequeued(__inout AtlServerRequest *pRequest) noexcept
+{
+	ATLASSERT(pRequest);
+	if (pRequest->cbSize < sizeof(AtlServerRequest) || !pRequest->ullQueuedTime)
+		return;
+
+	ULONGLONG ullWait = AtlGetMicroseconds() - pRequest->ullQueuedTime;
+	pRequest->dwQueueWait = (ullWait > ULONG_MAX) ? ULONG_MAX : (DWORD) ullWait;
+	pRequest->dwTotalQueueWait += __min(pRequest->dwQueueWait, ULONG_MAX - pRequest->dwTotalQueueWait);
+	pRequest->ullQueuedTime = 0;
+}
+
+// Returns the string manager of the request's arena, or NULL if the
+// request does not have one (for example, it was created by an older
+// IIsapiExtension implementation).
+inline IAtlStringMgr *AtlGetRequestStringMgr(__in_opt AtlServerRequest *pRequest) noexcept
+{
+	if (pRequest == NULL || pRequest->cbSize < sizeof(AtlServerRequest) || pRequest->pArena == NULL)
+		return NULL;
+	return pRequest->pArena->GetStringManager();
+}
+
 inline void _ReleaseAtlServerRequest(__inout AtlServerRequest* pRequest)
 {	
 	ATLENSURE(pRequest!=NULL);
@@ -597,139 +895,1338 @@ typedef BOOL (__stdcall *GETATLHANDLERBYNAME)(LPCSTR szHandlerName, IIsapiExtens
 typedef BOOL (__stdcall *INITIALIZEATLHANDLERS)(IHttpServerContext*, IIsapiExtension*);
 typedef void (__stdcall *UNINITIALIZEATLHANDLERS)();
 
-// initial size of thread worker heap (per thread)
-// The heap is growable.  The default initial is 16KB
-#ifndef ATLS_WORKER_HEAP_SIZE
-#define ATLS_WORKER_HEAP_SIZE 16384
+#ifndef ATL_NO_SOAP
+
+// Set to 1 to parse SOAP messages with the SAXXMLReader named by
+// ATLS_SAXXMLREADER_CLSID instead of the built-in CAtlSoapXmlReader.
+#ifndef ATLS_USE_MSXML_SAX
+#define ATLS_USE_MSXML_SAX 0
 #endif
 
-class CIsapiWorker
+// Largest document buffer, in bytes, that a CAtlSoapXmlReader keeps
+// between parses. Larger buffers are freed once the parse is done.
+#ifndef ATLS_SOAP_XML_KEEP_SIZE
+#define ATLS_SOAP_XML_KEEP_SIZE 65536
+#endif
+
+//
+// CAtlSoapXmlReader
+// A SAX reader for SOAP messages on top of CAtlXmlTokenizer (atlxmltok.h).
+// parse reads the whole stream into a buffer that is kept from one parse
+// to the next and has the tokenizer work on it in place. Names and text
+// are converted to UTF-16 only into a reusable scratch buffer, so that no
+// memory is allocated per element. Documents without a byte order mark
+// must be UTF-8; UTF-16LE is converted to UTF-8 first.
+//
+// The reader is also the ISAXAttributes passed to startElement, which is
+// valid until the handler returns. It is used by a single thread at a time.
+class CAtlSoapXmlReader :
+	public CComObjectRootEx<CComSingleThreadModel>,
+	public ISAXXMLReader,
+	public ISAXAttributes
 {
 public:
-	typedef AtlServerRequest* RequestType;
-	HANDLE m_hHeap;
-#ifndef ATL_NO_SOAP
-	CComPtr<ISAXXMLReader> m_spReader;
-#endif
+	BEGIN_COM_MAP(CAtlSoapXmlReader)
+		COM_INTERFACE_ENTRY(ISAXXMLReader)
+	END_COM_MAP()
 
-	CIsapiWorker() noexcept
+protected:
+	// The UTF-16 names and value of an attribute of the current element,
+	// as offsets in the scratch buffer
+	struct CWideAttribute
+	{
+		size_t nwUri;
+		size_t nwLocalName;
+		size_t nwQName;
+		size_t nwValue;
+		int cwUri;
+		int cwLocalName;
+		int cwQName;
+		int cwValue;
+	};
+
+	CComPtr<ISAXContentHandler> m_spContentHandler;
+	CComPtr<ISAXErrorHandler> m_spErrorHandler;
+
+	CAtlXmlTokenizer m_Tokenizer;
+	CHeapPtr<char> m_szDoc;			// the document, nul-terminated
+	size_t m_cbDocMax;
+	CHeapPtr<wchar_t> m_wszScratch;	// UTF-16 names and text for the current event
+	size_t m_cchScratchMax;
+
+	CAtlArray<CWideAttribute> m_arrAttributes;
+	size_t m_nAttributes;
+
+	static bool IsEqual(__in_ecount(cch1) const wchar_t *wsz1, __in int cch1,
+		__in_ecount(cch2) const wchar_t *wsz2, __in int cch2) noexcept
 	{
-		m_hHeap = NULL;
+		return (cch1 == cch2 && !memcmp(wsz1, wsz2, cch1*sizeof(wchar_t)));
 	}
 
-	virtual ~CIsapiWorker() noexcept
+	HRESULT Fail(__in LPCWSTR wszMessage) noexcept
 	{
-		ATLASSUME(m_hHeap == NULL);
+		ATLTRACE( _T("ATLSOAP: CAtlSoapXmlReader -- %ws\r\n"), wszMessage );
+		if (m_spErrorHandler)
+			m_spErrorHandler->fatalError(NULL, wszMessage, E_FAIL);
+		return E_FAIL;
 	}
 
-	virtual BOOL Initialize(__inout __crt_typefix(IIsapiExtension*) void *pvParam)
+	// Reports the error that stopped the tokenizer
+	HRESULT FailTokenizer(__in HRESULT hr) noexcept
 	{
-		IIsapiExtension* pExtension = (IIsapiExtension*) pvParam;
-		ATLENSURE(pExtension);
-		if (!(pExtension->OnThreadAttach()))
+		if (hr == E_OUTOFMEMORY)
+			return hr;
+
+		// the messages are ASCII
+		wchar_t wszMessage[64];
+		LPCSTR szMessage = m_Tokenizer.GetErrorMessage();
+		size_t i = 0;
+		for (; szMessage && szMessage[i] && i < _countof(wszMessage)-1; i++)
+			wszMessage[i] = (wchar_t) szMessage[i];
+		wszMessage[i] = L'\0';
+		return Fail(wszMessage);
+	}
+
+	BOOL ReserveDoc(__in size_t cbDoc) noexcept
+	{
+		if (cbDoc <= m_cbDocMax)
+			return TRUE;
+
+		size_t cbNew = __max(cbDoc, m_cbDocMax*2);
+		if (!m_szDoc.Reallocate(cbNew))
 			return FALSE;
+		m_cbDocMax = cbNew;
+		return TRUE;
+	}
 
-		m_hHeap = HeapCreate(HEAP_NO_SERIALIZE, ATLS_WORKER_HEAP_SIZE, 0);
-		if (!m_hHeap)
+	BOOL ReserveScratch(__in size_t cchScratch) noexcept
+	{
+		if (cchScratch <= m_cchScratchMax)
+			return TRUE;
+
+		size_t cchNew = __max(cchScratch, m_cchScratchMax*2);
+		if (cchNew > ((size_t)-1)/sizeof(wchar_t) || !m_wszScratch.Reallocate(cchNew))
 			return FALSE;
-#ifndef ATL_NO_SOAP
-		if (FAILED(m_spReader.CoCreateInstance(ATLS_SAXXMLREADER_CLSID, NULL, CLSCTX_INPROC_SERVER )))
-		{
-			ATLASSERT( FALSE );
-			ATLTRACE( atlTraceISAPI, 0, _T("MSXML3 is not installed -- web services will not work.") );
-		}
-#endif
-		return pExtension->SetThreadWorker(this);
+		m_cchScratchMax = cchNew;
+		return TRUE;
 	}
 
-	virtual void Terminate(__inout_opt __crt_typefix(IIsapiExtension*) void* pvParam) noexcept
+	// Reads the document into m_szDoc and returns its length.
+	HRESULT ReadDocument(__in VARIANT& varInput, __out size_t *pcbDoc) noexcept
 	{
-		if (m_hHeap)
+		*pcbDoc = 0;
+		if (V_VT(&varInput) == VT_BSTR)
 		{
-			if (HeapDestroy(m_hHeap))
-				m_hHeap = NULL;
-			else
+			int cchInput = (int) SysStringLen(V_BSTR(&varInput));
+			int cbDoc = cchInput ? WideCharToMultiByte(CP_UTF8, 0, V_BSTR(&varInput), cchInput, NULL, 0, NULL, NULL) : 0;
+			if (cchInput && !cbDoc)
+				return AtlHresultFromLastError();
+			if (!ReserveDoc((size_t) cbDoc + 1))
+				return E_OUTOFMEMORY;
+			if (cbDoc)
+				WideCharToMultiByte(CP_UTF8, 0, V_BSTR(&varInput), cchInput, m_szDoc, cbDoc, NULL, NULL);
+			*pcbDoc = cbDoc;
+			return S_OK;
+		}
+
+		if (V_VT(&varInput) != VT_UNKNOWN && V_VT(&varInput) != VT_DISPATCH)
+			return E_INVALIDARG;
+
+		CComQIPtr<ISequentialStream> spStream(V_UNKNOWN(&varInput));
+		if (!spStream)
+			return E_INVALIDARG;
+
+		size_t cbDoc = 0;
+		for (;;)
+		{
+			if (!ReserveDoc(cbDoc + 4096 + 1))
+				return E_OUTOFMEMORY;
+
+			ULONG cbRead = 0;
+			ULONG cbMax = (ULONG) __min(m_cbDocMax - cbDoc - 1, (size_t) ULONG_MAX);
+			HRESULT hr = spStream->Read(m_szDoc + cbDoc, cbMax, &cbRead);
+			if (FAILED(hr))
+				return hr;
+			cbDoc += cbRead;
+			if (hr == S_FALSE || cbRead == 0)
+				break;
+			if (cbDoc > INT_MAX)
+				return E_OUTOFMEMORY;
+		}
+
+		// the names and text handed to SAX have int lengths
+		if (cbDoc > INT_MAX)
+			return E_OUTOFMEMORY;
+
+		// UTF-16LE documents are converted to UTF-8 at the end of the
+		// buffer and moved down
+		if (cbDoc >= 2 && (BYTE) m_szDoc[0] == 0xFF && (BYTE) m_szDoc[1] == 0xFE)
+		{
+			int cchInput = (int) ((cbDoc - 2) / sizeof(wchar_t));
+			int cbUtf8 = cchInput ? WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR) (m_szDoc + 2), cchInput, NULL, 0, NULL, NULL) : 0;
+			if (cchInput && !cbUtf8)
+				return AtlHresultFromLastError();
+			if (!ReserveDoc(cbDoc + cbUtf8 + 1))
+				return E_OUTOFMEMORY;
+			if (cbUtf8)
 			{
-				ATLASSERT(FALSE);
+				WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR) (m_szDoc + 2), cchInput, m_szDoc + cbDoc, cbUtf8, NULL, NULL);
+				memmove(m_szDoc, m_szDoc + cbDoc, cbUtf8);
 			}
+			cbDoc = cbUtf8;
+		}
+		else if (cbDoc >= 2 && (BYTE) m_szDoc[0] == 0xFE && (BYTE) m_szDoc[1] == 0xFF)
+		{
+			return Fail(L"UTF-16BE documents are not supported");
 		}
 
-#ifndef ATL_NO_SOAP
-		m_spReader.Release();
-#endif
-		if (pvParam != NULL)
-			(static_cast<IIsapiExtension*>(pvParam))->OnThreadTerminate();
+		*pcbDoc = cbDoc;
+		return S_OK;
 	}
 
-	void Execute(__inout AtlServerRequest *pRequestInfo, __inout __crt_typefix(IIsapiExtension*) void *pvParam, __reserved OVERLAPPED *pOverlapped)
+	// Converts the cch UTF-8 bytes at sz to UTF-16 at the end of the
+	// scratch buffer, which must have room for cch characters, and
+	// returns the number of characters written, or -1 if the bytes
+	// are not valid UTF-8.
+	int Widen(__in_ecount(cch) const char *sz, __in int cch, __inout size_t *pnScratch) noexcept
 	{
-		ATLENSURE(pRequestInfo != NULL);
-		ATLENSURE(pvParam != NULL);
-		(pOverlapped);    // unused
-		ATLASSUME(m_hHeap != NULL);
-		// any exceptions thrown at this point should have been caught in an
-		// override of DispatchStencilCall. They will not be thrown out of this
-		// function.
-		_ATLTRY
+		ATLASSERT(*pnScratch + cch <= m_cchScratchMax);
+		wchar_t *wsz = m_wszScratch + *pnScratch;
+
+		// most names and values are ASCII
+		int i = 0;
+		while (i < cch && !(sz[i] & 0x80))
 		{
-			(static_cast<IIsapiExtension*>(pvParam))->DispatchStencilCall(pRequestInfo);
+			wsz[i] = (wchar_t) sz[i];
+			i++;
 		}
-		_ATLCATCHALL()
+
+		int cw = i;
+		if (i < cch)
 		{
-			ATLTRACE(_T("Warning. An uncaught exception was thrown from DispatchStencilCall\n"));
-			ATLASSERT(FALSE);
+			int cwRest = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, sz + i, cch - i, wsz + i, cch - i);
+			if (!cwRest)
+				return -1;
+			cw += cwRest;
 		}
+		*pnScratch += cw;
+		return cw;
 	}
 
-	virtual BOOL GetWorkerData(DWORD /*dwParam*/, void ** /*ppvData*/) noexcept
+	HRESULT Characters() noexcept
 	{
-		return FALSE;
-	}
-};
+		const char *sz;
+		int cch;
+		m_Tokenizer.GetText(&sz, &cch);
+		if (!ReserveScratch(cch))
+			return E_OUTOFMEMORY;
 
-inline void _AtlGetScriptPathTranslated(
-	__in LPCSTR szPathTranslated, 
-	__inout CFixedStringT<CStringA, MAX_PATH>& strScriptPathTranslated)
-{
-	ATLENSURE(szPathTranslated!=NULL);
-	LPCSTR szEnd = szPathTranslated;
+		size_t nScratch = 0;
+		int cw = Widen(sz, cch, &nScratch);
+		if (cw < 0)
+			return Fail(L"invalid UTF-8");
 
-	while (TRUE)
-	{
-		while (*szEnd != '.' && *szEnd != '\0')
-			szEnd++;
-		if (*szEnd == '\0')
-			break;
+		CComPtr<ISAXContentHandler> spHandler = m_spContentHandler;
+		return spHandler ? spHandler->characters(m_wszScratch, cw) : S_OK;
+	}
 
-		szEnd++;
+	HRESULT StartElement() noexcept
+	{
+		const CAtlXmlElement& element = m_Tokenizer.GetElement();
+		size_t nAttributes = m_Tokenizer.GetAttributeCount();
+		size_t nNamespaces = m_Tokenizer.GetNamespaceCount();
 
-		size_t nLen(0);
-		if (!AsciiStrnicmp(szEnd, c_AtlDLLExtension+1, ATLS_DLL_EXTENSION_LEN))
-			nLen = ATLS_DLL_EXTENSION_LEN;
-		else if (!AsciiStrnicmp(szEnd, c_AtlSRFExtension+1, ATLS_EXTENSION_LEN))
-			nLen = ATLS_EXTENSION_LEN;
+		size_t cchScratch = element.cchUri + element.cchQName + element.cchLocalName;
+		for (size_t i = 0; i < nAttributes; i++)
+		{
+			const CAtlXmlAttribute& attr = m_Tokenizer.GetAttribute(i);
+			cchScratch += attr.cchUri + attr.cchQName + attr.cchLocalName + attr.cchValue;
+		}
+		for (size_t i = element.nNamespaces; i < nNamespaces; i++)
+		{
+			const CAtlXmlNamespace& ns = m_Tokenizer.GetNamespace(i);
+			cchScratch = __max(cchScratch, (size_t) ns.cchPrefix + ns.cchUri);
+		}
+		if (!ReserveScratch(cchScratch))
+			return E_OUTOFMEMORY;
 
-		if (nLen)
+		_ATLTRY
 		{
-			szEnd += nLen;
-			if (!*szEnd || *szEnd == '/' || *szEnd == '\\' || *szEnd == '?' || *szEnd == '#')
-				break;
+			if (m_arrAttributes.GetCount() < nAttributes && !m_arrAttributes.SetCount(nAttributes))
+				return E_OUTOFMEMORY;
+		}
+		_ATLCATCHALL()
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		HRESULT hr = S_OK;
+		CComPtr<ISAXContentHandler> spHandler;
+		for (size_t i = element.nNamespaces; i < nNamespaces && SUCCEEDED(hr); i++)
+		{
+			const CAtlXmlNamespace& ns = m_Tokenizer.GetNamespace(i);
+			size_t nScratch = 0;
+			int cwPrefix = Widen(ns.szPrefix, ns.cchPrefix, &nScratch);
+			int cwUri = Widen(ns.szUri, ns.cchUri, &nScratch);
+			if (cwPrefix < 0 || cwUri < 0)
+				return Fail(L"invalid UTF-8");
+			spHandler = m_spContentHandler;
+			if (spHandler)
+				hr = spHandler->startPrefixMapping(m_wszScratch, cwPrefix, m_wszScratch + cwPrefix, cwUri);
 		}
+		if (FAILED(hr))
+			return hr;
+
+		size_t nScratch = 0;
+		int cwUri = Widen(element.szUri, element.cchUri, &nScratch);
+		size_t nwQName = nScratch;
+		int cwQName = Widen(element.szQName, element.cchQName, &nScratch);
+		size_t nwLocalName = nScratch;
+		int cwLocalName = Widen(element.szLocalName, element.cchLocalName, &nScratch);
+		if (cwUri < 0 || cwQName < 0 || cwLocalName < 0)
+			return Fail(L"invalid UTF-8");
+
+		for (size_t i = 0; i < nAttributes; i++)
+		{
+			const CAtlXmlAttribute& attr = m_Tokenizer.GetAttribute(i);
+			CWideAttribute& wattr = m_arrAttributes[i];
+			wattr.nwUri = nScratch;
+			wattr.cwUri = Widen(attr.szUri, attr.cchUri, &nScratch);
+			wattr.nwQName = nScratch;
+			wattr.cwQName = Widen(attr.szQName, attr.cchQName, &nScratch);
+			wattr.nwLocalName = nScratch;
+			wattr.cwLocalName = Widen(attr.szLocalName, attr.cchLocalName, &nScratch);
+			wattr.nwValue = nScratch;
+			wattr.cwValue = Widen(attr.szValue, attr.cchValue, &nScratch);
+			if (wattr.cwUri < 0 || wattr.cwQName < 0 || wattr.cwLocalName < 0 || wattr.cwValue < 0)
+				return Fail(L"invalid UTF-8");
+		}
+
+		spHandler = m_spContentHandler;
+		if (spHandler)
+		{
+			m_nAttributes = nAttributes;
+			hr = spHandler->startElement(m_wszScratch, cwUri, m_wszScratch + nwLocalName, cwLocalName,
+				m_wszScratch + nwQName, cwQName, static_cast<ISAXAttributes *>(this));
+			m_nAttributes = 0;
+		}
+		return hr;
 	}
 
-	DWORD dwResult = (DWORD)(szEnd - szPathTranslated);
-	char *szScriptPathTranslated = NULL;
-	ATLTRY(szScriptPathTranslated = strScriptPathTranslated.GetBuffer(dwResult));
-	if (szScriptPathTranslated)
+	// Reports the end of the current element and of its namespace
+	// declarations.
+	HRESULT EndElement() noexcept
 	{
-		Checked::memcpy_s(szScriptPathTranslated, dwResult, szPathTranslated, dwResult);
-		szScriptPathTranslated[dwResult] = '\0';
-		strScriptPathTranslated.ReleaseBuffer(dwResult);
-	}
-}
+		const CAtlXmlElement& element = m_Tokenizer.GetElement();
+		if (!ReserveScratch(element.cchUri + element.cchQName + element.cchLocalName))
+			return E_OUTOFMEMORY;
 
+		size_t nScratch = 0;
+		int cwUri = Widen(element.szUri, element.cchUri, &nScratch);
+		size_t nwQName = nScratch;
+		int cwQName = Widen(element.szQName, element.cchQName, &nScratch);
+		size_t nwLocalName = nScratch;
+		int cwLocalName = Widen(element.szLocalName, element.cchLocalName, &nScratch);
+		if (cwUri < 0 || cwQName < 0 || cwLocalName < 0)
+			return Fail(L"invalid UTF-8");
 
-struct CStencilState
+		HRESULT hr = S_OK;
+		CComPtr<ISAXContentHandler> spHandler = m_spContentHandler;
+		if (spHandler)
+		{
+			hr = spHandler->endElement(m_wszScratch, cwUri, m_wszScratch + nwLocalName, cwLocalName,
+				m_wszScratch + nwQName, cwQName);
+		}
+
+		for (size_t i = m_Tokenizer.GetNamespaceCount(); SUCCEEDED(hr) && i > element.nNamespaces; i--)
+		{
+			const CAtlXmlNamespace& ns = m_Tokenizer.GetNamespace(i-1);
+			if (!ReserveScratch(ns.cchPrefix))
+				return E_OUTOFMEMORY;
+			nScratch = 0;
+			int cwPrefix = Widen(ns.szPrefix, ns.cchPrefix, &nScratch);
+			spHandler = m_spContentHandler;
+			if (spHandler)
+				hr = spHandler->endPrefixMapping(m_wszScratch, cwPrefix);
+		}
+		return hr;
+	}
+
+	HRESULT ParseDocument(__inout char *szDoc, __in size_t cbDoc) noexcept
+	{
+		HRESULT hr = m_Tokenizer.Initialize(szDoc, cbDoc);
+		if (FAILED(hr))
+			return FailTokenizer(hr);
+
+		CComPtr<ISAXContentHandler> spHandler = m_spContentHandler;
+		hr = spHandler ? spHandler->startDocument() : S_OK;
+
+		int nToken = 0;
+		while (SUCCEEDED(hr))
+		{
+			hr = m_Tokenizer.Next(&nToken);
+			if (FAILED(hr))
+				return FailTokenizer(hr);
+
+			if (nToken == ATL_XML_START_ELEMENT)
+				hr = StartElement();
+			else if (nToken == ATL_XML_END_ELEMENT)
+				hr = EndElement();
+			else if (nToken == ATL_XML_CHARACTERS)
+				hr = Characters();
+			else
+				break;
+		}
+		if (FAILED(hr))
+			return hr;
+
+		ATLASSERT(nToken == ATL_XML_END_DOCUMENT);
+		spHandler = m_spContentHandler;
+		return spHandler ? spHandler->endDocument() : S_OK;
+	}
+
+	// Looks up an attribute of the current element by its UTF-16 names.
+	int FindAttribute(__in_ecount_opt(cchUri) const wchar_t *wszUri, __in int cchUri,
+		__in_ecount(cchName) const wchar_t *wszName, __in int cchName, __in bool bQName) noexcept
+	{
+		if (!wszName)
+			return -1;
+
+		for (size_t i = 0; i < m_nAttributes; i++)
+		{
+			const CWideAttribute& attr = m_arrAttributes[i];
+			if (bQName)
+			{
+				if (IsEqual(m_wszScratch + attr.nwQName, attr.cwQName, wszName, cchName))
+					return (int) i;
+			}
+			else if (IsEqual(m_wszScratch + attr.nwLocalName, attr.cwLocalName, wszName, cchName) &&
+				(wszUri ? IsEqual(m_wszScratch + attr.nwUri, attr.cwUri, wszUri, cchUri) : attr.cwUri == 0))
+			{
+				return (int) i;
+			}
+		}
+		return -1;
+	}
+
+	bool IsValidIndex(__in int nIndex) noexcept
+	{
+		return (nIndex >= 0 && (size_t) nIndex < m_nAttributes);
+	}
+
+public:
+	CAtlSoapXmlReader() noexcept :
+		m_cbDocMax(0), m_cchScratchMax(0), m_nAttributes(0)
+	{
+	}
+
+	//
+	// ISAXXMLReader
+	//
+
+	HRESULT __stdcall getFeature(const wchar_t * /*wszName*/, VARIANT_BOOL * /*pvfValue*/)
+	{
+		return E_NOTIMPL;
+	}
+
+	HRESULT __stdcall putFeature(const wchar_t * /*wszName*/, VARIANT_BOOL /*vfValue*/)
+	{
+		return E_NOTIMPL;
+	}
+
+	HRESULT __stdcall getProperty(const wchar_t * /*wszName*/, VARIANT * /*pvarValue*/)
+	{
+		return E_NOTIMPL;
+	}
+
+	HRESULT __stdcall putProperty(const wchar_t * /*wszName*/, VARIANT /*varValue*/)
+	{
+		return E_NOTIMPL;
+	}
+
+	HRESULT __stdcall getEntityResolver(ISAXEntityResolver **ppResolver)
+	{
+		if (!ppResolver)
+			return E_POINTER;
+		*ppResolver = NULL;
+		return S_OK;
+	}
+
+	HRESULT __stdcall putEntityResolver(ISAXEntityResolver * /*pResolver*/)
+	{
+		return E_NOTIMPL;
+	}
+
+	HRESULT __stdcall getContentHandler(ISAXContentHandler **ppHandler)
+	{
+		if (!ppHandler)
+			return E_POINTER;
+		return m_spContentHandler.CopyTo(ppHandler);
+	}
+
+	HRESULT __stdcall putContentHandler(ISAXContentHandler *pHandler)
+	{
+		m_spContentHandler = pHandler;
+		return S_OK;
+	}
+
+	HRESULT __stdcall getDTDHandler(ISAXDTDHandler **ppHandler)
+	{
+		if (!ppHandler)
+			return E_POINTER;
+		*ppHandler = NULL;
+		return S_OK;
+	}
+
+	HRESULT __stdcall putDTDHandler(ISAXDTDHandler * /*pHandler*/)
+	{
+		return E_NOTIMPL;
+	}
+
+	HRESULT __stdcall getErrorHandler(ISAXErrorHandler **ppHandler)
+	{
+		if (!ppHandler)
+			return E_POINTER;
+		return m_spErrorHandler.CopyTo(ppHandler);
+	}
+
+	HRESULT __stdcall putErrorHandler(ISAXErrorHandler *pHandler)
+	{
+		m_spErrorHandler = pHandler;
+		return S_OK;
+	}
+
+	HRESULT __stdcall getBaseURL(const wchar_t **pwszBaseUrl)
+	{
+		if (!pwszBaseUrl)
+			return E_POINTER;
+		*pwszBaseUrl = NULL;
+		return S_OK;
+	}
+
+	HRESULT __stdcall putBaseURL(const wchar_t * /*wszBaseUrl*/)
+	{
+		return E_NOTIMPL;
+	}
+
+	HRESULT __stdcall getSecureBaseURL(const wchar_t **pwszSecureBaseUrl)
+	{
+		if (!pwszSecureBaseUrl)
+			return E_POINTER;
+		*pwszSecureBaseUrl = NULL;
+		return S_OK;
+	}
+
+	HRESULT __stdcall putSecureBaseURL(const wchar_t * /*wszSecureBaseUrl*/)
+	{
+		return E_NOTIMPL;
+	}
+
+	HRESULT __stdcall parse(VARIANT varInput)
+	{
+		size_t cbDoc = 0;
+		HRESULT hr = ReadDocument(varInput, &cbDoc);
+		if (SUCCEEDED(hr))
+		{
+			m_nAttributes = 0;
+			hr = ParseDocument(m_szDoc, cbDoc);
+			m_nAttributes = 0;
+		}
+
+		if (m_cbDocMax > ATLS_SOAP_XML_KEEP_SIZE)
+		{
+			m_szDoc.Free();
+			m_cbDocMax = 0;
+		}
+		if (m_cchScratchMax > ATLS_SOAP_XML_KEEP_SIZE)
+		{
+			m_wszScratch.Free();
+			m_cchScratchMax = 0;
+		}
+		return hr;
+	}
+
+	HRESULT __stdcall parseURL(const wchar_t * /*wszUrl*/)
+	{
+		return E_NOTIMPL;
+	}
+
+	//
+	// ISAXAttributes
+	//
+
+	HRESULT __stdcall getLength(int *pnLength)
+	{
+		if (!pnLength)
+			return E_POINTER;
+		*pnLength = (int) m_nAttributes;
+		return S_OK;
+	}
+
+	HRESULT __stdcall getURI(int nIndex, const wchar_t **pwszUri, int *pcchUri)
+	{
+		if (!pwszUri || !pcchUri)
+			return E_POINTER;
+		if (!IsValidIndex(nIndex))
+			return E_INVALIDARG;
+		*pwszUri = m_wszScratch + m_arrAttributes[nIndex].nwUri;
+		*pcchUri = m_arrAttributes[nIndex].cwUri;
+		return S_OK;
+	}
+
+	HRESULT __stdcall getLocalName(int nIndex, const wchar_t **pwszLocalName, int *pcchLocalName)
+	{
+		if (!pwszLocalName || !pcchLocalName)
+			return E_POINTER;
+		if (!IsValidIndex(nIndex))
+			return E_INVALIDARG;
+		*pwszLocalName = m_wszScratch + m_arrAttributes[nIndex].nwLocalName;
+		*pcchLocalName = m_arrAttributes[nIndex].cwLocalName;
+		return S_OK;
+	}
+
+	HRESULT __stdcall getQName(int nIndex, const wchar_t **pwszQName, int *pcchQName)
+	{
+		if (!pwszQName || !pcchQName)
+			return E_POINTER;
+		if (!IsValidIndex(nIndex))
+			return E_INVALIDARG;
+		*pwszQName = m_wszScratch + m_arrAttributes[nIndex].nwQName;
+		*pcchQName = m_arrAttributes[nIndex].cwQName;
+		return S_OK;
+	}
+
+	HRESULT __stdcall getName(int nIndex, const wchar_t **pwszUri, int *pcchUri,
+		const wchar_t **pwszLocalName, int *pcchLocalName, const wchar_t **pwszQName, int *pcchQName)
+	{
+		HRESULT hr = getURI(nIndex, pwszUri, pcchUri);
+		if (SUCCEEDED(hr))
+			hr = getLocalName(nIndex, pwszLocalName, pcchLocalName);
+		if (SUCCEEDED(hr))
+			hr = getQName(nIndex, pwszQName, pcchQName);
+		return hr;
+	}
+
+	HRESULT __stdcall getIndexFromName(const wchar_t *wszUri, int cchUri,
+		const wchar_t *wszLocalName, int cchLocalName, int *pnIndex)
+	{
+		if (!pnIndex)
+			return E_POINTER;
+		*pnIndex = FindAttribute(wszUri, cchUri, wszLocalName, cchLocalName, false);
+		return (*pnIndex < 0) ? E_INVALIDARG : S_OK;
+	}
+
+	HRESULT __stdcall getIndexFromQName(const wchar_t *wszQName, int cchQName, int *pnIndex)
+	{
+		if (!pnIndex)
+			return E_POINTER;
+		*pnIndex = FindAttribute(NULL, 0, wszQName, cchQName, true);
+		return (*pnIndex < 0) ? E_INVALIDARG : S_OK;
+	}
+
+	HRESULT __stdcall getType(int nIndex, const wchar_t **pwszType, int *pcchType)
+	{
+		if (!pwszType || !pcchType)
+			return E_POINTER;
+		if (!IsValidIndex(nIndex))
+			return E_INVALIDARG;
+
+		// without a DTD every attribute is CDATA
+		*pwszType = L"CDATA";
+		*pcchType = sizeof("CDATA")-1;
+		return S_OK;
+	}
+
+	HRESULT __stdcall getTypeFromName(const wchar_t *wszUri, int cchUri,
+		const wchar_t *wszLocalName, int cchLocalName, const wchar_t **pwszType, int *pcchType)
+	{
+		return getType(FindAttribute(wszUri, cchUri, wszLocalName, cchLocalName, false), pwszType, pcchType);
+	}
+
+	HRESULT __stdcall getTypeFromQName(const wchar_t *wszQName, int cchQName,
+		const wchar_t **pwszType, int *pcchType)
+	{
+		return getType(FindAttribute(NULL, 0, wszQName, cchQName, true), pwszType, pcchType);
+	}
+
+	HRESULT __stdcall getValue(int nIndex, const wchar_t **pwszValue, int *pcchValue)
+	{
+		if (!pwszValue || !pcchValue)
+			return E_POINTER;
+		if (!IsValidIndex(nIndex))
+			return E_INVALIDARG;
+		*pwszValue = m_wszScratch + m_arrAttributes[nIndex].nwValue;
+		*pcchValue = m_arrAttributes[nIndex].cwValue;
+		return S_OK;
+	}
+
+	HRESULT __stdcall getValueFromName(const wchar_t *wszUri, int cchUri,
+		const wchar_t *wszLocalName, int cchLocalName, const wchar_t **pwszValue, int *pcchValue)
+	{
+		return getValue(FindAttribute(wszUri, cchUri, wszLocalName, cchLocalName, false), pwszValue, pcchValue);
+	}
+
+	HRESULT __stdcall getValueFromQName(const wchar_t *wszQName, int cchQName,
+		const wchar_t **pwszValue, int *pcchValue)
+	{
+		return getValue(FindAttribute(NULL, 0, wszQName, cchQName, true), pwszValue, pcchValue);
+	}
+}; // class CAtlSoapXmlReader
+
+// Creates the SAX reader that parses SOAP messages: a CAtlSoapXmlReader,
+// or the reader named by ATLS_SAXXMLREADER_CLSID if ATLS_USE_MSXML_SAX is set.
+inline HRESULT AtlCreateSoapXmlReader(__deref_out ISAXXMLReader **ppReader) noexcept
+{
+	if (!ppReader)
+		return E_POINTER;
+	*ppReader = NULL;
+
+#if ATLS_USE_MSXML_SAX
+	return CoCreateInstance(ATLS_SAXXMLREADER_CLSID, NULL, CLSCTX_INPROC_SERVER,
+		__uuidof(ISAXXMLReader), (void **) ppReader);
+#else
+	CComObjectNoLock<CAtlSoapXmlReader> *pReader = NULL;
+	ATLTRY(pReader = new CComObjectNoLock<CAtlSoapXmlReader>);
+	if (pReader == NULL)
+		return E_OUTOFMEMORY;
+	*ppReader = static_cast<ISAXXMLReader *>(pReader);
+	pReader->AddRef();
+	return S_OK;
+#endif
+}
+
+#endif // ATL_NO_SOAP
+
+// initial size of thread worker heap (per thread)
+// The heap is growable.  The default initial is 16KB
+#ifndef ATLS_WORKER_HEAP_SIZE
+#define ATLS_WORKER_HEAP_SIZE 16384
+#endif
+
+class CIsapiWorker
+{
+public:
+	typedef AtlServerRequest* RequestType;
+	HANDLE m_hHeap;
+#ifndef ATL_NO_SOAP
+	CComPtr<ISAXXMLReader> m_spReader;
+#endif
+
+	CIsapiWorker() noexcept
+	{
+		m_hHeap = NULL;
+	}
+
+	virtual ~CIsapiWorker() noexcept
+	{
+		ATLASSUME(m_hHeap == NULL);
+	}
+
+	virtual BOOL Initialize(__inout __crt_typefix(IIsapiExtension*) void *pvParam)
+	{
+		IIsapiExtension* pExtension = (IIsapiExtension*) pvParam;
+		ATLENSURE(pExtension);
+		if (!(pExtension->OnThreadAttach()))
+			return FALSE;
+
+		m_hHeap = HeapCreate(HEAP_NO_SERIALIZE, ATLS_WORKER_HEAP_SIZE, 0);
+		if (!m_hHeap)
+			return FALSE;
+#ifndef ATL_NO_SOAP
+		if (FAILED(AtlCreateSoapXmlReader(&m_spReader)))
+		{
+			ATLASSERT( FALSE );
+			ATLTRACE( atlTraceISAPI, 0, _T("Failed to create the SAX reader -- web services will not work.") );
+		}
+#endif
+		return pExtension->SetThreadWorker(this);
+	}
+
+	virtual void Terminate(__inout_opt __crt_typefix(IIsapiExtension*) void* pvParam) noexcept
+	{
+		if (m_hHeap)
+		{
+			if (HeapDestroy(m_hHeap))
+				m_hHeap = NULL;
+			else
+			{
+				ATLASSERT(FALSE);
+			}
+		}
+
+#ifndef ATL_NO_SOAP
+		m_spReader.Release();
+#endif
+		if (pvParam != NULL)
+			(static_cast<IIsapiExtension*>(pvParam))->OnThreadTerminate();
+	}
+
+	void Execute(__inout AtlServerRequest *pRequestInfo, __inout __crt_typefix(IIsapiExtension*) void *pvParam, __reserved OVERLAPPED *pOverlapped)
+	{
+		ATLENSURE(pRequestInfo != NULL);
+		ATLENSURE(pvParam != NULL);
+		(pOverlapped);    // unused
+		ATLASSUME(m_hHeap != NULL);
+		// any exceptions thrown at this point should have been caught in an
+		// override of DispatchStencilCall. They will not be thrown out of this
+		// function.
+		_ATLTRY
+		{
+			(static_cast<IIsapiExtension*>(pvParam))->DispatchStencilCall(pRequestInfo);
+		}
+		_ATLCATCHALL()
+		{
+			ATLTRACE(_T("Warning. An uncaught exception was thrown from DispatchStencilCall\n"));
+			ATLASSERT(FALSE);
+		}
+	}
+
+	virtual BOOL GetWorkerData(DWORD /*dwParam*/, void ** /*ppvData*/) noexcept
+	{
+		return FALSE;
+	}
+};
+
+// Default number of worker threads per processor when
+// CWorkStealingThreadPool::Initialize is passed 0 threads.
+#ifndef ATLS_DEFAULT_THREADSPERPROC
+#define ATLS_DEFAULT_THREADSPERPROC 2
+#endif
+
+// Default time CWorkStealingThreadPool::Shutdown waits for workers to exit.
+#ifndef ATLS_DEFAULT_THREADPOOLSHUTDOWNTIMEOUT
+#define ATLS_DEFAULT_THREADPOOLSHUTDOWNTIMEOUT 30000
+#endif
+
+// Maximum number of worker threads a CWorkStealingThreadPool can run.
+#ifndef ATLS_POOL_MAX_WORKERS
+#define ATLS_POOL_MAX_WORKERS 256
+#endif
+
+// The pool records which worker ran a request and how it got there.
+// These functions do nothing for request types other than AtlServerRequest*.
+template <class RequestType>
+inline DWORD _AtlGetRequestWorker(__in RequestType /*request*/) noexcept
+{
+	return 0;
+}
+
+template <class RequestType>
+inline void _AtlSetRequestWorker(__in RequestType /*request*/, __in DWORD /*dwWorker*/, __in DWORD /*dwQueueInfo*/) noexcept
+{
+}
+
+inline DWORD _AtlGetRequestWorker(__in AtlServerRequest *pRequest) noexcept
+{
+	if (pRequest == NULL || pRequest->cbSize < sizeof(AtlServerRequest))
+		return 0;
+	return pRequest->dwWorkerAffinity;
+}
+
+inline void _AtlSetRequestWorker(__inout AtlServerRequest *pRequest, __in DWORD dwWorker, __in DWORD dwQueueInfo) noexcept
+{
+	if (pRequest == NULL || pRequest->cbSize < sizeof(AtlServerRequest))
+		return;
+	pRequest->dwWorkerAffinity = dwWorker;
+	pRequest->dwQueueInfo = dwQueueInfo;
+}
+
+// The lock of each CWorkStealingThreadPool queue; the pool also tries
+// it, so that idle workers skip queues that another thread is using
+class CWorkStealingQueueLock : public CComCriticalSection
+{
+public:
+	BOOL TryLock() noexcept
+	{
+		return TryEnterCriticalSection(&m_sec);
+	}
+};
+
+//
+// CWorkStealingThreadPool
+// Description:
+// A thread pool that can be used as the ThreadPoolClass of CIsapiExtension
+// in place of CThreadPool. Every worker thread owns a FIFO queue with its
+// own lock, rather than all of them sharing one I/O completion port.
+// New requests are spread round robin over the queues. A request that is
+// queued again (an async continuation requeued from AsyncCallback) goes
+// back to the worker that last ran it, so its handler and heap are still
+// warm in that processor's cache. A worker whose queue is empty steals the
+// oldest request from another worker's queue before it goes to sleep.
+// The queues and the way workers take requests from them are in
+// CAtlWorkStealingScheduler (atlpoolqueue.h); the pool adds the threads.
+//
+// For AtlServerRequest requests, the pool records the worker in
+// dwWorkerAffinity. It also records dwQueueInfo: the depth of the queue
+// the request was taken from, plus ATLSRV_QUEUE_STOLEN if the request
+// was stolen. CIsapiExtension passes these to CRequestStatClass::OnRequestScheduled.
+//
+// Worker has the same requirements as for CThreadPool: a RequestType
+// typedef and Initialize, Execute and Terminate methods. Execute is
+// passed a NULL OVERLAPPED pointer.
+template <class Worker, class ThreadTraits=DefaultThreadTraits>
+class CWorkStealingThreadPool :
+	public IThreadPoolConfig,
+	public CAtlWorkStealingScheduler<CWorkStealingThreadPool<Worker, ThreadTraits>, typename Worker::RequestType, CWorkStealingQueueLock>
+{
+public:
+	typedef typename Worker::RequestType RequestType;
+	typedef CAtlWorkStealingScheduler<CWorkStealingThreadPool<Worker, ThreadTraits>, RequestType, CWorkStealingQueueLock> baseScheduler;
+	typedef typename baseScheduler::CSlot CSlot;
+
+	using baseScheduler::m_ppSlots;
+	using baseScheduler::m_nWorkers;
+	using baseScheduler::m_lQueued;
+	using baseScheduler::m_lStolen;
+
+protected:
+	struct CWorkerSlot : public CSlot
+	{
+		CWorkStealingThreadPool *pPool;
+		HANDLE hThread;
+		HANDLE hWake;				// auto-reset, set to wake the worker when it is idle
+		BOOL bInitialized;			// result of Worker::Initialize
+	};
+
+	DWORD m_nCapacity;
+	volatile LONG m_lShutdown;
+	void *m_pvWorkerParam;
+	DWORD m_dwStackSize;
+	DWORD m_dwMaxWait;
+	HANDLE m_hThreadEvent;
+	CComCriticalSection m_critSec;	// serializes changes to the number of workers
+
+public:
+	CWorkStealingThreadPool() noexcept :
+		m_nCapacity(0),
+		m_lShutdown(0),
+		m_pvWorkerParam(NULL),
+		m_dwStackSize(0),
+		m_dwMaxWait(ATLS_DEFAULT_THREADPOOLSHUTDOWNTIMEOUT),
+		m_hThreadEvent(NULL)
+	{
+	}
+
+	~CWorkStealingThreadPool() noexcept
+	{
+		Shutdown();
+	}
+
+	// Starts nNumThreads workers, or ATLS_DEFAULT_THREADSPERPROC per
+	// processor if nNumThreads is 0, or -nNumThreads per processor if it
+	// is negative. hCompletion is accepted for compatibility with
+	// CThreadPool and is not used.
+	HRESULT Initialize(__in_opt void *pvWorkerParam=NULL, __in int nNumThreads=0, __in DWORD dwStackSize=0, __in HANDLE hCompletion=INVALID_HANDLE_VALUE) noexcept
+	{
+		(hCompletion);
+		ATLASSERT(m_ppSlots == NULL);
+		if (m_ppSlots != NULL)
+			return E_UNEXPECTED;
+
+		HRESULT hr = m_critSec.Init();
+		if (FAILED(hr))
+			return hr;
+
+		m_hThreadEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (!m_hThreadEvent)
+		{
+			m_critSec.Term();
+			return AtlHresultFromLastError();
+		}
+
+		ATLTRY(m_ppSlots = new CSlot*[ATLS_POOL_MAX_WORKERS]);
+		if (m_ppSlots == NULL)
+		{
+			CloseHandle(m_hThreadEvent);
+			m_hThreadEvent = NULL;
+			m_critSec.Term();
+			return E_OUTOFMEMORY;
+		}
+		memset(m_ppSlots, 0x00, ATLS_POOL_MAX_WORKERS*sizeof(CSlot*));
+		m_nCapacity = ATLS_POOL_MAX_WORKERS;
+
+		m_pvWorkerParam = pvWorkerParam;
+		m_dwStackSize = dwStackSize;
+		m_lShutdown = 0;
+
+		hr = SetSize(nNumThreads);
+		if (hr != S_OK)
+			Shutdown();
+		return hr;
+	}
+
+	// Stops every worker after it has run the requests still queued.
+	// Threads that have not exited after dwMaxWait milliseconds (the
+	// SetTimeout value if dwMaxWait is 0) are terminated.
+	void Shutdown(__in DWORD dwMaxWait=0) noexcept
+	{
+		if (m_ppSlots == NULL)
+			return;
+
+		if (dwMaxWait == 0)
+			dwMaxWait = m_dwMaxWait;
+
+		m_critSec.Lock();
+		InterlockedExchange(&m_lShutdown, 1);
+		RemoveWorkers(0, dwMaxWait);
+		m_critSec.Unlock();
+
+		for (DWORD i = 0; i < m_nCapacity; i++)
+		{
+			CWorkerSlot *pSlot = GetSlot(i);
+			if (pSlot == NULL)
+				continue;
+			if (pSlot->hWake)
+				CloseHandle(pSlot->hWake);
+			pSlot->queue.Term();
+			delete pSlot;
+		}
+		delete [] m_ppSlots;
+		m_ppSlots = NULL;
+		m_nCapacity = 0;
+
+		CloseHandle(m_hThreadEvent);
+		m_hThreadEvent = NULL;
+		m_critSec.Term();
+	}
+
+	// Queues a request. It goes to the worker that last ran it if there is
+	// one, otherwise to the next worker in turn.
+	BOOL QueueRequest(__in RequestType request) noexcept
+	{
+		if (m_lShutdown)
+			return FALSE;
+
+		return baseScheduler::Queue(request, _AtlGetRequestWorker(request));
+	}
+
+	// Returns the number of requests waiting in all the worker queues.
+	long GetQueueDepth() noexcept
+	{
+		return m_lQueued;
+	}
+
+	// Returns the number of requests one worker has taken from another's queue.
+	long GetStealCount() noexcept
+	{
+		return m_lStolen;
+	}
+
+	ULONG GetNumThreads() noexcept
+	{
+		return (ULONG) m_nWorkers;
+	}
+
+	// IUnknown
+	STDMETHOD(QueryInterface)(REFIID riid, void **ppv)
+	{
+		if (!ppv)
+			return E_POINTER;
+
+		*ppv = NULL;
+
+		if (InlineIsEqualGUID(riid, __uuidof(IUnknown)) ||
+			InlineIsEqualGUID(riid, __uuidof(IThreadPoolConfig)))
+		{
+			*ppv = static_cast<IThreadPoolConfig*>(this);
+			AddRef();
+			return S_OK;
+		}
+		return E_NOINTERFACE;
+	}
+
+	STDMETHOD_(ULONG, AddRef)()
+	{
+		return 1;
+	}
+
+	STDMETHOD_(ULONG, Release)()
+	{
+		return 1;
+	}
+
+	// IThreadPoolConfig
+	STDMETHOD(SetSize)(int nNumThreads)
+	{
+		if (nNumThreads == 0)
+			nNumThreads = -ATLS_DEFAULT_THREADSPERPROC;
+
+		if (nNumThreads < 0)
+		{
+			SYSTEM_INFO si;
+			GetSystemInfo(&si);
+			nNumThreads = (int) (-nNumThreads) * si.dwNumberOfProcessors;
+		}
+
+		if (nNumThreads <= 0 || (DWORD) nNumThreads > m_nCapacity)
+			return E_INVALIDARG;
+
+		CComCritSecLock<CComCriticalSection> lock(m_critSec, false);
+		HRESULT hr = lock.Lock();
+		if (FAILED(hr))
+			return hr;
+
+		if (m_lShutdown)
+			return E_UNEXPECTED;
+
+		if ((DWORD) nNumThreads < (DWORD) m_nWorkers)
+		{
+			RemoveWorkers((DWORD) nNumThreads, m_dwMaxWait);
+			return S_OK;
+		}
+
+		while ((DWORD) m_nWorkers < (DWORD) nNumThreads)
+		{
+			hr = AddWorker((DWORD) m_nWorkers);
+			if (FAILED(hr))
+				return hr;
+		}
+		return S_OK;
+	}
+
+	STDMETHOD(GetSize)(int *pnNumThreads)
+	{
+		if (!pnNumThreads)
+			return E_POINTER;
+
+		*pnNumThreads = (int) m_nWorkers;
+		return S_OK;
+	}
+
+	STDMETHOD(SetTimeout)(DWORD dwMaxWait)
+	{
+		m_dwMaxWait = dwMaxWait;
+		return S_OK;
+	}
+
+	STDMETHOD(GetTimeout)(DWORD *pdwMaxWait)
+	{
+		if (!pdwMaxWait)
+			return E_POINTER;
+
+		*pdwMaxWait = m_dwMaxWait;
+		return S_OK;
+	}
+
+	// CAtlWorkStealingScheduler
+	void WakeWorker(__in CSlot *pSlot) noexcept
+	{
+		SetEvent(static_cast<CWorkerSlot*>(pSlot)->hWake);
+	}
+
+	void WaitForWake(__in CSlot *pSlot) noexcept
+	{
+		WaitForSingleObject(static_cast<CWorkerSlot*>(pSlot)->hWake, INFINITE);
+	}
+
+protected:
+	CWorkerSlot * GetSlot(__in DWORD nIndex) noexcept
+	{
+		return static_cast<CWorkerSlot*>(m_ppSlots[nIndex]);
+	}
+
+	DWORD ThreadProc(__inout CWorkerSlot *pSlot) noexcept
+	{
+		Worker theWorker;
+
+		pSlot->bInitialized = theWorker.Initialize(m_pvWorkerParam);
+		SetEvent(m_hThreadEvent);
+		if (!pSlot->bInitialized)
+		{
+			theWorker.Terminate(m_pvWorkerParam);
+			return 1;
+		}
+
+		RequestType request;
+		DWORD dwQueueInfo;
+		while (baseScheduler::WaitForRequest(pSlot, &request, &dwQueueInfo))
+		{
+			// the request may be freed by Execute, so record the worker first
+			_AtlSetRequestWorker(request, pSlot->nIndex + 1, dwQueueInfo);
+			theWorker.Execute(request, m_pvWorkerParam, NULL);
+		}
+
+		theWorker.Terminate(m_pvWorkerParam);
+		return 0;
+	}
+
+	static DWORD WINAPI WorkerThreadProc(__in LPVOID pv) noexcept
+	{
+		CWorkerSlot *pSlot = static_cast<CWorkerSlot*>(pv);
+		return pSlot->pPool->ThreadProc(pSlot);
+	}
+
+	// starts the worker for slot nIndex; called with m_critSec held
+	HRESULT AddWorker(__in DWORD nIndex) noexcept
+	{
+		ATLASSERT(nIndex < m_nCapacity);
+
+		CWorkerSlot *pSlot = GetSlot(nIndex);
+		if (pSlot == NULL)
+		{
+			ATLTRY(pSlot = new CWorkerSlot);
+			if (pSlot == NULL)
+				return E_OUTOFMEMORY;
+
+			pSlot->pPool = this;
+			pSlot->nIndex = nIndex;
+			pSlot->hThread = NULL;
+			pSlot->hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+			HRESULT hr = pSlot->hWake ? pSlot->queue.Init() : AtlHresultFromLastError();
+			if (FAILED(hr))
+			{
+				if (pSlot->hWake)
+					CloseHandle(pSlot->hWake);
+				delete pSlot;
+				return hr;
+			}
+			m_ppSlots[nIndex] = pSlot;
+		}
+		else
+		{
+			// the slot belonged to a worker removed by an earlier SetSize
+			pSlot->queue.Open();
+		}
+
+		pSlot->lIdle = 0;
+		pSlot->lExit = 0;
+		pSlot->bInitialized = FALSE;
+
+		DWORD dwThreadId;
+		pSlot->hThread = ThreadTraits::CreateThread(NULL, m_dwStackSize, WorkerThreadProc, pSlot, 0, &dwThreadId);
+		if (pSlot->hThread == NULL)
+			return AtlHresultFromLastError();
+
+		WaitForSingleObject(m_hThreadEvent, INFINITE);
+		if (!pSlot->bInitialized)
+		{
+			WaitForSingleObject(pSlot->hThread, INFINITE);
+			CloseHandle(pSlot->hThread);
+			pSlot->hThread = NULL;
+			return E_FAIL;
+		}
+
+		// only now can QueueRequest and the other workers see the slot
+		InterlockedExchange(&m_nWorkers, (LONG) nIndex + 1);
+		return S_OK;
+	}
+
+	// stops the workers in slots nKeep and above; called with m_critSec held
+	void RemoveWorkers(__in DWORD nKeep, __in DWORD dwMaxWait) noexcept
+	{
+		DWORD nWorkers = (DWORD) m_nWorkers;
+		if (nKeep >= nWorkers)
+			return;
+
+		// stop new requests going to the slots first, then move what they
+		// still hold to the workers that remain
+		if (nKeep > 0)
+		{
+			InterlockedExchange(&m_nWorkers, (LONG) nKeep);
+
+			CAtlArray<RequestType> requests;
+			for (DWORD i = nKeep; i < nWorkers; i++)
+				m_ppSlots[i]->queue.Close(requests);
+
+			for (size_t i = 0; i < requests.GetCount(); i++)
+			{
+				InterlockedDecrement(&m_lQueued);
+				if (!QueueRequest(requests[i]))
+				{
+					// give the request to one of the leaving workers,
+					// which runs it before it exits
+					InterlockedIncrement(&m_lQueued);
+					m_ppSlots[nKeep]->queue.Open();
+					DWORD nDepth;
+					m_ppSlots[nKeep]->queue.Push(requests[i], &nDepth);
+				}
+			}
+		}
+
+		HANDLE hThreads[MAXIMUM_WAIT_OBJECTS];
+		for (DWORD i = nKeep; i < nWorkers; i++)
+		{
+			InterlockedExchange(&m_ppSlots[i]->lExit, 1);
+			SetEvent(GetSlot(i)->hWake);
+		}
+
+		// when shutting down every worker stays visible until it exits,
+		// so the queued requests are all run
+		for (DWORD i = nKeep; i < nWorkers; i += MAXIMUM_WAIT_OBJECTS)
+		{
+			DWORD nWait = __min(nWorkers - i, MAXIMUM_WAIT_OBJECTS);
+			for (DWORD j = 0; j < nWait; j++)
+				hThreads[j] = GetSlot(i + j)->hThread;
+
+			if (WaitForMultipleObjects(nWait, hThreads, TRUE, dwMaxWait) != WAIT_OBJECT_0)
+			{
+				for (DWORD j = 0; j < nWait; j++)
+				{
+					if (WaitForSingleObject(hThreads[j], 0) != WAIT_OBJECT_0)
+					{
+						ATLTRACE(atlTraceISAPI, 0, _T("Terminating thread"));
+#pragma warning(push)
+#pragma warning(disable: 6258)
+						TerminateThread(hThreads[j], 0);
+#pragma warning(pop)
+					}
+				}
+			}
+
+			for (DWORD j = 0; j < nWait; j++)
+			{
+				CloseHandle(hThreads[j]);
+				GetSlot(i + j)->hThread = NULL;
+			}
+		}
+
+		InterlockedExchange(&m_nWorkers, (LONG) nKeep);
+	}
+}; // class CWorkStealingThreadPool
+
+inline void _AtlGetScriptPathTranslated(
+	__in LPCSTR szPathTranslated, 
+	__inout CFixedStringT<CStringA, MAX_PATH>& strScriptPathTranslated)
+{
+	ATLENSURE(szPathTranslated!=NULL);
+	LPCSTR szEnd = szPathTranslated;
+
+	while (TRUE)
+	{
+		while (*szEnd != '.' && *szEnd != '\0')
+			szEnd++;
+		if (*szEnd == '\0')
+			break;
+
+		szEnd++;
+
+		size_t nLen(0);
+		if (!AsciiStrnicmp(szEnd, c_AtlDLLExtension+1, ATLS_DLL_EXTENSION_LEN))
+			nLen = ATLS_DLL_EXTENSION_LEN;
+		else if (!AsciiStrnicmp(szEnd, c_AtlSRFExtension+1, ATLS_EXTENSION_LEN))
+			nLen = ATLS_EXTENSION_LEN;
+
+		if (nLen)
+		{
+			szEnd += nLen;
+			if (!*szEnd || *szEnd == '/' || *szEnd == '\\' || *szEnd == '?' || *szEnd == '#')
+				break;
+		}
+	}
+
+	DWORD dwResult = (DWORD)(szEnd - szPathTranslated);
+	char *szScriptPathTranslated = NULL;
+	ATLTRY(szScriptPathTranslated = strScriptPathTranslated.GetBuffer(dwResult));
+	if (szScriptPathTranslated)
+	{
+		Checked::memcpy_s(szScriptPathTranslated, dwResult, szPathTranslated, dwResult);
+		szScriptPathTranslated[dwResult] = '\0';
+		strScriptPathTranslated.ReleaseBuffer(dwResult);
+	}
+}
+
+
+struct CStencilState
 {
 	CStencilState() noexcept
 	{
@@ -906,17 +2403,20 @@ public:
 // access to the web server's functionality.
 class CServerContext :
 	public CComObjectRootEx<CComMultiThreadModel>,
-	public IHttpServerContext
+	public IHttpServerContext,
+	public IHttpVectorSend
 {
 public:
 	BEGIN_COM_MAP(CServerContext)
 		COM_INTERFACE_ENTRY(IHttpServerContext)
+		COM_INTERFACE_ENTRY(IHttpVectorSend)
 	END_COM_MAP()
 
 	CServerContext() noexcept
 	{
 		m_pECB = NULL;
 		m_bHeadersHaveBeenSent = false;
+		m_cbWritten = 0;
 	}
 	virtual ~CServerContext() noexcept
 	{
@@ -1054,7 +2554,10 @@ public:
 
 		if (pvBuffer && pdwBytes)
 		{
-			return m_pECB->WriteClient(m_pECB->ConnID, pvBuffer, pdwBytes, HSE_IO_SYNC | HSE_IO_NODELAY);
+			if (!m_pECB->WriteClient(m_pECB->ConnID, pvBuffer, pdwBytes, HSE_IO_SYNC | HSE_IO_NODELAY))
+				return FALSE;
+			m_cbWritten += *pdwBytes;
+			return TRUE;
 		}
 		return FALSE;
 	}
@@ -1070,7 +2573,12 @@ public:
 
 		if (pvBuffer && pdwBytes)
 		{
-			return m_pECB->WriteClient(m_pECB->ConnID, pvBuffer, pdwBytes, HSE_IO_ASYNC | HSE_IO_NODELAY);
+			// the completion may run before WriteClient returns
+			DWORD dwBytes = *pdwBytes;
+			if (!m_pECB->WriteClient(m_pECB->ConnID, pvBuffer, pdwBytes, HSE_IO_ASYNC | HSE_IO_NODELAY))
+				return FALSE;
+			m_cbWritten += dwBytes;
+			return TRUE;
 		}
 		return FALSE;
 	}
@@ -1159,21 +2667,99 @@ public:
 	{
 		ATLENSURE(m_pECB);
 
-		if (m_bHeadersHaveBeenSent)
+		if (m_bHeadersHaveBeenSent)
+			return TRUE;
+
+		HSE_SEND_HEADER_EX_INFO hex;
+		hex.pszStatus = pszStatusCode;
+		hex.pszHeader = pszHeader;
+		hex.cchStatus = (DWORD)(pszStatusCode ? strlen(pszStatusCode) : 0);
+		hex.cchHeader = (DWORD)(pszHeader ? strlen(pszHeader) : 0);
+		hex.fKeepConn = fKeepConn;
+
+		m_bHeadersHaveBeenSent = true;
+
+		return m_pECB->ServerSupportFunction(m_pECB->ConnID,
+			HSE_REQ_SEND_RESPONSE_HEADER_EX,
+			&hex, NULL, NULL);
+	}
+
+	// Call this function to send the given buffers to the client, preceded by the
+	// response headers unless szHeaders is NULL or they have already been sent.
+	// Returns TRUE on success, and FALSE on failure.
+	// Equivalent to the HSE_REQ_VECTOR_SEND server support function on servers
+	// that have it (IIS 6.0 and later), and to SendResponseHeader followed by
+	// WriteClient for each buffer on others.
+	__checkReturn BOOL VectorSend(
+		__in_opt LPCSTR szStatus,
+		__in_opt LPCSTR szHeaders,
+		__in BOOL fKeepConn,
+		__in_ecount(nBuffers) const AtlServerSendBuffer *rgBuffers,
+		__in DWORD nBuffers)
+	{
+		ATLENSURE(m_pECB);
+		ATLASSERT(rgBuffers || !nBuffers);
+
+		if (m_bHeadersHaveBeenSent)
+			szHeaders = NULL;
+
+#ifdef HSE_REQ_VECTOR_SEND
+		if (HIWORD(m_pECB->dwVersion) >= 6)
+		{
+			HSE_VECTOR_ELEMENT rgElements[ATLS_MAX_SEND_BUFFERS];
+			DWORD dwBuffer = 0;
+			do
+			{
+				DWORD nElements = __min(nBuffers - dwBuffer, (DWORD) ATLS_MAX_SEND_BUFFERS);
+				for (DWORD i = 0; i < nElements; i++)
+				{
+					rgElements[i].ElementType = HSE_VECTOR_ELEMENT_TYPE_MEMORY_BUFFER;
+					rgElements[i].pvContext = (PVOID) rgBuffers[dwBuffer+i].pvData;
+					rgElements[i].cbOffset = 0;
+					rgElements[i].cbSize = rgBuffers[dwBuffer+i].cbData;
+				}
+				dwBuffer += nElements;
+
+				HSE_RESPONSE_VECTOR vector;
+				vector.dwFlags = HSE_IO_SYNC | HSE_IO_NODELAY;
+				vector.pszStatus = NULL;
+				vector.pszHeaders = NULL;
+				vector.nElementCount = nElements;
+				vector.lpElementArray = rgElements;
+				if (szHeaders)
+				{
+					vector.dwFlags |= HSE_IO_SEND_HEADERS;
+					vector.pszStatus = const_cast<LPSTR>(szStatus ? szStatus : "200 OK");
+					vector.pszHeaders = const_cast<LPSTR>(szHeaders);
+				}
+				if (!fKeepConn && dwBuffer == nBuffers)
+					vector.dwFlags |= HSE_IO_DISCONNECT_AFTER_SEND;
+
+				if (!m_pECB->ServerSupportFunction(m_pECB->ConnID, HSE_REQ_VECTOR_SEND, &vector, NULL, NULL))
+					return FALSE;
+				for (DWORD i = 0; i < nElements; i++)
+					m_cbWritten += rgElements[i].cbSize;
+
+				if (szHeaders)
+				{
+					m_bHeadersHaveBeenSent = true;
+					szHeaders = NULL;
+				}
+			} while (dwBuffer < nBuffers);
 			return TRUE;
+		}
+#endif // HSE_REQ_VECTOR_SEND
 
-		HSE_SEND_HEADER_EX_INFO hex;
-		hex.pszStatus = pszStatusCode;
-		hex.pszHeader = pszHeader;
-		hex.cchStatus = (DWORD)(pszStatusCode ? strlen(pszStatusCode) : 0);
-		hex.cchHeader = (DWORD)(pszHeader ? strlen(pszHeader) : 0);
-		hex.fKeepConn = fKeepConn;
-
-		m_bHeadersHaveBeenSent = true;
+		if (szHeaders && !SendResponseHeader(szHeaders, szStatus ? szStatus : "200 OK", fKeepConn))
+			return FALSE;
 
-		return m_pECB->ServerSupportFunction(m_pECB->ConnID,
-			HSE_REQ_SEND_RESPONSE_HEADER_EX,
-			&hex, NULL, NULL);
+		for (DWORD i = 0; i < nBuffers; i++)
+		{
+			DWORD dwLen = rgBuffers[i].cbData;
+			if (dwLen && !WriteClient((void *) rgBuffers[i].pvData, &dwLen))
+				return FALSE;
+		}
+		return TRUE;
 	}
 
 	// Call this function to terminate the session for the current request.
@@ -1237,8 +2823,26 @@ public:
 		tf.TailLength = dwTailLen;
 		tf.pszStatusCode = szStatusCode;
 		tf.dwFlags = dwFlags;
-		return m_pECB->ServerSupportFunction(m_pECB->ConnID,
-			HSE_REQ_TRANSMIT_FILE, &tf, NULL, NULL);
+
+		// a BytesToWrite of 0 sends the rest of the file
+		ULONGLONG cbFile = dwBytesToWrite;
+		LARGE_INTEGER liSize;
+		if (!dwBytesToWrite && GetFileSizeEx(hFile, &liSize) && (ULONGLONG) liSize.QuadPart > dwOffset)
+			cbFile = liSize.QuadPart - dwOffset;
+
+		if (!m_pECB->ServerSupportFunction(m_pECB->ConnID,
+			HSE_REQ_TRANSMIT_FILE, &tf, NULL, NULL))
+			return FALSE;
+		m_cbWritten += cbFile + dwHeadLen + dwTailLen;
+		return TRUE;
+	}
+
+	// Returns the number of body bytes handed to the server for the client
+	// so far, counting the head and tail of transmitted files but not the
+	// response headers.
+	ULONGLONG GetBytesWritten() noexcept
+	{
+		return m_cbWritten;
 	}
 
 	// Appends the string szMessage to the web server log for the current
@@ -1283,12 +2887,206 @@ protected:
 	// The pointer to the extension control block provided by IIS.
 	EXTENSION_CONTROL_BLOCK *m_pECB;
 	bool m_bHeadersHaveBeenSent;
+	ULONGLONG m_cbWritten;
 
 	// The translated script path
 	CFixedStringT<CStringA, MAX_PATH> m_strScriptPathTranslated;
 
 }; // class CServerContext
 
+// Longest If-None-Match or If-Modified-Since header that AtlIsNotModified
+// reads. A longer header never matches, so the full response is sent.
+#ifndef ATLS_MAX_CONDITIONAL_HEADER
+#define ATLS_MAX_CONDITIONAL_HEADER 512
+#endif
+
+// Formats ullHash as a strong entity tag: 16 hex digits in quotes.
+inline void AtlFormatETag(__in ULONGLONG ullHash, __out CStringA& strETag)
+{
+	strETag.Format("\"%016I64x\"", ullHash);
+}
+
+// Returns TRUE if the If-None-Match header of a GET or HEAD request, or its
+// If-Modified-Since header when it has no If-None-Match, shows that the
+// client already has the current version of a resource whose validators
+// are szETag and pftLastModified. Either validator may be NULL, and an
+// empty ETag or a zero time is not used.
+inline BOOL AtlIsNotModified(
+	__in IHttpServerContext *pServerContext,
+	__in_opt LPCSTR szETag,
+	__in_opt const FILETIME *pftLastModified) noexcept
+{
+	ATLASSERT(pServerContext != NULL);
+
+	char szValue[ATLS_MAX_CONDITIONAL_HEADER];
+	DWORD dwSize = sizeof(szValue);
+	if (pServerContext->GetServerVariable("HTTP_IF_NONE_MATCH", szValue, &dwSize))
+		return szETag != NULL && *szETag && AtlMatchETag(szValue, szETag);
+	if (GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+		return FALSE;
+
+	if (pftLastModified == NULL || CFileTime(*pftLastModified) == 0)
+		return FALSE;
+
+	dwSize = sizeof(szValue);
+	FILETIME ftSince;
+	if (!pServerContext->GetServerVariable("HTTP_IF_MODIFIED_SINCE", szValue, &dwSize) ||
+		!AtlParseHttpDate(szValue, &ftSince))
+	{
+		return FALSE;
+	}
+
+	// HTTP dates have a resolution of one second
+	return CFileTime(*pftLastModified).GetTime() / CFileTime::Second <=
+		CFileTime(ftSince).GetTime() / CFileTime::Second;
+}
+
+// Responses and cached pages smaller than this many bytes are sent uncompressed.
+#ifndef ATLS_COMPRESS_MIN_SIZE
+#define ATLS_COMPRESS_MIN_SIZE 1024
+#endif
+
+// The Content-Type values that are compressed: a ';'-separated list
+// of prefixes, matched without regard to case.
+#ifndef ATLS_COMPRESS_CONTENT_TYPES
+#define ATLS_COMPRESS_CONTENT_TYPES "text/;application/json;application/javascript;application/xml;application/xhtml+xml;image/svg+xml"
+#endif
+
+// Set to 1 to have CHttpResponse compress responses by default. See
+// CHttpResponse::SetCompression.
+#ifndef ATLS_COMPRESS_RESPONSES
+#define ATLS_COMPRESS_RESPONSES 0
+#endif
+
+// Set to 0 to keep compressed variants of pages out of the page cache.
+#ifndef ATLS_PAGE_CACHE_COMPRESS
+#define ATLS_PAGE_CACHE_COMPRESS 1
+#endif
+
+// Set to 0 to stop CIsapiExtension breaking its request statistics down
+// by request type and handler. See CRequestBreakdownStats.
+#ifndef ATLS_REQUEST_BREAKDOWN
+#define ATLS_REQUEST_BREAKDOWN 1
+#endif
+
+// Largest page, in bytes, that the page cache compresses.
+#ifndef ATLS_PAGE_CACHE_MAX_COMPRESS
+#define ATLS_PAGE_CACHE_MAX_COMPRESS (1024*1024)
+#endif
+
+// Size of the buffer AtlGetPageCacheVariantKey writes.
+#define ATLS_MAX_VARIANT_KEY_LENGTH (ATL_URL_MAX_URL_LENGTH + 16)
+
+inline LPCSTR AtlGetEncodingName(__in int nEncoding) noexcept
+{
+	switch (nEncoding)
+	{
+	case ATLS_ENCODING_GZIP:
+		return "gzip";
+	case ATLS_ENCODING_DEFLATE:
+		return "deflate";
+	}
+	return "identity";
+}
+
+// Returns TRUE if szQValue, the value of a q parameter, is zero.
+inline BOOL _AtlIsZeroQValue(__in LPCSTR szQValue) noexcept
+{
+	if (*szQValue++ != '0')
+		return FALSE;
+	if (*szQValue == '.')
+	{
+		szQValue++;
+		while (*szQValue == '0')
+			szQValue++;
+	}
+	return *szQValue == '\0' || *szQValue == ',' || *szQValue == ';' ||
+		*szQValue == ' ' || *szQValue == '\t';
+}
+
+// Returns the content coding to compress a response with: gzip if the
+// request's Accept-Encoding header accepts it, otherwise deflate if it
+// accepts that, otherwise ATLS_ENCODING_IDENTITY.
+inline int AtlGetAcceptedEncoding(__in IHttpServerContext *pServerContext) noexcept
+{
+	ATLASSERT(pServerContext != NULL);
+
+	char szValue[256];
+	DWORD dwSize = sizeof(szValue);
+	if (!pServerContext->GetServerVariable("HTTP_ACCEPT_ENCODING", szValue, &dwSize))
+		return ATLS_ENCODING_IDENTITY;
+
+	int nEncoding = ATLS_ENCODING_IDENTITY;
+	LPCSTR szCur = szValue;
+	while (*szCur)
+	{
+		while (*szCur == ' ' || *szCur == '\t' || *szCur == ',')
+			szCur++;
+		LPCSTR szName = szCur;
+		while (*szCur && *szCur != ',' && *szCur != ';' && *szCur != ' ' && *szCur != '\t')
+			szCur++;
+		size_t cchName = szCur - szName;
+
+		// a q value of 0 refuses the coding
+		BOOL bRefused = FALSE;
+		while (*szCur && *szCur != ',')
+		{
+			if (*szCur == ';')
+			{
+				szCur++;
+				while (*szCur == ' ' || *szCur == '\t')
+					szCur++;
+				if ((*szCur == 'q' || *szCur == 'Q') && szCur[1] == '=')
+				{
+					szCur += 2;
+					bRefused = _AtlIsZeroQValue(szCur);
+				}
+				continue;
+			}
+			szCur++;
+		}
+
+		if (bRefused)
+			continue;
+		if (cchName == 4 && !_strnicmp(szName, "gzip", 4))
+			return ATLS_ENCODING_GZIP;
+		if (cchName == 7 && !_strnicmp(szName, "deflate", 7))
+			nEncoding = ATLS_ENCODING_DEFLATE;
+	}
+	return nEncoding;
+}
+
+// Returns TRUE if szContentType matches one of the prefixes in szAllowed,
+// a list in the form of ATLS_COMPRESS_CONTENT_TYPES.
+inline BOOL AtlIsCompressibleContentType(__in_opt LPCSTR szContentType,
+	__in LPCSTR szAllowed = ATLS_COMPRESS_CONTENT_TYPES) noexcept
+{
+	if (szContentType == NULL)
+		return FALSE;
+
+	while (*szAllowed)
+	{
+		LPCSTR szEnd = strchr(szAllowed, ';');
+		size_t cchPrefix = szEnd ? (size_t) (szEnd - szAllowed) : strlen(szAllowed);
+		if (cchPrefix && !_strnicmp(szContentType, szAllowed, cchPrefix))
+			return TRUE;
+		szAllowed += cchPrefix;
+		if (*szAllowed)
+			szAllowed++;
+	}
+	return FALSE;
+}
+
+// Builds the page cache key of the nEncoding variant of the page szKey.
+inline void AtlGetPageCacheVariantKey(__in LPCSTR szKey, __in int nEncoding,
+	__out_ecount(ATLS_MAX_VARIANT_KEY_LENGTH) LPSTR szVariantKey) noexcept
+{
+	// '#' can't appear in the path or query string of a request
+	Checked::strcpy_s(szVariantKey, ATLS_MAX_VARIANT_KEY_LENGTH, szKey);
+	Checked::strcat_s(szVariantKey, ATLS_MAX_VARIANT_KEY_LENGTH, "#");
+	Checked::strcat_s(szVariantKey, ATLS_MAX_VARIANT_KEY_LENGTH, AtlGetEncodingName(nEncoding));
+}
+
 class CPageCachePeer
 {
 public:
@@ -1297,6 +3095,10 @@ public:
 	{
 		CStringA strHeader;
 		CStringA strStatus;
+		FILETIME ftFresh;	// when the page becomes stale, 0 if it is fresh until it expires
+		CStringA strETag;	// the page's strong validator, empty if it has none
+		FILETIME ftLastModified;
+		CStringA strNotModified;	// the headers of a 304 response for the page
 	};
 
 	static BOOL Add(__inout PeerInfo * pDest, __in PeerInfo * pSrc) noexcept
@@ -1306,6 +3108,10 @@ public:
 			PeerInfo *pIn = (PeerInfo *)pSrc;
 			pDest->strHeader = pIn->strHeader;
 			pDest->strStatus = pIn->strStatus;
+			pDest->ftFresh = pIn->ftFresh;
+			pDest->strETag = pIn->strETag;
+			pDest->ftLastModified = pIn->ftLastModified;
+			pDest->strNotModified = pIn->strNotModified;
 			return TRUE;
 		}
 		_ATLCATCHALL()
@@ -1320,6 +3126,144 @@ public:
 	}
 };
 
+// Largest page body that CCacheServerContext keeps in memory. Larger
+// bodies are written to a temporary file and added to the file page cache.
+#ifndef ATLS_PAGE_CACHE_MAX_RESIDENT
+#define ATLS_PAGE_CACHE_MAX_RESIDENT (64*1024)
+#endif
+
+// Number of bytes the in-memory page cache may hold before it evicts pages.
+#ifndef ATLS_PAGE_CACHE_MEMORY_SIZE
+#define ATLS_PAGE_CACHE_MEMORY_SIZE (32*1024*1024)
+#endif
+
+// Milliseconds an expired page is kept and served while one request
+// renders a fresh copy. 0 removes pages from the cache when they expire.
+#ifndef ATLS_PAGE_CACHE_STALE_TIME
+#define ATLS_PAGE_CACHE_STALE_TIME 0
+#endif
+
+//
+// CPageCacheBlob
+// A page in the in-memory page cache: the status, headers and body
+// in a single allocation that isn't changed once it has been added.
+// The cache reference counts its entries and frees the blob through
+// CPageCacheBlobClient once the entry is gone and no longer in use.
+struct CPageCacheBlob
+{
+	LPCSTR szStatus;
+	LPCSTR szHeader;
+	const BYTE *pbBody;
+	DWORD cbBody;
+	// as in CPageCachePeer::PeerInfo
+	FILETIME ftFresh;
+	LPCSTR szETag;
+	FILETIME ftLastModified;
+	LPCSTR szNotModified;
+
+	static CPageCacheBlob *Create(
+		__in const CPageCachePeer::PeerInfo& info,
+		__in_bcount(cbBody) const BYTE *pbBody,
+		__in DWORD cbBody,
+		__out DWORD *pcbBlob) noexcept
+	{
+		ATLASSERT(pcbBlob != NULL);
+
+		LPCSTR rgszStrings[] = { info.strStatus, info.strHeader, info.strETag, info.strNotModified };
+		size_t rgcchStrings[_countof(rgszStrings)];
+		size_t cbBlob = sizeof(CPageCacheBlob);
+		for (size_t i = 0; i < _countof(rgszStrings); i++)
+		{
+			rgcchStrings[i] = strlen(rgszStrings[i])+1;
+			if (FAILED(::ATL::AtlAdd(&cbBlob, cbBlob, rgcchStrings[i])))
+				return NULL;
+		}
+		if (FAILED(::ATL::AtlAdd(&cbBlob, cbBlob, (size_t) cbBody)) ||
+			cbBlob > ULONG_MAX)
+		{
+			return NULL;
+		}
+
+		CPageCacheBlob *pBlob = (CPageCacheBlob *) malloc(cbBlob);
+		if (!pBlob)
+			return NULL;
+
+		char *pData = (char *) (pBlob+1);
+		LPCSTR *rgpszDest[] = { &pBlob->szStatus, &pBlob->szHeader, &pBlob->szETag, &pBlob->szNotModified };
+		for (size_t i = 0; i < _countof(rgszStrings); i++)
+		{
+			Checked::memcpy_s(pData, rgcchStrings[i], rgszStrings[i], rgcchStrings[i]);
+			*rgpszDest[i] = pData;
+			pData += rgcchStrings[i];
+		}
+		if (cbBody)
+			Checked::memcpy_s(pData, cbBody, pbBody, cbBody);
+		pBlob->pbBody = (const BYTE *) pData;
+		pBlob->cbBody = cbBody;
+		pBlob->ftFresh = info.ftFresh;
+		pBlob->ftLastModified = info.ftLastModified;
+
+		*pcbBlob = (DWORD) cbBlob;
+		return pBlob;
+	}
+
+	static void Destroy(__in_opt CPageCacheBlob *pBlob) noexcept
+	{
+		free(pBlob);
+	}
+};
+
+class CPageCacheBlobClient :
+	public IMemoryCacheClient
+{
+public:
+	STDMETHOD(QueryInterface)(REFIID riid, void **ppv)
+	{
+		if (!ppv)
+			return E_POINTER;
+
+		if (InlineIsEqualGUID(riid, __uuidof(IUnknown)) ||
+			InlineIsEqualGUID(riid, __uuidof(IMemoryCacheClient)))
+		{
+			*ppv = static_cast<IMemoryCacheClient*>(this);
+			return S_OK;
+		}
+
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+
+	STDMETHOD_(ULONG, AddRef)()
+	{
+		return 1;
+	}
+
+	STDMETHOD_(ULONG, Release)()
+	{
+		return 1;
+	}
+
+	STDMETHOD(Free)(const void *pData)
+	{
+		if (!pData)
+			return E_POINTER;
+
+		CPageCacheBlob::Destroy(*((CPageCacheBlob **) pData));
+		return S_OK;
+	}
+};
+
+//
+// CPageCacheFill
+// A cacheable page that a request is rendering. Requests for the same
+// URL that miss the page cache in the meantime wait in arrWaiters, and
+// are queued again once the page has been added to the cache.
+struct CPageCacheFill
+{
+	CStringA strKey;
+	CAtlArray<AtlServerRequest*> arrWaiters;
+};
+
 
 class CCacheServerContext :
 	public CComObjectRootEx<CComMultiThreadModel>,
@@ -1328,12 +3272,309 @@ class CCacheServerContext :
 {
 private:
 
-	CAtlTemporaryFile m_cacheFile;
-	CComPtr<IFileCache> m_spCache;
-	char m_szFullUrl[ATL_URL_MAX_URL_LENGTH + 1];
-	FILETIME m_ftExpiration;
-	BOOL m_bIsCached;
-	CPageCachePeer::PeerInfo m_Headers;
+	CAtlTemporaryFile m_cacheFile;
+	CComPtr<IFileCache> m_spCache;
+	CComPtr<IMemoryCache> m_spMemoryCache;
+	IMemoryCacheClient *m_pBlobClient;
+	CAtlArray<BYTE> m_body;		// the body until it outgrows m_dwMaxResident
+	DWORD m_dwMaxResident;
+	BOOL m_bSpilled;			// the body is being written to m_cacheFile
+	char m_szFullUrl[ATL_URL_MAX_URL_LENGTH + 1];
+	FILETIME m_ftExpiration;
+	DWORD m_dwStaleTime;		// milliseconds the page is kept after m_ftExpiration
+	BOOL m_bIsCached;
+	CPageCachePeer::PeerInfo m_Headers;
+	ULONGLONG m_ullBodyHash;	// AtlHashValidator of the body
+	ULONGLONG m_cbBody;
+	BOOL m_bCompress;			// the page may also be cached compressed
+
+	// Moves the body buffered so far into the temporary file. The rest
+	// of the page is written straight to the file.
+	BOOL Spill() noexcept
+	{
+		if (FAILED(m_cacheFile.Create()))
+			return FALSE;
+
+		m_bSpilled = TRUE;
+		if (m_body.GetCount() != 0)
+		{
+			if (S_OK != m_cacheFile.Write(m_body.GetData(), (DWORD) m_body.GetCount()))
+				return FALSE;
+			m_body.RemoveAll();
+		}
+		return TRUE;
+	}
+
+	// Returns the time the page leaves the cache, and sets
+	// m_Headers.ftFresh to the time it becomes stale.
+	FILETIME GetCacheExpiration() noexcept
+	{
+		memset(&m_Headers.ftFresh, 0x00, sizeof(FILETIME));
+		if (m_dwStaleTime == 0 || CFileTime(m_ftExpiration) == 0)
+			return m_ftExpiration;
+
+		m_Headers.ftFresh = m_ftExpiration;
+		return CFileTime(m_ftExpiration) +
+			CFileTimeSpan(m_dwStaleTime * CFileTime::Millisecond);
+	}
+
+	// Finds the header szName in szHeaders. Returns the offset of its line,
+	// or -1, and sets *pcchLine to the length of the line and its CRLF.
+	static int FindHeaderLine(__in LPCSTR szHeaders, __in LPCSTR szName, __out int *pcchLine)
+	{
+		size_t cchName = strlen(szName);
+		LPCSTR szLine = szHeaders;
+		while (*szLine && *szLine != '\r')
+		{
+			LPCSTR szEnd = strstr(szLine, "\r\n");
+			szEnd = szEnd ? szEnd + 2 : szLine + strlen(szLine);
+
+			if (!_strnicmp(szLine, szName, cchName) && szLine[cchName] == ':')
+			{
+				*pcchLine = (int) (szEnd - szLine);
+				return (int) (szLine - szHeaders);
+			}
+			szLine = szEnd;
+		}
+		return -1;
+	}
+
+	// Finds the value of the header szName in szHeaders.
+	static BOOL FindHeader(__in LPCSTR szHeaders, __in LPCSTR szName, __out CStringA& strValue)
+	{
+		int cchLine = 0;
+		int nLine = FindHeaderLine(szHeaders, szName, &cchLine);
+		if (nLine < 0)
+			return FALSE;
+
+		LPCSTR szValue = szHeaders + nLine + strlen(szName) + 1;
+		strValue.SetString(szValue, (int) (szHeaders + nLine + cchLine - szValue));
+		strValue.Trim(" \t\r\n");
+		return TRUE;
+	}
+
+	static void RemoveHeader(__inout CStringA& strHeaders, __in LPCSTR szName)
+	{
+		int cchLine = 0;
+		int nLine = FindHeaderLine(strHeaders, szName, &cchLine);
+		if (nLine >= 0)
+			strHeaders.Delete(nLine, cchLine);
+	}
+
+	// Adds the header lines in szAdd before the blank line that ends
+	// m_Headers.strHeader. Returns FALSE if the headers don't end in CRLF.
+	BOOL InsertHeaders(__in LPCSTR szAdd)
+	{
+		int cchHeader = m_Headers.strHeader.GetLength();
+		if (cchHeader < 2 || strcmp((LPCSTR) m_Headers.strHeader + cchHeader - 2, "\r\n"))
+			return FALSE;
+		m_Headers.strHeader.Insert(cchHeader - 2, szAdd);
+		return TRUE;
+	}
+
+	// Returns TRUE if the page should also be cached compressed. The page
+	// must be eligible as described in CHttpResponse::SetCompression, and
+	// its handler must not have sent a Vary header of its own.
+	BOOL IsCompressible()
+	{
+		CStringA strContentType;
+		int cchLine = 0;
+		return m_bCompress && m_spMemoryCache &&
+			!strncmp(m_Headers.strStatus, "200", 3) &&
+			m_cbBody >= ATLS_COMPRESS_MIN_SIZE && m_cbBody <= ATLS_PAGE_CACHE_MAX_COMPRESS &&
+			FindHeader(m_Headers.strHeader, "Content-Type", strContentType) &&
+			AtlIsCompressibleContentType(strContentType) &&
+			FindHeaderLine(m_Headers.strHeader, "Content-Encoding", &cchLine) < 0 &&
+			FindHeaderLine(m_Headers.strHeader, "Vary", &cchLine) < 0;
+	}
+
+	// Sets the validators conditional GETs for the page are matched against.
+	// They are the ETag and Last-Modified headers the handler sent, or else
+	// a hash of the body and the time the page was cached. In that case the
+	// headers are added to those sent on cache hits; the response that
+	// rendered the page has gone out without them.
+	void SetValidators()
+	{
+		m_Headers.strETag.Empty();
+		m_Headers.strNotModified.Empty();
+		memset(&m_Headers.ftLastModified, 0x00, sizeof(FILETIME));
+
+		// only a successful response may be answered with 304
+		int cchHeader = m_Headers.strHeader.GetLength();
+		if (strncmp(m_Headers.strStatus, "200", 3) ||
+			cchHeader < 2 || strcmp((LPCSTR) m_Headers.strHeader + cchHeader - 2, "\r\n"))
+		{
+			return;
+		}
+
+		CStringA strAdd;
+		CStringA strETag;
+		if (!FindHeader(m_Headers.strHeader, "ETag", strETag))
+		{
+			AtlFormatETag(m_ullBodyHash, strETag);
+			strAdd.Append("ETag: ");
+			strAdd.Append(strETag);
+			strAdd.Append("\r\n");
+		}
+
+		CStringA strLastModified;
+		FILETIME ftLastModified;
+		if (FindHeader(m_Headers.strHeader, "Last-Modified", strLastModified))
+		{
+			if (!AtlParseHttpDate(strLastModified, &ftLastModified))
+				memset(&ftLastModified, 0x00, sizeof(FILETIME));
+		}
+		else
+		{
+			SYSTEMTIME st;
+			GetSystemTime(&st);
+			SystemTimeToFileTime(&st, &ftLastModified);
+			SystemTimeToHttpDate(st, strLastModified);
+			strAdd.Append("Last-Modified: ");
+			strAdd.Append(strLastModified);
+			strAdd.Append("\r\n");
+		}
+
+		CStringA strNotModified;
+		strNotModified.Append("ETag: ");
+		strNotModified.Append(strETag);
+		strNotModified.Append("\r\nLast-Modified: ");
+		strNotModified.Append(strLastModified);
+		strNotModified.Append("\r\n\r\n");
+
+		m_Headers.strHeader.Insert(cchHeader - 2, strAdd);
+		m_Headers.strETag = strETag;
+		m_Headers.ftLastModified = ftLastModified;
+		m_Headers.strNotModified = strNotModified;
+	}
+
+	BOOL ReadSpilledBody(__out CAtlArray<BYTE>& arrBody)
+	{
+		DWORD cbRead = 0;
+		return arrBody.SetCount((size_t) m_cbBody) &&
+			SUCCEEDED(m_cacheFile.Seek(0, FILE_BEGIN)) &&
+			SUCCEEDED(m_cacheFile.Read(arrBody.GetData(), (DWORD) m_cbBody, cbRead)) &&
+			cbRead == m_cbBody;
+	}
+
+	// Adds the page in the nEncoding coding, arrBody, to the memory cache
+	// under its variant key, or removes the variant if arrBody is empty or
+	// too large. Each coding gets its own strong validator.
+	void AddVariant(__in int nEncoding, __in CAtlArray<BYTE>& arrBody, __in FILETIME *pftExpiration)
+	{
+		char szKey[ATLS_MAX_VARIANT_KEY_LENGTH];
+		AtlGetPageCacheVariantKey(m_szFullUrl, nEncoding, szKey);
+
+		DWORD cbBody = (DWORD) arrBody.GetCount();
+		if (cbBody == 0 || cbBody >= m_cbBody || cbBody > m_dwMaxResident)
+		{
+			m_spMemoryCache->RemoveEntryByKey(szKey);
+			return;
+		}
+
+		CPageCachePeer::PeerInfo info;
+		info.strStatus = m_Headers.strStatus;
+		info.ftFresh = m_Headers.ftFresh;
+		info.ftLastModified = m_Headers.ftLastModified;
+		info.strHeader = m_Headers.strHeader;
+		RemoveHeader(info.strHeader, "Content-Length");
+		RemoveHeader(info.strHeader, "ETag");
+
+		CStringA strAdd;
+		strAdd.Format("Content-Encoding: %s\r\nContent-Length: %u\r\n", AtlGetEncodingName(nEncoding), cbBody);
+		if (!m_Headers.strETag.IsEmpty())
+		{
+			AtlFormatETag(AtlHashValidator(ATLS_VALIDATOR_SEED, arrBody.GetData(), cbBody), info.strETag);
+			strAdd.AppendFormat("ETag: %s\r\n", (LPCSTR) info.strETag);
+			info.strNotModified = m_Headers.strNotModified;
+			RemoveHeader(info.strNotModified, "ETag");
+			info.strNotModified.Insert(0, "ETag: " + info.strETag + "\r\n");
+		}
+		info.strHeader.Insert(info.strHeader.GetLength() - 2, strAdd);
+
+		DWORD cbBlob = 0;
+		CPageCacheBlob *pBlob = CPageCacheBlob::Create(info, arrBody.GetData(), cbBody, &cbBlob);
+		if (!pBlob || S_OK != m_spMemoryCache->Add(szKey, pBlob, cbBlob, pftExpiration,
+				NULL, NULL, m_pBlobClient))
+		{
+			CPageCacheBlob::Destroy(pBlob);
+			m_spMemoryCache->RemoveEntryByKey(szKey);
+		}
+	}
+
+	// Adds the gzip and deflate variants of the page to the memory cache,
+	// or removes those of an earlier copy of it if bCompress is FALSE.
+	// Both variants wrap the same DEFLATE stream, so the page is only
+	// compressed once.
+	void AddCompressedVariants(__in BOOL bCompress, __in FILETIME *pftExpiration)
+	{
+		if (!m_spMemoryCache)
+			return;
+
+		CAtlArray<BYTE> arrGzip;
+		CAtlArray<BYTE> arrDeflate;
+		CAtlArray<BYTE> arrSpilled;
+		if (bCompress && m_bSpilled)
+			bCompress = ReadSpilledBody(arrSpilled);
+
+		if (bCompress)
+		{
+			const BYTE *pbBody = m_bSpilled ? arrSpilled.GetData() : m_body.GetData();
+			DWORD cbBody = (DWORD) m_cbBody;
+			CAtlDeflateEncoder encoder;
+			size_t cbGzipHeader = 0;
+			size_t cbDeflateHeader = 0;
+
+			bCompress = AtlBeginContentCoding(ATLS_ENCODING_GZIP, arrGzip) &&
+				AtlBeginContentCoding(ATLS_ENCODING_DEFLATE, arrDeflate);
+			if (bCompress)
+			{
+				cbGzipHeader = arrGzip.GetCount();
+				cbDeflateHeader = arrDeflate.GetCount();
+				bCompress = encoder.Encode(pbBody, cbBody, arrGzip);
+			}
+			if (bCompress)
+			{
+				size_t cbStream = arrGzip.GetCount() - cbGzipHeader;
+				bCompress = arrDeflate.SetCount(cbDeflateHeader + cbStream);
+				if (bCompress)
+				{
+					Checked::memcpy_s(arrDeflate.GetData() + cbDeflateHeader, cbStream,
+						arrGzip.GetData() + cbGzipHeader, cbStream);
+					bCompress = AtlEndContentCoding(ATLS_ENCODING_GZIP, pbBody, cbBody, arrGzip) &&
+						AtlEndContentCoding(ATLS_ENCODING_DEFLATE, pbBody, cbBody, arrDeflate);
+				}
+			}
+			if (!bCompress)
+			{
+				arrGzip.RemoveAll();
+				arrDeflate.RemoveAll();
+			}
+		}
+
+		AddVariant(ATLS_ENCODING_GZIP, arrGzip, pftExpiration);
+		AddVariant(ATLS_ENCODING_DEFLATE, arrDeflate, pftExpiration);
+	}
+
+	void AddToMemoryCache(__in FILETIME *pftExpiration) noexcept
+	{
+		DWORD cbBlob = 0;
+		CPageCacheBlob *pBlob = CPageCacheBlob::Create(m_Headers,
+			m_body.GetData(), (DWORD) m_body.GetCount(), &cbBlob);
+		m_body.RemoveAll();
+		if (!pBlob)
+			return;
+
+		if (S_OK != m_spMemoryCache->Add(m_szFullUrl, pBlob, cbBlob, pftExpiration,
+				NULL, NULL, m_pBlobClient))
+		{
+			CPageCacheBlob::Destroy(pBlob);
+			return;
+		}
+
+		// don't let an older copy in the file cache outlive this one
+		m_spCache->RemoveFileByName(m_szFullUrl);
+	}
 
 public:
 
@@ -1344,24 +3585,55 @@ public:
 
 	CCacheServerContext() noexcept
 	{
+		m_pBlobClient = NULL;
+		m_dwMaxResident = 0;
+		m_dwStaleTime = 0;
+		m_bSpilled = FALSE;
+		m_ullBodyHash = ATLS_VALIDATOR_SEED;
+		m_cbBody = 0;
+		m_bCompress = FALSE;
 	}
 	virtual ~CCacheServerContext() noexcept
 	{
 	}
 
-	BOOL Initialize(__in IHttpServerContext *pParent, __in IFileCache *pCache) noexcept
+	// Pages whose bodies are no larger than dwMaxResident bytes are added
+	// to pMemoryCache, and are freed through pBlobClient. Other pages, or
+	// all pages if pMemoryCache is NULL, are added to pCache. A page that
+	// sets an expiration stays cached, marked stale, for dwStaleTime
+	// milliseconds after it expires. If bCompress is TRUE, gzip and deflate
+	// variants of compressible pages are also added to pMemoryCache.
+	BOOL Initialize(
+		__in IHttpServerContext *pParent,
+		__in IFileCache *pCache,
+		__in_opt IMemoryCache *pMemoryCache = NULL,
+		__in_opt IMemoryCacheClient *pBlobClient = NULL,
+		__in DWORD dwMaxResident = 0,
+		__in DWORD dwStaleTime = 0,
+		__in BOOL bCompress = FALSE) noexcept
 	{
 		ATLASSERT(pParent);
 		ATLASSERT(pCache);
+		ATLASSERT(pMemoryCache == NULL || pBlobClient != NULL);
 
 		if (pParent == NULL || pCache == NULL)
 			return FALSE;
 
 		m_spParent = pParent;
 		m_spCache = pCache;
+		m_dwStaleTime = dwStaleTime;
+		m_bCompress = bCompress;
 
-		if (FAILED(m_cacheFile.Create()))
+		if (pMemoryCache && pBlobClient && dwMaxResident)
+		{
+			m_spMemoryCache = pMemoryCache;
+			m_pBlobClient = pBlobClient;
+			m_dwMaxResident = dwMaxResident;
+		}
+		else if (!Spill())
+		{
 			return FALSE;
+		}
 
 		LPCSTR szPathInfo = pParent->GetPathInfo();
 		LPCSTR szQueryString = pParent->GetQueryString();
@@ -1434,8 +3706,27 @@ public:
 		ATLENSURE(pvBuffer);
 		ATLENSURE(pdwBytes);
 		
-		if (S_OK != m_cacheFile.Write(pvBuffer, *pdwBytes))
-			return FALSE;
+		if (!m_bSpilled && *pdwBytes > m_dwMaxResident - m_body.GetCount())
+		{
+			if (!Spill())
+				return FALSE;
+		}
+
+		if (m_bSpilled)
+		{
+			if (S_OK != m_cacheFile.Write(pvBuffer, *pdwBytes))
+				return FALSE;
+		}
+		else
+		{
+			// grow geometrically rather than by CAtlArray's default step
+			size_t nCount = m_body.GetCount();
+			if (!m_body.SetCount(nCount + *pdwBytes, (int) __max(nCount, 4096)))
+				return FALSE;
+			Checked::memcpy_s(m_body.GetData() + nCount, *pdwBytes, pvBuffer, *pdwBytes);
+		}
+		m_ullBodyHash = AtlHashValidator(m_ullBodyHash, pvBuffer, *pdwBytes);
+		m_cbBody += *pdwBytes;
 		ATLENSURE(m_spParent);
 		return m_spParent->WriteClient(pvBuffer, pdwBytes);
 	}
@@ -1448,16 +3739,33 @@ public:
 		{
 		   if (m_bIsCached)
 		   {
-			   CT2CA strFileName(m_cacheFile.TempFileName());
-			   m_cacheFile.HandsOff();
-			   m_spCache->AddFile(m_szFullUrl, strFileName, &m_ftExpiration, &m_Headers, NULL);
+			   BOOL bCompress = IsCompressible() && InsertHeaders("Vary: Accept-Encoding\r\n");
+			   SetValidators();
+			   FILETIME ftExpiration = GetCacheExpiration();
+			   AddCompressedVariants(bCompress, &ftExpiration);
+
+			   if (!m_bSpilled)
+			   {
+				   AddToMemoryCache(&ftExpiration);
+			   }
+			   else
+			   {
+				   CT2CA strFileName(m_cacheFile.TempFileName());
+				   m_cacheFile.HandsOff();
+				   if (m_spCache->AddFile(m_szFullUrl, strFileName, &ftExpiration, &m_Headers, NULL) == S_OK &&
+					   m_spMemoryCache)
+				   {
+					   m_spMemoryCache->RemoveEntryByKey(m_szFullUrl);
+				   }
+			   }
 		   }
-		   else
+		   else if (m_bSpilled)
 			   m_cacheFile.Close();
 		}
 		_ATLCATCHALL()
 		{
-			m_cacheFile.Close();
+			if (m_bSpilled)
+				m_cacheFile.Close();
 		}
 
 		return m_spParent->DoneWithSession(dwHttpStatusCode);
@@ -3373,99 +5681,9 @@ public:
 	{
 		while (szQueryString && *szQueryString)
 		{
-			LPSTR szUrlCurrent = szQueryString;
-			LPSTR szName = szUrlCurrent;
-			LPSTR szPropValue;
-
-			while (*szQueryString)
-			{
-				if (*szQueryString == '=')
-				{
-					szQueryString++;
-					break;
-				}
-				if (*szQueryString == '&')
-				{
-					break;
-				}
-				if (*szQueryString == '+')
-					*szUrlCurrent = ' ';
-				else if (*szQueryString == '%')
-				{
-					// if there is a % without two characters
-					// at the end of the url we skip it
-					if (*(szQueryString+1) && *(szQueryString+2))
-					{
-						short nFirstDigit = AtlHexValue(szQueryString[1]);
-						short nSecondDigit = AtlHexValue(szQueryString[2]);
-
-						if( nFirstDigit < 0 || nSecondDigit < 0 )
-						{
-							break;
-						}
-						*szUrlCurrent = static_cast<CHAR>(16*nFirstDigit+nSecondDigit);
-						szQueryString += 2;
-					}
-					else
-						*szUrlCurrent = '\0';
-				}
-				else
-					*szUrlCurrent = *szQueryString;
-
-				szQueryString++;
-				szUrlCurrent++;
-			}
-
-			if (*szUrlCurrent == '&')
-			{
-				*szUrlCurrent++ = '\0';
-				szQueryString++;
-				szPropValue = "";
-			}
-			else
-			{
-				if (*szUrlCurrent)
-					*szUrlCurrent++ = '\0';
-
-				// we have the property name
-				szPropValue = szUrlCurrent;
-				while (*szQueryString && *szQueryString != '#')
-				{
-					if (*szQueryString == '&')
-					{
-						szQueryString++;
-						break;
-					}
-					if (*szQueryString == '+')
-						*szUrlCurrent = ' ';
-					else if (*szQueryString == '%')
-					{
-						// if there is a % without two characters
-						// at the end of the url we skip it
-						if (*(szQueryString+1) && *(szQueryString+2))
-						{
-							short nFirstDigit = AtlHexValue(szQueryString[1]);
-							short nSecondDigit = AtlHexValue(szQueryString[2]);
-
-							if( nFirstDigit < 0 || nSecondDigit < 0 )
-							{
-								break;
-							}
-							*szUrlCurrent = static_cast<CHAR>(16*nFirstDigit+nSecondDigit);
-							szQueryString += 2;
-						}
-						else
-							*szUrlCurrent = '\0';
-					}
-					else
-						*szUrlCurrent = *szQueryString;
-					szQueryString++;
-					szUrlCurrent++;
-				}
-				// we have the value
-				*szUrlCurrent = '\0';
-				szUrlCurrent++;
-			}
+			LPSTR szName;
+			LPCSTR szPropValue;
+			szQueryString = AtlParseUrlParam(szQueryString, &szName, &szPropValue);
 
 			_ATLTRY
 			{
@@ -3766,61 +5984,35 @@ __checkReturn BOOL ReadClientData(__inout IHttpServerContext *pServerContext, __
 	return TRUE;
 }
 
-#ifndef MAX_MIME_BOUNDARY_LEN
-	#define MAX_MIME_BOUNDARY_LEN 128
-#endif
-
-enum ATL_FORM_FLAGS
-{
-	ATL_FORM_FLAG_NONE = 0,
-	ATL_FORM_FLAG_IGNORE_FILES = 1,
-	ATL_FORM_FLAG_REFUSE_FILES = 2,
-	ATL_FORM_FLAG_IGNORE_EMPTY_FILES = 4,
-	ATL_FORM_FLAG_IGNORE_EMPTY_FIELDS = 8,
-};
-
 // Use this class to read multipart/form-data from the associated server context
 // and generate files as necessary from the data in the body of the request.
-class CMultiPartFormParser
+// The parsing itself is done by CAtlMultiPartParser in atlmultipart.h.
+class CMultiPartFormParser : public CAtlMultiPartParser<CMultiPartFormParser>
 {
+public:
+
+	typedef CHttpMap<CStringA, IHttpFile*, CStringElementTraits<CStringA> > FILEMAPTYPE;
+
 protected:
 
-	LPSTR                       m_pCurrent;
-	LPSTR                       m_pEnd;
-	LPSTR                       m_pStart;
-	CHAR                        m_szBoundary[MAX_MIME_BOUNDARY_LEN+2];
-	DWORD                       m_dwBoundaryLen;
-	BOOL                        m_bFinished;
-	CComPtr<IHttpServerContext> m_spServerContext;
+	CComPtr<IHttpServerContext>     m_spServerContext;
 
-public:
+	// what ContinueMultiPartData is filling in
+	FILEMAPTYPE*                    m_pFiles;
+	CHttpRequestParams*             m_pQueryParams;
+	CStringA                        m_strParamName;
+	CStringA                        m_strFileName;
+	CStringA                        m_strContentType;
+	CStringA                        m_strData;
+	CAutoPtr<CAtlTemporaryFile>     m_spFile;
 
-	typedef CHttpMap<CStringA, IHttpFile*, CStringElementTraits<CStringA> > FILEMAPTYPE;
+public:
 
 	CMultiPartFormParser(__in IHttpServerContext* pServerContext) noexcept :
-		m_pCurrent(NULL),
-		m_pEnd(NULL),
-		m_pStart(NULL),
-		m_dwBoundaryLen(0),
-		m_bFinished(FALSE),
-		m_spServerContext(pServerContext)
+		m_spServerContext(pServerContext),
+		m_pFiles(NULL),
+		m_pQueryParams(NULL)
 	{
-		*m_szBoundary = '\0';
-	}
-
-	~CMultiPartFormParser() noexcept
-	{
-		_ATLTRY
-		{
-			// free memory if necessary
-			if (m_spServerContext->GetTotalBytes() > m_spServerContext->GetAvailableBytes())
-			{
-				free(m_pStart);
-			}
-		}
-		_ATLCATCHALL()
-		{
-		}
 	}
 
 	// Call this function to read multipart/form-data from the current HTTP request,
@@ -3863,568 +6055,169 @@ public:
 		__inout CHttpRequestParams* pQueryParams, 
 		__in DWORD dwFlags=ATL_FORM_FLAG_NONE) noexcept
 	{
-		_ATLTRY
-		{
-			if (!InitializeParser())
-			{
-				return FALSE;
-			}
-
-			//Get to the first boundary
-			if (!ReadUntilBoundary())
-			{
-				return FALSE;
-			}
-
-			CStringA strParamName;
-			CStringA strFileName;
-			CStringA strContentType;
-			CStringA strData;
-			BOOL bFound;
-
-			while (!m_bFinished)
-			{
-				// look for "name" field
-				if (!GetMimeData(strParamName, "name=", sizeof("name=")-1, &bFound, TRUE) || !bFound)
-				{
-					ATLTRACE(atlTraceISAPI, 0, _T("Malformed Form-Data"));
-					return FALSE;
-				}
-
-				// see if it's a file
-				if (!GetMimeData(strFileName, "filename=", sizeof("filename=")-1, &bFound, TRUE))
-				{
-					ATLTRACE(atlTraceISAPI, 0, _T("Malformed Form-Data"));
-					return FALSE;
-				}
-
-				if (bFound)
-				{
-					if (dwFlags & ATL_FORM_FLAG_REFUSE_FILES)
-					{
-						return FALSE;
-					}
-
-					if (!strFileName.GetLength())
-					{
-						if(!ReadUntilBoundary())
-						{
-							return FALSE;
-						}
-						continue;
-					}
-
-					if (!GetMimeData(strContentType, "Content-Type:", sizeof("Content-Type:")-1, &bFound, TRUE))
-					{
-						ATLTRACE(atlTraceISAPI, 0, _T("Malformed Form-Data"));
-						return FALSE;
-					}
-
-					// move to the actual uploaded data
-					if (!MoveToData())
-					{
-						ATLTRACE(atlTraceISAPI, 0, _T("Malformed Form-Data"));
-						return FALSE;
-					}
-
-					// if the user doesn't want files, don't save the file
-					if (dwFlags & ATL_FORM_FLAG_IGNORE_FILES)
-					{
-						if (!ReadUntilBoundary(NULL, NULL))
-						{
-							return FALSE;
-						}
-						continue;
-					}
-
-					CAtlTemporaryFile ctf;
-					HRESULT hr = ctf.Create();
-					if (hr != S_OK)
-						return FALSE;
-
-					if (!ReadUntilBoundary(NULL, &ctf))
-					{
-						ctf.Close();
-						return FALSE;
-					}
-					ULONGLONG nFileSize = 0;
-					if (ctf.GetSize(nFileSize) != S_OK)
-						return FALSE;
-
-					if ((dwFlags & ATL_FORM_FLAG_IGNORE_EMPTY_FILES) && nFileSize == 0)
-					{
-						ctf.Close();
-						continue;
-					}
-
-					CAutoPtr<CHttpRequestFile> spFile;
-
-					CT2AEX<MAX_PATH+1> szTempFileNameA(ctf.TempFileName());
-
-					ATLTRY(spFile.Attach(new CHttpRequestFile()));
-					if (!spFile)
-					{
-						return FALSE;
-					}
-
-					if (!spFile->Initialize(strParamName, strFileName, szTempFileNameA, strContentType, nFileSize))
-					{
-						// one of the strings was too long
-						return FALSE;
-					}
-
-					if (!Files.SetAt(szTempFileNameA, spFile))
-					{
-						return FALSE;
-					}
-
-					spFile.Detach();
-					
-					if (!pQueryParams || !pQueryParams->SetAt(strParamName, szTempFileNameA))
-					{
-						return FALSE;
-					}
-
-					ctf.HandsOff();
-
-					continue;
-				}
-
-				// move to the actual uploaded data
-				if (!MoveToData())
-				{
-					ATLTRACE(atlTraceISAPI, 0, _T("Malformed Form-Data"));
-					return FALSE;
-				}
-
-				if (!ReadUntilBoundary(&strData))
-				{
-					return FALSE;
-				}
-
-				if ((dwFlags & ATL_FORM_FLAG_IGNORE_EMPTY_FIELDS) && strData.GetLength() == 0)
-					continue;
-
-				if (!pQueryParams || !pQueryParams->SetAt(strParamName, strData))
-				{
-					return FALSE;
-				}
-
-			}
-
-			return TRUE;
-		}
-		_ATLCATCHALL()
+		if (!BeginMultiPartData(Files, pQueryParams, dwFlags, FALSE))
 		{
 			return FALSE;
 		}
-	}
-
-private:
-
-	// implementation
-
-	// case insensitive substring search -- does not handle multibyte characters (unlike tolower)
-	// allows searching up to a maximum point in a string
-	inline char AtlCharLower(__in char ch) noexcept
-	{
-		if (ch > 64 && ch < 91)
-		{
-			return ch+32;
-		}
-
-		return ch;
-	}
-
-	inline __checkReturn char * _stristr (__in const char * str1, __in const char * str2)
-	{
-		ATLENSURE(str1!=NULL);
-		ATLENSURE(str2!=NULL);
-		char *cp = (char *) str1;
-		char *s1, *s2;
-
-		if ( !*str2 )
-			return((char *)str1);
-
-		while (*cp)
-		{
-			s1 = cp;
-			s2 = (char *) str2;
-
-			while ( *s1 && *s2 && !(AtlCharLower(*s1)-AtlCharLower(*s2)) )
-			{
-				s1++, s2++;
-			}
-
-			if (!*s2)
-			{
-				return(cp);
-			}
-
-			cp++;
-		}
-
-		return(NULL);
-	}
-
-
-	inline __checkReturn char * _stristrex (__in const char * str1, __in const char * str2, __in const char * str1End)
-	{
-		ATLENSURE(str1!=NULL);
-		ATLENSURE(str2!=NULL);
-		char *cp = (char *) str1;
-		char *s1, *s2;
-
-		if ( !*str2 )
-			return((char *)str1);
-
-		while (cp != str1End)
-		{
-			s1 = cp;
-			s2 = (char *) str2;
-
-			while ( s1 != str1End && *s2 && !(AtlCharLower(*s1)-AtlCharLower(*s2)) )
-			{
-				s1++, s2++;
-			}
-
-			if (!*s2)
-			{
-				return (cp);
-			}
-
-			if (s1 == str1End)
-			{
-				return (NULL);
-			}
-
-			cp++;
-		}
-
-		return(NULL);
-	}
-
-	inline __checkReturn char * _strstrex (__in const char * str1, __in const char * str2, __in const char * str1End)
-	{
-		ATLENSURE(str1!=NULL);
-		ATLENSURE(str2!=NULL);
-		char *cp = (char *) str1;
-		char *s1, *s2;
-
-		if ( !*str2 )
-			return((char *)str1);
-
-		while (cp != str1End)
-		{
-			s1 = cp;
-			s2 = (char *) str2;
-
-			while ( s1 != str1End && *s2 && !((*s1)-(*s2)) )
-			{
-				s1++, s2++;
-			}
-
-			if (!*s2)
-			{
-				return (cp);
-			}
-
-			if (s1 == str1End)
-			{
-				return (NULL);
-			}
-
-			cp++;
-		}
 
-		return(NULL);
+		ATLASSERT(!IsPending());
+		return TRUE;
 	}
 
-	ATL_NOINLINE __checkReturn BOOL InitializeParser() noexcept
+	// Call this function instead of GetMultiPartData to parse a body without blocking
+	// on the client when bAsync is TRUE. The data the server already has is parsed at
+	// once. If IsPending then returns TRUE, read more of the body into the buffer
+	// returned by GetReadBuffer (with IHttpServerContext::AsyncReadClient, for example),
+	// then call OnReadComplete and ContinueMultiPartData, until IsPending returns FALSE.
+	// A read that fails or reads nothing makes ContinueMultiPartData fail.
+	//
+	// Files and pQueryParams must stay valid until the parse is done.
+	// Returns TRUE on success, FALSE on failure.
+	ATL_NOINLINE BOOL BeginMultiPartData(
+		__inout FILEMAPTYPE& Files, 
+		__inout_opt CHttpRequestParams* pQueryParams, 
+		__in DWORD dwFlags,
+		__in BOOL bAsync) noexcept
 	{
 		ATLASSUME( m_spServerContext != NULL );
 
+		m_pFiles = &Files;
+		m_pQueryParams = pQueryParams;
+
 		_ATLTRY
 		{
-			DWORD dwBytesTotal = m_spServerContext->GetTotalBytes();
-
-			// if greater than bytes available, allocate necessary space
-			if (dwBytesTotal > m_spServerContext->GetAvailableBytes())
-			{
-				m_pStart = (LPSTR) malloc(dwBytesTotal);
-				if (!m_pStart)
-				{
-					return FALSE;
-				}
-				m_pCurrent = m_pStart;
-				DWORD dwLen = dwBytesTotal;
-				if (!ReadClientData(m_spServerContext, m_pStart, &dwLen, 0) || dwLen != dwBytesTotal)
-				{
-					return FALSE;
-				}
-			}
-			else
-			{
-				m_pStart = (LPSTR) m_spServerContext->GetAvailableData();
-			}
-
-			m_pCurrent = m_pStart;
-			m_pEnd = m_pCurrent + dwBytesTotal;
-
-			//get the boundary
 			LPCSTR pszContentType = m_spServerContext->GetContentType();
 			ATLASSERT(pszContentType != NULL);
 
-			LPCSTR pszTmp = _stristr(pszContentType, "boundary=");
-			if (!pszTmp)
-			{
-				ATLTRACE(atlTraceISAPI, 0, _T("Malformed Form-Data"));
-				return FALSE;
-			}
-
-			pszTmp += sizeof("boundary=")-1;
-			BOOL bInQuote = FALSE;
-			if (*pszTmp == '\"')
-			{
-				bInQuote = TRUE;
-				pszTmp++;
-			}
-
-			LPSTR pszMimeBoundary = m_szBoundary;
-			*pszMimeBoundary++ = '-';
-			*pszMimeBoundary++ = '-';
-			m_dwBoundaryLen = 2;
-			while (*pszTmp && (bInQuote || IsStandardBoundaryChar(*pszTmp)))
-			{
-				if (m_dwBoundaryLen >= MAX_MIME_BOUNDARY_LEN)
-				{
-					ATLTRACE(atlTraceISAPI, 0, _T("Malformed MIME boundary"));
-					return FALSE;
-				}
-
-				if (*pszTmp == '\r' || *pszTmp == '\n')
-				{
-					if (bInQuote)
-					{
-						pszTmp++;
-						continue;
-					}
-					break;
-				}
-				if (bInQuote && *pszTmp == '"')
-				{
-					break;
-				}
-
-				*pszMimeBoundary++ = *pszTmp++;
-				m_dwBoundaryLen++;
-			}
-
-			*pszMimeBoundary = '\0';
+			return BeginParse(pszContentType,
+				m_spServerContext->GetTotalBytes(),
+				m_spServerContext->GetAvailableBytes(),
+				(LPSTR) m_spServerContext->GetAvailableData(),
+				dwFlags, bAsync);
 		}
 		_ATLCATCHALL()
 		{
 			return FALSE;
 		}
+	}
+
+	// CAtlMultiPartParser
+
+	__checkReturn BOOL ReadClient(__out_ecount_part(*pdwLen,*pdwLen) LPSTR pBuffer, __inout DWORD *pdwLen, __in DWORD dwBodyOffset) noexcept
+	{
+		return ReadClientData(m_spServerContext, pBuffer, pdwLen, dwBodyOffset);
+	}
 
+	__checkReturn BOOL BeginField(__in_ecount(cchName) LPCSTR szName, __in DWORD cchName)
+	{
+		m_strParamName.SetString(szName, (int)cchName);
+		m_strData.Empty();
 		return TRUE;
 	}
 
-	inline __checkReturn BOOL MoveToData() noexcept
+	__checkReturn BOOL BeginFile(
+		__in_ecount(cchName) LPCSTR szName, __in DWORD cchName,
+		__in_ecount(cchFileName) LPCSTR szFileName, __in DWORD cchFileName,
+		__in_ecount_opt(cchContentType) LPCSTR szContentType, __in DWORD cchContentType)
 	{
-		LPSTR szEnd = _strstrex(m_pCurrent, "\r\n\r\n", m_pEnd);
-		if (!szEnd)
+		m_strParamName.SetString(szName, (int)cchName);
+		m_strFileName.SetString(szFileName, (int)cchFileName);
+		if (szContentType)
+			m_strContentType.SetString(szContentType, (int)cchContentType);
+		else
+			m_strContentType.Empty();
+
+		m_spFile.Free();
+		ATLTRY(m_spFile.Attach(new CAtlTemporaryFile));
+		if (!m_spFile)
 		{
 			return FALSE;
 		}
 
-		m_pCurrent = szEnd+4;
-		if (m_pCurrent >= m_pEnd)
-		{
+		HRESULT hr = m_spFile->Create();
+		if (hr != S_OK)
 			return FALSE;
-		}
 
 		return TRUE;
 	}
 
-	inline __checkReturn BOOL GetMimeData(__inout CStringA &str, __in_ecount(dwFieldLen) LPCSTR szField, __in DWORD dwFieldLen, __out LPBOOL pbFound, __in BOOL bIgnoreCase = FALSE) noexcept
+	__checkReturn BOOL WritePartData(__in_bcount(cbData) LPCSTR pData, __in DWORD cbData)
 	{
-		_ATLTRY
+		if (m_nState == ATL_MULTIPART_FIELD)
 		{
-			ATLASSERT( szField != NULL );
-			ATLENSURE( pbFound != NULL );
-
-			*pbFound = FALSE;
-
-			LPSTR szEnd = _strstrex(m_pCurrent, "\r\n\r\n", m_pEnd);
-			if (!szEnd)
-			{
-				return FALSE;
-			}
-
-			LPSTR szDataStart = NULL;
-
-			if (!bIgnoreCase)
-			{
-				szDataStart = _strstrex(m_pCurrent, szField, szEnd);
-			}
-			else
-			{
-				szDataStart = _stristrex(m_pCurrent, szField, szEnd);
-			}
-
-			if (szDataStart)
-			{
-				szDataStart+= dwFieldLen;
-				if (szDataStart >= m_pEnd)
-				{
-					return FALSE;
-				}
-
-				BOOL bInQuote = FALSE;
-				if (*szDataStart == '\"')
-				{
-					bInQuote = TRUE;
-					szDataStart++;
-				}
-
-				LPSTR szDataEnd = szDataStart;
-				while (!bInQuote && (szDataEnd < m_pEnd) && (*szDataEnd == ' ' || *szDataEnd == '\t'))
-				{
-					szDataEnd++;
-				}
-
-				if (szDataEnd >= m_pEnd)
-				{
-					return FALSE;
-				}
-
-				while (szDataEnd < m_pEnd)
-				{
-					if (!IsValidTokenChar(*szDataEnd))
-					{
-						if (*szDataEnd == '\"' || !bInQuote)
-						{
-							break;
-						}
-					}
-					szDataEnd++;
-				}
-
-				if (szDataEnd >= m_pEnd)
-				{
-					return FALSE;
-				}
-
-				str.SetString(szDataStart, (int)(szDataEnd-szDataStart));
-				*pbFound = TRUE;
-			}
-
+			m_strData.Append(pData, (int)cbData);
 			return TRUE;
 		}
-		_ATLCATCHALL()
+
+		ATLASSERT(m_nState == ATL_MULTIPART_FILE);
+		return SUCCEEDED(m_spFile->Write(pData, cbData));
+	}
+
+	__checkReturn BOOL EndField(__in BOOL bKeep)
+	{
+		if (!bKeep)
 		{
-			return FALSE;
+			return TRUE;
 		}
+
+		return m_pQueryParams && m_pQueryParams->SetAt(m_strParamName, m_strData);
 	}
 
-	ATL_NOINLINE __checkReturn BOOL ReadUntilBoundary(__inout_opt CStringA* pStrData=NULL, __inout_opt CAtlTemporaryFile* pCtf=NULL) noexcept
+	// Adds the file m_spFile has been filled with to the files and form fields.
+	__checkReturn BOOL EndFile(__in BOOL bKeep)
 	{
-		_ATLTRY
+		if (!bKeep)
 		{
-			LPSTR szBoundaryStart = m_pCurrent;
-			LPSTR szBoundaryEnd = NULL;
+			m_spFile.Free();
+			return TRUE;
+		}
 
-			do 
-			{
-				szBoundaryStart = _strstrex(szBoundaryStart, m_szBoundary, m_pEnd);
-				if (szBoundaryStart)
-				{
-					if ((szBoundaryStart-m_pStart) >= 2)
-					{
-						if (*(szBoundaryStart-1) != 0x0a || *(szBoundaryStart-2) != 0x0d)
-						{
-							szBoundaryStart++;
-							continue;
-						}
-					}
-					szBoundaryEnd = szBoundaryStart+m_dwBoundaryLen;
-					if (szBoundaryEnd+2 >= m_pEnd)
-					{
-						return FALSE;
-					}
-					if (szBoundaryEnd[0] == '\r' && szBoundaryEnd[1] == '\n')
-					{
-						break;
-					}
-					if (szBoundaryEnd[0] == '-' && szBoundaryEnd[1] == '-')
-					{
-						m_bFinished = TRUE;
-						break;
-					}
-					szBoundaryStart++;
-				}
-			} while (szBoundaryStart && szBoundaryStart < m_pEnd);
+		ULONGLONG nFileSize = 0;
+		if (m_spFile->GetSize(nFileSize) != S_OK)
+			return FALSE;
 
-			if (!szBoundaryStart || szBoundaryStart >= m_pEnd)
-			{
-				return FALSE;
-			}
+		CAutoPtr<CHttpRequestFile> spFile;
 
-			if ((szBoundaryStart-m_pStart) >= 2)
-			{
-				szBoundaryStart-= 2;
-			}
-			if (pStrData)
-			{
-				pStrData->SetString(m_pCurrent, (int)(szBoundaryStart-m_pCurrent)); 
-			}
-			if (pCtf)
-			{
-				if (FAILED(pCtf->Write(m_pCurrent, (DWORD)(szBoundaryStart-m_pCurrent))))
-				{
-					return FALSE;
-				}
-			}
+		CT2AEX<MAX_PATH+1> szTempFileNameA(m_spFile->TempFileName());
 
-			if (!m_bFinished)
-			{
-				m_pCurrent = szBoundaryEnd+2;
-				if (m_pCurrent >= m_pEnd)
-				{
-					return FALSE;
-				}
-			}
+		ATLTRY(spFile.Attach(new CHttpRequestFile()));
+		if (!spFile)
+		{
+			return FALSE;
+		}
 
-			return TRUE;
+		if (!spFile->Initialize(m_strParamName, m_strFileName, szTempFileNameA, m_strContentType, nFileSize))
+		{
+			// one of the strings was too long
+			return FALSE;
 		}
-		_ATLCATCHALL()
+
+		if (!m_pFiles->SetAt(szTempFileNameA, spFile))
 		{
 			return FALSE;
 		}
-	}
 
-	static inline __checkReturn BOOL IsStandardBoundaryChar(__in CHAR ch) noexcept
-	{
-		if ( (ch >= 'A' && ch <= 'Z') ||
-			 (ch >= 'a' && ch <= 'z') ||
-			 (ch >= '0' && ch <= '9') ||
-			 (ch == '\'') ||
-			 (ch == '+')  ||
-			 (ch == '_')  ||
-			 (ch == '-')  ||
-			 (ch == '=')  ||
-			 (ch == '?') )
+		spFile.Detach();
+		
+		if (!m_pQueryParams || !m_pQueryParams->SetAt(m_strParamName, szTempFileNameA))
 		{
-			return TRUE;
+			return FALSE;
 		}
 
-		return FALSE;
+		m_spFile->HandsOff();
+		m_spFile.Free();
+		return TRUE;
+	}
+
+	void AbortFile()
+	{
+		m_spFile->Close();
 	}
 
-	inline __checkReturn BOOL IsValidTokenChar(__in CHAR ch) noexcept
+	void OnParseError(__in LPCSTR szMessage) noexcept
 	{
-		return ( (ch != 0) && (ch != 0xd) && (ch != 0xa) && (ch != ' ') && (ch != '\"') );
+		(szMessage);
+		ATLTRACE(atlTraceISAPI, 0, "%s\n", szMessage);
 	}
 
 private:
@@ -4470,12 +6263,25 @@ protected:
 
 	CCookie m_EmptyCookie;
 
+	// Implementation: TRUE while form data that Initialize left to be read
+	// asynchronously (ATL_FORM_FLAG_ASYNC_BODY) has not all arrived.
+	BOOL m_bBodyPending;
+
+	// Implementation: The parser of a pending multipart/form-data body.
+	CAutoPtr<CMultiPartFormParser> m_spFormParser;
+
+	// Implementation: The buffer a pending application/x-www-form-urlencoded body is read into.
+	CAutoVectorPtr<CHAR> m_szFormData;
+
 	// Implementation: Constructor function used to reinitialize all data members.
 	void Construct() noexcept
 	{
 		m_spServerContext.Release();
 		m_bMultiPart = FALSE;
 		m_dwBytesRead = 0;
+		m_bBodyPending = FALSE;
+		m_spFormParser.Free();
+		m_szFormData.Free();
 		if (m_pFormVars != &m_QueryParams)
 			delete m_pFormVars;
 
@@ -4557,6 +6363,7 @@ public:
 	{
 		m_bMultiPart = FALSE;
 		m_dwBytesRead = 0;
+		m_bBodyPending = FALSE;
 		m_pFormVars = &m_QueryParams;
 	}
 
@@ -4769,7 +6576,6 @@ public:
 			pos = pRequestLookup->GetFirstFormVar(&szName, &szValue);
 			if (pos)
 			{
-				m_pFormVars = NULL;
 				ATLTRY(m_pFormVars = new CHttpRequestParams);
 				if (!m_pFormVars)
 					return FALSE;
@@ -4833,6 +6639,9 @@ public:
 	//      The collection of form fields is accessible via the GetFormVars method or the FormVars property.
 	//      The collection of files is accessible via the m_Files member.
 	//
+	//      If dwFlags includes ATL_FORM_FLAG_ASYNC_BODY and the server does not have the whole body yet,
+	//      only the data it has is parsed and IsBodyPending returns TRUE. See ReadBodyAsync.
+	//
 	// Note that Initialize does not parse the cookies associated with a request.
 	// Cookies are not processed until an attempt is made to access a cookie in the collection.
 	BOOL Initialize(
@@ -4896,9 +6705,13 @@ public:
 					return TRUE;
 				}
 
+				// read the part of the body the server does not have yet without blocking
+				BOOL bAsync = (dwFlags & ATL_FORM_FLAG_ASYNC_BODY) &&
+					m_spServerContext->GetTotalBytes() > m_spServerContext->GetAvailableBytes();
+
 				// If POSTed data is urlencoded, call InitFromPost.
 				if (strncmp(szContentType, "application/x-www-form-urlencoded", 33) == 0 && !m_pFormVars->IsShared())
-					return InitFromPost();
+					return bAsync ? BeginFormData() : InitFromPost();
 
 				// If POSTed data is encoded as multipart/form-data, use CMultiPartFormParser.
 				if (strncmp(szContentType, "multipart/form-data", 19) == 0 && !m_pFormVars->IsShared())
@@ -4907,11 +6720,28 @@ public:
 						delete m_pFormVars;
 					m_pFormVars = NULL;
 
-					CMultiPartFormParser FormParser(m_spServerContext);
 					ATLTRY(m_pFormVars = new CHttpRequestParams);
 					if (!m_pFormVars)
 						return FALSE;
 
+					if (bAsync)
+					{
+						ATLTRY(m_spFormParser.Attach(new CMultiPartFormParser(m_spServerContext)));
+						if (!m_spFormParser)
+							return FALSE;
+
+						if (!m_spFormParser->BeginMultiPartData(m_Files, m_pFormVars, dwFlags, TRUE))
+							return FALSE;
+
+						// the parser has consumed the data the server had
+						m_dwBytesRead = m_spServerContext->GetAvailableBytes();
+						m_bBodyPending = m_spFormParser->IsPending();
+						if (!m_bBodyPending)
+							m_spFormParser.Free();
+						return TRUE;
+					}
+
+					CMultiPartFormParser FormParser(m_spServerContext);
 					BOOL bRet = FormParser.GetMultiPartData(m_Files, m_pFormVars, dwFlags);
 					return bRet;
 				}
@@ -4962,10 +6792,150 @@ public:
 			BOOL bRet = ReadClientData(m_spServerContext, szBuff, &dwBytesTotal, 0);
 			if (bRet)
 			{
-				szBuff[dwBytesTotal] = '\0';
-				bRet = m_pFormVars->Parse(szBuff);
+				szBuff[dwBytesTotal] = '\0';
+				bRet = m_pFormVars->Parse(szBuff);
+			}
+
+			return bRet;
+		}
+		_ATLCATCHALL()
+		{
+		}
+		return FALSE;
+	}
+
+	// Implementation: Call this function to start reading an application/x-www-form-urlencoded
+	// body that the server does not have all of. The data it has is copied into m_szFormData
+	// and the rest is read by ReadBodyAsync.
+	ATL_NOINLINE BOOL BeginFormData() noexcept
+	{
+		_ATLTRY
+		{
+			ATLASSUME(m_spServerContext != NULL);
+
+			if (m_pFormVars == NULL || m_pFormVars == &m_QueryParams)
+			{
+				ATLTRY(m_pFormVars = new CHttpRequestParams);
+				if (m_pFormVars == NULL)
+				{
+					return FALSE;
+				}
+			}
+
+			DWORD dwBytesTotal = m_spServerContext->GetTotalBytes();
+			if (dwBytesTotal+1 < dwBytesTotal)
+			{
+				return FALSE;
+			}
+			if (!m_szFormData.Allocate(dwBytesTotal+1))
+			{
+				return FALSE;
+			}
+
+			DWORD dwLen = m_spServerContext->GetAvailableBytes();
+			if (!ReadClientData(m_spServerContext, m_szFormData, &dwLen, 0))
+			{
+				return FALSE;
+			}
+
+			m_dwBytesRead = dwLen;
+			m_bBodyPending = TRUE;
+			return TRUE;
+		}
+		_ATLCATCHALL()
+		{
+		}
+		return FALSE;
+	}
+
+	// Returns TRUE if Initialize was called with ATL_FORM_FLAG_ASYNC_BODY and the form data
+	// has not all arrived yet. The form fields and files are not complete until it returns FALSE.
+	BOOL IsBodyPending() const noexcept
+	{
+		return m_bBodyPending;
+	}
+
+	// Call this function to read more of a pending body (see IsBodyPending) without blocking.
+	// The handler must use ATLSRV_INIT_USEASYNC_EX. It returns HTTP_SUCCESS_ASYNC_NOFLUSH
+	// after a successful call, and calls OnReadBody with the cbAsyncIO and dwAsyncError
+	// members of its AtlServerRequest when the request is resumed.
+	// Returns TRUE if the read was started, FALSE on failure.
+	__checkReturn BOOL ReadBodyAsync() noexcept
+	{
+		if (!m_bBodyPending)
+			return FALSE;
+
+		_ATLTRY
+		{
+			LPSTR pDest;
+			DWORD dwLen;
+			if (m_spFormParser)
+			{
+				if (!m_spFormParser->GetReadBuffer(&pDest, &dwLen))
+					return FALSE;
+			}
+			else
+			{
+				pDest = m_szFormData+m_dwBytesRead;
+				dwLen = m_spServerContext->GetTotalBytes()-m_dwBytesRead;
+			}
+
+			BOOL bPending;
+			if (!AsyncReadData(pDest, &dwLen, &bPending))
+				return FALSE;
+
+			// Initialize consumed the data the server had, so the read is always sent to the client
+			ATLASSERT(bPending);
+			return bPending;
+		}
+		_ATLCATCHALL()
+		{
+		}
+		return FALSE;
+	}
+
+	// Call this function when a request that called ReadBodyAsync is resumed.
+	// Parses the data that was read. IsBodyPending indicates whether ReadBodyAsync
+	// must be called again.
+	// Returns TRUE on success, FALSE if the read or the form data was not valid.
+	__checkReturn BOOL OnReadBody(__in DWORD cbIO, __in DWORD dwError) noexcept
+	{
+		if (!m_bBodyPending)
+			return FALSE;
+
+		_ATLTRY
+		{
+			m_bBodyPending = FALSE;
+			BOOL bRead = OnAsyncReadData(cbIO, dwError);
+
+			if (m_spFormParser)
+			{
+				// the parser fails a read that failed or read nothing itself,
+				// and closes the file it was reading into
+				m_spFormParser->OnReadComplete(cbIO, dwError);
+				if (!m_spFormParser->ContinueMultiPartData())
+					return FALSE;
+
+				ATLASSERT(bRead);
+				m_bBodyPending = m_spFormParser->IsPending();
+				if (!m_bBodyPending)
+					m_spFormParser.Free();
+				return TRUE;
+			}
+
+			if (!bRead)
+				return FALSE;
+
+			DWORD dwBytesTotal = m_spServerContext->GetTotalBytes();
+			if (m_dwBytesRead < dwBytesTotal)
+			{
+				m_bBodyPending = TRUE;
+				return TRUE;
 			}
 
+			m_szFormData[dwBytesTotal] = '\0';
+			BOOL bRet = m_pFormVars->Parse(m_szFormData);
+			m_szFormData.Free();
 			return bRet;
 		}
 		_ATLCATCHALL()
@@ -5006,6 +6976,47 @@ public:
 		return bRet;
 	}
 
+	// Reads up to *pdwLen bytes of the body into pDest without blocking.
+	// Data the server already has is copied at once; *pdwLen is set to the number of bytes
+	// copied and *pbPending to FALSE. Otherwise the read is started with AsyncReadClient and
+	// *pbPending is set to TRUE. The handler must use ATLSRV_INIT_USEASYNC_EX; it returns
+	// HTTP_SUCCESS_ASYNC_NOFLUSH and, when the request is resumed, calls OnAsyncReadData with
+	// the cbAsyncIO and dwAsyncError members of its AtlServerRequest.
+	// Returns TRUE on success, FALSE on failure.
+	__checkReturn BOOL AsyncReadData(__out_bcount_part(*pdwLen,*pdwLen) LPSTR pDest, __inout LPDWORD pdwLen, __out BOOL *pbPending)
+	{
+		ATLENSURE(pDest);
+		ATLENSURE(pdwLen);
+		ATLENSURE(pbPending);
+		ATLENSURE(m_spServerContext);
+
+		*pbPending = FALSE;
+		DWORD dwAvailable = m_spServerContext->GetAvailableBytes();
+		if (m_dwBytesRead < dwAvailable || m_dwBytesRead >= m_spServerContext->GetTotalBytes())
+		{
+			*pdwLen = __min(*pdwLen, dwAvailable > m_dwBytesRead ? dwAvailable-m_dwBytesRead : 0);
+			return ReadData(pDest, pdwLen);
+		}
+
+		if (!m_spServerContext->AsyncReadClient(pDest, pdwLen))
+			return FALSE;
+
+		*pbPending = TRUE;
+		return TRUE;
+	}
+
+	// Call this function when a request that started a read with AsyncReadData is resumed.
+	// cbIO and dwError are the cbAsyncIO and dwAsyncError members of the AtlServerRequest.
+	// Returns TRUE if cbIO bytes were read, FALSE if the read failed or the client closed the connection.
+	__checkReturn BOOL OnAsyncReadData(__in DWORD cbIO, __in DWORD dwError) noexcept
+	{
+		if (dwError != ERROR_SUCCESS || cbIO == 0)
+			return FALSE;
+
+		m_dwBytesRead+= cbIO;
+		return TRUE;
+	}
+
 	// Returns the number of bytes available in the request buffer accessible via GetAvailableData.
 	// If GetAvailableBytes returns the same value as GetTotalBytes, the request buffer contains the whole request.
 	// Otherwise, the remaining data should be read from the client using ReadData.
@@ -6217,12 +8228,316 @@ public:
 	}
 }; // class CAtlIsapiBuffer
 
+// Size in bytes of the segments CAtlIsapiBufferChain stores content in.
+#ifndef ATLS_RESPONSE_SEGMENT_SIZE
+#define ATLS_RESPONSE_SEGMENT_SIZE 16384
+#endif
+
+// Number of free segments CAtlIsapiSegmentPool keeps for reuse.
+#ifndef ATLS_RESPONSE_SEGMENT_POOL_SIZE
+#define ATLS_RESPONSE_SEGMENT_POOL_SIZE 256
+#endif
+
+// Writes of at least this many bytes from memory registered with
+// CHttpResponse::AddStableRange are referenced instead of copied.
+#ifndef ATLS_RESPONSE_REFERENCE_MIN
+#define ATLS_RESPONSE_REFERENCE_MIN 512
+#endif
+
+//
+// CAtlIsapiSegmentPool
+// A lock free list of ATLS_RESPONSE_SEGMENT_SIZE byte segments shared by
+// the response buffers of all requests, so steady state responses don't
+// go to the heap for their content.
+class CAtlIsapiSegmentPool
+{
+public:
+	static void *Allocate() noexcept
+	{
+		void *pvSegment = InterlockedPopEntrySList(GetFreeList());
+		if (pvSegment)
+			return pvSegment;
+		return HeapAlloc(GetProcessHeap(), 0, ATLS_RESPONSE_SEGMENT_SIZE);
+	}
+
+	static void Free(__in_opt void *pvSegment) noexcept
+	{
+		if (!pvSegment)
+			return;
+
+		// a free segment holds its list entry in its own first bytes
+		if (QueryDepthSList(GetFreeList()) < ATLS_RESPONSE_SEGMENT_POOL_SIZE)
+			InterlockedPushEntrySList(GetFreeList(), (PSLIST_ENTRY) pvSegment);
+		else
+			HeapFree(GetProcessHeap(), 0, pvSegment);
+	}
+
+	// Returns the free segments to the heap
+	static void Trim() noexcept
+	{
+		PSLIST_ENTRY pEntry = InterlockedFlushSList(GetFreeList());
+		while (pEntry)
+		{
+			PSLIST_ENTRY pNext = pEntry->Next;
+			HeapFree(GetProcessHeap(), 0, pEntry);
+			pEntry = pNext;
+		}
+	}
+
+private:
+	static PSLIST_HEADER GetFreeList() noexcept
+	{
+		// an all zero SLIST_HEADER is an empty list
+		static DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) SLIST_HEADER s_freeList;
+		return &s_freeList;
+	}
+}; // class CAtlIsapiSegmentPool
+
+//
+// CAtlIsapiBufferChain
+// A response buffer kept as a list of chunks rather than one contiguous
+// block. Appended data fills the inline buffer and then segments from
+// CAtlIsapiSegmentPool, so growing the buffer never copies what is
+// already in it, and AppendReference adds memory that outlives the buffer
+// without copying it at all. The chunks can be handed to the server in
+// one gathered send; operator LPCSTR gathers them into one block for
+// callers that need contiguous content.
+template <DWORD dwSizeT=ATL_ISAPI_BUFFER_SIZE>
+class CAtlIsapiBufferChain
+{
+protected:
+	struct CHUNK
+	{
+		LPCSTR pData;
+		DWORD cbData;
+		void *pvSegment;	// pool segment that starts with this chunk, if any
+		BOOL bReference;	// pData isn't owned by the buffer
+	};
+
+	enum { INLINE_CHUNKS = 16 };
+
+	char m_szBuffer[dwSizeT];
+	CHUNK m_rgInlineChunks[INLINE_CHUNKS];
+	CHUNK *m_pChunks;
+	DWORD m_nChunks;
+	DWORD m_nMaxChunks;
+	DWORD m_nReferences;
+	LPSTR m_pWrite;		// where the next copied byte goes
+	DWORD m_cbFree;		// bytes left at m_pWrite
+	DWORD m_dwLen;
+	LPSTR m_pLinear;	// heap block built by operator LPCSTR
+	HANDLE m_hProcHeap;
+
+public:
+	CAtlIsapiBufferChain() noexcept
+	{
+		m_pChunks = m_rgInlineChunks;
+		m_nChunks = 0;
+		m_nMaxChunks = INLINE_CHUNKS;
+		m_nReferences = 0;
+		m_pWrite = m_szBuffer;
+		m_cbFree = dwSizeT;
+		m_dwLen = 0;
+		m_pLinear = NULL;
+		m_hProcHeap = GetProcessHeap();
+	}
+
+	~CAtlIsapiBufferChain() noexcept
+	{
+		Empty();
+		if (m_pChunks != m_rgInlineChunks)
+			HeapFree(m_hProcHeap, 0, m_pChunks);
+	}
+
+	// Returns the segments to the pool. The chunk list keeps its size.
+	void Empty() noexcept
+	{
+		for (DWORD i = 0; i < m_nChunks; i++)
+			CAtlIsapiSegmentPool::Free(m_pChunks[i].pvSegment);
+		if (m_pLinear)
+		{
+			HeapFree(m_hProcHeap, 0, m_pLinear);
+			m_pLinear = NULL;
+		}
+		m_nChunks = 0;
+		m_nReferences = 0;
+		m_pWrite = m_szBuffer;
+		m_cbFree = dwSizeT;
+		m_dwLen = 0;
+	}
+
+	DWORD GetLength() noexcept
+	{
+		return m_dwLen;
+	}
+
+	DWORD GetChunkCount() noexcept
+	{
+		return m_nChunks;
+	}
+
+	LPCSTR GetChunkData(__in DWORD dwIndex) noexcept
+	{
+		ATLASSERT(dwIndex < m_nChunks);
+		return m_pChunks[dwIndex].pData;
+	}
+
+	DWORD GetChunkLength(__in DWORD dwIndex) noexcept
+	{
+		ATLASSERT(dwIndex < m_nChunks);
+		return m_pChunks[dwIndex].cbData;
+	}
+
+	BOOL Append(__in LPCSTR sz, __in int nLen = -1) noexcept
+	{
+		if (!sz)
+			return FALSE;
+
+		if (nLen == -1)
+			nLen = (int) strlen(sz);
+		if (nLen < 0 || m_dwLen + nLen < m_dwLen)
+			return FALSE;
+
+		DWORD cbLeft = (DWORD) nLen;
+		while (cbLeft)
+		{
+			if (!m_cbFree)
+			{
+				void *pvSegment = CAtlIsapiSegmentPool::Allocate();
+				if (!pvSegment)
+					return FALSE;
+				if (!AddChunk((LPCSTR) pvSegment, 0, pvSegment, FALSE))
+				{
+					CAtlIsapiSegmentPool::Free(pvSegment);
+					return FALSE;
+				}
+				m_pWrite = (LPSTR) pvSegment;
+				m_cbFree = ATLS_RESPONSE_SEGMENT_SIZE;
+			}
+
+			DWORD cbCopy = __min(cbLeft, m_cbFree);
+			CHUNK *pLast = m_nChunks ? &m_pChunks[m_nChunks-1] : NULL;
+			if (pLast && !pLast->bReference && pLast->pData + pLast->cbData == m_pWrite)
+				pLast->cbData += cbCopy;
+			else if (!AddChunk(m_pWrite, cbCopy, NULL, FALSE))
+				return FALSE;
+
+			Checked::memcpy_s(m_pWrite, m_cbFree, sz, cbCopy);
+			m_pWrite += cbCopy;
+			m_cbFree -= cbCopy;
+			m_dwLen += cbCopy;
+			sz += cbCopy;
+			cbLeft -= cbCopy;
+		}
+		return TRUE;
+	}
+
+	// Adds the dwLen bytes at sz without copying them. The memory must stay
+	// valid until the buffer is emptied or ResolveReferences is called.
+	BOOL AppendReference(__in_ecount(dwLen) LPCSTR sz, __in DWORD dwLen) noexcept
+	{
+		if (!sz || m_dwLen + dwLen < m_dwLen)
+			return FALSE;
+		if (!dwLen)
+			return TRUE;
+		if (!AddChunk(sz, dwLen, NULL, TRUE))
+			return FALSE;
+		m_dwLen += dwLen;
+		m_nReferences++;
+		return TRUE;
+	}
+
+	// Copies any referenced memory into the buffer.
+	BOOL ResolveReferences() noexcept
+	{
+		if (!m_nReferences)
+			return TRUE;
+		return (LPCSTR) *this != NULL;
+	}
+
+	// Returns the content as one nul-terminated block, gathering the chunks
+	// into it first if there is more than one. The gathered block is kept
+	// and returned again until something is appended. Returns NULL if that
+	// fails.
+	operator LPCSTR() noexcept
+	{
+		if (!m_nChunks)
+		{
+			m_szBuffer[0] = 0;
+			return m_szBuffer;
+		}
+		if (m_nChunks == 1 && m_pLinear && m_pChunks[0].pData == m_pLinear)
+			return m_pLinear;
+		if (m_nChunks == 1 && !m_nReferences && m_pChunks[0].pData + m_dwLen == m_pWrite && m_cbFree)
+		{
+			*m_pWrite = 0;
+			return m_pChunks[0].pData;
+		}
+
+		if (m_dwLen+1 == 0)
+			return NULL;
+		LPSTR pLinear = (LPSTR) HeapAlloc(m_hProcHeap, 0, m_dwLen+1);
+		if (!pLinear)
+			return NULL;
+
+		LPSTR pCopy = pLinear;
+		for (DWORD i = 0; i < m_nChunks; i++)
+		{
+			Checked::memcpy_s(pCopy, m_dwLen-(pCopy-pLinear), m_pChunks[i].pData, m_pChunks[i].cbData);
+			pCopy += m_pChunks[i].cbData;
+		}
+		*pCopy = 0;
+
+		DWORD dwLen = m_dwLen;
+		Empty();
+		m_pLinear = pLinear;
+		m_pChunks[0].pData = pLinear;
+		m_pChunks[0].cbData = dwLen;
+		m_pChunks[0].pvSegment = NULL;
+		m_pChunks[0].bReference = FALSE;
+		m_nChunks = 1;
+		m_dwLen = dwLen;
+
+		// anything appended later goes into a new segment
+		m_pWrite = NULL;
+		m_cbFree = 0;
+		return pLinear;
+	}
+
+protected:
+	BOOL AddChunk(__in LPCSTR pData, __in DWORD cbData, __in_opt void *pvSegment, __in BOOL bReference) noexcept
+	{
+		if (m_nChunks == m_nMaxChunks)
+		{
+			DWORD nMaxChunks = m_nMaxChunks*2;
+			if (nMaxChunks < m_nMaxChunks || nMaxChunks > ULONG_MAX/sizeof(CHUNK))
+				return FALSE;
+
+			CHUNK *pChunks = (CHUNK *) HeapAlloc(m_hProcHeap, 0, nMaxChunks*sizeof(CHUNK));
+			if (!pChunks)
+				return FALSE;
+			Checked::memcpy_s(pChunks, nMaxChunks*sizeof(CHUNK), m_pChunks, m_nChunks*sizeof(CHUNK));
+			if (m_pChunks != m_rgInlineChunks)
+				HeapFree(m_hProcHeap, 0, m_pChunks);
+			m_pChunks = pChunks;
+			m_nMaxChunks = nMaxChunks;
+		}
+
+		CHUNK& chunk = m_pChunks[m_nChunks++];
+		chunk.pData = pData;
+		chunk.cbData = cbData;
+		chunk.pvSegment = pvSegment;
+		chunk.bReference = bReference;
+		return TRUE;
+	}
+}; // class CAtlIsapiBufferChain
+
 // This class represents the response that the web server will send back to the client.
 //
 // CHttpResponse provides friendly functions for building up the headers, cookies, and body of an HTTP response.
 // The class derives from IWriteStream and CWriteStreamHelper, allowing you to call those classes' methods
-// to build up the body of the response. By default, the class improves performance by buffering the response until it is complete before sending it back to the client.
-class CHttpResponse : public IWriteStream, public CWriteStreamHelper
+// to build up the body of the response. IWriteStreamGather lets a stencil write several pieces of text in one call. By default, the class improves performance by buffering the response until it is complete before sending it back to the client.
+class CHttpResponse : public IWriteStream, public IWriteStreamGather, public CWriteStreamHelper
 {
 private:
 
@@ -6259,10 +8574,62 @@ private:
 	// when the async I/O completes
 	HANDLE m_hFile;
 
+	// Implementation: String manager used for header names and values, or NULL
+	// to use the default string manager.
+	IAtlStringMgr *m_pStringMgr;
+
+	// Implementation: Determines whether a fully buffered response is compressed
+	// when the client accepts it. See SetCompression.
+	BOOL m_bCompress;
+
+	// Implementation: Memory that stays valid until ClearStableRanges is
+	// called. See AddStableRange.
+	enum { MAX_STABLE_RANGES = 4 };
+	LPCSTR m_rgStableStart[MAX_STABLE_RANGES];
+	LPCSTR m_rgStableEnd[MAX_STABLE_RANGES];
+	int m_nStableRanges;
+
+	// Implementation: Determines whether the dwLen bytes at szOut lie in
+	// one of the stable ranges.
+	BOOL IsStable(__in_ecount(dwLen) LPCSTR szOut, __in DWORD dwLen) noexcept
+	{
+		for (int i = 0; i < m_nStableRanges; i++)
+		{
+			if (szOut >= m_rgStableStart[i] && szOut < m_rgStableEnd[i] &&
+				dwLen <= (DWORD) (m_rgStableEnd[i] - szOut))
+			{
+				return TRUE;
+			}
+		}
+		return FALSE;
+	}
+
+	// Implementation: Adds a header to m_headers, or replaces the value of an
+	// existing header if bReplace is TRUE, building the strings with m_pStringMgr.
+	// Returns the result of the add; replacing an existing value returns FALSE,
+	// which is what SetContentType, SetCacheControl and SetExpiresAbsolute
+	// have always returned in that case.
+	BOOL SetHeader(__in LPCSTR szName, __in_opt LPCSTR szValue, __in BOOL bReplace)
+	{
+		CStringA strName;
+		CStringA strValue;
+		if (m_pStringMgr != NULL)
+		{
+			strName.SetManager(m_pStringMgr);
+			strValue.SetManager(m_pStringMgr);
+		}
+		strName = szName;
+		strValue = szValue;
+
+		if (bReplace && m_headers.SetAt(strName, strValue))
+			return FALSE;
+		return m_headers.Add(strName, strValue);
+	}
+
 public:
 	// Implementation: The buffer used to store the response before
 	// the data is sent to the client.
-	CAtlIsapiBuffer<> m_strContent;
+	CAtlIsapiBufferChain<> m_strContent;
 
 	// Numeric constants for the HTTP status codes used for redirecting client requests.
 	enum HTTP_REDIRECT
@@ -6285,10 +8652,16 @@ public:
 		m_bHeadersSent = FALSE;
 		m_bSendOutput = TRUE;
 		m_hFile = INVALID_HANDLE_VALUE;
+		m_pStringMgr = NULL;
+		m_bCompress = ATLS_COMPRESS_RESPONSES;
+		m_nStableRanges = 0;
 	}
 
 	CHttpResponse(__in IHttpServerContext *pServerContext)
 	{
+		m_pStringMgr = NULL;
+		m_bCompress = ATLS_COMPRESS_RESPONSES;
+		m_nStableRanges = 0;
 		m_bBufferOutput = TRUE;
 		m_dwBufferLimit = ULONG_MAX;
 		m_nStatusCode = 200;
@@ -6321,6 +8694,16 @@ public:
 		return TRUE;
 	}
 
+	// Call this function to have header names and values stored with pStringMgr,
+	// for example the string manager of the request arena (see AtlGetRequestStringMgr).
+	// pStringMgr must stay valid until the response object is destroyed. The
+	// headers are private to the response and are only handed out as LPCSTR
+	// (see GetContentType), so no CStringA built with pStringMgr escapes it.
+	void SetStringManager(__in_opt IAtlStringMgr *pStringMgr) noexcept
+	{
+		m_pStringMgr = pStringMgr;
+	}
+
 	// This is called to initialize the CHttpResponse for a child handler.  By default, it
 	// assumes the parent will be responsible for sending the headers.
 	__checkReturn BOOL Initialize(__in IHttpRequestLookup *pLookup)
@@ -6390,6 +8773,36 @@ public:
 		return m_bHeadersSent;
 	}
 
+	// Call this function to register memory that stays valid and unchanged
+	// until ClearStableRanges is called, such as the text of a cached
+	// stencil. Large writes from that memory are then referenced by the
+	// buffer rather than copied into it. Returns FALSE if no more ranges
+	// can be registered.
+	BOOL AddStableRange(__in LPCSTR pStart, __in LPCSTR pEnd) noexcept
+	{
+		ATLASSERT(pStart <= pEnd);
+		if (m_nStableRanges == MAX_STABLE_RANGES)
+			return FALSE;
+		m_rgStableStart[m_nStableRanges] = pStart;
+		m_rgStableEnd[m_nStableRanges] = pEnd;
+		m_nStableRanges++;
+		return TRUE;
+	}
+
+	// Call this function before the memory registered with AddStableRange
+	// goes away. Any of it still referenced by the buffer is copied in.
+	// Returns FALSE, and clears the buffer, if that fails.
+	BOOL ClearStableRanges() noexcept
+	{
+		m_nStableRanges = 0;
+		if (!m_strContent.ResolveReferences())
+		{
+			m_strContent.Empty();
+			return FALSE;
+		}
+		return TRUE;
+	}
+
 	// Call this function to override the m_bHeadersSent state.  This is useful
 	// when you want child handlers (e.g. from an include or subhandler) to send the headers
 	void HaveSentHeaders(__in BOOL bSent) noexcept
@@ -6448,8 +8861,7 @@ public:
 	{
 		_ATLTRY
 		{
-			if (!m_headers.SetAt("Content-Type", szContentType))
-				return m_headers.Add("Content-Type", szContentType);
+			return SetHeader("Content-Type", szContentType, TRUE);
 		}
 		_ATLCATCHALL()
 		{
@@ -6478,8 +8890,7 @@ public:
 	{
 		_ATLTRY
 		{
-			if (!m_headers.SetAt("Cache-Control", szCacheControl))
-				return m_headers.Add("Cache-Control", szCacheControl);
+			return SetHeader("Cache-Control", szCacheControl, TRUE);
 		}
 		_ATLCATCHALL()
 		{
@@ -6496,8 +8907,7 @@ public:
 			CStringA strExpires;
 			SystemTimeToHttpDate(stExpires, strExpires);
 
-			if (!m_headers.SetAt("Expires", strExpires))
-				return m_headers.Add("Expires", strExpires);
+			return SetHeader("Expires", strExpires, TRUE);
 		}
 		_ATLCATCHALL()
 		{
@@ -6520,6 +8930,22 @@ public:
 		return SetExpiresAbsolute(st);
 	}
 
+	// Call this function to set whether the response is compressed with gzip or
+	// deflate when the client accepts them. Only fully buffered responses
+	// are compressed, when they have a status of 200, a Content-Type in
+	// ATLS_COMPRESS_CONTENT_TYPES, no Content-Encoding and a body of at least
+	// ATLS_COMPRESS_MIN_SIZE bytes. Pages that go into the page cache are
+	// left to it, as it keeps compressed copies of them.
+	void SetCompression(__in BOOL bCompress) noexcept
+	{
+		m_bCompress = bCompress;
+	}
+
+	BOOL GetCompression() noexcept
+	{
+		return m_bCompress;
+	}
+
 	// Call this function to set whether or not to output to client.
 	// Intended primarily for HEAD requests
 	BOOL SetWriteToClient(__in BOOL bSendOutput) noexcept
@@ -6571,6 +8997,44 @@ public:
 		return S_OK;
 	}
 
+	// Call this function to write several buffers to the response object,
+	// as if by one WriteStream call each. The buffer is flushed at most
+	// once up front, rather than whenever one of the writes fills it.
+	//
+	// pdwWritten   A DWORD pointer that can be used to get the number of bytes written.
+	//              This parameter can be NULL.
+	__checkReturn HRESULT WriteStreamGather(__in_ecount(nBuffers) const AtlServerSendBuffer *rgBuffers, __in DWORD nBuffers, __out_opt DWORD *pdwWritten)
+	{
+		ATLASSUME(m_spServerContext != NULL);
+
+		if (pdwWritten)
+			*pdwWritten = 0;
+		if (!rgBuffers && nBuffers)
+			return E_INVALIDARG;
+
+		DWORD cbTotal = 0;
+		for (DWORD i = 0; i < nBuffers; i++)
+		{
+			if (FAILED(AtlAdd(&cbTotal, cbTotal, rgBuffers[i].cbData)))
+				return E_INVALIDARG;
+		}
+
+		if (m_bBufferOutput && m_strContent.GetLength()+cbTotal >= m_dwBufferLimit)
+		{
+			if (!Flush())
+				return AtlHresultFromLastError();
+		}
+
+		for (DWORD i = 0; i < nBuffers; i++)
+		{
+			if (!WriteLen((LPCSTR) rgBuffers[i].pvData, rgBuffers[i].cbData))
+				return AtlHresultFromLastError();
+		}
+		if (pdwWritten)
+			*pdwWritten = cbTotal;
+		return S_OK;
+	}
+
 	// Call this function to write data to the response object.
 	//
 	// Returns TRUE on success. FALSE on failure.
@@ -6602,7 +9066,11 @@ public:
 					return FALSE;
 			}
 			if (dwLen <= m_dwBufferLimit)
+			{
+				if (dwLen >= ATLS_RESPONSE_REFERENCE_MIN && IsStable(szOut, dwLen))
+					return m_strContent.AppendReference(szOut, dwLen);
 				return m_strContent.Append(szOut, dwLen);
+			}
 		}
 		BOOL bRet = SendHeadersInternal();
 
@@ -6727,7 +9195,7 @@ public:
 		BOOL bRet = FALSE;
 		_ATLTRY
 		{
-			bRet = m_headers.Add(szName, szValue);
+			bRet = SetHeader(szName, szValue, FALSE);
 		}
 		_ATLCATCHALL()
 		{
@@ -6758,7 +9226,7 @@ public:
 		{
 			_ATLTRY
 			{
-				bRet = m_headers.Add("Set-Cookie", szCookie);
+				bRet = SetHeader("Set-Cookie", szCookie, FALSE);
 			}
 			_ATLCATCHALL()
 			{
@@ -6779,7 +9247,7 @@ public:
 				{
 					_ATLTRY
 					{
-						bRet = m_headers.Add("Set-Cookie", (const char *) sz);
+						bRet = SetHeader("Set-Cookie", (const char *) sz, FALSE);
 					}
 					_ATLCATCHALL()
 					{
@@ -6872,30 +9340,138 @@ public:
 		BOOL bRet = FALSE;
 		_ATLTRY
 		{
-			if (m_nStatusCode == 200)
+			CFixedStringT<CStringA, 256> strStatus;
+			GetStatusLine(strStatus);
+			bRet = m_spServerContext->SendResponseHeader(strHeaders, strStatus, fKeepConn);
+			if (bRet)
+			{
+				m_bHeadersSent = TRUE;
+			}
+		}
+		_ATLCATCHALL()
+		{
+			bRet = FALSE;
+		}
+		return bRet;
+	}
+
+	// Implementation: Gets the status line sent with the headers, e.g. "200 OK".
+	void GetStatusLine(__out CFixedStringT<CStringA, 256>& strStatus)
+	{
+		if (m_nStatusCode == 200)
+		{
+			strStatus = "200 OK";
+			return;
+		}
+
+		CDefaultErrorProvider prov;
+		GetStatusHeader(strStatus, m_nStatusCode, SUBERR_NONE, &prov);
+	}
+
+	// Implementation: Sends the buffered content, preceded by the headers if
+	// they haven't been sent yet, and empties the buffer. When the server
+	// context supports IHttpVectorSend, the chunks of the buffer go out in
+	// gathered writes, and a keep-alive response's headers go out with them.
+	BOOL SendBuffer(__in BOOL fKeepConn)
+	{
+		DWORD nChunks = m_strContent.GetChunkCount();
+		CComQIPtr<IHttpVectorSend> spVectorSend;
+		if (m_bSendOutput && nChunks)
+			spVectorSend = m_spServerContext;
+
+		BOOL bRet = TRUE;
+		if (!spVectorSend || !fKeepConn)
+			bRet = SendHeadersInternal(fKeepConn);
+
+		if (bRet && m_bSendOutput && nChunks)
+		{
+			CFixedStringT<CStringA, 256> strStatus;
+			CStringA strHeaders;
+			LPCSTR szStatus = NULL;
+			LPCSTR szHeaders = NULL;
+			if (!m_bHeadersSent)
+			{
+				GetStatusLine(strStatus);
+				RenderHeaders(strHeaders);
+				szStatus = strStatus;
+				szHeaders = strHeaders;
+			}
+
+			AtlServerSendBuffer rgBuffers[ATLS_MAX_SEND_BUFFERS];
+			DWORD dwChunk = 0;
+			while (bRet && dwChunk < nChunks)
 			{
-				bRet = m_spServerContext->SendResponseHeader(strHeaders, "200 OK", fKeepConn);
-				if (bRet)
+				DWORD nBuffers = 0;
+				for (; nBuffers < ATLS_MAX_SEND_BUFFERS && dwChunk < nChunks; nBuffers++, dwChunk++)
+				{
+					rgBuffers[nBuffers].pvData = m_strContent.GetChunkData(dwChunk);
+					rgBuffers[nBuffers].cbData = m_strContent.GetChunkLength(dwChunk);
+				}
+
+				if (spVectorSend)
+				{
+					bRet = spVectorSend->VectorSend(szStatus, szHeaders, fKeepConn, rgBuffers, nBuffers);
+					if (bRet && szHeaders)
+					{
+						m_bHeadersSent = TRUE;
+						szStatus = NULL;
+						szHeaders = NULL;
+					}
+				}
+				else
 				{
-					m_bHeadersSent = TRUE;
+					for (DWORD i = 0; bRet && i < nBuffers; i++)
+					{
+						DWORD dwLen = rgBuffers[i].cbData;
+						bRet = m_spServerContext->WriteClient((void *) rgBuffers[i].pvData, &dwLen);
+					}
 				}
-				return bRet;
 			}
+		}
 
-			CFixedStringT<CStringA, 256> strStatus;
-			CDefaultErrorProvider prov;
-			GetStatusHeader(strStatus, m_nStatusCode, SUBERR_NONE, &prov);
-			bRet = m_spServerContext->SendResponseHeader(strHeaders, strStatus, fKeepConn);
-			if (bRet)
-			{
-				m_bHeadersSent = TRUE;
-			}
+		m_strContent.Empty();
+		return bRet;
+	}
+
+	// Implementation: Compresses the buffered response as described in
+	// SetCompression. Called just before the headers of a fully buffered
+	// response are sent.
+	void CompressContent()
+	{
+		if (m_nStatusCode != 200 || m_strContent.GetLength() < ATLS_COMPRESS_MIN_SIZE ||
+			!AtlIsCompressibleContentType(GetContentType()) ||
+			m_headers.FindKey("Content-Encoding") >= 0)
+		{
+			return;
 		}
-		_ATLCATCHALL()
+
+		CComQIPtr<IPageCacheControl> spControl(m_spServerContext);
+		if (spControl && spControl->IsCached())
+			return;
+
+		// the response depends on Accept-Encoding whether or not it is compressed
+		int nVary = m_headers.FindKey("Vary");
+		if (nVary < 0)
+			SetHeader("Vary", "Accept-Encoding", TRUE);
+		else
+			SetHeader("Vary", m_headers.GetValueAt(nVary) + ", Accept-Encoding", TRUE);
+
+		int nEncoding = AtlGetAcceptedEncoding(m_spServerContext);
+		if (nEncoding == ATLS_ENCODING_IDENTITY)
+			return;
+
+		LPCSTR szContent = m_strContent;
+		CAtlArray<BYTE> arrCompressed;
+		if (!szContent || !AtlCompressContent(nEncoding, (const BYTE *) szContent,
+				m_strContent.GetLength(), arrCompressed))
 		{
-			bRet = FALSE;
+			return;
 		}
-		return bRet;
+
+		m_strContent.Empty();
+		if (!m_strContent.Append((LPCSTR) arrCompressed.GetData(), (int) arrCompressed.GetCount()))
+			AtlThrow(E_OUTOFMEMORY);
+		SetHeader("Content-Encoding", AtlGetEncodingName(nEncoding), TRUE);
 	}
 
 	// Call this function to get a string containing all the HTTP headers associated with
@@ -6949,8 +9525,10 @@ public:
 		_ATLTRY
 		{
 			// if the headers haven't been sent,
-			// send them now
+			// send them now. A fully buffered response
+			// sends them along with the buffer
 
+			BOOL fKeepConn = FALSE;
 			if (!m_bHeadersSent)
 			{
 				char szProtocol[ATL_URL_MAX_URL_LENGTH];
@@ -6961,28 +9539,19 @@ public:
 					if (m_spServerContext->GetServerVariable("SERVER_PROTOCOL", szProtocol, &dwProtocolLen) &&
 						!strcmp(szProtocol, "HTTP/1.0"))
 						AppendHeader("Connection", "Keep-Alive");
+					if (m_bCompress)
+						CompressContent();
 					Checked::itoa_s(m_strContent.GetLength(), szProtocol, _countof(szProtocol), 10);
 					AppendHeader("Content-Length", szProtocol);
-					bRet = SendHeadersInternal(TRUE);
+					fKeepConn = TRUE;
 				}
 				else
 					bRet = SendHeadersInternal();
 			}
 			if (m_bBufferOutput)
 			{
-				DWORD dwLen = 0;
-
-				dwLen = m_strContent.GetLength();
-				if (dwLen)
-				{
-					if (m_bSendOutput && 
-						m_spServerContext->WriteClient((void *) (LPCSTR) m_strContent, &dwLen) != TRUE)
-					{
-						m_strContent.Empty();
-						return FALSE;
-					}
-					m_strContent.Empty();
-				}
+				if (!SendBuffer(fKeepConn))
+					return FALSE;
 			}
 		} // _ATLTRY
 		_ATLCATCHALL()
@@ -7022,7 +9591,9 @@ public:
 			{
 				_ATLTRY
 				{
-					if (m_spServerContext->AsyncWriteClient((void *) (LPCSTR) m_strContent, &dwLen) != TRUE)
+					LPCSTR szContent = m_strContent;
+					if (!szContent ||
+						m_spServerContext->AsyncWriteClient((void *) szContent, &dwLen) != TRUE)
 					{
 						bRet = FALSE;
 					}
@@ -7284,6 +9855,48 @@ public:
 	}
 };
 
+// CRequestStats recomputes its latency percentile counters once every
+// this many requests.
+#ifndef ATLS_LATENCY_UPDATE_INTERVAL
+#define ATLS_LATENCY_UPDATE_INTERVAL 256
+#endif
+
+// Writes the number of values a CAtlLatencyHistogramT recorded in its
+// window, a few percentiles, and the count in each nonempty bucket after
+// its limit, one to a line.
+template <int t_nShards, int t_nIntervals, DWORD t_dwWindow>
+inline HRESULT AtlRenderLatencyHistogram(__in CAtlLatencyHistogramT<t_nShards, t_nIntervals, t_dwWindow>& histogram,
+	__in IWriteStream *pStream, __in LPCSTR szName) noexcept
+{
+	ATLASSERT(pStream);
+	ATLASSERT(szName);
+
+	typedef CAtlLatencyHistogramT<t_nShards, t_nIntervals, t_dwWindow> HISTOGRAM;
+	DWORD rgCounts[HISTOGRAM::BUCKETS];
+	ULONGLONG ullTotal = histogram.GetCounts(rgCounts);
+
+	_ATLTRY
+	{
+		CStringA strOut;
+		strOut.Format("# %s count=%I64u p50=%u p90=%u p99=%u p999=%u window_ms=%u\r\n", szName, ullTotal,
+			HISTOGRAM::GetPercentile(rgCounts, ullTotal, 500), HISTOGRAM::GetPercentile(rgCounts, ullTotal, 900),
+			HISTOGRAM::GetPercentile(rgCounts, ullTotal, 990), HISTOGRAM::GetPercentile(rgCounts, ullTotal, 999),
+			HISTOGRAM::GetWindow());
+
+		for (DWORD dwBucket = 0; dwBucket < HISTOGRAM::BUCKETS; dwBucket++)
+		{
+			if (rgCounts[dwBucket])
+				strOut.AppendFormat("%u %u\r\n", HISTOGRAM::GetBucketLimit(dwBucket), rgCounts[dwBucket]);
+		}
+
+		return pStream->WriteStream(strOut, strOut.GetLength(), NULL);
+	}
+	_ATLCATCHALL()
+	{
+		return E_OUTOFMEMORY;
+	}
+}
+
 struct CRequestStats
 {
 	long m_lTotalRequests;
@@ -7293,6 +9906,20 @@ struct CRequestStats
 	long m_lCurrWaiting;
 	long m_lMaxWaiting;
 	long m_lActiveThreads;
+	long m_lStolenRequests;
+	long m_lMaxQueueDepth;
+
+	// Latency percentiles in microseconds, updated every
+	// ATLS_LATENCY_UPDATE_INTERVAL requests from the histograms
+	long m_lQueueWaitP50;
+	long m_lQueueWaitP99;
+	long m_lQueueWaitP999;
+	long m_lServiceTimeP50;
+	long m_lServiceTimeP99;
+	long m_lServiceTimeP999;
+
+	CAtlLatencyHistogram m_QueueWait;
+	CAtlLatencyHistogram m_ServiceTime;
 
 	CRequestStats() noexcept
 	{
@@ -7303,13 +9930,32 @@ struct CRequestStats
 		m_lCurrWaiting = 0;
 		m_lMaxWaiting = 0;
 		m_lActiveThreads = 0;
+		m_lStolenRequests = 0;
+		m_lMaxQueueDepth = 0;
+		m_lQueueWaitP50 = 0;
+		m_lQueueWaitP99 = 0;
+		m_lQueueWaitP999 = 0;
+		m_lServiceTimeP50 = 0;
+		m_lServiceTimeP99 = 0;
+		m_lServiceTimeP999 = 0;
 	}
 
 	void RequestHandled(__in AtlServerRequest *pRequestInfo, __in BOOL bSuccess)
 	{
 		ATLENSURE(pRequestInfo);
 
-		InterlockedIncrement(&m_lTotalRequests);
+		if (pRequestInfo->cbSize >= sizeof(AtlServerRequest) && pRequestInfo->ullStartTime)
+		{
+			ULONGLONG ullElapsed = AtlGetMicroseconds() - pRequestInfo->ullStartTime;
+			ULONGLONG ullService = 0;
+			if (ullElapsed > pRequestInfo->dwTotalQueueWait)
+				ullService = ullElapsed - pRequestInfo->dwTotalQueueWait;
+			m_ServiceTime.Record(ullService > ULONG_MAX ? ULONG_MAX : (DWORD) ullService);
+		}
+
+		long lTotalRequests = InterlockedIncrement(&m_lTotalRequests);
+		if (lTotalRequests % ATLS_LATENCY_UPDATE_INTERVAL == 0)
+			UpdateLatencyPercentiles();
 		if (!bSuccess)
 			InterlockedIncrement(&m_lFailedRequests);
 
@@ -7369,7 +10015,79 @@ struct CRequestStats
 		return m_lActiveThreads;
 	}
 
+	// Called when a request starts running, with the queue information the
+	// thread pool recorded in it (see CWorkStealingThreadPool).
+	void OnRequestScheduled(__in AtlServerRequest *pRequestInfo) noexcept
+	{
+		ATLASSERT(pRequestInfo);
+		if (pRequestInfo == NULL || pRequestInfo->cbSize < sizeof(AtlServerRequest))
+			return;
+
+		DWORD dwQueueInfo = pRequestInfo->dwQueueInfo;
+		if (dwQueueInfo & ATLSRV_QUEUE_STOLEN)
+			InterlockedIncrement(&m_lStolenRequests);
+		AtlInterlockedUpdateMax((long) (dwQueueInfo & ATLSRV_QUEUE_DEPTH_MASK), &m_lMaxQueueDepth);
+
+		m_QueueWait.Record(pRequestInfo->dwQueueWait);
+	}
+
+	// Returns the latency in microseconds that dwPerMille thousandths of
+	// the requests didn't exceed. dwLatency is ATLS_LATENCY_QUEUE_WAIT or
+	// ATLS_LATENCY_SERVICE_TIME.
+	long GetLatencyPercentile(__in DWORD dwLatency, __in DWORD dwPerMille) noexcept
+	{
+		if (dwPerMille > 1000)
+			return 0;
+
+		CAtlLatencyHistogram& histogram = (dwLatency == ATLS_LATENCY_QUEUE_WAIT) ? m_QueueWait : m_ServiceTime;
+		DWORD rgCounts[CAtlLatencyHistogram::BUCKETS];
+		ULONGLONG ullTotal = histogram.GetCounts(rgCounts);
+		return ClampLatency(CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, dwPerMille));
+	}
+
+	// Writes both latency histograms to pStream as text.
+	HRESULT RenderLatencyStats(__in IWriteStream *pStream) noexcept
+	{
+		if (!pStream)
+			return E_POINTER;
+
+		HRESULT hr = AtlRenderLatencyHistogram(m_QueueWait, pStream, "queue_wait_us");
+		if (SUCCEEDED(hr))
+			hr = AtlRenderLatencyHistogram(m_ServiceTime, pStream, "service_time_us");
+		return hr;
+	}
+
+	long GetStolenRequests() noexcept
+	{
+		return m_lStolenRequests;
+	}
+
+	long GetMaxQueueDepth() noexcept
+	{
+		return m_lMaxQueueDepth;
+	}
+
 private:
+	void UpdateLatencyPercentiles() noexcept
+	{
+		DWORD rgCounts[CAtlLatencyHistogram::BUCKETS];
+
+		ULONGLONG ullTotal = m_QueueWait.GetCounts(rgCounts);
+		InterlockedExchange(&m_lQueueWaitP50, ClampLatency(CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, 500)));
+		InterlockedExchange(&m_lQueueWaitP99, ClampLatency(CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, 990)));
+		InterlockedExchange(&m_lQueueWaitP999, ClampLatency(CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, 999)));
+
+		ullTotal = m_ServiceTime.GetCounts(rgCounts);
+		InterlockedExchange(&m_lServiceTimeP50, ClampLatency(CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, 500)));
+		InterlockedExchange(&m_lServiceTimeP99, ClampLatency(CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, 990)));
+		InterlockedExchange(&m_lServiceTimeP999, ClampLatency(CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, 999)));
+	}
+
+	static long ClampLatency(__in DWORD dwMicroseconds) noexcept
+	{
+		return (long) __min(dwMicroseconds, (DWORD) LONG_MAX);
+	}
+
 	// not actually atomic, but it will add safely.
 
 	// the returned value is not 100% guaranteed to be
@@ -7443,6 +10161,14 @@ struct CPerfRequestStatObject : public CPerfObject,
 		DEFINE_COUNTER(m_lCurrWaiting, IDS_PERFMON_REQUEST_CURR_WAITING, IDS_PERFMON_REQUEST_CURR_WAITING_HELP, PERF_COUNTER_RAWCOUNT, -1)
 		DEFINE_COUNTER(m_lMaxWaiting, IDS_PERFMON_REQUEST_MAX_WAITING, IDS_PERFMON_REQUEST_MAX_WAITING_HELP, PERF_COUNTER_RAWCOUNT, -1)
 		DEFINE_COUNTER(m_lActiveThreads, IDS_PERFMON_REQUEST_ACTIVE_THREADS, IDS_PERFMON_REQUEST_ACTIVE_THREADS, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_lStolenRequests, IDS_PERFMON_REQUEST_STOLEN, IDS_PERFMON_REQUEST_STOLEN_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_lMaxQueueDepth, IDS_PERFMON_REQUEST_MAX_QUEUE_DEPTH, IDS_PERFMON_REQUEST_MAX_QUEUE_DEPTH_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_lQueueWaitP50, IDS_PERFMON_REQUEST_QUEUE_WAIT_P50, IDS_PERFMON_REQUEST_QUEUE_WAIT_P50_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_lQueueWaitP99, IDS_PERFMON_REQUEST_QUEUE_WAIT_P99, IDS_PERFMON_REQUEST_QUEUE_WAIT_P99_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_lQueueWaitP999, IDS_PERFMON_REQUEST_QUEUE_WAIT_P999, IDS_PERFMON_REQUEST_QUEUE_WAIT_P999_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_lServiceTimeP50, IDS_PERFMON_REQUEST_SERVICE_TIME_P50, IDS_PERFMON_REQUEST_SERVICE_TIME_P50_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_lServiceTimeP99, IDS_PERFMON_REQUEST_SERVICE_TIME_P99, IDS_PERFMON_REQUEST_SERVICE_TIME_P99_HELP, PERF_COUNTER_RAWCOUNT, -1)
+		DEFINE_COUNTER(m_lServiceTimeP999, IDS_PERFMON_REQUEST_SERVICE_TIME_P999, IDS_PERFMON_REQUEST_SERVICE_TIME_P999_HELP, PERF_COUNTER_RAWCOUNT, -1)
 	END_COUNTER_MAP()
 };
 
@@ -7593,6 +10319,46 @@ public:
 
 		return 0;
 	}
+
+	void OnRequestScheduled(__in AtlServerRequest *pRequestInfo) noexcept
+	{
+		if (m_pPerfObjectInstance != NULL)
+			m_pPerfObjectInstance->OnRequestScheduled(pRequestInfo);
+		if (m_pPerfObjectTotal != NULL)
+			m_pPerfObjectTotal->OnRequestScheduled(pRequestInfo);
+	}
+
+	long GetStolenRequests() noexcept
+	{
+		if (m_pPerfObjectInstance != NULL)
+			return m_pPerfObjectInstance->GetStolenRequests();
+
+		return 0;
+	}
+
+	long GetMaxQueueDepth() noexcept
+	{
+		if (m_pPerfObjectInstance != NULL)
+			return m_pPerfObjectInstance->GetMaxQueueDepth();
+
+		return 0;
+	}
+
+	long GetLatencyPercentile(__in DWORD dwLatency, __in DWORD dwPerMille) noexcept
+	{
+		if (m_pPerfObjectInstance != NULL)
+			return m_pPerfObjectInstance->GetLatencyPercentile(dwLatency, dwPerMille);
+
+		return 0;
+	}
+
+	HRESULT RenderLatencyStats(__in IWriteStream *pStream) noexcept
+	{
+		if (m_pPerfObjectInstance != NULL)
+			return m_pPerfObjectInstance->RenderLatencyStats(pStream);
+
+		return S_OK;
+	}
 };
 
 class CNoRequestStats
@@ -7647,11 +10413,352 @@ public:
 		return 0;
 	}
 
-	long GetActiveThreads() noexcept
-	{
-		return 0;
+	long GetActiveThreads() noexcept
+	{
+		return 0;
+	}
+
+	void OnRequestScheduled(AtlServerRequest * /*pRequestInfo*/) noexcept
+	{
+	}
+
+	long GetStolenRequests() noexcept
+	{
+		return 0;
+	}
+
+	long GetMaxQueueDepth() noexcept
+	{
+		return 0;
+	}
+
+	long GetLatencyPercentile(DWORD /*dwLatency*/, DWORD /*dwPerMille*/) noexcept
+	{
+		return 0;
+	}
+
+	HRESULT RenderLatencyStats(IWriteStream * /*pStream*/) noexcept
+	{
+		return S_OK;
+	}
+};
+
+// Number of shards CRequestBreakdownStats splits its entries into.
+#ifndef ATLS_BREAKDOWN_SHARDS
+#define ATLS_BREAKDOWN_SHARDS 8
+#endif
+
+// Most entries a CRequestBreakdownStats shard holds. Requests for handlers
+// beyond these are counted together under the handler name "*", since
+// the name of a .dll request's handler comes from the query string.
+#ifndef ATLS_BREAKDOWN_MAX_ENTRIES
+#define ATLS_BREAKDOWN_MAX_ENTRIES 64
+#endif
+
+//
+// CRequestBreakdownStats
+// Counts requests, failures, bytes sent and service time for each request
+// type and handler. Entries are kept in ATLS_BREAKDOWN_SHARDS shards picked
+// by thread id, each with its own lock, so threads finishing requests at
+// the same time seldom wait for each other. Render merges the shards.
+// Entries are keyed by module handle, so the dll cache drops a dll's
+// entries through RemoveModule as it unloads the dll; a dll loaded at the
+// same address later gets entries of its own.
+class CRequestBreakdownStats
+{
+protected:
+	struct CEntry
+	{
+		ATLSRV_REQUESTTYPE dwRequestType;
+		HINSTANCE hInstDll;
+		DWORD dwHash;
+		CHAR szHandlerName[ATL_MAX_HANDLER_NAME_LEN+1];
+		CHAR szModule[MAX_PATH];
+		ULONGLONG ullRequests;
+		ULONGLONG ullFailures;
+		ULONGLONG cbWritten;
+		CAtlLatencyHistogramT<1> ServiceTime;
+	};
+
+	struct CShard
+	{
+		CComCriticalSection m_cs;
+		CAtlArray<CEntry *> m_arrEntries;
+	};
+
+	CShard m_rgShards[ATLS_BREAKDOWN_SHARDS];
+	BOOL m_bInitialized;
+
+	static DWORD HashName(__in LPCSTR szName) noexcept
+	{
+		// FNV-1a
+		DWORD dwHash = 2166136261;
+		while (*szName)
+			dwHash = (dwHash ^ (BYTE) *szName++) * 16777619;
+		return dwHash;
+	}
+
+	// Returns the shard's entry for the key, adding it if there is none.
+	// Called with the shard locked.
+	static CEntry *LookupEntry(__inout CShard& shard, __in ATLSRV_REQUESTTYPE dwRequestType,
+		__in HINSTANCE hInstDll, __in LPCSTR szHandlerName) noexcept
+	{
+		DWORD dwHash = HashName(szHandlerName);
+		size_t nCount = shard.m_arrEntries.GetCount();
+		for (size_t i = 0; i < nCount; i++)
+		{
+			CEntry *pEntry = shard.m_arrEntries[i];
+			if (pEntry->dwHash == dwHash && pEntry->dwRequestType == dwRequestType &&
+				pEntry->hInstDll == hInstDll && !strcmp(pEntry->szHandlerName, szHandlerName))
+			{
+				return pEntry;
+			}
+		}
+
+		if (nCount >= ATLS_BREAKDOWN_MAX_ENTRIES && hInstDll != NULL)
+			return LookupEntry(shard, dwRequestType, NULL, "*");
+
+		CEntry *pEntry = NULL;
+		ATLTRY(pEntry = new CEntry);
+		if (pEntry == NULL)
+			return NULL;
+
+		pEntry->dwRequestType = dwRequestType;
+		pEntry->hInstDll = hInstDll;
+		pEntry->dwHash = dwHash;
+		Checked::strncpy_s(pEntry->szHandlerName, _countof(pEntry->szHandlerName), szHandlerName, _TRUNCATE);
+		*pEntry->szModule = '\0';
+		// the name is looked up now, while the request holds the dll loaded
+		if (hInstDll && !GetModuleFileNameA(hInstDll, pEntry->szModule, _countof(pEntry->szModule)))
+			*pEntry->szModule = '\0';
+		pEntry->szModule[_countof(pEntry->szModule)-1] = '\0';
+		pEntry->ullRequests = 0;
+		pEntry->ullFailures = 0;
+		pEntry->cbWritten = 0;
+
+		_ATLTRY
+		{
+			shard.m_arrEntries.Add(pEntry);
+		}
+		_ATLCATCHALL()
+		{
+			delete pEntry;
+			return NULL;
+		}
+		return pEntry;
+	}
+
+	static LPCSTR GetRequestTypeName(__in ATLSRV_REQUESTTYPE dwRequestType) noexcept
+	{
+		switch (dwRequestType)
+		{
+		case ATLSRV_REQUEST_STENCIL:
+			return "stencil";
+		case ATLSRV_REQUEST_DLL:
+			return "dll";
+		case ATLSRV_REQUEST_CACHE:
+			return "cache";
+		default:
+			return "unknown";
+		}
+	}
+
+public:
+	CRequestBreakdownStats() noexcept :
+		m_bInitialized(FALSE)
+	{
+	}
+
+	~CRequestBreakdownStats() noexcept
+	{
+		Uninitialize();
+	}
+
+	HRESULT Initialize() noexcept
+	{
+		for (int i = 0; i < ATLS_BREAKDOWN_SHARDS; i++)
+		{
+			HRESULT hr = m_rgShards[i].m_cs.Init();
+			if (FAILED(hr))
+			{
+				while (i--)
+					m_rgShards[i].m_cs.Term();
+				return hr;
+			}
+		}
+		m_bInitialized = TRUE;
+		return S_OK;
+	}
+
+	void Uninitialize() noexcept
+	{
+		if (!m_bInitialized)
+			return;
+
+		for (int i = 0; i < ATLS_BREAKDOWN_SHARDS; i++)
+		{
+			CShard& shard = m_rgShards[i];
+			for (size_t j = 0; j < shard.m_arrEntries.GetCount(); j++)
+				delete shard.m_arrEntries[j];
+			shard.m_arrEntries.RemoveAll();
+			shard.m_cs.Term();
+		}
+		m_bInitialized = FALSE;
+	}
+
+	void RequestHandled(__in AtlServerRequest *pRequestInfo, __in BOOL bSuccess) noexcept
+	{
+		ATLASSERT(pRequestInfo);
+		if (!m_bInitialized || pRequestInfo->cbSize < sizeof(AtlServerRequest))
+			return;
+
+		DWORD dwService = 0;
+		if (pRequestInfo->ullStartTime)
+		{
+			ULONGLONG ullElapsed = AtlGetMicroseconds() - pRequestInfo->ullStartTime;
+			ULONGLONG ullService = 0;
+			if (ullElapsed > pRequestInfo->dwTotalQueueWait)
+				ullService = ullElapsed - pRequestInfo->dwTotalQueueWait;
+			dwService = ullService > ULONG_MAX ? ULONG_MAX : (DWORD) ullService;
+		}
+
+		ULONGLONG cbWritten = 0;
+		if (pRequestInfo->pClientContext)
+			cbWritten = pRequestInfo->pClientContext->GetBytesWritten();
+
+		// cached responses are counted together, whatever rendered them
+		ATLSRV_REQUESTTYPE dwRequestType = pRequestInfo->dwRequestType;
+		HINSTANCE hInstDll = NULL;
+		LPCSTR szHandlerName = "";
+		if (dwRequestType == ATLSRV_REQUEST_STENCIL || dwRequestType == ATLSRV_REQUEST_DLL)
+		{
+			hInstDll = pRequestInfo->hInstDll;
+			szHandlerName = pRequestInfo->szHandlerName;
+		}
+
+		CShard& shard = m_rgShards[GetCurrentThreadId() % ATLS_BREAKDOWN_SHARDS];
+		CComCritSecLock<CComCriticalSection> lock(shard.m_cs, false);
+		if (FAILED(lock.Lock()))
+			return;
+
+		CEntry *pEntry = LookupEntry(shard, dwRequestType, hInstDll, szHandlerName);
+		if (pEntry == NULL)
+			return;
+
+		pEntry->ullRequests++;
+		if (!bSuccess)
+			pEntry->ullFailures++;
+		pEntry->cbWritten += cbWritten;
+		pEntry->ServiceTime.Record(dwService);
+	}
+
+	// Drops the entries of hInstDll, which is being unloaded
+	void RemoveModule(__in HINSTANCE hInstDll) noexcept
+	{
+		if (!m_bInitialized || hInstDll == NULL)
+			return;
+
+		for (int i = 0; i < ATLS_BREAKDOWN_SHARDS; i++)
+		{
+			CShard& shard = m_rgShards[i];
+			CComCritSecLock<CComCriticalSection> lock(shard.m_cs, false);
+			if (FAILED(lock.Lock()))
+				continue;
+
+			for (size_t j = shard.m_arrEntries.GetCount(); j-- > 0; )
+			{
+				CEntry *pEntry = shard.m_arrEntries[j];
+				if (pEntry->hInstDll == hInstDll)
+				{
+					shard.m_arrEntries.RemoveAt(j);
+					delete pEntry;
+				}
+			}
+		}
+	}
+
+	// Writes a line for each request type and handler to pStream:
+	// "<type> <dll>/<handler> requests= failures= bytes= p50= p99= p999=",
+	// or "<type> - ..." for cached and unknown requests,
+	// with the service time percentiles in microseconds over the last
+	// ATLS_LATENCY_WINDOW milliseconds.
+	HRESULT Render(__in IWriteStream *pStream) noexcept
+	{
+		ATLASSERT(pStream);
+		if (!m_bInitialized)
+			return S_OK;
+
+		_ATLTRY
+		{
+			// merge the shards' entries for each key into the first one seen
+			CAtlArray<CEntry> arrMerged;
+			for (int i = 0; i < ATLS_BREAKDOWN_SHARDS; i++)
+			{
+				CShard& shard = m_rgShards[i];
+				CComCritSecLock<CComCriticalSection> lock(shard.m_cs, false);
+				if (FAILED(lock.Lock()))
+					return E_FAIL;
+
+				for (size_t j = 0; j < shard.m_arrEntries.GetCount(); j++)
+				{
+					const CEntry *pEntry = shard.m_arrEntries[j];
+					size_t k;
+					for (k = 0; k < arrMerged.GetCount(); k++)
+					{
+						CEntry& merged = arrMerged[k];
+						if (merged.dwHash == pEntry->dwHash && merged.dwRequestType == pEntry->dwRequestType &&
+							merged.hInstDll == pEntry->hInstDll && !strcmp(merged.szHandlerName, pEntry->szHandlerName))
+						{
+							merged.ullRequests += pEntry->ullRequests;
+							merged.ullFailures += pEntry->ullFailures;
+							merged.cbWritten += pEntry->cbWritten;
+							merged.ServiceTime.Add(pEntry->ServiceTime);
+							break;
+						}
+					}
+					if (k == arrMerged.GetCount())
+						arrMerged.Add(*pEntry);
+				}
+			}
+
+			CStringA strOut;
+			strOut = "# breakdown\r\n";
+			for (size_t i = 0; i < arrMerged.GetCount(); i++)
+			{
+				CEntry& entry = arrMerged[i];
+				DWORD rgCounts[CAtlLatencyHistogram::BUCKETS];
+				ULONGLONG ullTotal = entry.ServiceTime.GetCounts(rgCounts);
+
+				// requests without a handler are shown as "-"
+				LPCSTR szModule = "";
+				if (entry.hInstDll)
+				{
+					szModule = entry.szModule;
+					LPCSTR szSlash = strrchr(szModule, '\\');
+					if (szSlash)
+						szModule = szSlash + 1;
+					if (!*szModule)
+						szModule = "?";
+				}
+
+				strOut.AppendFormat("%s %s%s%s requests=%I64u failures=%I64u bytes=%I64u p50=%u p99=%u p999=%u\r\n",
+					GetRequestTypeName(entry.dwRequestType), szModule,
+					(*szModule && *entry.szHandlerName) ? "/" : "",
+					(*szModule || *entry.szHandlerName) ? entry.szHandlerName : "-",
+					entry.ullRequests, entry.ullFailures, entry.cbWritten,
+					CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, 500),
+					CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, 990),
+					CAtlLatencyHistogram::GetPercentile(rgCounts, ullTotal, 999));
+			}
+
+			return pStream->WriteStream(strOut, strOut.GetLength(), NULL);
+		}
+		_ATLCATCHALL()
+		{
+			return E_OUTOFMEMORY;
+		}
 	}
-};
+}; // class CRequestBreakdownStats
 
 struct ATLServerDllInfo
 {
@@ -7681,6 +10788,14 @@ public:
 		}
 	};
 
+	// told as dlls are unloaded, if set
+	CRequestBreakdownStats *m_pRequestBreakdown;
+
+	CDllCachePeer() noexcept :
+		m_pRequestBreakdown(NULL)
+	{
+	}
+
 	BOOL Add(__in HINSTANCE hInst, __out DllInfo *pInfo)
 	{
 		ATLENSURE(pInfo!=NULL);
@@ -7701,11 +10816,13 @@ public:
 		return TRUE;
 	}
 
-	void Remove(HINSTANCE /*hInst*/, __in DllInfo *pInfo)
+	void Remove(__in HINSTANCE hInst, __in DllInfo *pInfo)
 	{
 		ATLENSURE(pInfo!=NULL);
 		if (pInfo->pfnUninitHandlers)
 			(*pInfo->pfnUninitHandlers)();
+		if (m_pRequestBreakdown)
+			m_pRequestBreakdown->RemoveModule(hInst);
 	}
 
 };
@@ -7828,6 +10945,21 @@ class _CComObjectHeapNoLock : public Base
 
 
 
+// _AtlRequestBlock
+// Layout of the fixed size blocks that CIsapiExtension carves out of its
+// request heap. Requests and server contexts are allocated from the same
+// heap with the same block size to avoid fragmentation. A request block
+// holds the AtlServerRequest, its CAtlRequestArena and the arena's initial
+// space, which gets whatever is left of the block (at least
+// ATLS_REQUEST_ARENA_SIZE bytes).
+struct _AtlRequestBlock
+{
+	static const size_t c_nArenaOffset = (sizeof(AtlServerRequest) + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(MEMORY_ALLOCATION_ALIGNMENT - 1);
+	static const size_t c_nArenaSpaceOffset = (c_nArenaOffset + sizeof(CAtlRequestArena) + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(MEMORY_ALLOCATION_ALIGNMENT - 1);
+	static const size_t c_nSize = __max(c_nArenaSpaceOffset + ATLS_REQUEST_ARENA_SIZE, sizeof(_CComObjectHeapNoLock<CServerContext>));
+	static const size_t c_nArenaSpace = c_nSize - c_nArenaSpaceOffset;
+}; // _AtlRequestBlock
+
 template <class Base>
 HRESULT WINAPI _CComObjectHeapNoLock<Base>::CreateInstance(__deref_out _CComObjectHeapNoLock<Base>** pp, __in HANDLE hHeap) noexcept
 {
@@ -7838,8 +10970,7 @@ HRESULT WINAPI _CComObjectHeapNoLock<Base>::CreateInstance(__deref_out _CComObje
 
 	HRESULT hRes = E_OUTOFMEMORY;
 	// Allocate a fixed block size to avoid fragmentation
-	void *pv = HeapAlloc(hHeap, HEAP_ZERO_MEMORY,
-		__max(sizeof(AtlServerRequest), sizeof(_CComObjectHeapNoLock<CServerContext>)));
+	void *pv = HeapAlloc(hHeap, HEAP_ZERO_MEMORY, _AtlRequestBlock::c_nSize);
 	if (pv == NULL)
 	{
 		return hRes;
@@ -8803,6 +11934,9 @@ void __cdecl AtlsSecErrHandlerFunc(int /* nCode */, void * /* pv */)
 //		a different worker thread class. Request processing code can
 //		access a pointer to the worker thread class, which allows the
 //		request handling code to easily access per-thread data.
+//		CWorkStealingThreadPool is an alternative that gives each worker
+//		its own queue and runs async continuations on the worker that
+//		started the request.
 // CRequestStatClass:	Specifies the class to be used to track request statistics
 //		CNoRequestStats is the default which is a noop class.
 //		You would change this parameter to provide a class that will
@@ -8828,7 +11962,7 @@ template <  class ThreadPoolClass=CThreadPool<CIsapiWorker>,
 			class CPageCacheStats=CNoStatClass,
 			class CStencilCacheStats=CNoStatClass>
 class CIsapiExtension :
-	public IServiceProvider, public IIsapiExtension, public IRequestStats
+	public IServiceProvider, public IIsapiExtension, public IRequestStats, public IRequestLatencyStats
 {
 private:
 
@@ -8848,11 +11982,22 @@ protected:
 
 	CDllCache<extWorkerType, CDllCachePeer> m_DllCache;
 	CFileCache<extWorkerType, CPageCacheStats, CPageCachePeer> m_PageCache;
+	CBlobCache<extWorkerType, CPageCacheStats, CComCriticalSection, CLRUFlusher> m_PageMemoryCache;
+	CPageCacheBlobClient m_PageBlobClient;
+#ifdef ATLS_SHARDED_STENCIL_CACHE
+	// stencil lookups from different worker threads lock separate segments
+	CComObjectGlobal<CShardedStencilCache<extWorkerType, CStencilCacheStats > > m_StencilCache;
+#else
 	CComObjectGlobal<CStencilCache<extWorkerType, CStencilCacheStats > > m_StencilCache;
+#endif // ATLS_SHARDED_STENCIL_CACHE
 	HttpUserErrorTextProvider m_UserErrorProvider;
 	HANDLE m_hRequestHeap;
 	CComCriticalSection m_critSec;
 
+	// cacheable pages being rendered, by page cache key; guarded by m_critSec
+	CAtlMap<CStringA, CPageCacheFill*, CStringElementTraits<CStringA> > m_PageFills;
+	volatile LONG m_lPageFills;		// lets cache misses skip m_critSec while m_PageFills is empty
+
 	// Dynamic services stuff
 	struct ServiceNode
 	{
@@ -8887,15 +12032,23 @@ public:
 	CWin32Heap m_heap;
 
 	CRequestStatClass m_reqStats;
+	CRequestBreakdownStats m_reqBreakdown;
 
 	AtlServerRequest *CreateRequest()
 	{
-		// Allocate a fixed block size to avoid fragmentation
-		AtlServerRequest *pRequest = (AtlServerRequest *) HeapAlloc(m_hRequestHeap, 
-				HEAP_ZERO_MEMORY, __max(sizeof(AtlServerRequest), sizeof(_CComObjectHeapNoLock<CServerContext>)));
-		if (!pRequest)
+		// Allocate a fixed block size to avoid fragmentation. The block
+		// holds the request, its arena and the arena's initial space, so
+		// a small request makes no further calls into the heap. See
+		// _AtlRequestBlock.
+		BYTE *pBlock = (BYTE *) HeapAlloc(m_hRequestHeap, 
+				HEAP_ZERO_MEMORY, _AtlRequestBlock::c_nSize);
+		if (!pBlock)
 			return NULL;
+
+		AtlServerRequest *pRequest = (AtlServerRequest *) pBlock;
 		pRequest->cbSize = sizeof(AtlServerRequest);
+		pRequest->pArena = _AtlConstructRequestArena(pBlock + _AtlRequestBlock::c_nArenaOffset, m_hRequestHeap,
+				pBlock + _AtlRequestBlock::c_nArenaSpaceOffset, _AtlRequestBlock::c_nArenaSpace);
 
 		return pRequest;
 	}
@@ -8903,12 +12056,18 @@ public:
 	void FreeRequest(__inout AtlServerRequest *pRequest)
 	{
 		_ReleaseAtlServerRequest(pRequest);
+
+		// the handler and server context have been released, so nothing
+		// is left that can refer to the arena
+		if (pRequest->pArena)
+			pRequest->pArena->~CAtlRequestArena();
 		HeapFree(m_hRequestHeap, 0, pRequest);
 	}
 
 	CIsapiExtension() noexcept
 	{
 		m_hRequestHeap = NULL;
+		m_lPageFills = 0;
 #ifdef _DEBUG
 		m_bDebug = FALSE;
 #endif
@@ -9049,6 +12208,7 @@ public:
 			pServerContext->AddRef();
 
 			pRequestInfo->pServerContext = pServerContext;
+			pRequestInfo->pClientContext = pServerContext;
 			pRequestInfo->dwRequestType = ATLSRV_REQUEST_UNKNOWN;
 			pRequestInfo->dwRequestState = ATLSRV_STATE_BEGIN;
 			pRequestInfo->pExtension = static_cast<IIsapiExtension *>(this);
@@ -9058,10 +12218,12 @@ public:
 #else
 			pRequestInfo->dwStartTicks = GetTickCount();
 #endif
+			pRequestInfo->ullStartTime = AtlGetMicroseconds();
 			pRequestInfo->pECB = lpECB;
 
 			m_reqStats.OnRequestReceived();
 
+			AtlOnRequestQueued(pRequestInfo);
 			if (m_ThreadPool.QueueRequest(pRequestInfo))
 				return HSE_STATUS_PENDING;
 
@@ -9083,6 +12245,7 @@ public:
 
 	BOOL QueueRequest(__in AtlServerRequest * pRequestInfo)
 	{
+		AtlOnRequestQueued(pRequestInfo);
 		return m_ThreadPool.QueueRequest(pRequestInfo);
 	}
 
@@ -9104,6 +12267,11 @@ public:
 	virtual DWORD GetDllCacheTimeout() noexcept { return ATL_DLL_CACHE_TIMEOUT; }
 	virtual DWORD GetStencilCacheTimeout() noexcept { return ATL_STENCIL_CACHE_TIMEOUT; }
 	virtual LONGLONG GetStencilLifespan() noexcept { return ATL_STENCIL_LIFESPAN; }
+	virtual DWORD GetPageCacheMaxResident() noexcept { return ATLS_PAGE_CACHE_MAX_RESIDENT; }
+	virtual ULONGLONG GetPageCacheMemorySize() noexcept { return ATLS_PAGE_CACHE_MEMORY_SIZE; }
+	virtual DWORD GetPageCacheStaleTime() noexcept { return ATLS_PAGE_CACHE_STALE_TIME; }
+	virtual BOOL GetPageCacheCompress() noexcept { return ATLS_PAGE_CACHE_COMPRESS; }
+	virtual BOOL GetRequestBreakdown() noexcept { return ATLS_REQUEST_BREAKDOWN; }
 
 	BOOL OnThreadAttach()
 	{
@@ -9236,6 +12404,12 @@ public:
 					 _T("Check request statistics perfmon dll registration\n") );
 		}
 
+		if (GetRequestBreakdown() && S_OK != m_reqBreakdown.Initialize())
+		{
+			ATLTRACE(atlTraceISAPI, 0, _T("Initialization failed for the request statistics breakdown.\n"));
+		}
+		m_DllCache.m_Peer.m_pRequestBreakdown = &m_reqBreakdown;
+
 		if (S_OK != m_WorkerThread.Initialize())
 		{
 			return SetCriticalIsapiError(IDS_ATLSRV_CRITICAL_WORKERINITFAILED);
@@ -9275,6 +12449,19 @@ public:
 			return SetCriticalIsapiError(IDS_ATLSRV_CRITICAL_PAGECACHEFAILED);
 		}
 
+		if (FAILED(m_PageMemoryCache.Initialize(NULL, &m_WorkerThread)) ||
+			FAILED(m_PageMemoryCache.SetMaxAllowedSize64(GetPageCacheMemorySize())))
+		{
+			HRESULT hrIgnore=m_WorkerThread.Shutdown();
+			(hrIgnore);
+			m_ThreadPool.Shutdown();
+			m_DllCache.Uninitialize();
+			m_PageCache.Uninitialize();
+			m_PageMemoryCache.Uninitialize();
+			m_critSec.Term();
+			return SetCriticalIsapiError(IDS_ATLSRV_CRITICAL_PAGECACHEFAILED);
+		}
+
 		if (S_OK != m_StencilCache.Initialize(static_cast<IServiceProvider*>(this),
 										  &m_WorkerThread, 
 										  GetStencilCacheTimeout(),
@@ -9285,6 +12472,7 @@ public:
 			m_ThreadPool.Shutdown();
 			m_DllCache.Uninitialize();
 			m_PageCache.Uninitialize();
+			m_PageMemoryCache.Uninitialize();
 			m_critSec.Term();
 			return SetCriticalIsapiError(IDS_ATLSRV_CRITICAL_STENCILCACHEFAILED);
 		}
@@ -9314,8 +12502,11 @@ public:
 		m_StencilCache.Uninitialize();
 		m_DllCache.Uninitialize();
 		m_PageCache.Uninitialize();
+		m_PageMemoryCache.Uninitialize();
+		CAtlIsapiSegmentPool::Trim();
 		HRESULT hrShutdown=m_WorkerThread.Shutdown();
 		m_reqStats.Uninitialize();
+		m_reqBreakdown.Uninitialize();
 		m_critSec.Term();
 
 		// free the request heap
@@ -9335,26 +12526,27 @@ public:
 	{
 		AtlServerRequest *pRequestInfo = reinterpret_cast<AtlServerRequest*>(pContext);
 		ATLENSURE(pRequestInfo);
-		if (pRequestInfo->m_hMutex)
-		{
-			// synchronize in case the previous async_noflush call isn't finished
-			// setting up state for the next call.
-			DWORD dwStatus = WaitForSingleObject(pRequestInfo->m_hMutex, ATLS_ASYNC_MUTEX_TIMEOUT);
-			if (dwStatus != WAIT_OBJECT_0 && dwStatus != WAIT_ABANDONED)
-			{
-				_ATLTRY
-				{
-					pRequestInfo->pExtension->RequestComplete(pRequestInfo, 500, ISE_SUBERR_UNEXPECTED);
-				}
-				_ATLCATCHALL()
-				{
-					ATLTRACE(_T("Warning: Uncaught user exception thrown and caught in AsyncCallback.\n"));
-					_ATLRETHROW;
-				}
+		if (pRequestInfo->lAsyncState != ATLSRV_ASYNC_NONE)
+		{
+			// if the previous async_noflush call isn't finished setting up
+			// state for the next call, leave the completion for it. It is
+			// processed by DispatchStencilCall once HandleRequest returns.
+			pRequestInfo->cbAsyncIO = cbIO;
+			pRequestInfo->dwAsyncError = dwError;
+			if (AtlAsyncCompletionArrived(&pRequestInfo->lAsyncState))
 				return;
-			}
 		}
 
+		ProcessAsyncCompletion(pRequestInfo, cbIO, dwError);
+	}
+
+	static void ProcessAsyncCompletion(__inout AtlServerRequest *pRequestInfo, __in DWORD cbIO, __in DWORD dwError)
+	{
+		ATLENSURE(pRequestInfo);
+
+		// a handler resumed after an AsyncReadClient finds the result here
+		pRequestInfo->cbAsyncIO = cbIO;
+		pRequestInfo->dwAsyncError = dwError;
 		if (pRequestInfo->pfnAsyncComplete != NULL)
 			ATLTRY((*pRequestInfo->pfnAsyncComplete)(pRequestInfo, cbIO, dwError));
 
@@ -9364,16 +12556,20 @@ public:
 		}
 		else if (pRequestInfo->dwRequestState == ATLSRV_STATE_CACHE_DONE)
 		{
-			CloseHandle(pRequestInfo->hFile);
-			pRequestInfo->pFileCache->ReleaseFile(pRequestInfo->hEntry);
+			if (pRequestInfo->pMemoryCache)
+			{
+				pRequestInfo->pMemoryCache->ReleaseEntry(pRequestInfo->hEntry);
+			}
+			else
+			{
+				CloseHandle(pRequestInfo->hFile);
+				pRequestInfo->pFileCache->ReleaseFile(pRequestInfo->hEntry);
+			}
 			pRequestInfo->pExtension->RequestComplete(pRequestInfo, HTTP_ERROR_CODE(HTTP_SUCCESS), 0);
 		}
 		else 
 		{
-			HANDLE hMutex = pRequestInfo->m_hMutex;
 			pRequestInfo->pExtension->QueueRequest(pRequestInfo);
-			if (hMutex)
-				ReleaseMutex(hMutex);
 		}
 	}
 
@@ -9398,15 +12594,24 @@ public:
 			if (dwSubStatus != SUBERR_NO_PROCESS)
 				HandleError(pRequestInfo->pServerContext, dwStatus, dwSubStatus);
 			m_reqStats.RequestHandled(pRequestInfo, FALSE);
+			m_reqBreakdown.RequestHandled(pRequestInfo, FALSE);
 		}
 		else
+		{
 			m_reqStats.RequestHandled(pRequestInfo, TRUE);
+			m_reqBreakdown.RequestHandled(pRequestInfo, TRUE);
+		}
 
 		CComPtr<IHttpServerContext> spServerContext = pRequestInfo->pServerContext;
+		CPageCacheFill *pPageFill = pRequestInfo->pPageFill;
 
 		FreeRequest(pRequestInfo);
 
+		// the page is in the cache once the cache context is done with it
 		spServerContext->DoneWithSession(dwReqStatus);
+
+		if (pPageFill)
+			EndPageFill(pPageFill);
 	}
 
 	HTTP_CODE GetHandlerName(__in LPCSTR szFileName, __out_ecount(MAX_PATH+ATL_MAX_HANDLER_NAME+2) LPSTR szHandlerName) noexcept
@@ -9506,6 +12711,7 @@ public:
 			m_StencilCache.ReleaseStencil(hStencil);
 		}
 
+		Checked::strcpy_s(pRequestInfo->szHandlerName, ATL_MAX_HANDLER_NAME_LEN+1, szHandlerName);
 
 		return LoadRequestHandler(szDllPath, szHandlerName, pRequestInfo->pServerContext, 
 			&pRequestInfo->hInstDll, &pRequestInfo->pHandler);
@@ -9558,6 +12764,7 @@ public:
 				CHAR szFile[MAX_PATH+ATL_MAX_HANDLER_NAME_LEN+1];
 				if (SafeStringCopy(szFile, szFileName))
 				{
+					Checked::strcpy_s(pRequestInfo->szHandlerName, ATL_MAX_HANDLER_NAME_LEN+1, szHandler);
 					hcErr = LoadRequestHandler(szFile, szHandler, pRequestInfo->pServerContext, &pRequestInfo->hInstDll, &pRequestInfo->pHandler);
 				}
 				else
@@ -9586,7 +12793,9 @@ public:
 		if (!pCacheServerContext)
 			return FALSE;
 
-		if (!pCacheServerContext->Initialize(pRequestInfo->pServerContext, pCache))
+		if (!pCacheServerContext->Initialize(pRequestInfo->pServerContext, pCache,
+				static_cast<IMemoryCache*>(&m_PageMemoryCache), &m_PageBlobClient,
+				GetPageCacheMaxResident(), GetPageCacheStaleTime(), GetPageCacheCompress()))
 		{
 			delete pCacheServerContext;
 			return FALSE;
@@ -9602,6 +12811,243 @@ public:
 	}
 #pragma warning(pop)
 
+	// Builds the page cache key for a request: its path info and query
+	// string joined by '?'. Returns FALSE if the key is too long.
+	static BOOL GetPageCacheKey(__in IHttpServerContext *pServerContext, __out_ecount(ATL_URL_MAX_URL_LENGTH+1) LPSTR szUrl)
+	{
+		ATLENSURE(pServerContext);
+		LPCSTR szPathInfo = pServerContext->GetPathInfo();
+		LPCSTR szQueryString = pServerContext->GetQueryString();
+
+		int nSize = 0;
+		LPSTR szTo = szUrl;
+		ATLENSURE(szPathInfo!=NULL);
+		while (*szPathInfo && nSize < ATL_URL_MAX_URL_LENGTH)
+		{
+			*szTo++ = *szPathInfo++;
+			nSize++;
+		}
+		if (nSize >= ATL_URL_MAX_URL_LENGTH)
+		{
+			return FALSE;
+		}
+		*szTo++ = '?';
+		nSize++;
+		ATLENSURE(szQueryString!=NULL);
+		while (*szQueryString && nSize < ATL_URL_MAX_URL_LENGTH)
+		{
+			*szTo++ = *szQueryString++;
+			nSize++;
+		}
+		if (nSize >= ATL_URL_MAX_URL_LENGTH)
+		{
+			return FALSE;
+		}
+		*szTo = '\0';
+		return TRUE;
+	}
+
+	static BOOL IsPageStale(__in const FILETIME& ftFresh) noexcept
+	{
+		return CFileTime(ftFresh) != 0 && CFileTime::GetCurrentTime() > CFileTime(ftFresh);
+	}
+
+	// Makes pRequestInfo the request that renders the page szUrl for any
+	// request that misses the page cache on szUrl until it completes.
+	// Returns FALSE if another request is already rendering the page.
+	BOOL BeginPageFill(__inout AtlServerRequest *pRequestInfo, __in LPCSTR szUrl) noexcept
+	{
+		ATLASSERT(pRequestInfo);
+		ATLASSERT(szUrl);
+
+		if (pRequestInfo->pPageFill || pRequestInfo->bNoPageFill)
+			return FALSE;
+
+		CPageCacheFill *pFill = NULL;
+		ATLTRY(pFill = new CPageCacheFill);
+		if (!pFill)
+			return FALSE;
+
+		BOOL bRet = FALSE;
+		m_critSec.Lock();
+		_ATLTRY
+		{
+			pFill->strKey = szUrl;
+			if (!m_PageFills.Lookup(pFill->strKey))
+			{
+				m_PageFills.SetAt(pFill->strKey, pFill);
+				InterlockedIncrement(&m_lPageFills);
+				bRet = TRUE;
+			}
+		}
+		_ATLCATCHALL()
+		{
+		}
+		m_critSec.Unlock();
+
+		if (!bRet)
+		{
+			delete pFill;
+			return FALSE;
+		}
+		pRequestInfo->pPageFill = pFill;
+		return TRUE;
+	}
+
+	// Parks pRequestInfo until the request rendering szUrl completes.
+	// Returns FALSE if no request is rendering it.
+	BOOL WaitForPageFill(__inout AtlServerRequest *pRequestInfo, __in LPCSTR szUrl) noexcept
+	{
+		ATLASSERT(pRequestInfo);
+		ATLASSERT(szUrl);
+
+		if (pRequestInfo->pPageFill || pRequestInfo->bNoPageFill || m_lPageFills == 0)
+			return FALSE;
+
+		BOOL bWaiting = FALSE;
+		m_critSec.Lock();
+		_ATLTRY
+		{
+			CPageCacheFill *pFill = NULL;
+			if (m_PageFills.Lookup(szUrl, pFill))
+			{
+				pFill->arrWaiters.Add(pRequestInfo);
+				bWaiting = TRUE;
+			}
+		}
+		_ATLCATCHALL()
+		{
+		}
+		m_critSec.Unlock();
+
+		return bWaiting;
+	}
+
+	// Queues the requests that waited for pFill again. They find the page
+	// in the cache, or render it themselves if it wasn't cached.
+	void EndPageFill(__in CPageCacheFill *pFill)
+	{
+		ATLASSERT(pFill);
+
+		m_critSec.Lock();
+		m_PageFills.RemoveKey(pFill->strKey);
+		InterlockedDecrement(&m_lPageFills);
+		m_critSec.Unlock();
+
+		for (size_t i = 0; i < pFill->arrWaiters.GetCount(); i++)
+		{
+			AtlServerRequest *pWaiter = pFill->arrWaiters[i];
+			pWaiter->bNoPageFill = TRUE;
+			m_reqStats.OnRequestReceived();
+			if (!QueueRequest(pWaiter))
+			{
+				m_reqStats.OnRequestDequeued();
+				RequestComplete(pWaiter, 503, SUBERR_NONE);
+			}
+		}
+		delete pFill;
+	}
+
+	// Answers a conditional GET for a cached page with a 304 response if
+	// the client's copy is current. Returns FALSE if the page has to be sent.
+	BOOL TransmitNotModified(__in AtlServerRequest* pRequestInfo, __in LPCSTR szETag,
+		__in const FILETIME& ftLastModified, __in LPCSTR szNotModified)
+	{
+		if (!*szNotModified ||
+			!AtlIsNotModified(pRequestInfo->pServerContext, szETag, &ftLastModified))
+		{
+			return FALSE;
+		}
+
+		pRequestInfo->dwRequestType = ATLSRV_REQUEST_CACHE;
+		pRequestInfo->pServerContext->SendResponseHeader(szNotModified, "304 Not Modified", FALSE);
+		RequestComplete(pRequestInfo, 304, SUBERR_NONE);
+		return TRUE;
+	}
+
+	// Sends a page from the in-memory page cache. When the server context
+	// supports IHttpVectorSend, the headers and the body go out together in
+	// one gathered write straight from the cached blob. Otherwise the
+	// headers are sent first and the body follows in a single asynchronous
+	// write, with the blob referenced until AsyncCallback releases hEntry.
+	BOOL TransmitFromMemoryCache(__in AtlServerRequest* pRequestInfo, __in LPCSTR szUrl, __in HCACHEITEM hEntry, __out BOOL *pbAllowCaching)
+	{
+		ATLENSURE(pRequestInfo);
+		ATLENSURE(pbAllowCaching);
+
+		CPageCacheBlob *pBlob = NULL;
+		DWORD dwSize = 0;
+		m_PageMemoryCache.GetData(hEntry, (void **) &pBlob, &dwSize);
+		if (!pBlob)
+		{
+			m_PageMemoryCache.ReleaseEntry(hEntry);
+			*pbAllowCaching = FALSE;
+			return FALSE;
+		}
+
+		if (IsPageStale(pBlob->ftFresh) && BeginPageFill(pRequestInfo, szUrl))
+		{
+			// render a fresh copy; other requests keep getting this one meanwhile
+			m_PageMemoryCache.ReleaseEntry(hEntry);
+			return FALSE;
+		}
+
+		// the blob can go once the 304 headers have been sent
+		if (TransmitNotModified(pRequestInfo, pBlob->szETag, pBlob->ftLastModified, pBlob->szNotModified))
+		{
+			m_PageMemoryCache.ReleaseEntry(hEntry);
+			return TRUE;
+		}
+
+		pRequestInfo->dwRequestType = ATLSRV_REQUEST_CACHE;
+
+		CComQIPtr<IHttpVectorSend> spVectorSend;
+		if (pBlob->cbBody != 0)
+			spVectorSend = pRequestInfo->pServerContext;
+		if (spVectorSend)
+		{
+			AtlServerSendBuffer buffer;
+			buffer.pvData = pBlob->pbBody;
+			buffer.cbData = pBlob->cbBody;
+			BOOL bRet = spVectorSend->VectorSend(pBlob->szStatus, pBlob->szHeader, FALSE, &buffer, 1);
+			m_PageMemoryCache.ReleaseEntry(hEntry);
+			if (bRet)
+				RequestComplete(pRequestInfo, HTTP_ERROR_CODE(HTTP_SUCCESS), 0);
+			else
+				RequestComplete(pRequestInfo, 500, SUBERR_NO_PROCESS);
+			return TRUE;
+		}
+
+		pRequestInfo->pServerContext->SendResponseHeader(
+			pBlob->szHeader, pBlob->szStatus, FALSE);
+
+		if (pBlob->cbBody == 0)
+		{
+			m_PageMemoryCache.ReleaseEntry(hEntry);
+			RequestComplete(pRequestInfo, HTTP_ERROR_CODE(HTTP_SUCCESS), 0);
+			return TRUE;
+		}
+
+		pRequestInfo->dwRequestState = ATLSRV_STATE_CACHE_DONE;
+		pRequestInfo->hFile = NULL;
+		pRequestInfo->hEntry = hEntry;
+		pRequestInfo->pFileCache = NULL;
+		pRequestInfo->pMemoryCache = static_cast<IMemoryCache*>(&m_PageMemoryCache);
+
+		DWORD cbBody = pBlob->cbBody;
+		if (!pRequestInfo->pServerContext->RequestIOCompletion(AsyncCallback, (DWORD *)pRequestInfo) ||
+			!pRequestInfo->pServerContext->AsyncWriteClient((void *) pBlob->pbBody, &cbBody))
+		{
+			// the headers have gone out, so the page can't be rendered
+			// instead; end the request without an error body
+			pRequestInfo->hEntry = NULL;
+			pRequestInfo->pMemoryCache = NULL;
+			m_PageMemoryCache.ReleaseEntry(hEntry);
+			RequestComplete(pRequestInfo, 500, SUBERR_NO_PROCESS);
+		}
+		return TRUE;
+	}
+
 	virtual BOOL TransmitFromCache(__in AtlServerRequest* pRequestInfo, __out BOOL *pbAllowCaching)
 	{
 		ATLENSURE(pRequestInfo);
@@ -9615,36 +13061,27 @@ public:
 				return FALSE;
 
 			char szUrl[ATL_URL_MAX_URL_LENGTH + 1];
-			LPCSTR szPathInfo = pRequestInfo->pServerContext->GetPathInfo();
-			LPCSTR szQueryString = pRequestInfo->pServerContext->GetQueryString();
-
-			int nSize = 0;
-			LPSTR szTo = szUrl;
-			ATLENSURE(szPathInfo!=NULL);
-			while (*szPathInfo && nSize < ATL_URL_MAX_URL_LENGTH)
-			{
-				*szTo++ = *szPathInfo++;
-				nSize++;
-			}
-			if (nSize >= ATL_URL_MAX_URL_LENGTH)
-			{
+			if (!GetPageCacheKey(pRequestInfo->pServerContext, szUrl))
 				return FALSE;
-			}
-			*szTo++ = '?';
-			nSize++;
-			ATLENSURE(szQueryString!=NULL);
-			while (*szQueryString && nSize < ATL_URL_MAX_URL_LENGTH)
+
+			HCACHEITEM hEntry;
+
+			// compressed variants are only kept in memory
+			int nEncoding = ATLS_ENCODING_IDENTITY;
+			if (GetPageCacheCompress())
+				nEncoding = AtlGetAcceptedEncoding(pRequestInfo->pServerContext);
+			if (nEncoding != ATLS_ENCODING_IDENTITY)
 			{
-				*szTo++ = *szQueryString++;
-				nSize++;
+				char szVariantKey[ATLS_MAX_VARIANT_KEY_LENGTH];
+				AtlGetPageCacheVariantKey(szUrl, nEncoding, szVariantKey);
+				if (S_OK == m_PageMemoryCache.LookupEntry(szVariantKey, &hEntry))
+					return TransmitFromMemoryCache(pRequestInfo, szUrl, hEntry, pbAllowCaching);
 			}
-			if (nSize >= ATL_URL_MAX_URL_LENGTH)
+
+			if (S_OK == m_PageMemoryCache.LookupEntry(szUrl, &hEntry))
 			{
-				return FALSE;
+				return TransmitFromMemoryCache(pRequestInfo, szUrl, hEntry, pbAllowCaching);
 			}
-			*szTo = '\0';
-
-			HCACHEITEM hEntry;
 
 			if (S_OK == m_PageCache.LookupFile(szUrl, &hEntry))
 			{ 
@@ -9652,6 +13089,16 @@ public:
 				CPageCachePeer::PeerInfo *pInfo;
 				m_PageCache.GetFile(hEntry, &szFileName, (void **)&pInfo);
 				ATLENSURE(pInfo);
+				if (IsPageStale(pInfo->ftFresh) && BeginPageFill(pRequestInfo, szUrl))
+				{
+					m_PageCache.ReleaseFile(hEntry);
+					return FALSE;
+				}
+				if (TransmitNotModified(pRequestInfo, pInfo->strETag, pInfo->ftLastModified, pInfo->strNotModified))
+				{
+					m_PageCache.ReleaseFile(hEntry);
+					return TRUE;
+				}
 				CAtlFile file;
 				HRESULT hr = E_FAIL;
 
@@ -9675,6 +13122,7 @@ public:
 				BOOL bRet = FALSE;
 
 				pRequestInfo->dwRequestState = ATLSRV_STATE_CACHE_DONE;
+				pRequestInfo->dwRequestType = ATLSRV_REQUEST_CACHE;
 				pRequestInfo->hFile = hFile;
 				pRequestInfo->hEntry = hEntry;
 				pRequestInfo->pFileCache = &m_PageCache;
@@ -9692,10 +13140,14 @@ public:
 
 				if (!bRet)
 				{
+					// the headers have gone out, so the page can't be rendered
+					// instead; end the request without an error body
+					pRequestInfo->hFile = NULL;
+					pRequestInfo->hEntry = NULL;
+					pRequestInfo->pFileCache = NULL;
 					m_PageCache.ReleaseFile(hEntry);
 					CloseHandle(hFile);
-					*pbAllowCaching = FALSE;
-					return FALSE;
+					RequestComplete(pRequestInfo, 500, SUBERR_NO_PROCESS);
 				}
 				return TRUE;
 			}
@@ -9920,7 +13372,14 @@ public:
 		ATLENSURE(pRequestInfo!=NULL);
 		CSetThreadToken sec;
 
+		AtlOnRequestDequeued(pRequestInfo);
 		m_reqStats.OnRequestDequeued();
+		// request stat classes written before OnRequestScheduled was added
+		// do not have to implement it
+		__if_exists(CRequestStatClass::OnRequestScheduled)
+		{
+			m_reqStats.OnRequestScheduled(pRequestInfo);
+		}
 
 		if (!sec.Initialize(pRequestInfo))
 		{
@@ -9933,17 +13392,8 @@ public:
 			return TRUE;
 #endif // defined(ATLS_ENABLE_DEBUGGING)
 
-		if (pRequestInfo->m_hMutex)
-		{
-			// synchronize in case the previous async_noflush call isn't finished
-			// setting up state for the next call.
-			DWORD dwStatus = WaitForSingleObject(pRequestInfo->m_hMutex, ATLS_ASYNC_MUTEX_TIMEOUT);
-			if (dwStatus != WAIT_OBJECT_0 && dwStatus != WAIT_ABANDONED)
-			{
-				RequestComplete(pRequestInfo, 500, ISE_SUBERR_UNEXPECTED);
-				return FALSE;
-			}
-		}
+		if (pRequestInfo->lAsyncState != ATLSRV_ASYNC_NONE)
+			AtlAsyncHandlerStart(&pRequestInfo->lAsyncState);
 
 #ifdef _DEBUG
 		bool bAsyncAllowed = false;
@@ -9957,6 +13407,22 @@ public:
 				return TRUE;
 			}
 
+			// if another request is rendering this page, wait for it to be cached
+			char szCacheKey[ATL_URL_MAX_URL_LENGTH + 1];
+			BOOL bCacheKey = FALSE;
+			if (bAllowCaching && !strcmp(pRequestInfo->pServerContext->GetRequestMethod(), "GET"))
+			{
+				_ATLTRY
+				{
+					bCacheKey = GetPageCacheKey(pRequestInfo->pServerContext, szCacheKey);
+				}
+				_ATLCATCHALL()
+				{
+				}
+			}
+			if (bCacheKey && WaitForPageFill(pRequestInfo, szCacheKey))
+				return TRUE;                        // EndPageFill queues it again
+
 			// get the srf filename
 			LPCSTR szFileName = pRequestInfo->pServerContext->GetScriptPathTranslated();
 
@@ -10015,6 +13481,10 @@ public:
 
 				pRequestInfo->pServerContext->Release();
 				pRequestInfo->pServerContext = spCacheCtx.Detach();
+
+				// only pages known to be cacheable make later misses wait
+				if (bCacheKey)
+					BeginPageFill(pRequestInfo, szCacheKey);
 			}
 
 			if (dwStatus & (ATLSRV_INIT_USEASYNC | ATLSRV_INIT_USEASYNC_EX))
@@ -10031,19 +13501,9 @@ public:
 
 			if (dwStatus & ATLSRV_INIT_USEASYNC_EX)
 			{
-				pRequestInfo->m_hMutex = CreateMutex(NULL, FALSE, NULL);
-				if (pRequestInfo->m_hMutex == NULL)
-				{
-					RequestComplete(pRequestInfo, 500, ISE_SUBERR_SYSOBJFAIL);
-					return FALSE;
-				}
-
-				DWORD dwMutexStatus = WaitForSingleObject(pRequestInfo->m_hMutex, 10000);
-				if (dwMutexStatus != WAIT_OBJECT_0 && dwMutexStatus != WAIT_ABANDONED)
-				{
-					RequestComplete(pRequestInfo, 500, ISE_SUBERR_UNEXPECTED);
-					return FALSE;
-				}
+				// from here on completions that arrive before HandleRequest
+				// returns are left for this call to process
+				AtlAsyncHandlerStart(&pRequestInfo->lAsyncState);
 			}
 			hcErr = pRequestInfo->pHandler->InitializeHandler(pRequestInfo, static_cast<IServiceProvider*>(this));
 		}
@@ -10074,13 +13534,13 @@ public:
 
 		// must use ATLSRV_INIT_USEASYNC_EX to use NOFLUSH returns
 		if (IsAsyncNoFlushStatus(hcErr))
-			ATLASSERT(pRequestInfo->m_hMutex);
+			ATLASSERT(pRequestInfo->lAsyncState != ATLSRV_ASYNC_NONE);
 #endif
 
-		// save hMutex in case pRequestInfo is deleted by AsyncCallback after
-		// we call StartAsyncFlush but before we check to see if we need to
-		// call ReleaseMutex
-		HANDLE hMutex = pRequestInfo->m_hMutex;
+		// save this in case pRequestInfo is deleted by AsyncCallback after
+		// we call StartAsyncFlush. ATLSRV_INIT_USEASYNC_EX requests are not,
+		// because AsyncCallback leaves their completion to us while we run.
+		BOOL bAsyncEx = (pRequestInfo->lAsyncState != ATLSRV_ASYNC_NONE);
 
 		if (IsAsyncStatus(hcErr))
 		{
@@ -10101,8 +13561,13 @@ public:
 			pRequestInfo = NULL;
 		}
 
-		if (hMutex)
-			ReleaseMutex(hMutex);
+		if (bAsyncEx && pRequestInfo != NULL)
+		{
+			// hand the request back. If its I/O has already completed, the
+			// completion was left for us, so process it now.
+			if (AtlAsyncHandlerDone(&pRequestInfo->lAsyncState))
+				ProcessAsyncCompletion(pRequestInfo, pRequestInfo->cbAsyncIO, pRequestInfo->dwAsyncError);
+		}
 
 		return TRUE;
 	}
@@ -10162,6 +13627,39 @@ public:
 		return m_reqStats.GetActiveThreads();
 	}
 
+	// request stat classes written before the latency histograms were
+	// added don't have to implement them
+	long GetLatencyPercentile(DWORD dwLatency, DWORD dwPerMille)
+	{
+		__if_exists(CRequestStatClass::GetLatencyPercentile)
+		{
+			return m_reqStats.GetLatencyPercentile(dwLatency, dwPerMille);
+		}
+		__if_not_exists(CRequestStatClass::GetLatencyPercentile)
+		{
+			(dwLatency);
+			(dwPerMille);
+			return 0;
+		}
+	}
+
+	HRESULT RenderLatencyStats(IWriteStream *pStream)
+	{
+		__if_exists(CRequestStatClass::RenderLatencyStats)
+		{
+			HRESULT hr = m_reqStats.RenderLatencyStats(pStream);
+			if (SUCCEEDED(hr) && pStream)
+				hr = m_reqBreakdown.Render(pStream);
+			return hr;
+		}
+		__if_not_exists(CRequestStatClass::RenderLatencyStats)
+		{
+			if (!pStream)
+				return E_POINTER;
+			return m_reqBreakdown.Render(pStream);
+		}
+	}
+
 	__success(SUCCEEDED(return)) __checkReturn HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, __deref_out void **ppv)
 	{
 		if (!ppv)
@@ -10172,6 +13670,12 @@ public:
 			AddRef();
 			return S_OK;
 		}
+		if (InlineIsEqualGUID(riid, __uuidof(IRequestLatencyStats)))
+		{
+			*ppv = static_cast<IRequestLatencyStats*>(this);
+			AddRef();
+			return S_OK;
+		}
 		if (InlineIsEqualGUID(riid, __uuidof(IUnknown)) ||
 			InlineIsEqualGUID(riid, __uuidof(IServiceProvider)))
 		{
@@ -0,0 +1,237 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLLATENCY_H__
+#define __ATLLATENCY_H__
+
+#pragma once
+
+// The latency histograms behind the request statistics in atlisapi.h.
+// They only rely on the basic ATL types and macros (DWORD, ULONGLONG,
+// ATLASSERT, C_ASSERT) and on GetTickCount, GetCurrentThreadId,
+// InterlockedIncrement and InterlockedCompareExchange, which the
+// including file must provide, so that they can be exercised outside of
+// a Windows build.
+
+#include <string.h>
+
+// Number of shards a CAtlLatencyHistogram splits its counts into.
+#ifndef ATLS_LATENCY_SHARDS
+#define ATLS_LATENCY_SHARDS 4
+#endif
+
+// Length in milliseconds of the window a CAtlLatencyHistogram reports on.
+#ifndef ATLS_LATENCY_WINDOW
+#define ATLS_LATENCY_WINDOW 60000
+#endif
+
+// Number of intervals the window is divided into. The oldest interval is
+// dropped as a new one starts, so the counts cover the last
+// ATLS_LATENCY_WINDOW less at most one interval. Each interval adds
+// ATLS_LATENCY_SHARDS*240 counts to a histogram, and CPerfRequestStatObject
+// keeps two histograms in perf shared memory.
+#ifndef ATLS_LATENCY_INTERVALS
+#define ATLS_LATENCY_INTERVALS 4
+#endif
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+//
+// CAtlLatencyHistogramT
+// Counts latencies in microseconds in buckets that grow with the latency,
+// eight to each power of two, so a bucket's limit is within 12.5% of any
+// value it counts. The counts are split into t_nShards shards picked by
+// thread id so that threads recording at the same time seldom share a
+// cache line. The histogram holds no pointers and can live in shared
+// memory, as it does in CPerfRequestStatObject.
+//
+// Only the last t_dwWindow milliseconds are counted, so the percentiles
+// follow changes in load instead of settling on the average since the
+// process started. The window is kept as t_nIntervals intervals in a
+// ring; the first value recorded in a new interval clears the slot of the
+// interval that has fallen out of the window. A value recorded by another
+// thread while the slot is being cleared may be lost.
+template <int t_nShards = ATLS_LATENCY_SHARDS, int t_nIntervals = ATLS_LATENCY_INTERVALS,
+	DWORD t_dwWindow = ATLS_LATENCY_WINDOW>
+struct CAtlLatencyHistogramT
+{
+	enum
+	{
+		SUB_BUCKET_BITS = 3,
+		SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+		BUCKETS = (32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+	};
+
+	// number of the interval each slot counts, plus one; 0 if unused
+	LONG m_rglIntervals[t_nIntervals];
+	LONG m_rgCounts[t_nIntervals][t_nShards][BUCKETS];
+
+	CAtlLatencyHistogramT() noexcept
+	{
+		C_ASSERT(t_nIntervals >= 2);
+		C_ASSERT(t_dwWindow >= (DWORD) t_nIntervals);
+		memset(m_rglIntervals, 0, sizeof(m_rglIntervals));
+		memset(m_rgCounts, 0, sizeof(m_rgCounts));
+	}
+
+	void Record(DWORD dwMicroseconds) noexcept
+	{
+		RecordAt(dwMicroseconds, GetTickCount());
+	}
+
+	// Records a value at dwNow, a tick count in milliseconds
+	void RecordAt(DWORD dwMicroseconds, DWORD dwNow) noexcept
+	{
+		LONG lInterval = GetInterval(dwNow);
+		DWORD dwSlot = (DWORD) lInterval % t_nIntervals;
+		if (m_rglIntervals[dwSlot] != lInterval)
+			StartInterval(dwSlot, lInterval);
+
+		DWORD dwShard = GetCurrentThreadId() % t_nShards;
+		InterlockedIncrement(&m_rgCounts[dwSlot][dwShard][GetBucket(dwMicroseconds)]);
+	}
+
+	// Adds up the shards of the intervals in the window into rgCounts and
+	// returns the number of values recorded. Values recorded meanwhile may
+	// or may not be included.
+	ULONGLONG GetCounts(DWORD *rgCounts) noexcept
+	{
+		return GetCountsAt(rgCounts, GetTickCount());
+	}
+
+	// Same as GetCounts for the window that ends at dwNow
+	ULONGLONG GetCountsAt(DWORD *rgCounts, DWORD dwNow) noexcept
+	{
+		LONG lNow = GetInterval(dwNow);
+		bool rgbInWindow[t_nIntervals];
+		for (DWORD dwSlot = 0; dwSlot < t_nIntervals; dwSlot++)
+		{
+			LONG lInterval = m_rglIntervals[dwSlot];
+			rgbInWindow[dwSlot] = lInterval != 0 && (DWORD) (lNow - lInterval) < t_nIntervals;
+		}
+
+		ULONGLONG ullTotal = 0;
+		for (DWORD dwBucket = 0; dwBucket < BUCKETS; dwBucket++)
+		{
+			DWORD dwCount = 0;
+			for (DWORD dwSlot = 0; dwSlot < t_nIntervals; dwSlot++)
+			{
+				if (!rgbInWindow[dwSlot])
+					continue;
+				for (DWORD dwShard = 0; dwShard < t_nShards; dwShard++)
+					dwCount += (DWORD) m_rgCounts[dwSlot][dwShard][dwBucket];
+			}
+			rgCounts[dwBucket] = dwCount;
+			ullTotal += dwCount;
+		}
+		return ullTotal;
+	}
+
+	// Adds the counts of another histogram, interval by interval. A slot
+	// that holds an older interval than the same slot of the other
+	// histogram takes over the newer one. Not safe against concurrent
+	// Record calls on this histogram; meant for merging copies.
+	void Add(const CAtlLatencyHistogramT& other) noexcept
+	{
+		for (DWORD dwSlot = 0; dwSlot < t_nIntervals; dwSlot++)
+		{
+			LONG lOther = other.m_rglIntervals[dwSlot];
+			if (lOther == 0 || (m_rglIntervals[dwSlot] != 0 && (LONG) (lOther - m_rglIntervals[dwSlot]) < 0))
+				continue;
+			if (lOther != m_rglIntervals[dwSlot])
+			{
+				m_rglIntervals[dwSlot] = lOther;
+				memset(m_rgCounts[dwSlot], 0, sizeof(m_rgCounts[dwSlot]));
+			}
+			for (DWORD dwShard = 0; dwShard < t_nShards; dwShard++)
+				for (DWORD dwBucket = 0; dwBucket < BUCKETS; dwBucket++)
+					m_rgCounts[dwSlot][dwShard][dwBucket] += other.m_rgCounts[dwSlot][dwShard][dwBucket];
+		}
+	}
+
+	static DWORD GetWindow() noexcept
+	{
+		return t_dwWindow;
+	}
+
+	static LONG GetInterval(DWORD dwNow) noexcept
+	{
+		return (LONG) (dwNow / (t_dwWindow / t_nIntervals)) + 1;
+	}
+
+	// Takes over dwSlot for lInterval and clears the counts left in it from
+	// an earlier interval. Only the thread that takes it over clears it.
+	void StartInterval(DWORD dwSlot, LONG lInterval) noexcept
+	{
+		LONG lOld = m_rglIntervals[dwSlot];
+		if (lOld == lInterval ||
+			InterlockedCompareExchange(&m_rglIntervals[dwSlot], lInterval, lOld) != lOld)
+		{
+			return;
+		}
+		memset(m_rgCounts[dwSlot], 0, sizeof(m_rgCounts[dwSlot]));
+	}
+
+	// Returns the latency that dwPerMille thousandths of the values
+	// counted in rgCounts don't exceed, or 0 if there are none.
+	static DWORD GetPercentile(const DWORD *rgCounts, ULONGLONG ullTotal,
+		DWORD dwPerMille) noexcept
+	{
+		ATLASSERT(dwPerMille <= 1000);
+		if (!ullTotal)
+			return 0;
+
+		ULONGLONG ullRank = (ullTotal * dwPerMille + 999) / 1000;
+		if (!ullRank)
+			ullRank = 1;
+
+		ULONGLONG ullSeen = 0;
+		for (DWORD dwBucket = 0; dwBucket < BUCKETS; dwBucket++)
+		{
+			ullSeen += rgCounts[dwBucket];
+			if (ullSeen >= ullRank)
+				return GetBucketLimit(dwBucket);
+		}
+		return GetBucketLimit(BUCKETS-1);
+	}
+
+	static DWORD GetBucket(DWORD dwValue) noexcept
+	{
+		if (dwValue < SUB_BUCKETS)
+			return dwValue;
+
+		DWORD dwExponent = SUB_BUCKET_BITS;
+		while (dwExponent < 31 && (dwValue >> (dwExponent+1)))
+			dwExponent++;
+
+		DWORD dwShift = dwExponent - SUB_BUCKET_BITS;
+		return (dwShift + 1) * SUB_BUCKETS + ((dwValue >> dwShift) & (SUB_BUCKETS-1));
+	}
+
+	// Returns the largest value counted in the bucket
+	static DWORD GetBucketLimit(DWORD dwBucket) noexcept
+	{
+		ATLASSERT(dwBucket < BUCKETS);
+		if (dwBucket < SUB_BUCKETS)
+			return dwBucket;
+
+		DWORD dwShift = dwBucket / SUB_BUCKETS - 1;
+		DWORD dwBase = (SUB_BUCKETS + dwBucket % SUB_BUCKETS) << dwShift;
+		return dwBase + ((1UL << dwShift) - 1);
+	}
+}; // struct CAtlLatencyHistogramT
+
+typedef CAtlLatencyHistogramT<> CAtlLatencyHistogram;
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLLATENCY_H__
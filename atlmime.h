@@ -1468,7 +1468,7 @@ public:
 				case ATLSMTP_BASE64_ENCODE:
 					//if we are at the end of input (dwCurrRead < dwToGet), output the trailing padding if necessary
 					//(ATL_FLAG_NONE)
-					bRet = Base64Encode(spData, dwCurrRead, currBuffer, &nEncodedLength, 
+					bRet = AtlFastBase64Encode(spData, dwCurrRead, currBuffer, &nEncodedLength, 
 						(dwCurrRead < dwToGet ? ATL_BASE64_FLAG_NONE: ATL_BASE64_FLAG_NOPAD));
 					//Base64Encoding needs explicit CRLF added
 					if (dwCurrRead < dwToGet)
@@ -1732,7 +1732,7 @@ public:
 			switch(m_nEncodingScheme)
 			{
 				case ATLSMTP_BASE64_ENCODE:
-					bRet = Base64Encode(((LPBYTE)(m_pvRaw))+dwRead, dwCurrChunk, currBuffer, &nDestLen, 
+					bRet = AtlFastBase64Encode(((LPBYTE)(m_pvRaw))+dwRead, dwCurrChunk, currBuffer, &nDestLen, 
 						(dwRead < m_dwLength) ? ATL_BASE64_FLAG_NONE : ATL_BASE64_FLAG_NOPAD);
 					if (dwRead+dwCurrChunk == m_dwLength)
 					{
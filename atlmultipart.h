@@ -0,0 +1,1014 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLMULTIPART_H__
+#define __ATLMULTIPART_H__
+
+#pragma once
+
+// The multipart/form-data parser behind CMultiPartFormParser in
+// atlisapi.h: the window the body is read through, the boundary search
+// and the parts state machine. The body, the form fields and the files
+// come from the including code through the T parameter, and the rest only
+// relies on the basic ATL types and macros (DWORD, LPSTR, BOOL, ATLASSERT,
+// ATLENSURE, _ATLTRY), which the including file must provide, so that it
+// can be exercised outside of a Windows build.
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef MAX_MIME_BOUNDARY_LEN
+	#define MAX_MIME_BOUNDARY_LEN 128
+#endif
+
+// size of the window CMultiPartFormParser reads a request body through when
+// the body is not all available up front; the headers of each part must fit in it
+#ifndef ATLS_MULTIPART_WINDOW_SIZE
+	#define ATLS_MULTIPART_WINDOW_SIZE 65536
+#endif
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+enum ATL_FORM_FLAGS
+{
+	ATL_FORM_FLAG_NONE = 0,
+	ATL_FORM_FLAG_IGNORE_FILES = 1,
+	ATL_FORM_FLAG_REFUSE_FILES = 2,
+	ATL_FORM_FLAG_IGNORE_EMPTY_FILES = 4,
+	ATL_FORM_FLAG_IGNORE_EMPTY_FIELDS = 8,
+	ATL_FORM_FLAG_ASYNC_BODY = 32,		// read the part of the body the server does not have yet with
+										// AsyncReadClient instead of blocking. See CHttpRequest::IsBodyPending
+};
+
+// States of CAtlMultiPartParser::ContinueMultiPartData
+enum ATL_MULTIPART_STATE
+{
+	ATL_MULTIPART_PREAMBLE,		// looking for the first boundary
+	ATL_MULTIPART_HEADERS,		// at the headers of a part
+	ATL_MULTIPART_FIELD,		// reading the value of a form field
+	ATL_MULTIPART_FILE,			// reading an uploaded file
+	ATL_MULTIPART_SKIP,			// skipping an ignored part
+	ATL_MULTIPART_DONE
+};
+
+//
+// CAtlMultiPartParser
+// Splits a multipart/form-data body into its parts. A body that is all
+// available up front is parsed where it is; otherwise it is read through
+// a window of ATLS_MULTIPART_WINDOW_SIZE bytes, which is refilled as the
+// parse moves through it. With bAsync, only the data the server already
+// has is read, and the parse stops with IsPending set for the caller to
+// read the rest into GetReadBuffer.
+//
+// T derives from CAtlMultiPartParser and provides
+//     BOOL ReadClient(LPSTR pBuffer, DWORD *pdwLen, DWORD dwBodyOffset);
+//     BOOL BeginField(LPCSTR szName, DWORD cchName);
+//     BOOL BeginFile(LPCSTR szName, DWORD cchName, LPCSTR szFileName, DWORD cchFileName,
+//                    LPCSTR szContentType, DWORD cchContentType);
+//     BOOL WritePartData(LPCSTR pData, DWORD cbData);
+//     BOOL EndField(BOOL bKeep);
+//     BOOL EndFile(BOOL bKeep);
+//     void AbortFile();
+//     void OnParseError(LPCSTR szMessage);
+// where ReadClient reads up to *pdwLen bytes of the body from dwBodyOffset
+// on like ReadClientData, the data of each field or file goes to
+// WritePartData between its Begin and End calls, bKeep is FALSE for an
+// empty field with ATL_FORM_FLAG_IGNORE_EMPTY_FIELDS and an empty file with
+// ATL_FORM_FLAG_IGNORE_EMPTY_FILES, and AbortFile is called instead of
+// EndFile when the body ends in a file.
+// szContentType is NULL if the file has no Content-Type. Any of them but
+// ReadClient may throw.
+template <class T>
+class CAtlMultiPartParser
+{
+protected:
+
+	LPSTR                       m_pCurrent;
+	LPSTR                       m_pEnd;
+	LPSTR                       m_pStart;
+	CHAR                        m_szBoundary[MAX_MIME_BOUNDARY_LEN+2];
+	DWORD                       m_dwBoundaryLen;
+	BOOL                        m_bFinished;
+
+	// m_pStart is a malloc'ed window that is refilled from the client, rather
+	// than the server's buffer of available data
+	BOOL                        m_bWindowed;
+	// body offset of m_pStart, body bytes read so far, and how many of them
+	// the server had before the parse started
+	DWORD                       m_dwWindowBase;
+	DWORD                       m_dwBodyRead;
+	DWORD                       m_dwBodyTotal;
+	DWORD                       m_dwBodyAvailable;
+	// Boyer-Moore-Horspool shifts for m_szBoundary
+	BYTE                        m_rgBoundarySkip[256];
+
+	// FillWindow only copies data the server already has, and sets m_bNeedData
+	// rather than block for the rest. See BeginParse
+	BOOL                        m_bAsync;
+	BOOL                        m_bNeedData;
+	// OnReadComplete was told that a read failed
+	BOOL                        m_bReadFailed;
+
+	// where ContinueMultiPartData is in the body, and the bytes of the
+	// current field or file so far
+	ATL_MULTIPART_STATE         m_nState;
+	DWORD                       m_dwFlags;
+	ULONGLONG                   m_nPartSize;
+
+public:
+
+	CAtlMultiPartParser() noexcept :
+		m_pCurrent(NULL),
+		m_pEnd(NULL),
+		m_pStart(NULL),
+		m_dwBoundaryLen(0),
+		m_bFinished(FALSE),
+		m_bWindowed(FALSE),
+		m_dwWindowBase(0),
+		m_dwBodyRead(0),
+		m_dwBodyTotal(0),
+		m_dwBodyAvailable(0),
+		m_bAsync(FALSE),
+		m_bNeedData(FALSE),
+		m_bReadFailed(FALSE),
+		m_nState(ATL_MULTIPART_PREAMBLE),
+		m_dwFlags(ATL_FORM_FLAG_NONE),
+		m_nPartSize(0)
+	{
+		*m_szBoundary = '\0';
+	}
+
+	~CAtlMultiPartParser() noexcept
+	{
+		if (m_bWindowed)
+		{
+			free(m_pStart);
+		}
+	}
+
+	// Starts parsing a body of dwBytesTotal bytes with the content type
+	// szContentType, of which the first dwBytesAvailable are at
+	// pAvailableData, and parses as much of it as can be read. dwFlags is a
+	// combination of ATL_FORM_FLAGS. Returns TRUE on success or if more of
+	// the body is needed (see IsPending), FALSE on failure.
+	BOOL BeginParse(
+		LPCSTR szContentType,
+		DWORD dwBytesTotal,
+		DWORD dwBytesAvailable,
+		LPSTR pAvailableData,
+		DWORD dwFlags,
+		BOOL bAsync) noexcept
+	{
+		m_dwFlags = dwFlags;
+		m_bAsync = bAsync;
+		m_nState = ATL_MULTIPART_PREAMBLE;
+
+		if (!InitializeParser(szContentType, dwBytesTotal, dwBytesAvailable, pAvailableData))
+		{
+			return FALSE;
+		}
+
+		return ContinueMultiPartData();
+	}
+
+	// Parses as much of the body as has been read. Returns TRUE on success or if more of
+	// the body is needed (see IsPending), FALSE on failure.
+	ATL_NOINLINE BOOL ContinueMultiPartData() noexcept
+	{
+		T *pT = static_cast<T*>(this);
+
+		_ATLTRY
+		{
+			m_bNeedData = FALSE;
+
+			if (m_bReadFailed)
+			{
+				// the rest of the body will not come
+				if (m_nState == ATL_MULTIPART_FILE)
+				{
+					pT->AbortFile();
+				}
+				m_nState = ATL_MULTIPART_DONE;
+				return FALSE;
+			}
+
+			for (;;)
+			{
+				switch (m_nState)
+				{
+				case ATL_MULTIPART_PREAMBLE:
+					//Get to the first boundary
+					if (!ReadUntilBoundary(FALSE))
+					{
+						return m_bNeedData;
+					}
+					m_nState = ATL_MULTIPART_HEADERS;
+					break;
+
+				case ATL_MULTIPART_HEADERS:
+					if (m_bFinished)
+					{
+						m_nState = ATL_MULTIPART_DONE;
+						break;
+					}
+
+					// the headers of a part are parsed once they are all in the window
+					{
+						LPSTR szHeadersEnd = FindEndOfHeaders();
+						if (m_bNeedData)
+						{
+							return TRUE;
+						}
+						if (!ParsePartHeaders(szHeadersEnd))
+						{
+							return FALSE;
+						}
+					}
+					break;
+
+				case ATL_MULTIPART_FIELD:
+					if (!ReadUntilBoundary(TRUE))
+					{
+						return m_bNeedData;
+					}
+					m_nState = ATL_MULTIPART_HEADERS;
+					if (!pT->EndField(!((m_dwFlags & ATL_FORM_FLAG_IGNORE_EMPTY_FIELDS) && m_nPartSize == 0)))
+					{
+						return FALSE;
+					}
+					break;
+
+				case ATL_MULTIPART_FILE:
+					if (!ReadUntilBoundary(TRUE))
+					{
+						if (!m_bNeedData)
+						{
+							pT->AbortFile();
+						}
+						return m_bNeedData;
+					}
+					m_nState = ATL_MULTIPART_HEADERS;
+					if (!pT->EndFile(!((m_dwFlags & ATL_FORM_FLAG_IGNORE_EMPTY_FILES) && m_nPartSize == 0)))
+					{
+						return FALSE;
+					}
+					break;
+
+				case ATL_MULTIPART_SKIP:
+					if (!ReadUntilBoundary(FALSE))
+					{
+						return m_bNeedData;
+					}
+					m_nState = ATL_MULTIPART_HEADERS;
+					break;
+
+				default:
+					ATLASSERT(m_nState == ATL_MULTIPART_DONE);
+					return TRUE;
+				}
+			}
+		}
+		_ATLCATCHALL()
+		{
+			return FALSE;
+		}
+	}
+
+	// Returns TRUE if ContinueMultiPartData stopped to wait for more of the body.
+	BOOL IsPending() const noexcept
+	{
+		return m_bNeedData;
+	}
+
+	// Returns the space in the window that the next part of the body should be read into
+	// when IsPending returns TRUE.
+	BOOL GetReadBuffer(LPSTR *ppBuffer, DWORD *pdwLen) const noexcept
+	{
+		ATLENSURE_RETURN_VAL(ppBuffer != NULL, FALSE);
+		ATLENSURE_RETURN_VAL(pdwLen != NULL, FALSE);
+
+		if (!m_bNeedData)
+		{
+			return FALSE;
+		}
+
+		*ppBuffer = m_pEnd;
+		*pdwLen = GetWindowSpace();
+		return TRUE;
+	}
+
+	// Call this function when a read into the buffer returned by GetReadBuffer completes,
+	// with the number of bytes read and the Win32 error code of the read. A read that
+	// failed or read nothing, because the client closed the connection, makes
+	// ContinueMultiPartData fail.
+	void OnReadComplete(DWORD dwLen, DWORD dwError = 0) noexcept
+	{
+		ATLASSERT(m_bNeedData);
+
+		if (dwError != 0 || dwLen == 0)
+		{
+			m_bReadFailed = TRUE;
+			return;
+		}
+
+		ATLASSERT(dwLen <= GetWindowSpace());
+
+		m_pEnd += dwLen;
+		m_dwBodyRead += dwLen;
+	}
+
+protected:
+
+	// Implementation: the room left in the window for the rest of the body.
+	DWORD GetWindowSpace() const noexcept
+	{
+		DWORD dwSpace = (DWORD)(ATLS_MULTIPART_WINDOW_SIZE-(m_pEnd-m_pStart));
+		DWORD dwLeft = m_dwBodyTotal-m_dwBodyRead;
+		return dwSpace < dwLeft ? dwSpace : dwLeft;
+	}
+
+	// Implementation: reads the headers of the part at m_pCurrent, which end at
+	// szHeadersEnd, and moves on to the state that reads its data.
+	BOOL ParsePartHeaders(LPSTR szHeadersEnd)
+	{
+		T *pT = static_cast<T*>(this);
+
+		if (!szHeadersEnd)
+		{
+			pT->OnParseError("Malformed Form-Data");
+			return FALSE;
+		}
+
+		// the headers are all in the window, so the values point into it
+		// until the window is refilled
+		LPCSTR szName;
+		DWORD cchName;
+		BOOL bFound;
+
+		// look for "name" field
+		if (!GetMimeData(szHeadersEnd, "name=", sizeof("name=")-1, &szName, &cchName, &bFound, TRUE) || !bFound)
+		{
+			pT->OnParseError("Malformed Form-Data");
+			return FALSE;
+		}
+
+		// see if it's a file
+		LPCSTR szFileName;
+		DWORD cchFileName;
+		if (!GetMimeData(szHeadersEnd, "filename=", sizeof("filename=")-1, &szFileName, &cchFileName, &bFound, TRUE))
+		{
+			pT->OnParseError("Malformed Form-Data");
+			return FALSE;
+		}
+
+		if (bFound)
+		{
+			if (m_dwFlags & ATL_FORM_FLAG_REFUSE_FILES)
+			{
+				return FALSE;
+			}
+
+			if (!cchFileName)
+			{
+				m_nState = ATL_MULTIPART_SKIP;
+				return TRUE;
+			}
+
+			LPCSTR szContentType;
+			DWORD cchContentType;
+			if (!GetMimeData(szHeadersEnd, "Content-Type:", sizeof("Content-Type:")-1, &szContentType, &cchContentType, &bFound, TRUE))
+			{
+				pT->OnParseError("Malformed Form-Data");
+				return FALSE;
+			}
+			if (!bFound)
+			{
+				szContentType = NULL;
+				cchContentType = 0;
+			}
+
+			// move to the actual uploaded data
+			if (!MoveToData(szHeadersEnd))
+			{
+				pT->OnParseError("Malformed Form-Data");
+				return FALSE;
+			}
+
+			// if the user doesn't want files, don't save the file
+			if (m_dwFlags & ATL_FORM_FLAG_IGNORE_FILES)
+			{
+				m_nState = ATL_MULTIPART_SKIP;
+				return TRUE;
+			}
+
+			if (!pT->BeginFile(szName, cchName, szFileName, cchFileName, szContentType, cchContentType))
+			{
+				return FALSE;
+			}
+
+			m_nPartSize = 0;
+			m_nState = ATL_MULTIPART_FILE;
+			return TRUE;
+		}
+
+		// move to the actual uploaded data
+		if (!MoveToData(szHeadersEnd))
+		{
+			pT->OnParseError("Malformed Form-Data");
+			return FALSE;
+		}
+
+		if (!pT->BeginField(szName, cchName))
+		{
+			return FALSE;
+		}
+
+		m_nPartSize = 0;
+		m_nState = ATL_MULTIPART_FIELD;
+		return TRUE;
+	}
+
+	// case insensitive substring search -- does not handle multibyte characters (unlike tolower)
+	// allows searching up to a maximum point in a string
+	static char AtlCharLower(char ch) noexcept
+	{
+		if (ch > 64 && ch < 91)
+		{
+			return ch+32;
+		}
+
+		return ch;
+	}
+
+	static char * _stristr (const char * str1, const char * str2)
+	{
+		ATLENSURE(str1!=NULL);
+		ATLENSURE(str2!=NULL);
+		char *cp = (char *) str1;
+		char *s1, *s2;
+
+		if ( !*str2 )
+			return((char *)str1);
+
+		while (*cp)
+		{
+			s1 = cp;
+			s2 = (char *) str2;
+
+			while ( *s1 && *s2 && !(AtlCharLower(*s1)-AtlCharLower(*s2)) )
+			{
+				s1++, s2++;
+			}
+
+			if (!*s2)
+			{
+				return(cp);
+			}
+
+			cp++;
+		}
+
+		return(NULL);
+	}
+
+	static char * _stristrex (const char * str1, const char * str2, const char * str1End)
+	{
+		ATLENSURE(str1!=NULL);
+		ATLENSURE(str2!=NULL);
+		char *cp = (char *) str1;
+		char *s1, *s2;
+
+		if ( !*str2 )
+			return((char *)str1);
+
+		while (cp != str1End)
+		{
+			s1 = cp;
+			s2 = (char *) str2;
+
+			while ( s1 != str1End && *s2 && !(AtlCharLower(*s1)-AtlCharLower(*s2)) )
+			{
+				s1++, s2++;
+			}
+
+			if (!*s2)
+			{
+				return (cp);
+			}
+
+			if (s1 == str1End)
+			{
+				return (NULL);
+			}
+
+			cp++;
+		}
+
+		return(NULL);
+	}
+
+	static char * _strstrex (const char * str1, const char * str2, const char * str1End)
+	{
+		ATLENSURE(str1!=NULL);
+		ATLENSURE(str2!=NULL);
+		char *cp = (char *) str1;
+		char *s1, *s2;
+
+		if ( !*str2 )
+			return((char *)str1);
+
+		while (cp != str1End)
+		{
+			s1 = cp;
+			s2 = (char *) str2;
+
+			while ( s1 != str1End && *s2 && !((*s1)-(*s2)) )
+			{
+				s1++, s2++;
+			}
+
+			if (!*s2)
+			{
+				return (cp);
+			}
+
+			if (s1 == str1End)
+			{
+				return (NULL);
+			}
+
+			cp++;
+		}
+
+		return(NULL);
+	}
+
+	ATL_NOINLINE BOOL InitializeParser(
+		LPCSTR szContentType,
+		DWORD dwBytesTotal,
+		DWORD dwBytesAvailable,
+		LPSTR pAvailableData) noexcept
+	{
+		T *pT = static_cast<T*>(this);
+		ATLASSERT(szContentType != NULL);
+
+		_ATLTRY
+		{
+			m_dwBodyTotal = dwBytesTotal;
+			m_dwBodyAvailable = dwBytesAvailable;
+
+			// if greater than bytes available, read the body through a
+			// fixed-size window so memory use does not grow with the upload
+			if (dwBytesTotal > dwBytesAvailable)
+			{
+				m_pStart = (LPSTR) malloc(ATLS_MULTIPART_WINDOW_SIZE);
+				if (!m_pStart)
+				{
+					return FALSE;
+				}
+				m_bWindowed = TRUE;
+				m_pCurrent = m_pStart;
+				m_pEnd = m_pStart;
+				if (!FillWindow() && !m_bNeedData)
+				{
+					return FALSE;
+				}
+			}
+			else
+			{
+				m_pStart = pAvailableData;
+				m_pCurrent = m_pStart;
+				m_pEnd = m_pCurrent + dwBytesTotal;
+				m_dwBodyRead = dwBytesTotal;
+			}
+
+			//get the boundary
+			LPCSTR pszTmp = _stristr(szContentType, "boundary=");
+			if (!pszTmp)
+			{
+				pT->OnParseError("Malformed Form-Data");
+				return FALSE;
+			}
+
+			pszTmp += sizeof("boundary=")-1;
+			BOOL bInQuote = FALSE;
+			if (*pszTmp == '\"')
+			{
+				bInQuote = TRUE;
+				pszTmp++;
+			}
+
+			LPSTR pszMimeBoundary = m_szBoundary;
+			*pszMimeBoundary++ = '-';
+			*pszMimeBoundary++ = '-';
+			m_dwBoundaryLen = 2;
+			while (*pszTmp && (bInQuote || IsStandardBoundaryChar(*pszTmp)))
+			{
+				if (m_dwBoundaryLen >= MAX_MIME_BOUNDARY_LEN)
+				{
+					pT->OnParseError("Malformed MIME boundary");
+					return FALSE;
+				}
+
+				if (*pszTmp == '\r' || *pszTmp == '\n')
+				{
+					if (bInQuote)
+					{
+						pszTmp++;
+						continue;
+					}
+					break;
+				}
+				if (bInQuote && *pszTmp == '"')
+				{
+					break;
+				}
+
+				*pszMimeBoundary++ = *pszTmp++;
+				m_dwBoundaryLen++;
+			}
+
+			*pszMimeBoundary = '\0';
+
+			for (size_t i=0; i<256; i++)
+			{
+				m_rgBoundarySkip[i] = (BYTE) m_dwBoundaryLen;
+			}
+			for (DWORD i=0; i+1<m_dwBoundaryLen; i++)
+			{
+				m_rgBoundarySkip[(BYTE) m_szBoundary[i]] = (BYTE) (m_dwBoundaryLen-1-i);
+			}
+		}
+		_ATLCATCHALL()
+		{
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	// Implementation: offset in the request body of a position in the window.
+	DWORD GetBodyOffset(LPCSTR p) const noexcept
+	{
+		return m_dwWindowBase + (DWORD)(p - m_pStart);
+	}
+
+	// Implementation: moves the unparsed data, and the two bytes before it, to the
+	// start of the window and reads more of the body after it. Returns FALSE if
+	// the whole body has been read, the window is full, or the parser is waiting
+	// for data (m_bNeedData). Pointers into the window other than m_pCurrent and
+	// m_pEnd are not valid after this returns TRUE.
+	ATL_NOINLINE BOOL FillWindow() noexcept
+	{
+		C_ASSERT(ATLS_MULTIPART_WINDOW_SIZE >= 4*(MAX_MIME_BOUNDARY_LEN+2));
+
+		if (!m_bWindowed || m_dwBodyRead >= m_dwBodyTotal)
+		{
+			return FALSE;
+		}
+
+		// ReadUntilBoundary looks for the line break before a boundary at m_pCurrent
+		LPSTR pKeep = m_pCurrent - ((m_pCurrent-m_pStart) < 2 ? (m_pCurrent-m_pStart) : 2);
+		if (pKeep != m_pStart)
+		{
+			size_t nShift = pKeep-m_pStart;
+			memmove(m_pStart, pKeep, m_pEnd-pKeep);
+			m_dwWindowBase += (DWORD)nShift;
+			m_pCurrent -= nShift;
+			m_pEnd -= nShift;
+		}
+
+		DWORD dwLen = GetWindowSpace();
+		if (dwLen == 0)
+		{
+			static_cast<T*>(this)->OnParseError("Form-Data part headers do not fit in ATLS_MULTIPART_WINDOW_SIZE");
+			return FALSE;
+		}
+
+		if (m_bAsync)
+		{
+			// only the data the server already has can be read without blocking;
+			// the caller reads the rest into the window with OnReadComplete
+			if (m_dwBodyRead >= m_dwBodyAvailable)
+			{
+				m_bNeedData = TRUE;
+				return FALSE;
+			}
+			if (dwLen > m_dwBodyAvailable-m_dwBodyRead)
+			{
+				dwLen = m_dwBodyAvailable-m_dwBodyRead;
+			}
+		}
+
+		if (!static_cast<T*>(this)->ReadClient(m_pEnd, &dwLen, m_dwBodyRead) || dwLen == 0)
+		{
+			return FALSE;
+		}
+
+		m_pEnd += dwLen;
+		m_dwBodyRead += dwLen;
+		return TRUE;
+	}
+
+	// Implementation: finds the blank line that ends the headers of the current part,
+	// reading more of the body as needed. Returns NULL if there is none.
+	LPSTR FindEndOfHeaders() noexcept
+	{
+		for (;;)
+		{
+			LPSTR szEnd = _strstrex(m_pCurrent, "\r\n\r\n", m_pEnd);
+
+			// make sure the data after the headers has started, too
+			if (szEnd && szEnd+4 < m_pEnd)
+			{
+				return szEnd;
+			}
+
+			if (!FillWindow())
+			{
+				return szEnd;
+			}
+		}
+	}
+
+	// Implementation: Boyer-Moore-Horspool search for m_szBoundary in [szStart, szEnd).
+	LPSTR FindBoundary(LPSTR szStart, LPSTR szEnd) const noexcept
+	{
+		DWORD dwLast = m_dwBoundaryLen-1;
+		CHAR chLast = m_szBoundary[dwLast];
+
+		while (szEnd-szStart >= (ptrdiff_t)m_dwBoundaryLen)
+		{
+			CHAR ch = szStart[dwLast];
+			if (ch == chLast && memcmp(szStart, m_szBoundary, dwLast) == 0)
+			{
+				return szStart;
+			}
+			szStart += m_rgBoundarySkip[(BYTE) ch];
+		}
+
+		return NULL;
+	}
+
+	// Implementation: hands the part data in [szStart, szEnd) to T if bWrite is TRUE.
+	BOOL WriteData(BOOL bWrite, LPCSTR szStart, LPCSTR szEnd)
+	{
+		if (szEnd < szStart)
+		{
+			// a boundary that overlaps the end of the part headers
+			return !bWrite;
+		}
+
+		if (bWrite && szEnd != szStart)
+		{
+			if (!static_cast<T*>(this)->WritePartData(szStart, (DWORD)(szEnd-szStart)))
+			{
+				return FALSE;
+			}
+			m_nPartSize += (DWORD)(szEnd-szStart);
+		}
+
+		return TRUE;
+	}
+
+	BOOL MoveToData(LPSTR szHeadersEnd) noexcept
+	{
+		m_pCurrent = szHeadersEnd+4;
+		if (m_pCurrent >= m_pEnd)
+		{
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	// Implementation: finds szField in the headers at m_pCurrent, which end at
+	// szHeadersEnd, and returns its value in *pszValue and *pcchValue.
+	BOOL GetMimeData(
+		LPSTR szHeadersEnd,
+		LPCSTR szField,
+		DWORD dwFieldLen,
+		LPCSTR *pszValue,
+		DWORD *pcchValue,
+		BOOL *pbFound,
+		BOOL bIgnoreCase = FALSE)
+	{
+		ATLASSERT( szField != NULL );
+		ATLENSURE( pbFound != NULL );
+
+		*pbFound = FALSE;
+
+		LPSTR szDataStart = NULL;
+
+		if (!bIgnoreCase)
+		{
+			szDataStart = _strstrex(m_pCurrent, szField, szHeadersEnd);
+		}
+		else
+		{
+			szDataStart = _stristrex(m_pCurrent, szField, szHeadersEnd);
+		}
+
+		if (szDataStart)
+		{
+			szDataStart+= dwFieldLen;
+			if (szDataStart >= m_pEnd)
+			{
+				return FALSE;
+			}
+
+			BOOL bInQuote = FALSE;
+			if (*szDataStart == '\"')
+			{
+				bInQuote = TRUE;
+				szDataStart++;
+			}
+
+			// the white space before an unquoted value is not part of it
+			while (!bInQuote && (szDataStart < m_pEnd) && (*szDataStart == ' ' || *szDataStart == '\t'))
+			{
+				szDataStart++;
+			}
+
+			LPSTR szDataEnd = szDataStart;
+
+			if (szDataEnd >= m_pEnd)
+			{
+				return FALSE;
+			}
+
+			while (szDataEnd < m_pEnd)
+			{
+				if (!IsValidTokenChar(*szDataEnd))
+				{
+					if (*szDataEnd == '\"' || !bInQuote)
+					{
+						break;
+					}
+				}
+				szDataEnd++;
+			}
+
+			if (szDataEnd >= m_pEnd)
+			{
+				return FALSE;
+			}
+
+			*pszValue = szDataStart;
+			*pcchValue = (DWORD)(szDataEnd-szDataStart);
+			*pbFound = TRUE;
+		}
+
+		return TRUE;
+	}
+
+	// Implementation: reads the data of the current part up to the next boundary and
+	// hands it to T if bWrite is TRUE, a window at a time if the body is windowed.
+	// If this returns FALSE with m_bNeedData set, call it again with the same
+	// argument once more of the body has been read.
+	ATL_NOINLINE BOOL ReadUntilBoundary(BOOL bWrite) noexcept
+	{
+		_ATLTRY
+		{
+			LPSTR szSearch = m_pCurrent;
+			LPSTR szBoundaryStart = NULL;
+			LPSTR szBoundaryEnd = NULL;
+
+			for (;;)
+			{
+				szBoundaryStart = FindBoundary(szSearch, m_pEnd);
+				if (szBoundaryStart)
+				{
+					if (GetBodyOffset(szBoundaryStart) >= 2)
+					{
+						if (*(szBoundaryStart-1) != 0x0a || *(szBoundaryStart-2) != 0x0d)
+						{
+							szSearch = szBoundaryStart+1;
+							continue;
+						}
+					}
+					szBoundaryEnd = szBoundaryStart+m_dwBoundaryLen;
+
+					// the last boundary may end the body
+					if (szBoundaryEnd+2 <= m_pEnd && szBoundaryEnd[0] == '-' && szBoundaryEnd[1] == '-')
+					{
+						m_bFinished = TRUE;
+						break;
+					}
+
+					// any other is followed by the headers of a part
+					if (szBoundaryEnd+2 < m_pEnd)
+					{
+						if (szBoundaryEnd[0] == '\r' && szBoundaryEnd[1] == '\n')
+						{
+							break;
+						}
+						szSearch = szBoundaryStart+1;
+						continue;
+					}
+				}
+
+				// The boundary is not all in the window yet. Hand off the data that
+				// cannot be part of it or of the line break before it, then read more.
+				LPSTR szSafe = m_pEnd - ((size_t)(m_pEnd-m_pCurrent) < (size_t)(m_dwBoundaryLen+1) ?
+					(size_t)(m_pEnd-m_pCurrent) : (size_t)(m_dwBoundaryLen+1));
+				if (szBoundaryStart && szBoundaryStart-2 < szSafe)
+				{
+					szSafe = (szBoundaryStart-2 > m_pCurrent) ? szBoundaryStart-2 : m_pCurrent;
+				}
+
+				if (!m_bWindowed || m_dwBodyRead >= m_dwBodyTotal)
+				{
+					return FALSE;
+				}
+
+				if (!WriteData(bWrite, m_pCurrent, szSafe))
+				{
+					return FALSE;
+				}
+
+				m_pCurrent = szSafe;
+				if (!FillWindow())
+				{
+					return FALSE;
+				}
+				szSearch = m_pCurrent;
+			}
+
+			LPSTR szDataEnd = szBoundaryStart;
+			if (GetBodyOffset(szBoundaryStart) >= 2)
+			{
+				szDataEnd-= 2;
+			}
+			if (!WriteData(bWrite, m_pCurrent, szDataEnd))
+			{
+				return FALSE;
+			}
+
+			if (!m_bFinished)
+			{
+				m_pCurrent = szBoundaryEnd+2;
+				if (m_pCurrent >= m_pEnd)
+				{
+					return FALSE;
+				}
+			}
+
+			return TRUE;
+		}
+		_ATLCATCHALL()
+		{
+			return FALSE;
+		}
+	}
+
+	static BOOL IsStandardBoundaryChar(CHAR ch) noexcept
+	{
+		if ( (ch >= 'A' && ch <= 'Z') ||
+			 (ch >= 'a' && ch <= 'z') ||
+			 (ch >= '0' && ch <= '9') ||
+			 (ch == '\'') ||
+			 (ch == '+')  ||
+			 (ch == '_')  ||
+			 (ch == '-')  ||
+			 (ch == '=')  ||
+			 (ch == '?') )
+		{
+			return TRUE;
+		}
+
+		return FALSE;
+	}
+
+	static BOOL IsValidTokenChar(CHAR ch) noexcept
+	{
+		return ( (ch != 0) && (ch != 0xd) && (ch != 0xa) && (ch != ' ') && (ch != '\"') );
+	}
+
+private:
+	// Prevents copying.
+	CAtlMultiPartParser(const CAtlMultiPartParser& /*that*/) noexcept
+	{
+		ATLASSERT(FALSE);
+	}
+
+	const CAtlMultiPartParser& operator=(const CAtlMultiPartParser& /*that*/) noexcept
+	{
+		ATLASSERT(FALSE);
+		return (*this);
+	}
+}; // class CAtlMultiPartParser
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLMULTIPART_H__
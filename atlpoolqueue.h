@@ -0,0 +1,357 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLPOOLQUEUE_H__
+#define __ATLPOOLQUEUE_H__
+
+#pragma once
+
+// The per-worker queues of CWorkStealingThreadPool in atlisapi.h, and the
+// way its workers take, steal and wait for requests. The locks, the wake
+// events and the threads come from the including code, and the rest only
+// relies on the basic ATL types and macros (DWORD, LONG, BOOL, HRESULT,
+// ATLTRY) and the Interlocked functions, which the including file must
+// provide, so that it can be exercised outside of a Windows build.
+
+// Values for AtlServerRequest::dwQueueInfo
+#define  ATLSRV_QUEUE_DEPTH_MASK 0x7FFFFFFF
+#define  ATLSRV_QUEUE_STOLEN     0x80000000
+
+// Initial capacity of each worker's request queue. The queue grows
+// as needed.
+#ifndef ATLS_POOL_QUEUE_SIZE
+#define ATLS_POOL_QUEUE_SIZE 32
+#endif
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+//
+// CAtlPoolQueue
+// A growable ring of requests, guarded by its own lock. Once Close has
+// been called, Push fails so the request goes to another worker.
+//
+// TLock provides Init, Term, Lock and Unlock like CComCriticalSection,
+// and BOOL TryLock(), which takes the lock only if it is free.
+template <class RequestType, class TLock>
+class CAtlPoolQueue
+{
+public:
+	TLock m_cs;
+	RequestType *m_pRequests;
+	DWORD m_nSize;
+	DWORD m_nHead;
+	volatile LONG m_nCount;
+	BOOL m_bClosed;
+
+	CAtlPoolQueue() noexcept :
+		m_pRequests(NULL), m_nSize(0), m_nHead(0), m_nCount(0), m_bClosed(FALSE)
+	{
+	}
+
+	~CAtlPoolQueue() noexcept
+	{
+		delete [] m_pRequests;
+	}
+
+	HRESULT Init() noexcept
+	{
+		return m_cs.Init();
+	}
+
+	void Term() noexcept
+	{
+		m_cs.Term();
+	}
+
+	BOOL Push(RequestType request, DWORD *pnDepth) noexcept
+	{
+		if (FAILED(m_cs.Lock()))
+			return FALSE;
+
+		BOOL bRet = FALSE;
+		if (!m_bClosed && Grow())
+		{
+			m_pRequests[(m_nHead + m_nCount) % m_nSize] = request;
+			*pnDepth = (DWORD) InterlockedIncrement(&m_nCount);
+			bRet = TRUE;
+		}
+		m_cs.Unlock();
+		return bRet;
+	}
+
+	// when bTry is TRUE, gives up rather than waiting for the lock
+	BOOL Pop(RequestType *pRequest, DWORD *pnDepth, BOOL bTry) noexcept
+	{
+		// cheap check without the lock, so idle scans skip empty queues
+		if (m_nCount == 0)
+			return FALSE;
+
+		if (bTry)
+		{
+			if (!m_cs.TryLock())
+				return FALSE;
+		}
+		else if (FAILED(m_cs.Lock()))
+		{
+			return FALSE;
+		}
+
+		BOOL bRet = FALSE;
+		if (m_nCount != 0)
+		{
+			*pnDepth = (DWORD) m_nCount;
+			*pRequest = m_pRequests[m_nHead];
+			m_nHead = (m_nHead + 1) % m_nSize;
+			InterlockedDecrement(&m_nCount);
+			bRet = TRUE;
+		}
+		m_cs.Unlock();
+		return bRet;
+	}
+
+	// closes the queue and adds whatever it still holds to requests,
+	// which has an Add method like CAtlArray
+	template <class TArray>
+	void Close(TArray& requests) noexcept
+	{
+		if (FAILED(m_cs.Lock()))
+			return;
+
+		m_bClosed = TRUE;
+		_ATLTRY
+		{
+			while (m_nCount != 0)
+			{
+				requests.Add(m_pRequests[m_nHead]);
+				m_nHead = (m_nHead + 1) % m_nSize;
+				InterlockedDecrement(&m_nCount);
+			}
+		}
+		_ATLCATCHALL()
+		{
+			// the requests left behind stay in the queue and are
+			// still taken by the workers that steal from it
+			m_bClosed = FALSE;
+		}
+		m_cs.Unlock();
+	}
+
+	void Open() noexcept
+	{
+		if (SUCCEEDED(m_cs.Lock()))
+		{
+			m_bClosed = FALSE;
+			m_cs.Unlock();
+		}
+	}
+
+protected:
+	// makes room for one more request; called with the lock held
+	BOOL Grow() noexcept
+	{
+		if ((DWORD) m_nCount != m_nSize)
+			return TRUE;
+
+		DWORD nNewSize = m_nSize ? m_nSize*2 : ATLS_POOL_QUEUE_SIZE;
+		if (nNewSize < m_nSize)
+			return FALSE;
+
+		RequestType *pNew = NULL;
+		ATLTRY(pNew = new RequestType[nNewSize]);
+		if (pNew == NULL)
+			return FALSE;
+
+		for (DWORD i = 0; i < (DWORD) m_nCount; i++)
+			pNew[i] = m_pRequests[(m_nHead + i) % m_nSize];
+
+		delete [] m_pRequests;
+		m_pRequests = pNew;
+		m_nSize = nNewSize;
+		m_nHead = 0;
+		return TRUE;
+	}
+}; // class CAtlPoolQueue
+
+// What CAtlWorkStealingScheduler keeps for each worker. The pool derives
+// its own slots from this to add the thread and the wake event.
+template <class RequestType, class TLock>
+struct CAtlPoolWorkerSlot
+{
+	DWORD nIndex;
+	volatile LONG lIdle;		// 1 while the worker waits to be woken
+	volatile LONG lExit;		// 1 when the worker should exit once it runs out of requests
+	CAtlPoolQueue<RequestType, TLock> queue;
+};
+
+//
+// CAtlWorkStealingScheduler
+// Spreads requests over the worker queues and hands them to the workers.
+// A request goes to the worker that last ran it, or failing that to the
+// next worker in turn. A worker takes the oldest request from its own
+// queue, or failing that steals one from another worker's queue, and
+// waits to be woken when there is nothing left to take anywhere.
+//
+// m_ppSlots holds the first m_nWorkers slots. T derives from
+// CAtlWorkStealingScheduler and provides
+//     void WakeWorker(CSlot *pSlot);    // wakes a worker in WaitForWake
+//     void WaitForWake(CSlot *pSlot);   // waits until WakeWorker is called
+// where a WakeWorker call made before WaitForWake is not lost.
+template <class T, class RequestType, class TLock>
+class CAtlWorkStealingScheduler
+{
+public:
+	typedef CAtlPoolWorkerSlot<RequestType, TLock> CSlot;
+
+	CSlot **m_ppSlots;
+	volatile LONG m_nWorkers;
+	volatile LONG m_lNextWorker;
+	volatile LONG m_lIdleWorkers;
+	volatile LONG m_lQueued;
+	volatile LONG m_lStolen;
+
+	CAtlWorkStealingScheduler() noexcept :
+		m_ppSlots(NULL),
+		m_nWorkers(0),
+		m_lNextWorker(0),
+		m_lIdleWorkers(0),
+		m_lQueued(0),
+		m_lStolen(0)
+	{
+	}
+
+	// Queues a request for worker dwWorker (1 based), or for the next
+	// worker in turn if dwWorker is 0 or no longer runs.
+	BOOL Queue(RequestType request, DWORD dwWorker) noexcept
+	{
+		DWORD nWorkers = (DWORD) m_nWorkers;
+		if (nWorkers == 0)
+			return FALSE;
+
+		DWORD nTarget;
+		if (dwWorker != 0 && dwWorker <= nWorkers)
+			nTarget = dwWorker - 1;
+		else
+			nTarget = (DWORD) InterlockedIncrement(&m_lNextWorker) % nWorkers;
+
+		for (DWORD i = 0; i < nWorkers; i++)
+		{
+			CSlot *pSlot = m_ppSlots[(nTarget + i) % nWorkers];
+			DWORD nDepth;
+			InterlockedIncrement(&m_lQueued);
+			if (pSlot->queue.Push(request, &nDepth))
+			{
+				Wake(pSlot);
+				return TRUE;
+			}
+			InterlockedDecrement(&m_lQueued);
+		}
+		return FALSE;
+	}
+
+	// wakes the target worker if it is idle, otherwise any idle worker
+	// so that it can steal the request
+	void Wake(CSlot *pTarget) noexcept
+	{
+		T *pT = static_cast<T*>(this);
+		if (InterlockedCompareExchange(&pTarget->lIdle, 0, 1) == 1)
+		{
+			pT->WakeWorker(pTarget);
+			return;
+		}
+
+		if (m_lIdleWorkers == 0)
+			return;
+
+		DWORD nWorkers = (DWORD) m_nWorkers;
+		for (DWORD i = 0; i < nWorkers; i++)
+		{
+			CSlot *pSlot = m_ppSlots[i];
+			if (InterlockedCompareExchange(&pSlot->lIdle, 0, 1) == 1)
+			{
+				pT->WakeWorker(pSlot);
+				return;
+			}
+		}
+	}
+
+	// takes the oldest request from the worker's own queue, or failing
+	// that steals one from another worker. When bTry is TRUE, queues
+	// whose lock is held by someone else are skipped.
+	BOOL TakeRequest(CSlot *pSlot, RequestType *pRequest, DWORD *pdwQueueInfo, BOOL bTry) noexcept
+	{
+		DWORD nDepth;
+		if (pSlot->queue.Pop(pRequest, &nDepth, FALSE))
+		{
+			InterlockedDecrement(&m_lQueued);
+			*pdwQueueInfo = nDepth & ATLSRV_QUEUE_DEPTH_MASK;
+			return TRUE;
+		}
+
+		DWORD nWorkers = (DWORD) m_nWorkers;
+		for (DWORD i = 1; i <= nWorkers; i++)
+		{
+			CSlot *pVictim = m_ppSlots[(pSlot->nIndex + i) % nWorkers];
+			if (pVictim == pSlot)
+				continue;
+
+			if (pVictim->queue.Pop(pRequest, &nDepth, bTry))
+			{
+				InterlockedDecrement(&m_lQueued);
+				InterlockedIncrement(&m_lStolen);
+				*pdwQueueInfo = (nDepth & ATLSRV_QUEUE_DEPTH_MASK) | ATLSRV_QUEUE_STOLEN;
+				return TRUE;
+			}
+		}
+		return FALSE;
+	}
+
+	// Takes the worker's next request, waiting until there is one. Returns
+	// FALSE when the worker has been told to exit and has nothing to take.
+	BOOL WaitForRequest(CSlot *pSlot, RequestType *pRequest, DWORD *pdwQueueInfo) noexcept
+	{
+		for (;;)
+		{
+			if (TakeRequest(pSlot, pRequest, pdwQueueInfo, TRUE))
+				return TRUE;
+
+			if (pSlot->lExit)
+				return FALSE;
+
+			// announce that we are idle before looking one last time, so a
+			// request queued after the look is sure to wake us. The last
+			// look waits for the queue locks, and looks again while requests
+			// are counted as queued: they are on their way into a queue or
+			// being taken from one, and a worker that sleeps through them
+			// may not be woken again while another worker is blocked.
+			InterlockedIncrement(&m_lIdleWorkers);
+			InterlockedExchange(&pSlot->lIdle, 1);
+			BOOL bTaken;
+			do
+			{
+				bTaken = TakeRequest(pSlot, pRequest, pdwQueueInfo, FALSE);
+			}
+			while (!bTaken && m_lQueued > 0 && !pSlot->lExit);
+
+			if (!bTaken && !pSlot->lExit)
+				static_cast<T*>(this)->WaitForWake(pSlot);
+			InterlockedExchange(&pSlot->lIdle, 0);
+			InterlockedDecrement(&m_lIdleWorkers);
+
+			if (bTaken)
+				return TRUE;
+		}
+	}
+}; // class CAtlWorkStealingScheduler
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLPOOLQUEUE_H__
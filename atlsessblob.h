@@ -0,0 +1,367 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLSESSBLOB_H__
+#define __ATLSESSBLOB_H__
+
+#pragma once
+
+// The layout of the packed session variables behind CSessionBlob in
+// atlsession.h. Values are kept as opaque bytes here; CSessionBlob reads
+// and writes them as VARIANTs. It only relies on the basic ATL types
+// (BYTE, DWORD, LPCSTR, HRESULT), CHeapPtr, AtlAdd, AtlMultiply and
+// Checked::memcpy_s, which the including file must provide, so that it
+// can be exercised outside of a Windows build.
+
+#include <string.h>
+#include <limits.h>
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+// The packed variables of a session are one contiguous buffer:
+//
+//   ATL_SESSION_BLOB_HEADER    signature and number of variables
+//   ATL_SESSION_BLOB_ENTRY[]   index, with one entry per variable
+//   data                       for each variable, its name (not nul
+//                              terminated) followed by its value
+//
+// Offsets in the index are from the start of the buffer. A variable is
+// found and read through the index without reading any of the other
+// values. An empty blob (no buffer at all) holds no variables.
+#define ATL_SESSION_BLOB_SIGNATURE 0x31425341 // "ASB1"
+
+struct ATL_SESSION_BLOB_HEADER
+{
+	DWORD dwSignature;
+	DWORD nCount;
+};
+
+struct ATL_SESSION_BLOB_ENTRY
+{
+	DWORD dwHash;	// hash of the name
+	DWORD dwOffset;	// offset of the name. The value follows the name.
+	DWORD cbName;
+	DWORD cbValue;
+};
+
+class CSessionBlobBase
+{
+public:
+	CSessionBlobBase() noexcept :
+		m_cbData(0)
+	{
+	}
+
+	const BYTE* GetData() const noexcept
+	{
+		return m_buffer;
+	}
+
+	DWORD GetSize() const noexcept
+	{
+		return m_cbData;
+	}
+
+	DWORD GetCount() const noexcept
+	{
+		return m_cbData ? GetHeader()->nCount : 0;
+	}
+
+	void Empty() noexcept
+	{
+		m_buffer.Free();
+		m_cbData = 0;
+	}
+
+	// Copies packed data into the blob, after checking
+	// that its index is consistent with its size.
+	HRESULT Load(const BYTE *pData, DWORD cbData) noexcept
+	{
+		Empty();
+		if (!cbData)
+			return S_OK;
+
+		if (!pData)
+			return E_INVALIDARG;
+
+		if (!IsValid(pData, cbData))
+			return E_FAIL;
+
+		if (!m_buffer.Allocate(cbData))
+			return E_OUTOFMEMORY;
+
+		Checked::memcpy_s(m_buffer, cbData, pData, cbData);
+		m_cbData = cbData;
+		return S_OK;
+	}
+
+	// Returns the index of the variable, or -1 if the blob doesn't hold it.
+	int Find(LPCSTR szName) const noexcept
+	{
+		if (!szName)
+			return -1;
+
+		DWORD cbName = (DWORD) strlen(szName);
+		DWORD dwHash = HashName(szName, cbName);
+		DWORD nCount = GetCount();
+		for (DWORD i=0; i<nCount; i++)
+		{
+			const ATL_SESSION_BLOB_ENTRY *pEntry = GetEntry(i);
+			if (pEntry->dwHash == dwHash &&
+				pEntry->cbName == cbName &&
+				!memcmp(m_buffer.m_pData + pEntry->dwOffset, szName, cbName))
+				return (int) i;
+		}
+		return -1;
+	}
+
+	// Returns the name of the variable at nIndex. The name
+	// is not nul terminated; its length is returned in *pcbName.
+	LPCSTR GetNameAt(DWORD nIndex, DWORD *pcbName) const noexcept
+	{
+		ATLASSERT(nIndex < GetCount());
+		ATLASSERT(pcbName);
+		const ATL_SESSION_BLOB_ENTRY *pEntry = GetEntry(nIndex);
+		*pcbName = pEntry->cbName;
+		return reinterpret_cast<LPCSTR>(m_buffer.m_pData + pEntry->dwOffset);
+	}
+
+	// Returns the value of the variable at nIndex; its length
+	// is returned in *pcbValue.
+	const BYTE* GetValueAt(DWORD nIndex, DWORD *pcbValue) const noexcept
+	{
+		ATLASSERT(nIndex < GetCount());
+		ATLASSERT(pcbValue);
+		const ATL_SESSION_BLOB_ENTRY *pEntry = GetEntry(nIndex);
+		*pcbValue = pEntry->cbValue;
+		return m_buffer.m_pData + pEntry->dwOffset + pEntry->cbName;
+	}
+
+	// Replaces, adds or, if pValue is NULL, removes one variable. The
+	// other variables are copied across as they are. Returns S_FALSE if
+	// asked to remove a variable the blob doesn't hold.
+	HRESULT SetValue(LPCSTR szName, const BYTE *pValue, DWORD cbValue) noexcept
+	{
+		if (!szName)
+			return E_INVALIDARG;
+
+		size_t nLen = strlen(szName);
+		if (nLen > INT_MAX)
+			return E_INVALIDARG;
+		DWORD cbName = (DWORD) nLen;
+
+		int nOld = Find(szName);
+		if (nOld < 0 && !pValue)
+			return S_FALSE;
+		if (!pValue)
+			cbValue = 0;
+
+		DWORD nCount = GetCount();
+		DWORD nNewCount = nCount;
+		if (nOld >= 0)
+			nNewCount--;
+		if (pValue)
+			nNewCount++;
+		if (!nNewCount)
+		{
+			Empty();
+			return S_OK;
+		}
+
+		HRESULT hr = S_OK;
+		DWORD cbNames = pValue ? cbName : 0;
+		DWORD cbValues = cbValue;
+		for (DWORD i=0; hr == S_OK && i<nCount; i++)
+		{
+			if ((int) i == nOld)
+				continue;
+			const ATL_SESSION_BLOB_ENTRY *pEntry = GetEntry(i);
+			hr = ::ATL::AtlAdd(&cbNames, cbNames, pEntry->cbName);
+			if (hr == S_OK)
+				hr = ::ATL::AtlAdd(&cbValues, cbValues, pEntry->cbValue);
+		}
+
+		CHeapPtr<BYTE> buffer;
+		DWORD cbData = 0;
+		if (hr == S_OK)
+			hr = AllocateBlob(buffer, nNewCount, cbNames, cbValues, &cbData);
+		if (hr != S_OK)
+			return hr;
+
+		// A replaced variable keeps its place in the index,
+		// a new one goes at the end.
+		DWORD dwOffset = GetDataOffset(nNewCount);
+		DWORD nIndex = 0;
+		for (DWORD i=0; i<nCount; i++)
+		{
+			if ((int) i == nOld)
+			{
+				if (pValue)
+					AppendEntry(buffer, cbData, nIndex++, dwOffset, szName, cbName, pValue, cbValue);
+			}
+			else
+			{
+				const ATL_SESSION_BLOB_ENTRY *pEntry = GetEntry(i);
+				const BYTE *pOld = m_buffer.m_pData + pEntry->dwOffset;
+				AppendEntry(buffer, cbData, nIndex++, dwOffset,
+							reinterpret_cast<LPCSTR>(pOld), pEntry->cbName,
+							pOld + pEntry->cbName, pEntry->cbValue);
+			}
+		}
+		if (nOld < 0)
+			AppendEntry(buffer, cbData, nIndex++, dwOffset, szName, cbName, pValue, cbValue);
+
+		ATLASSERT(nIndex == nNewCount);
+		ATLASSERT(dwOffset == cbData);
+		Replace(buffer, cbData);
+		return S_OK;
+	}
+
+	// Works out the size of the blob after SetValue(szName, pValue, cbValue),
+	// from the index alone.
+	HRESULT GetSizeWithValue(LPCSTR szName, DWORD cbValue, DWORD *pcbData) const noexcept
+	{
+		if (!szName)
+			return E_INVALIDARG;
+		if (!pcbData)
+			return E_INVALIDARG;
+
+		size_t nLen = strlen(szName);
+		if (nLen > INT_MAX)
+			return E_INVALIDARG;
+
+		DWORD cbData = m_cbData ? m_cbData : (DWORD) sizeof(ATL_SESSION_BLOB_HEADER);
+		int nOld = Find(szName);
+		if (nOld >= 0)
+		{
+			const ATL_SESSION_BLOB_ENTRY *pEntry = GetEntry((DWORD) nOld);
+			cbData -= (DWORD) sizeof(ATL_SESSION_BLOB_ENTRY) + pEntry->cbName + pEntry->cbValue;
+		}
+
+		HRESULT hr = ::ATL::AtlAdd(&cbData, cbData, (DWORD) sizeof(ATL_SESSION_BLOB_ENTRY));
+		if (hr == S_OK)
+			hr = ::ATL::AtlAdd(&cbData, cbData, (DWORD) nLen);
+		if (hr == S_OK)
+			hr = ::ATL::AtlAdd(&cbData, cbData, cbValue);
+		if (hr == S_OK)
+			*pcbData = cbData;
+		return hr;
+	}
+
+	static bool IsValid(const BYTE *pData, DWORD cbData) noexcept
+	{
+		ATL_SESSION_BLOB_HEADER header;
+		if (!pData || cbData < sizeof(header))
+			return false;
+
+		// The data may not be aligned, so copy the header and index entries out.
+		Checked::memcpy_s(&header, sizeof(header), pData, sizeof(header));
+		if (header.dwSignature != ATL_SESSION_BLOB_SIGNATURE ||
+			header.nCount > (cbData - sizeof(header)) / sizeof(ATL_SESSION_BLOB_ENTRY))
+			return false;
+
+		DWORD dwDataOffset = GetDataOffset(header.nCount);
+		for (DWORD i=0; i<header.nCount; i++)
+		{
+			ATL_SESSION_BLOB_ENTRY entry;
+			Checked::memcpy_s(&entry, sizeof(entry),
+				pData + sizeof(header) + i*sizeof(entry), sizeof(entry));
+			if (entry.dwOffset < dwDataOffset ||
+				entry.dwOffset > cbData ||
+				entry.cbName > cbData - entry.dwOffset ||
+				entry.cbValue > cbData - entry.dwOffset - entry.cbName)
+				return false;
+		}
+		return true;
+	}
+
+	static DWORD HashName(LPCSTR szName, DWORD cbName) noexcept
+	{
+		DWORD dwHash = 0;
+		for (DWORD i=0; i<cbName; i++)
+			dwHash = (dwHash<<5)+dwHash+(BYTE) szName[i];
+		return dwHash;
+	}
+
+// Implementation
+protected:
+	const ATL_SESSION_BLOB_HEADER* GetHeader() const noexcept
+	{
+		return reinterpret_cast<const ATL_SESSION_BLOB_HEADER*>(m_buffer.m_pData);
+	}
+
+	const ATL_SESSION_BLOB_ENTRY* GetEntry(DWORD nIndex) const noexcept
+	{
+		return reinterpret_cast<const ATL_SESSION_BLOB_ENTRY*>(m_buffer.m_pData + sizeof(ATL_SESSION_BLOB_HEADER)) + nIndex;
+	}
+
+	static DWORD GetDataOffset(DWORD nCount) noexcept
+	{
+		return (DWORD)(sizeof(ATL_SESSION_BLOB_HEADER) + nCount*sizeof(ATL_SESSION_BLOB_ENTRY));
+	}
+
+	// Allocates a blob for nCount variables and writes its header.
+	static HRESULT AllocateBlob(CHeapPtr<BYTE>& buffer, DWORD nCount, DWORD cbNames, DWORD cbValues, DWORD *pcbData) noexcept
+	{
+		DWORD cbIndex = 0;
+		DWORD cbData = 0;
+		if (FAILED(::ATL::AtlMultiply(&cbIndex, nCount, (DWORD) sizeof(ATL_SESSION_BLOB_ENTRY))) ||
+			FAILED(::ATL::AtlAdd(&cbData, cbIndex, (DWORD) sizeof(ATL_SESSION_BLOB_HEADER))) ||
+			FAILED(::ATL::AtlAdd(&cbData, cbData, cbNames)) ||
+			FAILED(::ATL::AtlAdd(&cbData, cbData, cbValues)))
+			return E_OUTOFMEMORY;
+
+		if (!buffer.Allocate(cbData))
+			return E_OUTOFMEMORY;
+
+		ATL_SESSION_BLOB_HEADER *pHeader = reinterpret_cast<ATL_SESSION_BLOB_HEADER*>(buffer.m_pData);
+		pHeader->dwSignature = ATL_SESSION_BLOB_SIGNATURE;
+		pHeader->nCount = nCount;
+		*pcbData = cbData;
+		return S_OK;
+	}
+
+	// Writes the index entry for one variable and copies its name
+	// and value to dwOffset, which is moved past them.
+	static void AppendEntry(BYTE *pBlob, DWORD cbBlob, DWORD nIndex, DWORD& dwOffset,
+							LPCSTR szName, DWORD cbName, const BYTE *pValue, DWORD cbValue) noexcept
+	{
+		ATL_SESSION_BLOB_ENTRY *pEntry = reinterpret_cast<ATL_SESSION_BLOB_ENTRY*>(pBlob + sizeof(ATL_SESSION_BLOB_HEADER)) + nIndex;
+		pEntry->dwHash = HashName(szName, cbName);
+		pEntry->dwOffset = dwOffset;
+		pEntry->cbName = cbName;
+		pEntry->cbValue = cbValue;
+
+		Checked::memcpy_s(pBlob + dwOffset, cbBlob - dwOffset, szName, cbName);
+		dwOffset += cbName;
+		Checked::memcpy_s(pBlob + dwOffset, cbBlob - dwOffset, pValue, cbValue);
+		dwOffset += cbValue;
+	}
+
+	void Replace(CHeapPtr<BYTE>& buffer, DWORD cbData) noexcept
+	{
+		m_buffer.Free();
+		m_buffer.Attach(buffer.Detach());
+		m_cbData = cbData;
+	}
+
+private:
+	CSessionBlobBase(const CSessionBlobBase&);
+	CSessionBlobBase& operator=(const CSessionBlobBase&);
+
+	CHeapPtr<BYTE> m_buffer;
+	DWORD m_cbData;
+}; // CSessionBlobBase
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLSESSBLOB_H__
@@ -27,6 +27,7 @@
 #include <atlcache.h>
 #include <atlspriv.h>
 #include <atlsiface.h>
+#include <atlsessblob.h>
 
 #pragma warning(disable: 4625) // copy constructor could not be generated because a base class copy constructor is inaccessible
 #pragma warning(disable: 4626) // assignment operator could not be generated because a base class assignment operator is inaccessible
@@ -59,6 +60,28 @@
 	#define ATL_SESSION_SWEEPER_TIMEOUT 1000 // 1sec
 #endif
 
+// The name of the SessionVariables row that holds the packed
+// variables of a CDBPackedSession.
+#ifndef ATL_SESSION_BLOB_VARNAME
+	#define ATL_SESSION_BLOB_VARNAME _T("__ATL_SESSION_BLOB")
+#endif
+
+// The largest packed blob CDBPackedSession stores in its
+// ATL_SESSION_BLOB_VARNAME row. The VariableValue column of the
+// SessionVariables table has to be at least this wide (see CDBSession);
+// 8000 bytes is the widest varbinary column SQL Server has short of
+// varbinary(max).
+#ifndef ATL_SESSION_BLOB_MAX_LENGTH
+	#define ATL_SESSION_BLOB_MAX_LENGTH 8000
+#endif
+
+// How many times CDBCachedSession applies its changes to a newer version
+// of the session's variables and writes them again, when another request
+// has written the session since its variables were read.
+#ifndef ATL_SESSION_WRITE_RETRIES
+	#define ATL_SESSION_WRITE_RETRIES 3
+#endif
+
 #define INVALID_DB_SESSION_POS 0x0
 #define ATL_DBSESSION_ID _T("__ATL_SESSION_DB_CONNECTION")
 
@@ -321,6 +344,23 @@ public:
 	{
 		return _T("UPDATE SessionReferences SET TimeoutMs=?");
 	}
+
+	// The following queries are only used by CDBCachedSession, and
+	// require the Version column in the SessionReferences table.
+	LPCTSTR GetSessionRefVersion() noexcept
+	{
+		return _T("SELECT Version FROM SessionReferences ")
+			   _T("WHERE SessionID=?");
+	}
+
+	LPCTSTR GetSessionRefCommit() noexcept
+	{
+		return _T("UPDATE SessionReferences ")
+			   _T("SET Version=Version+1, ")
+			   _T("RefCount=RefCount-1, ")
+			   _T("LastAccess=getdate() ")
+			   _T("WHERE SessionID=? AND Version=?");
+	}
 };
 
 
@@ -425,6 +465,78 @@ public:
 	END_PARAM_MAP()
 };
 
+// Contains the data for the accessors of the row that holds
+// the packed variables of a CDBPackedSession
+class CSessionBlobDataBase
+{
+public:
+	TCHAR m_szSessionID[MAX_SESSION_KEY_LEN];
+	TCHAR m_VariableName[MAX_VARIABLE_NAME_LENGTH];
+	BYTE m_VariableValue[ATL_SESSION_BLOB_MAX_LENGTH];
+	DBLENGTH m_VariableLen;
+	CSessionBlobDataBase() noexcept
+	{
+		m_szSessionID[0] = '\0';
+		m_VariableName[0] = '\0';
+		m_VariableLen = 0;
+	}
+
+	// The packed variables are copied as they are. pData is NULL
+	// when the row is only being looked up.
+	HRESULT Assign(LPCTSTR szSessionID, LPCTSTR szVarName, const BYTE *pData, DWORD cbData) noexcept
+	{
+		if (!szSessionID || !szVarName)
+			return E_INVALIDARG;
+
+		if (Checked::tcsnlen(szSessionID, MAX_SESSION_KEY_LEN) < MAX_SESSION_KEY_LEN)
+			Checked::tcscpy_s(m_szSessionID, _countof(m_szSessionID), szSessionID);
+		else
+			return E_OUTOFMEMORY;
+
+		if (Checked::tcsnlen(szVarName, MAX_VARIABLE_NAME_LENGTH) < MAX_VARIABLE_NAME_LENGTH)
+			Checked::tcscpy_s(m_VariableName, _countof(m_VariableName), szVarName);
+		else
+			return E_OUTOFMEMORY;
+
+		if (pData)
+		{
+			if (!cbData || cbData > ATL_SESSION_BLOB_MAX_LENGTH)
+				return E_INVALIDARG;
+			Checked::memcpy_s(m_VariableValue, ATL_SESSION_BLOB_MAX_LENGTH, pData, cbData);
+			m_VariableLen = static_cast<DBLENGTH>(cbData);
+		}
+		return S_OK;
+	}
+};
+
+// Use to select the packed variables of a session
+class CSessionBlobSelector : public CSessionBlobDataBase
+{
+public:
+	BEGIN_COLUMN_MAP(CSessionBlobSelector)
+		COLUMN_ENTRY(1, m_szSessionID)
+		COLUMN_ENTRY(2, m_VariableName)
+		COLUMN_ENTRY_LENGTH(3, m_VariableValue, m_VariableLen)
+	END_COLUMN_MAP()
+	BEGIN_PARAM_MAP(CSessionBlobSelector)
+		SET_PARAM_TYPE(DBPARAMIO_INPUT)
+		COLUMN_ENTRY(1, m_szSessionID)
+		COLUMN_ENTRY(2, m_VariableName)
+	END_PARAM_MAP()
+};
+
+// Use to update the packed variables of a session
+class CSessionBlobUpdator : public CSessionBlobDataBase
+{
+public:
+	BEGIN_PARAM_MAP(CSessionBlobUpdator)
+		SET_PARAM_TYPE(DBPARAMIO_INPUT)
+		COLUMN_ENTRY_LENGTH(1, m_VariableValue, m_VariableLen)
+		COLUMN_ENTRY(2, m_szSessionID)
+		COLUMN_ENTRY(3, m_VariableName)
+	END_PARAM_MAP()
+};
+
 // Use to delete a session variable given the
 // session name and the name of the variable
 class CSessionDataDeletor
@@ -674,675 +786,1871 @@ public:
 	END_PARAM_MAP()
 };
 
-
-// CDBSession
-// This session persistance class persists session variables to
-// an OLEDB datasource. The following table gives a general description
-// of the table schema for the tables this class uses.
-//
-// TableName: SessionVariables
-// Column		Name			Type							Description
-// 1			SessionID		char[MAX_SESSION_KEY_LEN]		Session Key name
-// 2			VariableName	char[MAX_VARIABLE_NAME_LENGTH]	Variable Name
-// 3			VariableValue	varbinary[MAX_VARIABLE_VALUE_LENGTH]	Variable Value
-
-//
-// TableName: SessionReferences
-// Column		Name			Type							Description
-// 1			SessionID		char[MAX_SESSION_KEY_LEN]		Session Key Name.
-// 2			LastAccess		datetime						Date and time of last access to this session.
-// 3			RefCount		int								Current references on this session.
-// 4			TimeoutMS		int								Timeout value for the session in milli seconds
-
-typedef bool (*PFN_GETPROVIDERINFO)(DWORD_PTR, wchar_t **);
-
-template <class QueryClass=CDefaultQueryClass>
-class CDBSession:
-	public ISession,
-	public CComObjectRootEx<CComGlobalsThreadModel>
-
+// Used for retrieving the version of a session's
+// variables, given a session ID.
+class CSessionRefVersion
 {
-	typedef CCommand<CAccessor<CAllSessionDataSelector> >  iterator_accessor;
 public:
-	typedef QueryClass DBQUERYCLASS_TYPE;
-	BEGIN_COM_MAP(CDBSession)
-		COM_INTERFACE_ENTRY(ISession)
-	END_COM_MAP()
+	TCHAR m_SessionID[MAX_SESSION_KEY_LEN];
+	LONG m_nVersion;
+	CSessionRefVersion() noexcept
+	{
+		m_SessionID[0] = '\0';
+		m_nVersion = 0;
+	}
 
-	CDBSession() noexcept:
-		m_dwTimeout(ATL_SESSION_TIMEOUT)
+	HRESULT Assign(LPCTSTR szSessionID) noexcept
 	{
-		m_szSessionName[0] = '\0';
+		if (!szSessionID)
+			return E_INVALIDARG;
+		if (Checked::tcsnlen(szSessionID, MAX_SESSION_KEY_LEN) < MAX_SESSION_KEY_LEN)
+			Checked::tcscpy_s(m_SessionID, _countof(m_SessionID), szSessionID);
+		else
+			return E_OUTOFMEMORY;
+		return S_OK;
 	}
+	BEGIN_COLUMN_MAP(CSessionRefVersion)
+		COLUMN_ENTRY(1, m_nVersion)
+	END_COLUMN_MAP()
+	BEGIN_PARAM_MAP(CSessionRefVersion)
+		SET_PARAM_TYPE(DBPARAMIO_INPUT)
+		COLUMN_ENTRY(1, m_SessionID)
+	END_PARAM_MAP()
+};
 
-	~CDBSession() noexcept
+// Used for releasing a session reference and bumping the
+// version of the session's variables, provided the version
+// is still the one the variables were read at.
+class CSessionRefCommit
+{
+public:
+	TCHAR m_SessionID[MAX_SESSION_KEY_LEN];
+	LONG m_nVersion;
+	HRESULT Assign(LPCTSTR szSessionID, LONG nVersion) noexcept
 	{
+		if (!szSessionID)
+			return E_INVALIDARG;
+		if (Checked::tcsnlen(szSessionID, MAX_SESSION_KEY_LEN) < MAX_SESSION_KEY_LEN)
+		{
+			Checked::tcscpy_s(m_SessionID, _countof(m_SessionID), szSessionID);
+			m_nVersion = nVersion;
+		}
+		else
+			return E_OUTOFMEMORY;
+		return S_OK;
 	}
+	BEGIN_PARAM_MAP(CSessionRefCommit)
+		SET_PARAM_TYPE(DBPARAMIO_INPUT)
+		COLUMN_ENTRY(1, m_SessionID)
+		COLUMN_ENTRY(2, m_nVersion)
+	END_PARAM_MAP()
+};
 
-	void FinalRelease()throw()
+
+// CSessionBlob
+// Packs all of the variables of a session into one contiguous buffer,
+// so that a session can be kept in a single allocation or a single
+// database row. The layout of the buffer is described in atlsessblob.h;
+// each value is stored as written by CComVariant::WriteToStream.
+//
+// CSessionBlob can also hold the variables of a CDBCachedSession, which
+// is how CDBPackedSession works on the packed variables directly (see
+// CSessionVariableMap).
+class CSessionBlob :
+	public CSessionBlobBase
+{
+public:
+	typedef CAtlMap<CStringA,
+					CComVariant,
+					CStringElementTraits<CStringA> > VarMapType;
+
+	CSessionBlob() noexcept
 	{
-		SessionUnlock();
 	}
 
-	STDMETHOD(SetVariable)(LPCSTR szName, VARIANT Val) noexcept
+	// Packs all of the variables in vars, replacing the contents of the blob.
+	HRESULT Pack(const VarMapType& vars) noexcept
 	{
-		HRESULT hr = E_FAIL;
-		if (!szName)
-			return E_INVALIDARG;
+		DWORD nCount = (DWORD) vars.GetCount();
+		if (!nCount)
+		{
+			Empty();
+			return S_OK;
+		}
 
-		// Get the data connection for this thread.
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
-		if (hr != S_OK)
-			return hr;
+		HRESULT hr = S_OK;
+		_ATLTRY
+		{
+			// Write all of the values to one stream first,
+			// to find out how big the blob has to be.
+			CVariantStream values;
+			CAtlArray<DWORD> rgcbValues;
+			DWORD cbNames = 0;
+			POSITION pos = vars.GetStartPosition();
+			while (hr == S_OK && pos)
+			{
+				const VarMapType::CPair *pPair = vars.GetNext(pos);
+				size_t cbBefore = values.GetVariantSize();
+				hr = const_cast<CComVariant&>(pPair->m_value).WriteToStream(static_cast<IStream*>(&values));
+				if (hr == S_OK)
+				{
+					rgcbValues.Add((DWORD)(values.GetVariantSize() - cbBefore));
+					hr = ::ATL::AtlAdd(&cbNames, cbNames, (DWORD) pPair->m_key.GetLength());
+				}
+			}
 
-		// Update the last access time for this session
-		hr = Access();
-		if (hr != S_OK)
-			return hr;
+			CHeapPtr<BYTE> buffer;
+			DWORD cbData = 0;
+			if (hr == S_OK)
+				hr = AllocateBlob(buffer, nCount, cbNames, (DWORD) values.GetVariantSize(), &cbData);
+			if (hr == S_OK)
+			{
+				DWORD dwOffset = GetDataOffset(nCount);
+				const BYTE *pValue = values.m_stream;
+				DWORD nIndex = 0;
+				pos = vars.GetStartPosition();
+				while (pos)
+				{
+					const VarMapType::CPair *pPair = vars.GetNext(pos);
+					AppendEntry(buffer, cbData, nIndex, dwOffset,
+								pPair->m_key, (DWORD) pPair->m_key.GetLength(),
+								pValue, rgcbValues[nIndex]);
+					pValue += rgcbValues[nIndex];
+					nIndex++;
+				}
+				ATLASSERT(dwOffset == cbData);
+				Replace(buffer, cbData);
+			}
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		return hr;
+	}
 
-		// Allocate an updator command and fill out it's input parameters.
-		CCommand<CAccessor<CSessionDataUpdator> > command;
+	// Reads all of the variables in the blob into vars.
+	HRESULT Unpack(VarMapType& vars) const noexcept
+	{
+		HRESULT hr = S_OK;
 		_ATLTRY
 		{
-			CA2CT name(szName);
-			hr = command.Assign(m_szSessionName, name, &Val);
+			vars.RemoveAll();
+			DWORD nCount = GetCount();
+			for (DWORD i=0; hr == S_OK && i<nCount; i++)
+			{
+				CComVariant val;
+				hr = GetVariableAt(i, &val);
+				if (hr == S_OK)
+				{
+					DWORD cbName = 0;
+					LPCSTR szName = GetNameAt(i, &cbName);
+					vars.SetAt(CStringA(szName, (int) cbName), val);
+				}
+			}
 		}
 		_ATLCATCHALL()
 		{
 			hr = E_OUTOFMEMORY;
 		}
-		if (hr != S_OK)
-			return hr;
+		return hr;
+	}
 
-		// Try an update. Update will fail if the variable is not already there.
-		DBROWCOUNT nRows = 0;
+	HRESULT GetVariableAt(DWORD nIndex, VARIANT *pVal) const noexcept
+	{
+		if (!pVal)
+			return E_POINTER;
 
-		hr = command.Open(dataconn, 
-						m_QueryObj.GetSessionVarUpdate(),
-						NULL, &nRows, DBGUID_DEFAULT, false);
-		if (hr == S_OK && nRows <= 0)
-			hr = E_UNEXPECTED;
-		if (hr != S_OK)
-		{
-			// Try an insert
-			hr = command.Open(dataconn, m_QueryObj.GetSessionVarInsert(), NULL, &nRows, DBGUID_DEFAULT, false);
-			if (hr == S_OK && nRows <=0)
-				hr = E_UNEXPECTED;
-		}
+		if (nIndex >= GetCount())
+			return E_INVALIDARG;
 
+		DWORD cbValue = 0;
+		const BYTE *pValue = GetValueAt(nIndex, &cbValue);
+		CStreamOnByteArray stream(const_cast<BYTE*>(pValue), cbValue);
+		CComVariant vOut;
+		HRESULT hr = vOut.ReadFromStream(static_cast<IStream*>(&stream));
+		if (hr == S_OK)
+			hr = vOut.Detach(pVal);
 		return hr;
 	}
 
-	// Warning: For string data types, depending on the configuration of
-	// your database, strings might be returned with trailing white space.
-	STDMETHOD(GetVariable)(LPCSTR szName, VARIANT *pVal) noexcept
+	// Returns S_FALSE if the blob doesn't hold the variable.
+	HRESULT GetVariable(LPCSTR szName, VARIANT *pVal) const noexcept
 	{
-		HRESULT hr = E_FAIL;
-		if (!szName)
-			return E_INVALIDARG;
-		if (pVal)
-			VariantInit(pVal);
-		else
-			return E_POINTER;
+		int nIndex = Find(szName);
+		if (nIndex < 0)
+			return S_FALSE;
+		return GetVariableAt((DWORD) nIndex, pVal);
+	}
 
-		// Get the data connection for this thread
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+	// Replaces, adds or, if pVal is NULL, removes one variable. The
+	// other variables are copied across as they are, without reading
+	// their values. Returns S_FALSE if asked to remove a variable the
+	// blob doesn't hold.
+	HRESULT SetVariable(LPCSTR szName, const VARIANT *pVal) noexcept
+	{
+		if (!pVal)
+			return SetValue(szName, NULL, 0);
+
+		CVariantStream value;
+		HRESULT hr = value.InsertVariant(pVal);
 		if (hr != S_OK)
 			return hr;
+		return SetValue(szName, value.m_stream, (DWORD) value.GetVariantSize());
+	}
 
-		// Update the last access time for this session
-		hr = Access();
+	// Works out the size of the blob after SetVariable(szName, pVal),
+	// without copying the blob.
+	HRESULT GetSizeWithVariable(LPCSTR szName, const VARIANT *pVal, DWORD *pcbData) const noexcept
+	{
+		if (!pVal)
+			return E_POINTER;
+
+		CVariantStream value;
+		HRESULT hr = value.InsertVariant(pVal);
 		if (hr != S_OK)
 			return hr;
+		return GetSizeWithValue(szName, (DWORD) value.GetVariantSize(), pcbData);
+	}
 
-		// Allocate a command a fill out it's input parameters.
-		CCommand<CAccessor<CSessionDataSelector> > command;
-		_ATLTRY
-		{
-			CA2CT name(szName);
-			hr = command.Assign(m_szSessionName, name, NULL);
-		}
-		_ATLCATCHALL()
+	// Positions are the index of the next variable in the blob, plus one.
+	POSITION GetStartPosition() const noexcept
+	{
+		return GetCount() ? (POSITION)(DWORD_PTR) 1 : NULL;
+	}
+
+	// Reads the variable at pos and, if szName isn't NULL, copies its
+	// name to szName, which holds dwLen characters. pos is moved to the
+	// next variable, or set to NULL after the last one.
+	HRESULT GetNextVariable(POSITION& pos, VARIANT *pVal, LPSTR szName, DWORD dwLen) const noexcept
+	{
+		// the blob may have changed since the enumeration began
+		DWORD nIndex = (DWORD)((DWORD_PTR) pos - 1);
+		DWORD nCount = GetCount();
+		if (!pos || nIndex >= nCount)
+			return E_UNEXPECTED;
+
+		if (szName)
 		{
-			hr = E_OUTOFMEMORY;
+			DWORD cbName = 0;
+			LPCSTR szVarName = GetNameAt(nIndex, &cbName);
+			if (dwLen > cbName)
+			{
+				Checked::memcpy_s(szName, dwLen, szVarName, cbName);
+				szName[cbName] = '\0';
+			}
+			else
+				return E_OUTOFMEMORY; // buffer not big enough
 		}
 
+		HRESULT hr = GetVariableAt(nIndex, pVal);
 		if (hr == S_OK)
-		{
-			hr = command.Open(dataconn, m_QueryObj.GetSessionVarSelectVar());
-			if (SUCCEEDED(hr))
+			pos = (nIndex+1 < nCount) ? (POSITION)(DWORD_PTR)(nIndex+2) : NULL;
+		return hr;
+	}
+
+	HRESULT CopyFrom(const CSessionBlob& blob) noexcept
+	{
+		return Load(blob.GetData(), blob.GetSize());
+	}
+
+	HRESULT CopyTo(CSessionBlob& blob) const noexcept
+	{
+		return blob.Load(GetData(), GetSize());
+	}
+
+private:
+	CSessionBlob(const CSessionBlob&);
+	CSessionBlob& operator=(const CSessionBlob&);
+}; // CSessionBlob
+
+
+// CSessionVariableMap
+// The variables of a CDBCachedSession, kept in a map of VARIANTs.
+//
+// The variables type of CDBCachedSession can be this class or
+// CSessionBlob, and has to provide GetCount, Empty, GetVariable,
+// SetVariable, GetStartPosition and GetNextVariable with the meaning
+// CSessionBlob gives them, and CopyFrom and CopyTo to exchange a packed
+// snapshot with CDBSessionCache.
+class CSessionVariableMap
+{
+public:
+	typedef CSessionBlob::VarMapType VarMapType;
+
+	DWORD GetCount() const noexcept
+	{
+		return (DWORD) m_Variables.GetCount();
+	}
+
+	void Empty() noexcept
+	{
+		m_Variables.RemoveAll();
+	}
+
+	// Returns S_FALSE if the map doesn't hold the variable.
+	HRESULT GetVariable(LPCSTR szName, VARIANT *pVal) const noexcept
+	{
+		if (!pVal)
+			return E_POINTER;
+
+		HRESULT hr = S_FALSE;
+		_ATLTRY
+		{
+			const VarMapType::CPair *pPair = m_Variables.Lookup(szName);
+			if (pPair)
+				hr = VariantCopy(pVal, const_cast<CComVariant*>(&pPair->m_value));
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_UNEXPECTED;
+		}
+		return hr;
+	}
+
+	// Sets or, if pVal is NULL, removes one variable. Returns S_FALSE
+	// if asked to remove a variable the map doesn't hold.
+	HRESULT SetVariable(LPCSTR szName, const VARIANT *pVal) noexcept
+	{
+		HRESULT hr = S_OK;
+		_ATLTRY
+		{
+			if (pVal)
+				m_Variables.SetAt(szName, *pVal);
+			else if (!m_Variables.RemoveKey(szName))
+				hr = S_FALSE;
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		return hr;
+	}
+
+	POSITION GetStartPosition() const noexcept
+	{
+		return m_Variables.GetStartPosition();
+	}
+
+	HRESULT GetNextVariable(POSITION& pos, VARIANT *pVal, LPSTR szName, DWORD dwLen) const noexcept
+	{
+		if (!pos)
+			return E_UNEXPECTED;
+
+		HRESULT hr = E_FAIL;
+		_ATLTRY
+		{
+			if (szName)
 			{
-				if ( S_OK == (hr = command.MoveFirst()))
+				const CStringA& strName = m_Variables.GetKeyAt(pos);
+				if (dwLen > (DWORD)strName.GetLength())
 				{
-					CStreamOnByteArray stream(command.m_VariableValue);
-					CComVariant vOut;
-					hr = vOut.ReadFromStream(static_cast<IStream*>(&stream));
-					if (hr == S_OK)
-						hr = vOut.Detach(pVal);
+					Checked::strcpy_s(szName, dwLen, strName);
+					hr = S_OK;
 				}
+				else
+					hr = E_OUTOFMEMORY; // buffer not big enough
+			}
+			else
+				hr = S_OK;
+
+			if (hr == S_OK)
+			{
+				POSITION posNext = pos;
+				const VarMapType::CPair *pPair = m_Variables.GetNext(posNext);
+				hr = VariantCopy(pVal, const_cast<CComVariant*>(&pPair->m_value));
+				if (hr == S_OK)
+					pos = posNext;
 			}
 		}
-		return hr;
+		_ATLCATCHALL()
+		{
+			hr = E_UNEXPECTED;
+		}
+		return hr;
+	}
+
+	HRESULT CopyFrom(const CSessionBlob& blob) noexcept
+	{
+		return blob.Unpack(m_Variables);
+	}
+
+	HRESULT CopyTo(CSessionBlob& blob) const noexcept
+	{
+		return blob.Pack(m_Variables);
+	}
+
+protected:
+	VarMapType m_Variables;
+}; // CSessionVariableMap
+
+
+// CNoSessionCache
+// The session cache type of CDBSession, which reads and writes
+// session variables straight through to the database.
+class CNoSessionCache
+{
+public:
+	void Remove(LPCTSTR /*szSessionID*/) noexcept
+	{
+	}
+
+	void Sweep(unsigned __int64 /*dwTimeout*/) noexcept
+	{
+	}
+
+	void RemoveAll() noexcept
+	{
+	}
+}; // CNoSessionCache
+
+
+// CDBSessionCache
+// A per-process cache of the variables of database persisted
+// sessions, used by CDBCachedSession. Each entry is a snapshot of a
+// session's variables tagged with the Version it was read or written
+// at. A session only uses the snapshot if the Version column in the
+// database still matches, so the cache can be shared by all the
+// sessions created by one session service. Snapshots are kept packed
+// in a CSessionBlob, one allocation per session.
+class CDBSessionCache
+{
+public:
+	// Copies the cached variables for the session into vars, which is a
+	// CSessionVariableMap or a CSessionBlob. Returns S_FALSE if there is
+	// no snapshot for nVersion.
+	template <class TVariables>
+	HRESULT Lookup(LPCTSTR szSessionID, LONG nVersion, TVariables& vars) noexcept
+	{
+		if (!szSessionID)
+			return E_INVALIDARG;
+
+		CSLockType lock(m_cs, false);
+		HRESULT hr = lock.Lock();
+		if (FAILED(hr))
+			return hr;
+
+		EntryMapType::CPair *pPair = m_Entries.Lookup(szSessionID);
+		if (!pPair || pPair->m_value->m_nVersion != nVersion)
+			return S_FALSE;
+
+		hr = vars.CopyFrom(pPair->m_value->m_Blob);
+		if (hr == S_OK)
+			pPair->m_value->m_tLastAccess = CTime::GetCurrentTime();
+		return hr;
+	}
+
+	template <class TVariables>
+	HRESULT Store(LPCTSTR szSessionID, LONG nVersion, const TVariables& vars) noexcept
+	{
+		if (!szSessionID)
+			return E_INVALIDARG;
+
+		// Copy the snapshot before taking the lock.
+		CAutoPtr<CCacheEntry> spEntry;
+		ATLTRYALLOC(spEntry.Attach(new CCacheEntry));
+		if (!spEntry)
+			return E_OUTOFMEMORY;
+
+		HRESULT hr = vars.CopyTo(spEntry->m_Blob);
+		if (hr != S_OK)
+			return hr;
+		spEntry->m_nVersion = nVersion;
+		spEntry->m_tLastAccess = CTime::GetCurrentTime();
+
+		CSLockType lock(m_cs, false);
+		hr = lock.Lock();
+		if (FAILED(hr))
+			return hr;
+
+		_ATLTRY
+		{
+			// Don't replace a newer snapshot another request has already stored.
+			EntryMapType::CPair *pPair = m_Entries.Lookup(szSessionID);
+			if (!pPair || pPair->m_value->m_nVersion <= nVersion)
+				m_Entries.SetAt(szSessionID, spEntry);
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		return hr;
+	}
+
+	void Remove(LPCTSTR szSessionID) noexcept
+	{
+		if (!szSessionID)
+			return;
+
+		CSLockType lock(m_cs, false);
+		if (FAILED(lock.Lock()))
+			return;
+		m_Entries.RemoveKey(szSessionID);
+	}
+
+	// Removes the snapshots that haven't been used for dwTimeout
+	// milliseconds.
+	void Sweep(unsigned __int64 dwTimeout) noexcept
+	{
+		CSLockType lock(m_cs, false);
+		if (FAILED(lock.Lock()))
+			return;
+
+		CTime tmNow = CTime::GetCurrentTime();
+		POSITION pos = m_Entries.GetStartPosition();
+		while (pos)
+		{
+			POSITION posRemove = pos;
+			EntryMapType::CPair *pPair = m_Entries.GetNext(pos);
+			CTimeSpan span = tmNow-pPair->m_value->m_tLastAccess;
+			if ((unsigned __int64)((span.GetTotalSeconds()*1000)) > dwTimeout)
+				m_Entries.RemoveAtPos(posRemove);
+		}
+	}
+
+	void RemoveAll() noexcept
+	{
+		CSLockType lock(m_cs, false);
+		if (FAILED(lock.Lock()))
+			return;
+		m_Entries.RemoveAll();
+	}
+
+protected:
+	class CCacheEntry
+	{
+	public:
+		LONG m_nVersion;
+		CTime m_tLastAccess;
+		CSessionBlob m_Blob;
+	};
+
+	typedef CAtlMap<CString,
+					CAutoPtr<CCacheEntry>,
+					CStringElementTraits<CString>,
+					CAutoPtrElementTraits<CCacheEntry> > EntryMapType;
+
+	EntryMapType m_Entries;
+	CComAutoCriticalSection m_cs;
+	typedef CComCritSecLock<CComAutoCriticalSection> CSLockType;
+}; // CDBSessionCache
+
+
+// CDBSession
+// This session persistance class persists session variables to
+// an OLEDB datasource. The following table gives a general description
+// of the table schema for the tables this class uses.
+//
+// TableName: SessionVariables
+// Column		Name			Type							Description
+// 1			SessionID		char[MAX_SESSION_KEY_LEN]		Session Key name
+// 2			VariableName	char[MAX_VARIABLE_NAME_LENGTH]	Variable Name
+// 3			VariableValue	varbinary[MAX_VARIABLE_VALUE_LENGTH]	Variable Value. CDBPackedSession keeps all of
+//																a session's variables in one row, and needs
+//																varbinary[ATL_SESSION_BLOB_MAX_LENGTH].
+
+//
+// TableName: SessionReferences
+// Column		Name			Type							Description
+// 1			SessionID		char[MAX_SESSION_KEY_LEN]		Session Key Name.
+// 2			LastAccess		datetime						Date and time of last access to this session.
+// 3			RefCount		int								Current references on this session.
+// 4			TimeoutMS		int								Timeout value for the session in milli seconds
+// 5			Version			int								Incremented each time CDBCachedSession writes back
+//																the session's variables. Only required by CDBCachedSession,
+//																and should default to 0.
+
+typedef bool (*PFN_GETPROVIDERINFO)(DWORD_PTR, wchar_t **);
+
+template <class QueryClass=CDefaultQueryClass>
+class CDBSession:
+	public ISession,
+	public CComObjectRootEx<CComGlobalsThreadModel>
+
+{
+	typedef CCommand<CAccessor<CAllSessionDataSelector> >  iterator_accessor;
+public:
+	typedef QueryClass DBQUERYCLASS_TYPE;
+	typedef CNoSessionCache SESSIONCACHE_TYPE;
+	BEGIN_COM_MAP(CDBSession)
+		COM_INTERFACE_ENTRY(ISession)
+	END_COM_MAP()
+
+	CDBSession() noexcept:
+		m_dwTimeout(ATL_SESSION_TIMEOUT)
+	{
+		m_szSessionName[0] = '\0';
+	}
+
+	~CDBSession() noexcept
+	{
+	}
+
+	void FinalRelease()throw()
+	{
+		SessionUnlock();
+	}
+
+	void SetSessionCache(SESSIONCACHE_TYPE* /*pCache*/) noexcept
+	{
+		// CDBSession doesn't cache session variables.
+	}
+
+	STDMETHOD(SetVariable)(LPCSTR szName, VARIANT Val) noexcept
+	{
+		HRESULT hr = E_FAIL;
+		if (!szName)
+			return E_INVALIDARG;
+
+		// Get the data connection for this thread.
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		// Update the last access time for this session
+		hr = Access();
+		if (hr != S_OK)
+			return hr;
+
+		// Allocate an updator command and fill out it's input parameters.
+		CCommand<CAccessor<CSessionDataUpdator> > command;
+		_ATLTRY
+		{
+			CA2CT name(szName);
+			hr = command.Assign(m_szSessionName, name, &Val);
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		if (hr != S_OK)
+			return hr;
+
+		// Try an update. Update will fail if the variable is not already there.
+		DBROWCOUNT nRows = 0;
+
+		hr = command.Open(dataconn, 
+						m_QueryObj.GetSessionVarUpdate(),
+						NULL, &nRows, DBGUID_DEFAULT, false);
+		if (hr == S_OK && nRows <= 0)
+			hr = E_UNEXPECTED;
+		if (hr != S_OK)
+		{
+			// Try an insert
+			hr = command.Open(dataconn, m_QueryObj.GetSessionVarInsert(), NULL, &nRows, DBGUID_DEFAULT, false);
+			if (hr == S_OK && nRows <=0)
+				hr = E_UNEXPECTED;
+		}
+
+		return hr;
+	}
+
+	// Warning: For string data types, depending on the configuration of
+	// your database, strings might be returned with trailing white space.
+	STDMETHOD(GetVariable)(LPCSTR szName, VARIANT *pVal) noexcept
+	{
+		HRESULT hr = E_FAIL;
+		if (!szName)
+			return E_INVALIDARG;
+		if (pVal)
+			VariantInit(pVal);
+		else
+			return E_POINTER;
+
+		// Get the data connection for this thread
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		// Update the last access time for this session
+		hr = Access();
+		if (hr != S_OK)
+			return hr;
+
+		// Allocate a command a fill out it's input parameters.
+		CCommand<CAccessor<CSessionDataSelector> > command;
+		_ATLTRY
+		{
+			CA2CT name(szName);
+			hr = command.Assign(m_szSessionName, name, NULL);
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
+		}
+
+		if (hr == S_OK)
+		{
+			hr = command.Open(dataconn, m_QueryObj.GetSessionVarSelectVar());
+			if (SUCCEEDED(hr))
+			{
+				if ( S_OK == (hr = command.MoveFirst()))
+				{
+					CStreamOnByteArray stream(command.m_VariableValue);
+					CComVariant vOut;
+					hr = vOut.ReadFromStream(static_cast<IStream*>(&stream));
+					if (hr == S_OK)
+						hr = vOut.Detach(pVal);
+				}
+			}
+		}
+		return hr;
+	}
+
+	STDMETHOD(RemoveVariable)(LPCSTR szName) noexcept
+	{
+		HRESULT hr = E_FAIL;
+		if (!szName)
+			return E_INVALIDARG;
+
+		// Get the data connection for this thread.
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		// update the last access time for this session
+		hr = Access();
+		if (hr != S_OK)
+			return hr;
+
+		// allocate a command and set it's input parameters
+		CCommand<CAccessor<CSessionDataDeletor> > command;
+		_ATLTRY
+		{
+			CA2CT name(szName);
+			hr = command.Assign(m_szSessionName, name);
+		}
+		_ATLCATCHALL()
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		// execute the command
+		DBROWCOUNT nRows = 0;
+		if (hr == S_OK)
+			hr = command.Open(dataconn, m_QueryObj.GetSessionVarDeleteVar(),
+			NULL, &nRows, DBGUID_DEFAULT, false);
+		if (hr == S_OK && nRows <= 0)
+			hr = E_FAIL;
+		return hr;
+	}
+
+	// Gives the count of rows in the table for this session ID.
+	STDMETHOD(GetCount)(long *pnCount) noexcept
+	{
+		HRESULT hr = S_OK;
+		if (pnCount)
+			*pnCount = 0;
+		else
+			return E_POINTER;
+
+		// Get the database connection for this thread.
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+		hr = Access();
+		if (hr != S_OK)
+			return hr;
+		CCommand<CAccessor<CCountAccessor> > command;
+
+		hr = command.Assign(m_szSessionName);
+		if (hr == S_OK)
+		{
+			hr = command.Open(dataconn, m_QueryObj.GetSessionVarCount());
+			if (hr == S_OK)
+			{
+				if (S_OK == (hr = command.MoveFirst()))
+				{
+					*pnCount = command.m_nCount;
+					hr = S_OK;
+				}
+			}
+		}
+		return hr;
+	}
+
+	STDMETHOD(RemoveAllVariables)() noexcept
+	{
+		HRESULT hr = E_UNEXPECTED;
+
+		// Get the data connection for this thread.
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		CCommand<CAccessor<CSessionDataDeleteAll> > command;
+		hr = command.Assign(m_szSessionName);
+		if (hr != S_OK)
+			return hr;
+
+		// delete all session variables
+		hr = command.Open(dataconn, m_QueryObj.GetSessionVarDeleteAllVars(), NULL, NULL, DBGUID_DEFAULT, false);
+		return hr;
+	}
+
+	// Iteration of variables works by taking a snapshot
+	// of the sessions at the point in time BeginVariableEnum
+	// is called, and then keeping an index variable that you use to
+	// move through the snapshot rowset. It is important to know
+	// that the handle returned in phEnum is not thread safe. It
+	// should only be used by the calling thread.
+	STDMETHOD(BeginVariableEnum)(POSITION *pPOS, HSESSIONENUM *phEnum) noexcept
+	{
+		HRESULT hr = E_FAIL;
+		if (!pPOS)
+			return E_POINTER;
+
+		if (phEnum)
+			*phEnum = NULL;
+		else
+			return E_POINTER;
+
+		// Get the data connection for this thread.
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		// Update the last access time for this session.
+		hr = Access();
+		if (hr != S_OK)
+			return hr;
+
+		// Allocate a new iterator accessor and initialize it's input parameters.
+		iterator_accessor *pIteratorAccessor = NULL;
+		ATLTRYALLOC(pIteratorAccessor = new iterator_accessor);
+		if (!pIteratorAccessor)
+			return E_OUTOFMEMORY;
+
+		hr = pIteratorAccessor->Assign(m_szSessionName, NULL, NULL);
+		if (hr == S_OK)
+		{
+			// execute the command and move to the first row of the recordset.
+			hr = pIteratorAccessor->Open(dataconn, 
+								m_QueryObj.GetSessionVarSelectAllVars());
+			if (hr == S_OK)
+			{
+				hr = pIteratorAccessor->MoveFirst();
+				if (hr == S_OK)
+				{
+					*pPOS = (POSITION) INVALID_DB_SESSION_POS + 1;
+					*phEnum = reinterpret_cast<HSESSIONENUM>(pIteratorAccessor);
+				}
+			}
+
+			if (hr != S_OK)
+			{
+				*pPOS = INVALID_DB_SESSION_POS;
+				*phEnum = NULL;
+				delete pIteratorAccessor;
+			}
+		}
+		return hr;
+	}
+
+	// The values for hEnum and pPos must have been initialized in a previous
+	// call to BeginVariableEnum. On success, the out variant will hold the next
+	// variable
+	STDMETHOD(GetNextVariable)(POSITION *pPOS, VARIANT *pVal, HSESSIONENUM hEnum, LPSTR szName=NULL, DWORD dwLen=0) noexcept
+	{
+		if (!pPOS)
+			return E_INVALIDARG;
+
+		if (pVal)
+			VariantInit(pVal);
+		else
+			return E_POINTER;
+
+		if (!hEnum)
+			return E_UNEXPECTED;
+
+		if (*pPOS <= INVALID_DB_SESSION_POS)
+			return E_UNEXPECTED;
+
+		iterator_accessor *pIteratorAccessor = reinterpret_cast<iterator_accessor*>(hEnum);
+
+		// update the last access time.
+		HRESULT hr = Access();
+
+		POSITION posCurrent = *pPOS;
+
+		if (szName)
+		{
+			// caller wants entry name
+			_ATLTRY
+			{
+				CT2CA szVarName(pIteratorAccessor->m_VariableName);
+				if (szVarName != NULL && dwLen > Checked::strnlen(szVarName, dwLen))
+				{
+					Checked::strcpy_s(szName, dwLen, szVarName);
+				}
+				else
+					hr = E_OUTOFMEMORY; // buffer not big enough
+			}				
+			_ATLCATCHALL()
+			{
+				hr = E_OUTOFMEMORY;
+			}
+				
+		}
+
+		if (hr == S_OK)
+		{
+			CStreamOnByteArray stream(pIteratorAccessor->m_VariableValue);
+			CComVariant vOut;
+			hr = vOut.ReadFromStream(static_cast<IStream*>(&stream));
+			if (hr == S_OK)
+				vOut.Detach(pVal);
+			else
+				return hr;
+		}
+		else
+			return hr;
+
+		hr = pIteratorAccessor->MoveNext();
+		*pPOS = ++posCurrent;
+
+		if (hr == DB_S_ENDOFROWSET)
+		{
+			// We're done iterating, reset everything
+			*pPOS = INVALID_DB_SESSION_POS;
+			hr = S_OK;
+		}
+
+		if (hr != S_OK)
+		{
+			VariantClear(pVal);
+		}
+		return hr;
+	}
+
+	// CloseEnum frees up any resources allocated by the iterator
+	STDMETHOD(CloseEnum)(HSESSIONENUM hEnum) noexcept
+	{
+		iterator_accessor *pIteratorAccessor = reinterpret_cast<iterator_accessor*>(hEnum);
+		if (!pIteratorAccessor)
+			return E_INVALIDARG;
+		pIteratorAccessor->Close();
+		delete pIteratorAccessor;
+		return S_OK;
+	}
+
+	//
+	// Returns S_FALSE if it's not expired
+	// S_OK if it is expired and an error HRESULT
+	// if an error occurred.
+	STDMETHOD(IsExpired)() noexcept
+	{
+		HRESULT hrRet = S_FALSE;
+		HRESULT hr = E_UNEXPECTED;
+
+		// Get the data connection for this thread.
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		CCommand<CAccessor<CSessionRefIsExpired> > command;
+		hr = command.Assign(m_szSessionName);
+		if (hr != S_OK)
+			return hr;
+
+		hr = command.Open(dataconn, m_QueryObj.GetSessionRefIsExpired(), 
+							NULL, NULL, DBGUID_DEFAULT, true);
+		if (hr == S_OK)
+		{
+			if (S_OK == command.MoveFirst())
+			{
+				if (!_tcscmp(command.m_SessionIDOut, m_szSessionName))
+					hrRet = S_OK;
+			}
+		}
+
+		if (hr == S_OK)
+			return hrRet;
+		return hr;
+	}
+
+	STDMETHOD(SetTimeout)(unsigned __int64 dwNewTimeout) noexcept
+	{
+		HRESULT hr = E_UNEXPECTED;
+
+		// Get the data connection for this thread.
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		// allocate a command and set it's input parameters
+		CCommand<CAccessor<CSessionRefUpdateTimeout> > command;
+		hr = command.Assign(m_szSessionName, dwNewTimeout);
+		if (hr != S_OK)
+			return hr;
+
+		hr = command.Open(dataconn, m_QueryObj.GetSessionRefUpdateTimeout(),
+						NULL, NULL, DBGUID_DEFAULT, false);
+
+		return hr;
+	}
+
+	// SessionLock increments the session reference count for this session.
+	// If there is not a session by this name in the session references table,
+	// a new session entry is created in the the table.
+	HRESULT SessionLock() noexcept
+	{
+		HRESULT hr = E_UNEXPECTED;
+		if (!m_szSessionName || m_szSessionName[0]==0)
+			return hr; // no session to lock.
+
+		// retrieve the data connection for this thread
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		// first try to update a session with this name
+		DBROWCOUNT nRows = 0;
+		CCommand<CAccessor<CSessionRefUpdator> > updator;
+		if (S_OK == updator.Assign(m_szSessionName))
+		{
+			if (S_OK != (hr = updator.Open(dataconn, m_QueryObj.GetSessionRefAddRef(),
+				NULL, &nRows, DBGUID_DEFAULT, false)) ||
+				nRows == 0)
+			{
+				// No session to update. Use the creator accessor
+				// to create a new session reference.
+				CCommand<CAccessor<CSessionRefCreator> > creator;
+				hr = creator.Assign(m_szSessionName, m_dwTimeout);
+				if (hr == S_OK)
+					hr = creator.Open(dataconn, m_QueryObj.GetSessionRefCreate(),
+					NULL, &nRows, DBGUID_DEFAULT, false);
+			}
+		}
+
+		// We should have been able to create or update a session.
+		ATLASSERT(nRows > 0);
+		if (hr == S_OK && nRows <= 0)
+			hr = E_UNEXPECTED;
+
+		return hr;
+	}
+
+	// SessionUnlock decrements the session RefCount for this session.
+	// Sessions cannot be removed from the database unless the session
+	// refcount is 0
+	HRESULT SessionUnlock() noexcept
+	{
+		HRESULT hr = E_UNEXPECTED;
+		if (!m_szSessionName ||
+			m_szSessionName[0]==0)
+			return hr; 
+
+		// get the data connection for this thread
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		// The session must exist at this point in order to unlock it
+		// so we can just use the session updator here.
+		DBROWCOUNT nRows = 0;
+		CCommand<CAccessor<CSessionRefUpdator> > updator;
+		hr = updator.Assign(m_szSessionName);
+		if (hr == S_OK)
+		{
+			hr = updator.Open(	dataconn,
+								m_QueryObj.GetSessionRefRemoveRef(),
+								NULL,
+								&nRows,
+								DBGUID_DEFAULT,
+								false);
+		}
+		if (hr != S_OK)
+			return hr;
+
+		// delete the session from the database if 
+		// nobody else is using it and it's expired.
+		hr = FreeSession();
+		return hr;
+	}
+
+	// Access updates the last access time for the session. The access
+	// time for sessions is updated using the SQL GETDATE function on the
+	// database server so that all clients will be using the same clock
+	// to compare access times against.
+	HRESULT Access() noexcept
+	{
+		HRESULT hr = E_UNEXPECTED;
+
+		if (!m_szSessionName || 
+			m_szSessionName[0]==0)
+			return hr; // no session to access
+
+		// get the data connection for this thread
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		// The session reference entry in the references table must
+		// be created prior to calling this function so we can just
+		// use an updator to update the current entry.
+		CCommand<CAccessor<CSessionRefUpdator> > updator;
+
+		DBROWCOUNT nRows = 0;
+		hr = updator.Assign(m_szSessionName);
+		if (hr == S_OK)
+		{
+			hr = updator.Open(	dataconn,
+								m_QueryObj.GetSessionRefAccess(),
+								NULL,
+								&nRows,
+								DBGUID_DEFAULT,
+								false);
+		}
+
+		ATLASSERT(nRows > 0);
+		if (hr == S_OK && nRows <= 0)
+			hr = E_UNEXPECTED;
+		return hr;
+	}
+
+	// If the session is expired and it's reference is 0,
+	// it can be deleted. SessionUnlock calls this function to
+	// unlock the session and delete it after we release a session
+	// lock. Note that our SQL command will only delete the session
+	// if it is expired and it's refcount is <= 0
+	HRESULT FreeSession() noexcept
+	{
+		HRESULT hr = E_UNEXPECTED;
+		if (!m_szSessionName ||
+			m_szSessionName[0]==0)
+			return hr;
+
+		// Get the data connection for this thread.
+		CDataConnection dataconn;
+		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		if (hr != S_OK)
+			return hr;
+
+		CCommand<CAccessor<CSessionRefUpdator> > updator;
+
+		// The SQL for this command only deletes the
+		// session reference from the references table if it's access
+		// count is 0 and it has expired.
+		return updator.Open(dataconn,
+							m_QueryObj.GetSessionRefDelete(),
+							NULL,
+							NULL,
+							DBGUID_DEFAULT,
+							false);
+	}
+
+	// Initialize is called each time a new session is created.
+	HRESULT Initialize( LPCSTR szSessionName, 
+						IServiceProvider *pServiceProvider,
+						DWORD_PTR dwCookie,
+						PFN_GETPROVIDERINFO pfnInfo) noexcept
+	{
+		if (!szSessionName)
+			return E_INVALIDARG;
+
+		if (!pServiceProvider)
+			return E_INVALIDARG;
+
+		if (!pfnInfo)
+			return E_INVALIDARG;
+
+		m_pfnInfo = pfnInfo;
+		m_dwProvCookie = dwCookie;
+		m_spServiceProvider = pServiceProvider;
+
+		_ATLTRY
+		{
+			CA2CT tcsSessionName(szSessionName);
+			if (Checked::tcsnlen(tcsSessionName, MAX_SESSION_KEY_LEN) < MAX_SESSION_KEY_LEN)
+				Checked::tcscpy_s(m_szSessionName, _countof(m_szSessionName), tcsSessionName);
+			else
+				return E_OUTOFMEMORY;
+		}
+		_ATLCATCHALL()
+		{
+			return E_OUTOFMEMORY;
+		}
+		return SessionLock();
 	}
 
-	STDMETHOD(RemoveVariable)(LPCSTR szName) noexcept
+	HRESULT GetSessionConnection(CDataConnection *pConn,
+								 IServiceProvider *pProv) noexcept
+	{
+		if (!pProv)
+			return E_INVALIDARG;
+
+		if (!m_pfnInfo || 
+			!m_dwProvCookie)
+			return E_UNEXPECTED;
+
+		wchar_t *wszProv = NULL;
+		if (m_pfnInfo(m_dwProvCookie, &wszProv) && wszProv!=NULL)
+		{
+			return GetDataSource(pProv,
+						ATL_DBSESSION_ID,
+						wszProv,
+						pConn);
+		}
+		return E_FAIL;
+	}
+
+
+protected:
+	TCHAR m_szSessionName[MAX_SESSION_KEY_LEN];
+	unsigned __int64 m_dwTimeout;
+	CComPtr<IServiceProvider> m_spServiceProvider;
+	DWORD_PTR m_dwProvCookie;
+	PFN_GETPROVIDERINFO m_pfnInfo;
+	DBQUERYCLASS_TYPE m_QueryObj;
+}; // CDBSession
+
+
+// CDBCachedSession
+// A CDBSession that reads all of the session's variables in one query
+// the first time they are accessed, serves reads and writes from
+// memory, and writes back the changed variables when the session is
+// released, in a single transaction with the release of the session
+// reference. Snapshots of the variables are shared across requests
+// through the CDBSessionCache owned by the session service.
+//
+// Writes use optimistic concurrency on the Version column of the
+// SessionReferences table (see CDBSession): if another request has
+// written the session since its variables were read, the variables are
+// read again and this request's changes (the variables it set or
+// removed, and RemoveAllVariables) are applied to them before writing
+// again, up to ATL_SESSION_WRITE_RETRIES times. Variables this request
+// didn't touch keep the other request's values. All servers sharing the
+// session database must use CDBCachedSession for the Version column to
+// be kept up to date.
+//
+// Like CDBSession, objects of this class are created for the duration
+// of a request and should only be used by the thread handling it.
+// The variables are held in a TVariables, a CSessionVariableMap by
+// default. Derived classes can change how the variables are held in
+// memory through TVariables, and how they are stored in the database by
+// overriding CheckVariable, ReadVariables and WriteChanges.
+template <class QueryClass=CDefaultQueryClass, class TVariables=CSessionVariableMap>
+class CDBCachedSession:
+	public CDBSession<QueryClass>
+{
+	typedef CDBSession<QueryClass> baseClass;
+	typedef CAtlMap<CStringA,
+					bool,
+					CStringElementTraits<CStringA> > DirtyMapType;
+public:
+	typedef CDBSessionCache SESSIONCACHE_TYPE;
+	BEGIN_COM_MAP(CDBCachedSession)
+		COM_INTERFACE_ENTRY(ISession)
+	END_COM_MAP()
+
+	CDBCachedSession() noexcept :
+		m_pCache(NULL),
+		m_nVersion(0),
+		m_bLoaded(false),
+		m_bRemoveAll(false)
+	{
+	}
+
+	void FinalRelease() noexcept
+	{
+		SessionUnlock();
+	}
+
+	void SetSessionCache(SESSIONCACHE_TYPE *pCache) noexcept
+	{
+		m_pCache = pCache;
+	}
+
+	STDMETHOD(SetVariable)(LPCSTR szName, VARIANT Val) noexcept
 	{
-		HRESULT hr = E_FAIL;
 		if (!szName)
 			return E_INVALIDARG;
 
-		// Get the data connection for this thread.
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		HRESULT hr = LoadVariables();
 		if (hr != S_OK)
 			return hr;
 
-		// update the last access time for this session
-		hr = Access();
+		// Make sure the variable can be stored now,
+		// rather than failing when the session is written back.
+		hr = CheckVariable(szName, &Val);
+		if (hr != S_OK)
+			return hr;
+
+		hr = m_Variables.SetVariable(szName, &Val);
 		if (hr != S_OK)
 			return hr;
 
-		// allocate a command and set it's input parameters
-		CCommand<CAccessor<CSessionDataDeletor> > command;
 		_ATLTRY
 		{
-			CA2CT name(szName);
-			hr = command.Assign(m_szSessionName, name);
+			m_Dirty.SetAt(szName, true);
 		}
 		_ATLCATCHALL()
 		{
-			return E_OUTOFMEMORY;
+			hr = E_OUTOFMEMORY;
 		}
-
-		// execute the command
-		DBROWCOUNT nRows = 0;
-		if (hr == S_OK)
-			hr = command.Open(dataconn, m_QueryObj.GetSessionVarDeleteVar(),
-			NULL, &nRows, DBGUID_DEFAULT, false);
-		if (hr == S_OK && nRows <= 0)
-			hr = E_FAIL;
 		return hr;
 	}
 
-	// Gives the count of rows in the table for this session ID.
-	STDMETHOD(GetCount)(long *pnCount) noexcept
+	STDMETHOD(GetVariable)(LPCSTR szName, VARIANT *pVal) noexcept
 	{
-		HRESULT hr = S_OK;
-		if (pnCount)
-			*pnCount = 0;
+		if (!szName)
+			return E_INVALIDARG;
+		if (pVal)
+			VariantInit(pVal);
 		else
 			return E_POINTER;
 
-		// Get the database connection for this thread.
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
-		if (hr != S_OK)
-			return hr;
-		hr = Access();
+		HRESULT hr = LoadVariables();
 		if (hr != S_OK)
 			return hr;
-		CCommand<CAccessor<CCountAccessor> > command;
 
-		hr = command.Assign(m_szSessionName);
-		if (hr == S_OK)
-		{
-			hr = command.Open(dataconn, m_QueryObj.GetSessionVarCount());
-			if (hr == S_OK)
-			{
-				if (S_OK == (hr = command.MoveFirst()))
-				{
-					*pnCount = command.m_nCount;
-					hr = S_OK;
-				}
-			}
-		}
+		hr = m_Variables.GetVariable(szName, pVal);
+		if (hr == S_FALSE)
+			hr = DB_S_ENDOFROWSET; // what CDBSession returns for a missing variable
 		return hr;
 	}
 
-	STDMETHOD(RemoveAllVariables)() noexcept
+	STDMETHOD(RemoveVariable)(LPCSTR szName) noexcept
 	{
-		HRESULT hr = E_UNEXPECTED;
+		if (!szName)
+			return E_INVALIDARG;
 
-		// Get the data connection for this thread.
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		HRESULT hr = LoadVariables();
 		if (hr != S_OK)
 			return hr;
 
-		CCommand<CAccessor<CSessionDataDeleteAll> > command;
-		hr = command.Assign(m_szSessionName);
+		hr = m_Variables.SetVariable(szName, NULL);
+		if (hr == S_FALSE)
+			return E_FAIL;
 		if (hr != S_OK)
 			return hr;
 
-		// delete all session variables
-		hr = command.Open(dataconn, m_QueryObj.GetSessionVarDeleteAllVars(), NULL, NULL, DBGUID_DEFAULT, false);
+		_ATLTRY
+		{
+			m_Dirty.SetAt(szName, false);
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_UNEXPECTED;
+		}
 		return hr;
 	}
 
-	// Iteration of variables works by taking a snapshot
-	// of the sessions at the point in time BeginVariableEnum
-	// is called, and then keeping an index variable that you use to
-	// move through the snapshot rowset. It is important to know
-	// that the handle returned in phEnum is not thread safe. It
-	// should only be used by the calling thread.
-	STDMETHOD(BeginVariableEnum)(POSITION *pPOS, HSESSIONENUM *phEnum) noexcept
+	STDMETHOD(GetCount)(long *pnCount) noexcept
 	{
-		HRESULT hr = E_FAIL;
-		if (!pPOS)
-			return E_POINTER;
-
-		if (phEnum)
-			*phEnum = NULL;
+		if (pnCount)
+			*pnCount = 0;
 		else
 			return E_POINTER;
 
-		// Get the data connection for this thread.
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
-		if (hr != S_OK)
-			return hr;
-
-		// Update the last access time for this session.
-		hr = Access();
-		if (hr != S_OK)
-			return hr;
-
-		// Allocate a new iterator accessor and initialize it's input parameters.
-		iterator_accessor *pIteratorAccessor = NULL;
-		ATLTRYALLOC(pIteratorAccessor = new iterator_accessor);
-		if (!pIteratorAccessor)
-			return E_OUTOFMEMORY;
+		HRESULT hr = LoadVariables();
+		if (hr == S_OK)
+			*pnCount = (long) m_Variables.GetCount();
+		return hr;
+	}
 
-		hr = pIteratorAccessor->Assign(m_szSessionName, NULL, NULL);
+	STDMETHOD(RemoveAllVariables)() noexcept
+	{
+		HRESULT hr = LoadVariables();
 		if (hr == S_OK)
 		{
-			// execute the command and move to the first row of the recordset.
-			hr = pIteratorAccessor->Open(dataconn, 
-								m_QueryObj.GetSessionVarSelectAllVars());
-			if (hr == S_OK)
-			{
-				hr = pIteratorAccessor->MoveFirst();
-				if (hr == S_OK)
-				{
-					*pPOS = (POSITION) INVALID_DB_SESSION_POS + 1;
-					*phEnum = reinterpret_cast<HSESSIONENUM>(pIteratorAccessor);
-				}
-			}
-
-			if (hr != S_OK)
-			{
-				*pPOS = INVALID_DB_SESSION_POS;
-				*phEnum = NULL;
-				delete pIteratorAccessor;
-			}
+			m_Variables.Empty();
+			m_Dirty.RemoveAll();
+			m_bRemoveAll = true;
 		}
 		return hr;
 	}
 
-	// The values for hEnum and pPos must have been initialized in a previous
-	// call to BeginVariableEnum. On success, the out variant will hold the next
-	// variable
-	STDMETHOD(GetNextVariable)(POSITION *pPOS, VARIANT *pVal, HSESSIONENUM hEnum, LPSTR szName=NULL, DWORD dwLen=0) noexcept
+	// Enumeration works on the in-memory variables, so no enumeration
+	// handle is needed and phEnum is always set to NULL.
+	STDMETHOD(BeginVariableEnum)(POSITION *pPOS, HSESSIONENUM *phEnum) noexcept
 	{
 		if (!pPOS)
-			return E_INVALIDARG;
+			return E_POINTER;
 
-		if (pVal)
-			VariantInit(pVal);
+		if (phEnum)
+			*phEnum = NULL;
 		else
 			return E_POINTER;
 
-		if (!hEnum)
-			return E_UNEXPECTED;
-
-		if (*pPOS <= INVALID_DB_SESSION_POS)
-			return E_UNEXPECTED;
-
-		iterator_accessor *pIteratorAccessor = reinterpret_cast<iterator_accessor*>(hEnum);
-
-		// update the last access time.
-		HRESULT hr = Access();
-
-		POSITION posCurrent = *pPOS;
-
-		if (szName)
-		{
-			// caller wants entry name
-			_ATLTRY
-			{
-				CT2CA szVarName(pIteratorAccessor->m_VariableName);
-				if (szVarName != NULL && dwLen > Checked::strnlen(szVarName, dwLen))
-				{
-					Checked::strcpy_s(szName, dwLen, szVarName);
-				}
-				else
-					hr = E_OUTOFMEMORY; // buffer not big enough
-			}				
-			_ATLCATCHALL()
-			{
-				hr = E_OUTOFMEMORY;
-			}
-				
-		}
-
+		*pPOS = NULL;
+		HRESULT hr = LoadVariables();
 		if (hr == S_OK)
-		{
-			CStreamOnByteArray stream(pIteratorAccessor->m_VariableValue);
-			CComVariant vOut;
-			hr = vOut.ReadFromStream(static_cast<IStream*>(&stream));
-			if (hr == S_OK)
-				vOut.Detach(pVal);
-			else
-				return hr;
-		}
+			*pPOS = m_Variables.GetStartPosition();
+		return hr;
+	}
+
+	STDMETHOD(GetNextVariable)(POSITION *pPOS, VARIANT *pVal, HSESSIONENUM /*hEnum*/, LPSTR szName=NULL, DWORD dwLen=0) noexcept
+	{
+		if (!pPOS)
+			return E_INVALIDARG;
+
+		if (pVal)
+			VariantInit(pVal);
 		else
-			return hr;
+			return E_POINTER;
 
-		hr = pIteratorAccessor->MoveNext();
-		*pPOS = ++posCurrent;
+		if (!*pPOS)
+			return E_UNEXPECTED;
 
-		if (hr == DB_S_ENDOFROWSET)
-		{
-			// We're done iterating, reset everything
-			*pPOS = INVALID_DB_SESSION_POS;
-			hr = S_OK;
-		}
+		return m_Variables.GetNextVariable(*pPOS, pVal, szName, dwLen);
+	}
+
+	STDMETHOD(CloseEnum)(HSESSIONENUM /*hEnum*/) noexcept
+	{
+		return S_OK;
+	}
+
+	// SessionUnlock writes back the variables changed while the session
+	// was in use, and decrements the session RefCount in the same
+	// transaction. If nothing changed, this is the same as
+	// CDBSession::SessionUnlock.
+	HRESULT SessionUnlock() noexcept
+	{
+		if (!m_bRemoveAll && m_Dirty.IsEmpty())
+			return baseClass::SessionUnlock();
 
+		HRESULT hr = WriteVariables();
+		m_Dirty.RemoveAll();
+		m_bRemoveAll = false;
 		if (hr != S_OK)
 		{
-			VariantClear(pVal);
+			// The transaction was rolled back, so the session reference
+			// still has to be released.
+			if (m_pCache)
+				m_pCache->Remove(m_szSessionName);
+			baseClass::SessionUnlock();
+			return hr;
 		}
-		return hr;
-	}
 
-	// CloseEnum frees up any resources allocated by the iterator
-	STDMETHOD(CloseEnum)(HSESSIONENUM hEnum) noexcept
-	{
-		iterator_accessor *pIteratorAccessor = reinterpret_cast<iterator_accessor*>(hEnum);
-		if (!pIteratorAccessor)
-			return E_INVALIDARG;
-		pIteratorAccessor->Close();
-		delete pIteratorAccessor;
-		return S_OK;
+		// delete the session from the database if
+		// nobody else is using it and it's expired.
+		return this->FreeSession();
 	}
 
-	//
-	// Returns S_FALSE if it's not expired
-	// S_OK if it is expired and an error HRESULT
-	// if an error occurred.
-	STDMETHOD(IsExpired)() noexcept
+protected:
+	// Reads the session's variables the first time they are needed.
+	HRESULT LoadVariables() noexcept
 	{
-		HRESULT hrRet = S_FALSE;
-		HRESULT hr = E_UNEXPECTED;
+		if (m_bLoaded)
+			return S_OK;
+
+		if (!m_szSessionName[0])
+			return E_UNEXPECTED;
 
 		// Get the data connection for this thread.
 		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		HRESULT hr = this->GetSessionConnection(&dataconn, m_spServiceProvider);
 		if (hr != S_OK)
 			return hr;
 
-		CCommand<CAccessor<CSessionRefIsExpired> > command;
-		hr = command.Assign(m_szSessionName);
-		if (hr != S_OK)
-			return hr;
+		hr = ReadCurrentVariables(dataconn);
+		if (hr == S_OK)
+			m_bLoaded = true;
+		return hr;
+	}
 
-		hr = command.Open(dataconn, m_QueryObj.GetSessionRefIsExpired(), 
-							NULL, NULL, DBGUID_DEFAULT, true);
+	// Reads the current version of the session's variables into
+	// m_Variables, from the session cache if it holds that version or
+	// from the database otherwise.
+	HRESULT ReadCurrentVariables(CDataConnection& dataconn) noexcept
+	{
+		CCommand<CAccessor<CSessionRefVersion> > version;
+		HRESULT hr = version.Assign(m_szSessionName);
+		if (hr == S_OK)
+			hr = version.Open(dataconn, m_QueryObj.GetSessionRefVersion());
 		if (hr == S_OK)
+			hr = version.MoveFirst();
+		if (hr != S_OK)
+			return FAILED(hr) ? hr : E_UNEXPECTED;
+		m_nVersion = version.m_nVersion;
+
+		if (m_pCache)
 		{
-			if (S_OK == command.MoveFirst())
-			{
-				if (!_tcscmp(command.m_SessionIDOut, m_szSessionName))
-					hrRet = S_OK;
-			}
+			hr = m_pCache->Lookup(m_szSessionName, m_nVersion, m_Variables);
+			if (hr != S_FALSE)
+				return hr;
 		}
 
-		if (hr == S_OK)
-			return hrRet;
+		hr = ReadVariables(dataconn);
+		if (hr == S_OK && m_pCache)
+			m_pCache->Store(m_szSessionName, m_nVersion, m_Variables);
 		return hr;
 	}
 
-	STDMETHOD(SetTimeout)(unsigned __int64 dwNewTimeout) noexcept
+	// Writes back the changed variables and releases the session
+	// reference in one transaction. Returns DB_E_CONCURRENCYVIOLATION if
+	// other requests kept writing the session first through all of the
+	// retries.
+	HRESULT WriteVariables() noexcept
 	{
-		HRESULT hr = E_UNEXPECTED;
-
 		// Get the data connection for this thread.
 		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		HRESULT hr = this->GetSessionConnection(&dataconn, m_spServiceProvider);
 		if (hr != S_OK)
 			return hr;
 
-		// allocate a command and set it's input parameters
-		CCommand<CAccessor<CSessionRefUpdateTimeout> > command;
-		hr = command.Assign(m_szSessionName, dwNewTimeout);
+		for (int nRetries = 0; ; nRetries++)
+		{
+			hr = TryWriteVariables(dataconn);
+			if (hr != S_FALSE)
+				return hr;
+
+			if (nRetries >= ATL_SESSION_WRITE_RETRIES)
+				return DB_E_CONCURRENCYVIOLATION;
+
+			hr = MergeChanges(dataconn);
+			if (hr != S_OK)
+				return hr;
+		}
+	}
+
+	// Makes one attempt at the transaction of WriteVariables. Returns
+	// S_FALSE, with the transaction rolled back, if the version of the
+	// variables in the database is no longer m_nVersion.
+	HRESULT TryWriteVariables(CDataConnection& dataconn) noexcept
+	{
+		CCommand<CAccessor<CSessionRefCommit> > commit;
+		HRESULT hr = commit.Assign(m_szSessionName, m_nVersion);
 		if (hr != S_OK)
 			return hr;
 
-		hr = command.Open(dataconn, m_QueryObj.GetSessionRefUpdateTimeout(),
-						NULL, NULL, DBGUID_DEFAULT, false);
+		hr = dataconn.m_session.StartTransaction();
+		if (FAILED(hr))
+			return hr;
+
+		// Bumping the version first locks the session reference for the
+		// rest of the transaction. If no rows are updated, another request
+		// has written the session since we read it.
+		DBROWCOUNT nRows = 0;
+		hr = commit.Open(dataconn, m_QueryObj.GetSessionRefCommit(),
+						NULL, &nRows, DBGUID_DEFAULT, false);
+		if (hr == S_OK && nRows <= 0)
+			hr = S_FALSE;
+
+		if (hr == S_OK)
+			hr = WriteChanges(dataconn);
+
+		if (hr == S_OK)
+			hr = dataconn.m_session.Commit();
+		else
+			dataconn.m_session.Abort();
 
+		if (hr == S_OK && m_pCache)
+			m_pCache->Store(m_szSessionName, m_nVersion+1, m_Variables);
 		return hr;
 	}
 
-	// SessionLock increments the session reference count for this session.
-	// If there is not a session by this name in the session references table,
-	// a new session entry is created in the the table.
-	HRESULT SessionLock() noexcept
+	// Reads the session's variables again, at the version another request
+	// has written, and applies this request's changes to them: first
+	// RemoveAllVariables if it was called, then the variables set or
+	// removed since.
+	HRESULT MergeChanges(CDataConnection& dataconn) noexcept
 	{
-		HRESULT hr = E_UNEXPECTED;
-		if (!m_szSessionName || m_szSessionName[0]==0)
-			return hr; // no session to lock.
+		CSessionBlob::VarMapType changes;
+		HRESULT hr = S_OK;
+		_ATLTRY
+		{
+			POSITION pos = m_Dirty.GetStartPosition();
+			while (pos)
+			{
+				const DirtyMapType::CPair *pPair = m_Dirty.GetNext(pos);
+				if (pPair->m_value)
+				{
+					CComVariant val;
+					hr = m_Variables.GetVariable(pPair->m_key, &val);
+					if (hr != S_OK)
+						return FAILED(hr) ? hr : E_UNEXPECTED;
+					changes.SetAt(pPair->m_key, val);
+				}
+			}
+		}
+		_ATLCATCHALL()
+		{
+			return E_OUTOFMEMORY;
+		}
 
-		// retrieve the data connection for this thread
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+		hr = ReadCurrentVariables(dataconn);
 		if (hr != S_OK)
 			return hr;
 
-		// first try to update a session with this name
-		DBROWCOUNT nRows = 0;
-		CCommand<CAccessor<CSessionRefUpdator> > updator;
-		if (S_OK == updator.Assign(m_szSessionName))
+		_ATLTRY
 		{
-			if (S_OK != (hr = updator.Open(dataconn, m_QueryObj.GetSessionRefAddRef(),
-				NULL, &nRows, DBGUID_DEFAULT, false)) ||
-				nRows == 0)
+			if (m_bRemoveAll)
+				m_Variables.Empty();
+
+			// Removing a variable the other request has also removed isn't an error.
+			POSITION pos = m_Dirty.GetStartPosition();
+			while (SUCCEEDED(hr) && pos)
 			{
-				// No session to update. Use the creator accessor
-				// to create a new session reference.
-				CCommand<CAccessor<CSessionRefCreator> > creator;
-				hr = creator.Assign(m_szSessionName, m_dwTimeout);
-				if (hr == S_OK)
-					hr = creator.Open(dataconn, m_QueryObj.GetSessionRefCreate(),
-					NULL, &nRows, DBGUID_DEFAULT, false);
+				const DirtyMapType::CPair *pPair = m_Dirty.GetNext(pos);
+				if (pPair->m_value)
+					hr = m_Variables.SetVariable(pPair->m_key, &changes.Lookup(pPair->m_key)->m_value);
+				else
+					hr = m_Variables.SetVariable(pPair->m_key, NULL);
 			}
+			if (hr == S_FALSE)
+				hr = S_OK;
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
 		}
-
-		// We should have been able to create or update a session.
-		ATLASSERT(nRows > 0);
-		if (hr == S_OK && nRows <= 0)
-			hr = E_UNEXPECTED;
-
 		return hr;
 	}
 
-	// SessionUnlock decrements the session RefCount for this session.
-	// Sessions cannot be removed from the database unless the session
-	// refcount is 0
-	HRESULT SessionUnlock() noexcept
+	// Checks that a variable can be written to the SessionVariables table.
+	virtual HRESULT CheckVariable(LPCSTR szName, VARIANT *pVal) noexcept
 	{
-		HRESULT hr = E_UNEXPECTED;
-		if (!m_szSessionName ||
-			m_szSessionName[0]==0)
-			return hr; 
+		HRESULT hr = E_FAIL;
+		_ATLTRY
+		{
+			CSessionDataBase data;
+			CA2CT name(szName);
+			hr = data.Assign(m_szSessionName, name, pVal);
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		return hr;
+	}
 
-		// get the data connection for this thread
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+	// Reads all of the session's variables into m_Variables, in one query.
+	virtual HRESULT ReadVariables(CDataConnection& dataconn) noexcept
+	{
+		CCommand<CAccessor<CAllSessionDataSelector> > command;
+		HRESULT hr = command.Assign(m_szSessionName, NULL, NULL);
 		if (hr != S_OK)
 			return hr;
 
-		// The session must exist at this point in order to unlock it
-		// so we can just use the session updator here.
-		DBROWCOUNT nRows = 0;
-		CCommand<CAccessor<CSessionRefUpdator> > updator;
-		hr = updator.Assign(m_szSessionName);
-		if (hr == S_OK)
-		{
-			hr = updator.Open(	dataconn,
-								m_QueryObj.GetSessionRefRemoveRef(),
-								NULL,
-								&nRows,
-								DBGUID_DEFAULT,
-								false);
-		}
+		hr = command.Open(dataconn, m_QueryObj.GetSessionVarSelectAllVars());
 		if (hr != S_OK)
 			return hr;
 
-		// delete the session from the database if 
-		// nobody else is using it and it's expired.
-		hr = FreeSession();
+		_ATLTRY
+		{
+			m_Variables.Empty();
+			hr = command.MoveFirst();
+			while (hr == S_OK)
+			{
+				CStreamOnByteArray stream(command.m_VariableValue);
+				CComVariant vOut;
+				hr = vOut.ReadFromStream(static_cast<IStream*>(&stream));
+				if (hr == S_OK)
+				{
+					// Depending on the configuration of the database, the
+					// name might come back padded with trailing white space.
+					CStringA strName(command.m_VariableName);
+					strName.TrimRight(' ');
+					hr = m_Variables.SetVariable(strName, &vOut);
+					if (hr == S_OK)
+						hr = command.MoveNext();
+				}
+			}
+			if (hr == DB_S_ENDOFROWSET)
+				hr = S_OK;
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
+		}
 		return hr;
 	}
 
-	// Access updates the last access time for the session. The access
-	// time for sessions is updated using the SQL GETDATE function on the
-	// database server so that all clients will be using the same clock
-	// to compare access times against.
-	HRESULT Access() noexcept
+	// Writes the changes recorded in m_Dirty and m_bRemoveAll, as part of
+	// the transaction started by WriteVariables.
+	virtual HRESULT WriteChanges(CDataConnection& dataconn) noexcept
 	{
-		HRESULT hr = E_UNEXPECTED;
+		HRESULT hr = S_OK;
+		if (m_bRemoveAll)
+		{
+			CCommand<CAccessor<CSessionDataDeleteAll> > deleteAll;
+			hr = deleteAll.Assign(m_szSessionName);
+			if (hr == S_OK)
+				hr = deleteAll.Open(dataconn, m_QueryObj.GetSessionVarDeleteAllVars(),
+									NULL, NULL, DBGUID_DEFAULT, false);
+		}
 
-		if (!m_szSessionName || 
-			m_szSessionName[0]==0)
-			return hr; // no session to access
+		POSITION pos = m_Dirty.GetStartPosition();
+		while (hr == S_OK && pos)
+		{
+			const DirtyMapType::CPair *pPair = m_Dirty.GetNext(pos);
+			if (pPair->m_value)
+				hr = WriteVariable(dataconn, pPair->m_key);
+			else
+				hr = DeleteVariable(dataconn, pPair->m_key);
+		}
+		return hr;
+	}
 
-		// get the data connection for this thread
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
+	HRESULT WriteVariable(CDataConnection& dataconn, const CStringA& strName) noexcept
+	{
+		CComVariant val;
+		HRESULT hr = m_Variables.GetVariable(strName, &val);
+		if (hr != S_OK)
+			return FAILED(hr) ? hr : E_UNEXPECTED;
+
+		CCommand<CAccessor<CSessionDataUpdator> > command;
+		_ATLTRY
+		{
+			CA2CT name(strName);
+			hr = command.Assign(m_szSessionName, name, &val);
+		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
+		}
 		if (hr != S_OK)
 			return hr;
 
-		// The session reference entry in the references table must
-		// be created prior to calling this function so we can just
-		// use an updator to update the current entry.
-		CCommand<CAccessor<CSessionRefUpdator> > updator;
+		return WriteRow(dataconn, command);
+	}
 
-		DBROWCOUNT nRows = 0;
-		hr = updator.Assign(m_szSessionName);
-		if (hr == S_OK)
+	HRESULT DeleteVariable(CDataConnection& dataconn, const CStringA& strName) noexcept
+	{
+		HRESULT hr = E_FAIL;
+		_ATLTRY
 		{
-			hr = updator.Open(	dataconn,
-								m_QueryObj.GetSessionRefAccess(),
-								NULL,
-								&nRows,
-								DBGUID_DEFAULT,
-								false);
+			CA2CT name(strName);
+			hr = DeleteRow(dataconn, name);
 		}
+		_ATLCATCHALL()
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		return hr;
+	}
 
-		ATLASSERT(nRows > 0);
+	// Writes the SessionVariables row the command has been assigned.
+	template <class TAccessor>
+	HRESULT WriteRow(CDataConnection& dataconn, CCommand<CAccessor<TAccessor> >& command) noexcept
+	{
+		// Try an update. Update will fail if the variable is not already there.
+		DBROWCOUNT nRows = 0;
+		HRESULT hr = command.Open(dataconn, m_QueryObj.GetSessionVarUpdate(),
+						NULL, &nRows, DBGUID_DEFAULT, false);
 		if (hr == S_OK && nRows <= 0)
-			hr = E_UNEXPECTED;
+		{
+			// Try an insert
+			hr = command.Open(dataconn, m_QueryObj.GetSessionVarInsert(),
+							NULL, &nRows, DBGUID_DEFAULT, false);
+			if (hr == S_OK && nRows <= 0)
+				hr = E_UNEXPECTED;
+		}
 		return hr;
 	}
 
-	// If the session is expired and it's reference is 0,
-	// it can be deleted. SessionUnlock calls this function to
-	// unlock the session and delete it after we release a session
-	// lock. Note that our SQL command will only delete the session
-	// if it is expired and it's refcount is <= 0
-	HRESULT FreeSession() noexcept
+	HRESULT DeleteRow(CDataConnection& dataconn, LPCTSTR szName) noexcept
 	{
-		HRESULT hr = E_UNEXPECTED;
-		if (!m_szSessionName ||
-			m_szSessionName[0]==0)
-			return hr;
+		CCommand<CAccessor<CSessionDataDeletor> > command;
+		HRESULT hr = command.Assign(m_szSessionName, szName);
 
-		// Get the data connection for this thread.
-		CDataConnection dataconn;
-		hr = GetSessionConnection(&dataconn, m_spServiceProvider);
-		if (hr != S_OK)
-			return hr;
+		// The variable may never have been written to the database,
+		// so it's not an error if there's nothing to delete.
+		if (hr == S_OK)
+			hr = command.Open(dataconn, m_QueryObj.GetSessionVarDeleteVar(),
+							NULL, NULL, DBGUID_DEFAULT, false);
+		return hr;
+	}
 
-		CCommand<CAccessor<CSessionRefUpdator> > updator;
+	using baseClass::m_szSessionName;
+	using baseClass::m_spServiceProvider;
+	using baseClass::m_QueryObj;
+
+	SESSIONCACHE_TYPE *m_pCache;
+	LONG m_nVersion;
+	bool m_bLoaded;
+	bool m_bRemoveAll;
+	TVariables m_Variables;
+	DirtyMapType m_Dirty; // true if the variable was set, false if it was removed
+}; // CDBCachedSession
+
+
+// CDBPackedSession
+// A CDBCachedSession that keeps the session's variables packed in a
+// CSessionBlob, and stores the blob as it is in a single row of the
+// SessionVariables table, named ATL_SESSION_BLOB_VARNAME. Reading the
+// session is one SELECT and writing it back is one UPDATE or INSERT
+// however many variables changed, and neither packs or unpacks the
+// variables: a variable is only read from the blob when it is asked
+// for. The session uses one row instead of one per variable. All of the
+// packed variables have to fit in ATL_SESSION_BLOB_MAX_LENGTH bytes.
+template <class QueryClass=CDefaultQueryClass>
+class CDBPackedSession:
+	public CDBCachedSession<QueryClass, CSessionBlob>
+{
+	typedef CDBCachedSession<QueryClass, CSessionBlob> baseClass;
+public:
+	BEGIN_COM_MAP(CDBPackedSession)
+		COM_INTERFACE_ENTRY(ISession)
+	END_COM_MAP()
 
-		// The SQL for this command only deletes the
-		// session reference from the references table if it's access
-		// count is 0 and it has expired.
-		return updator.Open(dataconn,
-							m_QueryObj.GetSessionRefDelete(),
-							NULL,
-							NULL,
-							DBGUID_DEFAULT,
-							false);
+protected:
+	// Checks that the packed variables would still fit in the
+	// VariableValue column with this variable set.
+	virtual HRESULT CheckVariable(LPCSTR szName, VARIANT *pVal) noexcept
+	{
+		DWORD cbData = 0;
+		HRESULT hr = m_Variables.GetSizeWithVariable(szName, pVal, &cbData);
+		if (hr == S_OK && cbData > ATL_SESSION_BLOB_MAX_LENGTH)
+			hr = E_INVALIDARG;
+		return hr;
 	}
 
-	// Initialize is called each time a new session is created.
-	HRESULT Initialize( LPCSTR szSessionName, 
-						IServiceProvider *pServiceProvider,
-						DWORD_PTR dwCookie,
-						PFN_GETPROVIDERINFO pfnInfo) noexcept
+	virtual HRESULT ReadVariables(CDataConnection& dataconn) noexcept
 	{
-		if (!szSessionName)
-			return E_INVALIDARG;
-
-		if (!pServiceProvider)
-			return E_INVALIDARG;
-
-		if (!pfnInfo)
-			return E_INVALIDARG;
-
-		m_pfnInfo = pfnInfo;
-		m_dwProvCookie = dwCookie;
-		m_spServiceProvider = pServiceProvider;
+		CCommand<CAccessor<CSessionBlobSelector> > command;
+		HRESULT hr = command.Assign(m_szSessionName, ATL_SESSION_BLOB_VARNAME, NULL, 0);
+		if (hr == S_OK)
+			hr = command.Open(dataconn, m_QueryObj.GetSessionVarSelectVar());
+		if (hr != S_OK)
+			return hr;
 
-		_ATLTRY
+		m_Variables.Empty();
+		hr = command.MoveFirst();
+		if (hr == S_OK)
 		{
-			CA2CT tcsSessionName(szSessionName);
-			if (Checked::tcsnlen(tcsSessionName, MAX_SESSION_KEY_LEN) < MAX_SESSION_KEY_LEN)
-				Checked::tcscpy_s(m_szSessionName, _countof(m_szSessionName), tcsSessionName);
+			if (command.m_VariableLen <= ATL_SESSION_BLOB_MAX_LENGTH)
+				hr = m_Variables.Load(command.m_VariableValue, (DWORD) command.m_VariableLen);
 			else
-				return E_OUTOFMEMORY;
+				hr = E_FAIL;
 		}
-		_ATLCATCHALL()
-		{
-			return E_OUTOFMEMORY;
-		}
-		return SessionLock();
+		else if (hr == DB_S_ENDOFROWSET)
+			hr = S_OK; // no variables have been stored yet
+		return hr;
 	}
 
-	HRESULT GetSessionConnection(CDataConnection *pConn,
-								 IServiceProvider *pProv) noexcept
+	virtual HRESULT WriteChanges(CDataConnection& dataconn) noexcept
 	{
-		if (!pProv)
-			return E_INVALIDARG;
+		if (!m_Variables.GetCount())
+			return this->DeleteRow(dataconn, ATL_SESSION_BLOB_VARNAME);
 
-		if (!m_pfnInfo || 
-			!m_dwProvCookie)
-			return E_UNEXPECTED;
+		CCommand<CAccessor<CSessionBlobUpdator> > command;
+		HRESULT hr = command.Assign(m_szSessionName, ATL_SESSION_BLOB_VARNAME,
+									m_Variables.GetData(), m_Variables.GetSize());
+		if (hr != S_OK)
+			return hr;
 
-		wchar_t *wszProv = NULL;
-		if (m_pfnInfo(m_dwProvCookie, &wszProv) && wszProv!=NULL)
-		{
-			return GetDataSource(pProv,
-						ATL_DBSESSION_ID,
-						wszProv,
-						pConn);
-		}
-		return E_FAIL;
+		return this->WriteRow(dataconn, command);
 	}
 
-
-protected:
-	TCHAR m_szSessionName[MAX_SESSION_KEY_LEN];
-	unsigned __int64 m_dwTimeout;
-	CComPtr<IServiceProvider> m_spServiceProvider;
-	DWORD_PTR m_dwProvCookie;
-	PFN_GETPROVIDERINFO m_pfnInfo;
-	DBQUERYCLASS_TYPE m_QueryObj;
-}; // CDBSession
+	using baseClass::m_szSessionName;
+	using baseClass::m_QueryObj;
+	using baseClass::m_Variables;
+}; // CDBPackedSession
 
 
 template <class TDBSession=CDBSession<> >
@@ -1351,6 +2659,7 @@ class CDBSessionServiceImplT
 	wchar_t m_szConnectionString[MAX_CONNECTION_STRING_LEN];
 	CComPtr<IServiceProvider> m_spServiceProvider;
 	typename TDBSession::DBQUERYCLASS_TYPE m_QueryObj;
+	typename TDBSession::SESSIONCACHE_TYPE m_SessionCache;
 public:
 	typedef const wchar_t* SERVICEIMPL_INITPARAM_TYPE;
 	CDBSessionServiceImplT() noexcept
@@ -1434,6 +2743,7 @@ public:
 		hr = m_SessionNameGenerator.GetNewSessionName(szNewID, pdwSize);
 		if (hr == S_OK)
 		{
+			pNewSession->SetSessionCache(&m_SessionCache);
 			hr = pNewSession->Initialize(szNewID, 
 										m_spServiceProvider,
 										reinterpret_cast<DWORD_PTR>(this),
@@ -1468,6 +2778,7 @@ public:
 		if (pNewSession == NULL)
 			return E_OUTOFMEMORY;
 
+		pNewSession->SetSessionCache(&m_SessionCache);
 		hr = pNewSession->Initialize(szNewID, 
 									m_spServiceProvider,
 									reinterpret_cast<DWORD_PTR>(this),
@@ -1515,6 +2826,7 @@ public:
 			if (pNewSession == NULL)
 				return E_OUTOFMEMORY;
 
+			pNewSession->SetSessionCache(&m_SessionCache);
 			hr = pNewSession->Initialize(szID,
 										m_spServiceProvider,
 										reinterpret_cast<DWORD_PTR>(this),
@@ -1551,6 +2863,7 @@ public:
 			hr = updator.Assign(session);
 			if (hr == S_OK)
 				hr = command.Assign(session);
+			m_SessionCache.Remove(session);
 		}
 		_ATLCATCHALL()
 		{
@@ -1652,12 +2965,13 @@ public:
 
 	void ReleaseAllSessions() noexcept
 	{
-		// nothing to do
+		m_SessionCache.RemoveAll();
 	}
 
 	void SweepSessions() noexcept
 	{
-		// nothing to do
+		// drop cached variables of sessions that haven't been used lately
+		m_SessionCache.Sweep(m_dwTimeout);
 	}
 
 
@@ -1700,6 +3014,8 @@ public:
 }; // CDBSessionServiceImplT
 
 typedef CDBSessionServiceImplT<> CDBSessionServiceImpl;
+typedef CDBSessionServiceImplT<CDBCachedSession<> > CDBCachedSessionServiceImpl;
+typedef CDBSessionServiceImplT<CDBPackedSession<> > CDBPackedSessionServiceImpl;
 
 
 
@@ -2020,20 +3336,190 @@ protected:
 }; // CMemSession
 
 
+// CMemPackedSession
+// A CMemSession that keeps all of the session's variables packed in one
+// CSessionBlob instead of a map of VARIANTs, so a session takes a single
+// allocation rather than several per variable. Variables are stored by
+// value, as written by CComVariant::WriteToStream, so only values that
+// can be written to a stream can be stored. Setting or removing a
+// variable copies the rest of the blob, so this is meant for sessions
+// holding a handful of small variables.
+class CMemPackedSession :
+	public CMemSession
+{
+public:
+	BEGIN_COM_MAP(CMemPackedSession)
+		COM_INTERFACE_ENTRY(ISession)
+	END_COM_MAP()
+
+	STDMETHOD(GetVariable)(LPCSTR szName, VARIANT *pVal) noexcept
+	{
+		if (!szName)
+			return E_INVALIDARG;
+
+		if (pVal)
+			VariantInit(pVal);
+		else
+			return E_POINTER;
+
+		HRESULT hr = Access();
+		if (hr == S_OK)
+		{
+			CSLockType lock(m_cs, false);
+			hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+
+			// only the requested value is read from the blob
+			hr = m_Blob.GetVariable(szName, pVal);
+			if (hr == S_FALSE)
+				hr = E_FAIL;
+		}
+		return hr;
+	}
+
+	STDMETHOD(SetVariable)(LPCSTR szName, VARIANT vNewVal) noexcept
+	{
+		if (!szName)
+			return E_INVALIDARG;
+
+		HRESULT hr = Access();
+		if (hr == S_OK)
+		{
+			CSLockType lock(m_cs, false);
+			hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+			hr = m_Blob.SetVariable(szName, &vNewVal);
+		}
+		return hr;
+	}
+
+	STDMETHOD(RemoveVariable)(LPCSTR szName) noexcept
+	{
+		if (!szName)
+			return E_INVALIDARG;
+
+		HRESULT hr = Access();
+		if (hr == S_OK)
+		{
+			CSLockType lock(m_cs, false);
+			hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+			hr = m_Blob.SetVariable(szName, NULL);
+			if (hr == S_FALSE)
+				hr = E_FAIL;
+		}
+		return hr;
+	}
+
+	STDMETHOD(GetCount)(long *pnCount) noexcept
+	{
+		if (pnCount)
+			*pnCount = 0;
+		else
+			return E_POINTER;
+
+		HRESULT hr = Access();
+		if (hr == S_OK)
+		{
+			CSLockType lock(m_cs, false);
+			hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+			*pnCount = (long) m_Blob.GetCount();
+		}
+		return hr;
+	}
+
+	STDMETHOD(RemoveAllVariables)() noexcept
+	{
+		HRESULT hr = Access();
+		if (hr == S_OK)
+		{
+			CSLockType lock(m_cs, false);
+			hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+			m_Blob.Empty();
+		}
+		return hr;
+	}
+
+	STDMETHOD(BeginVariableEnum)(POSITION *pPOS, HSESSIONENUM *phEnumHandle=NULL) noexcept
+	{
+		if (phEnumHandle)
+			*phEnumHandle = NULL;
+
+		if (pPOS)
+			*pPOS = NULL;
+		else
+			return E_POINTER;
+
+		HRESULT hr = Access();
+		if (hr == S_OK)
+		{
+			CSLockType lock(m_cs, false);
+			hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+			*pPOS = m_Blob.GetStartPosition();
+		}
+		return hr;
+	}
+
+	STDMETHOD(GetNextVariable)(POSITION *pPOS, VARIANT *pVal,
+							   HSESSIONENUM hEnum=NULL,
+							   LPSTR szName=NULL,
+							   DWORD dwLen=0 ) noexcept
+	{
+		(hEnum); // Unused!
+		if (pVal)
+			VariantInit(pVal);
+		else
+			return E_POINTER;
+
+		if (!pPOS)
+			return E_POINTER;
+
+		if (!*pPOS)
+			return E_UNEXPECTED;
+
+		HRESULT hr = Access();
+		if (hr == S_OK)
+		{
+			CSLockType lock(m_cs, false);
+			hr = lock.Lock();
+			if (FAILED(hr))
+				return hr;
+			hr = m_Blob.GetNextVariable(*pPOS, pVal, szName, dwLen);
+		}
+		return hr;
+	}
+
+protected:
+	CSessionBlob m_Blob;
+}; // CMemPackedSession
+
+
 //
-// CMemSessionServiceImpl
+// CMemSessionServiceImplT
 // Implements the service part of in-memory persisted session services.
 //
-class CMemSessionServiceImpl
+// Template Parameters:
+// TMemSession: The session class, CMemSession or CMemPackedSession.
+template <class TMemSession=CMemSession>
+class CMemSessionServiceImplT
 {
 public:
 	typedef void* SERVICEIMPL_INITPARAM_TYPE;
-	CMemSessionServiceImpl() noexcept
+	CMemSessionServiceImplT() noexcept
 	{
 		m_dwTimeout = ATL_SESSION_TIMEOUT;
 	}
 
-	~CMemSessionServiceImpl() noexcept
+	~CMemSessionServiceImplT() noexcept
 	{
 		m_CritSec.Term();
 	}
@@ -2041,7 +3527,7 @@ public:
 	HRESULT CreateNewSession(__out_ecount_part_z(*pdwSize, *pdwSize) LPSTR szNewID, __inout DWORD *pdwSize, __deref_out_opt ISession** ppSession) noexcept
 	{
 		HRESULT hr = E_FAIL;
-		CComObject<CMemSession> *pNewSession = NULL;
+		CComObject<TMemSession> *pNewSession = NULL;
 
 		if (!szNewID)
 			return E_INVALIDARG;
@@ -2057,7 +3543,7 @@ public:
 		_ATLTRY
 		{
 			// Create new session
-			CComObject<CMemSession>::CreateInstance(&pNewSession);
+			CComObject<TMemSession>::CreateInstance(&pNewSession);
 			if (pNewSession == NULL)
 				return E_OUTOFMEMORY;
 
@@ -2094,7 +3580,7 @@ public:
 	HRESULT CreateNewSessionByName(__in_z LPSTR szNewID, __deref_out_opt ISession** ppSession) noexcept
 	{
 		HRESULT hr = E_FAIL;
-		CComObject<CMemSession> *pNewSession = NULL;
+		CComObject<TMemSession> *pNewSession = NULL;
 
 		if (!szNewID || *szNewID == 0)
 			return E_INVALIDARG;
@@ -2118,7 +3604,7 @@ public:
 		_ATLTRY
 		{
 			// Create new session
-			CComObject<CMemSession>::CreateInstance(&pNewSession);
+			CComObject<TMemSession>::CreateInstance(&pNewSession);
 			if (pNewSession == NULL)
 				return E_OUTOFMEMORY;
 
@@ -2329,7 +3815,10 @@ public:
 	typedef CComCritSecLock<CComCriticalSection> CSLockType;
 	CSessionNameGenerator m_SessionNameGenerator; // Object for generating session names
 	unsigned __int64 m_dwTimeout;
-}; // CMemSessionServiceImpl
+}; // CMemSessionServiceImplT
+
+typedef CMemSessionServiceImplT<> CMemSessionServiceImpl;
+typedef CMemSessionServiceImplT<CMemPackedSession> CMemPackedSessionServiceImpl;
 
 
 
@@ -31,6 +31,7 @@ class CCookie;
 
 // Forward declarations of all interfaces declared in this file.
 __interface IWriteStream;
+__interface IWriteStreamGather;
 __interface IHttpFile;
 __interface IHttpServerContext;
 __interface IHttpRequestLookup;
@@ -39,6 +40,7 @@ __interface ITagReplacer;
 __interface IIsapiExtension;
 __interface IPageCacheControl;
 __interface IRequestStats;
+__interface IRequestLatencyStats;
 __interface IBrowserCaps;
 __interface IBrowserCapsSvc;
 
@@ -200,6 +202,34 @@ __interface ATL_NO_VTABLE __declspec(uuid("9868BFC0-D44D-4154-931C-D186EC0C45D5"
 	BOOL Cache(BOOL bCache);
 };
 
+// AtlServerSendBuffer
+// One of the buffers passed to IHttpVectorSend::VectorSend.
+struct AtlServerSendBuffer
+{
+	const void *pvData;
+	DWORD cbData;
+};
+
+// IHttpVectorSend
+// Implemented by server contexts that can send the response headers and
+// several buffers to the client in one gathered write.
+__interface ATL_NO_VTABLE __declspec(uuid("19AE28E0-82D3-4F10-96B4-8F9690827519"))
+	IHttpVectorSend : public IUnknown
+{
+	BOOL VectorSend(LPCSTR szStatus, LPCSTR szHeaders, BOOL fKeepConn,
+		const AtlServerSendBuffer *rgBuffers, DWORD nBuffers);
+};
+
+// IWriteStreamGather
+// Implemented by write streams that can take several buffers in one call.
+// A tag replacer hands it out from GetContext while its stream supports
+// it. It isn't reference counted, and is only valid as long as the stream.
+__interface ATL_NO_VTABLE __declspec(uuid("2DCD9079-FD72-488B-A68C-24697EE1C618"))
+	IWriteStreamGather
+{
+	HRESULT WriteStreamGather(const AtlServerSendBuffer *rgBuffers, DWORD nBuffers, DWORD *pdwWritten);
+};
+
 // IRequestStats
 // Used to query request statistics from a running ATL server ISAPI application.
 __interface ATL_NO_VTABLE __declspec(uuid("2B75C68D-0DDF-48d6-B58A-CC7C2387A6F2"))
@@ -213,6 +243,20 @@ __interface ATL_NO_VTABLE __declspec(uuid("2B75C68D-0DDF-48d6-B58A-CC7C2387A6F2"
 	long GetActiveThreads();
 };
 
+// The latencies reported by IRequestLatencyStats
+#define ATLS_LATENCY_QUEUE_WAIT		0	// time spent waiting for a worker thread
+#define ATLS_LATENCY_SERVICE_TIME	1	// time from receipt to completion, less the queue wait
+
+// IRequestLatencyStats
+// Used to query the request latency distributions kept by a running ATL server
+// ISAPI application. Latencies are in microseconds.
+__interface ATL_NO_VTABLE __declspec(uuid("FB90AC36-B2C7-4B35-9CAD-48E6B7FCCB35"))
+	IRequestLatencyStats : public IUnknown
+{
+	long GetLatencyPercentile(DWORD dwLatency, DWORD dwPerMille);
+	HRESULT RenderLatencyStats(IWriteStream *pStream);
+};
+
 // IBrowserCaps
 // Interface that provides information about a particular web brorwser.
 // See atlutil.h and the ATL Browser Capabilities service for information
@@ -0,0 +1,747 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLSIMDENC_H__
+#define __ATLSIMDENC_H__
+
+#pragma once
+
+// Vectorized base64 and hex codecs for SOAP blobs and MIME attachments.
+//
+// AtlFastBase64Encode, AtlFastBase64Decode, AtlFastHexEncode and
+// AtlFastHexDecode take the same arguments and flags, and produce the same
+// output, lengths and return values, as Base64Encode, Base64Decode,
+// AtlHexEncode and AtlHexDecode in atlenc.h. Runs of plain data go through
+// SSSE3 or AVX2 kernels picked once at run time; line breaks, padding and
+// the short tails go through scalar code. Define ATL_NO_SIMD_CODECS to make
+// them plain forwarders to atlenc.h, which is what they are on processors
+// other than x86 and x64.
+//
+// Besides the atlenc.h routines, they only rely on the basic ATL types and
+// macros (BYTE, LONG, ATLASSERT), which the including file must provide,
+// so that they can be exercised outside of a Windows build.
+
+#if !defined(ATL_NO_SIMD_CODECS) && !defined(_M_CEE) && \
+	(defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+#define _ATL_SIMD_CODECS
+#ifdef _MSC_VER
+#include <intrin.h>
+#define _ATL_SIMD_TARGET(isa)
+#else
+#include <immintrin.h>
+#include <cpuid.h>
+
+// lets the kernels use instructions the rest of the build may not assume
+#define _ATL_SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+#ifdef _ATL_SIMD_CODECS
+
+enum
+{
+	ATL_SIMD_NONE = 0,
+	ATL_SIMD_SSSE3 = 1,
+	ATL_SIMD_AVX2 = 2
+};
+
+inline void _AtlSimdCpuid(int rgInfo[4], int nLeaf) noexcept
+{
+#ifdef _MSC_VER
+	__cpuidex(rgInfo, nLeaf, 0);
+#else
+	unsigned int rgRegs[4] = { 0, 0, 0, 0 };
+	__cpuid_count(nLeaf, 0, rgRegs[0], rgRegs[1], rgRegs[2], rgRegs[3]);
+	for (int i = 0; i < 4; i++)
+		rgInfo[i] = (int) rgRegs[i];
+#endif
+}
+
+// the state components the OS saves on a context switch (XCR0)
+inline ULONGLONG _AtlSimdEnabledState() noexcept
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int nLow, nHigh;
+	__asm__ __volatile__ ("xgetbv" : "=a" (nLow), "=d" (nHigh) : "c" (0));
+	return ((ULONGLONG) nHigh << 32) | nLow;
+#endif
+}
+
+inline int _AtlDetectSimdLevel() noexcept
+{
+	int nLevel = ATL_SIMD_NONE;
+
+	int rgInfo[4];
+	_AtlSimdCpuid(rgInfo, 0);
+	int nIds = rgInfo[0];
+	if (nIds >= 1)
+	{
+		_AtlSimdCpuid(rgInfo, 1);
+		if (rgInfo[2] & (1 << 9))
+			nLevel = ATL_SIMD_SSSE3;
+
+		// AVX2 also needs the OS to save the YMM registers (OSXSAVE, AVX, XCR0)
+		if (nLevel == ATL_SIMD_SSSE3 && nIds >= 7 &&
+			(rgInfo[2] & (1 << 27)) && (rgInfo[2] & (1 << 28)) &&
+			(_AtlSimdEnabledState() & 6) == 6)
+		{
+			_AtlSimdCpuid(rgInfo, 7);
+			if (rgInfo[1] & (1 << 5))
+				nLevel = ATL_SIMD_AVX2;
+		}
+	}
+	return nLevel;
+}
+
+inline volatile LONG *_AtlSimdLevelStorage() noexcept
+{
+	static volatile LONG s_nLevel = -1;
+	return &s_nLevel;
+}
+
+// Returns the instruction set the codecs use, ATL_SIMD_NONE to ATL_SIMD_AVX2
+inline int AtlGetSimdLevel() noexcept
+{
+	volatile LONG *pnLevel = _AtlSimdLevelStorage();
+	LONG nLevel = *pnLevel;
+	if (nLevel < 0)
+	{
+		// every thread computes the same value, so a racy store is fine
+		nLevel = _AtlDetectSimdLevel();
+		*pnLevel = nLevel;
+	}
+	return nLevel;
+}
+
+// Makes the codecs use at most nLevel, to compare the code paths; the
+// CPU's own level still caps it. Not meant to be called while the codecs
+// are in use on other threads.
+inline void AtlSetSimdLevel(int nLevel) noexcept
+{
+	int nDetected = _AtlDetectSimdLevel();
+	*_AtlSimdLevelStorage() = (nLevel < nDetected) ? nLevel : nDetected;
+}
+
+// 12 bytes in the low three quarters of a register to 16 base64 characters
+_ATL_SIMD_TARGET("ssse3") inline __m128i _AtlBase64EncodeSSSE3(__m128i in) noexcept
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+	// split each group of 3 bytes into 4 sextets, one per byte
+	__m128i idx = _mm_or_si128(
+		_mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040)),
+		_mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010)));
+
+	// map each sextet range to the offset that turns it into its character:
+	// 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+	__m128i sel = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	sel = _mm_or_si128(sel, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+	const __m128i lutOffset = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	return _mm_add_epi8(idx, _mm_shuffle_epi8(lutOffset, sel));
+}
+
+// _AtlBase64EncodeSSSE3 on each 128-bit lane
+_ATL_SIMD_TARGET("avx2") inline __m256i _AtlBase64EncodeAVX2(__m256i in) noexcept
+{
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m256i idx = _mm256_or_si256(
+		_mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040)),
+		_mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010)));
+
+	__m256i sel = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+	sel = _mm256_or_si256(sel, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+	const __m256i lutOffset = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	return _mm256_add_epi8(idx, _mm256_shuffle_epi8(lutOffset, sel));
+}
+
+// The block loops of _AtlBase64EncodeGroups. They advance the pointers
+// and the group count past what they encode. The kernels load 4 bytes
+// more than they consume.
+_ATL_SIMD_TARGET("avx2") inline void _AtlBase64EncodeBlocksAVX2(const BYTE **ppbSrc, const BYTE *pbSrcEnd,
+	int *pnGroups, LPSTR *pszDest) noexcept
+{
+	const BYTE *pbSrc = *ppbSrc;
+	LPSTR szDest = *pszDest;
+	int nGroups = *pnGroups;
+	while (nGroups >= 8 && pbSrcEnd - pbSrc >= 28)
+	{
+		__m256i in = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)pbSrc)),
+			_mm_loadu_si128((const __m128i *)(pbSrc + 12)), 1);
+		_mm256_storeu_si256((__m256i *)szDest, _AtlBase64EncodeAVX2(in));
+		pbSrc += 24;
+		szDest += 32;
+		nGroups -= 8;
+	}
+	*ppbSrc = pbSrc;
+	*pszDest = szDest;
+	*pnGroups = nGroups;
+}
+
+_ATL_SIMD_TARGET("ssse3") inline void _AtlBase64EncodeBlocksSSSE3(const BYTE **ppbSrc, const BYTE *pbSrcEnd,
+	int *pnGroups, LPSTR *pszDest) noexcept
+{
+	const BYTE *pbSrc = *ppbSrc;
+	LPSTR szDest = *pszDest;
+	int nGroups = *pnGroups;
+	while (nGroups >= 4 && pbSrcEnd - pbSrc >= 16)
+	{
+		_mm_storeu_si128((__m128i *)szDest, _AtlBase64EncodeSSSE3(_mm_loadu_si128((const __m128i *)pbSrc)));
+		pbSrc += 12;
+		szDest += 16;
+		nGroups -= 4;
+	}
+	*ppbSrc = pbSrc;
+	*pszDest = szDest;
+	*pnGroups = nGroups;
+}
+
+// encodes nGroups 3-byte groups, without line breaks, and returns the
+// number of characters written. Never reads at or past pbSrcEnd.
+inline int _AtlBase64EncodeGroups(const BYTE *pbSrc, const BYTE *pbSrcEnd, int nGroups, LPSTR szDest, int nLevel) noexcept
+{
+	static const char s_chBase64EncodingTable[64] = {
+		'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P', 'Q',
+		'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f', 'g',
+		'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w',
+		'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/' };
+
+	LPSTR szStart = szDest;
+
+	if (nLevel >= ATL_SIMD_AVX2)
+		_AtlBase64EncodeBlocksAVX2(&pbSrc, pbSrcEnd, &nGroups, &szDest);
+	if (nLevel >= ATL_SIMD_SSSE3)
+		_AtlBase64EncodeBlocksSSSE3(&pbSrc, pbSrcEnd, &nGroups, &szDest);
+
+	for (; nGroups > 0; nGroups--)
+	{
+		DWORD dwCurr = ((DWORD)pbSrc[0] << 16) | ((DWORD)pbSrc[1] << 8) | pbSrc[2];
+		szDest[0] = s_chBase64EncodingTable[(dwCurr >> 18) & 0x3f];
+		szDest[1] = s_chBase64EncodingTable[(dwCurr >> 12) & 0x3f];
+		szDest[2] = s_chBase64EncodingTable[(dwCurr >> 6) & 0x3f];
+		szDest[3] = s_chBase64EncodingTable[dwCurr & 0x3f];
+		pbSrc += 3;
+		szDest += 4;
+	}
+
+	return (int)(szDest - szStart);
+}
+
+// decodes 16 base64 characters into 12 bytes. Returns false, without
+// writing, if any of them is not in the base64 alphabet.
+_ATL_SIMD_TARGET("ssse3") inline bool _AtlBase64DecodeSSSE3(LPCSTR szSrc, BYTE *pbDest) noexcept
+{
+	const __m128i mask2F = _mm_set1_epi8(0x2f);
+	const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0);
+
+	__m128i str = _mm_loadu_si128((const __m128i *)szSrc);
+	__m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask2F);
+	__m128i loNibbles = _mm_and_si128(str, mask2F);
+
+	// a character is valid when its low and high nibble classes do not overlap
+	__m128i bad = _mm_and_si128(_mm_shuffle_epi8(lutLo, loNibbles), _mm_shuffle_epi8(lutHi, hiNibbles));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xffff)
+		return false;
+
+	__m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(_mm_cmpeq_epi8(str, mask2F), hiNibbles));
+	str = _mm_add_epi8(str, roll);
+
+	// pack 4 sextets into 3 bytes, big-endian within each group
+	str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+	str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+	str = _mm_shuffle_epi8(str, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+	// two overlapping 8-byte stores write exactly 12 bytes
+	_mm_storel_epi64((__m128i *)pbDest, str);
+	_mm_storel_epi64((__m128i *)(pbDest + 4), _mm_srli_si128(str, 4));
+	return true;
+}
+
+// decodes 32 base64 characters into 24 bytes, as _AtlBase64DecodeSSSE3
+_ATL_SIMD_TARGET("avx2") inline bool _AtlBase64DecodeAVX2(LPCSTR szSrc, BYTE *pbDest) noexcept
+{
+	const __m256i mask2F = _mm256_set1_epi8(0x2f);
+	const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0);
+
+	__m256i str = _mm256_loadu_si256((const __m256i *)szSrc);
+	__m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask2F);
+	__m256i loNibbles = _mm256_and_si256(str, mask2F);
+
+	__m256i bad = _mm256_and_si256(_mm256_shuffle_epi8(lutLo, loNibbles), _mm256_shuffle_epi8(lutHi, hiNibbles));
+	if (!_mm256_testz_si256(bad, bad))
+		return false;
+
+	__m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(_mm256_cmpeq_epi8(str, mask2F), hiNibbles));
+	str = _mm256_add_epi8(str, roll);
+
+	str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+	str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+	str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+	__m128i lo = _mm256_castsi256_si128(str);
+	__m128i hi = _mm256_extracti128_si256(str, 1);
+	_mm_storel_epi64((__m128i *)pbDest, lo);
+	_mm_storel_epi64((__m128i *)(pbDest + 4), _mm_srli_si128(lo, 4));
+	_mm_storel_epi64((__m128i *)(pbDest + 12), hi);
+	_mm_storel_epi64((__m128i *)(pbDest + 16), _mm_srli_si128(hi, 4));
+	return true;
+}
+
+_ATL_SIMD_TARGET("ssse3") inline __m128i _AtlHexEncodeSSSE3(__m128i nibbles) noexcept
+{
+	return _mm_shuffle_epi8(_mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+		'8', '9', 'A', 'B', 'C', 'D', 'E', 'F'), nibbles);
+}
+
+// converts 16 hex digits to their values. Returns false if any of them is not a hex digit.
+_ATL_SIMD_TARGET("ssse3") inline bool _AtlHexValuesSSSE3(__m128i str, __m128i *pValues) noexcept
+{
+	__m128i digit = _mm_sub_epi8(str, _mm_set1_epi8('0'));
+	__m128i alpha = _mm_sub_epi8(_mm_or_si128(str, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+
+	// unsigned range checks: digit <= 9, alpha <= 5
+	__m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+	__m128i isAlpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+	if (_mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha)) != 0xffff)
+		return false;
+
+	*pValues = _mm_or_si128(_mm_and_si128(isDigit, digit),
+		_mm_and_si128(isAlpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+	return true;
+}
+
+_ATL_SIMD_TARGET("avx2") inline bool _AtlHexValuesAVX2(__m256i str, __m256i *pValues) noexcept
+{
+	__m256i digit = _mm256_sub_epi8(str, _mm256_set1_epi8('0'));
+	__m256i alpha = _mm256_sub_epi8(_mm256_or_si256(str, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+
+	__m256i isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+	__m256i isAlpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+	if (_mm256_movemask_epi8(_mm256_or_si256(isDigit, isAlpha)) != -1)
+		return false;
+
+	*pValues = _mm256_or_si256(_mm256_and_si256(isDigit, digit),
+		_mm256_and_si256(isAlpha, _mm256_add_epi8(alpha, _mm256_set1_epi8(10))));
+	return true;
+}
+
+// The block loops of AtlFastBase64Decode. They stop at the first block
+// that holds anything but alphabet characters, or when the output would
+// not fit, and advance the pointers and the count past what they decode.
+_ATL_SIMD_TARGET("avx2") inline void _AtlBase64DecodeBlocksAVX2(LPCSTR *pszSrc, LPCSTR szSrcEnd,
+	BYTE **ppbDest, int *pnWritten, int nDestLen) noexcept
+{
+	LPCSTR szSrc = *pszSrc;
+	BYTE *pbDest = *ppbDest;
+	int nWritten = *pnWritten;
+	while (szSrcEnd - szSrc >= 32 && nDestLen - nWritten >= 24 && _AtlBase64DecodeAVX2(szSrc, pbDest))
+	{
+		szSrc += 32;
+		pbDest += 24;
+		nWritten += 24;
+	}
+	*pszSrc = szSrc;
+	*ppbDest = pbDest;
+	*pnWritten = nWritten;
+}
+
+_ATL_SIMD_TARGET("ssse3") inline void _AtlBase64DecodeBlocksSSSE3(LPCSTR *pszSrc, LPCSTR szSrcEnd,
+	BYTE **ppbDest, int *pnWritten, int nDestLen) noexcept
+{
+	LPCSTR szSrc = *pszSrc;
+	BYTE *pbDest = *ppbDest;
+	int nWritten = *pnWritten;
+	while (szSrcEnd - szSrc >= 16 && nDestLen - nWritten >= 12 && _AtlBase64DecodeSSSE3(szSrc, pbDest))
+	{
+		szSrc += 16;
+		pbDest += 12;
+		nWritten += 12;
+	}
+	*pszSrc = szSrc;
+	*ppbDest = pbDest;
+	*pnWritten = nWritten;
+}
+
+// The block loops of AtlFastHexEncode. They take the number of bytes
+// encoded so far and return it updated.
+_ATL_SIMD_TARGET("avx2") inline int _AtlHexEncodeBlocksAVX2(const BYTE *pbSrcData, int nSrcLen, LPSTR szDest,
+	int nRead) noexcept
+{
+	// widen each byte to a word holding its high nibble in the low byte
+	// and its low nibble in the high byte, which is the output order
+	const __m256i lut = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+		'8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+		'0', '1', '2', '3', '4', '5', '6', '7',
+		'8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+	for (; nSrcLen - nRead >= 16; nRead += 16)
+	{
+		__m256i w = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(pbSrcData + nRead)));
+		w = _mm256_or_si256(_mm256_srli_epi16(w, 4), _mm256_slli_epi16(_mm256_and_si256(w, _mm256_set1_epi16(0x0f)), 8));
+		_mm256_storeu_si256((__m256i *)(szDest + 2*nRead), _mm256_shuffle_epi8(lut, w));
+	}
+	return nRead;
+}
+
+_ATL_SIMD_TARGET("ssse3") inline int _AtlHexEncodeBlocksSSSE3(const BYTE *pbSrcData, int nSrcLen, LPSTR szDest,
+	int nRead) noexcept
+{
+	const __m128i maskLo = _mm_set1_epi8(0x0f);
+	for (; nSrcLen - nRead >= 16; nRead += 16)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i *)(pbSrcData + nRead));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), maskLo);
+		__m128i lo = _mm_and_si128(in, maskLo);
+		_mm_storeu_si128((__m128i *)(szDest + 2*nRead), _AtlHexEncodeSSSE3(_mm_unpacklo_epi8(hi, lo)));
+		_mm_storeu_si128((__m128i *)(szDest + 2*nRead + 16), _AtlHexEncodeSSSE3(_mm_unpackhi_epi8(hi, lo)));
+	}
+	return nRead;
+}
+
+// The block loops of AtlFastHexDecode. They stop before the first block
+// with a character that is not a hex digit and return the number of
+// characters decoded so far.
+_ATL_SIMD_TARGET("avx2") inline int _AtlHexDecodeBlocksAVX2(LPCSTR pSrcData, int nSrcLen, BYTE *pbDest,
+	int nRead) noexcept
+{
+	for (; nSrcLen - nRead >= 32; nRead += 32)
+	{
+		__m256i values;
+		if (!_AtlHexValuesAVX2(_mm256_loadu_si256((const __m256i *)(pSrcData + nRead)), &values))
+			break;
+
+		// high digit * 16 + low digit in each word, then narrow the words to bytes
+		__m256i w = _mm256_maddubs_epi16(values, _mm256_set1_epi16(0x0110));
+		w = _mm256_permute4x64_epi64(_mm256_packus_epi16(w, w), 0x08);
+		_mm_storeu_si128((__m128i *)(pbDest + nRead/2), _mm256_castsi256_si128(w));
+	}
+	return nRead;
+}
+
+_ATL_SIMD_TARGET("ssse3") inline int _AtlHexDecodeBlocksSSSE3(LPCSTR pSrcData, int nSrcLen, BYTE *pbDest,
+	int nRead) noexcept
+{
+	for (; nSrcLen - nRead >= 32; nRead += 32)
+	{
+		__m128i values1;
+		__m128i values2;
+		if (!_AtlHexValuesSSSE3(_mm_loadu_si128((const __m128i *)(pSrcData + nRead)), &values1) ||
+			!_AtlHexValuesSSSE3(_mm_loadu_si128((const __m128i *)(pSrcData + nRead + 16)), &values2))
+			break;
+
+		__m128i w1 = _mm_maddubs_epi16(values1, _mm_set1_epi16(0x0110));
+		__m128i w2 = _mm_maddubs_epi16(values2, _mm_set1_epi16(0x0110));
+		_mm_storeu_si128((__m128i *)(pbDest + nRead/2), _mm_packus_epi16(w1, w2));
+	}
+	return nRead;
+}
+
+#endif // _ATL_SIMD_CODECS
+
+inline BOOL AtlFastBase64Encode(
+	const BYTE *pbSrcData,
+	int nSrcLen,
+	LPSTR szDest,
+	int *pnDestLen,
+	DWORD dwFlags = ATL_BASE64_FLAG_NONE) noexcept
+{
+#ifdef _ATL_SIMD_CODECS
+	int nLevel = AtlGetSimdLevel();
+	if (nLevel == ATL_SIMD_NONE)
+		return Base64Encode(pbSrcData, nSrcLen, szDest, pnDestLen, dwFlags);
+
+	if (!pbSrcData || !szDest || !pnDestLen)
+		return FALSE;
+
+	if (*pnDestLen < Base64EncodeGetRequiredLength(nSrcLen, dwFlags))
+	{
+		ATLASSERT(FALSE);
+		return FALSE;
+	}
+
+	const BYTE *pbSrcEnd = pbSrcData + nSrcLen;
+	int nGroups = nSrcLen / 3;
+	int nWritten = 0;
+
+	// like Base64Encode, break after every 76 characters (19 groups), but
+	// not after the last line unless the data ends on a full line
+	if ((dwFlags & ATL_BASE64_FLAG_NOCRLF) == 0)
+	{
+		for (; nGroups >= 19; nGroups -= 19)
+		{
+			nWritten += _AtlBase64EncodeGroups(pbSrcData, pbSrcEnd, 19, szDest + nWritten, nLevel);
+			pbSrcData += 19 * 3;
+			szDest[nWritten++] = '\r';
+			szDest[nWritten++] = '\n';
+		}
+	}
+	nWritten += _AtlBase64EncodeGroups(pbSrcData, pbSrcEnd, nGroups, szDest + nWritten, nLevel);
+	pbSrcData += nGroups * 3;
+
+	// Base64Encode also writes a line break here and then backs it out;
+	// leave the same bytes behind so the buffers match exactly
+	if ((dwFlags & ATL_BASE64_FLAG_NOCRLF) == 0)
+	{
+		szDest[nWritten] = '\r';
+		szDest[nWritten+1] = '\n';
+	}
+
+	int nRest = nSrcLen % 3;
+	if (nRest)
+	{
+		BYTE rgLast[3] = { 0, 0, 0 };
+		rgLast[0] = pbSrcData[0];
+		if (nRest == 2)
+			rgLast[1] = pbSrcData[1];
+
+		char szLast[4];
+		_AtlBase64EncodeGroups(rgLast, rgLast + 3, 1, szLast, ATL_SIMD_NONE);
+		for (int i = 0; i <= nRest; i++)
+			szDest[nWritten++] = szLast[i];
+
+		if ((dwFlags & ATL_BASE64_FLAG_NOPAD) == 0)
+		{
+			for (int i = nRest; i < 3; i++)
+				szDest[nWritten++] = '=';
+		}
+	}
+
+	*pnDestLen = nWritten;
+	return TRUE;
+#else
+	return Base64Encode(pbSrcData, nSrcLen, szDest, pnDestLen, dwFlags);
+#endif // _ATL_SIMD_CODECS
+}
+
+// DecodeBase64Char as a table, for the characters between vector blocks
+inline int _AtlBase64DecodeChar(char ch) noexcept
+{
+	static const signed char s_rgDecode[256] = {
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+		52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+		-1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+		15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+		-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+		41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 };
+
+	return s_rgDecode[(BYTE)ch];
+}
+
+inline BOOL AtlFastBase64Decode(
+	LPCSTR szSrc,
+	int nSrcLen,
+	BYTE *pbDest,
+	int *pnDestLen) noexcept
+{
+#ifdef _ATL_SIMD_CODECS
+	int nLevel = AtlGetSimdLevel();
+	if (nLevel == ATL_SIMD_NONE)
+		return Base64Decode(szSrc, nSrcLen, pbDest, pnDestLen);
+
+	if (szSrc == NULL || pnDestLen == NULL)
+		return FALSE;
+
+	LPCSTR szSrcEnd = szSrc + nSrcLen;
+	int nWritten = 0;
+	BOOL bOverflow = (pbDest == NULL) ? TRUE : FALSE;
+
+	while (szSrc < szSrcEnd && (*szSrc) != 0)
+	{
+		// whole blocks of alphabet characters decode in one step; anything
+		// else (line breaks, padding, junk) is left to the scalar loop below
+		if (!bOverflow)
+		{
+			if (nLevel >= ATL_SIMD_AVX2)
+				_AtlBase64DecodeBlocksAVX2(&szSrc, szSrcEnd, &pbDest, &nWritten, *pnDestLen);
+			_AtlBase64DecodeBlocksSSSE3(&szSrc, szSrcEnd, &pbDest, &nWritten, *pnDestLen);
+			if (szSrc >= szSrcEnd || (*szSrc) == 0)
+				break;
+		}
+
+		// one group, as Base64Decode does it
+		DWORD dwCurr = 0;
+		int i;
+		int nBits = 0;
+		for (i=0; i<4; i++)
+		{
+			if (szSrc >= szSrcEnd)
+				break;
+			int nCh = _AtlBase64DecodeChar(*szSrc);
+			szSrc++;
+			if (nCh == -1)
+			{
+				// skip this char
+				i--;
+				continue;
+			}
+			dwCurr <<= 6;
+			dwCurr |= nCh;
+			nBits += 6;
+		}
+
+		if (!bOverflow && nWritten + (nBits/8) > (*pnDestLen))
+			bOverflow = TRUE;
+
+		dwCurr <<= 24-nBits;
+		for (i=0; i<nBits/8; i++)
+		{
+			if (!bOverflow)
+			{
+				*pbDest = (BYTE) ((dwCurr & 0x00ff0000) >> 16);
+				pbDest++;
+			}
+			dwCurr <<= 8;
+			nWritten++;
+		}
+	}
+
+	*pnDestLen = nWritten;
+
+	if (bOverflow)
+	{
+		if (pbDest != NULL)
+		{
+			ATLASSERT(false);
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
+#else
+	return Base64Decode(szSrc, nSrcLen, pbDest, pnDestLen);
+#endif // _ATL_SIMD_CODECS
+}
+
+inline BOOL AtlFastHexEncode(
+	const BYTE *pbSrcData,
+	int nSrcLen,
+	LPSTR szDest,
+	int *pnDestLen) noexcept
+{
+#ifdef _ATL_SIMD_CODECS
+	int nLevel = AtlGetSimdLevel();
+	if (nLevel == ATL_SIMD_NONE)
+		return AtlHexEncode(pbSrcData, nSrcLen, szDest, pnDestLen);
+
+	if (!pbSrcData || !szDest || !pnDestLen)
+		return FALSE;
+
+	if (*pnDestLen < AtlHexEncodeGetRequiredLength(nSrcLen))
+	{
+		ATLASSERT(FALSE);
+		return FALSE;
+	}
+
+	int nRead = 0;
+	if (nLevel >= ATL_SIMD_AVX2)
+		nRead = _AtlHexEncodeBlocksAVX2(pbSrcData, nSrcLen, szDest, nRead);
+	nRead = _AtlHexEncodeBlocksSSSE3(pbSrcData, nSrcLen, szDest, nRead);
+
+	for (; nRead < nSrcLen; nRead++)
+	{
+		BYTE ch = pbSrcData[nRead];
+		szDest[2*nRead] = AtlHexDigit((ch >> 4) & 0x0F);
+		szDest[2*nRead+1] = AtlHexDigit(ch & 0x0F);
+	}
+
+	*pnDestLen = 2*nSrcLen;
+	return TRUE;
+#else
+	return AtlHexEncode(pbSrcData, nSrcLen, szDest, pnDestLen);
+#endif // _ATL_SIMD_CODECS
+}
+
+inline BOOL AtlFastHexDecode(
+	LPCSTR pSrcData,
+	int nSrcLen,
+	BYTE *pbDest,
+	int *pnDestLen) noexcept
+{
+#ifdef _ATL_SIMD_CODECS
+	int nLevel = AtlGetSimdLevel();
+	if (nLevel == ATL_SIMD_NONE)
+		return AtlHexDecode(pSrcData, nSrcLen, pbDest, pnDestLen);
+
+	if (!pSrcData || !pbDest || !pnDestLen)
+		return FALSE;
+
+	if (*pnDestLen < AtlHexDecodeGetRequiredLength(nSrcLen))
+	{
+		ATLASSERT(FALSE);
+		return FALSE;
+	}
+
+	if (nSrcLen % 2)
+		return FALSE;
+
+	// a block with a bad digit stops the vector loops; the scalar loop
+	// then writes the good bytes before it and fails, as AtlHexDecode does
+	int nRead = 0;
+	if (nLevel >= ATL_SIMD_AVX2)
+		nRead = _AtlHexDecodeBlocksAVX2(pSrcData, nSrcLen, pbDest, nRead);
+	nRead = _AtlHexDecodeBlocksSSSE3(pSrcData, nSrcLen, pbDest, nRead);
+
+	for (; nRead < nSrcLen; nRead += 2)
+	{
+		char ch1 = AtlGetHexValue(pSrcData[nRead]);
+		char ch2 = AtlGetHexValue(pSrcData[nRead+1]);
+		if ((ch1==-1) || (ch2==-1))
+			return FALSE;
+		pbDest[nRead/2] = (BYTE)(16*ch1+ch2);
+	}
+
+	*pnDestLen = nSrcLen/2;
+	return TRUE;
+#else
+	return AtlHexDecode(pSrcData, nSrcLen, pbDest, pnDestLen);
+#endif // _ATL_SIMD_CODECS
+}
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLSIMDENC_H__
@@ -50,6 +50,7 @@
 #include <atlstencil.h>
 #include <atlhttp.h>
 #include <atlhttp.inl>
+#include <atlsoapindex.h>
 
 #pragma warning(push)
 #pragma warning(disable: 4625) // copy constructor could not be generated because a base class copy constructor is inaccessible
@@ -879,11 +880,11 @@ inline HRESULT AtlGetSAXBlobValue(
 					int nDataLength = nLength;
 					if (!bHex)
 					{
-						bRet = Base64Decode(pSrc, nLength, pVal->data, &nDataLength);
+						bRet = AtlFastBase64Decode(pSrc, nLength, pVal->data, &nDataLength);
 					}
 					else
 					{
-						bRet = AtlHexDecode(pSrc, nLength, pVal->data, &nDataLength);
+						bRet = AtlFastHexDecode(pSrc, nLength, pVal->data, &nDataLength);
 					}
 					if (bRet)
 					{
@@ -1121,11 +1122,11 @@ inline HRESULT AtlGenXMLBlobValue(
 		BOOL bRet;
 		if (!bHex)
 		{
-			bRet = Base64Encode(pVal->data, pVal->size, pEnc, &nLength, ATLSOAP_BASE64_FLAGS);
+			bRet = AtlFastBase64Encode(pVal->data, pVal->size, pEnc, &nLength, ATLSOAP_BASE64_FLAGS);
 		}
 		else
 		{
-			bRet = AtlHexEncode(pVal->data, pVal->size, pEnc, &nLength);
+			bRet = AtlFastHexEncode(pVal->data, pVal->size, pEnc, &nLength);
 		}
 		if (bRet)
 		{
@@ -2805,9 +2806,9 @@ public:
 		}
 		else
 		{
-			if (FAILED(spReader.CoCreateInstance(ATLS_SAXXMLREADER_CLSID, NULL, CLSCTX_INPROC_SERVER)))
+			if (FAILED(AtlCreateSoapXmlReader(&spReader)))
 			{
-				ATLTRACE( _T("ATLSOAP: CSoapFault::ParseFault -- CoCreateInstance of SAXXMLReader failed.\r\n" ) );
+				ATLTRACE( _T("ATLSOAP: CSoapFault::ParseFault -- failed to create the SAX reader.\r\n" ) );
 
 				return E_FAIL;
 			}
@@ -3060,6 +3061,9 @@ private:
 
 		size_t m_nSize;
 
+		// allocator for m_pBits when it was sized by Reserve, NULL for the CRT
+		IAtlMemMgr * m_pMemMgr;
+
 		bool Grow(size_t nIndex)
 		{
 			// Think carefully
@@ -3075,7 +3079,14 @@ private:
 			if (m_pBits != &m_nBits)
 			{
 				unsigned __int64 * pNewBits=NULL;
-				pNewBits = (unsigned __int64 *) realloc(m_pBits, nAllocSizeBytes );
+				if (m_pMemMgr != NULL)
+				{
+					pNewBits = (unsigned __int64 *) m_pMemMgr->Reallocate(m_pBits, nAllocSizeBytes );
+				}
+				else
+				{
+					pNewBits = (unsigned __int64 *) realloc(m_pBits, nAllocSizeBytes );
+				}
 				if(!pNewBits)
 				{
 					return false;
@@ -3107,12 +3118,13 @@ private:
 	public:
 
 		CBitVector()
-			: m_nBits(0), m_nSize(sizeof(m_nBits)*CHAR_BIT)
+			: m_nBits(0), m_nSize(sizeof(m_nBits)*CHAR_BIT), m_pMemMgr(NULL)
 		{
 			m_pBits = &m_nBits;
 		}
 
 		CBitVector(const CBitVector&)
+			: m_nBits(0), m_nSize(sizeof(m_nBits)*CHAR_BIT), m_pMemMgr(NULL)
 		{
 			m_pBits = &m_nBits;
 		}
@@ -3122,11 +3134,52 @@ private:
 			if (this != &that)
 			{
 				m_pBits = &m_nBits;
+				m_nSize = sizeof(m_nBits)*CHAR_BIT;
+				m_pMemMgr = NULL;
 			}
 
 			return *this;
 		}
 
+		// size the vector for nBits in one allocation from pMemMgr,
+		// so that SetBit never has to Grow
+		bool Reserve(size_t nBits, IAtlMemMgr *pMemMgr)
+		{
+			ATLASSERT( pMemMgr != NULL );
+
+			if (nBits <= m_nSize)
+			{
+				return true;
+			}
+
+			if (m_pBits != &m_nBits)
+			{
+				return Grow(nBits-1);
+			}
+
+			ATLENSURE(nBits<SIZE_MAX/((sizeof(m_nBits)*CHAR_BIT)));
+
+			size_t nAllocSizeBits = nBits+((sizeof(m_nBits)*CHAR_BIT)-(nBits%(sizeof(m_nBits)*CHAR_BIT)));
+			size_t nAllocSizeBytes = nAllocSizeBits/CHAR_BIT;
+
+			unsigned __int64 *pBits = (unsigned __int64 *) pMemMgr->Allocate(nAllocSizeBytes);
+			if (pBits == NULL)
+			{
+				ATLTRACE( _T("ATLSOAP: CBitVector::Reserve -- out of memory.\r\n" ) );
+
+				return false;
+			}
+
+			memset(pBits, 0x00, nAllocSizeBytes);
+			pBits[0] = m_nBits;
+
+			m_pBits = pBits;
+			m_pMemMgr = pMemMgr;
+			m_nSize = nAllocSizeBits;
+
+			return true;
+		}
+
 		bool GetBit(size_t nIndex) const
 		{
 			if (nIndex >= m_nSize)
@@ -3172,11 +3225,19 @@ private:
 		{
 			if (m_pBits != &m_nBits)
 			{
-				free(m_pBits);
+				if (m_pMemMgr != NULL)
+				{
+					m_pMemMgr->Free(m_pBits);
+				}
+				else
+				{
+					free(m_pBits);
+				}
 			}
 
 			m_pBits = &m_nBits;
 			m_nSize = sizeof(m_nBits)*CHAR_BIT;
+			m_pMemMgr = NULL;
 		}
 
 		void RelocateFixup()
@@ -3265,6 +3326,27 @@ private:
 		}
 	};
 
+	//
+	// CElementMatch - the test GetElementEntry applies to the entries of a map
+	// that have the element's hash, when it looks them up through the index
+	//
+	struct CElementMatch
+	{
+		CSoapRootHandler *pHandler;
+		DWORD dwIncludeFlags;
+		DWORD dwExcludeFlags;
+		int cchLocalName;
+		const wchar_t *wszLocalName;
+
+		bool operator()(const _soapmapentry& entry)
+		{
+			return ((entry.dwFlags & dwIncludeFlags) || 
+					((entry.dwFlags & dwExcludeFlags) == 0)) &&
+				(pHandler->IsEqualElement(entry.cchField, entry.wszField, 
+					cchLocalName, wszLocalName) != FALSE);
+		}
+	}; // struct CElementMatch
+
 	class CResponseGenerator
 	{
 	public:
@@ -3665,6 +3747,12 @@ private:
 	typedef CAtlMap<REFSTRING, ParseState, CStringRefElementTraits<REFSTRING> > REFMAP;
 	REFMAP m_refMap;
 
+	// element indexes over the large maps of the module, see GetMapIndex
+	static CAtlSoapMapIndexTable<_soapmap> m_mapIndexes;
+
+	// allocator for large duplicate-element bit vectors
+	IAtlMemMgr * m_pParseMemMgr;
+
 	//
 	// Implementation helpers
 	//
@@ -3928,6 +4016,48 @@ private:
 		return S_FALSE;
 	}
 
+	HRESULT SetElementEntry(
+		ParseState& state,
+		const _soapmapentry *pEntries,
+		size_t i,
+		const _soapmapentry **ppEntry)
+	{
+		// check bit vector
+
+		if (state.vec.GetBit(i) == false)
+		{
+			if (state.vec.SetBit(i) == false)
+			{
+				return E_OUTOFMEMORY;
+			}
+		}
+		else
+		{
+			// already received this element
+			ATLTRACE( _T("ATLSOAP: CSoapRootHandler::GetElementEntry -- duplicate element was sent.\r\n" ) );
+
+			return E_FAIL;
+		}
+
+		state.nElement++;
+		*ppEntry = &pEntries[i];
+
+		return S_OK;
+	}
+
+	const CAtlSoapMapIndex<_soapmap> * GetMapIndex(const _soapmap *pMap)
+	{
+		ATLASSERT( pMap != NULL );
+
+		// nElements is only a hint here; small maps are cheaper to scan
+		if (pMap->nElements < ATLSOAP_MAP_INDEX_THRESHOLD)
+		{
+			return NULL;
+		}
+
+		return m_mapIndexes.GetIndex(pMap);
+	}
+
 	HRESULT GetElementEntry(
 		ParseState& state,
 		const wchar_t *wszNamespaceUri,
@@ -3967,36 +4097,35 @@ private:
 
 		ULONG nHash = AtlSoapHashStr(wszLocalName, cchLocalName);
 
-		for (size_t i=0; pEntries[i].nHash != 0; i++)
+		const CAtlSoapMapIndex<_soapmap> *pIndex = GetMapIndex(state.pMap);
+		if (pIndex != NULL)
 		{
-			if (nHash == pEntries[i].nHash && 
-				((pEntries[i].dwFlags & dwIncludeFlags) || 
-				 ((pEntries[i].dwFlags & dwExcludeFlags) == 0)) &&
-				IsEqualElement(pEntries[i].cchField, pEntries[i].wszField, 
-				cchLocalName, wszLocalName)/* &&
-				!wcscmp(wszNamespaceUri, wszNamespace)*/)
+			// size the duplicate check for the whole map once instead of growing it per element
+			if (state.vec.Reserve(pIndex->m_nEntries, m_pParseMemMgr) == false)
 			{
-				// check bit vector
+				return E_OUTOFMEMORY;
+			}
 
-				if (state.vec.GetBit(i) == false)
-				{
-					if (state.vec.SetBit(i) == false)
-					{
-						return E_OUTOFMEMORY;
-					}
-				}
-				else
+			CElementMatch match = { this, dwIncludeFlags, dwExcludeFlags, cchLocalName, wszLocalName };
+			size_t i = pIndex->Find(nHash, match);
+			if (i != ATLSOAP_MAP_INDEX_NOTFOUND)
+			{
+				return SetElementEntry(state, pEntries, i, ppEntry);
+			}
+		}
+		else
+		{
+			for (size_t i=0; pEntries[i].nHash != 0; i++)
+			{
+				if (nHash == pEntries[i].nHash && 
+					((pEntries[i].dwFlags & dwIncludeFlags) || 
+					 ((pEntries[i].dwFlags & dwExcludeFlags) == 0)) &&
+					IsEqualElement(pEntries[i].cchField, pEntries[i].wszField, 
+					cchLocalName, wszLocalName)/* &&
+					!wcscmp(wszNamespaceUri, wszNamespace)*/)
 				{
-					// already received this element
-					ATLTRACE( _T("ATLSOAP: CSoapRootHandler::GetElementEntry -- duplicate element was sent.\r\n" ) );
-
-					return E_FAIL;
+					return SetElementEntry(state, pEntries, i, ppEntry);
 				}
-
-				state.nElement++;
-				*ppEntry = &pEntries[i];
-
-				return S_OK;
 			}
 		}
 
@@ -5624,7 +5753,7 @@ public:
 
 	CSoapRootHandler(ISAXXMLReader *pReader = NULL)
 	:  m_pMemMgr(&m_crtHeap), m_spReader(pReader), m_bClient(false),
-	   m_nState(0), m_pvParam(NULL), m_nDepth(0)
+	   m_nState(0), m_pvParam(NULL), m_nDepth(0), m_pParseMemMgr(&m_crtHeap)
 	{
 		InitHandlerState();
 	}
@@ -5646,6 +5775,20 @@ public:
 		return m_pMemMgr;
 	}
 
+	// allocator for the parser's own bookkeeping (duplicate element bit
+	// vectors). Anything other than the default CRT heap is treated as
+	// per-request storage that is reclaimed without individual frees.
+	IAtlMemMgr * SetParseMemMgr(IAtlMemMgr *pMemMgr)
+	{
+		ATLASSERT( pMemMgr != NULL );
+		ATLASSERT( m_stateStack.IsEmpty() );
+
+		IAtlMemMgr *pPrevMgr = m_pParseMemMgr;
+		m_pParseMemMgr = pMemMgr;
+
+		return pPrevMgr;
+	}
+
 	// override this function to do SOAP Fault handling
 	virtual HRESULT SoapFault(
 		SOAP_ERROR_CODE /*errCode*/, 
@@ -5976,7 +6119,7 @@ public:
 
 	HRESULT CreateReader()
 	{
-		return m_spReader.CoCreateInstance(ATLS_SAXXMLREADER_CLSID, NULL, CLSCTX_INPROC_SERVER);
+		return AtlCreateSoapXmlReader(&m_spReader);
 	}
 
 	HRESULT InitializeSOAP(IServiceProvider *pProvider)
@@ -6288,6 +6431,7 @@ __declspec(selectany) const CSoapRootHandler::XSDEntry CSoapRootHandler::s_xsdNa
 };
 
 __declspec(selectany) CCRTHeap CSoapRootHandler::m_crtHeap;
+__declspec(selectany) CAtlSoapMapIndexTable<_soapmap> CSoapRootHandler::m_mapIndexes;
 
 template <typename THandler>
 class CSoapHandler : 
@@ -6379,6 +6523,12 @@ public:
 					SetMemMgr(&m_heap);
 				}
 
+				// the duplicate element bit vectors live as long as the request
+				if (pRequestInfo->cbSize >= sizeof(AtlServerRequest) && pRequestInfo->pArena != NULL)
+				{
+					SetParseMemMgr(pRequestInfo->pArena);
+				}
+
 				return m_hcErr;
 			}
 		}
@@ -6570,7 +6720,7 @@ protected:
 		*pReader = NULL;
 
 		CComPtr<ISAXXMLReader> spReader;
-		HRESULT hr = spReader.CoCreateInstance(ATLS_SAXXMLREADER_CLSID, NULL, CLSCTX_INPROC_SERVER);
+		HRESULT hr = AtlCreateSoapXmlReader(&spReader);
 		if (SUCCEEDED(hr))
 		{
 			*pReader = spReader.Detach();
@@ -6896,7 +7046,7 @@ protected:
 		*pReader = NULL;
 
 		CComPtr<ISAXXMLReader> spReader;
-		HRESULT hr = spReader.CoCreateInstance(ATLS_SAXXMLREADER_CLSID, NULL, CLSCTX_INPROC_SERVER);
+		HRESULT hr = AtlCreateSoapXmlReader(&spReader);
 		if (SUCCEEDED(hr))
 		{
 			*pReader = spReader.Detach();
@@ -7191,7 +7341,7 @@ protected:
 		*pReader = NULL;
 
 		CComPtr<ISAXXMLReader> spReader;
-		HRESULT hr = spReader.CoCreateInstance(ATLS_SAXXMLREADER_CLSID, NULL, CLSCTX_INPROC_SERVER);
+		HRESULT hr = AtlCreateSoapXmlReader(&spReader);
 		if (SUCCEEDED(hr))
 		{
 			*pReader = spReader.Detach();
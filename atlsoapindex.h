@@ -0,0 +1,253 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLSOAPINDEX_H__
+#define __ATLSOAPINDEX_H__
+
+#pragma once
+
+// The element indexes CSoapRootHandler in atlsoap.h looks up the entries
+// of large soap maps through. The maps come from the including code
+// through the TMap parameter, and the rest only relies on the basic ATL
+// types and macros (ULONG, DWORD_PTR, ATLASSERT, ATLTRY) and on
+// InterlockedCompareExchangePointer, which the including file must
+// provide, so that it can be exercised outside of a Windows build.
+
+#include <string.h>
+
+#ifndef ATLSOAP_MAP_INDEX_THRESHOLD
+	// maps with fewer entries than this are searched linearly
+	#define ATLSOAP_MAP_INDEX_THRESHOLD 16
+#endif
+
+#ifndef ATLSOAP_MAP_INDEX_BUCKETS
+	// buckets of a CAtlSoapMapIndexTable; the indexes of the maps that
+	// share a bucket are chained
+	#define ATLSOAP_MAP_INDEX_BUCKETS 64
+#endif
+
+// Returned by CAtlSoapMapIndex::Find
+#define ATLSOAP_MAP_INDEX_NOTFOUND ((size_t)-1)
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+//
+// CAtlSoapMapIndex
+// Open-addressing hash table over the entries of a soap map. TMap provides
+//     const TEntry *pEntries;
+// where TEntry provides ULONG nHash, and the entries end at the first one
+// with a zero hash. The maps themselves are unchanged. Slots hold entry
+// index + 1 (0 marks an empty slot), and entries that share a hash are
+// probed in map order, so lookups find the same entry as a linear scan of
+// pEntries.
+template <class TMap>
+class CAtlSoapMapIndex
+{
+public:
+	const TMap *m_pMap;
+	size_t m_nEntries;
+	ULONG *m_pSlots; // NULL if the map is too small to index
+	ULONG m_nMask;
+	ULONG m_nShift;
+	CAtlSoapMapIndex *m_pNext; // the next index in the same table bucket
+
+	CAtlSoapMapIndex() throw() :
+		m_pMap(NULL), m_nEntries(0), m_pSlots(NULL), m_nMask(0), m_nShift(0), m_pNext(NULL)
+	{
+	}
+
+	~CAtlSoapMapIndex() throw()
+	{
+		delete [] m_pSlots;
+	}
+
+	// Indexes the entries of pMap. A map with fewer than
+	// ATLSOAP_MAP_INDEX_THRESHOLD entries gets no slots, so that it is
+	// only counted once. Returns false if the slots can't be allocated.
+	bool Build(const TMap *pMap) throw()
+	{
+		ATLASSERT( pMap != NULL );
+		ATLASSERT( m_pSlots == NULL );
+
+		m_pMap = pMap;
+		m_nEntries = 0;
+		while (pMap->pEntries[m_nEntries].nHash != 0)
+		{
+			m_nEntries++;
+		}
+
+		if ((m_nEntries < ATLSOAP_MAP_INDEX_THRESHOLD) || (m_nEntries > 0x10000000))
+		{
+			return true;
+		}
+
+		// at most half full
+		ULONG nBits = 1;
+		while (((size_t)1 << nBits) < m_nEntries*2)
+		{
+			nBits++;
+		}
+
+		ULONG nSlots = (ULONG)1 << nBits;
+		ATLTRY(m_pSlots = new ULONG[nSlots]);
+		if (m_pSlots == NULL)
+		{
+			return false;
+		}
+		memset(m_pSlots, 0x00, nSlots*sizeof(ULONG));
+		m_nMask = nSlots-1;
+		m_nShift = 32-nBits;
+
+		for (size_t i=0; i<m_nEntries; i++)
+		{
+			ULONG nSlot = GetSlot(pMap->pEntries[i].nHash);
+			while (m_pSlots[nSlot] != 0)
+			{
+				nSlot = (nSlot+1) & m_nMask;
+			}
+			m_pSlots[nSlot] = (ULONG)(i+1);
+		}
+
+		return true;
+	}
+
+	ULONG GetSlot(ULONG nHash) const throw()
+	{
+		// AtlSoapHashStr is weak in its low bits, so take the high bits of a multiplicative hash
+		return (ULONG)((nHash * 0x9E3779B1U) >> m_nShift) & m_nMask;
+	}
+
+	// Returns the first entry, in map order, with the hash nHash that
+	// match(const TEntry&) accepts, or ATLSOAP_MAP_INDEX_NOTFOUND.
+	template <class TMatch>
+	size_t Find(ULONG nHash, TMatch& match) const
+	{
+		ATLASSUME( m_pSlots != NULL );
+
+		for (ULONG nSlot = GetSlot(nHash); m_pSlots[nSlot] != 0; nSlot = (nSlot+1) & m_nMask)
+		{
+			size_t i = m_pSlots[nSlot]-1;
+			if ((m_pMap->pEntries[i].nHash == nHash) && match(m_pMap->pEntries[i]))
+			{
+				return i;
+			}
+		}
+
+		return ATLSOAP_MAP_INDEX_NOTFOUND;
+	}
+
+private:
+	// Not implemented
+	CAtlSoapMapIndex(const CAtlSoapMapIndex&);
+	CAtlSoapMapIndex& operator=(const CAtlSoapMapIndex&);
+}; // class CAtlSoapMapIndex
+
+//
+// CAtlSoapMapIndexTable
+// The indexes of the maps of a module, keyed by the address of the map.
+// Each map is indexed once, the first time it is looked up, and the index
+// lives as long as the table. Lookups don't lock: a new index is pushed
+// onto its bucket by compare-exchange, and if another thread got there
+// first with the same map, its index is used instead.
+//
+// The maps are static data of the module, and so is the table, so an
+// address can't be reused by another map while the table holds it. The
+// table has no constructor, so that a static one is ready before any
+// constructor runs; any other instance must be value-initialized.
+template <class TMap>
+class CAtlSoapMapIndexTable
+{
+public:
+	CAtlSoapMapIndex<TMap> * volatile m_rgBuckets[ATLSOAP_MAP_INDEX_BUCKETS];
+
+	~CAtlSoapMapIndexTable() throw()
+	{
+		for (ULONG nBucket=0; nBucket<ATLSOAP_MAP_INDEX_BUCKETS; nBucket++)
+		{
+			CAtlSoapMapIndex<TMap> *pIndex = m_rgBuckets[nBucket];
+			while (pIndex != NULL)
+			{
+				CAtlSoapMapIndex<TMap> *pNext = pIndex->m_pNext;
+				delete pIndex;
+				pIndex = pNext;
+			}
+			m_rgBuckets[nBucket] = NULL;
+		}
+	}
+
+	// Returns the index of pMap, building it if need be, or NULL if the
+	// map should be searched linearly
+	const CAtlSoapMapIndex<TMap> * GetIndex(const TMap *pMap) throw()
+	{
+		ATLASSERT( pMap != NULL );
+
+		ULONG nBucket = GetBucket(pMap);
+		CAtlSoapMapIndex<TMap> *pHead = m_rgBuckets[nBucket];
+		CAtlSoapMapIndex<TMap> *pIndex = Find(pHead, pMap);
+		if (pIndex == NULL)
+		{
+			ATLTRY(pIndex = new CAtlSoapMapIndex<TMap>);
+			if (pIndex == NULL)
+			{
+				return NULL;
+			}
+			if (pIndex->Build(pMap) == false)
+			{
+				// fall back to the linear scan, and try again next time
+				delete pIndex;
+				return NULL;
+			}
+
+			for (;;)
+			{
+				pIndex->m_pNext = pHead;
+				CAtlSoapMapIndex<TMap> *pPrev = (CAtlSoapMapIndex<TMap> *)
+					InterlockedCompareExchangePointer((void * volatile *) &m_rgBuckets[nBucket], pIndex, pHead);
+				if (pPrev == pHead)
+				{
+					break;
+				}
+
+				// the bucket changed under us; it may have gained this map
+				pHead = pPrev;
+				CAtlSoapMapIndex<TMap> *pOther = Find(pHead, pMap);
+				if (pOther != NULL)
+				{
+					delete pIndex;
+					pIndex = pOther;
+					break;
+				}
+			}
+		}
+
+		return (pIndex->m_pSlots != NULL) ? pIndex : NULL;
+	}
+
+protected:
+	static ULONG GetBucket(const TMap *pMap) throw()
+	{
+		return (ULONG)(((DWORD_PTR)pMap >> 3) % ATLSOAP_MAP_INDEX_BUCKETS);
+	}
+
+	static CAtlSoapMapIndex<TMap> * Find(CAtlSoapMapIndex<TMap> *pIndex, const TMap *pMap) throw()
+	{
+		while ((pIndex != NULL) && (pIndex->m_pMap != pMap))
+		{
+			pIndex = pIndex->m_pNext;
+		}
+		return pIndex;
+	}
+}; // class CAtlSoapMapIndexTable
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLSOAPINDEX_H__
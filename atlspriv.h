@@ -26,6 +26,8 @@
 #include <atlcoll.h>
 #include <mlang.h>
 #include <atlutil.h>
+#include <atlenc.h>
+#include <atlsimdenc.h>
 
 // ATL_SOCK_TIMEOUT defines the amount of time
 // this socket will block the calling thread waiting
@@ -429,12 +431,23 @@ class CStreamOnByteArray :
 public:
 	BYTE *m_pArray;
 	DWORD m_dwRead;
+	DWORD m_dwLen;
 
 	CStreamOnByteArray(BYTE *pBytes) noexcept
 	{
 		ATLASSERT(pBytes);
 		m_pArray = pBytes;
 		m_dwRead = 0;
+		m_dwLen = ULONG_MAX;
+	}
+
+	// Reads fail rather than go past the first dwLen bytes.
+	CStreamOnByteArray(BYTE *pBytes, DWORD dwLen) noexcept
+	{
+		ATLASSERT(pBytes);
+		m_pArray = pBytes;
+		m_dwRead = 0;
+		m_dwLen = dwLen;
 	}
 
 	STDMETHOD(Read)(void *pv, ULONG cb, ULONG *pcbRead) noexcept
@@ -448,6 +461,9 @@ public:
 		if (!m_pArray)
 			return E_UNEXPECTED;
 
+		if (cb > m_dwLen - m_dwRead)
+			return E_FAIL;
+
 		BYTE *pCurr  = m_pArray;
 		pCurr += m_dwRead;
 		Checked::memcpy_s(pv, cb, pCurr, cb);
@@ -767,6 +783,36 @@ inline void AtlInterlockedUpdateMax(long nCurrent, long* pnMax)
 	while (nOrigMax != 0 && nOrigMax != nMax);
 }
 
+// 64-bit version of AtlInterlockedUpdateMax
+inline void AtlInterlockedUpdateMax64(LONGLONG nCurrent, LONGLONG volatile* pnMax)
+{
+	ATLENSURE(pnMax != NULL);
+
+	LONGLONG nMax;
+	do
+	{
+		nMax = *pnMax;
+		if (nCurrent <= nMax)
+			return;
+	}
+	while (InterlockedCompareExchange64(pnMax, nCurrent, nMax) != nMax);
+}
+
+// wrapper around InterlockedExchangeAdd64
+inline LONGLONG AtlInterlockedExchangeAdd64(_Inout_ LONGLONG volatile* pAddend, _In_ LONGLONG nValue)
+{
+#if defined(_M_CEE)
+
+	// System::Threading::Interlocked::Add returns the value after the addition, but we maintain the same semantics as InterlockedExchangeAdd64.
+	return (System::Threading::Interlocked::Add(*((__int64*)pAddend), nValue) - nValue);
+
+#else
+
+	return InterlockedExchangeAdd64(pAddend, nValue);
+
+#endif
+}
+
 // wrapper around InterlockedExchangeAdd
 inline LONG AtlInterlockedExchangeAdd(_Inout_ long volatile* pAddend, _In_ long nValue)
 {
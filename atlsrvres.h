@@ -94,6 +94,22 @@
 #define IDS_PERFMON_REQUEST_MAX_WAITING_HELP	(PERFMON_RESID_BASE+30)
 #define IDS_PERFMON_REQUEST_ACTIVE_THREADS		(PERFMON_RESID_BASE+31)
 #define IDS_PERFMON_REQUEST_ACTIVE_THREADS_HELP	(PERFMON_RESID_BASE+32)
+#define IDS_PERFMON_REQUEST_STOLEN				(PERFMON_RESID_BASE+33)
+#define IDS_PERFMON_REQUEST_STOLEN_HELP			(PERFMON_RESID_BASE+34)
+#define IDS_PERFMON_REQUEST_MAX_QUEUE_DEPTH		(PERFMON_RESID_BASE+35)
+#define IDS_PERFMON_REQUEST_MAX_QUEUE_DEPTH_HELP	(PERFMON_RESID_BASE+36)
+#define IDS_PERFMON_REQUEST_QUEUE_WAIT_P50		(PERFMON_RESID_BASE+37)
+#define IDS_PERFMON_REQUEST_QUEUE_WAIT_P50_HELP	(PERFMON_RESID_BASE+38)
+#define IDS_PERFMON_REQUEST_QUEUE_WAIT_P99		(PERFMON_RESID_BASE+39)
+#define IDS_PERFMON_REQUEST_QUEUE_WAIT_P99_HELP	(PERFMON_RESID_BASE+40)
+#define IDS_PERFMON_REQUEST_QUEUE_WAIT_P999		(PERFMON_RESID_BASE+41)
+#define IDS_PERFMON_REQUEST_QUEUE_WAIT_P999_HELP	(PERFMON_RESID_BASE+42)
+#define IDS_PERFMON_REQUEST_SERVICE_TIME_P50		(PERFMON_RESID_BASE+43)
+#define IDS_PERFMON_REQUEST_SERVICE_TIME_P50_HELP	(PERFMON_RESID_BASE+44)
+#define IDS_PERFMON_REQUEST_SERVICE_TIME_P99		(PERFMON_RESID_BASE+45)
+#define IDS_PERFMON_REQUEST_SERVICE_TIME_P99_HELP	(PERFMON_RESID_BASE+46)
+#define IDS_PERFMON_REQUEST_SERVICE_TIME_P999		(PERFMON_RESID_BASE+47)
+#define IDS_PERFMON_REQUEST_SERVICE_TIME_P999_HELP	(PERFMON_RESID_BASE+48)
 
 
 //
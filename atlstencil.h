@@ -16,6 +16,7 @@
 #include <atlisapi.h>
 #include <atlfile.h>
 #include <atlutil.h>
+#include <atlstencilops.h>
 #include <math.h>
 
 #ifdef ATL_DEBUG_STENCILS
@@ -64,10 +65,6 @@ extern __declspec(selectany) const DWORD STENCIL_CODEPAGE            = 0x0000000
 // The base for user defined token types
 extern __declspec(selectany) const DWORD STENCIL_USER_TOKEN_BASE     = 0x00001000;
 
-// Symbols to use in error handling in the stencil processor
-#define STENCIL_INVALIDINDEX            0xFFFFFFFF
-#define STENCIL_INVALIDOFFSET           0xFFFFFFFF
-
 // error codes
 #define STENCIL_SUCCESS     HTTP_SUCCESS
 #define STENCL_FAIL         HTTP_FAIL
@@ -75,6 +72,11 @@ extern __declspec(selectany) const DWORD STENCIL_USER_TOKEN_BASE     = 0x0000100
 #define STENCIL_BASIC_MAP 0
 #define STENCIL_ATTR_MAP 1
 
+// The most pieces of text a compiled stencil gathers into one write
+#ifndef ATL_STENCIL_GATHER_BUFFERS
+	#define ATL_STENCIL_GATHER_BUFFERS 16
+#endif
+
 #ifndef ATL_MAX_METHOD_NAME_LEN
 	#define ATL_MAX_METHOD_NAME_LEN 64
 #endif
@@ -130,6 +132,192 @@ struct CTagReplacerMethodEntry
 	CTagReplacerMethods<TBase> Methods;
 };
 
+//
+// CTagReplacerMethodIndex
+// Hash index over a replacement method map. The index is built from
+// the map the first time a name is looked up in it and maps each name
+// to its offset in the original map, so offsets handed to the stencil
+// stay valid for RenderReplacement. Lookup falls back to a linear scan
+// if the table can't be allocated or was built from a different map.
+//
+template <class TBase>
+class CTagReplacerMethodIndex
+{
+	struct CSlot
+	{
+		DWORD dwHash;
+		DWORD dwOffset; // STENCIL_INVALIDOFFSET if the slot is empty
+	};
+
+	struct CTable
+	{
+		const CTagReplacerMethodEntry<TBase> *pMap;
+		DWORD dwMask;
+		CSlot *pSlots;
+	};
+
+	CTable * volatile m_pTable;
+
+public:
+	CTagReplacerMethodIndex() throw()
+		:m_pTable(NULL)
+	{
+	}
+
+	~CTagReplacerMethodIndex() throw()
+	{
+		FreeTable(m_pTable);
+	}
+
+	static DWORD HashName(LPCSTR szName, size_t cchName) throw()
+	{
+		// FNV-1a
+		DWORD dwHash = 2166136261U;
+		for (size_t i=0; i<cchName; i++)
+		{
+			dwHash ^= (BYTE) szName[i];
+			dwHash *= 16777619U;
+		}
+		return dwHash;
+	}
+
+	// Looks up the first cchName characters of szName in pMap. As with
+	// a linear scan, the first entry with a method wins.
+	HTTP_CODE Lookup(
+		const CTagReplacerMethodEntry<TBase> *pMap,
+		LPCSTR szName,
+		size_t cchName,
+		LPDWORD pdwOffset) throw()
+	{
+		if (pMap == NULL)
+			return HTTP_FAIL;
+
+		DWORD dwOffset = STENCIL_INVALIDOFFSET;
+		CTable *pTable = GetTable(pMap);
+		if (pTable)
+		{
+			dwOffset = FindInTable(pTable, szName, cchName, HashName(szName, cchName));
+		}
+		else
+		{
+			for (const CTagReplacerMethodEntry<TBase> *pEntry = pMap; pEntry->szMethodName; pEntry++)
+			{
+				if (pEntry->Methods.pfnMethod && IsMatch(pEntry->szMethodName, szName, cchName))
+				{
+					dwOffset = (DWORD)(pEntry-pMap);
+					break;
+				}
+			}
+		}
+
+		if (dwOffset == STENCIL_INVALIDOFFSET)
+			return HTTP_FAIL;
+
+		*pdwOffset = dwOffset;
+		return HTTP_SUCCESS;
+	}
+
+private:
+	static bool IsMatch(LPCSTR szEntryName, LPCSTR szName, size_t cchName) throw()
+	{
+		return strncmp(szEntryName, szName, cchName) == 0 && szEntryName[cchName] == '\0';
+	}
+
+	static DWORD FindInTable(const CTable *pTable, LPCSTR szName, size_t cchName, DWORD dwHash) throw()
+	{
+		// the table is never more than half full, so the probe always
+		// reaches an empty slot
+		for (DWORD i = dwHash & pTable->dwMask; ; i = (i+1) & pTable->dwMask)
+		{
+			const CSlot& slot = pTable->pSlots[i];
+			if (slot.dwOffset == STENCIL_INVALIDOFFSET)
+				return STENCIL_INVALIDOFFSET;
+			if (slot.dwHash == dwHash && IsMatch(pTable->pMap[slot.dwOffset].szMethodName, szName, cchName))
+				return slot.dwOffset;
+		}
+	}
+
+	CTable *GetTable(const CTagReplacerMethodEntry<TBase> *pMap) throw()
+	{
+		CTable *pTable = m_pTable;
+		if (!pTable)
+		{
+			CTable *pNewTable = BuildTable(pMap);
+			if (!pNewTable)
+				return NULL;
+
+			// another thread may have built the table in the meantime
+			pTable = (CTable *) InterlockedCompareExchangePointer((void * volatile *) &m_pTable, pNewTable, NULL);
+			if (pTable)
+				FreeTable(pNewTable);
+			else
+				pTable = pNewTable;
+		}
+
+		return (pTable->pMap == pMap) ? pTable : NULL;
+	}
+
+	static CTable *BuildTable(const CTagReplacerMethodEntry<TBase> *pMap) throw()
+	{
+		DWORD dwCount = 0;
+		while (pMap[dwCount].szMethodName)
+			dwCount++;
+
+		DWORD dwSize = 8;
+		while (dwSize < dwCount*2)
+			dwSize <<= 1;
+
+		CTable *pTable = NULL;
+		ATLTRY(pTable = new CTable);
+		if (!pTable)
+			return NULL;
+
+		pTable->pMap = pMap;
+		pTable->dwMask = dwSize-1;
+		pTable->pSlots = NULL;
+		ATLTRY(pTable->pSlots = new CSlot[dwSize]);
+		if (!pTable->pSlots)
+		{
+			delete pTable;
+			return NULL;
+		}
+
+		for (DWORD i=0; i<dwSize; i++)
+			pTable->pSlots[i].dwOffset = STENCIL_INVALIDOFFSET;
+
+		for (DWORD dwOffset=0; dwOffset<dwCount; dwOffset++)
+		{
+			const CTagReplacerMethodEntry<TBase>& entry = pMap[dwOffset];
+			if (!entry.Methods.pfnMethod)
+				continue;
+
+			size_t cchName = strlen(entry.szMethodName);
+			DWORD dwHash = HashName(entry.szMethodName, cchName);
+
+			// keep the first entry for a duplicated name
+			if (FindInTable(pTable, entry.szMethodName, cchName, dwHash) != STENCIL_INVALIDOFFSET)
+				continue;
+
+			DWORD i = dwHash & pTable->dwMask;
+			while (pTable->pSlots[i].dwOffset != STENCIL_INVALIDOFFSET)
+				i = (i+1) & pTable->dwMask;
+			pTable->pSlots[i].dwHash = dwHash;
+			pTable->pSlots[i].dwOffset = dwOffset;
+		}
+
+		return pTable;
+	}
+
+	static void FreeTable(CTable *pTable) throw()
+	{
+		if (pTable)
+		{
+			delete [] pTable->pSlots;
+			delete pTable;
+		}
+	}
+}; // class CTagReplacerMethodIndex
+
 
 #define BEGIN_REPLACEMENT_METHOD_MAP(className)\
 public:\
@@ -237,15 +425,20 @@ public:
 				return hcErr;
 		}
 
-		if (!SafeStringCopy(szName, szMethodName))
+		size_t cchName = strlen(szMethodName);
+		if (cchName > ATL_MAX_METHOD_NAME_LEN)
 		{
 			return AtlsHttpError(500, ISE_SUBERR_LONGMETHODNAME);
 		}
 
-		// check for params
-		char *szLeftPar = strchr(szName, '(');
-		if (szLeftPar)
+		// check for params. The name only has to be copied when the
+		// parameter string needs terminating.
+		char *szLeftPar = NULL;
+		if (memchr(szMethodName, '(', cchName) != NULL)
 		{
+			Checked::memcpy_s(szName, sizeof(szName), szMethodName, cchName+1);
+
+			szLeftPar = strchr(szName, '(');
 			*szLeftPar = '\0';
 			szLeftPar++;
 
@@ -256,7 +449,7 @@ public:
 			*szRightPar = '\0';
 
 			szMethodName = szName;
-
+			cchName = szLeftPar-szName-1;
 		}
 
 		// No handler name is specified, so we look up the method name in
@@ -264,11 +457,11 @@ public:
 		const CTagReplacerMethodEntry<T> *pEntry = NULL;
 		pT->GetReplacementMethodMap(&pEntry);
 
-		hcErr = FindReplacementOffsetInMap(szMethodName, pdwMethodOffset, pEntry);
+		hcErr = GetReplacementMethodIndex(STENCIL_BASIC_MAP).Lookup(pEntry, szMethodName, cchName, pdwMethodOffset);
 		if (hcErr != HTTP_SUCCESS)
 		{
 			pT->GetAttrReplacementMethodMap(&pEntry);
-			hcErr = FindReplacementOffsetInMap(szMethodName, pdwMethodOffset, pEntry);
+			hcErr = GetReplacementMethodIndex(STENCIL_ATTR_MAP).Lookup(pEntry, szMethodName, cchName, pdwMethodOffset);
 			if (hcErr == HTTP_SUCCESS)
 				*pdwMap = STENCIL_ATTR_MAP;
 		}
@@ -311,6 +504,14 @@ public:
 		return HTTP_FAIL;
 	}
 
+	// One index per map kind for each replacer class; see
+	// CTagReplacerMethodIndex.
+	static CTagReplacerMethodIndex<T>& GetReplacementMethodIndex(DWORD dwMap) throw()
+	{
+		static CTagReplacerMethodIndex<T> s_rgIndex[2];
+		return s_rgIndex[dwMap == STENCIL_ATTR_MAP ? 1 : 0];
+	}
+
 
 	// Used to render a single replacement tag into a stream.
 	// Looks up a pointer to a member function in user code by offseting into the users
@@ -691,6 +892,7 @@ private:
 						  // For mapped files this is the beginning of the mapping.
 	LPCSTR m_pBufferEnd; // End of CHAR buffer that holds the stencil.
 	CAtlArray<StencilToken> m_arrTokens; //An array of tokens.
+	CAtlStencilProgram m_program; // The tokens compiled by CompileTokens
 	FILETIME m_ftLastModified;  // Last modified time (0 for resource)
 	FILETIME m_ftLastChecked;   // Last time we retrieved last modified time (0 for resource)
 	HCACHEITEM m_hCacheItem;
@@ -1127,6 +1329,8 @@ public:
 	// Call Uninitialize if you want to re-use an already initialized CStencil
 	void Uninitialize() throw()
 	{
+		m_program.Reset();
+
 		int nSize = (int) m_arrTokens.GetCount();
 		for (int nIndex = 0; nIndex < nSize; nIndex++)
 		{
@@ -1399,7 +1603,90 @@ public:
 			}
 		}
 
-		return ParseSuccessful();
+		if (!ParseSuccessful())
+		{
+			m_program.Reset();
+			return false;
+		}
+
+		if (UseCompiledRender())
+			CompileTokens();
+		return true;
+	}
+
+	// Return true to have the tokens compiled into ops after a successful
+	// parse, and rendered from those. Rendering from the ops saves following
+	// the links between tokens, but the ops cost memory on top of the
+	// tokens, and the built-in token types are rendered without calling
+	// RenderToken. Token types that aren't built in are still rendered by
+	// RenderToken. By default, the tokens are compiled only if
+	// ATL_STENCIL_COMPILE is defined.
+	virtual bool UseCompiledRender() const throw()
+	{
+#ifdef ATL_STENCIL_COMPILE
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Compiles the token array into m_program for Render. If this fails,
+	// Render walks the tokens instead.
+	virtual bool CompileTokens() throw()
+	{
+		return m_program.Compile(*this, GetTokenCount());
+	}
+
+	// The ops are only used while they still cover every token
+	bool IsCompiled() const throw()
+	{
+		return m_program.IsCompiled(GetTokenCount());
+	}
+
+	// Implementation: The op CompileTokens compiles the token into, and
+	// the token the op jumps to
+	DWORD GetTokenOp(DWORD dwIndex, DWORD *pdwTarget) const throw()
+	{
+		const StencilToken& token = m_arrTokens[dwIndex];
+		*pdwTarget = STENCIL_INVALIDINDEX;
+
+		switch (token.type)
+		{
+		case STENCIL_TEXTTAG:
+			return STENCIL_OP_TEXT;
+		case STENCIL_REPLACEMENT:
+			return STENCIL_OP_CALL;
+		case STENCIL_ITERATORSTART:
+		case STENCIL_CONDITIONALSTART:
+			if (token.dwFnOffset == STENCIL_INVALIDOFFSET || !IsValidIndex(token.dwLoopIndex))
+				return STENCIL_OP_INVALID;
+			*pdwTarget = token.dwLoopIndex+1;
+			return STENCIL_OP_TEST;
+		case STENCIL_CONDITIONALELSE:
+			if (!IsValidIndex(token.dwLoopIndex))
+				return STENCIL_OP_INVALID;
+			*pdwTarget = token.dwLoopIndex+1;
+			return STENCIL_OP_JUMP;
+		case STENCIL_ITERATOREND:
+			if (!IsValidIndex(token.dwLoopIndex))
+				return STENCIL_OP_INVALID;
+			*pdwTarget = token.dwLoopIndex;
+			return STENCIL_OP_JUMP;
+		case STENCIL_CONDITIONALEND:
+			return STENCIL_OP_NONE;
+		case STENCIL_LOCALE:
+			return STENCIL_OP_LOCALE;
+		default:
+			return STENCIL_OP_TOKEN;
+		}
+	}
+
+	// Implementation: The text of a text token, for CompileTokens
+	void GetTokenText(DWORD dwIndex, LPCSTR *ppText, DWORD *pcbText) const throw()
+	{
+		const StencilToken& token = m_arrTokens[dwIndex];
+		*ppText = token.pStart;
+		*pcbText = (DWORD)((token.pEnd-token.pStart)+1);
 	}
 
 	virtual bool Parse(ITagReplacer *pReplacer)
@@ -1995,14 +2282,22 @@ public:
 		}
 
 		pReplacer->SetStream(pWriteStream);
-		while (dwIndex < dwArraySize)
+		if (IsCompiled())
+		{
+			if (dwIndex < dwArraySize)
+				dwIndex = RenderOps(dwIndex, pReplacer, pWriteStream, &hcErrorCode, pState);
+		}
+		else
 		{
-			// RenderToken advances dwIndex appropriately for us.
-			dwIndex = RenderToken(dwIndex, pReplacer, pWriteStream, &hcErrorCode, pState);
+			while (dwIndex < dwArraySize)
+			{
+				// RenderToken advances dwIndex appropriately for us.
+				dwIndex = RenderToken(dwIndex, pReplacer, pWriteStream, &hcErrorCode, pState);
 
-			if (dwIndex == STENCIL_INVALIDINDEX ||
-				hcErrorCode != HTTP_SUCCESS)
-				break;
+				if (dwIndex == STENCIL_INVALIDINDEX ||
+					hcErrorCode != HTTP_SUCCESS)
+					break;
+			}
 		}
 
 		if (IsAsyncStatus(hcErrorCode))
@@ -2016,6 +2311,126 @@ public:
 		return hcErrorCode;
 	}
 
+	// Renders the compiled ops starting at the op for token dwIndex. Like
+	// RenderToken, it returns the index of the token to resume at, or
+	// STENCIL_INVALIDINDEX.
+	DWORD RenderOps(
+		DWORD dwIndex,
+		ITagReplacer *pReplacer,
+		IWriteStream *pWriteStream,
+		HTTP_CODE *phcErrorCode,
+		CStencilState* pState = NULL) const
+	{
+		ATLASSERT(IsCompiled());
+
+		COpRenderer renderer(this, pReplacer, pWriteStream, pState);
+		return m_program.Run(renderer, dwIndex, phcErrorCode);
+	}
+
+	// Implementation: What RenderOps renders the ops with. Text that the
+	// compiler couldn't merge because it isn't contiguous in the buffer
+	// is written straight from the tokens, in one gathered write per
+	// ATL_STENCIL_GATHER_BUFFERS pieces when the stream supports
+	// IWriteStreamGather.
+	class COpRenderer
+	{
+	public:
+		const CStencil *m_pStencil;
+		ITagReplacer *m_pReplacer;
+		IWriteStream *m_pWriteStream;
+		IWriteStreamGather *m_pGather;
+		CStencilState *m_pState;
+
+		COpRenderer(const CStencil *pStencil, ITagReplacer *pReplacer,
+			IWriteStream *pWriteStream, CStencilState *pState) throw() :
+			m_pStencil(pStencil),
+			m_pReplacer(pReplacer),
+			m_pWriteStream(pWriteStream),
+			m_pGather(NULL),
+			m_pState(pState)
+		{
+			if (FAILED(pReplacer->GetContext(__uuidof(IWriteStreamGather), (void **) &m_pGather)))
+				m_pGather = NULL;
+		}
+
+		HTTP_CODE CallMethod(DWORD dwToken)
+		{
+			const StencilToken *pToken = m_pStencil->GetToken(dwToken);
+			return m_pReplacer->RenderReplacement(pToken->dwFnOffset,
+						pToken->dwObjOffset, pToken->dwMap, (void *) pToken->dwData);
+		}
+
+		void WriteText(LPCSTR pText, DWORD cbText)
+		{
+			m_pWriteStream->WriteStream(pText, (int) cbText, NULL);
+		}
+
+		void WriteTokenText(DWORD dwToken, DWORD nTokens)
+		{
+			AtlServerSendBuffer rgBuffers[ATL_STENCIL_GATHER_BUFFERS];
+			DWORD nBuffers = 0;
+			for (DWORD dwIndex = dwToken; dwIndex < dwToken+nTokens; dwIndex++)
+			{
+				LPCSTR pText;
+				DWORD cbText;
+				m_pStencil->GetTokenText(dwIndex, &pText, &cbText);
+				if (nBuffers && (LPCSTR) rgBuffers[nBuffers-1].pvData + rgBuffers[nBuffers-1].cbData == pText)
+				{
+					rgBuffers[nBuffers-1].cbData += cbText;
+					continue;
+				}
+				if (nBuffers == ATL_STENCIL_GATHER_BUFFERS)
+				{
+					Write(rgBuffers, nBuffers);
+					nBuffers = 0;
+				}
+				rgBuffers[nBuffers].pvData = pText;
+				rgBuffers[nBuffers].cbData = cbText;
+				nBuffers++;
+			}
+			Write(rgBuffers, nBuffers);
+		}
+
+		void Write(const AtlServerSendBuffer *rgBuffers, DWORD nBuffers)
+		{
+			if (m_pGather)
+			{
+				m_pGather->WriteStreamGather(rgBuffers, nBuffers, NULL);
+				return;
+			}
+			for (DWORD i = 0; i < nBuffers; i++)
+				m_pWriteStream->WriteStream((LPCSTR) rgBuffers[i].pvData, (int) rgBuffers[i].cbData, NULL);
+		}
+
+		void SetLocale(DWORD dwToken)
+		{
+			LCID locale = (LCID) m_pStencil->GetToken(dwToken)->dwData;
+			if (m_pState)
+			{
+				m_pState->locale = locale;
+			}
+			SetThreadLocale(locale);
+		}
+
+		DWORD RenderToken(DWORD dwToken, HTTP_CODE *phcErrorCode)
+		{
+			return m_pStencil->RenderToken(dwToken, m_pReplacer, m_pWriteStream, phcErrorCode, m_pState);
+		}
+
+		HTTP_CODE OnRenderStatus(HTTP_CODE hcErr)
+		{
+			return m_pStencil->OnRenderStatus(m_pReplacer, hcErr);
+		}
+	}; // class COpRenderer
+
+	// Called with the status of each replacement method that RenderOps
+	// calls itself. Derived classes can use it to handle their own status
+	// codes.
+	virtual HTTP_CODE OnRenderStatus(ITagReplacer * /*pReplacer*/, HTTP_CODE hcErr) const
+	{
+		return hcErr;
+	}
+
 	inline BOOL IsValidIndex(DWORD dwIndex) const throw()
 	{
 		if (dwIndex == STENCIL_INVALIDINDEX)
@@ -3302,10 +3717,7 @@ public:
 			}
 		}
 
-		if (hcErrorCode == HTTP_SUCCESS_NO_CACHE)
-		{
-			hcErrorCode = NoCachePage(pReplacer);
-		}
+		hcErrorCode = OnRenderStatus(pReplacer, hcErrorCode);
 
 		if (phcErrorCode)
 		{
@@ -3313,6 +3725,15 @@ public:
 		}
 		return dwNextToken;
 	}
+
+	HTTP_CODE OnRenderStatus(ITagReplacer *pReplacer, HTTP_CODE hcErr) const
+	{
+		if (hcErr == HTTP_SUCCESS_NO_CACHE)
+		{
+			hcErr = NoCachePage(pReplacer);
+		}
+		return hcErr;
+	}
 }; // class CHtmlStencil
 
 
@@ -3821,6 +4242,8 @@ class CRequestHandlerT :
 protected:
 	CStencilState m_state;
 	CComObjectStackEx<CIDServerContext> m_SafeSrvCtx;
+	HCACHEITEM m_hStencilText; // Cached stencil held by HoldStencilText
+	bool m_bReadingForm; // form data is being read with ATL_FORM_FLAG_ASYNC_BODY; see ReadFormBody
 	typedef CRequestHandlerT<THandler, ThreadModel, TagReplacerType> _requestHandler;
 
 public:
@@ -3840,6 +4263,8 @@ public:
 		m_hInstHandler = NULL;
 		m_dwAsyncFlags = 0;
 		m_pRequestInfo = NULL;
+		m_hStencilText = NULL;
+		m_bReadingForm = false;
 	}
 
 	~CRequestHandlerT() throw()
@@ -3880,6 +4305,13 @@ public:
 		return HTTP_SUCCESS;
 	}
 
+	// Points the response headers at the request arena so they are
+	// released with the request instead of one allocation at a time.
+	void InitializeStringManagers(AtlServerRequest *pRequestInfo) throw()
+	{
+		m_HttpResponse.SetStringManager(AtlGetRequestStringMgr(pRequestInfo));
+	}
+
 	HTTP_CODE InitializeHandler(
 		AtlServerRequest *pRequestInfo, 
 		IServiceProvider *pProvider)
@@ -3892,21 +4324,32 @@ public:
 		hcErr = pT->InitializeInternal(pRequestInfo, pProvider);
 		if (!hcErr)
 		{
+			pT->InitializeStringManagers(pRequestInfo);
 			m_HttpResponse.Initialize(m_spServerContext);
 			hcErr = pT->CheckValidRequest();
 			if (!hcErr)
 			{
+				// the body can only be read asynchronously if the handler
+				// uses ATLSRV_INIT_USEASYNC_EX
+				DWORD dwFormFlags = pT->FormFlags();
+				if (pRequestInfo->lAsyncState == ATLSRV_ASYNC_NONE)
+					dwFormFlags &= ~ATL_FORM_FLAG_ASYNC_BODY;
+
 				hcErr = HTTP_FAIL;
 				if (m_HttpRequest.Initialize(m_spServerContext, 
 											 pT->MaxFormSize(),
-											 pT->FormFlags()))
+											 dwFormFlags))
 				{
 					if (m_SafeSrvCtx.Initialize(&m_HttpResponse, &m_HttpRequest))
 					{
 						hcErr = TagReplacerType::Initialize(pRequestInfo, &m_SafeSrvCtx);
 						if (!hcErr)
 						{
-							hcErr = pT->ValidateAndExchange();
+							// with the form data still to come, HandleRequest
+							// calls ValidateAndExchange once it has been read
+							m_bReadingForm = (m_HttpRequest.IsBodyPending() != FALSE);
+							if (!m_bReadingForm)
+								hcErr = pT->ValidateAndExchange();
 						}
 					}
 				}
@@ -3928,6 +4371,7 @@ public:
 		if (hcErr)
 			return hcErr;
 
+		pT->InitializeStringManagers(pRequestInfo);
 		if (pRequestLookup)
 		{
 			// initialize with the pRequestLookup
@@ -3993,8 +4437,21 @@ public:
 
 		THandler *pT = static_cast<THandler *>(this);
 		HTTP_CODE hcErr = HTTP_SUCCESS;
+		bool bBegin = (pRequestInfo->dwRequestState == ATLSRV_STATE_BEGIN);
 
-		if (pRequestInfo->dwRequestState == ATLSRV_STATE_BEGIN)
+		if (m_bReadingForm)
+		{
+			hcErr = ReadFormBody(pRequestInfo);
+			if (IsAsyncStatus(hcErr))
+				return hcErr;
+			if (hcErr != HTTP_SUCCESS)
+				return pT->Uninitialize(hcErr);
+
+			// the request starts now that the form data is all here
+			bBegin = true;
+		}
+
+		if (bBegin)
 		{
 			m_dwRequestType = pRequestInfo->dwRequestType;
 
@@ -4004,6 +4461,10 @@ public:
 				hcErr = HTTP_FAIL;
 				if (szFileName)
 					hcErr = pT->LoadStencil(szFileName, static_cast<IHttpRequestLookup *>(&m_HttpRequest));
+				if (hcErr == HTTP_SUCCESS && pT->UseStencilValidators())
+					hcErr = pT->CheckStencilValidators();
+				if (hcErr == HTTP_SUCCESS)
+					HoldStencilText();
 			}
 		}
 		else if (pRequestInfo->dwRequestState == ATLSRV_STATE_CONTINUE)
@@ -4019,6 +4480,7 @@ public:
 			}
 			_ATLCATCHALL()
 			{
+				ReleaseStencilText();
 				return HTTP_FAIL;
 			}
 		}
@@ -4039,9 +4501,15 @@ public:
 		{
 			pRequestInfo->pszBuffer = LPCSTR(m_HttpResponse.m_strContent);
 			pRequestInfo->dwBufferLen = m_HttpResponse.m_strContent.GetLength();
+			if (!pRequestInfo->pszBuffer)
+				hcErr = HTTP_FAIL;
 		}
 
-		if (pRequestInfo->dwRequestState == ATLSRV_STATE_BEGIN || IsAsyncDoneStatus(hcErr))
+		// the content for an async flush has already been gathered out of the stencil
+		if (!ReleaseStencilText())
+			hcErr = HTTP_FAIL;
+
+		if (bBegin || IsAsyncDoneStatus(hcErr))
 			return pT->Uninitialize(hcErr);
 
 		else if (!IsAsyncStatus(hcErr))
@@ -4050,6 +4518,34 @@ public:
 		return hcErr;
 	}
 
+	// Implementation: Reads the form data that CHttpRequest::Initialize left pending
+	// because FormFlags includes ATL_FORM_FLAG_ASYNC_BODY, one read per call, so no
+	// thread waits on the client. Returns HTTP_SUCCESS_ASYNC_NOFLUSH while a read
+	// is outstanding, and the result of ValidateAndExchange once the form is complete.
+	HTTP_CODE ReadFormBody(AtlServerRequest *pRequestInfo)
+	{
+		// every call after the first is resumed by the completion of a read
+		if (pRequestInfo->dwRequestState != ATLSRV_STATE_BEGIN &&
+			!m_HttpRequest.OnReadBody(pRequestInfo->cbAsyncIO, pRequestInfo->dwAsyncError))
+		{
+			m_bReadingForm = false;
+			return HTTP_FAIL;
+		}
+
+		if (m_HttpRequest.IsBodyPending())
+		{
+			if (!m_HttpRequest.ReadBodyAsync())
+			{
+				m_bReadingForm = false;
+				return HTTP_FAIL;
+			}
+			return HTTP_SUCCESS_ASYNC_NOFLUSH;
+		}
+
+		m_bReadingForm = false;
+		return static_cast<THandler*>(this)->ValidateAndExchange();
+	}
+
 	HTTP_CODE ServerTransferRequest(LPCSTR szRequest, bool bContinueAfterTransfer=false,
 		WORD nCodePage = 0, CStencilState *pState = NULL)
 	{
@@ -4064,6 +4560,94 @@ public:
 				pState);
 	}
 
+	// Implementation: Lets m_HttpResponse reference text from the loaded
+	// stencil instead of copying it, and keeps the stencil in the cache
+	// until ReleaseStencilText is called.
+	void HoldStencilText() throw()
+	{
+		if (m_hStencilText || !m_pLoadedStencil || !m_pLoadedStencil->GetCacheItem())
+			return;
+
+		if (FAILED(m_spStencilCache->AddRefStencil(m_pLoadedStencil->GetCacheItem())))
+			return;
+		m_hStencilText = m_pLoadedStencil->GetCacheItem();
+		m_HttpResponse.AddStableRange(m_pLoadedStencil->GetBufferStart(), m_pLoadedStencil->GetBufferEnd());
+	}
+
+	// Implementation: Copies in any stencil text m_HttpResponse still
+	// references and releases the stencil held by HoldStencilText. Returns
+	// FALSE if the text couldn't be copied, in which case the response
+	// buffer has been cleared.
+	BOOL ReleaseStencilText() throw()
+	{
+		if (!m_hStencilText)
+			return TRUE;
+
+		BOOL bRet = m_HttpResponse.ClearStableRanges();
+		m_spStencilCache->ReleaseStencil(m_hStencilText);
+		m_hStencilText = NULL;
+		return bRet;
+	}
+
+	// Override this function to return TRUE if the page rendered from the
+	// stencil only changes when the stencil file does. The response then
+	// carries ETag and Last-Modified headers derived from the stencil's last
+	// modified time, and GET and HEAD requests whose If-None-Match or
+	// If-Modified-Since header matches them get a 304 response instead of
+	// the page. Stencils loaded from resources have no validators.
+	BOOL UseStencilValidators()
+	{
+		return FALSE;
+	}
+
+	// Sets the validators described in UseStencilValidators, and sends the
+	// 304 response if the client's copy is current. Returns
+	// HTTP_SUCCESS_NO_CACHE in that case, so the stencil isn't rendered and
+	// the empty response doesn't go into the page cache.
+	HTTP_CODE CheckStencilValidators()
+	{
+		if (!m_pLoadedStencil)
+			return HTTP_SUCCESS;
+
+		FILETIME ftLastModified;
+		m_pLoadedStencil->GetLastModified(&ftLastModified);
+		if (CFileTime(ftLastModified) == 0)
+			return HTTP_SUCCESS;
+
+		LPCSTR szMethod = m_pRequestInfo->pServerContext->GetRequestMethod();
+		_ATLTRY
+		{
+			CStringA strETag;
+			AtlFormatETag(AtlHashValidator(ATLS_VALIDATOR_SEED, &ftLastModified, sizeof(FILETIME)), strETag);
+
+			SYSTEMTIME st;
+			CStringA strLastModified;
+			if (!FileTimeToSystemTime(&ftLastModified, &st))
+				return HTTP_SUCCESS;
+			SystemTimeToHttpDate(st, strLastModified);
+
+			if (!m_HttpResponse.AppendHeader("ETag", strETag) ||
+				!m_HttpResponse.AppendHeader("Last-Modified", strLastModified))
+			{
+				return HTTP_FAIL;
+			}
+
+			if ((!strcmp(szMethod, "GET") || !strcmp(szMethod, "HEAD")) &&
+				AtlIsNotModified(m_pRequestInfo->pServerContext, strETag, &ftLastModified))
+			{
+				m_HttpResponse.SetStatusCode(304);
+				if (!m_HttpResponse.SendHeadersInternal())
+					return HTTP_FAIL;
+				return HTTP_SUCCESS_NO_CACHE;
+			}
+		}
+		_ATLCATCHALL()
+		{
+			return HTTP_FAIL;
+		}
+		return HTTP_SUCCESS;
+	}
+
 	inline DWORD MaxFormSize()
 	{
 		return DEFAULT_MAX_FORM_SIZE;
@@ -4144,6 +4728,14 @@ public:
 			m_spServiceProvider.p->AddRef();
 			return S_OK;
 		}
+		if (InlineIsEqualGUID(riid, __uuidof(IWriteStreamGather)))
+		{
+			// not reference counted; only while the stencil writes to the response
+			if (this->m_pStream != static_cast<IWriteStream*>(&m_HttpResponse))
+				return E_NOINTERFACE;
+			*ppv = static_cast<IWriteStreamGather*>(&m_HttpResponse);
+			return S_OK;
+		}
 		return E_NOINTERFACE;
 	}
 
@@ -0,0 +1,307 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLSTENCILOPS_H__
+#define __ATLSTENCILOPS_H__
+
+#pragma once
+
+// The ops CStencil in atlstencil.h compiles its tokens into when
+// UseCompiledRender returns true, and the loop that renders them. The
+// tokens, the replacement methods and the stream come from the including
+// code through the TSource and TRenderer parameters, and the rest only
+// relies on the basic ATL types and macros (DWORD, LPCSTR, ATLASSERT,
+// ATLTRY) and on HTTP_CODE and the status codes from atlserr.h, which the
+// including file must provide, so that it can be exercised outside of a
+// Windows build.
+
+// Symbols to use in error handling in the stencil processor
+#define STENCIL_INVALIDINDEX            0xFFFFFFFF
+#define STENCIL_INVALIDOFFSET           0xFFFFFFFF
+
+// Opcodes of a StencilOp
+#define STENCIL_OP_TEXT     0 // write text
+#define STENCIL_OP_CALL     1 // call a replacement method
+#define STENCIL_OP_TEST     2 // call a replacement method, jump if it returns HTTP_S_FALSE
+#define STENCIL_OP_JUMP     3 // jump
+#define STENCIL_OP_LOCALE   4 // set the thread locale
+#define STENCIL_OP_TOKEN    5 // render the token through RenderToken
+
+// What else a token can compile to
+#define STENCIL_OP_NONE     6 // nothing, like endif once the jumps are resolved
+#define STENCIL_OP_INVALID  7 // the token can't be compiled
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+//
+// StencilOp
+// One op of a CAtlStencilProgram. Consecutive text tokens become a single
+// op, and the targets of jumps are op indices.
+struct StencilOp
+{
+	DWORD dwOpcode; // STENCIL_OP_*
+	DWORD dwToken; // Index of the first token compiled into this op
+	DWORD dwArg; // STENCIL_OP_TEST and STENCIL_OP_JUMP: the op to jump to.
+				 // STENCIL_OP_TEXT: the length of pText, or if pText is NULL,
+				 // the number of tokens whose text the op writes.
+	LPCSTR pText; // STENCIL_OP_TEXT: the text, if it is contiguous
+};
+
+//
+// CAtlStencilProgram
+// The compiled form of a stencil's tokens. The ops reference the text of
+// the tokens instead of copying it, so the program is only valid while
+// the tokens are.
+class CAtlStencilProgram
+{
+public:
+	StencilOp *m_pOps;
+	DWORD m_nOps;
+	DWORD *m_pTokenOps; // The op of each token, and m_nOps for the end
+	DWORD m_nTokens;
+
+	CAtlStencilProgram() throw() :
+		m_pOps(NULL), m_nOps(0), m_pTokenOps(NULL), m_nTokens(0)
+	{
+	}
+
+	~CAtlStencilProgram() throw()
+	{
+		Reset();
+	}
+
+	// Discards the ops. Always returns false so Compile can bail out
+	// through it.
+	bool Reset() throw()
+	{
+		delete [] m_pOps;
+		m_pOps = NULL;
+		m_nOps = 0;
+		delete [] m_pTokenOps;
+		m_pTokenOps = NULL;
+		m_nTokens = 0;
+		return false;
+	}
+
+	// The ops are only used while they still cover every token
+	bool IsCompiled(DWORD nTokens) const throw()
+	{
+		return m_pTokenOps != NULL && m_nTokens == nTokens;
+	}
+
+	// Compiles nTokens tokens. TSource provides
+	//     DWORD GetTokenOp(DWORD dwIndex, DWORD *pdwTarget) const;
+	//     void GetTokenText(DWORD dwIndex, LPCSTR *ppText, DWORD *pcbText) const;
+	// where GetTokenOp returns the STENCIL_OP_* that the token compiles to,
+	// and for STENCIL_OP_TEST and STENCIL_OP_JUMP, the token to jump to.
+	template <class TSource>
+	bool Compile(const TSource& source, DWORD nTokens) throw()
+	{
+		Reset();
+		if (nTokens == STENCIL_INVALIDINDEX)
+			return false;
+
+		// count the ops
+		DWORD nOps = 0;
+		DWORD dwPrevOpcode = STENCIL_OP_NONE;
+		DWORD dwTarget;
+		for (DWORD dwIndex = 0; dwIndex < nTokens; dwIndex++)
+		{
+			DWORD dwOpcode = source.GetTokenOp(dwIndex, &dwTarget);
+			if (dwOpcode == STENCIL_OP_INVALID)
+				return false;
+			if (dwOpcode != STENCIL_OP_NONE &&
+				!(dwOpcode == STENCIL_OP_TEXT && dwPrevOpcode == STENCIL_OP_TEXT))
+				nOps++;
+			dwPrevOpcode = dwOpcode;
+		}
+
+		ATLTRY(m_pTokenOps = new DWORD[nTokens+1]);
+		if (!m_pTokenOps)
+			return false;
+		ATLTRY(m_pOps = new StencilOp[nOps ? nOps : 1]);
+		if (!m_pOps)
+			return Reset();
+
+		// build them, with the target token of each jump in dwArg for now
+		DWORD dwOp = 0;
+		dwPrevOpcode = STENCIL_OP_NONE;
+		for (DWORD dwIndex = 0; dwIndex < nTokens; dwIndex++)
+		{
+			DWORD dwOpcode = source.GetTokenOp(dwIndex, &dwTarget);
+			if (dwOpcode == STENCIL_OP_TEXT && dwPrevOpcode == STENCIL_OP_TEXT)
+			{
+				// merge the text into the current op. Once a piece doesn't
+				// follow on from the one before, the op counts tokens instead
+				StencilOp& op = m_pOps[dwOp-1];
+				LPCSTR pText;
+				DWORD cbText;
+				source.GetTokenText(dwIndex, &pText, &cbText);
+				if (op.pText && op.pText+op.dwArg == pText)
+				{
+					op.dwArg += cbText;
+				}
+				else
+				{
+					op.pText = NULL;
+					op.dwArg = dwIndex - op.dwToken + 1;
+				}
+				m_pTokenOps[dwIndex] = dwOp-1;
+			}
+			else
+			{
+				m_pTokenOps[dwIndex] = dwOp;
+				if (dwOpcode != STENCIL_OP_NONE)
+				{
+					ATLASSERT(dwOp < nOps);
+					StencilOp& op = m_pOps[dwOp++];
+					op.dwOpcode = dwOpcode;
+					op.dwToken = dwIndex;
+					op.dwArg = dwTarget;
+					op.pText = NULL;
+					if (dwOpcode == STENCIL_OP_TEXT)
+						source.GetTokenText(dwIndex, &op.pText, &op.dwArg);
+				}
+			}
+			dwPrevOpcode = dwOpcode;
+		}
+		m_pTokenOps[nTokens] = nOps;
+		m_nOps = nOps;
+		m_nTokens = nTokens;
+
+		// resolve the jumps
+		for (dwOp = 0; dwOp < nOps; dwOp++)
+		{
+			StencilOp& op = m_pOps[dwOp];
+			if (op.dwOpcode != STENCIL_OP_TEST && op.dwOpcode != STENCIL_OP_JUMP)
+				continue;
+
+			dwTarget = op.dwArg;
+			if (dwTarget > nTokens)
+				return Reset();
+
+			// a jump into the middle of a merged text run can only come
+			// from a malformed block
+			DWORD dwTargetOp = m_pTokenOps[dwTarget];
+			if (dwTargetOp < nOps && m_pOps[dwTargetOp].dwToken < dwTarget)
+				return Reset();
+
+			op.dwArg = dwTargetOp;
+		}
+		return true;
+	}
+
+	// Renders the ops from the op of token dwIndex until the end, an error
+	// or an asynchronous status. Like CStencil::RenderToken, it returns the
+	// index of the token to resume at, or STENCIL_INVALIDINDEX. TRenderer
+	// provides
+	//     HTTP_CODE CallMethod(DWORD dwToken);   // the token's replacement method
+	//     void WriteText(LPCSTR pText, DWORD cbText);
+	//     void WriteTokenText(DWORD dwToken, DWORD nTokens);
+	//     void SetLocale(DWORD dwToken);
+	//     DWORD RenderToken(DWORD dwToken, HTTP_CODE *phcErrorCode);
+	//     HTTP_CODE OnRenderStatus(HTTP_CODE hcErr);
+	// where WriteTokenText writes the text of nTokens tokens from dwToken
+	// on, and OnRenderStatus is called with the status of each replacement
+	// method that Run calls itself.
+	template <class TRenderer>
+	DWORD Run(TRenderer& renderer, DWORD dwIndex, HTTP_CODE *phcErrorCode) const
+	{
+		ATLASSERT(m_pTokenOps != NULL && dwIndex <= m_nTokens);
+
+		DWORD dwOp = m_pTokenOps[dwIndex];
+		HTTP_CODE hcErrorCode = HTTP_SUCCESS;
+
+		// a text run can only be entered at its first token
+		ATLASSERT(dwOp == m_nOps || m_pOps[dwOp].dwToken >= dwIndex);
+
+		while (dwOp < m_nOps)
+		{
+			const StencilOp& op = m_pOps[dwOp];
+			DWORD dwNextOp = dwOp+1;
+
+			switch (op.dwOpcode)
+			{
+			case STENCIL_OP_TEXT:
+				if (op.pText)
+					renderer.WriteText(op.pText, op.dwArg);
+				else
+					renderer.WriteTokenText(op.dwToken, op.dwArg);
+				break;
+			case STENCIL_OP_CALL:
+				hcErrorCode = renderer.CallMethod(op.dwToken);
+
+				if (IsAsyncContinueStatus(hcErrorCode))
+					dwNextOp = dwOp; // call the tag again after we get back
+				else if (hcErrorCode == HTTP_SUCCESS_ASYNC_DONE)
+					hcErrorCode = HTTP_SUCCESS_ASYNC;
+				else if (hcErrorCode == HTTP_SUCCESS_ASYNC_NOFLUSH_DONE)
+					hcErrorCode = HTTP_SUCCESS_ASYNC_NOFLUSH;
+				hcErrorCode = renderer.OnRenderStatus(hcErrorCode);
+				break;
+			case STENCIL_OP_TEST:
+				// HTTP_SUCCESS enters the block, HTTP_S_FALSE skips past it
+				// (or to the else part)
+				hcErrorCode = renderer.CallMethod(op.dwToken);
+
+				if (hcErrorCode == HTTP_S_FALSE)
+				{
+					dwNextOp = op.dwArg;
+					hcErrorCode = HTTP_SUCCESS;
+				}
+				else if (hcErrorCode != HTTP_SUCCESS)
+				{
+					dwNextOp = STENCIL_INVALIDINDEX;
+					hcErrorCode = renderer.OnRenderStatus(hcErrorCode);
+				}
+				break;
+			case STENCIL_OP_JUMP:
+				dwNextOp = op.dwArg;
+				break;
+			case STENCIL_OP_LOCALE:
+				renderer.SetLocale(op.dwToken);
+				break;
+			default:
+				{
+					DWORD dwNextToken = renderer.RenderToken(op.dwToken, &hcErrorCode);
+					if (dwNextToken == STENCIL_INVALIDINDEX)
+						dwNextOp = STENCIL_INVALIDINDEX;
+					else if (dwNextToken < m_nTokens)
+						dwNextOp = m_pTokenOps[dwNextToken];
+					else
+						dwNextOp = m_nOps;
+				}
+				break;
+			}
+
+			if (dwNextOp == STENCIL_INVALIDINDEX)
+			{
+				if (phcErrorCode)
+					*phcErrorCode = hcErrorCode;
+				return STENCIL_INVALIDINDEX;
+			}
+
+			dwOp = dwNextOp;
+			if (hcErrorCode != HTTP_SUCCESS)
+				break;
+		}
+
+		if (phcErrorCode)
+			*phcErrorCode = hcErrorCode;
+
+		return (dwOp < m_nOps) ? m_pOps[dwOp].dwToken : m_nTokens;
+	}
+}; // class CAtlStencilProgram
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLSTENCILOPS_H__
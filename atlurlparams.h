@@ -0,0 +1,233 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLURLPARAMS_H__
+#define __ATLURLPARAMS_H__
+
+#pragma once
+
+// The URL-encoded data scanner behind CHttpRequestParams::Parse in
+// atlisapi.h. It only relies on the basic ATL types (CHAR, BYTE, LPSTR),
+// on AtlHexValue from atlutil.h, and on the processor detection in
+// atlsimdenc.h, which the including file must provide, so that it can be
+// exercised outside of a Windows build.
+
+#include <string.h>
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+// Returns true if ch is one of = & + % # or nul, the characters
+// AtlParseUrlParam has to look at.
+inline bool AtlIsUrlDelimiter(CHAR ch) noexcept
+{
+	// all of them are below 64, so one bit mask covers them
+	const ULONGLONG nDelimiters = ((ULONGLONG)1 << 0) | ((ULONGLONG)1 << '#') | ((ULONGLONG)1 << '%') |
+		((ULONGLONG)1 << '&') | ((ULONGLONG)1 << '+') | ((ULONGLONG)1 << '=');
+
+	return (BYTE)ch < 64 && ((nDelimiters >> (BYTE)ch) & 1) != 0;
+}
+
+#ifdef _ATL_SIMD_CODECS
+
+// AtlFindUrlDelimiter 16 bytes at a time
+_ATL_SIMD_TARGET("sse2") inline LPCSTR _AtlFindUrlDelimiterSSE2(LPCSTR sz) noexcept
+{
+	const __m128i chEq = _mm_set1_epi8('=');
+	const __m128i chAmp = _mm_set1_epi8('&');
+	const __m128i chPlus = _mm_set1_epi8('+');
+	const __m128i chPct = _mm_set1_epi8('%');
+	const __m128i chHash = _mm_set1_epi8('#');
+	const __m128i chNul = _mm_setzero_si128();
+
+	// aligned loads never cross a page boundary, so reading the rest of the
+	// block that holds the terminating nul is safe
+	size_t nOffset = (size_t)sz & 15;
+	const __m128i *pBlock = (const __m128i *)(sz - nOffset);
+	for (unsigned int nSkip = (unsigned int)nOffset; ; nSkip = 0, pBlock++)
+	{
+		__m128i v = _mm_load_si128(pBlock);
+		__m128i hits = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, chEq), _mm_cmpeq_epi8(v, chAmp)),
+			_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, chPlus), _mm_cmpeq_epi8(v, chPct)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, chHash), _mm_cmpeq_epi8(v, chNul))));
+		unsigned int nHits = ((unsigned int)_mm_movemask_epi8(hits) >> nSkip) << nSkip;
+		if (nHits != 0)
+		{
+#ifdef _MSC_VER
+			unsigned long nIndex;
+			_BitScanForward(&nIndex, nHits);
+#else
+			unsigned int nIndex = (unsigned int)__builtin_ctz(nHits);
+#endif
+			return (LPCSTR)pBlock + nIndex;
+		}
+	}
+}
+
+#endif // _ATL_SIMD_CODECS
+
+// Returns the first character in sz for which AtlIsUrlDelimiter is true.
+inline LPCSTR AtlFindUrlDelimiter(LPCSTR sz) noexcept
+{
+#ifdef _ATL_SIMD_CODECS
+	if (AtlGetSimdLevel() != ATL_SIMD_NONE)
+		return _AtlFindUrlDelimiterSSE2(sz);
+#endif // _ATL_SIMD_CODECS
+
+	while (!AtlIsUrlDelimiter(*sz))
+		sz++;
+	return sz;
+}
+
+// Implementation: copies the run of characters at szSrc that AtlParseUrlParam passes
+// through unchanged to szDest, advances szDest past it, and returns the first character
+// after the run (one of = & + % # or the terminating nul).
+inline LPSTR _AtlCopyUrlPlainRun(LPSTR& szDest, LPSTR szSrc) noexcept
+{
+	// a local copy, since stores through szOut could otherwise alias szDest
+	LPSTR szOut = szDest;
+
+	// most names and values are short; copy them while looking for the end
+	for (int i = 0; i < 16; i++)
+	{
+		if (AtlIsUrlDelimiter(*szSrc))
+		{
+			szDest = szOut;
+			return szSrc;
+		}
+		*szOut++ = *szSrc++;
+	}
+
+	LPSTR szEnd = const_cast<LPSTR>(AtlFindUrlDelimiter(szSrc));
+
+	// until the first escape is decoded, the data is already in place
+	if (szOut != szSrc)
+		memmove(szOut, szSrc, szEnd-szSrc);
+	szDest = szOut + (szEnd-szSrc);
+	return szEnd;
+}
+
+// Splits the first name-value pair off the URL-encoded data at szData, which
+// must not be empty, and decodes it in place. *pszName and *pszValue are set
+// to nul-terminated strings inside szData, or for a pair without a value, to
+// an empty string. Returns where the next pair starts.
+//
+// Pairs are separated by & and a name from its value by =. A # ends the value.
+// A + decodes as a space and % followed by two hex digits as that octet. A %
+// without two characters after it decodes as a nul, and a % followed by
+// anything else but hex digits ends the name or value.
+inline LPSTR AtlParseUrlParam(LPSTR szData, LPSTR *pszName, LPCSTR *pszValue) noexcept
+{
+	LPSTR szUrlCurrent = szData;
+	*pszName = szUrlCurrent;
+
+	while (*szData)
+	{
+		szData = _AtlCopyUrlPlainRun(szUrlCurrent, szData);
+		if (!*szData)
+			break;
+
+		if (*szData == '=')
+		{
+			szData++;
+			break;
+		}
+		if (*szData == '&')
+		{
+			break;
+		}
+		if (*szData == '+')
+			*szUrlCurrent = ' ';
+		else if (*szData == '%')
+		{
+			// if there is a % without two characters
+			// at the end of the url we skip it
+			if (*(szData+1) && *(szData+2))
+			{
+				short nFirstDigit = AtlHexValue(szData[1]);
+				short nSecondDigit = AtlHexValue(szData[2]);
+
+				if( nFirstDigit < 0 || nSecondDigit < 0 )
+				{
+					break;
+				}
+				*szUrlCurrent = static_cast<CHAR>(16*nFirstDigit+nSecondDigit);
+				szData += 2;
+			}
+			else
+				*szUrlCurrent = '\0';
+		}
+		else
+			*szUrlCurrent = *szData;
+
+		szData++;
+		szUrlCurrent++;
+	}
+
+	if (*szUrlCurrent == '&')
+	{
+		*szUrlCurrent++ = '\0';
+		szData++;
+		*pszValue = "";
+		return szData;
+	}
+
+	if (*szUrlCurrent)
+		*szUrlCurrent++ = '\0';
+
+	// we have the property name
+	*pszValue = szUrlCurrent;
+	while (*szData && *szData != '#')
+	{
+		szData = _AtlCopyUrlPlainRun(szUrlCurrent, szData);
+		if (!*szData || *szData == '#')
+			break;
+
+		if (*szData == '&')
+		{
+			szData++;
+			break;
+		}
+		if (*szData == '+')
+			*szUrlCurrent = ' ';
+		else if (*szData == '%')
+		{
+			// if there is a % without two characters
+			// at the end of the url we skip it
+			if (*(szData+1) && *(szData+2))
+			{
+				short nFirstDigit = AtlHexValue(szData[1]);
+				short nSecondDigit = AtlHexValue(szData[2]);
+
+				if( nFirstDigit < 0 || nSecondDigit < 0 )
+				{
+					break;
+				}
+				*szUrlCurrent = static_cast<CHAR>(16*nFirstDigit+nSecondDigit);
+				szData += 2;
+			}
+			else
+				*szUrlCurrent = '\0';
+		}
+		else
+			*szUrlCurrent = *szData;
+		szData++;
+		szUrlCurrent++;
+	}
+	// we have the value
+	*szUrlCurrent = '\0';
+	return szData;
+}
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLURLPARAMS_H__
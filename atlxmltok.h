@@ -0,0 +1,797 @@
+// This is a part of the Active Template Library.
+// Copyright (C) Microsoft Corporation
+// All rights reserved.
+//
+// This source code is only intended as a supplement to the
+// Active Template Library Reference and related
+// electronic documentation provided with the library.
+// See these sources for detailed information regarding the
+// Active Template Library product.
+
+#ifndef __ATLXMLTOK_H__
+#define __ATLXMLTOK_H__
+
+#pragma once
+
+// The UTF-8 XML tokenizer behind the SOAP message reader in atlisapi.h.
+// It only relies on the basic ATL types and macros (BYTE, BOOL, HRESULT,
+// ATLASSERT, ATLTRY), which the including file must provide, so that it
+// can be exercised outside of a Windows build.
+
+#include <string.h>
+
+// Tokens returned by CAtlXmlTokenizer::Next
+#define ATL_XML_START_ELEMENT	1
+#define ATL_XML_END_ELEMENT		2
+#define ATL_XML_CHARACTERS		3
+#define ATL_XML_END_DOCUMENT	4
+
+#pragma pack(push,_ATL_PACKING)
+namespace ATL {
+
+// The strings below point into the document and are not nul-terminated.
+
+// A namespace declaration. The default namespace has an empty prefix.
+struct CAtlXmlNamespace
+{
+	const char *szPrefix;
+	int cchPrefix;
+	const char *szUri;
+	int cchUri;
+};
+
+struct CAtlXmlElement
+{
+	const char *szQName;
+	int cchQName;
+	const char *szLocalName;
+	int cchLocalName;
+	const char *szUri;			// "" if the element is in no namespace
+	int cchUri;
+	size_t nNamespaces;			// namespace declarations in scope before the element
+};
+
+struct CAtlXmlAttribute
+{
+	const char *szQName;
+	int cchQName;
+	const char *szLocalName;
+	int cchLocalName;
+	const char *szUri;			// "" if the attribute has no prefix
+	int cchUri;
+	const char *szValue;		// with references decoded and white space normalized
+	int cchValue;
+};
+
+//
+// CAtlXmlStack
+// A stack of plain structures for CAtlXmlTokenizer. Its storage is kept
+// when it is emptied, so a tokenizer that is reused stops allocating once
+// it has seen its deepest document.
+template <class T>
+class CAtlXmlStack
+{
+public:
+	CAtlXmlStack() noexcept :
+		m_p(NULL), m_nCount(0), m_nMax(0)
+	{
+	}
+
+	~CAtlXmlStack() noexcept
+	{
+		delete [] m_p;
+	}
+
+	size_t GetCount() const noexcept
+	{
+		return m_nCount;
+	}
+
+	T& operator[](size_t i) noexcept
+	{
+		ATLASSERT(i < m_nCount);
+		return m_p[i];
+	}
+
+	const T& operator[](size_t i) const noexcept
+	{
+		ATLASSERT(i < m_nCount);
+		return m_p[i];
+	}
+
+	BOOL Push(const T& t) noexcept
+	{
+		if (m_nCount == m_nMax)
+		{
+			size_t nMax = m_nMax ? m_nMax*2 : 16;
+			T *p = NULL;
+			ATLTRY(p = new T[nMax]);
+			if (p == NULL)
+				return FALSE;
+			if (m_nCount)
+				memcpy(p, m_p, m_nCount*sizeof(T));
+			delete [] m_p;
+			m_p = p;
+			m_nMax = nMax;
+		}
+		m_p[m_nCount++] = t;
+		return TRUE;
+	}
+
+	// Drops the entries above nCount
+	void Truncate(size_t nCount) noexcept
+	{
+		ATLASSERT(nCount <= m_nCount);
+		m_nCount = nCount;
+	}
+
+private:
+	T *m_p;
+	size_t m_nCount;
+	size_t m_nMax;
+
+	CAtlXmlStack(const CAtlXmlStack&);
+	CAtlXmlStack& operator=(const CAtlXmlStack&);
+}; // class CAtlXmlStack
+
+//
+// CAtlXmlTokenizer
+// A pull tokenizer for UTF-8 XML documents held in a writable buffer.
+// Each call to Next moves to the next start tag, end tag, run of text or
+// the end of the document. Entity and character references are decoded
+// and line breaks normalized within the buffer, and the names, values and
+// text it hands out point into the buffer, so nothing is copied and no
+// memory is allocated per element once the stacks have grown.
+//
+// It supports namespaces, CDATA sections, comments and processing
+// instructions, but not DTDs, which SOAP messages may not contain. The
+// UTF-8 itself is not validated; that is left to whoever converts it.
+//
+// An empty element tag gives an ATL_XML_START_ELEMENT followed by an
+// ATL_XML_END_ELEMENT. The attributes are valid for an
+// ATL_XML_START_ELEMENT only. The namespace declarations an element makes
+// are the entries from its nNamespaces to GetNamespaceCount(), at both
+// its start and its end.
+class CAtlXmlTokenizer
+{
+public:
+	CAtlXmlTokenizer() noexcept
+	{
+		Reset();
+	}
+
+	// Starts on the cbDoc bytes at szDoc. szDoc[cbDoc] must be writable
+	// too; it is set to nul. The buffer is modified as it is tokenized and
+	// must be kept until the tokenizer is done with it.
+	HRESULT Initialize(char *szDoc, size_t cbDoc) noexcept
+	{
+		Reset();
+		if (cbDoc > INT_MAX_LENGTH)
+			return Fail("document too large", E_OUTOFMEMORY);
+
+		char *sz = szDoc;
+		m_szEnd = szDoc + cbDoc;
+		*m_szEnd = '\0';
+
+		if (cbDoc >= 3 && (BYTE) sz[0] == 0xEF && (BYTE) sz[1] == 0xBB && (BYTE) sz[2] == 0xBF)
+			sz += 3;
+
+		// only UTF-8 and its subsets are supported
+		if (!strncmp(sz, "<?xml", 5) && IsSpace(sz[5]))
+		{
+			char *szDeclEnd = strstr(sz, "?>");
+			if (!szDeclEnd)
+				return Fail("unterminated XML declaration");
+			*szDeclEnd = '\0';
+			char *szEncoding = strstr(sz, "encoding");
+			*szDeclEnd = '?';
+			if (szEncoding)
+			{
+				szEncoding += sizeof("encoding")-1;
+				while (IsSpace(*szEncoding) || *szEncoding == '=')
+					szEncoding++;
+				char chQuote = *szEncoding++;
+				char *szEncodingEnd = szEncoding;
+				while (szEncodingEnd < szDeclEnd && *szEncodingEnd != chQuote)
+					szEncodingEnd++;
+				int cchEncoding = (int) (szEncodingEnd - szEncoding);
+
+				// utf-16 is allowed for documents that were converted
+				if (!IsEqualNoCase(szEncoding, cchEncoding, "utf-8") &&
+					!IsEqualNoCase(szEncoding, cchEncoding, "us-ascii") &&
+					!IsEqualNoCase(szEncoding, cchEncoding, "utf-16"))
+				{
+					return Fail("unsupported encoding");
+				}
+			}
+			sz = szDeclEnd + 2;
+		}
+
+		m_sz = sz;
+		return S_OK;
+	}
+
+	// Moves to the next token and returns it in *pnToken. Once the end of
+	// the document has been reached, it keeps returning
+	// ATL_XML_END_DOCUMENT. Returns E_FAIL if the document is malformed,
+	// and keeps doing so; GetErrorMessage says why.
+	HRESULT Next(int *pnToken) noexcept
+	{
+		ATLASSERT(pnToken);
+		*pnToken = 0;
+		if (m_hrError != S_OK)
+			return m_hrError;
+		if (m_sz == NULL)
+			return Fail("no document");
+
+		// the element that ended goes out of scope with its declarations
+		if (m_nToken == ATL_XML_END_ELEMENT)
+		{
+			m_Namespaces.Truncate(m_Elements[m_Elements.GetCount()-1].nNamespaces);
+			m_Elements.Truncate(m_Elements.GetCount()-1);
+		}
+		m_Attributes.Truncate(0);
+
+		HRESULT hr = ReadToken();
+		if (FAILED(hr))
+			return hr;
+		*pnToken = m_nToken;
+		return S_OK;
+	}
+
+	int GetToken() const noexcept
+	{
+		return m_nToken;
+	}
+
+	// The element that starts or ends at the current token
+	const CAtlXmlElement& GetElement() const noexcept
+	{
+		ATLASSERT(m_nToken == ATL_XML_START_ELEMENT || m_nToken == ATL_XML_END_ELEMENT);
+		return m_Elements[m_Elements.GetCount()-1];
+	}
+
+	// Number of open elements, counting the current one
+	size_t GetDepth() const noexcept
+	{
+		return m_Elements.GetCount();
+	}
+
+	size_t GetAttributeCount() const noexcept
+	{
+		return m_Attributes.GetCount();
+	}
+
+	const CAtlXmlAttribute& GetAttribute(size_t i) const noexcept
+	{
+		return m_Attributes[i];
+	}
+
+	// Number of namespace declarations in scope
+	size_t GetNamespaceCount() const noexcept
+	{
+		return m_Namespaces.GetCount();
+	}
+
+	const CAtlXmlNamespace& GetNamespace(size_t i) const noexcept
+	{
+		return m_Namespaces[i];
+	}
+
+	// The text of an ATL_XML_CHARACTERS token. Text is never empty; a CDATA
+	// section is a token of its own.
+	void GetText(const char **psz, int *pcch) const noexcept
+	{
+		ATLASSERT(m_nToken == ATL_XML_CHARACTERS);
+		*psz = m_szText;
+		*pcch = m_cchText;
+	}
+
+	LPCSTR GetErrorMessage() const noexcept
+	{
+		return m_szError;
+	}
+
+	// Appends the UTF-8 form of the code point dwChar at psz.
+	static BOOL PutUtf8(DWORD dwChar, char **psz) noexcept
+	{
+		char *sz = *psz;
+		if (dwChar < 0x80)
+		{
+			*sz++ = (char) dwChar;
+		}
+		else if (dwChar < 0x800)
+		{
+			*sz++ = (char) (0xC0 | (dwChar >> 6));
+			*sz++ = (char) (0x80 | (dwChar & 0x3F));
+		}
+		else if (dwChar < 0x10000)
+		{
+			if (dwChar >= 0xD800 && dwChar <= 0xDFFF)
+				return FALSE;
+			*sz++ = (char) (0xE0 | (dwChar >> 12));
+			*sz++ = (char) (0x80 | ((dwChar >> 6) & 0x3F));
+			*sz++ = (char) (0x80 | (dwChar & 0x3F));
+		}
+		else if (dwChar <= 0x10FFFF)
+		{
+			*sz++ = (char) (0xF0 | (dwChar >> 18));
+			*sz++ = (char) (0x80 | ((dwChar >> 12) & 0x3F));
+			*sz++ = (char) (0x80 | ((dwChar >> 6) & 0x3F));
+			*sz++ = (char) (0x80 | (dwChar & 0x3F));
+		}
+		else
+		{
+			return FALSE;
+		}
+		*psz = sz;
+		return TRUE;
+	}
+
+	// Decodes the references in the text from szStart to szEnd and
+	// normalizes its line breaks, in place, and returns the new end.
+	// Attribute values also have their white space characters replaced
+	// by spaces. Decoding never makes the text longer. Returns NULL if
+	// the text has a bad reference.
+	static char *Decode(char *szStart, char *szEnd, bool bAttribute) noexcept
+	{
+		// find the first character that needs changing
+		char *szIn = szStart;
+		while (szIn < szEnd && *szIn != '&' && *szIn != '\r' && !(bAttribute && (*szIn == '\t' || *szIn == '\n')))
+			szIn++;
+
+		char *szOut = szIn;
+		while (szIn < szEnd)
+		{
+			char ch = *szIn;
+			if (ch == '&')
+			{
+				char *szSemi = szIn + 1;
+				while (szSemi < szEnd && *szSemi != ';' && szSemi - szIn <= 12)
+					szSemi++;
+				if (szSemi >= szEnd || *szSemi != ';')
+					return NULL;
+
+				const char *szRef = szIn + 1;
+				int cchRef = (int) (szSemi - szRef);
+				if (cchRef >= 2 && szRef[0] == '#')
+				{
+					DWORD dwChar = 0;
+					bool bHex = (szRef[1] == 'x');
+					for (int i = bHex ? 2 : 1; i < cchRef; i++)
+					{
+						char chDigit = szRef[i];
+						DWORD dwDigit;
+						if (chDigit >= '0' && chDigit <= '9')
+							dwDigit = chDigit - '0';
+						else if (bHex && chDigit >= 'a' && chDigit <= 'f')
+							dwDigit = chDigit - 'a' + 10;
+						else if (bHex && chDigit >= 'A' && chDigit <= 'F')
+							dwDigit = chDigit - 'A' + 10;
+						else
+							return NULL;
+						dwChar = dwChar * (bHex ? 16 : 10) + dwDigit;
+						if (dwChar > 0x10FFFF)
+							return NULL;
+					}
+					if ((bHex && cchRef == 2) || dwChar == 0 || !PutUtf8(dwChar, &szOut))
+						return NULL;
+				}
+				else if (IsEqual(szRef, cchRef, "lt", 2))
+					*szOut++ = '<';
+				else if (IsEqual(szRef, cchRef, "gt", 2))
+					*szOut++ = '>';
+				else if (IsEqual(szRef, cchRef, "amp", 3))
+					*szOut++ = '&';
+				else if (IsEqual(szRef, cchRef, "quot", 4))
+					*szOut++ = '"';
+				else if (IsEqual(szRef, cchRef, "apos", 4))
+					*szOut++ = '\'';
+				else
+					return NULL;
+				szIn = szSemi + 1;
+			}
+			else if (ch == '\r')
+			{
+				*szOut++ = bAttribute ? ' ' : '\n';
+				szIn++;
+				if (szIn < szEnd && *szIn == '\n')
+					szIn++;
+			}
+			else if (bAttribute && (ch == '\t' || ch == '\n'))
+			{
+				*szOut++ = ' ';
+				szIn++;
+			}
+			else
+			{
+				*szOut++ = ch;
+				szIn++;
+			}
+		}
+		return szOut;
+	}
+
+protected:
+	// the names and text handed out have int lengths
+	static const size_t INT_MAX_LENGTH = 0x7FFFFFFF;
+
+	CAtlXmlStack<CAtlXmlNamespace> m_Namespaces;
+	CAtlXmlStack<CAtlXmlElement> m_Elements;
+	CAtlXmlStack<CAtlXmlAttribute> m_Attributes;
+
+	char *m_sz;					// the next token, NULL before Initialize
+	char *m_szEnd;
+	int m_nToken;
+	bool m_bRoot;				// the document element has started
+	bool m_bEndPending;			// the start tag was an empty element tag
+	const char *m_szText;
+	int m_cchText;
+	HRESULT m_hrError;
+	LPCSTR m_szError;
+
+	void Reset() noexcept
+	{
+		m_Namespaces.Truncate(0);
+		m_Elements.Truncate(0);
+		m_Attributes.Truncate(0);
+		m_sz = NULL;
+		m_szEnd = NULL;
+		m_nToken = 0;
+		m_bRoot = false;
+		m_bEndPending = false;
+		m_szText = NULL;
+		m_cchText = 0;
+		m_hrError = S_OK;
+		m_szError = NULL;
+	}
+
+	HRESULT Fail(LPCSTR szMessage, HRESULT hr = E_FAIL) noexcept
+	{
+		m_szError = szMessage;
+		m_hrError = hr;
+		m_nToken = 0;
+		return hr;
+	}
+
+	static bool IsSpace(char ch) noexcept
+	{
+		return (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
+	}
+
+	static bool IsNameChar(char ch) noexcept
+	{
+		return ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') ||
+			ch == '_' || ch == ':' || ch == '-' || ch == '.' || (ch & 0x80));
+	}
+
+	static bool IsNameStartChar(char ch) noexcept
+	{
+		return (IsNameChar(ch) && !(ch >= '0' && ch <= '9') && ch != '-' && ch != '.');
+	}
+
+	static bool IsEqual(const char *sz1, int cch1, const char *sz2, int cch2) noexcept
+	{
+		return (cch1 == cch2 && !memcmp(sz1, sz2, cch1));
+	}
+
+	// Compares sz1 with the lower case, nul-terminated sz2, ignoring the
+	// case of ASCII letters in sz1
+	static bool IsEqualNoCase(const char *sz1, int cch1, const char *sz2) noexcept
+	{
+		int i;
+		for (i = 0; i < cch1 && sz2[i]; i++)
+		{
+			char ch = sz1[i];
+			if (ch >= 'A' && ch <= 'Z')
+				ch += 'a' - 'A';
+			if (ch != sz2[i])
+				return false;
+		}
+		return (i == cch1 && !sz2[i]);
+	}
+
+	static int GetPrefixLength(const char *szQName, int cchQName) noexcept
+	{
+		const char *szColon = (const char *) memchr(szQName, ':', cchQName);
+		return szColon ? (int) (szColon - szQName) : 0;
+	}
+
+	// Sets *pszEnd to the end of the name at sz. Returns FALSE if there
+	// isn't one.
+	static BOOL ScanName(char *sz, char **pszEnd) noexcept
+	{
+		if (!IsNameStartChar(*sz))
+			return FALSE;
+		while (IsNameChar(*sz))
+			sz++;
+		*pszEnd = sz;
+		return TRUE;
+	}
+
+	HRESULT ResolvePrefix(const char *szPrefix, int cchPrefix, const char **pszUri, int *pcchUri) noexcept
+	{
+		static const char s_szXmlNamespace[] = "http://www.w3.org/XML/1998/namespace";
+
+		for (size_t i = m_Namespaces.GetCount(); i > 0; i--)
+		{
+			const CAtlXmlNamespace& ns = m_Namespaces[i-1];
+			if (IsEqual(ns.szPrefix, ns.cchPrefix, szPrefix, cchPrefix))
+			{
+				*pszUri = ns.szUri;
+				*pcchUri = ns.cchUri;
+				return S_OK;
+			}
+		}
+
+		if (IsEqual(szPrefix, cchPrefix, "xml", 3))
+		{
+			*pszUri = s_szXmlNamespace;
+			*pcchUri = sizeof(s_szXmlNamespace)-1;
+		}
+		else if (cchPrefix == 0)
+		{
+			*pszUri = "";
+			*pcchUri = 0;
+		}
+		else
+		{
+			return Fail("undeclared namespace prefix");
+		}
+		return S_OK;
+	}
+
+	HRESULT ReadToken() noexcept
+	{
+		if (m_bEndPending)
+		{
+			m_bEndPending = false;
+			m_nToken = ATL_XML_END_ELEMENT;
+			return S_OK;
+		}
+
+		char *sz = m_sz;
+		char *szEnd = m_szEnd;
+		while (sz < szEnd)
+		{
+			if (*sz != '<')
+			{
+				char *szText = sz;
+				while (sz < szEnd && *sz != '<')
+					sz++;
+				if (m_Elements.GetCount())
+				{
+					char *szTextEnd = Decode(szText, sz, false);
+					if (!szTextEnd)
+						return Fail("bad reference in text");
+					m_sz = sz;
+					SetText(szText, szTextEnd);
+					return S_OK;
+				}
+				for (; szText < sz; szText++)
+				{
+					if (!IsSpace(*szText))
+						return Fail("text outside the document element");
+				}
+			}
+			else if (sz[1] == '?')
+			{
+				char *szPIEnd = strstr(sz + 2, "?>");
+				if (!szPIEnd)
+					return Fail("unterminated processing instruction");
+				sz = szPIEnd + 2;
+			}
+			else if (!strncmp(sz, "<!--", 4))
+			{
+				char *szCommentEnd = strstr(sz + 4, "-->");
+				if (!szCommentEnd)
+					return Fail("unterminated comment");
+				sz = szCommentEnd + 3;
+			}
+			else if (!strncmp(sz, "<![CDATA[", 9))
+			{
+				if (!m_Elements.GetCount())
+					return Fail("CDATA section outside the document element");
+				char *szData = sz + 9;
+				char *szDataEnd = strstr(szData, "]]>");
+				if (!szDataEnd)
+					return Fail("unterminated CDATA section");
+				sz = szDataEnd + 3;
+
+				// empty sections aren't reported
+				if (szDataEnd != szData)
+				{
+					m_sz = sz;
+					SetText(szData, szDataEnd);
+					return S_OK;
+				}
+			}
+			else if (sz[1] == '!')
+			{
+				return Fail("DTDs are not supported");
+			}
+			else if (sz[1] == '/')
+			{
+				if (!m_Elements.GetCount())
+					return Fail("unexpected end tag");
+				const CAtlXmlElement& element = m_Elements[m_Elements.GetCount()-1];
+				sz += 2;
+				if (szEnd - sz < element.cchQName || memcmp(sz, element.szQName, element.cchQName) ||
+					IsNameChar(sz[element.cchQName]))
+				{
+					return Fail("mismatched end tag");
+				}
+				sz += element.cchQName;
+				while (IsSpace(*sz))
+					sz++;
+				if (*sz++ != '>')
+					return Fail("unterminated end tag");
+				m_sz = sz;
+				m_nToken = ATL_XML_END_ELEMENT;
+				return S_OK;
+			}
+			else
+			{
+				if (m_bRoot && !m_Elements.GetCount())
+					return Fail("more than one document element");
+				m_bRoot = true;
+				return ReadStartTag(sz + 1);
+			}
+		}
+
+		m_sz = sz;
+		if (!m_bRoot || m_Elements.GetCount())
+			return Fail("incomplete document");
+		m_nToken = ATL_XML_END_DOCUMENT;
+		return S_OK;
+	}
+
+	void SetText(const char *szText, const char *szTextEnd) noexcept
+	{
+		ATLASSERT(szText < szTextEnd);
+		m_szText = szText;
+		m_cchText = (int) (szTextEnd - szText);
+		m_nToken = ATL_XML_CHARACTERS;
+	}
+
+	static void SplitQName(const char *szQName, int cchQName, const char **pszLocalName, int *pcchLocalName,
+		int *pcchPrefix) noexcept
+	{
+		int cchPrefix = GetPrefixLength(szQName, cchQName);
+		int cchSkip = cchPrefix ? cchPrefix+1 : 0;
+		*pszLocalName = szQName + cchSkip;
+		*pcchLocalName = cchQName - cchSkip;
+		*pcchPrefix = cchPrefix;
+	}
+
+	HRESULT ReadStartTag(char *szTag) noexcept
+	{
+		char *szNameEnd;
+		if (!ScanName(szTag, &szNameEnd))
+			return Fail("bad element name");
+
+		CAtlXmlElement element;
+		int cchElementPrefix;
+		element.szQName = szTag;
+		element.cchQName = (int) (szNameEnd - szTag);
+		SplitQName(element.szQName, element.cchQName, &element.szLocalName, &element.cchLocalName,
+			&cchElementPrefix);
+		element.nNamespaces = m_Namespaces.GetCount();
+
+		char *sz = szNameEnd;
+		for (;;)
+		{
+			bool bSpace = IsSpace(*sz);
+			while (IsSpace(*sz))
+				sz++;
+			if (*sz == '>' || *sz == '/' || *sz == '\0')
+				break;
+
+			char *szAttrEnd;
+			if (!bSpace || !ScanName(sz, &szAttrEnd))
+				return Fail("bad attribute name");
+
+			CAtlXmlAttribute attr;
+			int cchPrefix;
+			attr.szQName = sz;
+			attr.cchQName = (int) (szAttrEnd - sz);
+			SplitQName(attr.szQName, attr.cchQName, &attr.szLocalName, &attr.cchLocalName, &cchPrefix);
+
+			sz = szAttrEnd;
+			while (IsSpace(*sz))
+				sz++;
+			if (*sz++ != '=')
+				return Fail("missing attribute value");
+			while (IsSpace(*sz))
+				sz++;
+			char chQuote = *sz++;
+			if (chQuote != '"' && chQuote != '\'')
+				return Fail("missing attribute value");
+			char *szValue = sz;
+			while (*sz != chQuote && *sz != '<' && *sz != '\0')
+				sz++;
+			if (*sz != chQuote)
+				return Fail("unterminated attribute value");
+			char *szValueEnd = Decode(szValue, sz, true);
+			if (!szValueEnd)
+				return Fail("bad reference in attribute value");
+			sz++;
+
+			attr.szValue = szValue;
+			attr.cchValue = (int) (szValueEnd - szValue);
+
+			// the prefix is resolved once all the declarations are known;
+			// until then szUri is NULL and cchUri holds the prefix length
+			attr.szUri = NULL;
+			attr.cchUri = cchPrefix;
+
+			// namespace declarations aren't attributes
+			if (IsEqual(attr.szQName, attr.cchQName, "xmlns", 5) ||
+				(cchPrefix == 5 && !memcmp(attr.szQName, "xmlns", 5)))
+			{
+				CAtlXmlNamespace ns;
+				ns.szPrefix = cchPrefix ? attr.szLocalName : "";
+				ns.cchPrefix = cchPrefix ? attr.cchLocalName : 0;
+				ns.szUri = attr.szValue;
+				ns.cchUri = attr.cchValue;
+				if (ns.cchPrefix && !ns.cchUri)
+					return Fail("empty namespace declaration");
+				if (!m_Namespaces.Push(ns))
+					return Fail("out of memory", E_OUTOFMEMORY);
+				continue;
+			}
+
+			for (size_t i = 0; i < m_Attributes.GetCount(); i++)
+			{
+				if (IsEqual(m_Attributes[i].szQName, m_Attributes[i].cchQName, attr.szQName, attr.cchQName))
+					return Fail("duplicate attribute");
+			}
+			if (!m_Attributes.Push(attr))
+				return Fail("out of memory", E_OUTOFMEMORY);
+		}
+
+		if (*sz == '/')
+		{
+			m_bEndPending = true;
+			sz++;
+		}
+		if (*sz != '>')
+			return Fail("unterminated start tag");
+		m_sz = sz + 1;
+
+		HRESULT hr = ResolvePrefix(element.szQName, cchElementPrefix, &element.szUri, &element.cchUri);
+		if (FAILED(hr))
+			return hr;
+
+		for (size_t i = 0; i < m_Attributes.GetCount(); i++)
+		{
+			CAtlXmlAttribute& attr = m_Attributes[i];
+			int cchPrefix = attr.cchUri;
+			if (cchPrefix)
+			{
+				hr = ResolvePrefix(attr.szQName, cchPrefix, &attr.szUri, &attr.cchUri);
+				if (FAILED(hr))
+					return hr;
+			}
+			else
+			{
+				attr.szUri = "";
+				attr.cchUri = 0;
+			}
+		}
+
+		if (!m_Elements.Push(element))
+			return Fail("out of memory", E_OUTOFMEMORY);
+		m_nToken = ATL_XML_START_ELEMENT;
+		return S_OK;
+	}
+
+private:
+	CAtlXmlTokenizer(const CAtlXmlTokenizer&);
+	CAtlXmlTokenizer& operator=(const CAtlXmlTokenizer&);
+}; // class CAtlXmlTokenizer
+
+} // namespace ATL
+#pragma pack(pop)
+
+#endif // __ATLXMLTOK_H__
@@ -0,0 +1,308 @@
+// Support for the standalone tests and benchmarks.
+//
+// On Windows this pulls in the real ATL base headers.  Elsewhere it
+// defines the handful of ATL types and macros that the platform-neutral
+// headers (atlcacheflush.h, atlasyncstate.h and friends) rely on, so their logic can be
+// tested on any compiler.  ATLASSERT stays active in release builds and
+// counts as a test failure.
+
+#ifndef __ATLTEST_H__
+#define __ATLTEST_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int g_nAtlTestFailures = 0;
+
+inline void AtlTestFail(const char *szExpr, const char *szFile, int nLine)
+{
+	printf("%s(%d): check failed: %s\n", szFile, nLine, szExpr);
+	g_nAtlTestFailures++;
+}
+
+#define ATLTEST_CHECK(expr) \
+	((expr) ? (void)0 : AtlTestFail(#expr, __FILE__, __LINE__))
+
+// returns the process exit code for main
+inline int AtlTestResult(const char *szName)
+{
+	if (g_nAtlTestFailures)
+		printf("%s: %d check(s) failed\n", szName, g_nAtlTestFailures);
+	else
+		printf("%s: passed\n", szName);
+	return g_nAtlTestFailures ? 1 : 0;
+}
+
+#ifdef _WIN32
+
+#include <atlbase.h>
+#include <atlutil.h>
+
+#else // !_WIN32
+
+#include <stdint.h>
+#include <time.h>
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef unsigned int UINT;
+typedef int BOOL;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef char CHAR;
+typedef char *LPSTR;
+typedef const char *LPCSTR;
+typedef int32_t HRESULT;
+typedef uintptr_t DWORD_PTR;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define S_OK ((HRESULT)0)
+#define S_FALSE ((HRESULT)1)
+#define E_FAIL ((HRESULT)0x80004005)
+#define E_INVALIDARG ((HRESULT)0x80070057)
+#define E_OUTOFMEMORY ((HRESULT)0x8007000E)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+
+#define ATLASSERT(expr) ATLTEST_CHECK(expr)
+#define ATLASSUME(expr) ATLTEST_CHECK(expr)
+#define ATLENSURE(expr) do { if (!(expr)) { AtlTestFail(#expr, __FILE__, __LINE__); abort(); } } while (0)
+#define ATLENSURE_RETURN_VAL(expr, val) do { if (!(expr)) { AtlTestFail(#expr, __FILE__, __LINE__); return val; } } while (0)
+#define C_ASSERT(expr) static_assert(expr, #expr)
+#define ATL_NOINLINE __attribute__((noinline))
+
+#define MAKELONG(a, b) ((LONG)(((WORD)((DWORD_PTR)(a) & 0xffff)) | ((DWORD)((WORD)((DWORD_PTR)(b) & 0xffff))) << 16))
+#define LOWORD(l) ((WORD)((DWORD_PTR)(l) & 0xffff))
+#define HIWORD(l) ((WORD)((DWORD_PTR)(l) >> 16))
+#define ATLTRY(x) try { x; } catch (...) { }
+#define _ATLTRY try
+#define _ATLCATCHALL() catch (...)
+#define _ATL_PACKING 8
+
+inline LONG InterlockedExchange(volatile LONG *plTarget, LONG lValue)
+{
+	return __atomic_exchange_n(plTarget, lValue, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(volatile LONG *plTarget, LONG lExchange, LONG lComparand)
+{
+	__atomic_compare_exchange_n(plTarget, &lComparand, lExchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return lComparand;
+}
+
+inline void *InterlockedCompareExchangePointer(void * volatile *ppTarget, void *pExchange, void *pComparand)
+{
+	__atomic_compare_exchange_n(ppTarget, &pComparand, pExchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return pComparand;
+}
+
+inline LONG InterlockedIncrement(volatile LONG *plTarget)
+{
+	return __atomic_add_fetch(plTarget, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedDecrement(volatile LONG *plTarget)
+{
+	return __atomic_sub_fetch(plTarget, 1, __ATOMIC_SEQ_CST);
+}
+
+inline DWORD GetTickCount()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (DWORD) ((ULONGLONG) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// numbers the threads in the order they first ask
+inline DWORD GetCurrentThreadId()
+{
+	static volatile LONG s_lThreads = 0;
+	static thread_local DWORD s_dwThreadId = (DWORD) InterlockedIncrement(&s_lThreads);
+	return s_dwThreadId;
+}
+
+struct SYSTEMTIME
+{
+	WORD wYear;
+	WORD wMonth;
+	WORD wDayOfWeek;
+	WORD wDay;
+	WORD wHour;
+	WORD wMinute;
+	WORD wSecond;
+	WORD wMilliseconds;
+};
+
+struct FILETIME
+{
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+};
+
+// Fails for the same out of range fields as Windows does, and ignores
+// wDayOfWeek
+inline BOOL SystemTimeToFileTime(const SYSTEMTIME *pst, FILETIME *pft)
+{
+	static const WORD s_rgDays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	DWORD dwYear = pst->wYear;
+	bool bLeap = (dwYear % 4 == 0 && dwYear % 100 != 0) || dwYear % 400 == 0;
+	if (dwYear < 1601 || dwYear > 30827 || pst->wMonth < 1 || pst->wMonth > 12 || pst->wDay < 1 ||
+		pst->wDay > s_rgDays[pst->wMonth-1] + (pst->wMonth == 2 && bLeap) ||
+		pst->wHour > 23 || pst->wMinute > 59 || pst->wSecond > 59 || pst->wMilliseconds > 999)
+	{
+		return FALSE;
+	}
+
+	// days since 1 Jan 1601
+	ULONGLONG ullDays = 0;
+	for (DWORD dwPrev = 1601; dwPrev < dwYear; dwPrev++)
+		ullDays += ((dwPrev % 4 == 0 && dwPrev % 100 != 0) || dwPrev % 400 == 0) ? 366 : 365;
+	for (WORD wPrev = 1; wPrev < pst->wMonth; wPrev++)
+		ullDays += s_rgDays[wPrev-1] + (wPrev == 2 && bLeap);
+	ullDays += pst->wDay - 1;
+
+	ULONGLONG ullTime = ((ullDays * 24 + pst->wHour) * 60 + pst->wMinute) * 60 + pst->wSecond;
+	ullTime = (ullTime * 1000 + pst->wMilliseconds) * 10000;
+	pft->dwLowDateTime = (DWORD) ullTime;
+	pft->dwHighDateTime = (DWORD) (ullTime >> 32);
+	return TRUE;
+}
+
+// from atlutil.h
+inline short AtlHexValue(char chIn)
+{
+	unsigned char ch = (unsigned char)chIn;
+	if (ch >= '0' && ch <= '9')
+		return (short)(ch - '0');
+	if (ch >= 'A' && ch <= 'F')
+		return (short)(ch - 'A' + 10);
+	if (ch >= 'a' && ch <= 'f')
+		return (short)(ch - 'a' + 10);
+	return -1;
+}
+
+namespace ATL {
+
+// from atlalloc.h
+template <typename T>
+class CHeapPtr
+{
+public:
+	T *m_pData;
+
+	CHeapPtr() : m_pData(NULL)
+	{
+	}
+
+	~CHeapPtr()
+	{
+		free(m_pData);
+	}
+
+	operator T*() const
+	{
+		return m_pData;
+	}
+
+	bool Allocate(size_t nElements = 1)
+	{
+		free(m_pData);
+		m_pData = (nElements <= SIZE_MAX / sizeof(T)) ? (T *) malloc(nElements * sizeof(T)) : NULL;
+		return m_pData != NULL;
+	}
+
+	void Free()
+	{
+		free(m_pData);
+		m_pData = NULL;
+	}
+
+	void Attach(T *pData)
+	{
+		free(m_pData);
+		m_pData = pData;
+	}
+
+	T *Detach()
+	{
+		T *pData = m_pData;
+		m_pData = NULL;
+		return pData;
+	}
+
+private:
+	CHeapPtr(const CHeapPtr&);
+	CHeapPtr& operator=(const CHeapPtr&);
+};
+
+template <typename T>
+inline HRESULT AtlAdd(T *ptResult, T tLeft, T tRight)
+{
+	return __builtin_add_overflow(tLeft, tRight, ptResult) ? E_INVALIDARG : S_OK;
+}
+
+template <typename T>
+inline HRESULT AtlMultiply(T *ptResult, T tLeft, T tRight)
+{
+	return __builtin_mul_overflow(tLeft, tRight, ptResult) ? E_INVALIDARG : S_OK;
+}
+
+// from atlchecked.h
+namespace Checked {
+
+inline void memcpy_s(void *pDest, size_t cbDest, const void *pSrc, size_t cbSrc)
+{
+	ATLENSURE(cbSrc <= cbDest);
+	if (cbSrc)
+		memcpy(pDest, pSrc, cbSrc);
+}
+
+} // namespace Checked
+
+} // namespace ATL
+
+#endif // _WIN32
+
+#include <vector>
+
+// A byte array with the members of CAtlArray<BYTE> that the neutral
+// headers use
+class CAtlTestByteArray
+{
+	std::vector<BYTE> m_data;
+
+public:
+	size_t GetCount() const
+	{
+		return m_data.size();
+	}
+
+	bool SetCount(size_t nCount)
+	{
+		m_data.resize(nCount);
+		return true;
+	}
+
+	BYTE *GetData()
+	{
+		return m_data.empty() ? NULL : &m_data[0];
+	}
+
+	void RemoveAll()
+	{
+		m_data.clear();
+	}
+};
+
+#endif // __ATLTEST_H__
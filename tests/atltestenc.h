@@ -0,0 +1,325 @@
+// The atlenc.h codecs that atlsimdenc.h falls back to and must match.
+//
+// On Windows this is the real atlenc.h.  Elsewhere it is a copy of the
+// base64 and hex routines from that header, with the same lengths, flags,
+// return values and assertions, so that the vector codecs can be compared
+// with them on any compiler.  Include atltest.h first.
+
+#ifndef __ATLTESTENC_H__
+#define __ATLTESTENC_H__
+
+#ifdef _WIN32
+
+#include <atlenc.h>
+
+#else // !_WIN32
+
+#include <limits.h>
+
+#define ATL_BASE64_FLAG_NONE	0
+#define ATL_BASE64_FLAG_NOPAD	1
+#define ATL_BASE64_FLAG_NOCRLF	2
+
+namespace ATL {
+
+inline int Base64EncodeGetRequiredLength(int nSrcLen, DWORD dwFlags = ATL_BASE64_FLAG_NONE)
+{
+	long long nSrcLen4 = static_cast<long long>(nSrcLen) * 4;
+	ATLENSURE(nSrcLen4 <= INT_MAX);
+
+	int nRet = static_cast<int>(nSrcLen4 / 3);
+
+	if ((dwFlags & ATL_BASE64_FLAG_NOPAD) == 0)
+		nRet += nSrcLen % 3;
+
+	int nCRLFs = nRet / 76 + 1;
+	int nOnLastLine = nRet % 76;
+
+	if (nOnLastLine)
+	{
+		if (nOnLastLine % 4)
+			nRet += 4 - (nOnLastLine % 4);
+	}
+
+	nCRLFs *= 2;
+
+	if ((dwFlags & ATL_BASE64_FLAG_NOCRLF) == 0)
+		nRet += nCRLFs;
+
+	return nRet;
+}
+
+inline BOOL Base64Encode(const BYTE *pbSrcData, int nSrcLen, LPSTR szDest, int *pnDestLen,
+	DWORD dwFlags = ATL_BASE64_FLAG_NONE) noexcept
+{
+	static const char s_chBase64EncodingTable[64] = {
+		'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P', 'Q',
+		'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f', 'g',
+		'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w',
+		'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/' };
+
+	if (!pbSrcData || !szDest || !pnDestLen)
+		return FALSE;
+
+	if (*pnDestLen < Base64EncodeGetRequiredLength(nSrcLen, dwFlags))
+	{
+		ATLASSERT(FALSE);
+		return FALSE;
+	}
+
+	int nWritten = 0;
+	int nLen1 = (nSrcLen / 3) * 4;
+	int nLen2 = nLen1 / 76;
+	int nLen3 = 19;
+
+	for (int i = 0; i <= nLen2; i++)
+	{
+		if (i == nLen2)
+			nLen3 = (nLen1 % 76) / 4;
+
+		for (int j = 0; j < nLen3; j++)
+		{
+			DWORD dwCurr = 0;
+			for (int n = 0; n < 3; n++)
+			{
+				dwCurr |= *pbSrcData++;
+				dwCurr <<= 8;
+			}
+			for (int k = 0; k < 4; k++)
+			{
+				BYTE b = (BYTE)(dwCurr >> 26);
+				*szDest++ = s_chBase64EncodingTable[b];
+				dwCurr <<= 6;
+			}
+		}
+		nWritten += nLen3 * 4;
+
+		if ((dwFlags & ATL_BASE64_FLAG_NOCRLF) == 0)
+		{
+			*szDest++ = '\r';
+			*szDest++ = '\n';
+			nWritten += 2;
+		}
+	}
+
+	if (nWritten && (dwFlags & ATL_BASE64_FLAG_NOCRLF) == 0)
+	{
+		szDest -= 2;
+		nWritten -= 2;
+	}
+
+	nLen2 = (nSrcLen % 3) ? (nSrcLen % 3 + 1) : 0;
+	if (nLen2)
+	{
+		DWORD dwCurr = 0;
+		for (int n = 0; n < 3; n++)
+		{
+			if (n < (nSrcLen % 3))
+				dwCurr |= *pbSrcData++;
+			dwCurr <<= 8;
+		}
+		for (int k = 0; k < nLen2; k++)
+		{
+			BYTE b = (BYTE)(dwCurr >> 26);
+			*szDest++ = s_chBase64EncodingTable[b];
+			dwCurr <<= 6;
+		}
+		nWritten += nLen2;
+		if ((dwFlags & ATL_BASE64_FLAG_NOPAD) == 0)
+		{
+			nLen3 = nLen2 ? 4 - nLen2 : 0;
+			for (int j = 0; j < nLen3; j++)
+				*szDest++ = '=';
+			nWritten += nLen3;
+		}
+	}
+
+	*pnDestLen = nWritten;
+	return TRUE;
+}
+
+inline int DecodeBase64Char(unsigned int ch) noexcept
+{
+	// returns -1 if the character is invalid
+	// or should be skipped
+	// otherwise, returns the 6-bit code for the character
+	// from the encoding table
+	if (ch >= 'A' && ch <= 'Z')
+		return ch - 'A' + 0;	// 0 range starts at 'A'
+	if (ch >= 'a' && ch <= 'z')
+		return ch - 'a' + 26;	// 26 range starts at 'a'
+	if (ch >= '0' && ch <= '9')
+		return ch - '0' + 52;	// 52 range starts at '0'
+	if (ch == '+')
+		return 62;
+	if (ch == '/')
+		return 63;
+	return -1;
+}
+
+inline BOOL Base64Decode(LPCSTR szSrc, int nSrcLen, BYTE *pbDest, int *pnDestLen) noexcept
+{
+	// walk the source buffer
+	// each four character sequence is converted to 3 bytes
+	// CRLFs and =, and any characters not in the encoding table
+	// are skiped
+
+	if (szSrc == NULL || pnDestLen == NULL)
+		return FALSE;
+
+	LPCSTR szSrcEnd = szSrc + nSrcLen;
+	int nWritten = 0;
+
+	BOOL bOverflow = (pbDest == NULL) ? TRUE : FALSE;
+
+	while (szSrc < szSrcEnd && (*szSrc) != 0)
+	{
+		DWORD dwCurr = 0;
+		int i;
+		int nBits = 0;
+		for (i = 0; i < 4; i++)
+		{
+			if (szSrc >= szSrcEnd)
+				break;
+			int nCh = DecodeBase64Char(*szSrc);
+			szSrc++;
+			if (nCh == -1)
+			{
+				// skip this char
+				i--;
+				continue;
+			}
+			dwCurr <<= 6;
+			dwCurr |= nCh;
+			nBits += 6;
+		}
+
+		if (!bOverflow && nWritten + (nBits / 8) > (*pnDestLen))
+			bOverflow = TRUE;
+
+		// dwCurr has the 3 bytes to write to the output buffer
+		// left to right
+		dwCurr <<= 24 - nBits;
+		for (i = 0; i < nBits / 8; i++)
+		{
+			if (!bOverflow)
+			{
+				*pbDest = (BYTE)((dwCurr & 0x00ff0000) >> 16);
+				pbDest++;
+			}
+			dwCurr <<= 8;
+			nWritten++;
+		}
+	}
+
+	*pnDestLen = nWritten;
+
+	if (bOverflow)
+	{
+		if (pbDest != NULL)
+		{
+			ATLASSERT(FALSE);
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+inline int AtlHexEncodeGetRequiredLength(int nSrcLen)
+{
+	long long nRet64 = 2 * static_cast<long long>(nSrcLen) + 1;
+	ATLENSURE(nRet64 <= INT_MAX && nRet64 >= INT_MIN);
+	int nRet = static_cast<int>(nRet64);
+	return nRet;
+}
+
+inline int AtlHexDecodeGetRequiredLength(int nSrcLen) noexcept
+{
+	return nSrcLen / 2;
+}
+
+inline char AtlHexDigit(UINT nDigit) noexcept
+{
+	static const char s_chHexChars[16] = {
+		'0', '1', '2', '3', '4', '5', '6', '7',
+		'8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+
+	return s_chHexChars[nDigit];
+}
+
+inline char AtlGetHexValue(char ch) noexcept
+{
+	if (ch >= '0' && ch <= '9')
+		return (ch - '0');
+	if (ch >= 'A' && ch <= 'F')
+		return (ch - 'A' + 10);
+	if (ch >= 'a' && ch <= 'f')
+		return (ch - 'a' + 10);
+	return -1;
+}
+
+inline BOOL AtlHexEncode(const BYTE *pbSrcData, int nSrcLen, LPSTR szDest, int *pnDestLen) noexcept
+{
+	if (!pbSrcData || !szDest || !pnDestLen)
+		return FALSE;
+
+	if (*pnDestLen < AtlHexEncodeGetRequiredLength(nSrcLen))
+	{
+		ATLASSERT(FALSE);
+		return FALSE;
+	}
+
+	int nRead = 0;
+	int nWritten = 0;
+	BYTE ch;
+	while (nRead < nSrcLen)
+	{
+		ch = *pbSrcData++;
+		nRead++;
+		*szDest++ = AtlHexDigit((ch >> 4) & 0x0F);
+		*szDest++ = AtlHexDigit(ch & 0x0F);
+		nWritten += 2;
+	}
+
+	*pnDestLen = nWritten;
+	return TRUE;
+}
+
+inline BOOL AtlHexDecode(LPCSTR pSrcData, int nSrcLen, BYTE *pbDest, int *pnDestLen) noexcept
+{
+	if (!pSrcData || !pbDest || !pnDestLen)
+		return FALSE;
+
+	if (*pnDestLen < AtlHexDecodeGetRequiredLength(nSrcLen))
+	{
+		ATLASSERT(FALSE);
+		return FALSE;
+	}
+
+	if (nSrcLen % 2)
+		return FALSE;
+
+	int nRead = 0;
+	int nWritten = 0;
+	while (nRead < nSrcLen)
+	{
+		char ch1 = AtlGetHexValue((char)*pSrcData++);
+		char ch2 = AtlGetHexValue((char)*pSrcData++);
+		if ((ch1 == -1) || (ch2 == -1))
+			return FALSE;
+		*pbDest++ = (BYTE)(16 * ch1 + ch2);
+		nWritten++;
+		nRead += 2;
+	}
+
+	*pnDestLen = nWritten;
+	return TRUE;
+}
+
+} // namespace ATL
+
+#endif // _WIN32
+
+#endif // __ATLTESTENC_H__
@@ -0,0 +1,91 @@
+// The reference that the URL-encoded data scanner in atlurlparams.h is
+// compared with, by test_url_params and bench_url_params.  Include
+// atltest.h first.
+
+#ifndef __ATLTESTURL_H__
+#define __ATLTESTURL_H__
+
+// One pair, one character at a time, as CHttpRequestParams::Parse did it
+// before the plain runs were copied in blocks
+inline LPSTR AtlTestParseUrlParam(LPSTR szQueryString, LPSTR *pszName, LPCSTR *pszValue)
+{
+	LPSTR szUrlCurrent = szQueryString;
+	*pszName = szUrlCurrent;
+
+	while (*szQueryString)
+	{
+		if (*szQueryString == '=')
+		{
+			szQueryString++;
+			break;
+		}
+		if (*szQueryString == '&')
+			break;
+		if (*szQueryString == '+')
+			*szUrlCurrent = ' ';
+		else if (*szQueryString == '%')
+		{
+			if (*(szQueryString+1) && *(szQueryString+2))
+			{
+				short nFirstDigit = AtlHexValue(szQueryString[1]);
+				short nSecondDigit = AtlHexValue(szQueryString[2]);
+				if (nFirstDigit < 0 || nSecondDigit < 0)
+					break;
+				*szUrlCurrent = static_cast<CHAR>(16*nFirstDigit+nSecondDigit);
+				szQueryString += 2;
+			}
+			else
+				*szUrlCurrent = '\0';
+		}
+		else
+			*szUrlCurrent = *szQueryString;
+
+		szQueryString++;
+		szUrlCurrent++;
+	}
+
+	if (*szUrlCurrent == '&')
+	{
+		*szUrlCurrent++ = '\0';
+		szQueryString++;
+		*pszValue = "";
+		return szQueryString;
+	}
+
+	if (*szUrlCurrent)
+		*szUrlCurrent++ = '\0';
+
+	*pszValue = szUrlCurrent;
+	while (*szQueryString && *szQueryString != '#')
+	{
+		if (*szQueryString == '&')
+		{
+			szQueryString++;
+			break;
+		}
+		if (*szQueryString == '+')
+			*szUrlCurrent = ' ';
+		else if (*szQueryString == '%')
+		{
+			if (*(szQueryString+1) && *(szQueryString+2))
+			{
+				short nFirstDigit = AtlHexValue(szQueryString[1]);
+				short nSecondDigit = AtlHexValue(szQueryString[2]);
+				if (nFirstDigit < 0 || nSecondDigit < 0)
+					break;
+				*szUrlCurrent = static_cast<CHAR>(16*nFirstDigit+nSecondDigit);
+				szQueryString += 2;
+			}
+			else
+				*szUrlCurrent = '\0';
+		}
+		else
+			*szUrlCurrent = *szQueryString;
+		szQueryString++;
+		szUrlCurrent++;
+	}
+	*szUrlCurrent = '\0';
+	return szQueryString;
+}
+
+#endif // __ATLTESTURL_H__
@@ -0,0 +1,79 @@
+// Lookup throughput of CMemoryCache, CShardedMemoryCache and
+// CReadMostlyMemoryCache when many threads hit the same cache.
+//
+// Every thread looks up and releases random keys from a preloaded set.
+// The output is the total lookup rate and the cost per lookup for
+// 1, 2, 4, ... up to twice the number of processors.
+
+#include <atlbase.h>
+#include <atlcache.h>
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+static const int c_nKeys = 4096;
+static const int c_nLookupsPerThread = 1000000;
+
+static CStringA g_rgKeys[c_nKeys];
+
+template <class TCache>
+static void RunLookups(TCache *pCache, unsigned nSeed)
+{
+	for (int i=0; i<c_nLookupsPerThread; i++)
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		HCACHEITEM hEntry = NULL;
+		if (pCache->LookupEntry(CFixedStringKey(g_rgKeys[(nSeed >> 8) % c_nKeys]), &hEntry) == S_OK)
+			pCache->ReleaseEntry(hEntry);
+	}
+}
+
+template <class TCache>
+static void Measure(const char *szName, int nMaxThreads)
+{
+	TCache cache;
+	if (FAILED(cache.Initialize(NULL)))
+	{
+		printf("%s: Initialize failed\n", szName);
+		return;
+	}
+
+	for (int i=0; i<c_nKeys; i++)
+		cache.AddEntry(CFixedStringKey(g_rgKeys[i]), i, 64);
+
+	for (int nThreads=1; nThreads<=nMaxThreads; nThreads*=2)
+	{
+		std::vector<std::thread> threads;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int t=0; t<nThreads; t++)
+			threads.push_back(std::thread(RunLookups<TCache>, &cache, (unsigned)t * 7919 + 1));
+		for (size_t t=0; t<threads.size(); t++)
+			threads[t].join();
+		double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		double dLookups = (double)nThreads * c_nLookupsPerThread;
+		printf("%-24s threads=%2d  %8.2f Mlookups/s  %7.1f ns/lookup/thread\n",
+			szName, nThreads, dLookups / dSeconds / 1e6,
+			dSeconds * 1e9 / c_nLookupsPerThread);
+	}
+
+	cache.Uninitialize();
+}
+
+int main()
+{
+	for (int i=0; i<c_nKeys; i++)
+		g_rgKeys[i].Format("/app/page%d.srf", i);
+
+	int nMaxThreads = 2 * (int)std::thread::hardware_concurrency();
+	if (nMaxThreads < 2)
+		nMaxThreads = 2;
+
+	Measure<CMemoryCache<int, CNoStatClass> >("CMemoryCache", nMaxThreads);
+	Measure<CShardedMemoryCache<int, CNoStatClass> >("CShardedMemoryCache", nMaxThreads);
+	Measure<CReadMostlyMemoryCache<int, CNoStatClass> >("CReadMostlyMemoryCache", nMaxThreads);
+	Measure<CShardedMemoryCache<int, CStdStatClass> >("CShardedMemoryCache+stats", nMaxThreads);
+	return 0;
+}
@@ -0,0 +1,205 @@
+// Trace replay for the flusher policies in atlcacheflush.h.
+//
+// Each trace is replayed through a cache of fixed capacity that evicts the
+// way CMemoryCacheBase::FlushEntries does when the entry limit is reached.
+// The output is the hit rate and the cost per request of every policy.
+//
+//   bench_cache_flushers [trace-file]
+//
+// A trace file holds one key per line; without one, synthetic traces are
+// used: a skewed (Zipf) working set, the same with periodic one-hit scans
+// mixed in, and a loop slightly larger than the cache.
+
+#include "atltest.h"
+#include <atlcacheflush.h>
+
+#include <math.h>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace ATL;
+
+struct CTraceNode : public CFlusherCacheData
+{
+	DWORD nKey;
+};
+
+template <class Flusher>
+class CTraceCache
+{
+	Flusher m_flusher;
+	std::unordered_map<DWORD, CTraceNode *> m_map;
+	size_t m_nCapacity;
+
+public:
+	size_t m_nHits;
+
+	CTraceCache(size_t nCapacity) : m_nCapacity(nCapacity), m_nHits(0)
+	{
+	}
+
+	~CTraceCache()
+	{
+		for (auto it = m_map.begin(); it != m_map.end(); ++it)
+			delete it->second;
+	}
+
+	void Request(DWORD nKey)
+	{
+		auto it = m_map.find(nKey);
+		if (it != m_map.end())
+		{
+			m_flusher.Access(it->second);
+			m_nHits++;
+			return;
+		}
+
+		if (m_map.size() >= m_nCapacity)
+			Flush(m_nCapacity - 1);
+
+		CTraceNode *pNode = new CTraceNode;
+		pNode->nKey = nKey;
+		pNode->nKeyHash = nKey * 2654435761u;
+		m_map[nKey] = pNode;
+		m_flusher.Add(pNode);
+	}
+
+	void Flush(size_t nTarget)
+	{
+		CTraceNode *pNode = static_cast<CTraceNode *>(m_flusher.GetStart());
+		while (pNode && m_map.size() > nTarget)
+		{
+			CTraceNode *pNext = static_cast<CTraceNode *>(m_flusher.GetNext(pNode));
+			m_flusher.Remove(pNode);
+			m_map.erase(pNode->nKey);
+			delete pNode;
+			pNode = pNext;
+		}
+	}
+};
+
+template <class Flusher>
+static void Replay(const char *szPolicy, const std::vector<DWORD> &trace, size_t nCapacity)
+{
+	CTraceCache<Flusher> cache(nCapacity);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i=0; i<trace.size(); i++)
+		cache.Request(trace[i]);
+	double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("  %-10s hit rate %6.2f%%  %7.1f ns/request\n", szPolicy,
+		100.0 * cache.m_nHits / trace.size(), dSeconds * 1e9 / trace.size());
+}
+
+static void ReplayAll(const char *szTrace, const std::vector<DWORD> &trace, size_t nCapacity)
+{
+	printf("%s: %u requests, capacity %u\n", szTrace, (unsigned)trace.size(), (unsigned)nCapacity);
+	Replay<COldFlusher>("Old", trace, nCapacity);
+	Replay<CLRUFlusher>("LRU", trace, nCapacity);
+	Replay<CLOUFlusher>("LOU", trace, nCapacity);
+	Replay<CClockFlusher>("Clock", trace, nCapacity);
+	Replay<CTinyLFUFlusher<> >("TinyLFU", trace, nCapacity);
+}
+
+// Draws keys 0..nKeys-1 with probability proportional to 1/(k+1)^dSkew
+class CZipf
+{
+	std::vector<double> m_cdf;
+	unsigned m_nSeed;
+
+public:
+	CZipf(DWORD nKeys, double dSkew, unsigned nSeed) : m_nSeed(nSeed)
+	{
+		double dSum = 0;
+		m_cdf.resize(nKeys);
+		for (DWORD k=0; k<nKeys; k++)
+		{
+			dSum += 1.0 / pow((double)(k+1), dSkew);
+			m_cdf[k] = dSum;
+		}
+		for (DWORD k=0; k<nKeys; k++)
+			m_cdf[k] /= dSum;
+	}
+
+	DWORD Next()
+	{
+		m_nSeed = m_nSeed * 1664525 + 1013904223;
+		double d = (m_nSeed >> 8) / 16777216.0;
+		size_t lo = 0, hi = m_cdf.size() - 1;
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if (m_cdf[mid] < d)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return (DWORD)lo;
+	}
+};
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+	{
+		FILE *pFile = fopen(argv[1], "r");
+		if (!pFile)
+		{
+			printf("cannot open %s\n", argv[1]);
+			return 1;
+		}
+
+		std::unordered_map<std::string, DWORD> keys;
+		std::vector<DWORD> trace;
+		char szLine[1024];
+		while (fgets(szLine, sizeof(szLine), pFile))
+		{
+			std::string key(szLine, strcspn(szLine, "\r\n"));
+			auto it = keys.find(key);
+			if (it == keys.end())
+				it = keys.insert(std::make_pair(key, (DWORD)keys.size())).first;
+			trace.push_back(it->second);
+		}
+		fclose(pFile);
+
+		size_t nCapacity = argc > 2 ? (size_t)atoi(argv[2]) : keys.size() / 10 + 1;
+		ReplayAll(argv[1], trace, nCapacity);
+		return 0;
+	}
+
+	const size_t c_nRequests = 2000000;
+	const DWORD c_nKeys = 100000;
+	const size_t c_nCapacity = 2000;
+
+	std::vector<DWORD> zipf;
+	{
+		CZipf gen(c_nKeys, 0.9, 1);
+		for (size_t i=0; i<c_nRequests; i++)
+			zipf.push_back(gen.Next());
+	}
+	ReplayAll("zipf(0.9)", zipf, c_nCapacity);
+
+	// every 10000 requests, a scan of 2000 keys that are never seen again
+	std::vector<DWORD> scan;
+	{
+		CZipf gen(c_nKeys, 0.9, 2);
+		DWORD nScanKey = c_nKeys;
+		for (size_t i=0; scan.size()<c_nRequests; i++)
+		{
+			if (i % 10000 == 0)
+				for (int j=0; j<2000; j++)
+					scan.push_back(nScanKey++);
+			scan.push_back(gen.Next());
+		}
+	}
+	ReplayAll("zipf(0.9)+scans", scan, c_nCapacity);
+
+	std::vector<DWORD> loop;
+	for (size_t i=0; i<c_nRequests; i++)
+		loop.push_back((DWORD)(i % (c_nCapacity + c_nCapacity / 10)));
+	ReplayAll("loop", loop, c_nCapacity);
+
+	return 0;
+}
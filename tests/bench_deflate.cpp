@@ -0,0 +1,142 @@
+// Size and CPU cost of the gzip content coding in atldeflate.h.
+//
+// For each body, prints the compressed size as a percentage of the input
+// and the compression rate of AtlCompressContent, and of zlib at levels 1
+// and 6 when the benchmark is built with zlib (ATLTEST_HAVE_ZLIB).  The
+// cost of the CRC-32 that the gzip trailer needs is shown separately.
+//
+//   bench_deflate [file...]
+//
+// Without arguments, synthetic pages are used: generated HTML tables of
+// several sizes, and random bytes that don't compress at all.
+
+#include "atltest.h"
+#include <atldeflate.h>
+
+#include <chrono>
+#include <string>
+
+#ifdef ATLTEST_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace ATL;
+
+static const size_t c_cbPerRun = 64 * 1024 * 1024;
+
+template <class TFunc>
+static double MeasureMBps(size_t cbData, TFunc func)
+{
+	size_t nRuns = c_cbPerRun / cbData + 1;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i=0; i<nRuns; i++)
+		func();
+	double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return (double) cbData * nRuns / dSeconds / 1e6;
+}
+
+static void Measure(const char *szName, const std::vector<BYTE>& data)
+{
+	const BYTE *pbData = &data[0];
+	DWORD cbData = (DWORD) data.size();
+	printf("%s: %u bytes\n", szName, (unsigned) cbData);
+
+	CAtlTestByteArray arrOut;
+	size_t cbOut = 0;
+	double dMBps = MeasureMBps(data.size(), [&]()
+	{
+		AtlCompressContent(ATLS_ENCODING_GZIP, pbData, cbData, arrOut);
+		cbOut = arrOut.GetCount();
+	});
+	printf("  %-18s %6.1f%%  %8.1f MB/s\n", "AtlCompressContent", 100.0 * cbOut / cbData, dMBps);
+
+	volatile DWORD dwCrc = 0;
+	dMBps = MeasureMBps(data.size(), [&]() { dwCrc = AtlCrc32(dwCrc, pbData, cbData); });
+	printf("  %-18s %7s  %8.1f MB/s\n", "CRC-32 alone", "", dMBps);
+
+#ifdef ATLTEST_HAVE_ZLIB
+	static const int c_rgLevels[] = { 1, 6 };
+	for (size_t i=0; i<sizeof(c_rgLevels)/sizeof(c_rgLevels[0]); i++)
+	{
+		std::vector<BYTE> out(compressBound(cbData) + 32);
+		dMBps = MeasureMBps(data.size(), [&]()
+		{
+			z_stream stream;
+			memset(&stream, 0, sizeof(stream));
+			deflateInit2(&stream, c_rgLevels[i], Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+			stream.next_in = const_cast<BYTE *>(pbData);
+			stream.avail_in = cbData;
+			stream.next_out = &out[0];
+			stream.avail_out = (uInt) out.size();
+			deflate(&stream, Z_FINISH);
+			cbOut = stream.total_out;
+			deflateEnd(&stream);
+		});
+		char szLevel[32];
+		snprintf(szLevel, sizeof(szLevel), "zlib level %d", c_rgLevels[i]);
+		printf("  %-18s %6.1f%%  %8.1f MB/s\n", szLevel, 100.0 * cbOut / cbData, dMBps);
+	}
+#endif
+}
+
+static std::vector<BYTE> MakePage(size_t cb)
+{
+	std::string str = "<html><head><title>Orders</title></head><body><table>\r\n";
+	unsigned nSeed = 11;
+	for (int nRow = 0; str.size() < cb; nRow++)
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		char szRow[256];
+		snprintf(szRow, sizeof(szRow),
+			"<tr class=\"%s\"><td>%d</td><td><a href=\"/orders/view.srf?id=%u\">Order %u</a></td>"
+			"<td class=\"amount\">%u.%02u</td></tr>\r\n",
+			(nRow & 1) ? "odd" : "even", nRow, nSeed % 100000, nSeed % 100000,
+			(nSeed >> 8) % 1000, (nSeed >> 4) % 100);
+		str += szRow;
+	}
+	str.resize(cb);
+	return std::vector<BYTE>(str.begin(), str.end());
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+	{
+		for (int i=1; i<argc; i++)
+		{
+			FILE *pFile = fopen(argv[i], "rb");
+			if (!pFile)
+			{
+				printf("cannot open %s\n", argv[i]);
+				return 1;
+			}
+			std::vector<BYTE> data;
+			BYTE rgbBuffer[65536];
+			size_t cbRead;
+			while ((cbRead = fread(rgbBuffer, 1, sizeof(rgbBuffer), pFile)) > 0)
+				data.insert(data.end(), rgbBuffer, rgbBuffer + cbRead);
+			fclose(pFile);
+			if (!data.empty())
+				Measure(argv[i], data);
+		}
+		return 0;
+	}
+
+	static const size_t c_rgSizes[] = { 2 * 1024, 16 * 1024, 256 * 1024 };
+	for (size_t i=0; i<sizeof(c_rgSizes)/sizeof(c_rgSizes[0]); i++)
+	{
+		char szName[32];
+		snprintf(szName, sizeof(szName), "page %uK", (unsigned) (c_rgSizes[i] / 1024));
+		Measure(szName, MakePage(c_rgSizes[i]));
+	}
+
+	std::vector<BYTE> random(256 * 1024);
+	unsigned nSeed = 3;
+	for (size_t i=0; i<random.size(); i++)
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		random[i] = (BYTE) (nSeed >> 24);
+	}
+	Measure("random 256K", random);
+	return 0;
+}
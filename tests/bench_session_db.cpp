@@ -0,0 +1,331 @@
+// Cost per request of the database persisted sessions in atlsession.h.
+//
+// Each request opens a session through its session service, reads a few
+// variables, sets one or two and releases the session, as a page handler
+// would.  CDBSession, CDBCachedSession and CDBPackedSession are measured
+// on the same SQLite database through the OLE DB provider for ODBC
+// (MSDASQL), so the numbers include a real round trip per statement but
+// no network.  The last part has two requests write the same session at
+// the same time, and checks that CDBCachedSession keeps the changes of
+// both.
+//
+//   bench_session_db ["OLE DB connection string"]
+//
+// The default connection string needs the SQLite3 ODBC driver
+// (http://www.ch-werner.de/sqliteodbc/) and creates atlsession_bench.db
+// in the current directory.  The tables are dropped and created again.
+
+#include <atlbase.h>
+#include <atlcom.h>
+#include <atlcache.h>
+#include <atlsession.h>
+
+#include <stdio.h>
+#include <chrono>
+
+static const wchar_t c_szDefaultConnection[] =
+	L"Provider=MSDASQL;Driver={SQLite3 ODBC Driver};Database=atlsession_bench.db";
+
+static const int c_nSessions = 50;
+static const int c_nRequests = 2000;
+static const int c_nVariables = 10;
+
+class CBenchModule : public CAtlModuleT<CBenchModule>
+{
+};
+
+static CBenchModule _AtlModule;
+
+// CDefaultQueryClass with SQLite date arithmetic in place of
+// getdate() and DATEDIFF.
+class CSQLiteQueryClass :
+	public CDefaultQueryClass
+{
+public:
+	LPCTSTR GetSessionRefDelete() noexcept
+	{
+		return _T("DELETE FROM SessionReferences ")
+			   _T("WHERE SessionID=? AND RefCount <= 0 ")
+			   _T("AND (julianday('now') - julianday(LastAccess)) * 86400000.0 > TimeoutMs");
+	}
+
+	LPCTSTR GetSessionRefIsExpired() noexcept
+	{
+		return _T("SELECT SessionID FROM SessionReferences ")
+			   _T("WHERE (SessionID=?) AND ((julianday('now') - julianday(LastAccess)) * 86400000.0 > TimeoutMs)");
+	}
+
+	LPCTSTR GetSessionRefCreate() noexcept
+	{
+		return _T("INSERT INTO SessionReferences ")
+			   _T("(SessionID, LastAccess, RefCount, TimeoutMs) ")
+			   _T("VALUES (?, datetime('now'), 1, ?)");
+	}
+
+	LPCTSTR GetSessionRefAddRef() noexcept
+	{
+		return _T("UPDATE SessionReferences ")
+			   _T("SET RefCount=RefCount+1, LastAccess=datetime('now') ")
+			   _T("WHERE SessionID=?");
+	}
+
+	LPCTSTR GetSessionRefRemoveRef() noexcept
+	{
+		return _T("UPDATE SessionReferences ")
+			   _T("SET RefCount=RefCount-1, LastAccess=datetime('now') ")
+			   _T("WHERE SessionID=?");
+	}
+
+	LPCTSTR GetSessionRefAccess() noexcept
+	{
+		return _T("UPDATE SessionReferences ")
+			   _T("SET LastAccess=datetime('now') ")
+			   _T("WHERE SessionID=?");
+	}
+
+	LPCTSTR GetSessionRefCommit() noexcept
+	{
+		return _T("UPDATE SessionReferences ")
+			   _T("SET Version=Version+1, RefCount=RefCount-1, LastAccess=datetime('now') ")
+			   _T("WHERE SessionID=? AND Version=?");
+	}
+};
+
+// Hands the sessions the data source cache, as the ISAPI extension does.
+class CBenchServiceProvider :
+	public IServiceProvider,
+	public CComObjectRootEx<CComMultiThreadModel>
+{
+public:
+	BEGIN_COM_MAP(CBenchServiceProvider)
+		COM_INTERFACE_ENTRY(IServiceProvider)
+	END_COM_MAP()
+
+	HRESULT FinalConstruct()
+	{
+		CComObject<CDataSourceCache> *pCache = NULL;
+		HRESULT hr = CComObject<CDataSourceCache>::CreateInstance(&pCache);
+		if (hr == S_OK)
+			hr = pCache->QueryInterface(&m_spCache);
+		return hr;
+	}
+
+	STDMETHOD(QueryService)(REFGUID guidService, REFIID riid, void **ppv)
+	{
+		if (!ppv)
+			return E_POINTER;
+		*ppv = NULL;
+		if (InlineIsEqualGUID(guidService, __uuidof(IDataSourceCache)))
+			return m_spCache->QueryInterface(riid, ppv);
+		return E_NOINTERFACE;
+	}
+
+	CComPtr<IDataSourceCache> m_spCache;
+};
+
+static HRESULT Execute(CDataConnection& conn, LPCTSTR szSQL)
+{
+	CCommand<CNoAccessor, CNoRowset> command;
+	return command.Open(conn, szSQL, NULL, NULL, DBGUID_DEFAULT, false);
+}
+
+static HRESULT CreateTables(CDataConnection& conn)
+{
+	static const LPCTSTR c_rgszSQL[] =
+	{
+		_T("DROP TABLE IF EXISTS SessionVariables"),
+		_T("DROP TABLE IF EXISTS SessionReferences"),
+		_T("CREATE TABLE SessionReferences (SessionID char(128) PRIMARY KEY, LastAccess datetime, ")
+		_T("RefCount int, TimeoutMs int, Version int NOT NULL DEFAULT 0)"),
+		_T("CREATE TABLE SessionVariables (SessionID char(128), VariableName char(50), ")
+		_T("VariableValue blob, PRIMARY KEY (SessionID, VariableName))"),
+	};
+	for (size_t i=0; i<_countof(c_rgszSQL); i++)
+	{
+		HRESULT hr = Execute(conn, c_rgszSQL[i]);
+		if (hr != S_OK)
+		{
+			printf("\"%ls\" failed: 0x%08x\n", c_rgszSQL[i], (unsigned) hr);
+			return hr;
+		}
+	}
+	return S_OK;
+}
+
+template <class TService>
+static HRESULT CreateSessions(TService& service, CStringA *rgstrIDs)
+{
+	for (int i=0; i<c_nSessions; i++)
+	{
+		char szID[MAX_SESSION_KEY_LEN];
+		DWORD dwSize = _countof(szID);
+		CComPtr<ISession> spSession;
+		HRESULT hr = service.CreateNewSession(szID, &dwSize, &spSession);
+		for (int j=0; hr == S_OK && j<c_nVariables; j++)
+		{
+			char szName[16];
+			sprintf_s(szName, "var%d", j);
+			hr = spSession->SetVariable(szName, CComVariant(L"an initial value of some length"));
+		}
+		if (hr != S_OK)
+			return hr;
+		rgstrIDs[i] = szID;
+	}
+	return S_OK;
+}
+
+template <class TSession>
+static void Measure(const char *szName, IServiceProvider *pProvider, LPCWSTR szConnection)
+{
+	CDBSessionServiceImplT<TSession> service;
+	HRESULT hr = service.Initialize(szConnection, pProvider, ATL_SESSION_TIMEOUT);
+	CStringA rgstrIDs[c_nSessions];
+	if (hr == S_OK)
+		hr = CreateSessions(service, rgstrIDs);
+	if (hr != S_OK)
+	{
+		printf("%s: setting up the sessions failed: 0x%08x\n", szName, (unsigned) hr);
+		return;
+	}
+
+	// every request reads three variables and sets one, every fourth sets two
+	int nFailures = 0;
+	unsigned nSeed = 5;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i=0; i<c_nRequests; i++)
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		CComPtr<ISession> spSession;
+		hr = service.GetSession(rgstrIDs[(nSeed >> 8) % c_nSessions], &spSession);
+		for (int j=0; hr == S_OK && j<3; j++)
+		{
+			char szVar[16];
+			sprintf_s(szVar, "var%d", (i + j) % c_nVariables);
+			CComVariant val;
+			hr = spSession->GetVariable(szVar, &val);
+		}
+		if (hr == S_OK)
+			hr = spSession->SetVariable("var0", CComVariant(i));
+		if (hr == S_OK && (i % 4) == 0)
+			hr = spSession->SetVariable("var1", CComVariant(L"a changed value"));
+		if (hr != S_OK)
+			nFailures++;
+	}
+	double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("  %-18s %8.1f us/request  %8.0f requests/s", szName,
+		dSeconds * 1e6 / c_nRequests, c_nRequests / dSeconds);
+	if (nFailures)
+		printf("  %d failed", nFailures);
+	printf("\n");
+
+	for (int i=0; i<c_nSessions; i++)
+		service.CloseSession(rgstrIDs[i]);
+}
+
+// Two requests open the same session, each sets a different variable,
+// and the second one to finish finds the version already bumped.
+template <class TSession>
+static void MeasureConflict(const char *szName, IServiceProvider *pProvider, LPCWSTR szConnection)
+{
+	CDBSessionServiceImplT<TSession> service;
+	HRESULT hr = service.Initialize(szConnection, pProvider, ATL_SESSION_TIMEOUT);
+	CStringA rgstrIDs[c_nSessions];
+	if (hr == S_OK)
+		hr = CreateSessions(service, rgstrIDs);
+	if (hr != S_OK)
+	{
+		printf("%s: setting up the sessions failed: 0x%08x\n", szName, (unsigned) hr);
+		return;
+	}
+
+	int nLost = 0;
+	int nFailures = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i=0; i<c_nRequests / 2; i++)
+	{
+		LPCSTR szID = rgstrIDs[i % c_nSessions];
+		{
+			CComPtr<ISession> spFirst;
+			CComPtr<ISession> spSecond;
+			hr = service.GetSession(szID, &spFirst);
+			if (hr == S_OK)
+				hr = service.GetSession(szID, &spSecond);
+			CComVariant val;
+			if (hr == S_OK)
+				hr = spFirst->GetVariable("var0", &val);
+			if (hr == S_OK)
+				hr = spSecond->GetVariable("var0", &val);
+			if (hr == S_OK)
+				hr = spFirst->SetVariable("first", CComVariant(i));
+			if (hr == S_OK)
+				hr = spSecond->SetVariable("second", CComVariant(i));
+			if (hr != S_OK)
+				nFailures++;
+			// releasing spFirst writes first; spSecond then has to merge
+		}
+
+		CComPtr<ISession> spCheck;
+		hr = service.GetSession(szID, &spCheck);
+		CComVariant vFirst;
+		CComVariant vSecond;
+		if (hr == S_OK)
+			hr = spCheck->GetVariable("first", &vFirst);
+		if (hr == S_OK)
+			hr = spCheck->GetVariable("second", &vSecond);
+		if (hr != S_OK || vFirst != CComVariant(i) || vSecond != CComVariant(i))
+			nLost++;
+	}
+	double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("  %-18s %8.1f us/pair  %d of %d updates lost", szName,
+		dSeconds * 1e6 / (c_nRequests / 2), nLost, c_nRequests / 2);
+	if (nFailures)
+		printf("  %d failed", nFailures);
+	printf("\n");
+
+	for (int i=0; i<c_nSessions; i++)
+		service.CloseSession(rgstrIDs[i]);
+}
+
+int main(int argc, char **argv)
+{
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	if (FAILED(hr))
+		return 1;
+
+	{
+		CStringW strConnection(argc > 1 ? CStringW(argv[1]) : CStringW(c_szDefaultConnection));
+
+		CDataConnection conn;
+		hr = conn.Open(strConnection);
+		if (hr == S_OK)
+			hr = CreateTables(conn);
+		if (hr != S_OK)
+		{
+			printf("cannot open \"%ls\": 0x%08x\n", (LPCWSTR) strConnection, (unsigned) hr);
+			CoUninitialize();
+			return 1;
+		}
+
+		CComObject<CBenchServiceProvider> *pProvider = NULL;
+		hr = CComObject<CBenchServiceProvider>::CreateInstance(&pProvider);
+		if (hr != S_OK)
+		{
+			CoUninitialize();
+			return 1;
+		}
+		CComPtr<IServiceProvider> spProvider(pProvider);
+
+		printf("%d sessions of %d variables, %d requests\n", c_nSessions, c_nVariables, c_nRequests);
+		Measure<CDBSession<CSQLiteQueryClass> >("CDBSession", spProvider, strConnection);
+		Measure<CDBCachedSession<CSQLiteQueryClass> >("CDBCachedSession", spProvider, strConnection);
+		Measure<CDBPackedSession<CSQLiteQueryClass> >("CDBPackedSession", spProvider, strConnection);
+
+		printf("two requests writing the same session\n");
+		MeasureConflict<CDBSession<CSQLiteQueryClass> >("CDBSession", spProvider, strConnection);
+		MeasureConflict<CDBCachedSession<CSQLiteQueryClass> >("CDBCachedSession", spProvider, strConnection);
+		MeasureConflict<CDBPackedSession<CSQLiteQueryClass> >("CDBPackedSession", spProvider, strConnection);
+	}
+
+	CoUninitialize();
+	return 0;
+}
@@ -0,0 +1,146 @@
+// Throughput of the base64 and hex codecs in atlsimdenc.h.
+//
+// Encodes and decodes random data of several sizes with the atlenc.h
+// routines and with the AtlFast* codecs at every instruction set the
+// processor supports, and prints GB/s of unencoded data.  Base64 is
+// measured both with the 76-character line breaks that MIME uses and
+// without them, as SOAP sends it.
+//
+//   bench_simd_codecs
+
+#include "atltest.h"
+#include "atltestenc.h"
+#include <atlsimdenc.h>
+
+#include <chrono>
+
+using namespace ATL;
+
+static const size_t c_cbPerRun = 256 * 1024 * 1024;
+
+template <class TFunc>
+static double MeasureGBps(size_t cbData, TFunc func)
+{
+	size_t nRuns = c_cbPerRun / cbData + 1;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i=0; i<nRuns; i++)
+		func();
+	double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return (double) cbData * nRuns / dSeconds / 1e9;
+}
+
+#ifdef _ATL_SIMD_CODECS
+
+static const char *GetLevelName(int nLevel)
+{
+	switch (nLevel)
+	{
+	case ATL_SIMD_SSSE3:
+		return "SSSE3";
+	case ATL_SIMD_AVX2:
+		return "AVX2";
+	}
+	return "scalar";
+}
+
+#endif // _ATL_SIMD_CODECS
+
+// bFast selects the AtlFast* codecs, at whatever level is set
+static void Measure(const char *szName, const std::vector<BYTE>& data, bool bFast)
+{
+	int cbData = (int) data.size();
+	const BYTE *pbData = &data[0];
+
+	std::vector<char> base64(Base64EncodeGetRequiredLength(cbData));
+	std::vector<char> hex(AtlHexEncodeGetRequiredLength(cbData));
+	std::vector<BYTE> decoded(cbData);
+	volatile int nSink = 0;
+
+	static const DWORD c_rgFlags[] = { ATL_BASE64_FLAG_NONE, ATL_BASE64_FLAG_NOCRLF };
+	static const char *c_rgszFlags[] = { "base64", "base64 no CRLF" };
+	double rgdGBps[6];
+	for (int i=0; i<2; i++)
+	{
+		int nEncoded = 0;
+		rgdGBps[2*i] = MeasureGBps(data.size(), [&]()
+		{
+			nEncoded = (int) base64.size();
+			if (bFast)
+				AtlFastBase64Encode(pbData, cbData, &base64[0], &nEncoded, c_rgFlags[i]);
+			else
+				Base64Encode(pbData, cbData, &base64[0], &nEncoded, c_rgFlags[i]);
+			nSink = nEncoded;
+		});
+		rgdGBps[2*i+1] = MeasureGBps(data.size(), [&]()
+		{
+			int nDecoded = cbData;
+			if (bFast)
+				AtlFastBase64Decode(&base64[0], nEncoded, &decoded[0], &nDecoded);
+			else
+				Base64Decode(&base64[0], nEncoded, &decoded[0], &nDecoded);
+			nSink = nDecoded;
+		});
+		if (decoded != data)
+			printf("  %s does not round-trip\n", c_rgszFlags[i]);
+	}
+
+	int nHex = 0;
+	rgdGBps[4] = MeasureGBps(data.size(), [&]()
+	{
+		nHex = (int) hex.size();
+		if (bFast)
+			AtlFastHexEncode(pbData, cbData, &hex[0], &nHex);
+		else
+			AtlHexEncode(pbData, cbData, &hex[0], &nHex);
+		nSink = nHex;
+	});
+	rgdGBps[5] = MeasureGBps(data.size(), [&]()
+	{
+		int nDecoded = cbData;
+		if (bFast)
+			AtlFastHexDecode(&hex[0], nHex, &decoded[0], &nDecoded);
+		else
+			AtlHexDecode(&hex[0], nHex, &decoded[0], &nDecoded);
+		nSink = nDecoded;
+	});
+	if (decoded != data)
+		printf("  hex does not round-trip\n");
+
+	printf("  %-18s %7.2f %7.2f %8.2f %8.2f %7.2f %7.2f\n", szName,
+		rgdGBps[0], rgdGBps[1], rgdGBps[2], rgdGBps[3], rgdGBps[4], rgdGBps[5]);
+}
+
+int main()
+{
+	static const size_t c_rgSizes[] = { 256, 4 * 1024, 64 * 1024, 4 * 1024 * 1024 };
+	for (size_t i=0; i<sizeof(c_rgSizes)/sizeof(c_rgSizes[0]); i++)
+	{
+		std::vector<BYTE> data(c_rgSizes[i]);
+		unsigned nSeed = 3;
+		for (size_t j=0; j<data.size(); j++)
+		{
+			nSeed = nSeed * 1664525 + 1013904223;
+			data[j] = (BYTE) (nSeed >> 24);
+		}
+
+		printf("%u bytes, GB/s of unencoded data (* without line breaks)\n", (unsigned) data.size());
+		printf("  %-18s %7s %7s %8s %8s %7s %7s\n", "", "b64 enc", "b64 dec",
+			"b64 enc*", "b64 dec*", "hex enc", "hex dec");
+		Measure("atlenc.h", data, false);
+
+#ifdef _ATL_SIMD_CODECS
+		int nDetected = AtlGetSimdLevel();
+		for (int nLevel = ATL_SIMD_NONE; nLevel <= nDetected; nLevel++)
+		{
+			char szName[32];
+			snprintf(szName, sizeof(szName), "AtlFast* %s", GetLevelName(nLevel));
+			AtlSetSimdLevel(nLevel);
+			Measure(szName, data, true);
+		}
+		AtlSetSimdLevel(nDetected);
+#else
+		Measure("AtlFast* (no SIMD)", data, true);
+#endif
+	}
+	return 0;
+}
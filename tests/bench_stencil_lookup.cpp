@@ -0,0 +1,118 @@
+// Replacement method lookup cost for stencil parsing.
+//
+// Every replacement tag in a stencil is resolved to an offset in the
+// handler's replacement method map when the stencil is parsed.  This
+// compares CTagReplacerMethodIndex with the linear strcmp scan it
+// replaced, for maps of increasing size.  Each map is looked up with
+// names that hit (spread evenly over the map) and with names that miss,
+// which is what every attribute map entry costs because the basic map is
+// searched first.
+
+#include <atlbase.h>
+#include <atlstencil.h>
+
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct CBenchTarget
+{
+	HTTP_CODE OnTag()
+	{
+		return HTTP_SUCCESS;
+	}
+};
+
+typedef CTagReplacerMethodEntry<CBenchTarget> CBenchEntry;
+
+static const int c_nLookups = 2000000;
+
+// the scan FindReplacementOffset did before the index
+static HTTP_CODE LinearLookup(const CBenchEntry *pMap, LPCSTR szName, size_t cchName, LPDWORD pdwOffset)
+{
+	for (const CBenchEntry *pEntry = pMap; pEntry->szMethodName; pEntry++)
+	{
+		if (strncmp(pEntry->szMethodName, szName, cchName) == 0 &&
+			pEntry->szMethodName[cchName] == '\0' && pEntry->Methods.pfnMethod)
+		{
+			*pdwOffset = (DWORD)(pEntry-pMap);
+			return HTTP_SUCCESS;
+		}
+	}
+	return HTTP_FAIL;
+}
+
+template <class TLookup>
+static double Measure(const std::vector<std::string>& names, TLookup lookup, DWORD *pdwFound)
+{
+	DWORD dwFound = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i=0; i<c_nLookups; i++)
+	{
+		const std::string& strName = names[i % names.size()];
+		DWORD dwOffset = STENCIL_INVALIDOFFSET;
+		if (lookup(strName.c_str(), strName.size(), &dwOffset) == HTTP_SUCCESS)
+			dwFound++;
+	}
+	double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	*pdwFound = dwFound;
+	return dSeconds * 1e9 / c_nLookups;
+}
+
+static void MeasureMap(int nEntries)
+{
+	std::vector<std::string> names;
+	for (int i=0; i<nEntries; i++)
+	{
+		char szName[32];
+		sprintf_s(szName, "OnReplacement%d", i);
+		names.push_back(szName);
+	}
+
+	std::vector<CBenchEntry> map(nEntries+1);
+	for (int i=0; i<nEntries; i++)
+	{
+		map[i].nType = REPLACEMENT_ENTRY_DEFAULT;
+		map[i].szMethodName = names[i].c_str();
+		map[i].Methods.pfnMethod = &CBenchTarget::OnTag;
+		map[i].Methods.pfnParse = NULL;
+	}
+	memset(&map[nEntries], 0, sizeof(CBenchEntry));
+	const CBenchEntry *pMap = &map[0];
+
+	std::vector<std::string> hits;
+	std::vector<std::string> misses;
+	for (int i=0; i<64; i++)
+	{
+		hits.push_back(names[(i * 7919) % nEntries]);
+		char szName[32];
+		sprintf_s(szName, "OnAttribute%d", i);
+		misses.push_back(szName);
+	}
+
+	CTagReplacerMethodIndex<CBenchTarget> index;
+	DWORD dwFound;
+	for (int nPass=0; nPass<2; nPass++)
+	{
+		const std::vector<std::string>& lookups = nPass ? misses : hits;
+		double dLinear = Measure(lookups, [pMap](LPCSTR szName, size_t cchName, LPDWORD pdwOffset)
+			{ return LinearLookup(pMap, szName, cchName, pdwOffset); }, &dwFound);
+		DWORD dwLinearFound = dwFound;
+		double dIndex = Measure(lookups, [&index, pMap](LPCSTR szName, size_t cchName, LPDWORD pdwOffset)
+			{ return index.Lookup(pMap, szName, cchName, pdwOffset); }, &dwFound);
+		if (dwFound != dwLinearFound)
+			printf("  lookup results differ!\n");
+
+		printf("map of %4d, %-6s linear %7.1f ns/lookup  index %6.1f ns/lookup\n",
+			nEntries, nPass ? "misses" : "hits", dLinear, dIndex);
+	}
+}
+
+int main()
+{
+	static const int c_rgSizes[] = { 4, 16, 64, 256, 1024 };
+	for (size_t i=0; i<_countof(c_rgSizes); i++)
+		MeasureMap(c_rgSizes[i]);
+	return 0;
+}
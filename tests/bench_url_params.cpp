@@ -0,0 +1,107 @@
+// Throughput of the URL-encoded data scanner in atlurlparams.h.
+//
+// Splits typical query strings and form bodies into decoded pairs with
+// AtlParseUrlParam, using the vector scan and the scalar one, and with the
+// character loop CHttpRequestParams::Parse used before.  Only the scanning
+// and decoding is measured; Parse also adds every pair to its map.  The
+// data is decoded in place, so each run starts with a fresh copy, whose
+// cost is shown on its own.
+//
+//   bench_url_params
+
+#include "atltest.h"
+#include "atltestenc.h"
+#include <atlsimdenc.h>
+#include <atlurlparams.h>
+#include "atltesturl.h"
+
+#include <chrono>
+#include <string>
+
+using namespace ATL;
+
+static const size_t c_cbPerRun = 64 * 1024 * 1024;
+
+template <class TFunc>
+static double MeasureMBps(size_t cbData, TFunc func)
+{
+	size_t nRuns = c_cbPerRun / cbData + 1;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i=0; i<nRuns; i++)
+		func();
+	double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return (double) cbData * nRuns / dSeconds / 1e6;
+}
+
+template <class TParse>
+static double MeasureParse(const std::string& str, std::vector<char>& buffer, TParse parse, size_t *pnPairs)
+{
+	return MeasureMBps(str.size(), [&]()
+	{
+		memcpy(&buffer[0], str.c_str(), str.size() + 1);
+		LPSTR sz = &buffer[0];
+		size_t nPairs = 0;
+		while (*sz)
+		{
+			LPSTR szName;
+			LPCSTR szValue;
+			sz = parse(sz, &szName, &szValue);
+			nPairs++;
+		}
+		*pnPairs = nPairs;
+	});
+}
+
+static void Measure(const char *szName, const std::string& str)
+{
+	printf("%s: %u bytes\n", szName, (unsigned) str.size());
+
+	std::vector<char> buffer(str.size() + 1);
+	double dMBps = MeasureMBps(str.size(), [&]()
+	{
+		memcpy(&buffer[0], str.c_str(), str.size() + 1);
+	});
+	printf("  %-22s %8.1f MB/s\n", "copy alone", dMBps);
+
+	size_t nPairs = 0;
+	dMBps = MeasureParse(str, buffer, AtlTestParseUrlParam, &nPairs);
+	printf("  %-22s %8.1f MB/s  %zu pairs\n", "by character", dMBps, nPairs);
+
+#ifdef _ATL_SIMD_CODECS
+	int nDetected = AtlGetSimdLevel();
+	AtlSetSimdLevel(ATL_SIMD_NONE);
+	dMBps = MeasureParse(str, buffer, AtlParseUrlParam, &nPairs);
+	printf("  %-22s %8.1f MB/s\n", "AtlParseUrlParam scalar", dMBps);
+	AtlSetSimdLevel(nDetected);
+#endif
+	dMBps = MeasureParse(str, buffer, AtlParseUrlParam, &nPairs);
+	printf("  %-22s %8.1f MB/s\n", "AtlParseUrlParam", dMBps);
+}
+
+static std::string MakeEscaped(size_t cb)
+{
+	std::string str = "comment=";
+	unsigned nSeed = 9;
+	while (str.size() < cb)
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		static const char *s_rgszWords[] = { "caf%C3%A9", "na%C3%AFve", "%22quoted%22", "a%2Fb", "100%25",
+			"one", "two", "three", "%E2%82%AC5" };
+		str += s_rgszWords[(nSeed >> 8) % (sizeof(s_rgszWords)/sizeof(s_rgszWords[0]))];
+		str += '+';
+	}
+	return str;
+}
+
+int main()
+{
+	Measure("query string", "id=1234&name=John+Smith&page=2&sort=date&dir=desc&filter=open");
+	Measure("form, 20 fields", std::string("__VIEWSTATE=dDwtMTA4NzMxMTY0ODs7Pg%3D%3D&") +
+		"first=Jane&last=Doe&email=jane.doe%40example.com&phone=555-0100&street=1+Main+St&city=Springfield&"
+		"state=IL&zip=62701&country=US&company=Contoso&title=Buyer&dept=Purchasing&ref=newsletter&"
+		"agree=on&lang=en-US&tz=-360&source=web&campaign=spring&submit=Send");
+	Measure("6 KB value", "text=" + std::string(6 * 1024, 'x') + "&save=1");
+	Measure("256 KB value", "data=" + std::string(256 * 1024, 'x'));
+	Measure("6 KB escaped value", MakeEscaped(6 * 1024));
+	return 0;
+}
@@ -0,0 +1,213 @@
+// Throughput of the SOAP message parsers.
+//
+// Tokenizes generated SOAP requests of several sizes with
+// CAtlXmlTokenizer (atlxmltok.h).  The tokenizer decodes the document in
+// place, so each run starts with a fresh copy; the cost of that copy is
+// shown on its own.  On Windows the same documents are also parsed through
+// the SAX interface, by CAtlSoapXmlReader and by the MSXML reader named by
+// ATLS_SAXXMLREADER_CLSID, with a content handler that does nothing.
+//
+//   bench_xml_tokenizer [file...]
+
+#include "atltest.h"
+#include <atlxmltok.h>
+
+#ifdef _WIN32
+#include <atlisapi.h>
+#endif
+
+#include <chrono>
+#include <string>
+
+using namespace ATL;
+
+static const size_t c_cbPerRun = 64 * 1024 * 1024;
+
+template <class TFunc>
+static double MeasureMBps(size_t cbData, TFunc func)
+{
+	size_t nRuns = c_cbPerRun / cbData + 1;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i=0; i<nRuns; i++)
+		func();
+	double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return (double) cbData * nRuns / dSeconds / 1e6;
+}
+
+#ifdef _WIN32
+
+// A content handler that ignores everything, so that only the reader is
+// measured
+class CNullContentHandler : public ISAXContentHandler
+{
+public:
+	HRESULT __stdcall QueryInterface(REFIID riid, void **ppv)
+	{
+		if (riid == __uuidof(IUnknown) || riid == __uuidof(ISAXContentHandler))
+		{
+			*ppv = static_cast<ISAXContentHandler *>(this);
+			return S_OK;
+		}
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+	ULONG __stdcall AddRef() { return 1; }
+	ULONG __stdcall Release() { return 1; }
+
+	HRESULT __stdcall putDocumentLocator(ISAXLocator *) { return S_OK; }
+	HRESULT __stdcall startDocument() { return S_OK; }
+	HRESULT __stdcall endDocument() { return S_OK; }
+	HRESULT __stdcall startPrefixMapping(const wchar_t *, int, const wchar_t *, int) { return S_OK; }
+	HRESULT __stdcall endPrefixMapping(const wchar_t *, int) { return S_OK; }
+	HRESULT __stdcall startElement(const wchar_t *, int, const wchar_t *, int, const wchar_t *, int,
+		ISAXAttributes *) { return S_OK; }
+	HRESULT __stdcall endElement(const wchar_t *, int, const wchar_t *, int, const wchar_t *, int) { return S_OK; }
+	HRESULT __stdcall characters(const wchar_t *, int) { return S_OK; }
+	HRESULT __stdcall ignorableWhitespace(const wchar_t *, int) { return S_OK; }
+	HRESULT __stdcall processingInstruction(const wchar_t *, int, const wchar_t *, int) { return S_OK; }
+	HRESULT __stdcall skippedEntity(const wchar_t *, int) { return S_OK; }
+};
+
+static void MeasureSax(const char *szName, ISAXXMLReader *pReader, const std::string& strDoc)
+{
+	CComPtr<IStream> spStream;
+	if (FAILED(CreateStreamOnHGlobal(NULL, TRUE, &spStream)) ||
+		FAILED(spStream->Write(strDoc.data(), (ULONG) strDoc.size(), NULL)))
+	{
+		printf("  %-18s cannot create the stream\n", szName);
+		return;
+	}
+
+	CNullContentHandler handler;
+	pReader->putContentHandler(&handler);
+	HRESULT hr = S_OK;
+	double dMBps = MeasureMBps(strDoc.size(), [&]()
+	{
+		LARGE_INTEGER liZero = { 0 };
+		spStream->Seek(liZero, STREAM_SEEK_SET, NULL);
+		VARIANT varInput;
+		V_VT(&varInput) = VT_UNKNOWN;
+		V_UNKNOWN(&varInput) = spStream;
+		if (SUCCEEDED(hr))
+			hr = pReader->parse(varInput);
+	});
+	pReader->putContentHandler(NULL);
+	if (FAILED(hr))
+		printf("  %-18s parse failed: 0x%08x\n", szName, (unsigned) hr);
+	else
+		printf("  %-18s %8.1f MB/s\n", szName, dMBps);
+}
+
+#endif // _WIN32
+
+static void Measure(const char *szName, const std::string& strDoc)
+{
+	printf("%s: %u bytes\n", szName, (unsigned) strDoc.size());
+
+	std::vector<char> doc(strDoc.size() + 1);
+	double dMBps = MeasureMBps(strDoc.size(), [&]()
+	{
+		memcpy(&doc[0], strDoc.data(), strDoc.size());
+	});
+	printf("  %-18s %8.1f MB/s\n", "copy alone", dMBps);
+
+	CAtlXmlTokenizer tokenizer;
+	size_t nTokens = 0;
+	HRESULT hr = S_OK;
+	dMBps = MeasureMBps(strDoc.size(), [&]()
+	{
+		memcpy(&doc[0], strDoc.data(), strDoc.size());
+		if (SUCCEEDED(hr))
+			hr = tokenizer.Initialize(&doc[0], strDoc.size());
+		int nToken = 0;
+		nTokens = 0;
+		while (SUCCEEDED(hr) && nToken != ATL_XML_END_DOCUMENT)
+		{
+			hr = tokenizer.Next(&nToken);
+			nTokens++;
+		}
+	});
+	if (FAILED(hr))
+	{
+		printf("  %-18s %s\n", "CAtlXmlTokenizer", tokenizer.GetErrorMessage());
+		return;
+	}
+	printf("  %-18s %8.1f MB/s  %6.1f ns/token\n", "CAtlXmlTokenizer", dMBps,
+		1e3 * strDoc.size() / dMBps / nTokens);
+
+#ifdef _WIN32
+	CComPtr<ISAXXMLReader> spReader;
+	if (SUCCEEDED(AtlCreateSoapXmlReader(&spReader)))
+		MeasureSax("CAtlSoapXmlReader", spReader, strDoc);
+	spReader.Release();
+	if (SUCCEEDED(spReader.CoCreateInstance(ATLS_SAXXMLREADER_CLSID, NULL, CLSCTX_INPROC_SERVER)))
+		MeasureSax("MSXML SAX", spReader, strDoc);
+	else
+		printf("  %-18s not available\n", "MSXML SAX");
+#endif
+}
+
+// A request carrying an array of nItems structs, as the SOAP client code
+// generated for a typical service would send it
+static std::string MakeRequest(int nItems)
+{
+	std::string str =
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+		"<soap:Envelope xmlns:soap=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+		"xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xmlns:xsd=\"http://www.w3.org/2001/XMLSchema\">"
+		"<soap:Body><snp:SubmitOrders xmlns:snp=\"urn:Orders\">"
+		"<orders soapenc:arrayType=\"snp:Order[]\" xmlns:soapenc=\"http://schemas.xmlsoap.org/soap/encoding/\">";
+	unsigned nSeed = 5;
+	for (int i = 0; i < nItems; i++)
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		char szItem[512];
+		snprintf(szItem, sizeof(szItem),
+			"<Order><id xsi:type=\"xsd:int\">%d</id><customer>Smith &amp; Sons %u</customer>"
+			"<amount xsi:type=\"xsd:double\">%u.%02u</amount><shipped>%s</shipped>"
+			"<note>Leave at the back door &lt;gate %u&gt;</note></Order>",
+			i, nSeed % 1000, (nSeed >> 8) % 10000, (nSeed >> 4) % 100, (nSeed & 1) ? "true" : "false",
+			(nSeed >> 12) % 10);
+		str += szItem;
+	}
+	str += "</orders></snp:SubmitOrders></soap:Body></soap:Envelope>";
+	return str;
+}
+
+int main(int argc, char **argv)
+{
+#ifdef _WIN32
+	CoInitializeEx(NULL, COINIT_MULTITHREADED);
+#endif
+
+	if (argc > 1)
+	{
+		for (int i=1; i<argc; i++)
+		{
+			FILE *pFile = fopen(argv[i], "rb");
+			if (!pFile)
+			{
+				printf("cannot open %s\n", argv[i]);
+				return 1;
+			}
+			std::string strDoc;
+			char rgchBuffer[65536];
+			size_t cbRead;
+			while ((cbRead = fread(rgchBuffer, 1, sizeof(rgchBuffer), pFile)) > 0)
+				strDoc.append(rgchBuffer, cbRead);
+			fclose(pFile);
+			if (!strDoc.empty())
+				Measure(argv[i], strDoc);
+		}
+		return 0;
+	}
+
+	static const int c_rgItems[] = { 1, 16, 256, 4096 };
+	for (size_t i=0; i<sizeof(c_rgItems)/sizeof(c_rgItems[0]); i++)
+	{
+		char szName[32];
+		snprintf(szName, sizeof(szName), "%d orders", c_rgItems[i]);
+		Measure(szName, MakeRequest(c_rgItems[i]));
+	}
+	return 0;
+}
@@ -0,0 +1,214 @@
+// Stress test for the ATLSRV_INIT_USEASYNC_EX handshake in atlasyncstate.h.
+//
+// Each simulated request runs a chain of HTTP_SUCCESS_ASYNC_NOFLUSH style
+// rounds: a worker thread dispatches the handler, the handler starts an I/O
+// that a completion thread finishes, and the completion queues the next
+// round back to the workers.  The dispatch and completion sides follow
+// DispatchStencilCall and AsyncCallback.  Every round checks that its
+// completion is processed exactly once, never while a handler for the same
+// request is running, and with the result the handler's I/O produced.
+//
+// The rounds alternate between forcing the completion to arrive while the
+// handler still runs, forcing it to arrive after the handler has returned,
+// and letting the two race.
+
+#include "atltest.h"
+#include <atlasyncstate.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace ATL;
+
+static const int c_nRequests = 64;
+static const int c_nRounds = 3000;
+static const int c_nWorkers = 4;
+static const int c_nCompletionThreads = 4;
+
+struct CTestRequest
+{
+	volatile LONG lAsyncState;
+	DWORD cbAsyncIO;				// completion left for the dispatcher
+	std::atomic<int> nInHandler;
+	std::atomic<int> nInCompletion;
+	int nRound;						// only touched by the thread that owns the request
+	int nCompleted;
+};
+
+template <class T>
+class CTestQueue
+{
+	std::mutex m_lock;
+	std::condition_variable m_cv;
+	std::deque<T> m_items;
+
+public:
+	void Push(T item)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_items.push_back(item);
+		}
+		m_cv.notify_one();
+	}
+
+	T Pop()
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		while (m_items.empty())
+			m_cv.wait(lock);
+		T item = m_items.front();
+		m_items.pop_front();
+		return item;
+	}
+};
+
+struct CCompletion
+{
+	CTestRequest *pRequest;
+	DWORD cbIO;
+};
+
+static CTestQueue<CTestRequest *> g_workQueue;
+static CTestQueue<CCompletion> g_completionQueue;
+static std::atomic<int> g_nDone(0);
+static std::atomic<int> g_nLeftForDispatcher(0);
+static std::atomic<int> g_nProcessedDirectly(0);
+
+enum { ROUND_RACE, ROUND_WHILE_RUNNING, ROUND_AFTER_RETURN };
+
+static int RoundKind(int nRound)
+{
+	return nRound % 3;
+}
+
+// ProcessAsyncCompletion: runs the completion and queues the continuation
+static void ProcessCompletion(CTestRequest *pRequest, DWORD cbIO)
+{
+	ATLTEST_CHECK(pRequest->nInHandler.load() == 0);
+	ATLTEST_CHECK(pRequest->nInCompletion.fetch_add(1) == 0);
+	ATLTEST_CHECK(cbIO == (DWORD)pRequest->nRound);
+	pRequest->nCompleted++;
+	pRequest->nInCompletion.fetch_sub(1);
+
+	if (pRequest->nRound < c_nRounds)
+		g_workQueue.Push(pRequest);
+	else
+		g_nDone++;
+}
+
+// DispatchStencilCall
+static void Dispatch(CTestRequest *pRequest)
+{
+	AtlAsyncHandlerStart(&pRequest->lAsyncState);
+
+	// HandleRequest: start the I/O for this round
+	ATLTEST_CHECK(pRequest->nInHandler.fetch_add(1) == 0);
+	ATLTEST_CHECK(pRequest->nCompleted == pRequest->nRound);
+	int nRound = ++pRequest->nRound;
+	CCompletion completion = { pRequest, (DWORD)nRound };
+	g_completionQueue.Push(completion);
+
+	if (RoundKind(nRound) == ROUND_WHILE_RUNNING)
+	{
+		while (pRequest->lAsyncState != ATLSRV_ASYNC_PENDING)
+			std::this_thread::yield();
+	}
+	pRequest->nInHandler.fetch_sub(1);
+
+	if (AtlAsyncHandlerDone(&pRequest->lAsyncState))
+	{
+		g_nLeftForDispatcher++;
+		ProcessCompletion(pRequest, pRequest->cbAsyncIO);
+	}
+}
+
+static void Worker()
+{
+	for (;;)
+	{
+		CTestRequest *pRequest = g_workQueue.Pop();
+		if (pRequest == NULL)
+			return;
+		Dispatch(pRequest);
+	}
+}
+
+// AsyncCallback
+static void CompletionThread()
+{
+	for (;;)
+	{
+		CCompletion completion = g_completionQueue.Pop();
+		CTestRequest *pRequest = completion.pRequest;
+		if (pRequest == NULL)
+			return;
+
+		if (RoundKind((int)completion.cbIO) == ROUND_AFTER_RETURN)
+		{
+			while (pRequest->lAsyncState != ATLSRV_ASYNC_IDLE)
+				std::this_thread::yield();
+		}
+
+		pRequest->cbAsyncIO = completion.cbIO;
+		if (AtlAsyncCompletionArrived(&pRequest->lAsyncState))
+			continue;
+
+		g_nProcessedDirectly++;
+		ProcessCompletion(pRequest, completion.cbIO);
+	}
+}
+
+int main()
+{
+	std::vector<CTestRequest> requests(c_nRequests);
+	for (size_t i=0; i<requests.size(); i++)
+	{
+		requests[i].lAsyncState = ATLSRV_ASYNC_NONE;
+		requests[i].cbAsyncIO = 0;
+		requests[i].nInHandler = 0;
+		requests[i].nInCompletion = 0;
+		requests[i].nRound = 0;
+		requests[i].nCompleted = 0;
+	}
+
+	std::vector<std::thread> threads;
+	for (int i=0; i<c_nWorkers; i++)
+		threads.push_back(std::thread(Worker));
+	for (int i=0; i<c_nCompletionThreads; i++)
+		threads.push_back(std::thread(CompletionThread));
+
+	for (size_t i=0; i<requests.size(); i++)
+		g_workQueue.Push(&requests[i]);
+
+	while (g_nDone.load() < c_nRequests)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	for (int i=0; i<c_nWorkers; i++)
+		g_workQueue.Push(NULL);
+	for (int i=0; i<c_nCompletionThreads; i++)
+	{
+		CCompletion stop = { NULL, 0 };
+		g_completionQueue.Push(stop);
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+
+	for (size_t i=0; i<requests.size(); i++)
+	{
+		ATLTEST_CHECK(requests[i].nCompleted == c_nRounds);
+		ATLTEST_CHECK(requests[i].lAsyncState == ATLSRV_ASYNC_IDLE);
+	}
+
+	// both ways a completion can be processed were taken
+	ATLTEST_CHECK(g_nLeftForDispatcher.load() >= c_nRequests * (c_nRounds / 3));
+	ATLTEST_CHECK(g_nProcessedDirectly.load() >= c_nRequests * (c_nRounds / 3));
+	printf("%d completions left for the dispatcher, %d processed directly\n",
+		g_nLeftForDispatcher.load(), g_nProcessedDirectly.load());
+
+	return AtlTestResult("test_async_handshake");
+}
@@ -0,0 +1,252 @@
+// Tests for the flusher policies in atlcacheflush.h.
+//
+// Flush() below walks a flusher the same way CMemoryCacheBase::FlushEntries
+// does: it asks for the next item before removing the current one, and
+// deletes every item it removes.  Each item the flusher offers is checked
+// against the set of live items before it is touched, so a flusher that
+// hands back an item that has already been removed fails the test instead
+// of corrupting memory.
+
+#include "atltest.h"
+#include <atlcacheflush.h>
+
+#include <set>
+#include <vector>
+
+using namespace ATL;
+
+struct CTestNode : public CFlusherCacheData
+{
+	CTestNode(DWORD nHash) : dwRef(0)
+	{
+		nKeyHash = nHash;
+	}
+
+	DWORD dwRef;
+};
+
+typedef std::set<CTestNode *> CLiveSet;
+
+template <class Flusher>
+static CTestNode * AddNode(Flusher &flusher, CLiveSet &live, DWORD nHash)
+{
+	CTestNode *pNode = new CTestNode(nHash);
+	flusher.Add(pNode);
+	live.insert(pNode);
+	return pNode;
+}
+
+template <class Flusher>
+static size_t Flush(Flusher &flusher, CLiveSet &live, size_t nTarget)
+{
+	size_t nRemoved = 0;
+	CTestNode *pNode = static_cast<CTestNode *>(flusher.GetStart());
+	while (pNode && live.size() > nTarget)
+	{
+		ATLTEST_CHECK(live.count(pNode) == 1);
+		if (live.count(pNode) == 0)
+			break;
+
+		CTestNode *pNext = static_cast<CTestNode *>(flusher.GetNext(pNode));
+		if (pNode->dwRef == 0)
+		{
+			flusher.Remove(pNode);
+			live.erase(pNode);
+			delete pNode;
+			nRemoved++;
+		}
+		pNode = pNext;
+	}
+	return nRemoved;
+}
+
+template <class Flusher>
+static void RemoveAll(Flusher &flusher, CLiveSet &live)
+{
+	for (CLiveSet::iterator it = live.begin(); it != live.end(); ++it)
+	{
+		flusher.Remove(*it);
+		delete *it;
+	}
+	live.clear();
+}
+
+// The 1 and 2 entry cases, with every combination of accessed and
+// referenced entries
+template <class Flusher>
+static void TestSmallFlushes()
+{
+	for (int nAccess=0; nAccess<2; nAccess++)
+	{
+		Flusher flusher;
+		CLiveSet live;
+		CTestNode *pA = AddNode(flusher, live, 1);
+		if (nAccess)
+			flusher.Access(pA);
+		ATLTEST_CHECK(Flush(flusher, live, 0) == 1);
+		ATLTEST_CHECK(live.empty());
+		ATLTEST_CHECK(flusher.GetStart() == NULL);
+	}
+
+	{
+		Flusher flusher;
+		CLiveSet live;
+		CTestNode *pA = AddNode(flusher, live, 1);
+		pA->dwRef = 1;
+		ATLTEST_CHECK(Flush(flusher, live, 0) == 0);
+		ATLTEST_CHECK(live.size() == 1);
+		RemoveAll(flusher, live);
+	}
+
+	for (int nAccess=0; nAccess<4; nAccess++)
+	{
+		for (int nTarget=0; nTarget<2; nTarget++)
+		{
+			Flusher flusher;
+			CLiveSet live;
+			CTestNode *pA = AddNode(flusher, live, 1);
+			CTestNode *pB = AddNode(flusher, live, 2);
+			if (nAccess & 1)
+				flusher.Access(pA);
+			if (nAccess & 2)
+				flusher.Access(pB);
+			ATLTEST_CHECK(Flush(flusher, live, nTarget) == 2 - (size_t)nTarget);
+			ATLTEST_CHECK(live.size() == (size_t)nTarget);
+			RemoveAll(flusher, live);
+		}
+
+		for (int nRef=0; nRef<2; nRef++)
+		{
+			Flusher flusher;
+			CLiveSet live;
+			CTestNode *pA = AddNode(flusher, live, 1);
+			CTestNode *pB = AddNode(flusher, live, 2);
+			if (nAccess & 1)
+				flusher.Access(pA);
+			if (nAccess & 2)
+				flusher.Access(pB);
+			CTestNode *pHeld = nRef ? pB : pA;
+			pHeld->dwRef = 1;
+			ATLTEST_CHECK(Flush(flusher, live, 0) == 1);
+			ATLTEST_CHECK(live.size() == 1 && live.count(pHeld) == 1);
+			RemoveAll(flusher, live);
+		}
+	}
+}
+
+// An accessed item gets a second chance
+static void TestClockOrder()
+{
+	CClockFlusher flusher;
+	CLiveSet live;
+	CTestNode *pA = AddNode(flusher, live, 1);
+	CTestNode *pB = AddNode(flusher, live, 2);
+	AddNode(flusher, live, 3);
+	flusher.Access(pA);
+
+	ATLTEST_CHECK(Flush(flusher, live, 2) == 1);
+	ATLTEST_CHECK(live.count(pA) == 1 && live.count(pB) == 0);
+	RemoveAll(flusher, live);
+}
+
+// The oldest probation items (the window) are offered least frequently
+// seen first, oldest first among equals; the rest of the probation segment
+// follows in age order and the protected segment comes last
+template <DWORD t_nWindow>
+static void TestTinyLFUOrder()
+{
+	typedef CTinyLFUFlusher<80, ATL_CACHE_SKETCH_WIDTH, t_nWindow> Flusher;
+
+	{
+		// the sketch remembers a popular key that was flushed and came back
+		Flusher flusher;
+		CLiveSet live;
+		CTestNode *pOld = AddNode(flusher, live, 100);
+		for (int i=0; i<5; i++)
+			flusher.Access(pOld);
+		flusher.Remove(pOld);
+		live.erase(pOld);
+		delete pOld;
+
+		CTestNode *pA = AddNode(flusher, live, 1);
+		CTestNode *pBack = AddNode(flusher, live, 100);
+		CTestNode *pC = AddNode(flusher, live, 3);
+		ATLTEST_CHECK(Flush(flusher, live, 1) == 2);
+		ATLTEST_CHECK(live.count(pBack) == 1 && live.count(pA) == 0 && live.count(pC) == 0);
+		RemoveAll(flusher, live);
+	}
+
+	{
+		Flusher flusher;
+		CLiveSet live;
+		std::vector<CTestNode *> nodes;
+		unsigned nSeed = 12345;
+		for (DWORD i=0; i<300; i++)
+			nodes.push_back(AddNode(flusher, live, i * 2654435761u));
+
+		for (int i=0; i<2000; i++)
+		{
+			nSeed = nSeed * 1664525 + 1013904223;
+			flusher.m_sketch.Increment(nodes[(nSeed >> 8) % nodes.size()]->nKeyHash);
+		}
+		for (size_t i=0; i<nodes.size(); i+=7)
+			flusher.Access(nodes[i]);
+
+		std::vector<CTestNode *> order;
+		for (CFlusherCacheData *p = flusher.GetStart(); p; p = flusher.GetNext(p))
+			order.push_back(static_cast<CTestNode *>(p));
+		ATLTEST_CHECK(order.size() == nodes.size());
+		ATLTEST_CHECK(std::set<CTestNode *>(order.begin(), order.end()).size() == nodes.size());
+
+		std::vector<CTestNode *> probation;
+		for (CFlusherCacheData *p = flusher.m_probation.GetStart(); p; p = flusher.m_probation.GetNext(p))
+			probation.push_back(static_cast<CTestNode *>(p));
+		ATLTEST_CHECK(probation.size() == flusher.m_nProbation);
+
+		size_t nWindow = probation.size() < t_nWindow ? probation.size() : t_nWindow;
+		std::set<CTestNode *> window(probation.begin(), probation.begin() + nWindow);
+		size_t nLast = 0;
+		for (size_t i=0; i<order.size(); i++)
+		{
+			if (i < nWindow)
+			{
+				ATLTEST_CHECK(window.count(order[i]) == 1);
+				size_t nPos = 0;
+				while (probation[nPos] != order[i])
+					nPos++;
+				if (i > 0)
+				{
+					DWORD nPrev = flusher.m_sketch.Estimate(order[i-1]->nKeyHash);
+					DWORD nCur = flusher.m_sketch.Estimate(order[i]->nKeyHash);
+					ATLTEST_CHECK(nPrev <= nCur);
+
+					// stable: equal estimates keep the probation order
+					if (nPrev == nCur)
+						ATLTEST_CHECK(nPos > nLast);
+				}
+				nLast = nPos;
+			}
+			else if (i < probation.size())
+				ATLTEST_CHECK(order[i] == probation[i]);
+			else
+				ATLTEST_CHECK(order[i]->dwAccessed == Flusher::SEGMENT_PROTECTED);
+		}
+
+		ATLTEST_CHECK(Flush(flusher, live, 10) == nodes.size() - 10);
+		RemoveAll(flusher, live);
+	}
+}
+
+int main()
+{
+	TestSmallFlushes<COldFlusher>();
+	TestSmallFlushes<CLRUFlusher>();
+	TestSmallFlushes<CLOUFlusher>();
+	TestSmallFlushes<CClockFlusher>();
+	TestSmallFlushes<CTinyLFUFlusher<> >();
+	TestClockOrder();
+	TestTinyLFUOrder<4>();
+	TestTinyLFUOrder<ATL_CACHE_TINYLFU_WINDOW>();
+	TestTinyLFUOrder<1024>();
+	return AtlTestResult("test_cache_flushers");
+}
@@ -0,0 +1,331 @@
+// Tests for the timing wheel in atlcachewheel.h.
+//
+// CTestWheel drives the wheel with a clock the test controls.  After every
+// Advance the due list must hold exactly the items whose expiration tick
+// has elapsed, and every other item must sit in a slot that the wheel will
+// still reach.  The cases cover expiry on both sides of a tick boundary,
+// cascading from each level and from the overflow slot, long gaps between
+// culls, and items removed before they expire.
+
+#include "atltest.h"
+#include <atlcachewheel.h>
+
+#include <iterator>
+#include <set>
+#include <vector>
+
+using namespace ATL;
+
+struct CTestItem
+{
+	CTestItem(ULONGLONG nExpire) :
+		pNext(NULL), pPrev(NULL), nWheelSlot(0xFFFFFFFF), nExpireTime(nExpire)
+	{
+	}
+
+	CTestItem *pNext;
+	CTestItem *pPrev;
+	DWORD nWheelSlot;
+	ULONGLONG nExpireTime;
+};
+
+template <ULONGLONG t_nTick>
+class CTestWheel :
+	public CAtlTimingWheel<CTestWheel<t_nTick>, CTestItem, t_nTick>
+{
+public:
+	typedef CAtlTimingWheel<CTestWheel<t_nTick>, CTestItem, t_nTick> baseWheel;
+
+	static ULONGLONG GetExpireTime(const CTestItem *pItem)
+	{
+		return pItem->nExpireTime;
+	}
+
+	// Takes every due item off the wheel, the way the cache culls
+	std::set<CTestItem *> DrainDue()
+	{
+		std::set<CTestItem *> due;
+		while (CTestItem *pItem = baseWheel::GetExpired())
+		{
+			ATLTEST_CHECK(pItem->nWheelSlot == baseWheel::SLOT_DUE);
+			if (!due.insert(pItem).second)
+				break;
+			baseWheel::Remove(pItem);
+		}
+		return due;
+	}
+
+	// Checks that the slot lists are well formed and agree with nWheelSlot
+	size_t CheckSlots()
+	{
+		size_t nItems = 0;
+		for (DWORD nSlot=0; nSlot<baseWheel::SLOT_COUNT; nSlot++)
+		{
+			CTestItem *pPrev = NULL;
+			for (CTestItem *pItem = this->m_rgSlots[nSlot]; pItem; pItem = pItem->pNext)
+			{
+				ATLTEST_CHECK(pItem->nWheelSlot == nSlot);
+				ATLTEST_CHECK(pItem->pPrev == pPrev);
+				pPrev = pItem;
+				nItems++;
+			}
+		}
+		return nItems;
+	}
+};
+
+static unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1664525 + 1013904223;
+	return g_nSeed >> 8;
+}
+
+static ULONGLONG Random64()
+{
+	return ((ULONGLONG) Random() << 24) ^ Random();
+}
+
+// Adds the items, advances to each time in turn and checks what falls due.
+template <ULONGLONG t_nTick>
+static void CheckAdvance(ULONGLONG nStart, const std::vector<ULONGLONG>& expires, const std::vector<ULONGLONG>& times)
+{
+	CTestWheel<t_nTick> wheel;
+	wheel.SetCurrentTime(nStart);
+
+	std::vector<CTestItem *> items;
+	std::set<CTestItem *> live;
+	for (size_t i=0; i<expires.size(); i++)
+	{
+		items.push_back(new CTestItem(expires[i]));
+		wheel.Insert(items.back());
+		live.insert(items.back());
+	}
+
+	for (size_t t=0; t<times.size(); t++)
+	{
+		wheel.Advance(times[t]);
+		ULONGLONG nNowTick = times[t] / t_nTick;
+		std::set<CTestItem *> due = wheel.DrainDue();
+
+		std::set<CTestItem *> expected;
+		for (std::set<CTestItem *>::iterator it = live.begin(); it != live.end(); ++it)
+		{
+			if ((*it)->nExpireTime != 0 && (*it)->nExpireTime / t_nTick < nNowTick)
+				expected.insert(*it);
+		}
+		if (due != expected)
+			printf("at %llu: %u items due, %u expected\n", (unsigned long long) times[t],
+				(unsigned) due.size(), (unsigned) expected.size());
+		ATLTEST_CHECK(due == expected);
+		for (std::set<CTestItem *>::iterator it = due.begin(); it != due.end(); ++it)
+			live.erase(*it);
+
+		size_t nNever = 0;
+		for (std::set<CTestItem *>::iterator it = live.begin(); it != live.end(); ++it)
+			nNever += (*it)->nExpireTime == 0;
+		ATLTEST_CHECK(wheel.CheckSlots() == live.size() - nNever);
+	}
+
+	for (size_t i=0; i<items.size(); i++)
+		delete items[i];
+}
+
+static void TestTickBoundaries()
+{
+	// with a tick of 10, an item is due once the tick holding its time has
+	// passed: 19 is due at 20 but not at 19, 20 only at 30
+	std::vector<ULONGLONG> expires;
+	expires.push_back(1009);
+	expires.push_back(1010);
+	expires.push_back(1019);
+	expires.push_back(1020);
+	expires.push_back(1000);
+	expires.push_back(999);
+	expires.push_back(0);	// never
+	std::vector<ULONGLONG> times;
+	for (ULONGLONG n = 1000; n < 1040; n++)
+		times.push_back(n);
+	CheckAdvance<10>(1000, expires, times);
+
+	CTestWheel<10> wheel;
+	wheel.SetCurrentTime(1000);
+	CTestItem a(1019);
+	wheel.Insert(&a);
+	wheel.Advance(1019);
+	ATLTEST_CHECK(wheel.GetExpired() == NULL);
+	wheel.Advance(1020);
+	ATLTEST_CHECK(wheel.GetExpired() == &a);
+
+	// an item committed in the past is due right away
+	CTestItem b(500);
+	wheel.Insert(&b);
+	ATLTEST_CHECK(b.nWheelSlot == CTestWheel<10>::SLOT_DUE);
+}
+
+static void TestCascade()
+{
+	// one item at each level, and around each level boundary, advancing one
+	// tick at a time so that every cascade happens
+	ULONGLONG nStart = 100;
+	std::vector<ULONGLONG> expires;
+	for (int nLevel=0; nLevel<=2; nLevel++)
+	{
+		ULONGLONG nSpan = (ULONGLONG) 1 << (ATL_CACHE_WHEEL_BITS * (nLevel+1));
+		ULONGLONG rgDeltas[] = { nSpan - 1, nSpan, nSpan + 1, nSpan / 2, nSpan - 64 + 1 };
+		for (size_t i=0; i<sizeof(rgDeltas)/sizeof(rgDeltas[0]); i++)
+			expires.push_back(nStart + rgDeltas[i]);
+	}
+	// the same slot index as the current tick, a full turn of level 1 ahead
+	expires.push_back(nStart + 4096 - 1);
+	std::vector<ULONGLONG> times;
+	for (ULONGLONG n = nStart; n <= nStart + 300000; n += 1 + (n > nStart + 5000) * 37)
+		times.push_back(n);
+	CheckAdvance<1>(nStart, expires, times);
+}
+
+static void TestOverflow()
+{
+	// items beyond the top level wait in the overflow slot, which cascades
+	// every 2^24 ticks; culls 4000 ticks apart keep Advance on the per-tick
+	// path, so the overflow cascade is what brings them down
+	ULONGLONG nTop = (ULONGLONG) 1 << (ATL_CACHE_WHEEL_BITS * ATL_CACHE_WHEEL_LEVELS);
+	std::vector<ULONGLONG> expires;
+	expires.push_back(nTop + 5);
+	expires.push_back(nTop * 2 + 3);
+	expires.push_back(nTop * 3 - 1);
+	expires.push_back(nTop - 1);
+	std::vector<ULONGLONG> times;
+	for (ULONGLONG n = 1; n <= nTop * 3 + 10; n += 4000)
+		times.push_back(n);
+	times.push_back(nTop * 3 + 10);
+	CheckAdvance<1>(1, expires, times);
+}
+
+static void TestLongGap()
+{
+	// more than 64*64 ticks between culls places every item again
+	std::vector<ULONGLONG> expires;
+	for (int i=0; i<2000; i++)
+		expires.push_back(1 + Random64() % 100000000);
+	std::vector<ULONGLONG> times;
+	times.push_back(50000);
+	times.push_back(50001);
+	times.push_back(3000000);
+	times.push_back(3004000);
+	times.push_back(3004001);
+	times.push_back(60000000);
+	times.push_back(200000000);
+	CheckAdvance<1>(1, expires, times);
+}
+
+static void TestRemove()
+{
+	CTestWheel<1> wheel;
+	wheel.SetCurrentTime(1000);
+
+	// removed from each level, from the overflow slot, from the due list,
+	// from the middle, head and tail of a slot, and never inserted
+	std::vector<CTestItem *> items;
+	ULONGLONG rgExpires[] = { 1001, 1001, 1001, 1100, 6000, 300000, 20000000, 999, 0 };
+	for (size_t i=0; i<sizeof(rgExpires)/sizeof(rgExpires[0]); i++)
+	{
+		items.push_back(new CTestItem(rgExpires[i]));
+		wheel.Insert(items.back());
+	}
+	CTestItem never(5000);
+	wheel.Remove(&never);
+
+	wheel.Remove(items[1]);		// middle of the slot holding 1001
+	wheel.Remove(items[2]);		// head
+	wheel.Remove(items[0]);		// and the last one
+	for (size_t i=3; i<items.size(); i++)
+	{
+		wheel.Remove(items[i]);
+		ATLTEST_CHECK(items[i]->nWheelSlot == CTestWheel<1>::SLOT_NONE);
+		ATLTEST_CHECK(items[i]->pNext == NULL && items[i]->pPrev == NULL);
+	}
+	ATLTEST_CHECK(wheel.CheckSlots() == 0);
+
+	// nothing that was removed comes due later
+	wheel.Advance(1002);
+	wheel.Advance(1000000000);
+	ATLTEST_CHECK(wheel.GetExpired() == NULL);
+	for (size_t i=0; i<items.size(); i++)
+		delete items[i];
+}
+
+// Random inserts, removes and advances against a plain list of items
+static void TestRandom()
+{
+	for (int nRun=0; nRun<20; nRun++)
+	{
+		CTestWheel<7> wheel;
+		ULONGLONG nNow = Random64() % 1000000;
+		wheel.SetCurrentTime(nNow);
+		std::set<CTestItem *> live;
+		std::vector<CTestItem *> all;
+
+		for (int nStep=0; nStep<3000; nStep++)
+		{
+			unsigned nOp = Random() % 10;
+			if (nOp < 5)
+			{
+				static const ULONGLONG c_rgRanges[] = { 50, 5000, 500000, 50000000, 5000000000ULL };
+				ULONGLONG nExpire = nNow + Random64() % c_rgRanges[Random() % 5];
+				if (Random() % 20 == 0)
+					nExpire = 0;
+				else if (Random() % 20 == 0 && nNow > 100)
+					nExpire = nNow - Random() % 100;
+				CTestItem *pItem = new CTestItem(nExpire);
+				all.push_back(pItem);
+				wheel.Insert(pItem);
+				live.insert(pItem);
+			}
+			else if (nOp < 7 && !live.empty())
+			{
+				std::set<CTestItem *>::iterator it = live.begin();
+				std::advance(it, Random() % live.size());
+				wheel.Remove(*it);
+				ATLTEST_CHECK((*it)->nWheelSlot == CTestWheel<7>::SLOT_NONE);
+				live.erase(it);
+			}
+			else
+			{
+				static const ULONGLONG c_rgSteps[] = { 3, 70, 3000, 40000, 9000000 };
+				nNow += Random64() % c_rgSteps[Random() % 5];
+				wheel.Advance(nNow);
+				std::set<CTestItem *> due = wheel.DrainDue();
+				std::set<CTestItem *> expected;
+				for (std::set<CTestItem *>::iterator it = live.begin(); it != live.end(); ++it)
+				{
+					if ((*it)->nExpireTime != 0 && (*it)->nExpireTime / 7 < nNow / 7)
+						expected.insert(*it);
+				}
+				ATLTEST_CHECK(due == expected);
+				if (due != expected)
+				{
+					printf("run %d step %d differs\n", nRun, nStep);
+					break;
+				}
+				for (std::set<CTestItem *>::iterator it = due.begin(); it != due.end(); ++it)
+					live.erase(*it);
+			}
+		}
+
+		for (size_t i=0; i<all.size(); i++)
+			delete all[i];
+	}
+}
+
+int main()
+{
+	TestTickBoundaries();
+	TestCascade();
+	TestOverflow();
+	TestLongGap();
+	TestRemove();
+	TestRandom();
+	return AtlTestResult("test_cache_wheel");
+}
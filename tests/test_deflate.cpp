@@ -0,0 +1,147 @@
+// Tests for the gzip and deflate content codings in atldeflate.h.
+//
+// Every encoded buffer is decoded with zlib, which also checks the CRC-32
+// or Adler-32 trailer, and compared with the input.
+
+#include "atltest.h"
+#include <atldeflate.h>
+
+#include <zlib.h>
+
+using namespace ATL;
+
+static std::vector<BYTE> Inflate(int nEncoding, CAtlTestByteArray& arrIn, size_t cbExpected)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	int nWindowBits = (nEncoding == ATLS_ENCODING_GZIP) ? 16 + MAX_WBITS : MAX_WBITS;
+	std::vector<BYTE> out(cbExpected + 1);
+	if (inflateInit2(&stream, nWindowBits) != Z_OK)
+		return std::vector<BYTE>(1);
+
+	stream.next_in = arrIn.GetData();
+	stream.avail_in = (uInt) arrIn.GetCount();
+	stream.next_out = &out[0];
+	stream.avail_out = (uInt) out.size();
+	int nRet = inflate(&stream, Z_FINISH);
+	ATLTEST_CHECK(nRet == Z_STREAM_END);
+	ATLTEST_CHECK(stream.avail_in == 0);
+	out.resize(stream.total_out);
+	inflateEnd(&stream);
+	return out;
+}
+
+static void CheckRoundTrip(const char *szName, const std::vector<BYTE>& data)
+{
+	for (int nEncoding = ATLS_ENCODING_GZIP; nEncoding <= ATLS_ENCODING_DEFLATE; nEncoding++)
+	{
+		CAtlTestByteArray arrOut;
+		CAtlDeflateEncoder encoder;
+		const BYTE *pbData = data.empty() ? NULL : &data[0];
+		ATLTEST_CHECK(AtlBeginContentCoding(nEncoding, arrOut));
+		ATLTEST_CHECK(encoder.Encode(pbData, (DWORD) data.size(), arrOut));
+		ATLTEST_CHECK(AtlEndContentCoding(nEncoding, pbData, (DWORD) data.size(), arrOut));
+
+		// fixed Huffman codes never take more than 9 bits per byte
+		ATLTEST_CHECK(arrOut.GetCount() <= data.size() + data.size()/8 + 32);
+
+		std::vector<BYTE> decoded = Inflate(nEncoding, arrOut, data.size());
+		if (decoded != data)
+			printf("%s: encoding %d does not round-trip\n", szName, nEncoding);
+		ATLTEST_CHECK(decoded == data);
+	}
+}
+
+static std::vector<BYTE> MakeText(size_t cb)
+{
+	static const char *s_rgszWords[] = { "<td class=\"cell\">", "</td>", "<tr>", "</tr>\r\n",
+		"ATL", "Server", "stencil", "replacement", "request", "handler", "0", "1", "42", " " };
+	std::vector<BYTE> data;
+	unsigned nSeed = 7;
+	while (data.size() < cb)
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		const char *szWord = s_rgszWords[(nSeed >> 8) % (sizeof(s_rgszWords)/sizeof(s_rgszWords[0]))];
+		data.insert(data.end(), szWord, szWord + strlen(szWord));
+	}
+	data.resize(cb);
+	return data;
+}
+
+static std::vector<BYTE> MakeRandom(size_t cb, unsigned nSeed)
+{
+	std::vector<BYTE> data(cb);
+	for (size_t i=0; i<cb; i++)
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		data[i] = (BYTE) (nSeed >> 24);
+	}
+	return data;
+}
+
+static void TestRoundTrips()
+{
+	CheckRoundTrip("empty", std::vector<BYTE>());
+	CheckRoundTrip("one byte", std::vector<BYTE>(1, 'x'));
+	CheckRoundTrip("two bytes", std::vector<BYTE>(2, 'x'));
+	CheckRoundTrip("min match", std::vector<BYTE>(3, 'x'));
+	CheckRoundTrip("max match", std::vector<BYTE>(CAtlDeflateEncoder::MAX_MATCH + 1, 'x'));
+	CheckRoundTrip("long run", std::vector<BYTE>(200000, 0));
+	CheckRoundTrip("text", MakeText(100000));
+	CheckRoundTrip("random", MakeRandom(100000, 1));
+
+	// every literal and length code, and distances up to the window size
+	std::vector<BYTE> all;
+	for (int i=0; i<256; i++)
+		all.push_back((BYTE) i);
+	std::vector<BYTE> data = MakeRandom(CAtlDeflateEncoder::WINDOW_SIZE, 3);
+	data.insert(data.end(), all.begin(), all.end());
+	data.insert(data.end(), data.begin(), data.begin() + 1000);
+	for (DWORD nLen = 3; nLen <= 258; nLen += 5)
+		data.insert(data.end(), data.begin() + 500, data.begin() + 500 + nLen);
+	CheckRoundTrip("codes", data);
+
+	// the encoder keeps its tables between calls
+	CAtlDeflateEncoder encoder;
+	std::vector<BYTE> text = MakeText(5000);
+	CAtlTestByteArray arrFirst;
+	CAtlTestByteArray arrSecond;
+	ATLTEST_CHECK(encoder.Encode(&text[0], (DWORD) text.size(), arrFirst));
+	ATLTEST_CHECK(encoder.Encode(&text[0], (DWORD) text.size(), arrSecond));
+	ATLTEST_CHECK(arrFirst.GetCount() == arrSecond.GetCount() &&
+		memcmp(arrFirst.GetData(), arrSecond.GetData(), arrFirst.GetCount()) == 0);
+}
+
+static void TestChecksums()
+{
+	const BYTE *pbCheck = (const BYTE *) "123456789";
+	ATLTEST_CHECK(AtlCrc32(0, pbCheck, 9) == 0xCBF43926);
+	ATLTEST_CHECK(AtlCrc32(AtlCrc32(0, pbCheck, 4), pbCheck + 4, 5) == 0xCBF43926);
+	ATLTEST_CHECK(AtlAdler32((const BYTE *) "Wikipedia", 9) == 0x11E60398);
+	ATLTEST_CHECK(AtlAdler32(NULL, 0) == 1);
+
+	// long enough to need the periodic modulo
+	std::vector<BYTE> data(100000, 0xff);
+	ATLTEST_CHECK(AtlAdler32(&data[0], data.size()) == adler32(1, &data[0], (uInt) data.size()));
+	ATLTEST_CHECK(AtlCrc32(0, &data[0], data.size()) == crc32(0, &data[0], (uInt) data.size()));
+}
+
+static void TestCompressContent()
+{
+	CAtlTestByteArray arrOut;
+	std::vector<BYTE> text = MakeText(10000);
+	ATLTEST_CHECK(AtlCompressContent(ATLS_ENCODING_GZIP, &text[0], (DWORD) text.size(), arrOut));
+	ATLTEST_CHECK(Inflate(ATLS_ENCODING_GZIP, arrOut, text.size()) == text);
+
+	// data that doesn't shrink is not worth sending compressed
+	std::vector<BYTE> random = MakeRandom(10000, 5);
+	ATLTEST_CHECK(!AtlCompressContent(ATLS_ENCODING_DEFLATE, &random[0], (DWORD) random.size(), arrOut));
+}
+
+int main()
+{
+	TestRoundTrips();
+	TestChecksums();
+	TestCompressContent();
+	return AtlTestResult("test_deflate");
+}
@@ -0,0 +1,298 @@
+// Tests for the conditional GET validators in atlhttpcond.h.
+//
+// AtlParseHttpDate must read back every IMF-fixdate it is given, at the
+// same time SystemTimeToFileTime gives, and turn down anything else: a
+// non-digit at any digit, every truncation, out of range fields, and the
+// obsolete RFC 850 and asctime formats, which only ever cost a full
+// response.  AtlMatchETag is checked on hand-written If-None-Match lists
+// with weak tags, "*", unterminated quotes and whitespace, and on random
+// lists whose members the test knows.
+
+#include "atltest.h"
+#include <atlhttpcond.h>
+
+#include <string>
+#include <vector>
+
+using namespace ATL;
+
+static unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1103515245 + 12345;
+	return (g_nSeed >> 16) & 0x7FFF;
+}
+
+static ULONGLONG GetTime(const FILETIME& ft)
+{
+	return ((ULONGLONG) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+static std::string FormatDate(const SYSTEMTIME& st)
+{
+	static const char *s_rgszDays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static const char *s_rgszMonths[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+	char szDate[64];
+	snprintf(szDate, sizeof(szDate), "%s, %02u %s %04u %02u:%02u:%02u GMT", s_rgszDays[st.wDayOfWeek % 7],
+		st.wDay, s_rgszMonths[st.wMonth-1], st.wYear, st.wHour, st.wMinute, st.wSecond);
+	return szDate;
+}
+
+static bool ParseDate(const std::string& strDate, ULONGLONG *pullTime = NULL)
+{
+	FILETIME ft;
+	if (!AtlParseHttpDate(strDate.c_str(), &ft))
+		return false;
+	if (pullTime)
+		*pullTime = GetTime(ft);
+	return true;
+}
+
+static SYSTEMTIME RandomDate()
+{
+	static const WORD s_rgDays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	SYSTEMTIME st;
+	memset(&st, 0, sizeof(st));
+	st.wYear = (WORD) ((Random() % 2) ? 1970 + Random() % 100 : 1601 + Random() % 8399);
+	st.wMonth = (WORD) (1 + Random() % 12);
+	st.wDay = (WORD) (1 + Random() % s_rgDays[st.wMonth-1]);
+	st.wHour = (WORD) (Random() % 24);
+	st.wMinute = (WORD) (Random() % 60);
+	st.wSecond = (WORD) (Random() % 60);
+	st.wDayOfWeek = (WORD) (Random() % 7);
+	return st;
+}
+
+static void TestDates(int nDates)
+{
+	// the example of RFC 7231, 784111777 seconds into 1970
+	ULONGLONG ullTime = 0;
+	ATLTEST_CHECK(ParseDate("Sun, 06 Nov 1994 08:49:37 GMT", &ullTime));
+	ATLTEST_CHECK(ullTime == (784111777ULL + 11644473600ULL) * 10000000);
+
+	// the day name is not checked
+	ATLTEST_CHECK(ParseDate("Wed, 06 Nov 1994 08:49:37 GMT", &ullTime));
+	ATLTEST_CHECK(ullTime == (784111777ULL + 11644473600ULL) * 10000000);
+
+	ATLTEST_CHECK(ParseDate("Tue, 29 Feb 2000 23:59:59 GMT"));
+	ATLTEST_CHECK(ParseDate("Mon, 01 Jan 1601 00:00:00 GMT", &ullTime) && ullTime == 0);
+	ATLTEST_CHECK(ParseDate("Fri, 31 Dec 9999 23:59:59 GMT"));
+
+	for (int i=0; i<nDates; i++)
+	{
+		SYSTEMTIME st = RandomDate();
+		FILETIME ft;
+		ATLTEST_CHECK(SystemTimeToFileTime(&st, &ft));
+		std::string strDate = FormatDate(st);
+		ATLTEST_CHECK(ParseDate(strDate, &ullTime) && ullTime == GetTime(ft));
+
+		// every truncation, and anything after the zone
+		for (size_t cch=0; cch<strDate.size(); cch++)
+			ATLTEST_CHECK(!ParseDate(strDate.substr(0, cch)));
+		ATLTEST_CHECK(!ParseDate(strDate + " "));
+		ATLTEST_CHECK(!ParseDate(strDate + "\r\n"));
+		ATLTEST_CHECK(!ParseDate(strDate + "T"));
+	}
+}
+
+// Each digit of a date replaced with something that isn't one
+static void TestBadDigits(int nDates)
+{
+	static const char s_rgchBad[] = { 'a', 'O', ' ', '-', '+', '/', ':', '.', '\t', '\x80', '\0' };
+
+	for (int i=0; i<nDates; i++)
+	{
+		std::string strDate = FormatDate(RandomDate());
+		for (size_t ich=0; ich<strDate.size(); ich++)
+		{
+			if (strDate[ich] < '0' || strDate[ich] > '9')
+				continue;
+			for (size_t b=0; b<sizeof(s_rgchBad); b++)
+			{
+				std::string strBad(strDate);
+				strBad[ich] = s_rgchBad[b];
+				ATLTEST_CHECK(!ParseDate(strBad));
+			}
+		}
+	}
+
+	// too few or too many digits in a field
+	ATLTEST_CHECK(!ParseDate("Sun, 6 Nov 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 006 Nov 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 94 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 01994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 8:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08:9:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08:49:7 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08:49:370 GMT"));
+
+	// fields out of range
+	ATLTEST_CHECK(!ParseDate("Sun, 00 Nov 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 31 Nov 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 29 Feb 1900 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1600 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 24:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08:60:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08:49:60 GMT"));
+
+	// months and zones are case sensitive, and only GMT will do
+	ATLTEST_CHECK(!ParseDate("Sun, 06 nov 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 NOV 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nox 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 November 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08:49:37 gmt"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08:49:37 UTC"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08:49:37 +0000"));
+
+	// and the separators are single spaces
+	ATLTEST_CHECK(!ParseDate("Sun,06 Nov 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun,_06 Nov 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun,  06 Nov 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06  Nov 1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov\t1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08.49.37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun, 06 Nov 1994 08:49:37  GMT"));
+	ATLTEST_CHECK(!ParseDate(""));
+	ATLTEST_CHECK(!ParseDate(","));
+}
+
+// RFC 7231 obsoletes them, and a date that isn't read only means the full
+// response is sent
+static void TestObsoleteDates()
+{
+	ATLTEST_CHECK(!ParseDate("Sunday, 06-Nov-94 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sunday, 06-Nov-1994 08:49:37 GMT"));
+	ATLTEST_CHECK(!ParseDate("Sun Nov  6 08:49:37 1994"));
+	ATLTEST_CHECK(!ParseDate("Sun Nov 06 08:49:37 1994"));
+	ATLTEST_CHECK(!ParseDate("1994-11-06T08:49:37Z"));
+	ATLTEST_CHECK(!ParseDate("784111777"));
+}
+
+static void TestETags()
+{
+	// strong and weak tags compare weakly
+	ATLTEST_CHECK(AtlMatchETag("\"abc\"", "\"abc\""));
+	ATLTEST_CHECK(AtlMatchETag("W/\"abc\"", "\"abc\""));
+	ATLTEST_CHECK(AtlMatchETag("\"abc\"", "W/\"abc\""));
+	ATLTEST_CHECK(AtlMatchETag("W/\"abc\"", "W/\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("w/\"abc\"", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("W/ \"abc\"", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("Wx\"abc\"", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("\"ABC\"", "\"abc\""));
+
+	// only the whole tag matches
+	ATLTEST_CHECK(!AtlMatchETag("\"abcd\"", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("\"ab\"", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("abc", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("\"\"", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("W/", "\"abc\""));
+
+	// "*" matches any current entity
+	ATLTEST_CHECK(AtlMatchETag("*", "\"abc\""));
+	ATLTEST_CHECK(AtlMatchETag(" \t*", "\"abc\""));
+	ATLTEST_CHECK(AtlMatchETag("\"x\", *", "\"abc\""));
+
+	// an unterminated tag matches nothing, and ends the list
+	ATLTEST_CHECK(!AtlMatchETag("\"abc", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("W/\"abc", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("\"x, \"abc\"", "\"abc\""));
+	ATLTEST_CHECK(AtlMatchETag("\"x\", \"abc\", \"y", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("\"x\", \"y, *", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("\"", "\"abc\""));
+
+	// commas inside a tag don't split it
+	ATLTEST_CHECK(AtlMatchETag("\"a,b\"", "\"a,b\""));
+	ATLTEST_CHECK(!AtlMatchETag("\"a,b\"", "\"a\""));
+	ATLTEST_CHECK(AtlMatchETag("\"a,\", \"b\"", "\"b\""));
+
+	// whitespace and empty members between the tags
+	ATLTEST_CHECK(AtlMatchETag("\"a\" , \"b\",\t\"abc\"", "\"abc\""));
+	ATLTEST_CHECK(AtlMatchETag(",,  W/\"abc\"  ,", "\"abc\""));
+	ATLTEST_CHECK(AtlMatchETag("\"a\",\"abc\"", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("\"a\" , \"b\",\t\"c\"", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag("", "\"abc\""));
+	ATLTEST_CHECK(!AtlMatchETag(" \t, ,", "\"abc\""));
+}
+
+static std::string RandomTag()
+{
+	std::string strTag("\"");
+	size_t cch = Random() % 6;
+	for (size_t i=0; i<cch; i++)
+		strTag += "ab,W/ *"[Random() % 7];
+	return strTag + "\"";
+}
+
+static std::string RandomSpace()
+{
+	static const char *s_rgszSpace[] = { "", "", " ", "\t", "  ", " \t " };
+	return s_rgszSpace[Random() % 6];
+}
+
+// Lists of random tags, some weak, some with commas, spaces or a '*'
+// inside, separated by commas and whitespace
+static void TestRandomLists(int nLists)
+{
+	for (int n=0; n<nLists; n++)
+	{
+		std::vector<std::string> tags(1 + Random() % 5);
+		std::string strList = RandomSpace();
+		for (size_t i=0; i<tags.size(); i++)
+		{
+			tags[i] = RandomTag();
+			if (i)
+				strList += RandomSpace() + "," + RandomSpace();
+			if (Random() % 3 == 0)
+				strList += "W/";
+			strList += tags[i];
+		}
+		strList += RandomSpace();
+		if (Random() % 2)
+			strList += "," + RandomSpace();
+
+		for (int q=0; q<8; q++)
+		{
+			std::string strETag = (q < (int) tags.size()) ? tags[q] : RandomTag();
+			bool bExpected = false;
+			for (size_t i=0; i<tags.size(); i++)
+				bExpected = bExpected || tags[i] == strETag;
+
+			ATLTEST_CHECK(!AtlMatchETag(strList.c_str(), strETag.c_str()) == !bExpected);
+			ATLTEST_CHECK(!AtlMatchETag(strList.c_str(), ("W/" + strETag).c_str()) == !bExpected);
+
+			// cut off inside the last tag, the others still match
+			bool bBefore = false;
+			for (size_t i=0; i+1<tags.size(); i++)
+				bBefore = bBefore || tags[i] == strETag;
+			std::string strCut = strList.substr(0, strList.rfind('"'));
+			ATLTEST_CHECK(!AtlMatchETag(strCut.c_str(), strETag.c_str()) == !bBefore);
+		}
+	}
+}
+
+static void TestHashValidator()
+{
+	// the FNV-1a test vectors
+	ATLTEST_CHECK(AtlHashValidator(ATLS_VALIDATOR_SEED, "", 0) == 0xcbf29ce484222325ULL);
+	ATLTEST_CHECK(AtlHashValidator(ATLS_VALIDATOR_SEED, "a", 1) == 0xaf63dc4c8601ec8cULL);
+	ATLTEST_CHECK(AtlHashValidator(ATLS_VALIDATOR_SEED, "foobar", 6) == 0x85944171f73967e8ULL);
+
+	// hashing in pieces, as the page cache does
+	ATLTEST_CHECK(AtlHashValidator(AtlHashValidator(ATLS_VALIDATOR_SEED, "foo", 3), "bar", 3) == 0x85944171f73967e8ULL);
+}
+
+int main()
+{
+	TestDates(2000);
+	TestBadDigits(200);
+	TestObsoleteDates();
+	TestETags();
+	TestRandomLists(5000);
+	TestHashValidator();
+
+	return AtlTestResult("test_http_cond");
+}
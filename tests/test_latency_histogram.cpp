@@ -0,0 +1,362 @@
+// Tests for the latency histograms in atllatency.h.
+//
+// The histograms are driven through RecordAt and GetCountsAt with a clock
+// the test controls.  A list of the values recorded and when stands in
+// for the histogram: the counts of a window must add up to the values
+// recorded in the intervals it covers, as the clock moves on by less than
+// an interval, by whole windows with no traffic, and across the wrap of
+// the tick count.  Add must line the intervals of two histograms up, so
+// a merged histogram reports what both did.  The buckets must round-trip
+// through their limits, and percentiles must land in the bucket of the
+// value of that rank.
+
+#include "atltest.h"
+#include <atllatency.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+using namespace ATL;
+
+static unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1103515245 + 12345;
+	return (g_nSeed >> 16) & 0x7FFF;
+}
+
+// Mostly short latencies, with a long tail
+static DWORD RandomLatency()
+{
+	switch (Random() % 8)
+	{
+	case 0:
+		return Random() % 16;
+	case 1:
+		return ((DWORD) Random() << 17) ^ ((DWORD) Random() << 2) ^ Random();
+	default:
+		return Random() % (1U << (Random() % 24));
+	}
+}
+
+// Four intervals of a second each
+typedef CAtlLatencyHistogramT<2, 4, 4000> CTestHistogram;
+
+const DWORD c_dwInterval = 1000;
+
+struct CRecord
+{
+	DWORD dwValue;
+	DWORD dwTime;
+};
+
+// The counts of the records whose interval is in the window that ends at dwNow
+static ULONGLONG GetExpected(const std::vector<CRecord>& records, DWORD dwNow, DWORD *rgCounts)
+{
+	memset(rgCounts, 0, CTestHistogram::BUCKETS * sizeof(DWORD));
+	ULONGLONG ullTotal = 0;
+	LONG lNow = CTestHistogram::GetInterval(dwNow);
+	for (size_t i=0; i<records.size(); i++)
+	{
+		if ((DWORD) (lNow - CTestHistogram::GetInterval(records[i].dwTime)) < 4)
+		{
+			rgCounts[CTestHistogram::GetBucket(records[i].dwValue)]++;
+			ullTotal++;
+		}
+	}
+	return ullTotal;
+}
+
+static bool CheckCounts(CTestHistogram& histogram, const std::vector<CRecord>& records, DWORD dwNow)
+{
+	DWORD rgCounts[CTestHistogram::BUCKETS];
+	DWORD rgExpected[CTestHistogram::BUCKETS];
+	ULONGLONG ullTotal = histogram.GetCountsAt(rgCounts, dwNow);
+	ULONGLONG ullExpected = GetExpected(records, dwNow, rgExpected);
+	ATLTEST_CHECK(ullTotal == ullExpected);
+	ATLTEST_CHECK(memcmp(rgCounts, rgExpected, sizeof(rgCounts)) == 0);
+	if (ullTotal != ullExpected || memcmp(rgCounts, rgExpected, sizeof(rgCounts)) != 0)
+	{
+		printf("at %u: %u counted, %u expected\n", dwNow, (unsigned) ullTotal, (unsigned) ullExpected);
+		return false;
+	}
+	return true;
+}
+
+// Moves the clock on by a random step: within an interval, to the next
+// one, past a few, or past the whole window
+static DWORD RandomStep()
+{
+	switch (Random() % 6)
+	{
+	case 0:
+		return 0;
+	case 1:
+	case 2:
+		return Random() % c_dwInterval;
+	case 3:
+		return c_dwInterval;
+	case 4:
+		return Random() % (3 * c_dwInterval);
+	default:
+		return 4 * c_dwInterval + Random() % (8 * c_dwInterval);
+	}
+}
+
+// Records through the ring many times over, checking the window as the
+// clock moves on, also when the tick count wraps around
+static void TestRollover(int nRuns)
+{
+	for (int nRun=0; nRun<nRuns; nRun++)
+	{
+		CTestHistogram *pHistogram = new CTestHistogram;
+		std::vector<CRecord> records;
+
+		DWORD dwNow = (nRun % 2) ? 0xFFFFFFFF - Random() * 10 : Random() * 100;
+		for (int i=0; i<400; i++)
+		{
+			dwNow += RandomStep();
+
+			int nValues = Random() % 4;
+			for (int v=0; v<nValues; v++)
+			{
+				CRecord record = { RandomLatency(), dwNow };
+				pHistogram->RecordAt(record.dwValue, record.dwTime);
+				records.push_back(record);
+			}
+
+			if (!CheckCounts(*pHistogram, records, dwNow) ||
+				!CheckCounts(*pHistogram, records, dwNow + Random() % (6 * c_dwInterval)))
+			{
+				break;
+			}
+		}
+		delete pHistogram;
+	}
+}
+
+// With no traffic the counts drop out an interval at a time
+static void TestDecay()
+{
+	CTestHistogram *pHistogram = new CTestHistogram;
+	DWORD rgCounts[CTestHistogram::BUCKETS];
+
+	// 10 values in each of four intervals, starting halfway into one
+	DWORD dwStart = 7 * c_dwInterval + c_dwInterval / 2;
+	for (DWORD dwInterval=0; dwInterval<4; dwInterval++)
+	{
+		for (DWORD i=0; i<10; i++)
+			pHistogram->RecordAt(100 * (dwInterval+1), dwStart + dwInterval * c_dwInterval);
+	}
+
+	DWORD dwLast = dwStart + 3 * c_dwInterval;
+	ATLTEST_CHECK(pHistogram->GetCountsAt(rgCounts, dwLast) == 40);
+	ATLTEST_CHECK(pHistogram->GetCountsAt(rgCounts, dwLast + c_dwInterval / 2 - 1) == 40);
+	ATLTEST_CHECK(pHistogram->GetCountsAt(rgCounts, dwLast + c_dwInterval / 2) == 30);
+	ATLTEST_CHECK(rgCounts[CTestHistogram::GetBucket(100)] == 0);
+	ATLTEST_CHECK(rgCounts[CTestHistogram::GetBucket(200)] == 10);
+	ATLTEST_CHECK(pHistogram->GetCountsAt(rgCounts, dwLast + c_dwInterval * 3 / 2) == 20);
+	ATLTEST_CHECK(pHistogram->GetCountsAt(rgCounts, dwLast + c_dwInterval * 5 / 2) == 10);
+	ATLTEST_CHECK(CTestHistogram::GetPercentile(rgCounts, 10, 500) == CTestHistogram::GetBucketLimit(CTestHistogram::GetBucket(400)));
+
+	// nothing is left once the window has passed, however long ago
+	ULONGLONG ullTotal = pHistogram->GetCountsAt(rgCounts, dwLast + c_dwInterval * 7 / 2);
+	ATLTEST_CHECK(ullTotal == 0);
+	ATLTEST_CHECK(CTestHistogram::GetPercentile(rgCounts, ullTotal, 500) == 0);
+	ATLTEST_CHECK(pHistogram->GetCountsAt(rgCounts, dwLast + 1000 * c_dwInterval) == 0);
+
+	// nor when the interval comes round to the same slot
+	ATLTEST_CHECK(pHistogram->GetCountsAt(rgCounts, dwStart + 4 * c_dwInterval) == 30);
+	ATLTEST_CHECK(pHistogram->GetCountsAt(rgCounts, dwStart + 8 * c_dwInterval) == 0);
+
+	// an empty histogram counts nothing, even at tick 0
+	CTestHistogram *pEmpty = new CTestHistogram;
+	ATLTEST_CHECK(pEmpty->GetCountsAt(rgCounts, 0) == 0);
+	ATLTEST_CHECK(pEmpty->GetCountsAt(rgCounts, 0xFFFFFFFF) == 0);
+	delete pEmpty;
+	delete pHistogram;
+}
+
+// Records into two histograms on the same clock, merges them at random
+// points, and checks that the sum reports what both did from then on
+static void TestAdd(int nRuns)
+{
+	for (int nRun=0; nRun<nRuns; nRun++)
+	{
+		CTestHistogram *pFirst = new CTestHistogram;
+		CTestHistogram *pSecond = new CTestHistogram;
+		std::vector<CRecord> first;
+		std::vector<CRecord> second;
+
+		// each one sometimes goes quiet for a while
+		DWORD dwNow = Random() * 100;
+		int nQuiet = 0;
+		for (int i=0; i<100; i++)
+		{
+			dwNow += RandomStep();
+			if (Random() % 8 == 0)
+				nQuiet = 1 + Random() % 2;
+			int nValues = Random() % 3;
+			for (int v=0; v<nValues; v++)
+			{
+				CRecord record = { RandomLatency(), dwNow };
+				if (nQuiet != 1)
+				{
+					pFirst->RecordAt(record.dwValue, dwNow);
+					first.push_back(record);
+				}
+				if (nQuiet != 2)
+				{
+					pSecond->RecordAt(record.dwValue, dwNow);
+					second.push_back(record);
+				}
+			}
+			if (Random() % 4 == 0)
+				nQuiet = 0;
+		}
+
+		std::vector<CRecord> both(first);
+		both.insert(both.end(), second.begin(), second.end());
+
+		CTestHistogram *pSum = new CTestHistogram(*pFirst);
+		pSum->Add(*pSecond);
+		CTestHistogram *pCopy = new CTestHistogram;
+		pCopy->Add(*pSecond);
+
+		for (int i=0; i<8; i++)
+		{
+			DWORD dwThen = dwNow + Random() % (5 * c_dwInterval);
+			if (!CheckCounts(*pSum, both, dwThen) ||
+				!CheckCounts(*pSecond, second, dwThen) ||
+				!CheckCounts(*pCopy, second, dwThen))
+			{
+				break;
+			}
+		}
+
+		// the merged slots keep counting
+		CRecord record = { RandomLatency(), dwNow + Random() % (5 * c_dwInterval) };
+		pSum->RecordAt(record.dwValue, record.dwTime);
+		both.push_back(record);
+		CheckCounts(*pSum, both, record.dwTime);
+
+		delete pCopy;
+		delete pSum;
+		delete pSecond;
+		delete pFirst;
+	}
+}
+
+static void TestBuckets()
+{
+	ATLTEST_CHECK(CTestHistogram::GetBucket(0) == 0);
+	ATLTEST_CHECK(CTestHistogram::GetBucketLimit(0) == 0);
+	ATLTEST_CHECK(CTestHistogram::GetBucket(0xFFFFFFFF) == CTestHistogram::BUCKETS-1);
+	ATLTEST_CHECK(CTestHistogram::GetBucketLimit(CTestHistogram::BUCKETS-1) == 0xFFFFFFFF);
+
+	for (DWORD dwBucket=0; dwBucket<CTestHistogram::BUCKETS; dwBucket++)
+	{
+		DWORD dwLimit = CTestHistogram::GetBucketLimit(dwBucket);
+		ATLTEST_CHECK(CTestHistogram::GetBucket(dwLimit) == dwBucket);
+		if (dwBucket+1 < CTestHistogram::BUCKETS)
+		{
+			ATLTEST_CHECK(CTestHistogram::GetBucketLimit(dwBucket+1) > dwLimit);
+			ATLTEST_CHECK(CTestHistogram::GetBucket(dwLimit+1) == dwBucket+1);
+		}
+	}
+
+	// every value is within an eighth of its bucket's limit
+	for (int i=0; i<100000; i++)
+	{
+		DWORD dwValue = RandomLatency();
+		DWORD dwBucket = CTestHistogram::GetBucket(dwValue);
+		ATLTEST_CHECK(dwBucket < CTestHistogram::BUCKETS);
+		DWORD dwLimit = CTestHistogram::GetBucketLimit(dwBucket);
+		ATLTEST_CHECK(dwLimit >= dwValue);
+		ATLTEST_CHECK(dwLimit - dwValue <= dwValue / 8);
+		ATLTEST_CHECK(dwBucket == 0 || CTestHistogram::GetBucketLimit(dwBucket-1) < dwValue);
+	}
+}
+
+static void TestPercentile(int nRuns)
+{
+	DWORD rgCounts[CTestHistogram::BUCKETS];
+	ATLTEST_CHECK(CTestHistogram::GetPercentile(rgCounts, 0, 500) == 0);
+
+	static const DWORD s_rgPerMille[] = { 0, 1, 10, 250, 500, 900, 990, 999, 1000 };
+	for (int nRun=0; nRun<nRuns; nRun++)
+	{
+		std::vector<DWORD> values(1 + Random() % ((Random() % 2) ? 10 : 3000));
+		memset(rgCounts, 0, sizeof(rgCounts));
+		for (size_t i=0; i<values.size(); i++)
+		{
+			values[i] = RandomLatency();
+			rgCounts[CTestHistogram::GetBucket(values[i])]++;
+		}
+		std::sort(values.begin(), values.end());
+
+		for (size_t p=0; p<sizeof(s_rgPerMille)/sizeof(s_rgPerMille[0]); p++)
+		{
+			// the smallest value that at least dwPerMille thousandths don't exceed
+			size_t nRank = (values.size() * s_rgPerMille[p] + 999) / 1000;
+			DWORD dwValue = values[nRank ? nRank-1 : 0];
+			ATLTEST_CHECK(CTestHistogram::GetPercentile(rgCounts, values.size(), s_rgPerMille[p]) ==
+				CTestHistogram::GetBucketLimit(CTestHistogram::GetBucket(dwValue)));
+		}
+	}
+}
+
+// Threads recording in the same interval land in different shards, and
+// none of their values are lost
+static void TestShards()
+{
+	const int c_nThreads = 8;
+	const int c_nValues = 20000;
+
+	CTestHistogram *pHistogram = new CTestHistogram;
+	DWORD dwNow = 5 * c_dwInterval;
+	pHistogram->RecordAt(0, dwNow);
+
+	std::vector<std::thread> threads;
+	for (int t=0; t<c_nThreads; t++)
+	{
+		threads.push_back(std::thread([pHistogram, dwNow, t]()
+		{
+			for (int i=0; i<c_nValues; i++)
+				pHistogram->RecordAt((DWORD) ((t+1) * 1000 + i % 7), dwNow + i % c_dwInterval);
+		}));
+	}
+	for (int t=0; t<c_nThreads; t++)
+		threads[t].join();
+
+	DWORD rgCounts[CTestHistogram::BUCKETS];
+	ATLTEST_CHECK(pHistogram->GetCountsAt(rgCounts, dwNow) == 1 + (ULONGLONG) c_nThreads * c_nValues);
+	ATLTEST_CHECK(rgCounts[0] == 1);
+	for (int t=0; t<c_nThreads; t++)
+		ATLTEST_CHECK(rgCounts[CTestHistogram::GetBucket((t+1) * 1000)] == (DWORD) c_nValues);
+
+	// both shards took some
+	for (DWORD dwShard=0; dwShard<2; dwShard++)
+	{
+		DWORD dwSlot = (DWORD) CTestHistogram::GetInterval(dwNow) % 4;
+		LONG lShard = 0;
+		for (DWORD dwBucket=0; dwBucket<CTestHistogram::BUCKETS; dwBucket++)
+			lShard += pHistogram->m_rgCounts[dwSlot][dwShard][dwBucket];
+		ATLTEST_CHECK(lShard > 0);
+	}
+	delete pHistogram;
+}
+
+int main()
+{
+	TestBuckets();
+	TestPercentile(2000);
+	TestRollover(300);
+	TestDecay();
+	TestAdd(1000);
+	TestShards();
+
+	return AtlTestResult("test_latency_histogram");
+}
@@ -0,0 +1,694 @@
+// Tests for the multipart/form-data parser in atlmultipart.h.
+//
+// The window is made small so that a few kilobytes of body go through many
+// refills.  Random well formed bodies are parsed where they are, the way
+// the parser worked before the window, and through the window with the
+// first read cut at every offset of the body and the rest read in random
+// short pieces, so that every boundary, the line break before it, and
+// every part's headers straddle a refill somewhere.  Each parse must give
+// the fields and files the body was built from.  Bodies with the boundary
+// at the very start, near-boundaries in the data, and headers that do not
+// fit in the window check the line break look-behind, the bytes held back
+// at the end of the window, and how the two ways of parsing fail.
+//
+// The asynchronous parse CHttpRequest uses with ATL_FORM_FLAG_ASYNC_BODY
+// starts with every length of the body available, reads the rest in
+// pieces of random size and must give the same parts, having stopped in
+// the middle of headers, fields and files.  Reads that fail or read
+// nothing must fail the parse and close the file being read.
+
+#define ATLS_MULTIPART_WINDOW_SIZE 1024
+
+#include "atltest.h"
+#include <atlmultipart.h>
+
+#include <string>
+#include <vector>
+
+using namespace ATL;
+
+static unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1664525 + 1013904223;
+	return g_nSeed >> 8;
+}
+
+// Logs what the parser hands over as one line per field or file, so two
+// parses can be compared as strings.
+class CTestParser : public CAtlMultiPartParser<CTestParser>
+{
+public:
+	const std::string& m_strBody;
+	DWORD m_dwDelivered;		// bytes of the body ReadClient has returned
+	DWORD m_dwFirstRead;		// size of the first read, 0 for as much as asked for
+	DWORD m_dwMaxRead;			// the other reads are 1 to m_dwMaxRead bytes, 0 for as much as asked for
+	std::string m_strLog;
+	std::string m_strPart;		// the current part: its name and data so far
+	BOOL m_bInPart;
+
+	CTestParser(const std::string& strBody) :
+		m_strBody(strBody), m_dwDelivered(0), m_dwFirstRead(0), m_dwMaxRead(0), m_bInPart(FALSE)
+	{
+	}
+
+	using CAtlMultiPartParser<CTestParser>::GetBodyOffset;
+
+	ATL_MULTIPART_STATE GetState() const
+	{
+		return m_nState;
+	}
+
+	// CAtlMultiPartParser
+	BOOL ReadClient(LPSTR pBuffer, DWORD *pdwLen, DWORD dwBodyOffset)
+	{
+		ATLTEST_CHECK(dwBodyOffset == m_dwDelivered);
+		ATLTEST_CHECK(GetBodyOffset(pBuffer) == dwBodyOffset);
+		ATLTEST_CHECK(*pdwLen != 0);
+		if (m_bAsync)
+			ATLTEST_CHECK(dwBodyOffset + *pdwLen <= m_dwBodyAvailable);
+		DWORD dwLen = (DWORD) m_strBody.size() - dwBodyOffset;
+		if (dwLen > *pdwLen)
+			dwLen = *pdwLen;
+		DWORD dwLimit = m_dwDelivered == 0 ? m_dwFirstRead : (m_dwMaxRead ? 1 + Random() % m_dwMaxRead : 0);
+		if (dwLimit && dwLen > dwLimit)
+			dwLen = dwLimit;
+		memcpy(pBuffer, m_strBody.data() + dwBodyOffset, dwLen);
+		m_dwDelivered += dwLen;
+		*pdwLen = dwLen;
+		return TRUE;
+	}
+
+	BOOL BeginField(LPCSTR szName, DWORD cchName)
+	{
+		ATLTEST_CHECK(!m_bInPart);
+		m_bInPart = TRUE;
+		m_strPart = "field " + std::string(szName, cchName) + "=";
+		return TRUE;
+	}
+
+	BOOL BeginFile(LPCSTR szName, DWORD cchName, LPCSTR szFileName, DWORD cchFileName,
+		LPCSTR szContentType, DWORD cchContentType)
+	{
+		ATLTEST_CHECK(!m_bInPart);
+		m_bInPart = TRUE;
+		m_strPart = "file " + std::string(szName, cchName) + " " + std::string(szFileName, cchFileName) + " " +
+			(szContentType ? std::string(szContentType, cchContentType) : std::string("-")) + " ";
+		return TRUE;
+	}
+
+	BOOL WritePartData(LPCSTR pData, DWORD cbData)
+	{
+		ATLTEST_CHECK(m_bInPart);
+		ATLTEST_CHECK(cbData != 0);
+		m_strPart.append(pData, cbData);
+		return TRUE;
+	}
+
+	BOOL EndField(BOOL bKeep)
+	{
+		ATLTEST_CHECK(m_bInPart && m_nState == ATL_MULTIPART_HEADERS);
+		m_bInPart = FALSE;
+		if (bKeep)
+			m_strLog += m_strPart + "\n";
+		return TRUE;
+	}
+
+	BOOL EndFile(BOOL bKeep)
+	{
+		ATLTEST_CHECK(m_bInPart && m_nState == ATL_MULTIPART_HEADERS);
+		m_bInPart = FALSE;
+		if (bKeep)
+			m_strLog += m_strPart + "\n";
+		return TRUE;
+	}
+
+	void AbortFile()
+	{
+		ATLTEST_CHECK(m_bInPart);
+		m_bInPart = FALSE;
+		// how much of the file was written depends on the window
+		m_strLog += "abort\n";
+	}
+
+	void OnParseError(LPCSTR szMessage)
+	{
+		m_strLog += std::string("error ") + szMessage + "\n";
+	}
+};
+
+// Parses the body and returns the log and the result. dwFirstRead is
+// ignored unless bWindowed.
+static std::string Parse(const std::string& strContentType, const std::string& strBody,
+	DWORD dwFlags, BOOL bWindowed, DWORD dwFirstRead, DWORD dwMaxRead)
+{
+	CTestParser parser(strBody);
+	parser.m_dwFirstRead = dwFirstRead;
+	parser.m_dwMaxRead = dwMaxRead;
+	std::string strCopy(strBody);
+	BOOL bRet = parser.BeginParse(strContentType.c_str(), (DWORD) strBody.size(),
+		bWindowed ? 0 : (DWORD) strBody.size(), bWindowed ? NULL : &strCopy[0], dwFlags, FALSE);
+	ATLTEST_CHECK(!parser.IsPending());
+	if (bWindowed)
+	{
+		// the window is only read up to the boundary that ends the body
+		ATLTEST_CHECK(parser.m_dwDelivered <= strBody.size());
+	}
+	else
+	{
+		ATLTEST_CHECK(parser.m_dwDelivered == 0);
+		ATLTEST_CHECK(strCopy == strBody);
+	}
+	return parser.m_strLog + (bRet ? "ok\n" : "failed\n");
+}
+
+// how often an asynchronous parse stopped for more data in each state
+static int g_rgPendingStates[ATL_MULTIPART_DONE+1];
+
+// Parses the body asynchronously, the way CHttpRequest does with
+// ATL_FORM_FLAG_ASYNC_BODY: the first dwAvailable bytes are there up front,
+// and the rest is read into GetReadBuffer in pieces of 1 to dwMaxRead
+// bytes (or as much as fits for 0). Read nFailAt fails with dwError, or
+// reads nothing if dwError is 0.
+static std::string ParseAsync(const std::string& strContentType, const std::string& strBody,
+	DWORD dwFlags, DWORD dwAvailable, DWORD dwMaxRead, int nFailAt = -1, DWORD dwError = 0)
+{
+	ATLASSERT(dwAvailable < strBody.size());
+
+	CTestParser parser(strBody);
+	parser.m_dwMaxRead = dwMaxRead;
+	BOOL bRet = parser.BeginParse(strContentType.c_str(), (DWORD) strBody.size(), dwAvailable, NULL, dwFlags, TRUE);
+	ATLTEST_CHECK(parser.m_dwDelivered <= dwAvailable);
+
+	for (int nRead=0; bRet && parser.IsPending(); nRead++)
+	{
+		ATL_MULTIPART_STATE nState = parser.GetState();
+		g_rgPendingStates[nState]++;
+
+		// everything the server had has been parsed
+		ATLTEST_CHECK(parser.m_dwDelivered == dwAvailable || nRead > 0);
+
+		LPSTR pBuffer = NULL;
+		DWORD dwLen = 0;
+		ATLTEST_CHECK(parser.GetReadBuffer(&pBuffer, &dwLen));
+		ATLTEST_CHECK(dwLen != 0 && dwLen <= strBody.size() - parser.m_dwDelivered);
+		ATLTEST_CHECK(parser.GetBodyOffset(pBuffer) == parser.m_dwDelivered);
+
+		if (nRead == nFailAt)
+		{
+			// the count of a failed read means nothing
+			parser.OnReadComplete(dwError ? dwLen + 1 : 0, dwError);
+			bRet = parser.ContinueMultiPartData();
+			ATLTEST_CHECK(!bRet);
+			ATLTEST_CHECK(!parser.IsPending());
+			ATLTEST_CHECK(!parser.GetReadBuffer(&pBuffer, &dwLen));
+			ATLTEST_CHECK((parser.m_strLog.find("abort\n") != std::string::npos) == (nState == ATL_MULTIPART_FILE));
+
+			// and the parse stays failed, without closing the file again
+			size_t nLog = parser.m_strLog.size();
+			ATLTEST_CHECK(!parser.ContinueMultiPartData());
+			ATLTEST_CHECK(parser.m_strLog.size() == nLog);
+			break;
+		}
+
+		if (dwMaxRead && dwLen > dwMaxRead)
+			dwLen = 1 + Random() % dwMaxRead;
+		memcpy(pBuffer, strBody.data() + parser.m_dwDelivered, dwLen);
+		parser.m_dwDelivered += dwLen;
+		parser.OnReadComplete(dwLen);
+		bRet = parser.ContinueMultiPartData();
+	}
+	ATLTEST_CHECK(!parser.IsPending());
+	return parser.m_strLog + (bRet ? "ok\n" : "failed\n");
+}
+
+static const char c_szBoundaryChars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789'+_-=?";
+
+static std::string RandomString(const char *szChars, size_t nLen)
+{
+	size_t nChars = strlen(szChars);
+	std::string str;
+	for (size_t i=0; i<nLen; i++)
+		str += szChars[Random() % nChars];
+	return str;
+}
+
+// Part data made of line breaks, dashes, pieces of the boundary and
+// boundaries that are not followed by a line break or "--"
+static std::string RandomData(const std::string& strBoundary, size_t nLen)
+{
+	std::string str;
+	while (str.size() < nLen)
+	{
+		switch (Random() % 8)
+		{
+		case 0:
+			str += "\r\n";
+			break;
+		case 1:
+			str += "\r\n--" + strBoundary.substr(0, Random() % (strBoundary.size() + 1));
+			break;
+		case 2:
+			str += "\r\n--" + strBoundary + "x";
+			break;
+		case 3:
+			str += "--" + strBoundary + "\r\n";
+			break;
+		case 4:
+			str += "\r\n--" + strBoundary + (Random() % 2 ? "\r" : "-");
+			break;
+		default:
+			str += RandomString("ab-\r\n\"", 1 + Random() % 16);
+			break;
+		}
+	}
+	str.resize(nLen);
+	return str;
+}
+
+struct CTestPart
+{
+	bool bFile;
+	std::string strName;
+	std::string strFileName;
+	std::string strContentType;		// empty for none
+	std::string strData;
+};
+
+// Builds a body out of the parts, with the boundary in pieces of random
+// size
+static std::string BuildBody(const std::string& strBoundary, const std::vector<CTestPart>& parts,
+	const std::string& strPreamble, const std::string& strEpilogue, size_t nMaxPad)
+{
+	std::string strBody = strPreamble;
+	for (size_t i=0; i<parts.size(); i++)
+	{
+		const CTestPart& part = parts[i];
+		strBody += "--" + strBoundary + "\r\n";
+		if (Random() % 2)
+			strBody += "X-Pad: " + RandomString("abc ", Random() % (nMaxPad + 1)) + "\r\n";
+		strBody += (Random() % 2) ? "Content-Disposition: form-data; " : "content-disposition: form-data; ";
+		strBody += (Random() % 2) ? "name=\"" + part.strName + "\"" : "NAME=\"" + part.strName + "\"";
+		if (part.bFile)
+			strBody += "; filename=\"" + part.strFileName + "\"";
+		strBody += "\r\n";
+		if (part.bFile && !part.strContentType.empty())
+			strBody += std::string((Random() % 2) ? "Content-Type:" : "content-type:") + (Random() % 2 ? " " : "\t ") + part.strContentType + "\r\n";
+		else if (!part.bFile && Random() % 4 == 0)
+			strBody += "Content-Type: text/plain\r\n";
+		strBody += "\r\n" + part.strData + "\r\n";
+	}
+	strBody += "--" + strBoundary + "--" + strEpilogue;
+	return strBody;
+}
+
+// What the parser should log for the parts
+static std::string ExpectedLog(const std::vector<CTestPart>& parts, DWORD dwFlags)
+{
+	std::string strLog;
+	for (size_t i=0; i<parts.size(); i++)
+	{
+		const CTestPart& part = parts[i];
+		if (part.bFile)
+		{
+			if (dwFlags & ATL_FORM_FLAG_REFUSE_FILES)
+				return strLog + "failed\n";
+			if (part.strFileName.empty() || (dwFlags & ATL_FORM_FLAG_IGNORE_FILES))
+				continue;
+			if ((dwFlags & ATL_FORM_FLAG_IGNORE_EMPTY_FILES) && part.strData.empty())
+				continue;
+			strLog += "file " + part.strName + " " + part.strFileName + " " +
+				(part.strContentType.empty() ? std::string("-") : part.strContentType) + " " + part.strData + "\n";
+		}
+		else
+		{
+			if ((dwFlags & ATL_FORM_FLAG_IGNORE_EMPTY_FIELDS) && part.strData.empty())
+				continue;
+			strLog += "field " + part.strName + "=" + part.strData + "\n";
+		}
+	}
+	return strLog + "ok\n";
+}
+
+static std::string ContentType(const std::string& strBoundary)
+{
+	if (Random() % 2)
+		return "multipart/form-data; boundary=\"" + strBoundary + "\"";
+	return "multipart/form-data; boundary=" + strBoundary;
+}
+
+// Whether data between two line breaks holds a boundary
+static bool ContainsRealBoundary(const std::string& strData, const std::string& strBoundary)
+{
+	std::string str = "\r\n" + strData + "\r\n";
+	return str.find("\r\n--" + strBoundary + "\r\n") != std::string::npos ||
+		str.find("\r\n--" + strBoundary + "--") != std::string::npos;
+}
+
+static std::vector<CTestPart> RandomParts(const std::string& strBoundary, size_t nMaxData)
+{
+	std::vector<CTestPart> parts;
+	size_t nParts = Random() % 5;
+	for (size_t i=0; i<nParts; i++)
+	{
+		CTestPart part;
+		part.bFile = Random() % 2 == 0;
+		part.strName = RandomString("abcxyz0123", 1 + Random() % 8);
+		if (part.bFile)
+		{
+			part.strFileName = (Random() % 6 == 0) ? std::string() : RandomString("abc.-_ ", 1 + Random() % 12);
+			if (Random() % 3)
+				part.strContentType = RandomString("abcdefghijklmnopqrstuvwxyz/-", 1 + Random() % 20);
+		}
+		do
+		{
+			part.strData = (Random() % 5 == 0) ? std::string() : RandomData(strBoundary, Random() % (nMaxData + 1));
+		}
+		while (ContainsRealBoundary(part.strData, strBoundary));
+		parts.push_back(part);
+	}
+	return parts;
+}
+
+static DWORD RandomFlags()
+{
+	static const DWORD c_rgFlags[] =
+	{
+		ATL_FORM_FLAG_NONE,
+		ATL_FORM_FLAG_IGNORE_FILES,
+		ATL_FORM_FLAG_REFUSE_FILES,
+		ATL_FORM_FLAG_IGNORE_EMPTY_FILES,
+		ATL_FORM_FLAG_IGNORE_EMPTY_FIELDS,
+		ATL_FORM_FLAG_IGNORE_EMPTY_FILES | ATL_FORM_FLAG_IGNORE_EMPTY_FIELDS,
+	};
+	return c_rgFlags[Random() % (sizeof(c_rgFlags)/sizeof(c_rgFlags[0]))];
+}
+
+// Random bodies, parsed where they are and through the window with the
+// first read cut at every offset
+static void TestSplitPoints(int nBodies)
+{
+	for (int n=0; n<nBodies; n++)
+	{
+		std::string strBoundary = RandomString(c_szBoundaryChars, 1 + Random() % (MAX_MIME_BOUNDARY_LEN - 3));
+		std::vector<CTestPart> parts = RandomParts(strBoundary, (n % 4 == 0) ? 2000 : 200);
+		std::string strPreamble;
+		if (Random() % 2)
+		{
+			// text before the first boundary, which may look like one
+			strPreamble = RandomData(strBoundary, Random() % 64);
+			if (ContainsRealBoundary("\r\n" + strPreamble, strBoundary) || strPreamble.find("--" + strBoundary) == 0)
+				strPreamble.clear();
+			strPreamble += "\r\n";
+		}
+		std::string strEpilogue = (Random() % 2) ? "\r\n" : "\r\n" + RandomData(strBoundary, Random() % 64);
+		std::string strBody = BuildBody(strBoundary, parts, strPreamble, strEpilogue, 400);
+		std::string strContentType = ContentType(strBoundary);
+		DWORD dwFlags = RandomFlags();
+
+		std::string strExpected = ExpectedLog(parts, dwFlags);
+		std::string strWhole = Parse(strContentType, strBody, dwFlags, FALSE, 0, 0);
+		ATLTEST_CHECK(strWhole == strExpected);
+		if (strWhole != strExpected)
+		{
+			printf("body %d parsed where it is:\n%s\nexpected:\n%s\n", n, strWhole.c_str(), strExpected.c_str());
+			continue;
+		}
+
+		DWORD dwMaxRead = (Random() % 3 == 0) ? 0 : 1 + Random() % 300;
+		for (DWORD dwFirst=1; dwFirst<=strBody.size(); dwFirst++)
+		{
+			std::string strWindowed = Parse(strContentType, strBody, dwFlags, TRUE, dwFirst, dwMaxRead);
+			ATLTEST_CHECK(strWindowed == strExpected);
+			if (strWindowed != strExpected)
+			{
+				printf("body %d, first read %u, reads of up to %u:\n%s\nexpected:\n%s\n",
+					n, dwFirst, dwMaxRead, strWindowed.c_str(), strExpected.c_str());
+				break;
+			}
+		}
+	}
+}
+
+// Parses a hand written body every way and checks that they agree
+static void CheckBody(const char *szBoundary, const std::string& strBody, DWORD dwFlags, const char *szExpected)
+{
+	std::string strContentType = std::string("multipart/form-data; boundary=") + szBoundary;
+	std::string strWhole = Parse(strContentType, strBody, dwFlags, FALSE, 0, 0);
+	ATLTEST_CHECK(strWhole == szExpected);
+	if (strWhole != szExpected)
+		printf("parsed where it is:\n%s\nexpected:\n%s\n", strWhole.c_str(), szExpected);
+
+	for (DWORD dwFirst=1; dwFirst<=strBody.size(); dwFirst++)
+	{
+		for (DWORD dwMaxRead=0; dwMaxRead<4; dwMaxRead++)
+		{
+			std::string strWindowed = Parse(strContentType, strBody, dwFlags, TRUE, dwFirst, dwMaxRead);
+			ATLTEST_CHECK(strWindowed == szExpected);
+			if (strWindowed != szExpected)
+			{
+				printf("first read %u, reads of up to %u:\n%s\nexpected:\n%s\n", dwFirst, dwMaxRead, strWindowed.c_str(), szExpected);
+				return;
+			}
+		}
+	}
+}
+
+// A boundary only counts after a line break, except at the first two
+// bytes of the body, which the window keeps in front of the data it
+// refills after
+static void TestLookBehind()
+{
+	static const char c_szParts[] = "\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\nvalue\r\n--b--\r\n";
+
+	CheckBody("b", std::string("--b") + c_szParts, 0, "field a=value\nok\n");
+	CheckBody("b", std::string("x--b") + c_szParts, 0, "field a=value\nok\n");
+	CheckBody("b", std::string("\r\n--b") + c_szParts, 0, "field a=value\nok\n");
+
+	// otherwise the first boundary is the one that ends the body
+	CheckBody("b", std::string("xy--b") + c_szParts, 0, "ok\n");
+	CheckBody("b", std::string("x\n--b") + c_szParts, 0, "ok\n");
+
+	// the line break before a boundary belongs to it, not to the data, and
+	// a line break without one is data
+	CheckBody("bnd",
+		"--bnd\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\n\r\n\r\n--bnd\r\n"
+		"Content-Disposition: form-data; name=\"b\"\r\n\r\nx\n--bnd\r\n--bnd\r\n"
+		"Content-Disposition: form-data; name=\"c\"\r\n\r\n\r--bnd\r\n--bnd--\r\n",
+		0, "field a=\r\n\nfield b=x\n--bnd\nfield c=\r--bnd\nok\n");
+}
+
+// The end of the window holds back the boundary's length plus one bytes,
+// since they may be the start of a boundary and its line break
+static void TestCarryOver()
+{
+	for (DWORD dwLen=1; dwLen<=MAX_MIME_BOUNDARY_LEN-3; dwLen+=(dwLen < 8 ? 1 : 13))
+	{
+		std::string strBoundary(dwLen, 'q');
+		for (DWORD dwData=0; dwData<2*ATLS_MULTIPART_WINDOW_SIZE; dwData+=(dwData < 64 ? 1 : 97))
+		{
+			// data that ends in near-boundaries of every length
+			std::string strData(dwData, 'd');
+			strData += "\r\n--" + strBoundary.substr(0, dwData % dwLen);
+			std::string strBody = "--" + strBoundary + "\r\nContent-Disposition: form-data; name=\"f\"\r\n\r\n" +
+				strData + "\r\n--" + strBoundary + "--\r\n";
+			std::string strExpected = "field f=" + strData + "\nok\n";
+			std::string strContentType = "multipart/form-data; boundary=" + strBoundary;
+			for (DWORD dwFirst=1; dwFirst<=strBody.size(); dwFirst+=(dwFirst < 300 ? 1 : 7))
+			{
+				std::string strWindowed = Parse(strContentType, strBody, 0, TRUE, dwFirst, dwLen + 3);
+				ATLTEST_CHECK(strWindowed == strExpected);
+				if (strWindowed != strExpected)
+				{
+					printf("boundary of %u, %u bytes of data, first read %u:\n%s\n", dwLen, dwData, dwFirst, strWindowed.c_str());
+					return;
+				}
+			}
+		}
+	}
+}
+
+// Part headers are only parsed once they are all in the window. Headers
+// that do not fit in it fail the windowed parse.
+static void TestLongHeaders()
+{
+	for (DWORD dwPad=0; dwPad<ATLS_MULTIPART_WINDOW_SIZE+64; dwPad+=(dwPad < 900 ? 61 : 1))
+	{
+		std::string strBody = "--b\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\n1\r\n--b\r\nX-Pad: " +
+			std::string(dwPad, 'p') + "\r\nContent-Disposition: form-data; name=\"z\"; filename=\"f\"\r\n"
+			"Content-Type: image/png\r\n\r\n2\r\n--b--\r\n";
+		std::string strContentType = "multipart/form-data; boundary=b";
+		std::string strExpected = "field a=1\nfile z f image/png 2\nok\n";
+		std::string strWhole = Parse(strContentType, strBody, 0, FALSE, 0, 0);
+		ATLTEST_CHECK(strWhole == strExpected);
+		if (strWhole != strExpected) printf("%s\n", strWhole.c_str());
+
+		// the headers with the two bytes the window keeps before them, and
+		// the first byte of the data
+		size_t nHeaders = strBody.find("\r\n\r\n2") + 5 - (strBody.find("X-Pad") - 2);
+		bool bFits = nHeaders <= ATLS_MULTIPART_WINDOW_SIZE;
+		for (DWORD dwFirst=1; dwFirst<=strBody.size(); dwFirst+=(dwFirst < 100 ? 1 : 5))
+		{
+			std::string strWindowed = Parse(strContentType, strBody, 0, TRUE, dwFirst, (dwFirst % 3) * 50);
+			if (bFits)
+			{
+				ATLTEST_CHECK(strWindowed == strExpected);
+			}
+			else
+			{
+				ATLTEST_CHECK(strWindowed == "field a=1\nerror Form-Data part headers do not fit in ATLS_MULTIPART_WINDOW_SIZE\n"
+					"error Malformed Form-Data\nfailed\n");
+			}
+		}
+	}
+}
+
+// Bodies that are cut short or malformed fail the same way parsed where
+// they are and through the window
+static void TestTruncated(int nBodies)
+{
+	for (int n=0; n<nBodies; n++)
+	{
+		std::string strBoundary = RandomString(c_szBoundaryChars, 1 + Random() % 20);
+		std::vector<CTestPart> parts = RandomParts(strBoundary, 300);
+		std::string strBody = BuildBody(strBoundary, parts, std::string(), "\r\n", 100);
+		std::string strContentType = ContentType(strBoundary);
+		DWORD dwFlags = RandomFlags();
+
+		strBody.resize(Random() % (strBody.size() + 1));
+		if (!strBody.empty() && Random() % 2)
+			strBody[Random() % strBody.size()] = "\r\n-\"x"[Random() % 5];
+
+		std::string strWhole = Parse(strContentType, strBody, dwFlags, FALSE, 0, 0);
+		for (DWORD dwFirst=1; dwFirst<=strBody.size(); dwFirst++)
+		{
+			std::string strWindowed = Parse(strContentType, strBody, dwFlags, TRUE, dwFirst, Random() % 40);
+			ATLTEST_CHECK(strWindowed == strWhole);
+			if (strWindowed != strWhole)
+			{
+				printf("body %d, first read %u:\n%s\nparsed where it is:\n%s\n", n, dwFirst, strWindowed.c_str(), strWhole.c_str());
+				break;
+			}
+		}
+	}
+}
+
+static void TestBadContentType()
+{
+	std::string strBody = "--b\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\n1\r\n--b--\r\n";
+	ATLTEST_CHECK(Parse("multipart/form-data", strBody, 0, FALSE, 0, 0) == "error Malformed Form-Data\nfailed\n");
+	ATLTEST_CHECK(Parse("multipart/form-data; BOUNDARY=b", strBody, 0, FALSE, 0, 0) == "field a=1\nok\n");
+	ATLTEST_CHECK(Parse("multipart/form-data; boundary=\"b\"; charset=x", strBody, 0, TRUE, 5, 0) == "field a=1\nok\n");
+	ATLTEST_CHECK(Parse("multipart/form-data; boundary=" + std::string(MAX_MIME_BOUNDARY_LEN, 'b'), strBody, 0, FALSE, 0, 0) ==
+		"error Malformed MIME boundary\nfailed\n");
+}
+
+// Random bodies parsed asynchronously, with the server holding every
+// length of the start of the body, and the rest read in pieces of random
+// size, so that the parse stops for data in the preamble, in the middle of
+// the headers of a part, in the middle of fields, files and skipped parts,
+// and in the middle of boundaries
+static void TestAsync(int nBodies)
+{
+	for (int n=0; n<nBodies; n++)
+	{
+		std::string strBoundary = RandomString(c_szBoundaryChars, 1 + Random() % 40);
+		std::vector<CTestPart> parts = RandomParts(strBoundary, (n % 4 == 0) ? 2000 : 200);
+		std::string strPreamble = (Random() % 2) ? std::string() : "preamble\r\n";
+		std::string strBody = BuildBody(strBoundary, parts, strPreamble, (Random() % 2) ? "\r\n" : "", 400);
+		std::string strContentType = ContentType(strBoundary);
+		DWORD dwFlags = RandomFlags();
+		std::string strExpected = ExpectedLog(parts, dwFlags);
+
+		for (DWORD dwAvailable=0; dwAvailable<strBody.size(); dwAvailable++)
+		{
+			DWORD dwMaxRead = (Random() % 4 == 0) ? 0 : 1 + Random() % ((Random() % 2) ? 8 : 600);
+			std::string strAsync = ParseAsync(strContentType, strBody, dwFlags, dwAvailable, dwMaxRead);
+			ATLTEST_CHECK(strAsync == strExpected);
+			if (strAsync != strExpected)
+			{
+				printf("body %d, %u bytes available, reads of up to %u:\n%s\nexpected:\n%s\n",
+					n, dwAvailable, dwMaxRead, strAsync.c_str(), strExpected.c_str());
+				break;
+			}
+		}
+	}
+
+	ATLTEST_CHECK(g_rgPendingStates[ATL_MULTIPART_PREAMBLE] != 0);
+	ATLTEST_CHECK(g_rgPendingStates[ATL_MULTIPART_HEADERS] != 0);
+	ATLTEST_CHECK(g_rgPendingStates[ATL_MULTIPART_FIELD] != 0);
+	ATLTEST_CHECK(g_rgPendingStates[ATL_MULTIPART_FILE] != 0);
+	ATLTEST_CHECK(g_rgPendingStates[ATL_MULTIPART_SKIP] != 0);
+}
+
+// A read that fails or reads nothing fails the parse wherever it stopped,
+// after the parts that were complete, and closes a file being read
+static void TestFailedReads(int nBodies)
+{
+	for (int n=0; n<nBodies; n++)
+	{
+		std::string strBoundary = RandomString(c_szBoundaryChars, 1 + Random() % 20);
+		std::vector<CTestPart> parts = RandomParts(strBoundary, 300);
+		std::string strBody = BuildBody(strBoundary, parts, std::string(), "\r\n", 100);
+		std::string strContentType = ContentType(strBoundary);
+		DWORD dwFlags = RandomFlags() & ~ATL_FORM_FLAG_REFUSE_FILES;
+		std::string strExpected = ExpectedLog(parts, dwFlags);
+		strExpected.resize(strExpected.size() - 3);
+
+		DWORD dwMaxRead = 1 + Random() % 64;
+		for (int nFailAt=0; ; nFailAt++)
+		{
+			DWORD dwError = (nFailAt % 2) ? 64 : 0;	// ERROR_NETNAME_DELETED
+			std::string strAsync = ParseAsync(strContentType, strBody, dwFlags, 0, dwMaxRead, nFailAt, dwError);
+			if (strAsync == strExpected + "ok\n")
+				break;		// there were fewer reads
+
+			// a failure, after some of the parts
+			std::string strLog = strAsync;
+			size_t nAbort = strLog.find("abort\n");
+			if (nAbort != std::string::npos)
+				strLog.erase(nAbort, 6);
+			ATLTEST_CHECK(strLog.size() >= 7 && strLog.compare(strLog.size() - 7, 7, "failed\n") == 0);
+			strLog.resize(strLog.size() - 7);
+			ATLTEST_CHECK(strExpected.compare(0, strLog.size(), strLog) == 0);
+		}
+	}
+}
+
+// The body may end right after the last boundary, without a line break
+static void TestEndOfData()
+{
+	static const char c_szPart[] = "--b\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\n1\r\n";
+	static const char *c_rgEnds[] = { "--b--", "--b--\r\n", "--b--x", "--b-", "--b", "--b\r\n", "--", "" };
+	static const char *c_rgExpected[] = { "field a=1\nok\n", "field a=1\nok\n", "field a=1\nok\n",
+		"failed\n", "failed\n", "failed\n", "failed\n", "failed\n" };
+
+	for (size_t i=0; i<sizeof(c_rgEnds)/sizeof(c_rgEnds[0]); i++)
+	{
+		std::string strBody = std::string(c_szPart) + c_rgEnds[i];
+		CheckBody("b", strBody, 0, c_rgExpected[i]);
+		for (DWORD dwAvailable=0; dwAvailable<strBody.size(); dwAvailable++)
+		{
+			for (DWORD dwMaxRead=0; dwMaxRead<4; dwMaxRead++)
+				ATLTEST_CHECK(ParseAsync("multipart/form-data; boundary=b", strBody, 0, dwAvailable, dwMaxRead) == c_rgExpected[i]);
+		}
+	}
+
+	CheckBody("b", "--b--", 0, "ok\n");
+	CheckBody("b", "--b\r\nContent-Disposition: form-data; name=\"f\"; filename=\"x\"\r\n\r\n\r\n--b--", 0, "file f x - \nok\n");
+}
+
+int main()
+{
+	TestLookBehind();
+	TestCarryOver();
+	TestLongHeaders();
+	TestBadContentType();
+	TestSplitPoints(400);
+	TestTruncated(400);
+	TestEndOfData();
+	TestAsync(200);
+	TestFailedReads(200);
+	return AtlTestResult("test_multipart");
+}
@@ -0,0 +1,327 @@
+// Stress test for the work stealing scheduler in atlpoolqueue.h.
+//
+// CTestPool runs the scheduler on std::thread workers the way
+// CWorkStealingThreadPool runs it on Windows threads.  The main case blocks
+// one worker inside a request and queues N more requests behind it, in that
+// worker's queue; the other workers must steal and run all of them while
+// the first one is still blocked.  TryEnterCriticalSection fails whenever
+// another thread holds the queue lock, so the test lock's TryLock fails at
+// random as well, which is what used to leave a thief asleep with work
+// still queued.  A second case has several threads queueing requests for
+// random workers while the workers run them, and checks that each one runs
+// exactly once.
+
+#include "atltest.h"
+#include <atlpoolqueue.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace ATL;
+
+static const int c_nWorkers = 4;
+
+static thread_local unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1664525 + 1013904223;
+	return g_nSeed >> 8;
+}
+
+static std::atomic<int> g_nTryLockFailPercent(0);
+
+class CTestLock
+{
+	std::mutex m_lock;
+
+public:
+	HRESULT Init()
+	{
+		return S_OK;
+	}
+
+	void Term()
+	{
+	}
+
+	HRESULT Lock()
+	{
+		m_lock.lock();
+		return S_OK;
+	}
+
+	BOOL TryLock()
+	{
+		if ((int) (Random() % 100) < g_nTryLockFailPercent)
+			return FALSE;
+		return m_lock.try_lock();
+	}
+
+	void Unlock()
+	{
+		m_lock.unlock();
+	}
+};
+
+struct CTestRequest
+{
+	std::atomic<int> nRuns;
+	DWORD dwWorker;				// worker that ran it, 1 based
+	DWORD dwQueueInfo;
+	BOOL bBlock;				// wait for the gate before returning
+
+	CTestRequest() : nRuns(0), dwWorker(0), dwQueueInfo(0), bBlock(FALSE)
+	{
+	}
+};
+
+// auto-reset event
+class CTestEvent
+{
+	std::mutex m_lock;
+	std::condition_variable m_cv;
+	bool m_bSet;
+
+public:
+	CTestEvent() : m_bSet(false)
+	{
+	}
+
+	void Set()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_bSet = true;
+		}
+		m_cv.notify_one();
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		while (!m_bSet)
+			m_cv.wait(lock);
+		m_bSet = false;
+	}
+};
+
+class CTestPool;
+typedef CAtlWorkStealingScheduler<CTestPool, CTestRequest *, CTestLock> CTestScheduler;
+
+struct CTestSlot : public CTestScheduler::CSlot
+{
+	CTestEvent wake;
+	std::thread thread;
+};
+
+class CTestPool : public CTestScheduler
+{
+	std::mutex m_gateLock;
+	std::condition_variable m_gateCv;
+	bool m_bGateOpen;
+
+public:
+	std::atomic<int> m_nDone;
+	std::atomic<int> m_nBlocked;
+
+	CTestPool() : m_bGateOpen(false), m_nDone(0), m_nBlocked(0)
+	{
+		m_ppSlots = new CSlot*[c_nWorkers];
+		for (int i=0; i<c_nWorkers; i++)
+		{
+			CTestSlot *pSlot = new CTestSlot;
+			pSlot->nIndex = i;
+			pSlot->lIdle = 0;
+			pSlot->lExit = 0;
+			pSlot->queue.Init();
+			m_ppSlots[i] = pSlot;
+		}
+		m_nWorkers = c_nWorkers;
+		for (int i=0; i<c_nWorkers; i++)
+			GetSlot(i)->thread = std::thread(&CTestPool::ThreadProc, this, GetSlot(i));
+	}
+
+	~CTestPool()
+	{
+		OpenGate();
+		for (int i=0; i<c_nWorkers; i++)
+		{
+			InterlockedExchange(&m_ppSlots[i]->lExit, 1);
+			GetSlot(i)->wake.Set();
+		}
+		for (int i=0; i<c_nWorkers; i++)
+			GetSlot(i)->thread.join();
+		for (int i=0; i<c_nWorkers; i++)
+			delete GetSlot(i);
+		delete [] m_ppSlots;
+	}
+
+	CTestSlot * GetSlot(int nIndex)
+	{
+		return static_cast<CTestSlot*>(m_ppSlots[nIndex]);
+	}
+
+	void OpenGate()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_gateLock);
+			m_bGateOpen = true;
+		}
+		m_gateCv.notify_all();
+	}
+
+	// waits for nDone requests to finish, for up to nSeconds
+	bool WaitForDone(int nDone, int nSeconds)
+	{
+		std::chrono::steady_clock::time_point deadline =
+			std::chrono::steady_clock::now() + std::chrono::seconds(nSeconds);
+		while (m_nDone < nDone)
+		{
+			if (std::chrono::steady_clock::now() > deadline)
+				return false;
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+		return true;
+	}
+
+	// CAtlWorkStealingScheduler
+	void WakeWorker(CSlot *pSlot)
+	{
+		static_cast<CTestSlot*>(pSlot)->wake.Set();
+	}
+
+	void WaitForWake(CSlot *pSlot)
+	{
+		static_cast<CTestSlot*>(pSlot)->wake.Wait();
+	}
+
+protected:
+	void ThreadProc(CTestSlot *pSlot)
+	{
+		g_nSeed = 12345 + pSlot->nIndex;
+		CTestRequest *pRequest;
+		DWORD dwQueueInfo;
+		while (WaitForRequest(pSlot, &pRequest, &dwQueueInfo))
+		{
+			pRequest->dwWorker = pSlot->nIndex + 1;
+			pRequest->dwQueueInfo = dwQueueInfo;
+			pRequest->nRuns++;
+			if (pRequest->bBlock)
+			{
+				m_nBlocked++;
+				std::unique_lock<std::mutex> lock(m_gateLock);
+				while (!m_bGateOpen)
+					m_gateCv.wait(lock);
+				m_nBlocked--;
+			}
+			m_nDone++;
+		}
+	}
+};
+
+// Blocks a worker and queues nRequests behind it
+static void TestBlockedWorker(int nRequests, int nTryLockFailPercent)
+{
+	g_nTryLockFailPercent = nTryLockFailPercent;
+	CTestPool pool;
+
+	// let the workers go idle first, as they are between bursts of work
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+	CTestRequest blocker;
+	blocker.bBlock = TRUE;
+	ATLTEST_CHECK(pool.Queue(&blocker, 1));
+	while (pool.m_nBlocked == 0)
+		std::this_thread::yield();
+
+	// normally worker 1 itself, unless another worker was awake to steal it
+	DWORD dwBlocked = blocker.dwWorker;
+	std::vector<CTestRequest> requests(nRequests);
+	for (int i=0; i<nRequests; i++)
+		ATLTEST_CHECK(pool.Queue(&requests[i], dwBlocked));
+
+	// everything behind the blocked worker runs while it is still blocked
+	bool bDone = pool.WaitForDone(nRequests, 20);
+	if (!bDone)
+		printf("%d of %d requests ran behind the blocked worker (try lock failing %d%%)\n",
+			(int) pool.m_nDone, nRequests, nTryLockFailPercent);
+	ATLTEST_CHECK(bDone);
+	ATLTEST_CHECK(pool.m_nBlocked == 1);
+
+	pool.OpenGate();
+	ATLTEST_CHECK(pool.WaitForDone(nRequests + 1, 20));
+
+	for (int i=0; i<nRequests; i++)
+	{
+		ATLTEST_CHECK(requests[i].nRuns == 1);
+		if (bDone)
+		{
+			ATLTEST_CHECK(requests[i].dwWorker != dwBlocked);
+			ATLTEST_CHECK((requests[i].dwQueueInfo & ATLSRV_QUEUE_STOLEN) != 0);
+		}
+	}
+	ATLTEST_CHECK(pool.m_lQueued == 0);
+	if (bDone)
+		ATLTEST_CHECK(pool.m_lStolen == nRequests + ((blocker.dwQueueInfo & ATLSRV_QUEUE_STOLEN) != 0));
+}
+
+// Several threads queue requests for random workers
+static void TestProducers(int nTryLockFailPercent)
+{
+	static const int c_nProducers = 4;
+	static const int c_nPerProducer = 20000;
+
+	g_nTryLockFailPercent = nTryLockFailPercent;
+	CTestPool pool;
+	std::vector<CTestRequest> requests(c_nProducers * c_nPerProducer);
+
+	std::vector<std::thread> producers;
+	for (int p=0; p<c_nProducers; p++)
+	{
+		producers.push_back(std::thread([&pool, &requests, p]()
+		{
+			g_nSeed = 777 + p;
+			for (int i=0; i<c_nPerProducer; i++)
+			{
+				ATLTEST_CHECK(pool.Queue(&requests[p * c_nPerProducer + i], Random() % (c_nWorkers + 1)));
+				if (Random() % 64 == 0)
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+			}
+		}));
+	}
+	for (size_t p=0; p<producers.size(); p++)
+		producers[p].join();
+
+	ATLTEST_CHECK(pool.WaitForDone((int) requests.size(), 30));
+	int nStolen = 0;
+	for (size_t i=0; i<requests.size(); i++)
+	{
+		ATLTEST_CHECK(requests[i].nRuns == 1);
+		nStolen += (requests[i].dwQueueInfo & ATLSRV_QUEUE_STOLEN) != 0;
+	}
+	ATLTEST_CHECK(pool.m_lQueued == 0);
+	ATLTEST_CHECK(pool.m_lStolen == nStolen);
+}
+
+int main()
+{
+	static const int c_rgRequests[] = { 1, 2, 3, 4, 10, 100, 1000 };
+	static const int c_rgFailPercent[] = { 0, 50, 100 };
+	for (int nRound=0; nRound<20; nRound++)
+	{
+		for (size_t f=0; f<sizeof(c_rgFailPercent)/sizeof(c_rgFailPercent[0]); f++)
+		{
+			for (size_t n=0; n<sizeof(c_rgRequests)/sizeof(c_rgRequests[0]); n++)
+				TestBlockedWorker(c_rgRequests[n], c_rgFailPercent[f]);
+		}
+	}
+
+	TestProducers(0);
+	TestProducers(50);
+	return AtlTestResult("test_pool_queue");
+}
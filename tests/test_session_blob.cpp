@@ -0,0 +1,337 @@
+// Tests for the packed session variables in atlsessblob.h.
+//
+// Random sequences of SetValue calls are checked against a plain list of
+// names and values: same variables in the same order, a consistent index,
+// and the size GetSizeWithValue predicted.  IsValid and Load are checked
+// against truncated and corrupted blobs.  On Windows, CSessionBlob from
+// atlsession.h is also checked with VARIANT values.
+
+#include "atltest.h"
+#include <atlsessblob.h>
+
+#ifdef _WIN32
+#include <atlsession.h>
+#endif
+
+#include <string>
+#include <utility>
+
+using namespace ATL;
+
+typedef std::vector<std::pair<std::string, std::vector<BYTE> > > CModel;
+
+static unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1664525 + 1013904223;
+	return g_nSeed >> 8;
+}
+
+static DWORD GetModelSize(const CModel& model)
+{
+	if (model.empty())
+		return 0;
+	DWORD cbData = sizeof(ATL_SESSION_BLOB_HEADER);
+	for (size_t i=0; i<model.size(); i++)
+		cbData += (DWORD)(sizeof(ATL_SESSION_BLOB_ENTRY) + model[i].first.size() + model[i].second.size());
+	return cbData;
+}
+
+// Reads every variable back out of the blob, and compares them with the model.
+static bool Matches(const CSessionBlobBase& blob, const CModel& model)
+{
+	if (blob.GetCount() != model.size() || blob.GetSize() != GetModelSize(model))
+		return false;
+	if (blob.GetSize() && !CSessionBlobBase::IsValid(blob.GetData(), blob.GetSize()))
+		return false;
+
+	for (DWORD i=0; i<blob.GetCount(); i++)
+	{
+		DWORD cbName = 0;
+		LPCSTR szName = blob.GetNameAt(i, &cbName);
+		DWORD cbValue = 0;
+		const BYTE *pValue = blob.GetValueAt(i, &cbValue);
+		if (std::string(szName, cbName) != model[i].first ||
+			std::vector<BYTE>(pValue, pValue + cbValue) != model[i].second ||
+			blob.Find(model[i].first.c_str()) != (int) i)
+			return false;
+	}
+	return true;
+}
+
+static std::vector<BYTE> MakeValue(size_t cb)
+{
+	std::vector<BYTE> value(cb);
+	for (size_t i=0; i<cb; i++)
+		value[i] = (BYTE) Random();
+	return value;
+}
+
+static void TestSetValue()
+{
+	// "b!" and "aB" have the same hash
+	static const char *c_rgszNames[] = { "a", "b", "name", "b!", "aB", "", "a long variable name", "x" };
+	const size_t nNames = sizeof(c_rgszNames) / sizeof(c_rgszNames[0]);
+	ATLTEST_CHECK(CSessionBlobBase::HashName("b!", 2) == CSessionBlobBase::HashName("aB", 2));
+
+	for (int nRun = 0; nRun < 200; nRun++)
+	{
+		CSessionBlobBase blob;
+		CModel model;
+		for (int nStep = 0; nStep < 60; nStep++)
+		{
+			const char *szName = c_rgszNames[Random() % nNames];
+			size_t nModel = 0;
+			while (nModel < model.size() && model[nModel].first != szName)
+				nModel++;
+
+			if (Random() % 4 == 0)
+			{
+				// remove, which isn't there half of the time
+				HRESULT hr = blob.SetValue(szName, NULL, 0);
+				if (nModel < model.size())
+				{
+					ATLTEST_CHECK(hr == S_OK);
+					model.erase(model.begin() + nModel);
+				}
+				else
+					ATLTEST_CHECK(hr == S_FALSE);
+			}
+			else
+			{
+				// values of no bytes are still values
+				std::vector<BYTE> value = MakeValue(Random() % ((nStep % 10) ? 24 : 300));
+				BYTE bEmpty = 0;
+				const BYTE *pValue = value.empty() ? &bEmpty : &value[0];
+
+				DWORD cbExpected = 0;
+				ATLTEST_CHECK(blob.GetSizeWithValue(szName, (DWORD) value.size(), &cbExpected) == S_OK);
+				ATLTEST_CHECK(blob.SetValue(szName, pValue, (DWORD) value.size()) == S_OK);
+				ATLTEST_CHECK(blob.GetSize() == cbExpected);
+
+				// a replaced variable keeps its place
+				if (nModel < model.size())
+					model[nModel].second = value;
+				else
+					model.push_back(std::make_pair(std::string(szName), value));
+			}
+
+			bool bMatches = Matches(blob, model);
+			ATLTEST_CHECK(bMatches);
+			if (!bMatches)
+			{
+				printf("run %d step %d differs\n", nRun, nStep);
+				return;
+			}
+		}
+
+		for (size_t i=0; i<nNames; i++)
+		{
+			bool bFound = false;
+			for (size_t j=0; j<model.size(); j++)
+				bFound = bFound || model[j].first == c_rgszNames[i];
+			if (!bFound)
+				ATLTEST_CHECK(blob.Find(c_rgszNames[i]) == -1);
+		}
+	}
+
+	CSessionBlobBase blob;
+	ATLTEST_CHECK(blob.SetValue(NULL, NULL, 0) == E_INVALIDARG);
+	ATLTEST_CHECK(blob.Find(NULL) == -1);
+	ATLTEST_CHECK(blob.GetSize() == 0 && blob.GetData() == NULL);
+}
+
+// Builds a blob holding a few variables, and returns a copy of its bytes.
+static std::vector<BYTE> MakeBlob(CModel *pModel)
+{
+	CSessionBlobBase blob;
+	static const char *c_rgszNames[] = { "first", "second", "3", "fourth" };
+	for (size_t i=0; i<sizeof(c_rgszNames)/sizeof(c_rgszNames[0]); i++)
+	{
+		std::vector<BYTE> value = MakeValue(5 + i * 7);
+		blob.SetValue(c_rgszNames[i], &value[0], (DWORD) value.size());
+		pModel->push_back(std::make_pair(std::string(c_rgszNames[i]), value));
+	}
+	return std::vector<BYTE>(blob.GetData(), blob.GetData() + blob.GetSize());
+}
+
+static void CheckRejected(const std::vector<BYTE>& data)
+{
+	ATLTEST_CHECK(!CSessionBlobBase::IsValid(data.empty() ? NULL : &data[0], (DWORD) data.size()));
+	CSessionBlobBase blob;
+	BYTE b = 0;
+	blob.SetValue("left over", &b, 1);
+	ATLTEST_CHECK(blob.Load(data.empty() ? &b : &data[0], (DWORD) data.size()) == (data.empty() ? S_OK : E_FAIL));
+	ATLTEST_CHECK(blob.GetCount() == 0 && blob.GetSize() == 0);
+}
+
+static void TestLoad()
+{
+	CModel model;
+	std::vector<BYTE> data = MakeBlob(&model);
+
+	CSessionBlobBase blob;
+	ATLTEST_CHECK(blob.Load(&data[0], (DWORD) data.size()) == S_OK);
+	ATLTEST_CHECK(Matches(blob, model));
+
+	// the index is read without assuming the data is aligned
+	std::vector<BYTE> unaligned(data.size() + 1);
+	memcpy(&unaligned[1], &data[0], data.size());
+	ATLTEST_CHECK(CSessionBlobBase::IsValid(&unaligned[1], (DWORD) data.size()));
+	ATLTEST_CHECK(blob.Load(&unaligned[1], (DWORD) data.size()) == S_OK);
+	ATLTEST_CHECK(Matches(blob, model));
+
+	// loading nothing empties the blob
+	ATLTEST_CHECK(blob.Load(NULL, 0) == S_OK);
+	ATLTEST_CHECK(blob.GetCount() == 0 && blob.GetSize() == 0);
+	ATLTEST_CHECK(blob.Load(NULL, 8) == E_INVALIDARG);
+
+	// a blob that was loaded can be changed like any other
+	ATLTEST_CHECK(blob.Load(&data[0], (DWORD) data.size()) == S_OK);
+	ATLTEST_CHECK(blob.SetValue("second", NULL, 0) == S_OK);
+	model.erase(model.begin() + 1);
+	ATLTEST_CHECK(Matches(blob, model));
+}
+
+static void TestIsValid()
+{
+	CModel model;
+	std::vector<BYTE> data = MakeBlob(&model);
+	ATLTEST_CHECK(CSessionBlobBase::IsValid(&data[0], (DWORD) data.size()));
+	ATLTEST_CHECK(!CSessionBlobBase::IsValid(NULL, (DWORD) data.size()));
+
+	// every variable ends inside the blob, so cutting any of it off is caught
+	for (size_t cb = 0; cb < data.size(); cb++)
+		CheckRejected(std::vector<BYTE>(data.begin(), data.begin() + cb));
+
+	ATL_SESSION_BLOB_HEADER header;
+	memcpy(&header, &data[0], sizeof(header));
+
+	std::vector<BYTE> bad(data);
+	header.dwSignature ^= 0x100;
+	memcpy(&bad[0], &header, sizeof(header));
+	CheckRejected(bad);
+
+	// more entries than would fit in the blob
+	memcpy(&header, &data[0], sizeof(header));
+	header.nCount = (DWORD)(data.size() / sizeof(ATL_SESSION_BLOB_ENTRY));
+	bad = data;
+	memcpy(&bad[0], &header, sizeof(header));
+	CheckRejected(bad);
+	header.nCount = 0xffffffff;
+	memcpy(&bad[0], &header, sizeof(header));
+	CheckRejected(bad);
+
+	// each field of each index entry pointing outside the data
+	for (DWORD i=0; i<model.size(); i++)
+	{
+		size_t nEntry = sizeof(ATL_SESSION_BLOB_HEADER) + i * sizeof(ATL_SESSION_BLOB_ENTRY);
+		ATL_SESSION_BLOB_ENTRY entry;
+		memcpy(&entry, &data[nEntry], sizeof(entry));
+		DWORD dwDataOffset = (DWORD)(sizeof(ATL_SESSION_BLOB_HEADER) + model.size() * sizeof(ATL_SESSION_BLOB_ENTRY));
+
+		ATL_SESSION_BLOB_ENTRY rgBad[6] = { entry, entry, entry, entry, entry, entry };
+		rgBad[0].dwOffset = dwDataOffset - 1;			// into the index
+		rgBad[1].dwOffset = (DWORD) data.size() + 1;	// past the end
+		rgBad[2].cbName = (DWORD) data.size();
+		rgBad[3].cbValue = (DWORD) data.size() - entry.dwOffset - entry.cbName + 1;
+		rgBad[4].cbName = 0xffffffff;					// wraps around
+		rgBad[5].cbValue = 0xfffffff0;
+		for (size_t j=0; j<sizeof(rgBad)/sizeof(rgBad[0]); j++)
+		{
+			bad = data;
+			memcpy(&bad[nEntry], &rgBad[j], sizeof(rgBad[j]));
+			CheckRejected(bad);
+		}
+	}
+
+	// random damage to the header and index is either caught, or
+	// leaves every variable inside the blob
+	for (int i=0; i<20000; i++)
+	{
+		bad = data;
+		size_t cbIndex = sizeof(ATL_SESSION_BLOB_HEADER) + model.size() * sizeof(ATL_SESSION_BLOB_ENTRY);
+		int nChanges = 1 + Random() % 3;
+		for (int j=0; j<nChanges; j++)
+			bad[Random() % cbIndex] = (BYTE) Random();
+		if (Random() % 4 == 0)
+			bad.resize(Random() % bad.size());
+
+		CSessionBlobBase blob;
+		if (blob.Load(bad.empty() ? NULL : &bad[0], (DWORD) bad.size()) != S_OK)
+			continue;
+		for (DWORD k=0; k<blob.GetCount(); k++)
+		{
+			DWORD cbName = 0;
+			DWORD cbValue = 0;
+			const BYTE *pName = (const BYTE *) blob.GetNameAt(k, &cbName);
+			const BYTE *pValue = blob.GetValueAt(k, &cbValue);
+			ATLTEST_CHECK(pName >= blob.GetData() && pValue + cbValue <= blob.GetData() + blob.GetSize());
+		}
+	}
+}
+
+#ifdef _WIN32
+
+// CSessionBlob packs VARIANTs through CComVariant::WriteToStream
+static void TestVariants()
+{
+	CSessionBlob::VarMapType vars;
+	vars.SetAt("count", CComVariant(42));
+	vars.SetAt("name", CComVariant(L"a string value"));
+	vars.SetAt("price", CComVariant(9.95));
+
+	CSessionBlob blob;
+	ATLTEST_CHECK(blob.Pack(vars) == S_OK);
+	ATLTEST_CHECK(blob.GetCount() == 3);
+	ATLTEST_CHECK(CSessionBlobBase::IsValid(blob.GetData(), blob.GetSize()));
+
+	CComVariant val(L"a new value");
+	DWORD cbExpected = 0;
+	ATLTEST_CHECK(blob.GetSizeWithVariable("name", &val, &cbExpected) == S_OK);
+	ATLTEST_CHECK(blob.SetVariable("name", &val) == S_OK);
+	ATLTEST_CHECK(blob.GetSize() == cbExpected);
+	ATLTEST_CHECK(blob.SetVariable("price", NULL) == S_OK);
+	ATLTEST_CHECK(blob.SetVariable("price", NULL) == S_FALSE);
+
+	CComVariant vOut;
+	ATLTEST_CHECK(blob.GetVariable("count", &vOut) == S_OK && vOut == CComVariant(42));
+	ATLTEST_CHECK(blob.GetVariable("price", &vOut) == S_FALSE);
+
+	CSessionBlob::VarMapType unpacked;
+	ATLTEST_CHECK(blob.Unpack(unpacked) == S_OK);
+	ATLTEST_CHECK(unpacked.GetCount() == 2);
+	const CSessionBlob::VarMapType::CPair *pPair = unpacked.Lookup("name");
+	ATLTEST_CHECK(pPair && pPair->m_value == val);
+
+	// enumeration visits each variable once, with its name
+	int nSeen = 0;
+	POSITION pos = blob.GetStartPosition();
+	while (pos)
+	{
+		char szName[16];
+		CComVariant vNext;
+		ATLTEST_CHECK(blob.GetNextVariable(pos, &vNext, szName, sizeof(szName)) == S_OK);
+		ATLTEST_CHECK(unpacked.Lookup(szName) != NULL);
+		nSeen++;
+	}
+	ATLTEST_CHECK(nSeen == 2);
+
+	CSessionBlob copy;
+	ATLTEST_CHECK(copy.CopyFrom(blob) == S_OK);
+	ATLTEST_CHECK(copy.GetSize() == blob.GetSize() && !memcmp(copy.GetData(), blob.GetData(), blob.GetSize()));
+}
+
+#endif // _WIN32
+
+int main()
+{
+	TestSetValue();
+	TestLoad();
+	TestIsValid();
+#ifdef _WIN32
+	TestVariants();
+#endif
+	return AtlTestResult("test_session_blob");
+}
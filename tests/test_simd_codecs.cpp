@@ -0,0 +1,306 @@
+// Tests for the vectorized base64 and hex codecs in atlsimdenc.h.
+//
+// Every AtlFast* call is compared with the atlenc.h routine it replaces:
+// same return value, same length, and the same bytes in the whole output
+// buffer, including bytes past the reported length.  Each check runs once
+// per instruction set the processor supports, from the scalar fallback up.
+// Built with ATL_NO_SIMD_CODECS, the same checks cover the plain
+// forwarders.  Inputs are allocated at their exact size, and outputs
+// with one guard byte, so that overruns show up in a sanitizer build or
+// in the comparison.
+
+#include "atltest.h"
+#include "atltestenc.h"
+#include <atlsimdenc.h>
+
+#include <ctype.h>
+#include <string>
+
+using namespace ATL;
+
+static unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1664525 + 1013904223;
+	return g_nSeed >> 8;
+}
+
+static std::vector<BYTE> MakeRandom(size_t cb)
+{
+	std::vector<BYTE> data(cb);
+	for (size_t i=0; i<cb; i++)
+		data[i] = (BYTE) Random();
+	return data;
+}
+
+static const char c_szAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Encodes with both codecs and returns the reference encoding
+static std::string CheckBase64Encode(const std::vector<BYTE>& data, DWORD dwFlags)
+{
+	int nSrcLen = (int) data.size();
+	int nRequired = Base64EncodeGetRequiredLength(nSrcLen, dwFlags);
+
+	// a zero-length source still needs a valid pointer
+	std::vector<BYTE> src(data);
+	src.push_back(0);
+	std::vector<char> expected(nRequired + 1, '#');
+	std::vector<char> actual(nRequired + 1, '#');
+	int nExpected = nRequired;
+	int nActual = nRequired;
+	BOOL bExpected = Base64Encode(&src[0], nSrcLen, &expected[0], &nExpected, dwFlags);
+	BOOL bActual = AtlFastBase64Encode(&src[0], nSrcLen, &actual[0], &nActual, dwFlags);
+
+	ATLTEST_CHECK(bExpected == bActual);
+	ATLTEST_CHECK(nExpected == nActual);
+	if (expected != actual)
+		printf("base64 encoding of %d bytes with flags %u differs\n", nSrcLen, (unsigned) dwFlags);
+	ATLTEST_CHECK(expected == actual);
+	return std::string(&expected[0], nExpected);
+}
+
+// Decodes with both codecs, into a buffer of nDestLen bytes or none, and
+// returns the reference output
+static std::vector<BYTE> CheckBase64Decode(const std::string& str, int nDestLen, bool bNullDest = false)
+{
+	std::vector<char> src(str.begin(), str.end());
+	src.push_back(0);
+	int nSrcLen = (int) str.size();
+
+	std::vector<BYTE> expected(nDestLen + 1, 0xcc);
+	std::vector<BYTE> actual(nDestLen + 1, 0xcc);
+	int nExpected = nDestLen;
+	int nActual = nDestLen;
+	BOOL bExpected = Base64Decode(&src[0], nSrcLen, bNullDest ? NULL : &expected[0], &nExpected);
+	BOOL bActual = AtlFastBase64Decode(&src[0], nSrcLen, bNullDest ? NULL : &actual[0], &nActual);
+
+	ATLTEST_CHECK(bExpected == bActual);
+	ATLTEST_CHECK(nExpected == nActual);
+	if (expected != actual)
+		printf("base64 decoding of %d characters into %d bytes differs\n", nSrcLen, nDestLen);
+	ATLTEST_CHECK(expected == actual);
+	if (bNullDest)
+		return std::vector<BYTE>();
+	expected.resize(nExpected <= nDestLen ? nExpected : 0);
+	return expected;
+}
+
+static std::string CheckHexEncode(const std::vector<BYTE>& data)
+{
+	int nSrcLen = (int) data.size();
+	int nRequired = AtlHexEncodeGetRequiredLength(nSrcLen);
+
+	std::vector<BYTE> src(data);
+	src.push_back(0);
+	std::vector<char> expected(nRequired, '#');
+	std::vector<char> actual(nRequired, '#');
+	int nExpected = nRequired;
+	int nActual = nRequired;
+	BOOL bExpected = AtlHexEncode(&src[0], nSrcLen, &expected[0], &nExpected);
+	BOOL bActual = AtlFastHexEncode(&src[0], nSrcLen, &actual[0], &nActual);
+
+	ATLTEST_CHECK(bExpected == bActual);
+	ATLTEST_CHECK(nExpected == nActual);
+	if (expected != actual)
+		printf("hex encoding of %d bytes differs\n", nSrcLen);
+	ATLTEST_CHECK(expected == actual);
+	return std::string(&expected[0], nExpected);
+}
+
+// returns whether the string decoded
+static bool CheckHexDecode(const std::string& str, std::vector<BYTE> *pData = NULL)
+{
+	std::vector<char> src(str.begin(), str.end());
+	src.push_back(0);
+	int nSrcLen = (int) str.size();
+	int nDestLen = AtlHexDecodeGetRequiredLength(nSrcLen);
+
+	std::vector<BYTE> expected(nDestLen + 1, 0xcc);
+	std::vector<BYTE> actual(nDestLen + 1, 0xcc);
+	int nExpected = nDestLen;
+	int nActual = nDestLen;
+	BOOL bExpected = AtlHexDecode(&src[0], nSrcLen, &expected[0], &nExpected);
+	BOOL bActual = AtlFastHexDecode(&src[0], nSrcLen, &actual[0], &nActual);
+
+	ATLTEST_CHECK(bExpected == bActual);
+	ATLTEST_CHECK(nExpected == nActual);
+	if (bExpected)
+	{
+		// on failure atlenc.h leaves a partial output that callers ignore
+		if (expected != actual)
+			printf("hex decoding of %d characters differs\n", nSrcLen);
+		ATLTEST_CHECK(expected == actual);
+		if (pData)
+			pData->assign(expected.begin(), expected.begin() + nExpected);
+	}
+	return bExpected != FALSE;
+}
+
+static void TestBase64Vectors()
+{
+	// RFC 4648, section 10
+	static const char *s_rgszPlain[] = { "", "f", "fo", "foo", "foob", "fooba", "foobar" };
+	static const char *s_rgszEncoded[] = { "", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy" };
+	for (size_t i=0; i<sizeof(s_rgszPlain)/sizeof(s_rgszPlain[0]); i++)
+	{
+		std::vector<BYTE> data(s_rgszPlain[i], s_rgszPlain[i] + strlen(s_rgszPlain[i]));
+		ATLTEST_CHECK(CheckBase64Encode(data, ATL_BASE64_FLAG_NONE) == s_rgszEncoded[i]);
+		ATLTEST_CHECK(CheckBase64Decode(s_rgszEncoded[i], (int) data.size()) == data);
+	}
+
+	std::vector<BYTE> all;
+	for (int i=0; i<256; i++)
+		all.push_back((BYTE) i);
+	std::string str = CheckHexEncode(all);
+	ATLTEST_CHECK(str.compare(0, 8, "00010203") == 0 && str.compare(str.size() - 4, 4, "FEFF") == 0);
+}
+
+static void TestBase64RoundTrips()
+{
+	// every length around the vector block sizes and the 57-byte lines,
+	// with and without padding and line breaks
+	std::vector<size_t> sizes;
+	for (size_t cb=0; cb<=200; cb++)
+		sizes.push_back(cb);
+	static const size_t c_rgLarge[] = { 57 * 10, 57 * 10 + 1, 1023, 1024, 1025, 4096 + 7, 65536 + 2 };
+	sizes.insert(sizes.end(), c_rgLarge, c_rgLarge + sizeof(c_rgLarge)/sizeof(c_rgLarge[0]));
+
+	for (size_t i=0; i<sizes.size(); i++)
+	{
+		std::vector<BYTE> data = MakeRandom(sizes[i]);
+		for (DWORD dwFlags = 0; dwFlags <= (ATL_BASE64_FLAG_NOPAD | ATL_BASE64_FLAG_NOCRLF); dwFlags++)
+		{
+			std::string str = CheckBase64Encode(data, dwFlags);
+			if (CheckBase64Decode(str, (int) data.size()) != data)
+				printf("%u bytes with flags %u do not round-trip\n", (unsigned) data.size(), (unsigned) dwFlags);
+
+			// without an output buffer only the length comes back
+			CheckBase64Decode(str, (int) data.size(), true);
+			if (!data.empty())
+				CheckBase64Decode(str, (int) data.size() - 1, true);
+		}
+	}
+}
+
+static void TestBase64Decode()
+{
+	// characters outside the alphabet are skipped wherever they are,
+	// including inside what would be a vector block; a NUL ends the input
+	static const char *s_rgszInsert[] = { "\r\n", "=", " ", "\t", "-", "_", "\x80", "\xff", "!", "@", "[", "`", "{" };
+	std::string strBase = CheckBase64Encode(MakeRandom(300), ATL_BASE64_FLAG_NOCRLF);
+	for (size_t i=0; i<sizeof(s_rgszInsert)/sizeof(s_rgszInsert[0]); i++)
+	{
+		for (size_t nPos = 0; nPos <= 80; nPos++)
+		{
+			std::string str = strBase;
+			str.insert(nPos, s_rgszInsert[i]);
+			CheckBase64Decode(str, 300);
+		}
+	}
+	for (size_t nPos = 0; nPos <= 80; nPos++)
+	{
+		std::string str = strBase;
+		str[nPos] = '\0';
+		CheckBase64Decode(str, 300);
+	}
+
+	// random mixes of alphabet characters and junk, of any length
+	for (int i=0; i<2000; i++)
+	{
+		std::string str;
+		size_t cch = Random() % 200;
+		for (size_t j=0; j<cch; j++)
+		{
+			unsigned n = Random() % 16;
+			str += (n == 0) ? (char) Random() : (n == 1) ? '=' : c_szAlphabet[Random() % 64];
+		}
+		CheckBase64Decode(str, (int) str.size());
+		CheckBase64Decode(str, (int) (Random() % (str.size() + 1)), true);
+	}
+}
+
+static void TestHex()
+{
+	for (size_t cb=0; cb<=100; cb++)
+	{
+		std::vector<BYTE> data = MakeRandom(cb);
+		std::string str = CheckHexEncode(data);
+
+		std::vector<BYTE> decoded;
+		ATLTEST_CHECK(CheckHexDecode(str, &decoded) && decoded == data);
+
+		// lower case digits decode the same
+		for (size_t i=0; i<str.size(); i++)
+		{
+			if (Random() % 2)
+				str[i] = (char) tolower(str[i]);
+		}
+		ATLTEST_CHECK(CheckHexDecode(str, &decoded) && decoded == data);
+	}
+
+	// a single bad character anywhere fails the whole string, including
+	// the characters just outside the ranges the vector compare accepts
+	static const char c_rgchBad[] = { '/', ':', '@', 'G', '`', 'g', ' ', 'x', '\0', '\x80', '\xb0', '\xc1' };
+	std::string strBase = CheckHexEncode(MakeRandom(48));
+	for (size_t i=0; i<sizeof(c_rgchBad); i++)
+	{
+		for (size_t nPos = 0; nPos < strBase.size(); nPos++)
+		{
+			std::string str = strBase;
+			str[nPos] = c_rgchBad[i];
+			ATLTEST_CHECK(!CheckHexDecode(str));
+		}
+	}
+
+	// odd lengths fail
+	ATLTEST_CHECK(!CheckHexDecode(strBase + "A"));
+}
+
+static void TestArguments()
+{
+	BYTE rgb[4] = { 0 };
+	char rgch[16];
+	int nLen = sizeof(rgch);
+	ATLTEST_CHECK(!AtlFastBase64Encode(NULL, 1, rgch, &nLen));
+	ATLTEST_CHECK(!AtlFastBase64Encode(rgb, 1, NULL, &nLen));
+	ATLTEST_CHECK(!AtlFastBase64Encode(rgb, 1, rgch, NULL));
+	ATLTEST_CHECK(!AtlFastBase64Decode(NULL, 1, rgb, &nLen));
+	ATLTEST_CHECK(!AtlFastBase64Decode("AA", 2, rgb, NULL));
+	ATLTEST_CHECK(!AtlFastHexEncode(NULL, 1, rgch, &nLen));
+	ATLTEST_CHECK(!AtlFastHexDecode(NULL, 2, rgb, &nLen));
+	ATLTEST_CHECK(!AtlFastHexDecode("00", 2, NULL, &nLen));
+}
+
+static void RunAll()
+{
+	g_nSeed = 1;
+	TestBase64Vectors();
+	TestBase64RoundTrips();
+	TestBase64Decode();
+	TestHex();
+	TestArguments();
+}
+
+int main()
+{
+#ifdef _ATL_SIMD_CODECS
+	int nDetected = AtlGetSimdLevel();
+	for (int nLevel = ATL_SIMD_NONE; nLevel <= nDetected; nLevel++)
+	{
+		AtlSetSimdLevel(nLevel);
+		ATLTEST_CHECK(AtlGetSimdLevel() == nLevel);
+		int nFailures = g_nAtlTestFailures;
+		RunAll();
+		printf("level %d: %s\n", nLevel, (g_nAtlTestFailures == nFailures) ? "passed" : "failed");
+	}
+
+	// the level can't be raised past what the processor has
+	AtlSetSimdLevel(ATL_SIMD_AVX2 + 1);
+	ATLTEST_CHECK(AtlGetSimdLevel() == nDetected);
+	return AtlTestResult("test_simd_codecs");
+#else
+	RunAll();
+	return AtlTestResult("test_simd_codecs_fallback");
+#endif
+}
@@ -0,0 +1,338 @@
+// Tests for the soap map indexes in atlsoapindex.h.
+//
+// The maps are random, with their hashes drawn from a small pool so that
+// many entries share a hash, and names and flags drawn so that several
+// entries with the same hash and name differ only in their flags, the way
+// the in and out parameters of a method do.  Every lookup through the
+// index must find the same entry as a linear scan of the map, which is how
+// CSoapRootHandler searches small maps.  The table cases check that each
+// map is indexed once, also when several threads look it up at the same
+// time.
+
+#include "atltest.h"
+#include <atlsoapindex.h>
+
+#include <thread>
+#include <vector>
+
+using namespace ATL;
+
+static thread_local unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1103515245 + 12345;
+	return (g_nSeed >> 16) & 0x7FFF;
+}
+
+static ULONG RandomHash()
+{
+	ULONG nHash = (Random() << 17) ^ (Random() << 2) ^ Random();
+	return nHash ? nHash : 1;
+}
+
+#define TEST_FLAG_IN	1
+#define TEST_FLAG_OUT	2
+
+struct CTestEntry
+{
+	ULONG nHash;
+	int nName;
+	DWORD dwFlags;
+};
+
+struct CTestMap
+{
+	const CTestEntry *pEntries;
+	std::vector<CTestEntry> entries;
+};
+
+typedef CAtlSoapMapIndex<CTestMap> CTestIndex;
+typedef CAtlSoapMapIndexTable<CTestMap> CTestTable;
+
+// The test GetElementEntry applies to the entries with the element's hash
+struct CTestMatch
+{
+	int nName;
+	DWORD dwIncludeFlags;
+	DWORD dwExcludeFlags;
+
+	bool operator()(const CTestEntry& entry)
+	{
+		return ((entry.dwFlags & dwIncludeFlags) || ((entry.dwFlags & dwExcludeFlags) == 0)) &&
+			entry.nName == nName;
+	}
+};
+
+static size_t FindLinear(const CTestMap& map, ULONG nHash, CTestMatch& match)
+{
+	for (size_t i=0; map.pEntries[i].nHash != 0; i++)
+	{
+		if (map.pEntries[i].nHash == nHash && match(map.pEntries[i]))
+			return i;
+	}
+	return ATLSOAP_MAP_INDEX_NOTFOUND;
+}
+
+// nEntries entries with hashes from rgHashes
+static void BuildMap(CTestMap& map, size_t nEntries, const std::vector<ULONG>& rgHashes, int nNames)
+{
+	static const DWORD s_rgFlags[] = { 0, TEST_FLAG_IN, TEST_FLAG_OUT, TEST_FLAG_IN | TEST_FLAG_OUT };
+
+	map.entries.clear();
+	for (size_t i=0; i<nEntries; i++)
+	{
+		CTestEntry entry;
+		entry.nHash = rgHashes[Random() % rgHashes.size()];
+		entry.nName = (int) (Random() % nNames);
+		entry.dwFlags = s_rgFlags[Random() % 4];
+		map.entries.push_back(entry);
+	}
+	CTestEntry end = { 0, 0, 0 };
+	map.entries.push_back(end);
+	map.pEntries = &map.entries[0];
+}
+
+static std::vector<ULONG> RandomHashes(size_t nHashes)
+{
+	std::vector<ULONG> rgHashes;
+	if (Random() % 2)
+	{
+		for (size_t i=0; i<nHashes; i++)
+			rgHashes.push_back(RandomHash());
+	}
+	else
+	{
+		// like AtlSoapHashStr of names that only differ in their last
+		// characters, the hashes only differ in their low bits
+		ULONG nBase = RandomHash() & ~0xFFU;
+		for (size_t i=0; i<nHashes; i++)
+			rgHashes.push_back(nBase + 1 + (ULONG) i);
+	}
+	return rgHashes;
+}
+
+// Looks up every hash of the map and some others, with every name and
+// both directions, through the index and linearly
+static void CheckLookups(const CTestIndex& index, const CTestMap& map, const std::vector<ULONG>& rgHashes, int nNames)
+{
+	std::vector<ULONG> rgQueries(rgHashes);
+	for (int i=0; i<8; i++)
+		rgQueries.push_back(RandomHash());
+
+	for (size_t h=0; h<rgQueries.size(); h++)
+	{
+		for (int nName=0; nName<=nNames; nName++)
+		{
+			for (int nDir=0; nDir<2; nDir++)
+			{
+				CTestMatch match;
+				match.nName = nName;
+				match.dwIncludeFlags = nDir ? TEST_FLAG_OUT : TEST_FLAG_IN;
+				match.dwExcludeFlags = nDir ? TEST_FLAG_IN : TEST_FLAG_OUT;
+
+				size_t nIndexed = index.Find(rgQueries[h], match);
+				size_t nLinear = FindLinear(map, rgQueries[h], match);
+				ATLTEST_CHECK(nIndexed == nLinear);
+				if (nIndexed != nLinear)
+				{
+					printf("hash %08x name %d dir %d: index found %d, scan found %d\n",
+						(unsigned) rgQueries[h], nName, nDir, (int) nIndexed, (int) nLinear);
+					return;
+				}
+			}
+		}
+	}
+}
+
+static void TestLookups(int nMaps)
+{
+	for (int m=0; m<nMaps; m++)
+	{
+		size_t nEntries = ATLSOAP_MAP_INDEX_THRESHOLD + Random() % 300;
+		std::vector<ULONG> rgHashes = RandomHashes(1 + Random() % (Random() % 2 ? 8 : nEntries));
+		int nNames = 1 + (int) (Random() % 6);
+
+		CTestMap map;
+		BuildMap(map, nEntries, rgHashes, nNames);
+
+		CTestIndex index;
+		ATLTEST_CHECK(index.Build(&map));
+		ATLTEST_CHECK(index.m_pSlots != NULL);
+		ATLTEST_CHECK(index.m_nEntries == nEntries);
+
+		// at most half full
+		ATLTEST_CHECK(index.m_nMask+1 >= 2*nEntries);
+		ATLTEST_CHECK(index.m_nMask+1 < 4*nEntries);
+
+		CheckLookups(index, map, rgHashes, nNames);
+	}
+}
+
+// Every entry has the same hash, so every lookup probes the whole map
+static void TestOneHash()
+{
+	std::vector<ULONG> rgHashes(1, RandomHash());
+
+	CTestMap map;
+	BuildMap(map, 100, rgHashes, 3);
+
+	CTestIndex index;
+	ATLTEST_CHECK(index.Build(&map));
+	CheckLookups(index, map, rgHashes, 3);
+}
+
+static void TestThreshold()
+{
+	std::vector<ULONG> rgHashes = RandomHashes(4);
+
+	CTestMap small;
+	BuildMap(small, ATLSOAP_MAP_INDEX_THRESHOLD-1, rgHashes, 2);
+	CTestIndex smallIndex;
+	ATLTEST_CHECK(smallIndex.Build(&small));
+	ATLTEST_CHECK(smallIndex.m_pSlots == NULL);
+	ATLTEST_CHECK(smallIndex.m_nEntries == ATLSOAP_MAP_INDEX_THRESHOLD-1);
+
+	CTestMap large;
+	BuildMap(large, ATLSOAP_MAP_INDEX_THRESHOLD, rgHashes, 2);
+	CTestIndex largeIndex;
+	ATLTEST_CHECK(largeIndex.Build(&large));
+	ATLTEST_CHECK(largeIndex.m_pSlots != NULL);
+	ATLTEST_CHECK(largeIndex.m_nEntries == ATLSOAP_MAP_INDEX_THRESHOLD);
+
+	// the table answers NULL for the small map, but remembers it
+	CTestTable *pTable = new CTestTable();
+	ATLTEST_CHECK(pTable->GetIndex(&small) == NULL);
+	ATLTEST_CHECK(pTable->GetIndex(&small) == NULL);
+	ATLTEST_CHECK(pTable->GetIndex(&large) != NULL);
+	size_t nIndexes = 0;
+	for (ULONG nBucket=0; nBucket<ATLSOAP_MAP_INDEX_BUCKETS; nBucket++)
+	{
+		for (CTestIndex *pIndex = pTable->m_rgBuckets[nBucket]; pIndex; pIndex = pIndex->m_pNext)
+			nIndexes++;
+	}
+	ATLTEST_CHECK(nIndexes == 2);
+	delete pTable;
+}
+
+// Returns the number of indexes in the table, and checks that no map has two
+static size_t CountIndexes(const CTestTable& table, const std::vector<CTestMap>& maps)
+{
+	std::vector<int> rgCounts(maps.size());
+	size_t nIndexes = 0;
+	for (ULONG nBucket=0; nBucket<ATLSOAP_MAP_INDEX_BUCKETS; nBucket++)
+	{
+		for (CTestIndex *pIndex = table.m_rgBuckets[nBucket]; pIndex; pIndex = pIndex->m_pNext)
+		{
+			size_t nMap = pIndex->m_pMap - &maps[0];
+			ATLTEST_CHECK(nMap < maps.size());
+			if (nMap < maps.size())
+				rgCounts[nMap]++;
+			nIndexes++;
+		}
+	}
+	for (size_t i=0; i<maps.size(); i++)
+		ATLTEST_CHECK(rgCounts[i] == 1);
+	return nIndexes;
+}
+
+static void BuildMaps(std::vector<CTestMap>& maps, std::vector<std::vector<ULONG> >& hashes)
+{
+	for (size_t m=0; m<maps.size(); m++)
+	{
+		// a quarter of them too small to index
+		size_t nEntries = (m % 4 == 0) ? 1 + Random() % (ATLSOAP_MAP_INDEX_THRESHOLD-1) :
+			ATLSOAP_MAP_INDEX_THRESHOLD + Random() % 100;
+		hashes[m] = RandomHashes(1 + Random() % nEntries);
+		BuildMap(maps[m], nEntries, hashes[m], 3);
+	}
+}
+
+// Many more maps than buckets, and than the handlers used to cache
+static void TestTable()
+{
+	const size_t c_nMaps = 20 * ATLSOAP_MAP_INDEX_BUCKETS;
+	std::vector<CTestMap> maps(c_nMaps);
+	std::vector<std::vector<ULONG> > hashes(c_nMaps);
+	BuildMaps(maps, hashes);
+
+	CTestTable *pTable = new CTestTable();
+	std::vector<const CTestIndex *> rgIndexes(c_nMaps);
+	for (size_t m=0; m<c_nMaps; m++)
+		rgIndexes[m] = pTable->GetIndex(&maps[m]);
+
+	for (int nPass=0; nPass<3; nPass++)
+	{
+		for (size_t n=0; n<c_nMaps; n++)
+		{
+			size_t m = Random() % c_nMaps;
+			const CTestIndex *pIndex = pTable->GetIndex(&maps[m]);
+			ATLTEST_CHECK(pIndex == rgIndexes[m]);
+			ATLTEST_CHECK((pIndex == NULL) == (maps[m].entries.size()-1 < ATLSOAP_MAP_INDEX_THRESHOLD));
+			if (pIndex)
+			{
+				ATLTEST_CHECK(pIndex->m_pMap == &maps[m]);
+				if (nPass == 0)
+					CheckLookups(*pIndex, maps[m], hashes[m], 3);
+			}
+		}
+	}
+
+	ATLTEST_CHECK(CountIndexes(*pTable, maps) == c_nMaps);
+	delete pTable;
+}
+
+// Threads look up the same maps in different orders, so they race to
+// index them and to push onto the same buckets
+static void TestThreads(int nRounds)
+{
+	const size_t c_nMaps = 4 * ATLSOAP_MAP_INDEX_BUCKETS;
+	const int c_nThreads = 8;
+
+	std::vector<CTestMap> maps(c_nMaps);
+	std::vector<std::vector<ULONG> > hashes(c_nMaps);
+	BuildMaps(maps, hashes);
+
+	for (int nRound=0; nRound<nRounds; nRound++)
+	{
+		CTestTable *pTable = new CTestTable();
+		std::vector<std::vector<const CTestIndex *> > rgSeen(c_nThreads, std::vector<const CTestIndex *>(c_nMaps));
+		std::vector<std::thread> threads;
+		for (int t=0; t<c_nThreads; t++)
+		{
+			threads.push_back(std::thread([&, t]()
+			{
+				g_nSeed = (unsigned) (nRound * c_nThreads + t + 1);
+				size_t nStart = Random() % c_nMaps;
+				size_t nStep = (t % 2) ? 1 : c_nMaps-1;
+				for (size_t n=0; n<c_nMaps; n++)
+				{
+					size_t m = (nStart + n*nStep) % c_nMaps;
+					rgSeen[t][m] = pTable->GetIndex(&maps[m]);
+				}
+			}));
+		}
+		for (int t=0; t<c_nThreads; t++)
+			threads[t].join();
+
+		for (size_t m=0; m<c_nMaps; m++)
+		{
+			for (int t=1; t<c_nThreads; t++)
+				ATLTEST_CHECK(rgSeen[t][m] == rgSeen[0][m]);
+			ATLTEST_CHECK(pTable->GetIndex(&maps[m]) == rgSeen[0][m]);
+		}
+		ATLTEST_CHECK(CountIndexes(*pTable, maps) == c_nMaps);
+		delete pTable;
+	}
+}
+
+int main()
+{
+	TestLookups(300);
+	TestOneHash();
+	TestThreshold();
+	TestTable();
+	TestThreads(50);
+
+	return AtlTestResult("test_soap_map_index");
+}
@@ -0,0 +1,723 @@
+// Tests for the compiled stencil ops in atlstencilops.h.
+//
+// CTestStencil builds random stencils of text, replacements, nested
+// if/else/endif and while/endwhile blocks, locale tags and a user defined
+// token type, linked through dwLoopIndex the way CStencil links its tokens.
+// Text tokens follow each other either contiguously, as when a tag is
+// turned back into text, or with a gap, as around a comment, so the
+// compiler has both kinds of runs to merge.  Each stencil is rendered by
+// walking the tokens the way CStencil::RenderToken does, and by running the
+// compiled ops, and the output and the calls made to the replacement
+// methods must match.  Replacement methods and the user token return
+// asynchronous statuses at random, and rendering resumes at the index
+// returned, as Render does with CStencilState.
+
+#include "atltest.h"
+#include <atlserr.h>
+#include <atlstencilops.h>
+
+#include <string>
+#include <vector>
+
+using namespace ATL;
+
+enum
+{
+	TOKEN_TEXT,
+	TOKEN_REPLACEMENT,
+	TOKEN_WHILE,
+	TOKEN_ENDWHILE,
+	TOKEN_IF,
+	TOKEN_ELSE,
+	TOKEN_ENDIF,
+	TOKEN_LOCALE,
+	TOKEN_USER
+};
+
+static unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1664525 + 1013904223;
+	return g_nSeed >> 8;
+}
+
+static DWORD Mix(DWORD a, DWORD b)
+{
+	DWORD h = a * 0x9E3779B1 ^ (b + 0x7F4A7C15);
+	h ^= h >> 15;
+	h *= 0x85EBCA77;
+	h ^= h >> 13;
+	return h;
+}
+
+struct CTestToken
+{
+	DWORD type;
+	size_t nStart;
+	DWORD cbText;
+	DWORD dwLoopIndex;
+	DWORD dwSeed;		// what the replacement method returns
+	DWORD nLimit;		// iterations of a while loop
+};
+
+class CTestStencil
+{
+public:
+	std::string m_strBuffer;
+	std::vector<CTestToken> m_tokens;
+
+	DWORD Add(DWORD type)
+	{
+		CTestToken token;
+		token.type = type;
+		token.nStart = m_strBuffer.size();
+		token.cbText = 0;
+		token.dwLoopIndex = STENCIL_INVALIDINDEX;
+		token.dwSeed = Random();
+		token.nLimit = Random() % 4;
+		m_tokens.push_back(token);
+
+		// tags take up room in the buffer, so text on either side of them
+		// is never contiguous
+		if (type != TOKEN_TEXT)
+			m_strBuffer += "{{tag}}";
+		return (DWORD) m_tokens.size() - 1;
+	}
+
+	void AddText(bool bGap)
+	{
+		if (bGap)
+			m_strBuffer += "{{!-- comment --}}";
+		DWORD dwIndex = Add(TOKEN_TEXT);
+		m_tokens[dwIndex].nStart = m_strBuffer.size();
+		DWORD cbText = 1 + Random() % 6;
+		for (DWORD i=0; i<cbText; i++)
+			m_strBuffer += (char) ('a' + Random() % 26);
+		m_tokens[dwIndex].cbText = cbText;
+	}
+
+	void Generate(int nDepth)
+	{
+		int nItems = (int) (Random() % 5);
+		for (int i=0; i<nItems; i++)
+		{
+			switch (Random() % 8)
+			{
+			case 0:
+			case 1:
+				{
+					// a run of text tokens
+					int nText = 1 + (int) (Random() % 4);
+					for (int t=0; t<nText; t++)
+						AddText(Random() % 2 == 0);
+				}
+				break;
+			case 2:
+				Add(TOKEN_REPLACEMENT);
+				break;
+			case 3:
+				if (nDepth < 4)
+				{
+					DWORD dwIf = Add(TOKEN_IF);
+					Generate(nDepth+1);
+					DWORD dwLast = dwIf;
+					if (Random() % 2)
+					{
+						DWORD dwElse = Add(TOKEN_ELSE);
+						m_tokens[dwLast].dwLoopIndex = dwElse;
+						dwLast = dwElse;
+						Generate(nDepth+1);
+					}
+					DWORD dwEnd = Add(TOKEN_ENDIF);
+					m_tokens[dwLast].dwLoopIndex = dwEnd;
+					m_tokens[dwEnd].dwLoopIndex = dwIf;
+				}
+				break;
+			case 4:
+				if (nDepth < 4)
+				{
+					DWORD dwWhile = Add(TOKEN_WHILE);
+					Generate(nDepth+1);
+					DWORD dwEnd = Add(TOKEN_ENDWHILE);
+					m_tokens[dwWhile].dwLoopIndex = dwEnd;
+					m_tokens[dwEnd].dwLoopIndex = dwWhile;
+				}
+				break;
+			case 5:
+				Add(TOKEN_LOCALE);
+				break;
+			case 6:
+				Add(TOKEN_USER);
+				break;
+			default:
+				AddText(Random() % 2 == 0);
+				break;
+			}
+		}
+	}
+
+	DWORD GetTokenCount() const
+	{
+		return (DWORD) m_tokens.size();
+	}
+
+	LPCSTR GetText(DWORD dwIndex) const
+	{
+		return m_strBuffer.data() + m_tokens[dwIndex].nStart;
+	}
+
+	// CAtlStencilProgram::Compile, as CStencil::GetTokenOp maps its types
+	DWORD GetTokenOp(DWORD dwIndex, DWORD *pdwTarget) const
+	{
+		const CTestToken& token = m_tokens[dwIndex];
+		*pdwTarget = STENCIL_INVALIDINDEX;
+
+		switch (token.type)
+		{
+		case TOKEN_TEXT:
+			return STENCIL_OP_TEXT;
+		case TOKEN_REPLACEMENT:
+			return STENCIL_OP_CALL;
+		case TOKEN_WHILE:
+		case TOKEN_IF:
+			if (token.dwLoopIndex >= GetTokenCount())
+				return STENCIL_OP_INVALID;
+			*pdwTarget = token.dwLoopIndex+1;
+			return STENCIL_OP_TEST;
+		case TOKEN_ELSE:
+			if (token.dwLoopIndex >= GetTokenCount())
+				return STENCIL_OP_INVALID;
+			*pdwTarget = token.dwLoopIndex+1;
+			return STENCIL_OP_JUMP;
+		case TOKEN_ENDWHILE:
+			if (token.dwLoopIndex >= GetTokenCount())
+				return STENCIL_OP_INVALID;
+			*pdwTarget = token.dwLoopIndex;
+			return STENCIL_OP_JUMP;
+		case TOKEN_ENDIF:
+			return STENCIL_OP_NONE;
+		case TOKEN_LOCALE:
+			return STENCIL_OP_LOCALE;
+		default:
+			return STENCIL_OP_TOKEN;
+		}
+	}
+
+	void GetTokenText(DWORD dwIndex, LPCSTR *ppText, DWORD *pcbText) const
+	{
+		*ppText = GetText(dwIndex);
+		*pcbText = m_tokens[dwIndex].cbText;
+	}
+};
+
+// The replacement methods, the stream and the user token type. What a
+// method returns depends only on how often it has been called, so both
+// ways of rendering see the same results as long as they make the same
+// calls.
+class CTestHandler
+{
+public:
+	const CTestStencil& m_stencil;
+	std::vector<DWORD> m_nCalls;
+	std::vector<DWORD> m_nIterations;
+	std::string m_strOut;		// the text written to the stream
+	std::string m_strTrace;		// the calls made, and the text again
+	int m_nWrites;
+
+	CTestHandler(const CTestStencil& stencil) :
+		m_stencil(stencil),
+		m_nCalls(stencil.GetTokenCount()),
+		m_nIterations(stencil.GetTokenCount()),
+		m_nWrites(0)
+	{
+	}
+
+	void Trace(const char *szFormat, DWORD dwValue)
+	{
+		char sz[32];
+		snprintf(sz, sizeof(sz), szFormat, (unsigned) dwValue);
+		m_strTrace += sz;
+	}
+
+	void Write(LPCSTR pText, DWORD cbText)
+	{
+		m_strOut.append(pText, cbText);
+		m_strTrace.append(pText, cbText);
+		m_nWrites++;
+	}
+
+	HTTP_CODE CallMethod(DWORD dwToken)
+	{
+		const CTestToken& token = m_stencil.m_tokens[dwToken];
+		DWORD h = Mix(token.dwSeed, m_nCalls[dwToken]++);
+		Trace("(%u)", dwToken);
+
+		switch (token.type)
+		{
+		case TOKEN_WHILE:
+			if (h % 60 == 0)
+				return HTTP_FAIL;
+			if (m_nIterations[dwToken] < token.nLimit)
+			{
+				m_nIterations[dwToken]++;
+				return HTTP_SUCCESS;
+			}
+			m_nIterations[dwToken] = 0;
+			return HTTP_S_FALSE;
+		case TOKEN_IF:
+			if (h % 60 == 0)
+				return HTTP_FAIL;
+			return (h & 0x100) ? HTTP_SUCCESS : HTTP_S_FALSE;
+		default:
+			{
+				h %= 100;
+				if (h < 70)
+				{
+					Trace("[%u]", dwToken);
+					return HTTP_SUCCESS;
+				}
+				if (h < 75)
+					return HTTP_SUCCESS_ASYNC;
+				if (h < 80)
+					return HTTP_SUCCESS_ASYNC_DONE;
+				if (h < 85)
+					return HTTP_SUCCESS_ASYNC_NOFLUSH;
+				if (h < 90)
+					return HTTP_SUCCESS_ASYNC_NOFLUSH_DONE;
+				if (h < 95)
+					return HTTP_SUCCESS_NO_CACHE;
+				if (h < 98)
+					return HTTP_S_FALSE;
+				return HTTP_FAIL;
+			}
+		}
+	}
+
+	void SetLocale(DWORD dwToken)
+	{
+		Trace("<L%u>", dwToken);
+	}
+
+	// CStencil::RenderToken for a token that isn't built in
+	DWORD RenderUserToken(DWORD dwIndex, HTTP_CODE *phcErrorCode)
+	{
+		DWORD h = Mix(m_stencil.m_tokens[dwIndex].dwSeed, m_nCalls[dwIndex]++) % 10;
+		Trace("<U%u>", dwIndex);
+		if (h < 2)
+		{
+			*phcErrorCode = HTTP_SUCCESS_ASYNC;
+			return dwIndex;
+		}
+		if (h < 3)
+		{
+			*phcErrorCode = HTTP_FAIL;
+			return STENCIL_INVALIDINDEX;
+		}
+		*phcErrorCode = HTTP_SUCCESS;
+		return dwIndex+1;
+	}
+};
+
+// Walks the tokens like CStencil::RenderToken
+static DWORD RenderToken(CTestHandler& handler, DWORD dwIndex, HTTP_CODE *phcErrorCode)
+{
+	const CTestToken& token = handler.m_stencil.m_tokens[dwIndex];
+	DWORD dwNextToken;
+	HTTP_CODE hcErrorCode = HTTP_SUCCESS;
+
+	switch (token.type)
+	{
+	case TOKEN_TEXT:
+		handler.Write(handler.m_stencil.GetText(dwIndex), token.cbText);
+		dwNextToken = dwIndex+1;
+		break;
+	case TOKEN_WHILE:
+	case TOKEN_IF:
+		{
+			HTTP_CODE hcErr = handler.CallMethod(dwIndex);
+			if (hcErr == HTTP_SUCCESS)
+				dwNextToken = dwIndex+1;
+			else if (hcErr == HTTP_S_FALSE)
+				dwNextToken = token.dwLoopIndex+1;
+			else
+			{
+				dwNextToken = STENCIL_INVALIDINDEX;
+				hcErrorCode = hcErr;
+			}
+		}
+		break;
+	case TOKEN_REPLACEMENT:
+		hcErrorCode = handler.CallMethod(dwIndex);
+		if (IsAsyncContinueStatus(hcErrorCode))
+			dwNextToken = dwIndex;
+		else
+		{
+			dwNextToken = dwIndex+1;
+			if (hcErrorCode == HTTP_SUCCESS_ASYNC_DONE)
+				hcErrorCode = HTTP_SUCCESS_ASYNC;
+			else if (hcErrorCode == HTTP_SUCCESS_ASYNC_NOFLUSH_DONE)
+				hcErrorCode = HTTP_SUCCESS_ASYNC_NOFLUSH;
+		}
+		break;
+	case TOKEN_ENDWHILE:
+		dwNextToken = token.dwLoopIndex;
+		break;
+	case TOKEN_ELSE:
+		dwNextToken = token.dwLoopIndex+1;
+		break;
+	case TOKEN_ENDIF:
+		dwNextToken = dwIndex+1;
+		break;
+	case TOKEN_LOCALE:
+		handler.SetLocale(dwIndex);
+		dwNextToken = dwIndex+1;
+		break;
+	default:
+		dwNextToken = handler.RenderUserToken(dwIndex, &hcErrorCode);
+		break;
+	}
+
+	*phcErrorCode = hcErrorCode;
+	return dwNextToken;
+}
+
+// What CStencil::COpRenderer does, against the test handler
+class CTestRenderer
+{
+public:
+	CTestHandler& m_handler;
+	int m_nStatusCalls;
+
+	CTestRenderer(CTestHandler& handler) : m_handler(handler), m_nStatusCalls(0)
+	{
+	}
+
+	HTTP_CODE CallMethod(DWORD dwToken)
+	{
+		return m_handler.CallMethod(dwToken);
+	}
+
+	void WriteText(LPCSTR pText, DWORD cbText)
+	{
+		m_handler.Write(pText, cbText);
+	}
+
+	void WriteTokenText(DWORD dwToken, DWORD nTokens)
+	{
+		// a gathered write counts once
+		std::string strGathered;
+		for (DWORD dwIndex = dwToken; dwIndex < dwToken+nTokens; dwIndex++)
+		{
+			ATLTEST_CHECK(m_handler.m_stencil.m_tokens[dwIndex].type == TOKEN_TEXT);
+			strGathered.append(m_handler.m_stencil.GetText(dwIndex), m_handler.m_stencil.m_tokens[dwIndex].cbText);
+		}
+		m_handler.Write(strGathered.data(), (DWORD) strGathered.size());
+	}
+
+	void SetLocale(DWORD dwToken)
+	{
+		m_handler.SetLocale(dwToken);
+	}
+
+	DWORD RenderToken(DWORD dwToken, HTTP_CODE *phcErrorCode)
+	{
+		return ::RenderToken(m_handler, dwToken, phcErrorCode);
+	}
+
+	HTTP_CODE OnRenderStatus(HTTP_CODE hcErr)
+	{
+		m_nStatusCalls++;
+		return hcErr;
+	}
+};
+
+// Renders the stencil like CStencil::Render, again and again from the
+// index it stopped at for as long as it returns an asynchronous status
+static void Render(const CTestStencil& stencil, const CAtlStencilProgram *pProgram,
+	CTestHandler& handler)
+{
+	DWORD dwIndex = 0;
+	DWORD dwCount = stencil.GetTokenCount();
+	for (int nRenders=0; nRenders<10000; nRenders++)
+	{
+		HTTP_CODE hcErrorCode = HTTP_SUCCESS;
+		if (pProgram)
+		{
+			CTestRenderer renderer(handler);
+			if (dwIndex < dwCount)
+				dwIndex = pProgram->Run(renderer, dwIndex, &hcErrorCode);
+		}
+		else
+		{
+			while (dwIndex < dwCount)
+			{
+				dwIndex = RenderToken(handler, dwIndex, &hcErrorCode);
+				if (dwIndex == STENCIL_INVALIDINDEX || hcErrorCode != HTTP_SUCCESS)
+					break;
+			}
+		}
+
+		// the ops may resume past an endif where the tokens resume at it,
+		// so where it resumes only shows in what happens next
+		handler.Trace("{%08x}", hcErrorCode);
+		if (!IsAsyncStatus(hcErrorCode))
+			return;
+	}
+	ATLTEST_CHECK(!"rendering didn't finish");
+}
+
+// Checks the ops against the tokens they were compiled from
+static void CheckProgram(const CTestStencil& stencil, const CAtlStencilProgram& program)
+{
+	DWORD dwCount = stencil.GetTokenCount();
+	ATLTEST_CHECK(program.IsCompiled(dwCount));
+	ATLTEST_CHECK(program.m_nOps <= dwCount);
+	ATLTEST_CHECK(program.m_pTokenOps[dwCount] == program.m_nOps);
+
+	LPCSTR pBufferStart = stencil.m_strBuffer.data();
+	LPCSTR pBufferEnd = pBufferStart + stencil.m_strBuffer.size();
+	for (DWORD dwOp = 0; dwOp < program.m_nOps; dwOp++)
+	{
+		const StencilOp& op = program.m_pOps[dwOp];
+		ATLTEST_CHECK(program.m_pTokenOps[op.dwToken] == dwOp);
+		ATLTEST_CHECK(dwOp == 0 || program.m_pOps[dwOp-1].dwToken < op.dwToken);
+
+		if (op.dwOpcode == STENCIL_OP_TEXT)
+		{
+			// every token of the run maps to the op, and the run ends at
+			// the first token that isn't text
+			DWORD dwEnd = op.dwToken;
+			while (dwEnd < dwCount && stencil.m_tokens[dwEnd].type == TOKEN_TEXT)
+				dwEnd++;
+			ATLTEST_CHECK(op.dwToken == 0 || stencil.m_tokens[op.dwToken-1].type != TOKEN_TEXT);
+			for (DWORD dwIndex = op.dwToken; dwIndex < dwEnd; dwIndex++)
+				ATLTEST_CHECK(program.m_pTokenOps[dwIndex] == dwOp);
+
+			bool bContiguous = true;
+			DWORD cbRun = 0;
+			for (DWORD dwIndex = op.dwToken; dwIndex < dwEnd; dwIndex++)
+			{
+				if (dwIndex > op.dwToken && stencil.GetText(dwIndex-1) + stencil.m_tokens[dwIndex-1].cbText != stencil.GetText(dwIndex))
+					bContiguous = false;
+				cbRun += stencil.m_tokens[dwIndex].cbText;
+			}
+			if (bContiguous)
+			{
+				// the text is referenced in place, never copied
+				ATLTEST_CHECK(op.pText == stencil.GetText(op.dwToken));
+				ATLTEST_CHECK(op.dwArg == cbRun);
+				ATLTEST_CHECK(op.pText >= pBufferStart && op.pText+op.dwArg <= pBufferEnd);
+			}
+			else
+			{
+				ATLTEST_CHECK(op.pText == NULL);
+				ATLTEST_CHECK(op.dwArg == dwEnd - op.dwToken);
+			}
+		}
+		else if (op.dwOpcode == STENCIL_OP_TEST || op.dwOpcode == STENCIL_OP_JUMP)
+		{
+			// the jump lands on the op of the token after the end of the
+			// block, or for endwhile, on the while
+			const CTestToken& token = stencil.m_tokens[op.dwToken];
+			DWORD dwTarget = token.type == TOKEN_ENDWHILE ? token.dwLoopIndex : token.dwLoopIndex+1;
+			ATLTEST_CHECK(op.dwArg == program.m_pTokenOps[dwTarget]);
+			ATLTEST_CHECK(op.dwArg == program.m_nOps || program.m_pOps[op.dwArg].dwToken >= dwTarget);
+		}
+		else
+		{
+			ATLTEST_CHECK(op.pText == NULL);
+		}
+	}
+
+	// endif compiles to nothing, and resumes at whatever follows it
+	for (DWORD dwIndex = 0; dwIndex < dwCount; dwIndex++)
+	{
+		if (stencil.m_tokens[dwIndex].type == TOKEN_ENDIF)
+		{
+			DWORD dwOp = program.m_pTokenOps[dwIndex];
+			ATLTEST_CHECK(dwOp == program.m_nOps || program.m_pOps[dwOp].dwToken > dwIndex);
+		}
+	}
+}
+
+static void TestRandomStencils()
+{
+	for (int nRun=0; nRun<5000; nRun++)
+	{
+		CTestStencil stencil;
+		stencil.Generate(0);
+
+		CAtlStencilProgram program;
+		ATLTEST_CHECK(program.Compile(stencil, stencil.GetTokenCount()));
+		if (!program.IsCompiled(stencil.GetTokenCount()))
+			continue;
+		CheckProgram(stencil, program);
+
+		CTestHandler walked(stencil);
+		Render(stencil, NULL, walked);
+		CTestHandler compiled(stencil);
+		Render(stencil, &program, compiled);
+
+		ATLTEST_CHECK(walked.m_strOut == compiled.m_strOut);
+		ATLTEST_CHECK(walked.m_strTrace == compiled.m_strTrace);
+		ATLTEST_CHECK(compiled.m_nWrites <= walked.m_nWrites);
+		if (walked.m_strTrace != compiled.m_strTrace)
+		{
+			printf("run %d differs\n  tokens:   %s\n  compiled: %s\n", nRun,
+				walked.m_strTrace.c_str(), compiled.m_strTrace.c_str());
+			break;
+		}
+	}
+}
+
+// A small stencil, checked op by op:
+//   0 text "ab", 1 text "cd" (contiguous), 2 if -> 5, 3 text "x", 4 else -> 7,
+//   5 text "y", 6 text "z" (gap), 7 endif, 8 while -> 10, 9 user, 10 endwhile -> 8,
+//   11 text "e"
+static void BuildSmall(CTestStencil& stencil)
+{
+	stencil.m_strBuffer = "abcd{{tag}}x{{tag}}y{{!}}z{{tag}}{{tag}}{{tag}}{{tag}}e";
+	struct { DWORD type; size_t nStart; DWORD cbText; DWORD dwLoopIndex; } rgTokens[] =
+	{
+		{ TOKEN_TEXT, 0, 2, STENCIL_INVALIDINDEX },
+		{ TOKEN_TEXT, 2, 2, STENCIL_INVALIDINDEX },
+		{ TOKEN_IF, 4, 0, 4 },
+		{ TOKEN_TEXT, 11, 1, STENCIL_INVALIDINDEX },
+		{ TOKEN_ELSE, 12, 0, 7 },
+		{ TOKEN_TEXT, 19, 1, STENCIL_INVALIDINDEX },
+		{ TOKEN_TEXT, 25, 1, STENCIL_INVALIDINDEX },
+		{ TOKEN_ENDIF, 26, 0, 2 },
+		{ TOKEN_WHILE, 33, 0, 10 },
+		{ TOKEN_USER, 40, 0, STENCIL_INVALIDINDEX },
+		{ TOKEN_ENDWHILE, 47, 0, 8 },
+		{ TOKEN_TEXT, 54, 1, STENCIL_INVALIDINDEX },
+	};
+	for (size_t i=0; i<sizeof(rgTokens)/sizeof(rgTokens[0]); i++)
+	{
+		CTestToken token;
+		token.type = rgTokens[i].type;
+		token.nStart = rgTokens[i].nStart;
+		token.cbText = rgTokens[i].cbText;
+		token.dwLoopIndex = rgTokens[i].dwLoopIndex;
+		token.dwSeed = (DWORD) i;
+		token.nLimit = 1;
+		stencil.m_tokens.push_back(token);
+	}
+}
+
+static void TestLowering()
+{
+	CTestStencil stencil;
+	BuildSmall(stencil);
+	ATLTEST_CHECK(stencil.m_strBuffer[54] == 'e' && stencil.m_strBuffer[25] == 'z');
+
+	CAtlStencilProgram program;
+	ATLTEST_CHECK(program.Compile(stencil, stencil.GetTokenCount()));
+	CheckProgram(stencil, program);
+
+	// text "abcd", if, text "x", else, text "y" "z", while, user, endwhile, text "e"
+	ATLTEST_CHECK(program.m_nOps == 9);
+	if (program.m_nOps != 9)
+		return;
+	static const DWORD c_rgOpcodes[] =
+	{
+		STENCIL_OP_TEXT, STENCIL_OP_TEST, STENCIL_OP_TEXT, STENCIL_OP_JUMP, STENCIL_OP_TEXT,
+		STENCIL_OP_TEST, STENCIL_OP_TOKEN, STENCIL_OP_JUMP, STENCIL_OP_TEXT
+	};
+	for (DWORD dwOp = 0; dwOp < 9; dwOp++)
+		ATLTEST_CHECK(program.m_pOps[dwOp].dwOpcode == c_rgOpcodes[dwOp]);
+
+	ATLTEST_CHECK(program.m_pOps[0].pText == stencil.m_strBuffer.data() && program.m_pOps[0].dwArg == 4);
+	ATLTEST_CHECK(program.m_pOps[1].dwArg == 4);	// if: to the else part
+	ATLTEST_CHECK(program.m_pOps[3].dwArg == 5);	// else: past the endif, to the while
+	ATLTEST_CHECK(program.m_pOps[4].pText == NULL && program.m_pOps[4].dwArg == 2);
+	ATLTEST_CHECK(program.m_pOps[5].dwArg == 8);	// while: past the endwhile
+	ATLTEST_CHECK(program.m_pOps[7].dwArg == 5);	// endwhile: back to the while
+	ATLTEST_CHECK(program.m_pTokenOps[7] == 5);		// endif
+	ATLTEST_CHECK(program.m_pTokenOps[12] == 9);
+}
+
+// Resuming after an asynchronous status from the user token goes back to
+// the token through m_pTokenOps
+static void TestResumeToken()
+{
+	CTestStencil stencil;
+	BuildSmall(stencil);
+
+	// find seeds that make the user token go asynchronous on its first
+	// call, and the if and while take the paths tested
+	CAtlStencilProgram program;
+	ATLTEST_CHECK(program.Compile(stencil, stencil.GetTokenCount()));
+	int nResumed = 0;
+	for (DWORD dwSeed = 0; dwSeed < 200; dwSeed++)
+	{
+		stencil.m_tokens[9].dwSeed = dwSeed;
+		CTestHandler handler(stencil);
+		CTestRenderer renderer(handler);
+		HTTP_CODE hcErrorCode;
+		DWORD dwIndex = program.Run(renderer, 0, &hcErrorCode);
+		if (hcErrorCode != HTTP_SUCCESS_ASYNC)
+			continue;
+
+		// stopped at the user token, and picks up from it
+		ATLTEST_CHECK(dwIndex == 9);
+		nResumed++;
+		CTestHandler walked(stencil);
+		Render(stencil, NULL, walked);
+		CTestHandler compiled(stencil);
+		Render(stencil, &program, compiled);
+		ATLTEST_CHECK(walked.m_strTrace == compiled.m_strTrace);
+	}
+	ATLTEST_CHECK(nResumed > 0);
+}
+
+static void TestBadPrograms()
+{
+	CAtlStencilProgram program;
+
+	// an else that jumps into the middle of a merged text run
+	CTestStencil stencil;
+	BuildSmall(stencil);
+	stencil.m_tokens[4].dwLoopIndex = 5;	// else -> token 6, the second half of "y" "z"
+	ATLTEST_CHECK(!program.Compile(stencil, stencil.GetTokenCount()));
+	ATLTEST_CHECK(!program.IsCompiled(stencil.GetTokenCount()));
+	ATLTEST_CHECK(program.m_pOps == NULL && program.m_pTokenOps == NULL);
+
+	// a loop that isn't closed
+	stencil.m_tokens.clear();
+	BuildSmall(stencil);
+	stencil.m_tokens[8].dwLoopIndex = STENCIL_INVALIDINDEX;
+	ATLTEST_CHECK(!program.Compile(stencil, stencil.GetTokenCount()));
+
+	// recompiling replaces the old program
+	stencil.m_tokens.clear();
+	BuildSmall(stencil);
+	ATLTEST_CHECK(program.Compile(stencil, stencil.GetTokenCount()));
+	ATLTEST_CHECK(program.Compile(stencil, 2));
+	ATLTEST_CHECK(program.IsCompiled(2) && !program.IsCompiled(stencil.GetTokenCount()));
+	ATLTEST_CHECK(program.m_nOps == 1 && program.m_pTokenOps[2] == 1);
+	program.Reset();
+	ATLTEST_CHECK(!program.IsCompiled(2));
+
+	// the block of the if ends past the tokens compiled
+	ATLTEST_CHECK(!program.Compile(stencil, 3));
+
+	// no tokens at all
+	CTestStencil empty;
+	ATLTEST_CHECK(program.Compile(empty, 0));
+	ATLTEST_CHECK(program.IsCompiled(0) && program.m_nOps == 0);
+	CTestHandler handler(empty);
+	CTestRenderer renderer(handler);
+	HTTP_CODE hcErrorCode;
+	ATLTEST_CHECK(program.Run(renderer, 0, &hcErrorCode) == 0 && hcErrorCode == HTTP_SUCCESS);
+}
+
+int main()
+{
+	TestLowering();
+	TestResumeToken();
+	TestBadPrograms();
+	TestRandomStencils();
+	return AtlTestResult("test_stencil_ops");
+}
@@ -0,0 +1,249 @@
+// Tests for the URL-encoded data scanner in atlurlparams.h.
+//
+// AtlFindUrlDelimiter is compared with a byte-by-byte search, and
+// AtlParseUrlParam with the character loop CHttpRequestParams::Parse used
+// before the plain runs were copied in blocks: same names and values, same
+// position of the next pair, and the same bytes left in the buffer.  Each
+// check runs with the vector scan and with the scalar one.
+
+#include "atltest.h"
+#include "atltestenc.h"
+#include <atlsimdenc.h>
+#include <atlurlparams.h>
+#include "atltesturl.h"
+
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace ATL;
+
+static unsigned g_nSeed = 1;
+
+static unsigned Random()
+{
+	g_nSeed = g_nSeed * 1664525 + 1013904223;
+	return g_nSeed >> 8;
+}
+
+static bool IsDelimiter(char ch)
+{
+	return ch == '=' || ch == '&' || ch == '+' || ch == '%' || ch == '#' || ch == '\0';
+}
+
+static const char *FindDelimiter(const char *sz)
+{
+	while (!IsDelimiter(*sz))
+		sz++;
+	return sz;
+}
+
+// Parses all of str both ways and compares every pair and the buffers.
+// Returns the pairs as name=value lines.
+static std::string CheckParse(const std::string& str)
+{
+	// both decode in place, so each gets its own copy
+	std::vector<char> expected(str.begin(), str.end());
+	expected.push_back('\0');
+	std::vector<char> actual(expected);
+
+	std::string strPairs;
+	LPSTR szExpected = &expected[0];
+	LPSTR szActual = &actual[0];
+	while (*szExpected)
+	{
+		LPSTR szExpectedName;
+		LPCSTR szExpectedValue;
+		LPSTR szActualName;
+		LPCSTR szActualValue;
+		szExpected = AtlTestParseUrlParam(szExpected, &szExpectedName, &szExpectedValue);
+		szActual = AtlParseUrlParam(szActual, &szActualName, &szActualValue);
+
+		ATLTEST_CHECK(szExpected - &expected[0] == szActual - &actual[0]);
+		ATLTEST_CHECK(szExpectedName - &expected[0] == szActualName - &actual[0]);
+		ATLTEST_CHECK(strcmp(szExpectedName, szActualName) == 0);
+		ATLTEST_CHECK(strcmp(szExpectedValue, szActualValue) == 0);
+		if (szExpected - &expected[0] != szActual - &actual[0])
+		{
+			printf("parsing \"%s\" differs\n", str.c_str());
+			break;
+		}
+		strPairs += szExpectedName;
+		strPairs += '=';
+		strPairs += szExpectedValue;
+		strPairs += '\n';
+	}
+
+	if (expected != actual)
+		printf("parsing \"%s\" leaves different bytes\n", str.c_str());
+	ATLTEST_CHECK(expected == actual);
+	return strPairs;
+}
+
+static void TestFindDelimiter()
+{
+	// every byte value on its own, including those that share the low six
+	// bits with a delimiter
+	for (int ch = 1; ch < 256; ch++)
+	{
+		char sz[2] = { (char) ch, '\0' };
+		ATLTEST_CHECK(AtlIsUrlDelimiter((char) ch) == IsDelimiter((char) ch));
+		ATLTEST_CHECK(AtlFindUrlDelimiter(sz) == FindDelimiter(sz));
+	}
+
+	// each delimiter at each position, from each offset into an aligned block
+	static const char c_rgchDelimiters[] = { '=', '&', '+', '%', '#', '\0' };
+	static const char c_rgchFiller[] = { 'a', 'Z', '0', '~', '\x80', '\xa5', '\xbd', 'c', 'e', 'k' };
+	char rgchBuffer[128 + 16];
+	char *pAligned = rgchBuffer + (16 - ((size_t) rgchBuffer & 15)) % 16;
+	for (size_t nStart = 0; nStart < 32; nStart++)
+	{
+		for (size_t nPos = 0; nPos < 64; nPos++)
+		{
+			for (size_t i=0; i<sizeof(c_rgchDelimiters); i++)
+			{
+				char *sz = pAligned + nStart;
+				for (size_t j=0; j<nPos; j++)
+					sz[j] = c_rgchFiller[(nStart + j) % sizeof(c_rgchFiller)];
+				sz[nPos] = c_rgchDelimiters[i];
+				sz[nPos + 1] = '=';
+				sz[nPos + 2] = '\0';
+				if (AtlFindUrlDelimiter(sz) != sz + nPos)
+					printf("delimiter %d at %u from offset %u not found\n",
+						c_rgchDelimiters[i], (unsigned) nPos, (unsigned) nStart);
+				ATLTEST_CHECK(AtlFindUrlDelimiter(sz) == sz + nPos);
+			}
+		}
+	}
+}
+
+// The vector scan reads whole aligned blocks; a string that ends right
+// before an inaccessible page must not fault
+static void TestPageEnd()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	size_t cbPage = info.dwPageSize;
+	char *pPages = (char *) VirtualAlloc(NULL, 2 * cbPage, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	DWORD dwOld;
+	if (!pPages || !VirtualProtect(pPages + cbPage, cbPage, PAGE_NOACCESS, &dwOld))
+	{
+		printf("cannot set up a guard page\n");
+		return;
+	}
+#else
+	size_t cbPage = (size_t) sysconf(_SC_PAGESIZE);
+	char *pPages = (char *) mmap(NULL, 2 * cbPage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pPages == (char *) MAP_FAILED || mprotect(pPages + cbPage, cbPage, PROT_NONE) != 0)
+	{
+		printf("cannot set up a guard page\n");
+		return;
+	}
+#endif
+
+	char *pEnd = pPages + cbPage;
+	for (size_t cch = 0; cch < 100; cch++)
+	{
+		char *sz = pEnd - cch - 1;
+		memset(sz, 'v', cch);
+		sz[cch] = '\0';
+		ATLTEST_CHECK(AtlFindUrlDelimiter(sz) == sz + cch);
+
+		std::string str(sz);
+		LPSTR szName;
+		LPCSTR szValue;
+		ATLTEST_CHECK(AtlParseUrlParam(sz, &szName, &szValue) == sz + cch);
+		ATLTEST_CHECK(str == szName && *szValue == '\0');
+	}
+
+#ifdef _WIN32
+	VirtualFree(pPages, 0, MEM_RELEASE);
+#else
+	munmap(pPages, 2 * cbPage);
+#endif
+}
+
+static void TestParse()
+{
+	ATLTEST_CHECK(CheckParse("a=1&b=2") == "a=1\nb=2\n");
+	ATLTEST_CHECK(CheckParse("name=John+Smith&city=New%20York") == "name=John Smith\ncity=New York\n");
+	ATLTEST_CHECK(CheckParse("flag&x=%41%4a%6b") == "flag=\nx=AJk\n");
+	// the nul that ends a value lands on the # unless an escape has moved
+	// the value back, in which case the fragment becomes a name
+	ATLTEST_CHECK(CheckParse("a=b#frag") == "a=b\n");
+	ATLTEST_CHECK(CheckParse("a=%41b#frag") == "a=Ab\n#frag=\n");
+	ATLTEST_CHECK(CheckParse("q=%e4%f6%fc") == "q=\xe4\xf6\xfc\n");
+
+	// escapes that are cut short or not hex
+	CheckParse("a=%4");
+	CheckParse("a=%");
+	CheckParse("%zz=1&b=2");
+	CheckParse("a=%g1&b=2");
+	CheckParse("a%=1");
+	CheckParse("==&&==");
+	CheckParse("&");
+	CheckParse("=");
+	CheckParse("#");
+
+	// plain runs shorter and longer than the copied prefix and the vector
+	// blocks, with escapes in and around them
+	for (size_t cch = 0; cch < 80; cch++)
+	{
+		std::string strPlain(cch, 'p');
+		CheckParse("n" + strPlain + "=" + strPlain);
+		CheckParse(strPlain + "=%41" + strPlain + "+" + strPlain + "&x=" + strPlain);
+		CheckParse("k=" + strPlain + "%4");
+		CheckParse(strPlain + "%2" + strPlain);
+	}
+	std::string strLong(6000, 'v');
+	ATLTEST_CHECK(CheckParse("big=" + strLong + "&next=1") == "big=" + strLong + "\nnext=1\n");
+
+	// random data weighted toward the characters the scanner stops at
+	static const char c_szChars[] = "=&+%#0123456789abcdefABCDEFxyz\x80\xff";
+	for (int i=0; i<20000; i++)
+	{
+		std::string str;
+		size_t cch = Random() % ((i % 50) ? 60 : 400);
+		while (str.size() < cch)
+		{
+			if (Random() % 8 == 0)
+				str.append(Random() % 40, 'r');
+			else
+				str += c_szChars[Random() % (sizeof(c_szChars) - 1)];
+		}
+		CheckParse(str);
+	}
+}
+
+static void RunAll()
+{
+	g_nSeed = 1;
+	TestFindDelimiter();
+	TestPageEnd();
+	TestParse();
+}
+
+int main()
+{
+#ifdef _ATL_SIMD_CODECS
+	int nDetected = AtlGetSimdLevel();
+	int rgLevels[2] = { nDetected, ATL_SIMD_NONE };
+	for (int i=0; i<(nDetected == ATL_SIMD_NONE ? 1 : 2); i++)
+	{
+		AtlSetSimdLevel(rgLevels[i]);
+		int nFailures = g_nAtlTestFailures;
+		RunAll();
+		printf("level %d: %s\n", rgLevels[i], (g_nAtlTestFailures == nFailures) ? "passed" : "failed");
+	}
+	AtlSetSimdLevel(nDetected);
+#else
+	RunAll();
+#endif
+	return AtlTestResult("test_url_params");
+}
@@ -0,0 +1,292 @@
+// Tests for the UTF-8 XML tokenizer in atlxmltok.h.
+//
+// Each document is tokenized into a compact trace of its tokens, which is
+// compared with the expected one:
+//
+//   <{uri}local qname [ns prefix=uri] [@{uri}local qname=value]   start tag
+//   >qname                                                         end tag
+//   "text"                                                         text
+//   $                                                              end of document
+
+#include "atltest.h"
+#include <atlxmltok.h>
+
+#include <string>
+
+using namespace ATL;
+
+static std::string Str(const char *sz, int cch)
+{
+	return std::string(sz, cch);
+}
+
+// Returns the trace of the document, or "error: <message>" if it is
+// rejected.
+static std::string Tokenize(CAtlXmlTokenizer& tokenizer, const std::string& strDoc)
+{
+	std::vector<char> doc(strDoc.begin(), strDoc.end());
+	doc.push_back('!');		// overwritten with the terminator
+	HRESULT hr = tokenizer.Initialize(&doc[0], strDoc.size());
+
+	std::string strTrace;
+	int nToken = 0;
+	while (SUCCEEDED(hr) && nToken != ATL_XML_END_DOCUMENT)
+	{
+		hr = tokenizer.Next(&nToken);
+		if (FAILED(hr))
+			break;
+
+		if (nToken == ATL_XML_START_ELEMENT)
+		{
+			const CAtlXmlElement& element = tokenizer.GetElement();
+			strTrace += "<{" + Str(element.szUri, element.cchUri) + "}" +
+				Str(element.szLocalName, element.cchLocalName) + " " + Str(element.szQName, element.cchQName);
+			for (size_t i = element.nNamespaces; i < tokenizer.GetNamespaceCount(); i++)
+			{
+				const CAtlXmlNamespace& ns = tokenizer.GetNamespace(i);
+				strTrace += " ns " + Str(ns.szPrefix, ns.cchPrefix) + "=" + Str(ns.szUri, ns.cchUri);
+			}
+			for (size_t i = 0; i < tokenizer.GetAttributeCount(); i++)
+			{
+				const CAtlXmlAttribute& attr = tokenizer.GetAttribute(i);
+				strTrace += " @{" + Str(attr.szUri, attr.cchUri) + "}" + Str(attr.szLocalName, attr.cchLocalName) +
+					" " + Str(attr.szQName, attr.cchQName) + "=" + Str(attr.szValue, attr.cchValue);
+			}
+			strTrace += "\n";
+		}
+		else if (nToken == ATL_XML_END_ELEMENT)
+		{
+			const CAtlXmlElement& element = tokenizer.GetElement();
+			strTrace += ">" + Str(element.szQName, element.cchQName) + "\n";
+		}
+		else if (nToken == ATL_XML_CHARACTERS)
+		{
+			const char *szText;
+			int cchText;
+			tokenizer.GetText(&szText, &cchText);
+			strTrace += "\"" + Str(szText, cchText) + "\"\n";
+		}
+		else if (nToken == ATL_XML_END_DOCUMENT)
+		{
+			strTrace += "$\n";
+		}
+	}
+
+	if (FAILED(hr))
+	{
+		ATLTEST_CHECK(tokenizer.GetErrorMessage() != NULL);
+		return std::string("error: ") + (tokenizer.GetErrorMessage() ? tokenizer.GetErrorMessage() : "");
+	}
+
+	// reading past the end keeps returning the end
+	ATLTEST_CHECK(SUCCEEDED(tokenizer.Next(&nToken)) && nToken == ATL_XML_END_DOCUMENT);
+	return strTrace;
+}
+
+static void Check(CAtlXmlTokenizer& tokenizer, const char *szDoc, const char *szExpected)
+{
+	std::string strTrace = Tokenize(tokenizer, szDoc);
+	if (strTrace != szExpected)
+		printf("document:\n%s\ngives:\n%s\nexpected:\n%s\n", szDoc, strTrace.c_str(), szExpected);
+	ATLTEST_CHECK(strTrace == szExpected);
+}
+
+static void CheckError(CAtlXmlTokenizer& tokenizer, const char *szDoc, const char *szMessage)
+{
+	Check(tokenizer, szDoc, (std::string("error: ") + szMessage).c_str());
+}
+
+static void TestStructure(CAtlXmlTokenizer& tokenizer)
+{
+	Check(tokenizer, "<a/>",
+		"<{}a a\n>a\n$\n");
+	Check(tokenizer, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n<a>x<b></b >y</a>\r\n",
+		"<{}a a\n\"x\"\n<{}b b\n>b\n\"y\"\n>a\n$\n");
+	Check(tokenizer, "\xEF\xBB\xBF<a>1</a>",
+		"<{}a a\n\"1\"\n>a\n$\n");
+
+	// comments, processing instructions and empty CDATA sections give no tokens
+	Check(tokenizer, "<!-- c --><?pi x?><a><!-- <b> --><![CDATA[]]><?pi?></a><!-- c -->",
+		"<{}a a\n>a\n$\n");
+	Check(tokenizer, "<a><![CDATA[<b>&amp;</b>]]></a>",
+		"<{}a a\n\"<b>&amp;</b>\"\n>a\n$\n");
+
+	// white space inside elements is text
+	Check(tokenizer, "<a> <b/>\n</a>",
+		"<{}a a\n\" \"\n<{}b b\n>b\n\"\n\"\n>a\n$\n");
+}
+
+static void TestReferences(CAtlXmlTokenizer& tokenizer)
+{
+	Check(tokenizer, "<a>&lt;&gt;&amp;&quot;&apos;</a>",
+		"<{}a a\n\"<>&\"'\"\n>a\n$\n");
+	Check(tokenizer, "<a>&#65;&#x42;&#xe9;&#x20AC;&#x1F600;</a>",
+		"<{}a a\n\"AB\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80\"\n>a\n$\n");
+	Check(tokenizer, "<a>1\r\n2\r3\n4</a>",
+		"<{}a a\n\"1\n2\n3\n4\"\n>a\n$\n");
+
+	// attribute values have their white space normalized
+	Check(tokenizer, "<a x='1&amp;2' y=\"a\tb\r\nc&#10;d\"/>",
+		"<{}a a @{}x x=1&2 @{}y y=a b c\nd\n>a\n$\n");
+
+	CheckError(tokenizer, "<a>&bogus;</a>", "bad reference in text");
+	CheckError(tokenizer, "<a>&amp</a>", "bad reference in text");
+	CheckError(tokenizer, "<a>&#0;</a>", "bad reference in text");
+	CheckError(tokenizer, "<a>&#xD800;</a>", "bad reference in text");
+	CheckError(tokenizer, "<a>&#x110000;</a>", "bad reference in text");
+	CheckError(tokenizer, "<a>&#x;</a>", "bad reference in text");
+	CheckError(tokenizer, "<a x='&#12a;'/>", "bad reference in attribute value");
+}
+
+static void TestNamespaces(CAtlXmlTokenizer& tokenizer)
+{
+	Check(tokenizer,
+		"<soap:Envelope xmlns:soap=\"http://schemas.xmlsoap.org/soap/envelope/\" xmlns=\"urn:d\">"
+		"<soap:Body><m xmlns='urn:m' soap:mustUnderstand='1' xml:lang='en' a='b'/><n/></soap:Body></soap:Envelope>",
+		"<{http://schemas.xmlsoap.org/soap/envelope/}Envelope soap:Envelope"
+			" ns soap=http://schemas.xmlsoap.org/soap/envelope/ ns =urn:d\n"
+		"<{http://schemas.xmlsoap.org/soap/envelope/}Body soap:Body\n"
+		"<{urn:m}m m ns =urn:m @{http://schemas.xmlsoap.org/soap/envelope/}mustUnderstand soap:mustUnderstand=1"
+			" @{http://www.w3.org/XML/1998/namespace}lang xml:lang=en @{}a a=b\n"
+		">m\n"
+		"<{urn:d}n n\n"
+		">n\n"
+		">soap:Body\n"
+		">soap:Envelope\n"
+		"$\n");
+
+	// a prefix can be declared after it is used in the same tag, and
+	// goes out of scope with the element
+	Check(tokenizer, "<r><p:a p:x='1' xmlns:p='urn:p'/><a/></r>",
+		"<{}r r\n<{urn:p}a p:a ns p=urn:p @{urn:p}x p:x=1\n>p:a\n<{}a a\n>a\n>r\n$\n");
+	CheckError(tokenizer, "<r><a xmlns:p='urn:p'/><p:b/></r>", "undeclared namespace prefix");
+	CheckError(tokenizer, "<a p:x='1'/>", "undeclared namespace prefix");
+	CheckError(tokenizer, "<a xmlns:p=''/>", "empty namespace declaration");
+
+	// the default namespace can be undeclared
+	Check(tokenizer, "<a xmlns='urn:a'><b xmlns=''/></a>",
+		"<{urn:a}a a ns =urn:a\n<{}b b ns =\n>b\n>a\n$\n");
+}
+
+static void TestErrors(CAtlXmlTokenizer& tokenizer)
+{
+	CheckError(tokenizer, "", "incomplete document");
+	CheckError(tokenizer, "  ", "incomplete document");
+	CheckError(tokenizer, "<a>", "incomplete document");
+	CheckError(tokenizer, "<a></b>", "mismatched end tag");
+	CheckError(tokenizer, "<a></ab>", "mismatched end tag");
+	CheckError(tokenizer, "<a></a", "unterminated end tag");
+	CheckError(tokenizer, "</a>", "unexpected end tag");
+	CheckError(tokenizer, "<a/><b/>", "more than one document element");
+	CheckError(tokenizer, "x<a/>", "text outside the document element");
+	CheckError(tokenizer, "<a/>x", "text outside the document element");
+	CheckError(tokenizer, "<![CDATA[x]]><a/>", "CDATA section outside the document element");
+	CheckError(tokenizer, "<a><![CDATA[x</a>", "unterminated CDATA section");
+	CheckError(tokenizer, "<a><!-- x</a>", "unterminated comment");
+	CheckError(tokenizer, "<a><?pi </a>", "unterminated processing instruction");
+	CheckError(tokenizer, "<!DOCTYPE a><a/>", "DTDs are not supported");
+	CheckError(tokenizer, "<1a/>", "bad element name");
+	CheckError(tokenizer, "<a", "unterminated start tag");
+	CheckError(tokenizer, "<a x='1'y='2'/>", "bad attribute name");
+	CheckError(tokenizer, "<a x/>", "missing attribute value");
+	CheckError(tokenizer, "<a x=1/>", "missing attribute value");
+	CheckError(tokenizer, "<a x='1/>", "unterminated attribute value");
+	CheckError(tokenizer, "<a x='<'/>", "unterminated attribute value");
+	CheckError(tokenizer, "<a x='1' x='2'/>", "duplicate attribute");
+	CheckError(tokenizer, "<?xml version='1.0' encoding='ISO-8859-1'?><a/>", "unsupported encoding");
+	CheckError(tokenizer, "<?xml version='1.0'", "unterminated XML declaration");
+	Check(tokenizer, "<?xml version='1.0' encoding='us-ascii'?><a/>", "<{}a a\n>a\n$\n");
+
+	// an error sticks until the next document
+	std::vector<char> doc(10, 0);
+	memcpy(&doc[0], "<a></b>", 7);
+	ATLTEST_CHECK(SUCCEEDED(tokenizer.Initialize(&doc[0], 7)));
+	int nToken;
+	ATLTEST_CHECK(SUCCEEDED(tokenizer.Next(&nToken)) && nToken == ATL_XML_START_ELEMENT);
+	ATLTEST_CHECK(FAILED(tokenizer.Next(&nToken)) && nToken == 0);
+	ATLTEST_CHECK(FAILED(tokenizer.Next(&nToken)) && nToken == 0);
+}
+
+static void TestDepth(CAtlXmlTokenizer& tokenizer)
+{
+	// deeper than the stacks start out, with a declaration at every level
+	std::string strDoc;
+	std::string strExpected;
+	const int c_nDepth = 100;
+	for (int i = 0; i < c_nDepth; i++)
+	{
+		std::string strPrefix = "p" + std::to_string(i);
+		strDoc += "<" + strPrefix + ":e xmlns:" + strPrefix + "='urn:" + std::to_string(i) + "'>";
+	}
+	for (int i = c_nDepth; i-- > 0; )
+		strDoc += "</p" + std::to_string(i) + ":e>";
+
+	std::vector<char> doc(strDoc.begin(), strDoc.end());
+	doc.push_back(0);
+	ATLTEST_CHECK(SUCCEEDED(tokenizer.Initialize(&doc[0], strDoc.size())));
+	int nToken;
+	size_t nMaxDepth = 0;
+	int nEnds = 0;
+	while (SUCCEEDED(tokenizer.Next(&nToken)) && nToken != ATL_XML_END_DOCUMENT)
+	{
+		const CAtlXmlElement& element = tokenizer.GetElement();
+		size_t nLevel = tokenizer.GetDepth() - 1;
+		ATLTEST_CHECK(element.nNamespaces == nLevel && tokenizer.GetNamespaceCount() == nLevel + 1);
+		ATLTEST_CHECK(Str(element.szUri, element.cchUri) == "urn:" + std::to_string(nLevel));
+		if (tokenizer.GetDepth() > nMaxDepth)
+			nMaxDepth = tokenizer.GetDepth();
+		if (nToken == ATL_XML_END_ELEMENT)
+			nEnds++;
+	}
+	ATLTEST_CHECK(nToken == ATL_XML_END_DOCUMENT);
+	ATLTEST_CHECK(nMaxDepth == c_nDepth && nEnds == c_nDepth);
+	ATLTEST_CHECK(tokenizer.GetDepth() == 0);
+}
+
+static void TestMutations(CAtlXmlTokenizer& tokenizer)
+{
+	// damaged documents must be rejected or tokenized without reading
+	// outside the buffer; the checks are in the tokenizer's asserts
+	static const char c_szDoc[] =
+		"<?xml version=\"1.0\"?><s:Envelope xmlns:s=\"urn:s\"><s:Body><m:Op xmlns:m=\"urn:m\" a=\"1&amp;\">"
+		"<x>&lt;1&#x41;</x><![CDATA[c]]><!-- c --><y/></m:Op></s:Body></s:Envelope>";
+	static const char c_rgchBytes[] = "<>/&;:='\"![]?-x \r";
+
+	unsigned nSeed = 17;
+	for (int nRun = 0; nRun < 20000; nRun++)
+	{
+		std::string strDoc = c_szDoc;
+		int nEdits = 1 + nRun % 4;
+		for (int i = 0; i < nEdits && !strDoc.empty(); i++)
+		{
+			nSeed = nSeed * 1664525 + 1013904223;
+			size_t nPos = (nSeed >> 8) % strDoc.size();
+			switch (nSeed % 3)
+			{
+			case 0:
+				strDoc.erase(nPos, 1 + (nSeed >> 20) % 8);
+				break;
+			case 1:
+				strDoc[nPos] = c_rgchBytes[(nSeed >> 16) % (sizeof(c_rgchBytes)-1)];
+				break;
+			default:
+				strDoc.resize(nPos);
+				break;
+			}
+		}
+		Tokenize(tokenizer, strDoc);
+	}
+}
+
+int main()
+{
+	// one tokenizer for everything, as a reader reuses it
+	CAtlXmlTokenizer tokenizer;
+	TestStructure(tokenizer);
+	TestReferences(tokenizer);
+	TestNamespaces(tokenizer);
+	TestErrors(tokenizer);
+	TestDepth(tokenizer);
+	TestMutations(tokenizer);
+	return AtlTestResult("test_xml_tokenizer");
+}